@@ -39,12 +39,17 @@ static struct timespec timestamp_origin;
 #if defined(ENABLE_LOGGING) && !defined(USE_SYSTEM_LOGGING_FACILITY)
 static libusb_log_cb log_handler;
 #endif
+static libusb_thread_cb thread_handler;
+#ifdef ENABLE_LOGGING
+static int log_ring_set_enabled(int enable);
+static void log_ring_flush(void);
+#endif
 
 struct libusb_context *usbi_default_context;
 struct libusb_context *usbi_fallback_context;
 static int default_context_refcnt;
 #if defined(ENABLE_LOGGING) && !defined(ENABLE_DEBUG_LOGGING)
-static usbi_atomic_t default_debug_level = -1;
+usbi_atomic_t usbi_default_debug_level = -1;
 #endif
 static usbi_mutex_static_t default_context_lock = USBI_MUTEX_INITIALIZER;
 static struct usbi_option default_context_options[LIBUSB_OPTION_MAX];
@@ -717,6 +722,9 @@ struct libusb_device *usbi_alloc_device(struct libusb_context *ctx,
 		return NULL;
 
 	usbi_atomic_store(&dev->refcnt, 1);
+	usbi_mutex_init(&dev->config_cache_lock);
+	usbi_mutex_init(&dev->string_cache_lock);
+	list_init(&dev->string_cache);
 
 	dev->ctx = ctx;
 	dev->session_data = session_id;
@@ -728,6 +736,12 @@ struct libusb_device *usbi_alloc_device(struct libusb_context *ctx,
 	return dev;
 }
 
+static struct list_head *session_bucket(struct libusb_context *ctx,
+	unsigned long session_id)
+{
+	return &ctx->usb_devs_by_session[usbi_hash_session_id(session_id) % USBI_SESSION_INDEX_SIZE];
+}
+
 void usbi_connect_device(struct libusb_device *dev)
 {
 	struct libusb_context *ctx = DEVICE_CTX(dev);
@@ -736,6 +750,7 @@ void usbi_connect_device(struct libusb_device *dev)
 
 	usbi_mutex_lock(&dev->ctx->usb_devs_lock);
 	list_add(&dev->list, &dev->ctx->usb_devs);
+	list_add(&dev->session_list, session_bucket(ctx, dev->session_data));
 	usbi_mutex_unlock(&dev->ctx->usb_devs_lock);
 
 	usbi_hotplug_notification(ctx, dev, LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED);
@@ -749,11 +764,29 @@ void usbi_disconnect_device(struct libusb_device *dev)
 
 	usbi_mutex_lock(&ctx->usb_devs_lock);
 	list_del(&dev->list);
+	list_del(&dev->session_list);
 	usbi_mutex_unlock(&ctx->usb_devs_lock);
 
+	usbi_clear_string_cache(dev);
 	usbi_hotplug_notification(ctx, dev, LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT);
 }
 
+/* Change the session ID of a device, which backends may need to do when a
+ * device they already know re-enumerates. */
+void usbi_set_device_session_id(struct libusb_device *dev,
+	unsigned long session_id)
+{
+	struct libusb_context *ctx = DEVICE_CTX(dev);
+
+	usbi_mutex_lock(&ctx->usb_devs_lock);
+	dev->session_data = session_id;
+	if (dev->session_list.next) {
+		list_del(&dev->session_list);
+		list_add(&dev->session_list, session_bucket(ctx, session_id));
+	}
+	usbi_mutex_unlock(&ctx->usb_devs_lock);
+}
+
 /* Perform some final sanity checks on a newly discovered device. If this
  * function fails (negative return code), the device should not be added
  * to the discovered device list. */
@@ -788,7 +821,8 @@ struct libusb_device *usbi_get_device_by_session_id(struct libusb_context *ctx,
 	struct libusb_device *ret = NULL;
 
 	usbi_mutex_lock(&ctx->usb_devs_lock);
-	for_each_device(ctx, dev) {
+	list_for_each_entry(dev, session_bucket(ctx, session_id), session_list,
+			struct libusb_device) {
 		if (dev->session_data == session_id) {
 			ret = libusb_ref_device(dev);
 			break;
@@ -839,7 +873,7 @@ ssize_t API_EXPORTED libusb_get_device_list(libusb_context *ctx,
 		struct libusb_device *dev;
 
 		if (usbi_backend.hotplug_poll)
-			usbi_backend.hotplug_poll();
+			usbi_backend.hotplug_poll(ctx);
 
 		usbi_mutex_lock(&ctx->usb_devs_lock);
 		for_each_device(ctx, dev) {
@@ -1017,31 +1051,6 @@ int API_EXPORTED libusb_get_device_speed(libusb_device *dev)
 	return dev->speed;
 }
 
-static const struct libusb_endpoint_descriptor *find_endpoint(
-	struct libusb_config_descriptor *config, unsigned char endpoint)
-{
-	int iface_idx;
-	for (iface_idx = 0; iface_idx < config->bNumInterfaces; iface_idx++) {
-		const struct libusb_interface *iface = &config->interface[iface_idx];
-		int altsetting_idx;
-
-		for (altsetting_idx = 0; altsetting_idx < iface->num_altsetting;
-				altsetting_idx++) {
-			const struct libusb_interface_descriptor *altsetting
-				= &iface->altsetting[altsetting_idx];
-			int ep_idx;
-
-			for (ep_idx = 0; ep_idx < altsetting->bNumEndpoints; ep_idx++) {
-				const struct libusb_endpoint_descriptor *ep =
-					&altsetting->endpoint[ep_idx];
-				if (ep->bEndpointAddress == endpoint)
-					return ep;
-			}
-		}
-	}
-	return NULL;
-}
-
 /** \ingroup libusb_dev
  * Convenience function to retrieve the wMaxPacketSize value for a particular
  * endpoint in the active device configuration.
@@ -1072,7 +1081,7 @@ int API_EXPORTED libusb_get_max_packet_size(libusb_device *dev,
 		return LIBUSB_ERROR_OTHER;
 	}
 
-	ep = find_endpoint(config, endpoint);
+	ep = usbi_find_config_endpoint(config, endpoint);
 	if (!ep) {
 		r = LIBUSB_ERROR_NOT_FOUND;
 		goto out;
@@ -1191,7 +1200,7 @@ int API_EXPORTED libusb_get_max_iso_packet_size(libusb_device *dev,
 		return LIBUSB_ERROR_OTHER;
 	}
 
-	ep = find_endpoint(config, endpoint);
+	ep = usbi_find_config_endpoint(config, endpoint);
 	if (!ep) {
 		r = LIBUSB_ERROR_NOT_FOUND;
 		goto out;
@@ -1308,6 +1317,10 @@ void API_EXPORTED libusb_unref_device(libusb_device *dev)
 			usbi_disconnect_device(dev);
 		}
 
+		usbi_clear_config_cache(dev);
+		usbi_mutex_destroy(&dev->config_cache_lock);
+		usbi_clear_string_cache(dev);
+		usbi_mutex_destroy(&dev->string_cache_lock);
 		free(dev);
 	}
 }
@@ -1366,15 +1379,21 @@ int API_EXPORTED libusb_wrap_sys_device(libusb_context *ctx, intptr_t sys_dev,
 		return LIBUSB_ERROR_NO_MEM;
 
 	usbi_mutex_init(&_dev_handle->lock);
+	usbi_mutex_init(&_dev_handle->flying_transfers_lock);
+	list_init(&_dev_handle->flying_transfers);
 
 	r = usbi_backend.wrap_sys_device(ctx, _dev_handle, sys_dev);
 	if (r < 0) {
 		usbi_dbg(ctx, "wrap_sys_device 0x%" PRIxPTR " returns %d", (uintptr_t)sys_dev, r);
+		usbi_mutex_destroy(&_dev_handle->flying_transfers_lock);
 		usbi_mutex_destroy(&_dev_handle->lock);
 		free(_dev_handle);
 		return r;
 	}
 
+	/* some backends select a configuration when opening the device */
+	usbi_invalidate_active_config(_dev_handle->dev);
+
 	usbi_mutex_lock(&ctx->open_devs_lock);
 	list_add(&_dev_handle->list, &ctx->open_devs);
 	usbi_mutex_unlock(&ctx->open_devs_lock);
@@ -1420,6 +1439,8 @@ int API_EXPORTED libusb_open(libusb_device *dev,
 		return LIBUSB_ERROR_NO_MEM;
 
 	usbi_mutex_init(&_dev_handle->lock);
+	usbi_mutex_init(&_dev_handle->flying_transfers_lock);
+	list_init(&_dev_handle->flying_transfers);
 
 	_dev_handle->dev = libusb_ref_device(dev);
 
@@ -1427,11 +1448,15 @@ int API_EXPORTED libusb_open(libusb_device *dev,
 	if (r < 0) {
 		usbi_dbg(DEVICE_CTX(dev), "open %d.%d returns %d", dev->bus_number, dev->device_address, r);
 		libusb_unref_device(dev);
+		usbi_mutex_destroy(&_dev_handle->flying_transfers_lock);
 		usbi_mutex_destroy(&_dev_handle->lock);
 		free(_dev_handle);
 		return r;
 	}
 
+	/* some backends select a configuration when opening the device */
+	usbi_invalidate_active_config(_dev_handle->dev);
+
 	usbi_mutex_lock(&ctx->open_devs_lock);
 	list_add(&_dev_handle->list, &ctx->open_devs);
 	usbi_mutex_unlock(&ctx->open_devs_lock);
@@ -1499,20 +1524,14 @@ static void do_close(struct libusb_context *ctx,
 	struct usbi_transfer *tmp;
 
 	/* remove any transfers in flight that are for this device */
-	usbi_mutex_lock(&ctx->flying_transfers_lock);
+	usbi_mutex_lock(&dev_handle->flying_transfers_lock);
 
 	/* safe iteration because transfers may be being deleted */
-	for_each_transfer_safe(ctx, itransfer, tmp) {
+	for_each_transfer_safe(dev_handle, itransfer, tmp) {
 		struct libusb_transfer *transfer =
 			USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
-		uint32_t state_flags;
+		uint32_t state_flags = usbi_transfer_state(itransfer);
 
-		if (transfer->dev_handle != dev_handle)
-			continue;
-
-		usbi_mutex_lock(&itransfer->lock);
-		state_flags = itransfer->state_flags;
-		usbi_mutex_unlock(&itransfer->lock);
 		if (!(state_flags & USBI_TRANSFER_DEVICE_DISAPPEARED)) {
 			usbi_err(ctx, "Device handle closed while transfer was still being processed, but the device is still connected as far as we know");
 
@@ -1526,7 +1545,7 @@ static void do_close(struct libusb_context *ctx,
 		 * we don't accidentally use the device handle in the future
 		 * (or that such accesses will be easily caught and identified as a crash)
 		 */
-		list_del(&itransfer->list);
+		usbi_remove_from_flying_list_locked(itransfer);
 		transfer->dev_handle = NULL;
 
 		/* it is up to the user to free up the actual transfer struct.  this is
@@ -1536,7 +1555,7 @@ static void do_close(struct libusb_context *ctx,
 		usbi_dbg(ctx, "Removed transfer %p from the in-flight list because device handle %p closed",
 			 (void *) transfer, (void *) dev_handle);
 	}
-	usbi_mutex_unlock(&ctx->flying_transfers_lock);
+	usbi_mutex_unlock(&dev_handle->flying_transfers_lock);
 
 	usbi_mutex_lock(&ctx->open_devs_lock);
 	list_del(&dev_handle->list);
@@ -1544,6 +1563,7 @@ static void do_close(struct libusb_context *ctx,
 
 	usbi_backend.close(dev_handle);
 	libusb_unref_device(dev_handle->dev);
+	usbi_mutex_destroy(&dev_handle->flying_transfers_lock);
 	usbi_mutex_destroy(&dev_handle->lock);
 	free(dev_handle);
 }
@@ -1736,10 +1756,14 @@ int API_EXPORTED libusb_get_configuration(libusb_device_handle *dev_handle,
 int API_EXPORTED libusb_set_configuration(libusb_device_handle *dev_handle,
 	int configuration)
 {
+	int r;
+
 	usbi_dbg(HANDLE_CTX(dev_handle), "configuration %d", configuration);
 	if (configuration < -1 || configuration > (int)UINT8_MAX)
 		return LIBUSB_ERROR_INVALID_PARAM;
-	return usbi_backend.set_configuration(dev_handle, configuration);
+	r = usbi_backend.set_configuration(dev_handle, configuration);
+	usbi_invalidate_active_config(dev_handle->dev);
+	return r;
 }
 
 /** \ingroup libusb_dev
@@ -1931,14 +1955,19 @@ int API_EXPORTED libusb_clear_halt(libusb_device_handle *dev_handle,
  */
 int API_EXPORTED libusb_reset_device(libusb_device_handle *dev_handle)
 {
+	int r;
+
 	usbi_dbg(HANDLE_CTX(dev_handle), " ");
 	if (!usbi_atomic_load(&dev_handle->dev->attached))
 		return LIBUSB_ERROR_NO_DEVICE;
 
-	if (usbi_backend.reset_device)
-		return usbi_backend.reset_device(dev_handle);
-	else
+	if (!usbi_backend.reset_device)
 		return LIBUSB_ERROR_NOT_SUPPORTED;
+
+	r = usbi_backend.reset_device(dev_handle);
+	usbi_invalidate_active_config(dev_handle->dev);
+	usbi_clear_string_cache(dev_handle->dev);
+	return r;
 }
 
 /** \ingroup libusb_asyncio
@@ -2064,6 +2093,282 @@ int API_EXPORTED libusb_dev_mem_free(libusb_device_handle *dev_handle,
 		return LIBUSB_ERROR_NOT_SUPPORTED;
 }
 
+/* buffers handed out by a pool are aligned to (and padded to a multiple of)
+ * this many bytes, which keeps them on separate cache lines */
+#define DEV_MEM_POOL_ALIGN	64
+
+enum dev_mem_pool_source {
+	DEV_MEM_POOL_DEVICE,	/* libusb_dev_mem_alloc() */
+	DEV_MEM_POOL_BACKEND,	/* the backend's host_mem_alloc() */
+	DEV_MEM_POOL_MALLOC,
+};
+
+struct dev_mem_pool_region {
+	struct list_head list;
+	unsigned char *base;
+	size_t length;
+	enum dev_mem_pool_source source;
+
+	/* the malloc() allocation backing the region, base is aligned within
+	 * it */
+	void *host_mem;
+};
+
+struct libusb_dev_mem_pool {
+	struct libusb_device_handle *dev_handle;
+	size_t buffer_size;
+	unsigned int buffers_per_region;
+	uint32_t flags;
+
+	/* protects the fields below */
+	usbi_mutex_t lock;
+	struct list_head regions;
+
+	/* singly linked list of free buffers, the link is stored in the first
+	 * bytes of each free buffer */
+	void *free_list;
+};
+
+/* must be called with the pool lock held */
+static int dev_mem_pool_grow(struct libusb_dev_mem_pool *pool)
+{
+	struct dev_mem_pool_region *region;
+	unsigned char *buffer;
+	unsigned int i;
+
+	region = malloc(sizeof(*region));
+	if (!region)
+		return LIBUSB_ERROR_NO_MEM;
+
+	region->length = pool->buffer_size * pool->buffers_per_region;
+	region->host_mem = NULL;
+	region->base = NULL;
+	region->source = DEV_MEM_POOL_DEVICE;
+	if (!(pool->flags & LIBUSB_DEV_MEM_POOL_HOST_MEMORY))
+		region->base = libusb_dev_mem_alloc(pool->dev_handle, region->length);
+
+	if (!region->base && usbi_backend.host_mem_alloc &&
+	    (pool->flags & (LIBUSB_DEV_MEM_POOL_NUMA_LOCAL | LIBUSB_DEV_MEM_POOL_HUGE_PAGES))) {
+		region->source = DEV_MEM_POOL_BACKEND;
+		region->base = usbi_backend.host_mem_alloc(pool->dev_handle,
+			region->length, pool->flags);
+	}
+
+	if (!region->base) {
+		/* no zero-copy memory on this platform, or the device memory
+		 * limit has been reached, so fall back to aligned host memory */
+		region->source = DEV_MEM_POOL_MALLOC;
+		region->host_mem = malloc(region->length + DEV_MEM_POOL_ALIGN - 1);
+		if (!region->host_mem) {
+			free(region);
+			return LIBUSB_ERROR_NO_MEM;
+		}
+		region->base = (unsigned char *)(((uintptr_t)region->host_mem +
+			DEV_MEM_POOL_ALIGN - 1) & ~(uintptr_t)(DEV_MEM_POOL_ALIGN - 1));
+	}
+
+	usbi_dbg(HANDLE_CTX(pool->dev_handle), "pool %p: new %s region of %lu bytes",
+		 (void *) pool,
+		 region->source == DEV_MEM_POOL_DEVICE ? "device memory" :
+		 region->source == DEV_MEM_POOL_BACKEND ? "backend host memory" :
+		 "host memory", (unsigned long)region->length);
+
+	/* thread the new buffers onto the free list in address order */
+	for (i = pool->buffers_per_region; i > 0; i--) {
+		buffer = region->base + (i - 1) * pool->buffer_size;
+		*(void **)buffer = pool->free_list;
+		pool->free_list = buffer;
+	}
+
+	list_add_tail(&region->list, &pool->regions);
+	return 0;
+}
+
+/** \ingroup libusb_asyncio
+ * Create a pool of fixed-size data buffers for a device handle.
+ *
+ * The pool carves its buffers out of regions of buffers_per_region buffers
+ * each, allocated with libusb_dev_mem_alloc() so that transfers using them
+ * avoid a copy in the kernel where the platform supports it. Where
+ * libusb_dev_mem_alloc() is not supported, or fails, the regions fall back
+ * to ordinary host memory, so the pool can be used unconditionally. A new
+ * region is allocated whenever the pool runs out of buffers.
+ *
+ * Buffers are aligned to 64 bytes and can be used directly as the buffer of
+ * a transfer, e.g. with libusb_fill_bulk_transfer(). They must not be freed
+ * with \ref libusb_transfer_flags::LIBUSB_TRANSFER_FREE_BUFFER
+ * "LIBUSB_TRANSFER_FREE_BUFFER".
+ *
+ * The pool must be destroyed with libusb_dev_mem_pool_destroy() before the
+ * device handle is closed.
+ *
+ * Since version 1.0.27, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param dev_handle a device handle
+ * \param buffer_size size of each buffer
+ * \param buffers_per_region number of buffers allocated at once when the
+ * pool needs to grow
+ * \param pool output location for the newly created pool
+ * \returns 0 on success
+ * \returns \ref LIBUSB_ERROR_INVALID_PARAM if a parameter is invalid
+ * \returns \ref LIBUSB_ERROR_NO_MEM on memory allocation failure
+ */
+int API_EXPORTED libusb_dev_mem_pool_create(libusb_device_handle *dev_handle,
+	size_t buffer_size, unsigned int buffers_per_region,
+	libusb_dev_mem_pool **pool)
+{
+	return libusb_dev_mem_pool_create_with_flags(dev_handle, buffer_size,
+		buffers_per_region, 0, pool);
+}
+
+/** \ingroup libusb_asyncio
+ * Create a pool of fixed-size data buffers for a device handle, with
+ * control over where its memory comes from.
+ *
+ * This works like libusb_dev_mem_pool_create(), with flags taken from
+ * \ref libusb_dev_mem_pool_flags. When \ref LIBUSB_DEV_MEM_POOL_NUMA_LOCAL
+ * or \ref LIBUSB_DEV_MEM_POOL_HUGE_PAGES is set, the regions that are not
+ * made of device memory are allocated by the platform so as to honour
+ * them, which is currently only done on Linux. Device memory obtained from
+ * libusb_dev_mem_alloc() is already allocated by the kernel close to the
+ * host controller.
+ *
+ * Since version 1.0.27, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param dev_handle a device handle
+ * \param buffer_size size of each buffer
+ * \param buffers_per_region number of buffers allocated at once when the
+ * pool needs to grow
+ * \param flags bitwise OR of \ref libusb_dev_mem_pool_flags
+ * \param pool output location for the newly created pool
+ * \returns 0 on success
+ * \returns \ref LIBUSB_ERROR_INVALID_PARAM if a parameter is invalid
+ * \returns \ref LIBUSB_ERROR_NO_MEM on memory allocation failure
+ */
+int API_EXPORTED libusb_dev_mem_pool_create_with_flags(
+	libusb_device_handle *dev_handle, size_t buffer_size,
+	unsigned int buffers_per_region, uint32_t flags,
+	libusb_dev_mem_pool **pool)
+{
+	struct libusb_dev_mem_pool *_pool;
+	int r;
+
+	if (!dev_handle || !buffer_size || !buffers_per_region || !pool)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	if (flags & ~(uint32_t)(LIBUSB_DEV_MEM_POOL_HOST_MEMORY |
+			LIBUSB_DEV_MEM_POOL_NUMA_LOCAL | LIBUSB_DEV_MEM_POOL_HUGE_PAGES))
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	buffer_size = (buffer_size + DEV_MEM_POOL_ALIGN - 1) &
+		~(size_t)(DEV_MEM_POOL_ALIGN - 1);
+	if (buffer_size > SIZE_MAX / buffers_per_region)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	_pool = calloc(1, sizeof(*_pool));
+	if (!_pool)
+		return LIBUSB_ERROR_NO_MEM;
+
+	_pool->dev_handle = dev_handle;
+	_pool->buffer_size = buffer_size;
+	_pool->buffers_per_region = buffers_per_region;
+	_pool->flags = flags;
+	usbi_mutex_init(&_pool->lock);
+	list_init(&_pool->regions);
+
+	/* allocate the first region up front so that the common case of a
+	 * pool sized for its user never allocates again */
+	r = dev_mem_pool_grow(_pool);
+	if (r < 0) {
+		usbi_mutex_destroy(&_pool->lock);
+		free(_pool);
+		return r;
+	}
+
+	*pool = _pool;
+	return 0;
+}
+
+/** \ingroup libusb_asyncio
+ * Take a buffer from a pool created with libusb_dev_mem_pool_create().
+ *
+ * Since version 1.0.27, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param pool the pool
+ * \returns a pointer to the buffer, or NULL on memory allocation failure
+ */
+DEFAULT_VISIBILITY
+unsigned char * LIBUSB_CALL libusb_dev_mem_pool_alloc(libusb_dev_mem_pool *pool)
+{
+	unsigned char *buffer = NULL;
+
+	usbi_mutex_lock(&pool->lock);
+	if (pool->free_list || dev_mem_pool_grow(pool) == 0) {
+		buffer = pool->free_list;
+		pool->free_list = *(void **)buffer;
+	}
+	usbi_mutex_unlock(&pool->lock);
+
+	return buffer;
+}
+
+/** \ingroup libusb_asyncio
+ * Return a buffer to the pool it was taken from.
+ *
+ * Since version 1.0.27, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param pool the pool
+ * \param buffer a buffer returned by libusb_dev_mem_pool_alloc() on this
+ * pool. If NULL, no action is taken.
+ */
+void API_EXPORTED libusb_dev_mem_pool_free(libusb_dev_mem_pool *pool,
+	unsigned char *buffer)
+{
+	if (!buffer)
+		return;
+
+	usbi_mutex_lock(&pool->lock);
+	*(void **)buffer = pool->free_list;
+	pool->free_list = buffer;
+	usbi_mutex_unlock(&pool->lock);
+}
+
+/** \ingroup libusb_asyncio
+ * Destroy a pool and release all of its memory. Any buffer still taken from
+ * the pool becomes invalid, so no transfer using one may be in flight.
+ *
+ * Since version 1.0.27, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param pool the pool to destroy. If NULL, no action is taken.
+ */
+void API_EXPORTED libusb_dev_mem_pool_destroy(libusb_dev_mem_pool *pool)
+{
+	struct dev_mem_pool_region *region, *tmp;
+
+	if (!pool)
+		return;
+
+	list_for_each_entry_safe(region, tmp, &pool->regions, list, struct dev_mem_pool_region) {
+		list_del(&region->list);
+		switch (region->source) {
+		case DEV_MEM_POOL_DEVICE:
+			libusb_dev_mem_free(pool->dev_handle, region->base, region->length);
+			break;
+		case DEV_MEM_POOL_BACKEND:
+			usbi_backend.host_mem_free(pool->dev_handle, region->base,
+				region->length, pool->flags);
+			break;
+		case DEV_MEM_POOL_MALLOC:
+			free(region->host_mem);
+			break;
+		}
+		free(region);
+	}
+
+	usbi_mutex_destroy(&pool->lock);
+	free(pool);
+}
+
 /** \ingroup libusb_dev
  * Determine if a kernel driver is active on an interface. If a kernel driver
  * is active, you cannot claim the interface, and libusb will be unable to
@@ -2265,6 +2570,24 @@ void API_EXPORTED libusb_set_log_cb(libusb_context *ctx, libusb_log_cb cb,
 	libusb_set_log_cb_internal(ctx, cb, mode);
 }
 
+void usbi_thread_started(struct libusb_context *ctx,
+	enum libusb_thread_type type, const char *name)
+{
+	libusb_thread_cb cb = NULL;
+	int r;
+
+	r = usbi_thread_set_name(name);
+	if (r)
+		usbi_dbg(ctx, "failed to name thread %s, error=%d", name, r);
+
+	if (ctx)
+		cb = ctx->thread_cb;
+	if (!cb)
+		cb = thread_handler;
+	if (cb)
+		cb(ctx, type, name);
+}
+
 /** \ingroup libusb_lib
  * Set an option in the library.
  *
@@ -2293,6 +2616,7 @@ int API_EXPORTEDV libusb_set_option(libusb_context *ctx,
 {
 	int arg = 0, r = LIBUSB_SUCCESS;
 	libusb_log_cb log_cb = NULL;
+	libusb_thread_cb thread_cb = NULL;
 	va_list ap;
 #if defined(ENABLE_LOGGING) && !defined(ENABLE_DEBUG_LOGGING)
 	int is_default_context = (NULL == ctx);
@@ -2309,6 +2633,48 @@ int API_EXPORTEDV libusb_set_option(libusb_context *ctx,
 	if (LIBUSB_OPTION_LOG_CB == option) {
 		log_cb = (libusb_log_cb) va_arg(ap, libusb_log_cb);
 	}
+	if (LIBUSB_OPTION_EVENT_LOOPS == option) {
+		arg = va_arg(ap, int);
+		if (arg < 1 || arg > USBI_MAX_EVENT_LOOPS) {
+			r = LIBUSB_ERROR_INVALID_PARAM;
+		}
+	}
+	if (LIBUSB_OPTION_IO_THREADS == option) {
+		arg = va_arg(ap, int);
+		if (arg < 1 || arg > USBI_MAX_IO_THREADS) {
+			r = LIBUSB_ERROR_INVALID_PARAM;
+		}
+	}
+	if (LIBUSB_OPTION_ENUMERATION_THREADS == option) {
+		arg = va_arg(ap, int);
+		if (arg < 1 || arg > USBI_MAX_ENUMERATION_THREADS) {
+			r = LIBUSB_ERROR_INVALID_PARAM;
+		}
+	}
+	if (LIBUSB_OPTION_HOTPLUG_BATCH_WINDOW == option) {
+		arg = va_arg(ap, int);
+		if (arg < 0 || arg > USBI_MAX_HOTPLUG_BATCH_WINDOW) {
+			r = LIBUSB_ERROR_INVALID_PARAM;
+		}
+	}
+	if (LIBUSB_OPTION_LOG_ASYNC == option || LIBUSB_OPTION_EVENT_STATS == option) {
+		arg = va_arg(ap, int);
+	}
+	if (LIBUSB_OPTION_TIMEOUT_GRANULARITY == option) {
+		arg = va_arg(ap, int);
+		if (arg < 0 || arg > USBI_MAX_TIMEOUT_GRANULARITY) {
+			r = LIBUSB_ERROR_INVALID_PARAM;
+		}
+	}
+	if (LIBUSB_OPTION_BUSY_POLL == option) {
+		arg = va_arg(ap, int);
+		if (arg < 0 || arg > USBI_MAX_BUSY_POLL) {
+			r = LIBUSB_ERROR_INVALID_PARAM;
+		}
+	}
+	if (LIBUSB_OPTION_THREAD_CB == option) {
+		thread_cb = (libusb_thread_cb) va_arg(ap, libusb_thread_cb);
+	}
 
 	do {
 		if (LIBUSB_SUCCESS != r) {
@@ -2323,10 +2689,20 @@ int API_EXPORTEDV libusb_set_option(libusb_context *ctx,
 		if (NULL == ctx) {
 			usbi_mutex_static_lock(&default_context_lock);
 			default_context_options[option].is_set = 1;
-			if (LIBUSB_OPTION_LOG_LEVEL == option) {
+			if (LIBUSB_OPTION_LOG_LEVEL == option || LIBUSB_OPTION_EVENT_LOOPS == option ||
+			    LIBUSB_OPTION_IO_THREADS == option ||
+			    LIBUSB_OPTION_ENUMERATION_THREADS == option ||
+			    LIBUSB_OPTION_HOTPLUG_BATCH_WINDOW == option ||
+			    LIBUSB_OPTION_LOG_ASYNC == option ||
+			    LIBUSB_OPTION_EVENT_STATS == option ||
+			    LIBUSB_OPTION_TIMEOUT_GRANULARITY == option ||
+			    LIBUSB_OPTION_BUSY_POLL == option) {
 				default_context_options[option].arg.ival = arg;
 			} else if (LIBUSB_OPTION_LOG_CB == option) {
 				default_context_options[option].arg.log_cbval = log_cb;
+			} else if (LIBUSB_OPTION_THREAD_CB == option) {
+				default_context_options[option].arg.thread_cbval = thread_cb;
+				thread_handler = thread_cb;
 			}
 			usbi_mutex_static_unlock(&default_context_lock);
 		}
@@ -2343,7 +2719,7 @@ int API_EXPORTEDV libusb_set_option(libusb_context *ctx,
 			if (!ctx->debug_fixed) {
 				ctx->debug = (enum libusb_log_level)arg;
 				if (is_default_context)
-					usbi_atomic_store(&default_debug_level, CLAMP(arg, LIBUSB_LOG_LEVEL_NONE, LIBUSB_LOG_LEVEL_DEBUG));
+					usbi_atomic_store(&usbi_default_debug_level, CLAMP(arg, LIBUSB_LOG_LEVEL_NONE, LIBUSB_LOG_LEVEL_DEBUG));
 			}
 #endif
 			break;
@@ -2364,6 +2740,69 @@ int API_EXPORTEDV libusb_set_option(libusb_context *ctx,
 			libusb_set_log_cb_internal(ctx, log_cb, LIBUSB_LOG_CB_CONTEXT);
 			break;
 
+		case LIBUSB_OPTION_USE_EPOLL:
+#ifdef HAVE_EVENT_SET
+			ctx->use_epoll = 1;
+#else
+			r = LIBUSB_ERROR_NOT_SUPPORTED;
+#endif
+			break;
+
+		case LIBUSB_OPTION_EVENT_LOOPS:
+#ifdef HAVE_EVENT_SET
+			ctx->use_epoll = 1;
+			ctx->requested_event_loops = arg;
+#else
+			r = LIBUSB_ERROR_NOT_SUPPORTED;
+#endif
+			break;
+
+		case LIBUSB_OPTION_IO_THREADS:
+#ifdef PLATFORM_WINDOWS
+			ctx->io_threads = arg;
+#else
+			r = LIBUSB_ERROR_NOT_SUPPORTED;
+#endif
+			break;
+
+		case LIBUSB_OPTION_ENUMERATION_THREADS:
+			if (usbi_backend.caps & USBI_CAP_PARALLEL_ENUMERATION)
+				ctx->enumeration_threads = arg;
+			else
+				r = LIBUSB_ERROR_NOT_SUPPORTED;
+			break;
+
+		case LIBUSB_OPTION_HOTPLUG_BATCH_WINDOW:
+			if (usbi_backend.caps & USBI_CAP_HOTPLUG_BATCHING)
+				usbi_atomic_store(&ctx->hotplug_batch_window, arg);
+			else
+				r = LIBUSB_ERROR_NOT_SUPPORTED;
+			break;
+
+		case LIBUSB_OPTION_LOG_ASYNC:
+#ifdef ENABLE_LOGGING
+			r = log_ring_set_enabled(arg);
+#else
+			r = LIBUSB_ERROR_NOT_SUPPORTED;
+#endif
+			break;
+
+		case LIBUSB_OPTION_EVENT_STATS:
+			usbi_atomic_store(&ctx->event_stats_enabled, arg != 0);
+			break;
+
+		case LIBUSB_OPTION_TIMEOUT_GRANULARITY:
+			usbi_atomic_store(&ctx->timeout_granularity, arg);
+			break;
+
+		case LIBUSB_OPTION_BUSY_POLL:
+			usbi_atomic_store(&ctx->busy_poll, arg);
+			break;
+
+		case LIBUSB_OPTION_THREAD_CB:
+			ctx->thread_cb = thread_cb;
+			break;
+
 		case LIBUSB_OPTION_MAX: /* unreachable */
 		default:
 			r = LIBUSB_ERROR_INVALID_PARAM;
@@ -2470,6 +2909,8 @@ int API_EXPORTED libusb_init_context(libusb_context **ctx, const struct libusb_i
 	usbi_mutex_init(&_ctx->usb_devs_lock);
 	usbi_mutex_init(&_ctx->open_devs_lock);
 	list_init(&_ctx->usb_devs);
+	for (int i = 0; i < USBI_SESSION_INDEX_SIZE; i++)
+		list_init(&_ctx->usb_devs_by_session[i]);
 	list_init(&_ctx->open_devs);
 
 	/* apply default options to all new contexts */
@@ -2477,7 +2918,18 @@ int API_EXPORTED libusb_init_context(libusb_context **ctx, const struct libusb_i
 		if (LIBUSB_OPTION_LOG_LEVEL == option || !default_context_options[option].is_set) {
 			continue;
 		}
-		if (LIBUSB_OPTION_LOG_CB != option) {
+		if (LIBUSB_OPTION_EVENT_LOOPS == option || LIBUSB_OPTION_IO_THREADS == option ||
+		    LIBUSB_OPTION_ENUMERATION_THREADS == option ||
+		    LIBUSB_OPTION_HOTPLUG_BATCH_WINDOW == option ||
+		    LIBUSB_OPTION_LOG_ASYNC == option ||
+		    LIBUSB_OPTION_EVENT_STATS == option ||
+		    LIBUSB_OPTION_TIMEOUT_GRANULARITY == option ||
+		    LIBUSB_OPTION_BUSY_POLL == option) {
+			r = libusb_set_option(_ctx, option, default_context_options[option].arg.ival);
+		} else if (LIBUSB_OPTION_THREAD_CB == option) {
+			/* the global callback already applies to the context */
+			continue;
+		} else if (LIBUSB_OPTION_LOG_CB != option) {
 			r = libusb_set_option(_ctx, option);
 		} else {
 			r = libusb_set_option(_ctx, option, default_context_options[option].arg.log_cbval);
@@ -2492,6 +2944,9 @@ int API_EXPORTED libusb_init_context(libusb_context **ctx, const struct libusb_i
 		case LIBUSB_OPTION_LOG_CB:
 			r = libusb_set_option(_ctx, options[i].option, options[i].value.log_cbval);
 			break;
+		case LIBUSB_OPTION_THREAD_CB:
+			r = libusb_set_option(_ctx, options[i].option, options[i].value.thread_cbval);
+			break;
 		default:
 			r = libusb_set_option(_ctx, options[i].option, options[i].value.ival);
 		}
@@ -2504,7 +2959,7 @@ int API_EXPORTED libusb_init_context(libusb_context **ctx, const struct libusb_i
 		usbi_default_context = _ctx;
 		default_context_refcnt = 1;
 #if defined(ENABLE_LOGGING) && !defined(ENABLE_DEBUG_LOGGING)
-		usbi_atomic_store(&default_debug_level, _ctx->debug);
+		usbi_atomic_store(&usbi_default_debug_level, _ctx->debug);
 #endif
 		usbi_dbg(usbi_default_context, "created default context");
 	}
@@ -2534,8 +2989,8 @@ int API_EXPORTED libusb_init_context(libusb_context **ctx, const struct libusb_i
 
 		if (!usbi_fallback_context) {
 #if defined(ENABLE_LOGGING) && !defined(ENABLE_DEBUG_LOGGING)
-			if (usbi_atomic_load(&default_debug_level) == -1)
-				usbi_atomic_store(&default_debug_level, _ctx->debug);
+			if (usbi_atomic_load(&usbi_default_debug_level) == -1)
+				usbi_atomic_store(&usbi_default_debug_level, _ctx->debug);
 #endif
 			usbi_fallback_context = _ctx;
 			usbi_dbg(usbi_fallback_context, "installing new context as implicit default");
@@ -2580,6 +3035,7 @@ void API_EXPORTED libusb_exit(libusb_context *ctx)
 {
 	struct libusb_context *_ctx;
 	struct libusb_device *dev;
+	int last_context;
 
 	usbi_mutex_static_lock(&default_context_lock);
 
@@ -2607,6 +3063,7 @@ void API_EXPORTED libusb_exit(libusb_context *ctx)
 
 	usbi_mutex_static_lock(&active_contexts_lock);
 	list_del(&_ctx->list);
+	last_context = list_empty(&active_contexts_list);
 	usbi_mutex_static_unlock(&active_contexts_lock);
 
 	/* Exit hotplug before backend dependency */
@@ -2639,7 +3096,18 @@ void API_EXPORTED libusb_exit(libusb_context *ctx)
 	usbi_mutex_destroy(&_ctx->open_devs_lock);
 	usbi_mutex_destroy(&_ctx->usb_devs_lock);
 
+#ifdef ENABLE_LOGGING
+	/* queued log messages may refer to the context */
+	if (last_context)
+		log_ring_set_enabled(0);
+	else
+		log_ring_flush();
+#endif
+
 	free(_ctx);
+
+	if (last_context)
+		usbi_transfer_cache_flush();
 }
 
 /** \ingroup libusb_misc
@@ -2750,90 +3218,68 @@ static void log_str(enum libusb_log_level level, const char *str)
 #endif /* USE_SYSTEM_LOGGING_FACILITY */
 }
 
-static void log_v(struct libusb_context *ctx, enum libusb_log_level level,
-	const char *function, const char *format, va_list args)
+static const char *log_prefix(enum libusb_log_level level)
 {
-	const char *prefix;
-	char buf[USBI_MAX_LOG_LEN];
-	int global_debug, header_len, text_len;
-	static int has_debug_header_been_displayed = 0;
-
-#ifdef ENABLE_DEBUG_LOGGING
-	global_debug = 1;
-	UNUSED(ctx);
-#else
-	enum libusb_log_level ctx_level;
-	long default_level_value;
-
-	if (ctx) {
-		ctx_level = ctx->debug;
-	} else {
-		default_level_value = usbi_atomic_load(&default_debug_level);
-		ctx_level = default_level_value < 0 ? get_env_debug_level() : (enum libusb_log_level)default_level_value;
-	}
-
-	if (ctx_level < level)
-		return;
-
-	global_debug = (ctx_level == LIBUSB_LOG_LEVEL_DEBUG);
-#endif
-
 	switch (level) {
 	case LIBUSB_LOG_LEVEL_NONE:	/* Impossible, but keeps compiler happy */
-		return;
+		return NULL;
 	case LIBUSB_LOG_LEVEL_ERROR:
-		prefix = "error";
-		break;
+		return "error";
 	case LIBUSB_LOG_LEVEL_WARNING:
-		prefix = "warning";
-		break;
+		return "warning";
 	case LIBUSB_LOG_LEVEL_INFO:
-		prefix = "info";
-		break;
+		return "info";
 	case LIBUSB_LOG_LEVEL_DEBUG:
-		prefix = "debug";
-		break;
+		return "debug";
 	default:
-		prefix = "unknown";
-		break;
+		return "unknown";
 	}
+}
 
-	if (global_debug) {
-		struct timespec timestamp;
+/* writes the header of a log line to buf and returns its length */
+static int log_header(char *buf, size_t size, const char *prefix,
+	const char *function, int global_debug,
+	const struct timespec *timestamp, unsigned int tid)
+{
+	static int has_debug_header_been_displayed = 0;
+	int header_len;
 
+	if (global_debug) {
 		if (!has_debug_header_been_displayed) {
 			has_debug_header_been_displayed = 1;
 			log_str(LIBUSB_LOG_LEVEL_DEBUG, "[timestamp] [threadID] facility level [function call] <message>" USBI_LOG_LINE_END);
 			log_str(LIBUSB_LOG_LEVEL_DEBUG, "--------------------------------------------------------------------------------" USBI_LOG_LINE_END);
 		}
 
-		usbi_get_monotonic_time(&timestamp);
-		TIMESPEC_SUB(&timestamp, &timestamp_origin, &timestamp);
-
-		header_len = snprintf(buf, sizeof(buf),
+		header_len = snprintf(buf, size,
 			"[%2ld.%06ld] [%08x] libusb: %s [%s] ",
-			(long)timestamp.tv_sec, (long)(timestamp.tv_nsec / 1000L), usbi_get_tid(), prefix, function);
+			(long)timestamp->tv_sec, (long)(timestamp->tv_nsec / 1000L), tid, prefix, function);
 	} else {
-		header_len = snprintf(buf, sizeof(buf),
+		header_len = snprintf(buf, size,
 			"libusb: %s [%s] ", prefix, function);
 	}
 
-	if (header_len < 0 || header_len >= (int)sizeof(buf)) {
+	if (header_len < 0 || header_len >= (int)size) {
 		/* Somehow snprintf() failed to write to the buffer,
 		 * remove the header so something useful is output. */
 		header_len = 0;
 	}
 
-	text_len = vsnprintf(buf + header_len, sizeof(buf) - (size_t)header_len,
-		format, args);
-	if (text_len < 0 || text_len + header_len >= (int)sizeof(buf)) {
+	return header_len;
+}
+
+/* terminates the log line in buf and hands it to the log handlers */
+static void log_finish(struct libusb_context *ctx, enum libusb_log_level level,
+	char *buf, int header_len, int text_len)
+{
+	if (text_len < 0 || text_len + header_len >= USBI_MAX_LOG_LEN) {
 		/* Truncated log output. On some platforms a -1 return value means
 		 * that the output was truncated. */
-		text_len = (int)sizeof(buf) - header_len;
+		text_len = USBI_MAX_LOG_LEN - header_len;
 	}
-	if (header_len + text_len + (int)sizeof(USBI_LOG_LINE_END) >= (int)sizeof(buf)) {
+	if (header_len + text_len + (int)sizeof(USBI_LOG_LINE_END) >= USBI_MAX_LOG_LEN) {
 		/* Need to truncate the text slightly to fit on the terminator. */
-		text_len -= (header_len + text_len + (int)sizeof(USBI_LOG_LINE_END)) - (int)sizeof(buf);
+		text_len -= (header_len + text_len + (int)sizeof(USBI_LOG_LINE_END)) - USBI_MAX_LOG_LEN;
 	}
 	strcpy(buf + header_len + text_len, USBI_LOG_LINE_END);
 
@@ -2843,9 +3289,270 @@ static void log_v(struct libusb_context *ctx, enum libusb_log_level level,
 #ifndef ENABLE_DEBUG_LOGGING
 	if (ctx && ctx->log_handler)
 		ctx->log_handler(ctx, level, buf);
+#else
+	UNUSED(ctx);
 #endif
 }
 
+/* Asynchronous logging (LIBUSB_OPTION_LOG_ASYNC)
+ *
+ * The logging threads claim slots of a bounded ring, write their record and
+ * publish it by advancing the sequence number of the slot. The slot sequence
+ * numbers also tell a logging thread when the ring is full, in which case the
+ * message is dropped. A single thread at a time, holding log_ring_lock, takes
+ * the records off in order and outputs them. The ring is statically allocated
+ * so that it outlives any thread which is still logging. */
+#define LOG_RING_SIZE		256	/* must be a power of two */
+
+struct log_record {
+	usbi_atomic_t seq;
+	struct libusb_context *ctx;
+	enum libusb_log_level level;
+	const char *function;
+	int global_debug;
+	struct timespec timestamp;
+	unsigned int tid;
+	char text[USBI_MAX_LOG_LEN];
+};
+
+static struct log_record log_ring[LOG_RING_SIZE];
+static usbi_atomic_t log_ring_head;
+static long log_ring_tail;
+static usbi_atomic_t log_ring_dropped;
+static long log_ring_dropped_reported;
+static usbi_atomic_t log_ring_enabled;
+static int log_ring_initialized;
+static int log_thread_running;
+static int log_thread_stop;
+static usbi_atomic_t log_thread_waiting;
+static usbi_atomic_t log_ring_drainer = -1;	/* tid of the thread in log_ring_drain() */
+static usbi_thread_t log_thread;
+static usbi_mutex_static_t log_ring_config_lock = USBI_MUTEX_INITIALIZER;
+static usbi_mutex_t log_ring_lock;
+static usbi_cond_t log_ring_cond;
+
+/* signals the log thread if it waits for records. the log thread checks for
+ * records after announcing that it waits, under the lock, so a record that
+ * was published before this call is either seen by it or signaled here. a
+ * record logged by a log handler while its thread drains the ring is output
+ * by that same drain, and taking the lock again would deadlock. */
+static void log_thread_wake(void)
+{
+	if (!usbi_atomic_load(&log_thread_waiting) ||
+	    usbi_atomic_load(&log_ring_drainer) == (long)usbi_get_tid())
+		return;
+
+	usbi_mutex_lock(&log_ring_lock);
+	usbi_cond_broadcast(&log_ring_cond);
+	usbi_mutex_unlock(&log_ring_lock);
+}
+
+static void log_ring_push(struct libusb_context *ctx, enum libusb_log_level level,
+	const char *function, int global_debug, const char *format, va_list args)
+{
+	struct log_record *record;
+	long pos, seq;
+
+	pos = usbi_atomic_load(&log_ring_head);
+	for (;;) {
+		record = &log_ring[pos & (LOG_RING_SIZE - 1)];
+		seq = usbi_atomic_load(&record->seq);
+		if (seq == pos) {
+			if (usbi_atomic_cas(&log_ring_head, pos, pos + 1))
+				break;
+		} else if (seq < pos) {
+			/* the ring is full */
+			(void)usbi_atomic_inc(&log_ring_dropped);
+			log_thread_wake();
+			return;
+		}
+		pos = usbi_atomic_load(&log_ring_head);
+	}
+
+	record->ctx = ctx;
+	record->level = level;
+	record->function = function;
+	record->global_debug = global_debug;
+	if (global_debug) {
+		usbi_get_monotonic_time(&record->timestamp);
+		TIMESPEC_SUB(&record->timestamp, &timestamp_origin, &record->timestamp);
+		record->tid = usbi_get_tid();
+	}
+	if (vsnprintf(record->text, sizeof(record->text), format, args) < 0)
+		record->text[0] = '\0';
+
+	usbi_atomic_store(&record->seq, pos + 1);
+	log_thread_wake();
+}
+
+/* whether a record is waiting to be output, called with log_ring_lock held */
+static int log_ring_pending(void)
+{
+	struct log_record *record = &log_ring[log_ring_tail & (LOG_RING_SIZE - 1)];
+
+	return usbi_atomic_load(&record->seq) == log_ring_tail + 1;
+}
+
+/* outputs the published records, called with log_ring_lock held */
+static void log_ring_drain(void)
+{
+	struct log_record *record;
+	char buf[USBI_MAX_LOG_LEN];
+	const char *prefix;
+	long dropped;
+	int header_len, text_len;
+
+	usbi_atomic_store(&log_ring_drainer, (long)usbi_get_tid());
+	while (log_ring_pending()) {
+		record = &log_ring[log_ring_tail & (LOG_RING_SIZE - 1)];
+
+		prefix = log_prefix(record->level);
+		if (prefix) {
+			header_len = log_header(buf, sizeof(buf), prefix, record->function,
+				record->global_debug, &record->timestamp, record->tid);
+			text_len = snprintf(buf + header_len, sizeof(buf) - (size_t)header_len,
+				"%s", record->text);
+			log_finish(record->ctx, record->level, buf, header_len, text_len);
+		}
+
+		/* hand the slot back to the logging threads */
+		usbi_atomic_store(&record->seq, log_ring_tail + LOG_RING_SIZE);
+		log_ring_tail++;
+	}
+
+	dropped = usbi_atomic_load(&log_ring_dropped);
+	if (dropped != log_ring_dropped_reported) {
+		snprintf(buf, sizeof(buf), "libusb: warning [%s] %ld log messages dropped" USBI_LOG_LINE_END,
+			__func__, dropped - log_ring_dropped_reported);
+		log_str(LIBUSB_LOG_LEVEL_WARNING, buf);
+		log_ring_dropped_reported = dropped;
+	}
+	usbi_atomic_store(&log_ring_drainer, -1);
+}
+
+static void *log_thread_main(void *arg)
+{
+	UNUSED(arg);
+
+	usbi_thread_started(NULL, LIBUSB_THREAD_LOG, "libusb_log");
+
+	usbi_mutex_lock(&log_ring_lock);
+	while (!log_thread_stop) {
+		log_ring_drain();
+
+		/* sleep until log_ring_push() signals a new record */
+		usbi_atomic_store(&log_thread_waiting, 1);
+		if (!log_ring_pending() && !log_thread_stop)
+			usbi_cond_wait(&log_ring_cond, &log_ring_lock);
+		usbi_atomic_store(&log_thread_waiting, 0);
+	}
+	usbi_mutex_unlock(&log_ring_lock);
+
+	return NULL;
+}
+
+static int log_ring_set_enabled(int enable)
+{
+	int r = LIBUSB_SUCCESS;
+
+	usbi_mutex_static_lock(&log_ring_config_lock);
+	if (!log_ring_initialized) {
+		for (long i = 0; i < LOG_RING_SIZE; i++)
+			usbi_atomic_store(&log_ring[i].seq, i);
+		usbi_mutex_init(&log_ring_lock);
+		usbi_cond_init(&log_ring_cond);
+		log_ring_initialized = 1;
+	}
+
+	if (enable && !log_thread_running) {
+		log_thread_stop = 0;
+		r = usbi_thread_create(&log_thread, log_thread_main, NULL);
+		if (r == LIBUSB_SUCCESS) {
+			log_thread_running = 1;
+			usbi_atomic_store(&log_ring_enabled, 1);
+		}
+	} else if (!enable && log_thread_running) {
+		usbi_atomic_store(&log_ring_enabled, 0);
+
+		usbi_mutex_lock(&log_ring_lock);
+		log_thread_stop = 1;
+		usbi_cond_broadcast(&log_ring_cond);
+		usbi_mutex_unlock(&log_ring_lock);
+		usbi_thread_join(log_thread);
+		log_thread_running = 0;
+
+		/* output whatever was queued while the thread was exiting */
+		usbi_mutex_lock(&log_ring_lock);
+		log_ring_drain();
+		usbi_mutex_unlock(&log_ring_lock);
+	}
+	usbi_mutex_static_unlock(&log_ring_config_lock);
+
+	return r;
+}
+
+/* outputs all queued log messages, so that none refers to a context which
+ * is about to be destroyed */
+static void log_ring_flush(void)
+{
+	if (!usbi_atomic_load(&log_ring_enabled))
+		return;
+
+	usbi_mutex_lock(&log_ring_lock);
+	log_ring_drain();
+	usbi_mutex_unlock(&log_ring_lock);
+}
+
+static void log_v(struct libusb_context *ctx, enum libusb_log_level level,
+	const char *function, const char *format, va_list args)
+{
+	const char *prefix;
+	char buf[USBI_MAX_LOG_LEN];
+	int global_debug, header_len, text_len;
+	struct timespec timestamp;
+
+#ifdef ENABLE_DEBUG_LOGGING
+	global_debug = 1;
+#else
+	enum libusb_log_level ctx_level;
+	long default_level_value;
+
+	if (ctx) {
+		ctx_level = ctx->debug;
+	} else {
+		default_level_value = usbi_atomic_load(&usbi_default_debug_level);
+		ctx_level = default_level_value < 0 ? get_env_debug_level() : (enum libusb_log_level)default_level_value;
+	}
+
+	if (ctx_level < level)
+		return;
+
+	global_debug = (ctx_level == LIBUSB_LOG_LEVEL_DEBUG);
+#endif
+
+	if (level == LIBUSB_LOG_LEVEL_NONE)
+		return;
+
+	if (usbi_atomic_load(&log_ring_enabled)) {
+		log_ring_push(ctx, level, function, global_debug, format, args);
+		return;
+	}
+
+	prefix = log_prefix(level);
+
+	if (global_debug) {
+		usbi_get_monotonic_time(&timestamp);
+		TIMESPEC_SUB(&timestamp, &timestamp_origin, &timestamp);
+	}
+
+	header_len = log_header(buf, sizeof(buf), prefix, function, global_debug,
+		&timestamp, global_debug ? usbi_get_tid() : 0);
+
+	text_len = vsnprintf(buf + header_len, sizeof(buf) - (size_t)header_len,
+		format, args);
+	log_finish(ctx, level, buf, header_len, text_len);
+}
+
 void usbi_log(struct libusb_context *ctx, enum libusb_log_level level,
 	const char *function, const char *format, ...)
 {
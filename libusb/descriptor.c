@@ -40,47 +40,234 @@
 	 ((uint32_t)((p)[1]) <<  8) |	\
 	 ((uint32_t)((p)[0]))))
 
-static void parse_descriptor(const void *source, const char *descriptor, void *dest)
+/* Fixed-layout decoders for each of the descriptors libusb parses. They
+ * convert the multiple-byte fields from little endian to host-endian. The
+ * caller checks that enough of the descriptor is present. */
+
+static void parse_descriptor_header(const uint8_t *sp,
+	struct usbi_descriptor_header *header)
 {
-	const uint8_t *sp = source;
-	uint8_t *dp = dest;
-	char field_type;
+	header->bLength = sp[0];
+	header->bDescriptorType = sp[1];
+}
 
-	while (*descriptor) {
-		field_type = *descriptor++;
-		switch (field_type) {
-		case 'b':	/* 8-bit byte */
-			*dp++ = *sp++;
-			break;
-		case 'w':	/* 16-bit word, convert from little endian to CPU */
-			dp += ((uintptr_t)dp & 1);	/* Align to 16-bit word boundary */
+static void parse_config_descriptor(const uint8_t *sp,
+	struct libusb_config_descriptor *config)
+{
+	config->bLength = sp[0];
+	config->bDescriptorType = sp[1];
+	config->wTotalLength = READ_LE16(sp + 2);
+	config->bNumInterfaces = sp[4];
+	config->bConfigurationValue = sp[5];
+	config->iConfiguration = sp[6];
+	config->bmAttributes = sp[7];
+	config->MaxPower = sp[8];
+}
 
-			*((uint16_t *)dp) = READ_LE16(sp);
-			sp += 2;
-			dp += 2;
-			break;
-		case 'd':	/* 32-bit word, convert from little endian to CPU */
-			dp += 4 - ((uintptr_t)dp & 3);	/* Align to 32-bit word boundary */
+static void parse_interface_descriptor(const uint8_t *sp,
+	struct libusb_interface_descriptor *ifp)
+{
+	ifp->bLength = sp[0];
+	ifp->bDescriptorType = sp[1];
+	ifp->bInterfaceNumber = sp[2];
+	ifp->bAlternateSetting = sp[3];
+	ifp->bNumEndpoints = sp[4];
+	ifp->bInterfaceClass = sp[5];
+	ifp->bInterfaceSubClass = sp[6];
+	ifp->bInterfaceProtocol = sp[7];
+	ifp->iInterface = sp[8];
+}
 
-			*((uint32_t *)dp) = READ_LE32(sp);
-			sp += 4;
-			dp += 4;
-			break;
-		case 'u':	/* 16 byte UUID */
-			memcpy(dp, sp, 16);
-			sp += 16;
-			dp += 16;
-			break;
-		}
+/* bRefresh and bSynchAddress are only present in audio endpoint
+ * descriptors */
+static void parse_endpoint_descriptor(const uint8_t *sp, int audio,
+	struct libusb_endpoint_descriptor *endpoint)
+{
+	endpoint->bLength = sp[0];
+	endpoint->bDescriptorType = sp[1];
+	endpoint->bEndpointAddress = sp[2];
+	endpoint->bmAttributes = sp[3];
+	endpoint->wMaxPacketSize = READ_LE16(sp + 4);
+	endpoint->bInterval = sp[6];
+	if (audio) {
+		endpoint->bRefresh = sp[7];
+		endpoint->bSynchAddress = sp[8];
 	}
 }
 
-static void clear_endpoint(struct libusb_endpoint_descriptor *endpoint)
+static void parse_ss_endpoint_companion_descriptor(const uint8_t *sp,
+	struct libusb_ss_endpoint_companion_descriptor *ep_comp)
+{
+	ep_comp->bLength = sp[0];
+	ep_comp->bDescriptorType = sp[1];
+	ep_comp->bMaxBurst = sp[2];
+	ep_comp->bmAttributes = sp[3];
+	ep_comp->wBytesPerInterval = READ_LE16(sp + 4);
+}
+
+static void parse_bos_descriptor(const uint8_t *sp,
+	struct libusb_bos_descriptor *bos)
+{
+	bos->bLength = sp[0];
+	bos->bDescriptorType = sp[1];
+	bos->wTotalLength = READ_LE16(sp + 2);
+	bos->bNumDeviceCaps = sp[4];
+}
+
+static void parse_usb_2_0_extension_descriptor(const uint8_t *sp,
+	struct libusb_usb_2_0_extension_descriptor *usb_2_0_extension)
+{
+	usb_2_0_extension->bLength = sp[0];
+	usb_2_0_extension->bDescriptorType = sp[1];
+	usb_2_0_extension->bDevCapabilityType = sp[2];
+	usb_2_0_extension->bmAttributes = READ_LE32(sp + 3);
+}
+
+static void parse_ss_usb_device_capability_descriptor(const uint8_t *sp,
+	struct libusb_ss_usb_device_capability_descriptor *ss_usb_device_cap)
 {
-	free((void *)endpoint->extra);
+	ss_usb_device_cap->bLength = sp[0];
+	ss_usb_device_cap->bDescriptorType = sp[1];
+	ss_usb_device_cap->bDevCapabilityType = sp[2];
+	ss_usb_device_cap->bmAttributes = sp[3];
+	ss_usb_device_cap->wSpeedSupported = READ_LE16(sp + 4);
+	ss_usb_device_cap->bFunctionalitySupport = sp[6];
+	ss_usb_device_cap->bU1DevExitLat = sp[7];
+	ss_usb_device_cap->bU2DevExitLat = READ_LE16(sp + 8);
 }
 
-static int parse_endpoint(struct libusb_context *ctx,
+static void parse_container_id_descriptor(const uint8_t *sp,
+	struct libusb_container_id_descriptor *container_id)
+{
+	container_id->bLength = sp[0];
+	container_id->bDescriptorType = sp[1];
+	container_id->bDevCapabilityType = sp[2];
+	container_id->bReserved = sp[3];
+	memcpy(container_id->ContainerID, sp + 4, 16);
+}
+
+static void parse_platform_descriptor(const uint8_t *sp,
+	struct libusb_platform_descriptor *platform_descriptor)
+{
+	platform_descriptor->bLength = sp[0];
+	platform_descriptor->bDescriptorType = sp[1];
+	platform_descriptor->bDevCapabilityType = sp[2];
+	platform_descriptor->bReserved = sp[3];
+	memcpy(platform_descriptor->PlatformCapabilityUUID, sp + 4, 16);
+}
+
+static void parse_iad_descriptor(const uint8_t *sp,
+	struct libusb_interface_association_descriptor *iad)
+{
+	iad->bLength = sp[0];
+	iad->bDescriptorType = sp[1];
+	iad->bFirstInterface = sp[2];
+	iad->bInterfaceCount = sp[3];
+	iad->bFunctionClass = sp[4];
+	iad->bFunctionSubClass = sp[5];
+	iad->bFunctionProtocol = sp[6];
+	iad->iFunction = sp[7];
+}
+
+/* A parsed configuration descriptor lives in a single allocation: the
+ * descriptor itself, followed by the interface, alternate setting and
+ * endpoint arrays, and then the extra descriptor bytes. A first pass over
+ * the raw descriptors sizes each of these regions, and the parser then
+ * carves its arrays out of them as it goes. */
+struct config_layout {
+	size_t num_interfaces;
+	size_t num_altsettings;
+	size_t num_endpoints;
+	size_t config_extra_length;
+	size_t extra_length;
+};
+
+struct arena_region {
+	uint8_t *next;
+	uint8_t *end;
+};
+
+struct config_arena {
+	struct arena_region altsettings;
+	struct arena_region endpoints;
+	struct arena_region config_extra;
+	struct arena_region extra;
+};
+
+static void *arena_take(struct arena_region *region, size_t count, size_t size)
+{
+	uint8_t *ptr = region->next;
+
+	/* the layout is an upper bound, so this should never fail */
+	if ((size_t)(region->end - ptr) < count * size)
+		return NULL;
+
+	region->next = ptr + count * size;
+	return ptr;
+}
+
+static void arena_region_init(struct arena_region *region, uint8_t **ptr,
+	size_t length)
+{
+	region->next = *ptr;
+	region->end = *ptr + length;
+	*ptr += length;
+}
+
+static int is_standard_descriptor(uint8_t descriptor_type)
+{
+	return descriptor_type == LIBUSB_DT_ENDPOINT ||
+	       descriptor_type == LIBUSB_DT_INTERFACE ||
+	       descriptor_type == LIBUSB_DT_CONFIG ||
+	       descriptor_type == LIBUSB_DT_DEVICE;
+}
+
+/* Work out the room parse_configuration() needs for the tree of buffer.
+ * The counts are upper bounds, as the parser may stop early on a
+ * malformed descriptor. Class or vendor specific descriptors belong to
+ * the standard descriptor they follow, so only those directly after the
+ * configuration descriptor end up in its extra field. */
+static void size_configuration(const uint8_t *buffer, int size,
+	struct config_layout *layout)
+{
+	const struct usbi_descriptor_header *header;
+	int config_level = 1;
+
+	memset(layout, 0, sizeof(*layout));
+
+	if (size < LIBUSB_DT_CONFIG_SIZE || buffer[0] < LIBUSB_DT_CONFIG_SIZE ||
+	    buffer[0] > size)
+		return;
+
+	layout->num_interfaces = ((const struct usbi_configuration_descriptor *)buffer)->bNumInterfaces;
+	size -= buffer[0];
+	buffer += buffer[0];
+
+	while (size >= DESC_HEADER_LENGTH) {
+		header = (const struct usbi_descriptor_header *)buffer;
+		if (header->bLength < DESC_HEADER_LENGTH || header->bLength > size)
+			break;
+
+		if (header->bDescriptorType == LIBUSB_DT_INTERFACE &&
+		    header->bLength >= LIBUSB_DT_INTERFACE_SIZE) {
+			layout->num_altsettings++;
+			layout->num_endpoints +=
+				((const struct usbi_interface_descriptor *)buffer)->bNumEndpoints;
+		}
+
+		if (is_standard_descriptor(header->bDescriptorType))
+			config_level = 0;
+		else if (config_level)
+			layout->config_extra_length += header->bLength;
+		else
+			layout->extra_length += header->bLength;
+
+		buffer += header->bLength;
+		size -= header->bLength;
+	}
+}
+
+static int parse_endpoint(struct libusb_context *ctx, struct config_arena *arena,
 	struct libusb_endpoint_descriptor *endpoint, const uint8_t *buffer, int size)
 {
 	const struct usbi_descriptor_header *header;
@@ -110,9 +297,9 @@ static int parse_endpoint(struct libusb_context *ctx,
 	}
 
 	if (header->bLength >= LIBUSB_DT_ENDPOINT_AUDIO_SIZE)
-		parse_descriptor(buffer, "bbbbwbbb", endpoint);
+		parse_endpoint_descriptor(buffer, 1, endpoint);
 	else
-		parse_descriptor(buffer, "bbbbwb", endpoint);
+		parse_endpoint_descriptor(buffer, 0, endpoint);
 
 	buffer += header->bLength;
 	size -= header->bLength;
@@ -134,10 +321,7 @@ static int parse_endpoint(struct libusb_context *ctx,
 		}
 
 		/* If we find another "proper" descriptor then we're done  */
-		if (header->bDescriptorType == LIBUSB_DT_ENDPOINT ||
-		    header->bDescriptorType == LIBUSB_DT_INTERFACE ||
-		    header->bDescriptorType == LIBUSB_DT_CONFIG ||
-		    header->bDescriptorType == LIBUSB_DT_DEVICE)
+		if (is_standard_descriptor(header->bDescriptorType))
 			break;
 
 		usbi_dbg(ctx, "skipping descriptor 0x%x", header->bDescriptorType);
@@ -152,7 +336,7 @@ static int parse_endpoint(struct libusb_context *ctx,
 	if (len <= 0)
 		return parsed;
 
-	extra = malloc((size_t)len);
+	extra = arena_take(&arena->extra, (size_t)len, 1);
 	if (!extra)
 		return LIBUSB_ERROR_NO_MEM;
 
@@ -163,32 +347,7 @@ static int parse_endpoint(struct libusb_context *ctx,
 	return parsed;
 }
 
-static void clear_interface(struct libusb_interface *usb_interface)
-{
-	int i;
-
-	if (usb_interface->altsetting) {
-		for (i = 0; i < usb_interface->num_altsetting; i++) {
-			struct libusb_interface_descriptor *ifp =
-				(struct libusb_interface_descriptor *)
-				usb_interface->altsetting + i;
-
-			free((void *)ifp->extra);
-			if (ifp->endpoint) {
-				uint8_t j;
-
-				for (j = 0; j < ifp->bNumEndpoints; j++)
-					clear_endpoint((struct libusb_endpoint_descriptor *)
-						       ifp->endpoint + j);
-			}
-			free((void *)ifp->endpoint);
-		}
-	}
-	free((void *)usb_interface->altsetting);
-	usb_interface->altsetting = NULL;
-}
-
-static int parse_interface(libusb_context *ctx,
+static int parse_interface(libusb_context *ctx, struct config_arena *arena,
 	struct libusb_interface *usb_interface, const uint8_t *buffer, int size)
 {
 	int len;
@@ -201,42 +360,44 @@ static int parse_interface(libusb_context *ctx,
 	const uint8_t *begin;
 
 	while (size >= LIBUSB_DT_INTERFACE_SIZE) {
-		struct libusb_interface_descriptor *altsetting;
+		struct libusb_interface_descriptor altsetting;
 
-		altsetting = realloc((void *)usb_interface->altsetting,
-			sizeof(*altsetting) * (size_t)(usb_interface->num_altsetting + 1));
-		if (!altsetting) {
-			r = LIBUSB_ERROR_NO_MEM;
-			goto err;
-		}
-		usb_interface->altsetting = altsetting;
-
-		ifp = altsetting + usb_interface->num_altsetting;
-		parse_descriptor(buffer, "bbbbbbbbb", ifp);
-		if (ifp->bDescriptorType != LIBUSB_DT_INTERFACE) {
+		parse_interface_descriptor(buffer, &altsetting);
+		if (altsetting.bDescriptorType != LIBUSB_DT_INTERFACE) {
 			usbi_err(ctx, "unexpected descriptor 0x%x (expected 0x%x)",
-				 ifp->bDescriptorType, LIBUSB_DT_INTERFACE);
+				 altsetting.bDescriptorType, LIBUSB_DT_INTERFACE);
 			return parsed;
-		} else if (ifp->bLength < LIBUSB_DT_INTERFACE_SIZE) {
+		} else if (altsetting.bLength < LIBUSB_DT_INTERFACE_SIZE) {
 			usbi_err(ctx, "invalid interface bLength (%u)",
-				 ifp->bLength);
-			r = LIBUSB_ERROR_IO;
-			goto err;
-		} else if (ifp->bLength > size) {
+				 altsetting.bLength);
+			return LIBUSB_ERROR_IO;
+		} else if (altsetting.bLength > size) {
 			usbi_warn(ctx, "short intf descriptor read %d/%u",
-				 size, ifp->bLength);
+				 size, altsetting.bLength);
 			return parsed;
-		} else if (ifp->bNumEndpoints > USB_MAXENDPOINTS) {
-			usbi_err(ctx, "too many endpoints (%u)", ifp->bNumEndpoints);
-			r = LIBUSB_ERROR_IO;
-			goto err;
+		} else if (altsetting.bNumEndpoints > USB_MAXENDPOINTS) {
+			usbi_err(ctx, "too many endpoints (%u)", altsetting.bNumEndpoints);
+			return LIBUSB_ERROR_IO;
 		}
 
-		usb_interface->num_altsetting++;
+		/* the alternate settings of an interface are parsed in a row,
+		 * so they are laid out next to each other */
+		ifp = arena_take(&arena->altsettings, 1, sizeof(*ifp));
+		if (!ifp)
+			return LIBUSB_ERROR_NO_MEM;
+
+		/* bNumEndpoints counts the endpoints actually parsed, so that it
+		 * stays consistent with endpoint if parsing stops early */
+		*ifp = altsetting;
+		ifp->bNumEndpoints = 0;
 		ifp->extra = NULL;
 		ifp->extra_length = 0;
 		ifp->endpoint = NULL;
 
+		if (!usb_interface->num_altsetting)
+			usb_interface->altsetting = ifp;
+		usb_interface->num_altsetting++;
+
 		if (interface_number == -1)
 			interface_number = ifp->bInterfaceNumber;
 
@@ -254,8 +415,7 @@ static int parse_interface(libusb_context *ctx,
 				usbi_err(ctx,
 					 "invalid extra intf desc len (%u)",
 					 header->bLength);
-				r = LIBUSB_ERROR_IO;
-				goto err;
+				return LIBUSB_ERROR_IO;
 			} else if (header->bLength > size) {
 				usbi_warn(ctx,
 					  "short extra intf desc read %d/%u",
@@ -264,10 +424,7 @@ static int parse_interface(libusb_context *ctx,
 			}
 
 			/* If we find another "proper" descriptor then we're done */
-			if (header->bDescriptorType == LIBUSB_DT_INTERFACE ||
-			    header->bDescriptorType == LIBUSB_DT_ENDPOINT ||
-			    header->bDescriptorType == LIBUSB_DT_CONFIG ||
-			    header->bDescriptorType == LIBUSB_DT_DEVICE)
+			if (is_standard_descriptor(header->bDescriptorType))
 				break;
 
 			buffer += header->bLength;
@@ -279,38 +436,34 @@ static int parse_interface(libusb_context *ctx,
 		/*  drivers to later parse */
 		len = (int)(buffer - begin);
 		if (len > 0) {
-			void *extra = malloc((size_t)len);
+			void *extra = arena_take(&arena->extra, (size_t)len, 1);
 
-			if (!extra) {
-				r = LIBUSB_ERROR_NO_MEM;
-				goto err;
-			}
+			if (!extra)
+				return LIBUSB_ERROR_NO_MEM;
 
 			memcpy(extra, begin, len);
 			ifp->extra = extra;
 			ifp->extra_length = len;
 		}
 
-		if (ifp->bNumEndpoints > 0) {
+		if (altsetting.bNumEndpoints > 0) {
 			struct libusb_endpoint_descriptor *endpoint;
 			uint8_t i;
 
-			endpoint = calloc(ifp->bNumEndpoints, sizeof(*endpoint));
-			if (!endpoint) {
-				r = LIBUSB_ERROR_NO_MEM;
-				goto err;
-			}
+			endpoint = arena_take(&arena->endpoints, altsetting.bNumEndpoints,
+					      sizeof(*endpoint));
+			if (!endpoint)
+				return LIBUSB_ERROR_NO_MEM;
 
 			ifp->endpoint = endpoint;
-			for (i = 0; i < ifp->bNumEndpoints; i++) {
-				r = parse_endpoint(ctx, endpoint + i, buffer, size);
+			for (i = 0; i < altsetting.bNumEndpoints; i++) {
+				r = parse_endpoint(ctx, arena, endpoint + i, buffer, size);
 				if (r < 0)
-					goto err;
-				if (r == 0) {
-					ifp->bNumEndpoints = i;
+					return r;
+				if (r == 0)
 					break;
-				}
 
+				ifp->bNumEndpoints = i + 1;
 				buffer += r;
 				parsed += r;
 				size -= r;
@@ -326,31 +479,15 @@ static int parse_interface(libusb_context *ctx,
 	}
 
 	return parsed;
-err:
-	clear_interface(usb_interface);
-	return r;
 }
 
-static void clear_configuration(struct libusb_config_descriptor *config)
-{
-	uint8_t i;
-
-	if (config->interface) {
-		for (i = 0; i < config->bNumInterfaces; i++)
-			clear_interface((struct libusb_interface *)
-					config->interface + i);
-	}
-	free((void *)config->interface);
-	free((void *)config->extra);
-}
-
-static int parse_configuration(struct libusb_context *ctx,
-	struct libusb_config_descriptor *config, const uint8_t *buffer, int size)
+static int parse_configuration(struct libusb_context *ctx, struct config_arena *arena,
+	struct libusb_config_descriptor *config, struct libusb_interface *usb_interface,
+	const uint8_t *buffer, int size)
 {
 	uint8_t i;
 	int r;
 	const struct usbi_descriptor_header *header;
-	struct libusb_interface *usb_interface;
 
 	if (size < LIBUSB_DT_CONFIG_SIZE) {
 		usbi_err(ctx, "short config descriptor read %d/%d",
@@ -358,7 +495,7 @@ static int parse_configuration(struct libusb_context *ctx,
 		return LIBUSB_ERROR_IO;
 	}
 
-	parse_descriptor(buffer, "bbwbbbbb", config);
+	parse_config_descriptor(buffer, config);
 	if (config->bDescriptorType != LIBUSB_DT_CONFIG) {
 		usbi_err(ctx, "unexpected descriptor 0x%x (expected 0x%x)",
 			 config->bDescriptorType, LIBUSB_DT_CONFIG);
@@ -375,10 +512,6 @@ static int parse_configuration(struct libusb_context *ctx,
 		return LIBUSB_ERROR_IO;
 	}
 
-	usb_interface = calloc(config->bNumInterfaces, sizeof(*usb_interface));
-	if (!usb_interface)
-		return LIBUSB_ERROR_NO_MEM;
-
 	config->interface = usb_interface;
 
 	buffer += config->bLength;
@@ -397,8 +530,7 @@ static int parse_configuration(struct libusb_context *ctx,
 				usbi_err(ctx,
 					 "invalid extra config desc len (%u)",
 					 header->bLength);
-				r = LIBUSB_ERROR_IO;
-				goto err;
+				return LIBUSB_ERROR_IO;
 			} else if (header->bLength > size) {
 				usbi_warn(ctx,
 					  "short extra config desc read %d/%u",
@@ -408,10 +540,7 @@ static int parse_configuration(struct libusb_context *ctx,
 			}
 
 			/* If we find another "proper" descriptor then we're done */
-			if (header->bDescriptorType == LIBUSB_DT_ENDPOINT ||
-			    header->bDescriptorType == LIBUSB_DT_INTERFACE ||
-			    header->bDescriptorType == LIBUSB_DT_CONFIG ||
-			    header->bDescriptorType == LIBUSB_DT_DEVICE)
+			if (is_standard_descriptor(header->bDescriptorType))
 				break;
 
 			usbi_dbg(ctx, "skipping descriptor 0x%x", header->bDescriptorType);
@@ -423,22 +552,20 @@ static int parse_configuration(struct libusb_context *ctx,
 		/*  drivers to later parse */
 		len = (int)(buffer - begin);
 		if (len > 0) {
-			uint8_t *extra = realloc((void *)config->extra,
-						 (size_t)(config->extra_length + len));
+			uint8_t *extra = arena_take(&arena->config_extra, (size_t)len, 1);
 
-			if (!extra) {
-				r = LIBUSB_ERROR_NO_MEM;
-				goto err;
-			}
+			if (!extra)
+				return LIBUSB_ERROR_NO_MEM;
 
-			memcpy(extra + config->extra_length, begin, len);
-			config->extra = extra;
+			memcpy(extra, begin, len);
+			if (!config->extra)
+				config->extra = extra;
 			config->extra_length += len;
 		}
 
-		r = parse_interface(ctx, usb_interface + i, buffer, size);
+		r = parse_interface(ctx, arena, usb_interface + i, buffer, size);
 		if (r < 0)
-			goto err;
+			return r;
 		if (r == 0) {
 			config->bNumInterfaces = i;
 			break;
@@ -449,34 +576,402 @@ static int parse_configuration(struct libusb_context *ctx,
 	}
 
 	return size;
+}
 
-err:
-	clear_configuration(config);
-	return r;
+/* Raw descriptors are kept in a store shared by all the devices, so that
+ * the many identical devices of a large installation hold a single copy of
+ * their descriptors, and of the configurations parsed from them. Blobs are
+ * looked up by content and reference counted. The store is process-wide
+ * rather than per context because parsed configurations may be freed after
+ * the context they came from. Protected by desc_store_lock. */
+#define DESC_STORE_BUCKETS	256
+
+struct parsed_config;
+
+struct desc_blob {
+	struct desc_blob *next;
+	uint32_t hash;
+	long refcnt;
+	size_t len;
+
+	/* the configuration parsed from the blob while anyone holds it, see
+	 * raw_desc_to_config() */
+	struct parsed_config *parsed;
+
+	uint8_t data[ZERO_SIZED_ARRAY];
+};
+
+static usbi_mutex_static_t desc_store_lock = USBI_MUTEX_INITIALIZER;
+static struct desc_blob *desc_store[DESC_STORE_BUCKETS];
+
+/* FNV-1a */
+static uint32_t desc_hash(const uint8_t *data, size_t len)
+{
+	uint32_t hash = 2166136261U;
+
+	while (len--)
+		hash = (hash ^ *data++) * 16777619U;
+
+	return hash;
 }
 
-static int raw_desc_to_config(struct libusb_context *ctx,
-	const uint8_t *buf, int size, struct libusb_config_descriptor **config)
+static struct desc_blob *desc_store_lookup(const void *data, size_t len,
+	uint32_t hash)
+{
+	struct desc_blob *blob;
+
+	for (blob = desc_store[hash % DESC_STORE_BUCKETS]; blob; blob = blob->next) {
+		if (blob->hash == hash && blob->len == len && !memcmp(blob->data, data, len))
+			return blob;
+	}
+
+	return NULL;
+}
+
+static struct desc_blob *desc_store_get_blob(const void *data, size_t len)
+{
+	uint32_t hash = desc_hash(data, len);
+	struct desc_blob *blob, *new_blob;
+
+	usbi_mutex_static_lock(&desc_store_lock);
+	blob = desc_store_lookup(data, len, hash);
+	if (blob)
+		blob->refcnt++;
+	usbi_mutex_static_unlock(&desc_store_lock);
+	if (blob)
+		return blob;
+
+	new_blob = malloc(sizeof(*new_blob) + len);
+	if (!new_blob)
+		return NULL;
+
+	new_blob->hash = hash;
+	new_blob->refcnt = 1;
+	new_blob->len = len;
+	new_blob->parsed = NULL;
+	memcpy(new_blob->data, data, len);
+
+	/* another device may have stored the same blob meanwhile */
+	usbi_mutex_static_lock(&desc_store_lock);
+	blob = desc_store_lookup(data, len, hash);
+	if (blob) {
+		blob->refcnt++;
+	} else {
+		blob = new_blob;
+		blob->next = desc_store[hash % DESC_STORE_BUCKETS];
+		desc_store[hash % DESC_STORE_BUCKETS] = blob;
+		new_blob = NULL;
+	}
+	usbi_mutex_static_unlock(&desc_store_lock);
+
+	free(new_blob);
+	return blob;
+}
+
+static void desc_store_put_blob(struct desc_blob *blob)
+{
+	struct desc_blob **pblob;
+
+	usbi_mutex_static_lock(&desc_store_lock);
+	if (--blob->refcnt) {
+		usbi_mutex_static_unlock(&desc_store_lock);
+		return;
+	}
+
+	for (pblob = &desc_store[blob->hash % DESC_STORE_BUCKETS]; *pblob != blob;
+			pblob = &(*pblob)->next)
+		;
+	*pblob = blob->next;
+	usbi_mutex_static_unlock(&desc_store_lock);
+
+	free(blob);
+}
+
+/* Return a shared copy of len bytes of descriptors, or NULL if out of
+ * memory. Other devices may hold the same copy, so it must not be modified.
+ * Release it with usbi_desc_store_put(). */
+void *usbi_desc_store_get(const void *data, size_t len)
+{
+	struct desc_blob *blob = desc_store_get_blob(data, len);
+
+	return blob ? blob->data : NULL;
+}
+
+/* Take another reference on a copy returned by usbi_desc_store_get() */
+void *usbi_desc_store_ref(void *data)
+{
+	struct desc_blob *blob = container_of(data, struct desc_blob, data);
+
+	usbi_mutex_static_lock(&desc_store_lock);
+	blob->refcnt++;
+	usbi_mutex_static_unlock(&desc_store_lock);
+
+	return data;
+}
+
+void usbi_desc_store_put(void *data)
+{
+	if (data)
+		desc_store_put_blob(container_of(data, struct desc_blob, data));
+}
+
+/* A parsed configuration descriptor. The device caches the configuration
+ * descriptors it has parsed, and hands them out to its callers with a
+ * reference taken, which libusb_free_config_descriptor() drops. Devices with
+ * the same raw configuration share the parsed one through its blob in the
+ * descriptor store. */
+struct parsed_config {
+	usbi_atomic_t refcnt;
+
+	/* the raw configuration, holding a reference */
+	struct desc_blob *blob;
+
+	/* first endpoint descriptor with each address, in descriptor order */
+	const struct libusb_endpoint_descriptor *endpoints[USB_MAXENDPOINTS];
+
+	struct libusb_config_descriptor config;
+};
+
+/* bits of an endpoint address which USBI_ENDPOINT_INDEX() ignores */
+#define ENDPOINT_ADDRESS_RESERVED	0x70
+
+/* Walk all of the endpoints of config, either to fill the index of the
+ * parsed descriptor or to find an endpoint it cannot index. */
+static const struct libusb_endpoint_descriptor *scan_endpoints(
+	const struct libusb_config_descriptor *config, struct parsed_config *parsed,
+	uint8_t endpoint)
+{
+	int iface_idx;
+
+	for (iface_idx = 0; iface_idx < config->bNumInterfaces; iface_idx++) {
+		const struct libusb_interface *iface = &config->interface[iface_idx];
+		int altsetting_idx;
+
+		for (altsetting_idx = 0; altsetting_idx < iface->num_altsetting;
+				altsetting_idx++) {
+			const struct libusb_interface_descriptor *altsetting
+				= &iface->altsetting[altsetting_idx];
+			int ep_idx;
+
+			for (ep_idx = 0; ep_idx < altsetting->bNumEndpoints; ep_idx++) {
+				const struct libusb_endpoint_descriptor *ep =
+					&altsetting->endpoint[ep_idx];
+
+				if (!parsed) {
+					if (ep->bEndpointAddress == endpoint)
+						return ep;
+				} else if (!(ep->bEndpointAddress & ENDPOINT_ADDRESS_RESERVED)) {
+					uint8_t slot = USBI_ENDPOINT_INDEX(ep->bEndpointAddress);
+
+					if (!parsed->endpoints[slot])
+						parsed->endpoints[slot] = ep;
+				}
+			}
+		}
+	}
+
+	return NULL;
+}
+
+/* Find the endpoint with the given address among all of the interfaces and
+ * alternate settings of a configuration descriptor returned by libusb. The
+ * first match in descriptor order is returned, or NULL. */
+const struct libusb_endpoint_descriptor *usbi_find_config_endpoint(
+	const struct libusb_config_descriptor *config, uint8_t endpoint)
+{
+	const struct parsed_config *parsed =
+		container_of(config, struct parsed_config, config);
+
+	if (endpoint & ENDPOINT_ADDRESS_RESERVED)
+		return scan_endpoints(config, NULL, endpoint);
+
+	return parsed->endpoints[USBI_ENDPOINT_INDEX(endpoint)];
+}
+
+static struct libusb_config_descriptor *config_ref(
+	struct libusb_config_descriptor *config)
+{
+	(void)usbi_atomic_inc(&container_of(config, struct parsed_config, config)->refcnt);
+	return config;
+}
+
+static void config_unref(struct libusb_config_descriptor *config)
 {
-	struct libusb_config_descriptor *_config = calloc(1, sizeof(*_config));
+	struct parsed_config *parsed = container_of(config, struct parsed_config, config);
+	int last;
+
+	/* the last reference is dropped with the store locked, so that a
+	 * lookup of the blob does not pick up a dying configuration */
+	usbi_mutex_static_lock(&desc_store_lock);
+	last = usbi_atomic_dec(&parsed->refcnt) == 0;
+	if (last)
+		parsed->blob->parsed = NULL;
+	usbi_mutex_static_unlock(&desc_store_lock);
+
+	if (last) {
+		desc_store_put_blob(parsed->blob);
+		free(parsed);
+	}
+}
+
+static int parse_config(struct libusb_context *ctx, const uint8_t *buf,
+	int size, struct parsed_config **parsed_out)
+{
+	struct parsed_config *parsed;
+	struct libusb_interface *usb_interface;
+	struct config_layout layout;
+	struct config_arena arena;
+	uint8_t *ptr;
 	int r;
 
-	if (!_config)
+	size_configuration(buf, size, &layout);
+
+	parsed = calloc(1, sizeof(*parsed) +
+		layout.num_interfaces * sizeof(struct libusb_interface) +
+		layout.num_altsettings * sizeof(struct libusb_interface_descriptor) +
+		layout.num_endpoints * sizeof(struct libusb_endpoint_descriptor) +
+		layout.config_extra_length + layout.extra_length);
+	if (!parsed)
 		return LIBUSB_ERROR_NO_MEM;
 
-	r = parse_configuration(ctx, _config, buf, size);
+	/* all of the descriptor structures have pointer alignment, so they
+	 * can follow each other, with the extra bytes at the end */
+	usb_interface = (struct libusb_interface *)(parsed + 1);
+	ptr = (uint8_t *)(usb_interface + layout.num_interfaces);
+	arena_region_init(&arena.altsettings, &ptr,
+		layout.num_altsettings * sizeof(struct libusb_interface_descriptor));
+	arena_region_init(&arena.endpoints, &ptr,
+		layout.num_endpoints * sizeof(struct libusb_endpoint_descriptor));
+	arena_region_init(&arena.config_extra, &ptr, layout.config_extra_length);
+	arena_region_init(&arena.extra, &ptr, layout.extra_length);
+
+	r = parse_configuration(ctx, &arena, &parsed->config, usb_interface, buf, size);
 	if (r < 0) {
 		usbi_err(ctx, "parse_configuration failed with error %d", r);
-		free(_config);
+		free(parsed);
 		return r;
 	} else if (r > 0) {
 		usbi_warn(ctx, "still %d bytes of descriptor data left", r);
 	}
 
-	*config = _config;
+	scan_endpoints(&parsed->config, parsed, 0);
+	usbi_atomic_store(&parsed->refcnt, 1);
+	*parsed_out = parsed;
+	return LIBUSB_SUCCESS;
+}
+
+/* Return a reference to the configuration parsed from buf, reusing the one
+ * of any other device with the same raw configuration. */
+static int raw_desc_to_config(struct libusb_context *ctx,
+	const uint8_t *buf, int size, struct libusb_config_descriptor **config)
+{
+	struct parsed_config *parsed = NULL, *new_parsed;
+	struct desc_blob *blob;
+	int r;
+
+	blob = desc_store_get_blob(buf, (size_t)size);
+	if (!blob)
+		return LIBUSB_ERROR_NO_MEM;
+
+	usbi_mutex_static_lock(&desc_store_lock);
+	if (blob->parsed) {
+		parsed = blob->parsed;
+		(void)usbi_atomic_inc(&parsed->refcnt);
+	}
+	usbi_mutex_static_unlock(&desc_store_lock);
+
+	if (parsed) {
+		/* the parsed configuration already holds the blob */
+		desc_store_put_blob(blob);
+		*config = &parsed->config;
+		return LIBUSB_SUCCESS;
+	}
+
+	r = parse_config(ctx, blob->data, size, &new_parsed);
+	if (r < 0) {
+		desc_store_put_blob(blob);
+		return r;
+	}
+	new_parsed->blob = blob;
+
+	/* another device may have parsed the same configuration meanwhile */
+	usbi_mutex_static_lock(&desc_store_lock);
+	if (blob->parsed) {
+		parsed = blob->parsed;
+		(void)usbi_atomic_inc(&parsed->refcnt);
+	} else {
+		blob->parsed = new_parsed;
+		parsed = new_parsed;
+		new_parsed = NULL;
+	}
+	usbi_mutex_static_unlock(&desc_store_lock);
+
+	if (new_parsed) {
+		desc_store_put_blob(blob);
+		free(new_parsed);
+	}
+
+	*config = &parsed->config;
 	return LIBUSB_SUCCESS;
 }
 
+/* return a new reference to the descriptor cached in slot, or NULL */
+static struct libusb_config_descriptor *config_cache_get(struct libusb_device *dev,
+	struct libusb_config_descriptor **slot)
+{
+	struct libusb_config_descriptor *config;
+
+	usbi_mutex_lock(&dev->config_cache_lock);
+	config = *slot;
+	if (config)
+		config_ref(config);
+	usbi_mutex_unlock(&dev->config_cache_lock);
+
+	return config;
+}
+
+/* cache a descriptor just parsed in slot, unless another thread got there
+ * first */
+static void config_cache_put(struct libusb_device *dev,
+	struct libusb_config_descriptor **slot, struct libusb_config_descriptor *config)
+{
+	usbi_mutex_lock(&dev->config_cache_lock);
+	if (!*slot)
+		*slot = config_ref(config);
+	usbi_mutex_unlock(&dev->config_cache_lock);
+}
+
+/* Forget the active configuration descriptor, for instance after the
+ * configuration has been changed. */
+void usbi_invalidate_active_config(struct libusb_device *dev)
+{
+	struct libusb_config_descriptor *config;
+
+	usbi_mutex_lock(&dev->config_cache_lock);
+	config = dev->active_config_cache;
+	dev->active_config_cache = NULL;
+	usbi_mutex_unlock(&dev->config_cache_lock);
+
+	if (config)
+		config_unref(config);
+}
+
+/* Drop all the cached configuration descriptors, when the device is
+ * destroyed. Descriptors still held by the application stay valid until
+ * freed. */
+void usbi_clear_config_cache(struct libusb_device *dev)
+{
+	uint8_t i;
+
+	usbi_invalidate_active_config(dev);
+	for (i = 0; i < USB_MAXCONFIG; i++) {
+		if (dev->config_cache[i]) {
+			config_unref(dev->config_cache[i]);
+			dev->config_cache[i] = NULL;
+		}
+	}
+}
+
 static int get_active_config_descriptor(struct libusb_device *dev,
 	uint8_t *buffer, size_t size)
 {
@@ -543,6 +1038,18 @@ int API_EXPORTED libusb_get_device_descriptor(libusb_device *dev,
  * This is a non-blocking function which does not involve any requests being
  * sent to the device.
  *
+ * The parsed descriptor is cached by the device, so repeated calls are
+ * cheap. The cache is discarded when the configuration is changed with
+ * libusb_set_configuration() or the device is reset with
+ * libusb_reset_device(), but not when the configuration is changed
+ * outside of libusb.
+ *
+ * Since version 1.0.27, the descriptor is shared with every other caller
+ * getting the same configuration, of this device or of another one with an
+ * identical configuration descriptor, rather than being a copy of its own.
+ * It is read-only: modifying any of its fields, the structures it points to
+ * or their extra descriptors changes what the other callers get.
+ *
  * \param dev a device
  * \param config output location for the USB configuration descriptor. Only
  * valid if 0 was returned. Must be freed with libusb_free_config_descriptor()
@@ -560,6 +1067,10 @@ int API_EXPORTED libusb_get_active_config_descriptor(libusb_device *dev,
 	uint8_t *buf;
 	int r;
 
+	*config = config_cache_get(dev, &dev->active_config_cache);
+	if (*config)
+		return LIBUSB_SUCCESS;
+
 	r = get_active_config_descriptor(dev, _config.buf, sizeof(_config.buf));
 	if (r < 0)
 		return r;
@@ -572,6 +1083,8 @@ int API_EXPORTED libusb_get_active_config_descriptor(libusb_device *dev,
 	r = get_active_config_descriptor(dev, buf, config_len);
 	if (r >= 0)
 		r = raw_desc_to_config(DEVICE_CTX(dev), buf, r, config);
+	if (r == LIBUSB_SUCCESS)
+		config_cache_put(dev, &dev->active_config_cache, *config);
 
 	free(buf);
 	return r;
@@ -582,6 +1095,10 @@ int API_EXPORTED libusb_get_active_config_descriptor(libusb_device *dev,
  * This is a non-blocking function which does not involve any requests being
  * sent to the device.
  *
+ * The parsed descriptor is cached by the device, so repeated calls are
+ * cheap. Since version 1.0.27 it is shared with the other callers and is
+ * read-only, see libusb_get_active_config_descriptor().
+ *
  * \param dev a device
  * \param config_index the index of the configuration you wish to retrieve
  * \param config output location for the USB configuration descriptor. Only
@@ -605,6 +1122,12 @@ int API_EXPORTED libusb_get_config_descriptor(libusb_device *dev,
 	if (config_index >= dev->device_descriptor.bNumConfigurations)
 		return LIBUSB_ERROR_NOT_FOUND;
 
+	if (config_index < USB_MAXCONFIG) {
+		*config = config_cache_get(dev, &dev->config_cache[config_index]);
+		if (*config)
+			return LIBUSB_SUCCESS;
+	}
+
 	r = get_config_descriptor(dev, config_index, _config.buf, sizeof(_config.buf));
 	if (r < 0)
 		return r;
@@ -617,6 +1140,8 @@ int API_EXPORTED libusb_get_config_descriptor(libusb_device *dev,
 	r = get_config_descriptor(dev, config_index, buf, config_len);
 	if (r >= 0)
 		r = raw_desc_to_config(DEVICE_CTX(dev), buf, r, config);
+	if (r == LIBUSB_SUCCESS && config_index < USB_MAXCONFIG)
+		config_cache_put(dev, &dev->config_cache[config_index], *config);
 
 	free(buf);
 	return r;
@@ -627,6 +1152,9 @@ int API_EXPORTED libusb_get_config_descriptor(libusb_device *dev,
  * This is a non-blocking function which does not involve any requests being
  * sent to the device.
  *
+ * Since version 1.0.27 the descriptor is shared with the other callers and
+ * is read-only, see libusb_get_active_config_descriptor().
+ *
  * \param dev a device
  * \param bConfigurationValue the bConfigurationValue of the configuration you
  * wish to retrieve
@@ -645,6 +1173,19 @@ int API_EXPORTED libusb_get_config_descriptor_by_value(libusb_device *dev,
 	uint8_t idx;
 	int r;
 
+	/* look among the configurations cached so far first */
+	usbi_mutex_lock(&dev->config_cache_lock);
+	for (idx = 0; idx < USB_MAXCONFIG; idx++) {
+		struct libusb_config_descriptor *cached = dev->config_cache[idx];
+
+		if (cached && cached->bConfigurationValue == bConfigurationValue) {
+			*config = config_ref(cached);
+			usbi_mutex_unlock(&dev->config_cache_lock);
+			return LIBUSB_SUCCESS;
+		}
+	}
+	usbi_mutex_unlock(&dev->config_cache_lock);
+
 	if (usbi_backend.get_config_descriptor_by_value) {
 		void *buf;
 
@@ -677,6 +1218,10 @@ int API_EXPORTED libusb_get_config_descriptor_by_value(libusb_device *dev,
  * It is safe to call this function with a NULL config parameter, in which
  * case the function simply returns.
  *
+ * The descriptor is shared, so this only releases the caller's use of it,
+ * and the caller must not use it afterwards even if other callers still
+ * hold the same descriptor.
+ *
  * \param config the configuration descriptor to free
  */
 void API_EXPORTED libusb_free_config_descriptor(
@@ -685,8 +1230,7 @@ void API_EXPORTED libusb_free_config_descriptor(
 	if (!config)
 		return;
 
-	clear_configuration(config);
-	free(config);
+	config_unref(config);
 }
 
 /** \ingroup libusb_desc
@@ -737,7 +1281,7 @@ int API_EXPORTED libusb_get_ss_endpoint_companion_descriptor(
 		*ep_comp = malloc(sizeof(**ep_comp));
 		if (!*ep_comp)
 			return LIBUSB_ERROR_NO_MEM;
-		parse_descriptor(buffer, "bbbbw", *ep_comp);
+		parse_ss_endpoint_companion_descriptor(buffer, *ep_comp);
 		return LIBUSB_SUCCESS;
 	}
 	return LIBUSB_ERROR_NOT_FOUND;
@@ -790,7 +1334,7 @@ static int parse_bos(struct libusb_context *ctx,
 	if (!_bos)
 		return LIBUSB_ERROR_NO_MEM;
 
-	parse_descriptor(buffer, "bbwb", _bos);
+	parse_bos_descriptor(buffer, _bos);
 	buffer += _bos->bLength;
 	size -= _bos->bLength;
 
@@ -940,7 +1484,7 @@ int API_EXPORTED libusb_get_usb_2_0_extension_descriptor(
 	if (!_usb_2_0_extension)
 		return LIBUSB_ERROR_NO_MEM;
 
-	parse_descriptor(dev_cap, "bbbd", _usb_2_0_extension);
+	parse_usb_2_0_extension_descriptor((const uint8_t *)dev_cap, _usb_2_0_extension);
 
 	*usb_2_0_extension = _usb_2_0_extension;
 	return LIBUSB_SUCCESS;
@@ -995,7 +1539,7 @@ int API_EXPORTED libusb_get_ss_usb_device_capability_descriptor(
 	if (!_ss_usb_device_cap)
 		return LIBUSB_ERROR_NO_MEM;
 
-	parse_descriptor(dev_cap, "bbbbwbbw", _ss_usb_device_cap);
+	parse_ss_usb_device_capability_descriptor((const uint8_t *)dev_cap, _ss_usb_device_cap);
 
 	*ss_usb_device_cap = _ss_usb_device_cap;
 	return LIBUSB_SUCCESS;
@@ -1050,7 +1594,7 @@ int API_EXPORTED libusb_get_container_id_descriptor(libusb_context *ctx,
 	if (!_container_id)
 		return LIBUSB_ERROR_NO_MEM;
 
-	parse_descriptor(dev_cap, "bbbbu", _container_id);
+	parse_container_id_descriptor((const uint8_t *)dev_cap, _container_id);
 
 	*container_id = _container_id;
 	return LIBUSB_SUCCESS;
@@ -1104,7 +1648,7 @@ int API_EXPORTED libusb_get_platform_descriptor(libusb_context *ctx,
 	if (!_platform_descriptor)
 		return LIBUSB_ERROR_NO_MEM;
 
-	parse_descriptor(dev_cap, "bbbbu", _platform_descriptor);
+	parse_platform_descriptor((const uint8_t *)dev_cap, _platform_descriptor);
 
 	/* Capability data is located after reserved byte and 128-bit UUID */
 	uint8_t* capability_data = dev_cap->dev_capability_data + 1 + 16;
@@ -1132,72 +1676,388 @@ void API_EXPORTED libusb_free_platform_descriptor(
 	free(platform_descriptor);
 }
 
+/* An ASCII string read from a device, kept in dev->string_cache */
+struct usbi_cached_string {
+	struct list_head list;
+	uint8_t desc_index;
+	int length;
+	unsigned char data[ZERO_SIZED_ARRAY];
+};
+
+/* Copy a string to a caller's buffer of length bytes, truncating it so that
+ * it stays NUL-terminated */
+static int string_copy_out(unsigned char *data, int length,
+	const unsigned char *str, int str_len)
+{
+	int n = MIN(str_len, length - 1);
+
+	if (n < 0)
+		n = 0;
+	memcpy(data, str, (size_t)n);
+	data[n] = 0;
+	return n;
+}
+
+static int string_cache_get(struct libusb_device *dev, uint8_t desc_index,
+	unsigned char *data, int length)
+{
+	struct usbi_cached_string *cached;
+	int r = LIBUSB_ERROR_NOT_FOUND;
+
+	usbi_mutex_lock(&dev->string_cache_lock);
+	for_each_helper(cached, &dev->string_cache, struct usbi_cached_string) {
+		if (cached->desc_index == desc_index) {
+			r = string_copy_out(data, length, cached->data, cached->length);
+			break;
+		}
+	}
+	usbi_mutex_unlock(&dev->string_cache_lock);
+
+	return r;
+}
+
+/* cache a string just read, unless another thread got there first */
+static void string_cache_put(struct libusb_device *dev, uint8_t desc_index,
+	const unsigned char *str, int str_len)
+{
+	struct usbi_cached_string *cached;
+
+	usbi_mutex_lock(&dev->string_cache_lock);
+	for_each_helper(cached, &dev->string_cache, struct usbi_cached_string) {
+		if (cached->desc_index == desc_index) {
+			usbi_mutex_unlock(&dev->string_cache_lock);
+			return;
+		}
+	}
+
+	cached = malloc(sizeof(*cached) + (size_t)str_len);
+	if (cached) {
+		cached->desc_index = desc_index;
+		cached->length = str_len;
+		memcpy(cached->data, str, (size_t)str_len);
+		list_add_tail(&cached->list, &dev->string_cache);
+	}
+	usbi_mutex_unlock(&dev->string_cache_lock);
+}
+
+/* Forget the strings read from a device and its language, when it may have
+ * changed: after a reset or once it is gone. */
+void usbi_clear_string_cache(struct libusb_device *dev)
+{
+	struct usbi_cached_string *cached, *next;
+
+	usbi_mutex_lock(&dev->string_cache_lock);
+	for_each_safe_helper(cached, next, &dev->string_cache, struct usbi_cached_string) {
+		list_del(&cached->list);
+		free(cached);
+	}
+	dev->string_langid = 0;
+	usbi_mutex_unlock(&dev->string_cache_lock);
+}
+
+/* Asking for the zero'th index is special - it returns a string
+ * descriptor that contains all the language IDs supported by the
+ * device. Typically there aren't many - often only one. Language
+ * IDs are 16 bit numbers, and they start at the third byte in the
+ * descriptor. See USB 2.0 specification section 9.6.7 for more
+ * information.
+ *
+ * The first language is the one used, it is read once per device.
+ */
+static int get_string_langid(libusb_device_handle *dev_handle, uint16_t *langid)
+{
+	struct libusb_device *dev = dev_handle->dev;
+	union usbi_string_desc_buf str;
+	int r;
+
+	usbi_mutex_lock(&dev->string_cache_lock);
+	*langid = dev->string_langid;
+	usbi_mutex_unlock(&dev->string_cache_lock);
+	if (*langid)
+		return LIBUSB_SUCCESS;
+
+	r = libusb_get_string_descriptor(dev_handle, 0, 0, str.buf, 4);
+	if (r < 0)
+		return r;
+	else if (r != 4 || str.desc.bLength < 4)
+		return LIBUSB_ERROR_IO;
+	else if (str.desc.bDescriptorType != LIBUSB_DT_STRING)
+		return LIBUSB_ERROR_IO;
+	else if (str.desc.bLength & 1)
+		usbi_warn(HANDLE_CTX(dev_handle), "suspicious bLength %u for language ID string descriptor", str.desc.bLength);
+
+	*langid = libusb_le16_to_cpu(str.desc.wData[0]);
+
+	usbi_mutex_lock(&dev->string_cache_lock);
+	dev->string_langid = *langid;
+	usbi_mutex_unlock(&dev->string_cache_lock);
+
+	return LIBUSB_SUCCESS;
+}
+
+/* Check a string descriptor of r bytes and convert it to ASCII in data, which
+ * must be large enough for the whole string */
+static int string_desc_to_ascii(struct libusb_context *ctx,
+	union usbi_string_desc_buf *str, int r, unsigned char *data)
+{
+	int si, di;
+	uint16_t wdata;
+
+	if (r < 0)
+		return r;
+	else if (r < DESC_HEADER_LENGTH || str->desc.bLength > r)
+		return LIBUSB_ERROR_IO;
+	else if (str->desc.bDescriptorType != LIBUSB_DT_STRING)
+		return LIBUSB_ERROR_IO;
+	else if ((str->desc.bLength & 1) || str->desc.bLength != r)
+		usbi_warn(ctx, "suspicious bLength %u for string descriptor (read %d)", str->desc.bLength, r);
+
+	di = 0;
+	for (si = 2; si < str->desc.bLength; si += 2) {
+		wdata = libusb_le16_to_cpu(str->desc.wData[di]);
+		if (wdata < 0x80)
+			data[di++] = (unsigned char)wdata;
+		else
+			data[di++] = '?'; /* non-ASCII */
+	}
+
+	return di;
+}
+
+/* Take a string from the cache or from what the OS already read from the
+ * device. Returns LIBUSB_ERROR_NOT_FOUND if it has to be requested. */
+static int get_known_string(struct libusb_device *dev, uint8_t desc_index,
+	unsigned char *data, int length)
+{
+	unsigned char ascii[sizeof(union usbi_string_desc_buf)];
+	int r;
+
+	r = string_cache_get(dev, desc_index, data, length);
+	if (r >= 0 || !usbi_backend.get_device_string)
+		return r;
+
+	r = usbi_backend.get_device_string(dev, desc_index, ascii, (int)sizeof(ascii));
+	if (r < 0)
+		return LIBUSB_ERROR_NOT_FOUND;
+
+	string_cache_put(dev, desc_index, ascii, r);
+	return string_copy_out(data, length, ascii, r);
+}
+
 /** \ingroup libusb_desc
  * Retrieve a string descriptor in C style ASCII.
  *
  * Wrapper around libusb_get_string_descriptor(). Uses the first language
  * supported by the device.
  *
+ * Strings are cached per device until it is reset or disconnected, and
+ * taken from the operating system where it already read them, so repeated
+ * calls do not cause any I/O.
+ *
  * \param dev_handle a device handle
  * \param desc_index the index of the descriptor to retrieve
  * \param data output buffer for ASCII string descriptor
  * \param length size of data buffer
  * \returns number of bytes returned in data, or LIBUSB_ERROR code on failure
+ * \see libusb_get_string_descriptors_ascii()
  */
 int API_EXPORTED libusb_get_string_descriptor_ascii(libusb_device_handle *dev_handle,
 	uint8_t desc_index, unsigned char *data, int length)
 {
+	unsigned char ascii[sizeof(union usbi_string_desc_buf)];
 	union usbi_string_desc_buf str;
-	int r, si, di;
-	uint16_t langid, wdata;
-
-	/* Asking for the zero'th index is special - it returns a string
-	 * descriptor that contains all the language IDs supported by the
-	 * device. Typically there aren't many - often only one. Language
-	 * IDs are 16 bit numbers, and they start at the third byte in the
-	 * descriptor. There's also no point in trying to read descriptor 0
-	 * with this function. See USB 2.0 specification section 9.6.7 for
-	 * more information.
-	 */
+	uint16_t langid;
+	int r;
 
+	/* There's no point in trying to read descriptor 0 with this
+	 * function, it holds the language IDs. */
 	if (desc_index == 0)
 		return LIBUSB_ERROR_INVALID_PARAM;
 
-	r = libusb_get_string_descriptor(dev_handle, 0, 0, str.buf, 4);
+	r = get_known_string(dev_handle->dev, desc_index, data, length);
+	if (r != LIBUSB_ERROR_NOT_FOUND)
+		return r;
+
+	r = get_string_langid(dev_handle, &langid);
 	if (r < 0)
 		return r;
-	else if (r != 4 || str.desc.bLength < 4)
-		return LIBUSB_ERROR_IO;
-	else if (str.desc.bDescriptorType != LIBUSB_DT_STRING)
-		return LIBUSB_ERROR_IO;
-	else if (str.desc.bLength & 1)
-		usbi_warn(HANDLE_CTX(dev_handle), "suspicious bLength %u for language ID string descriptor", str.desc.bLength);
 
-	langid = libusb_le16_to_cpu(str.desc.wData[0]);
 	r = libusb_get_string_descriptor(dev_handle, desc_index, langid, str.buf, sizeof(str.buf));
+	r = string_desc_to_ascii(HANDLE_CTX(dev_handle), &str, r, ascii);
 	if (r < 0)
 		return r;
-	else if (r < DESC_HEADER_LENGTH || str.desc.bLength > r)
-		return LIBUSB_ERROR_IO;
-	else if (str.desc.bDescriptorType != LIBUSB_DT_STRING)
-		return LIBUSB_ERROR_IO;
-	else if ((str.desc.bLength & 1) || str.desc.bLength != r)
-		usbi_warn(HANDLE_CTX(dev_handle), "suspicious bLength %u for string descriptor (read %d)", str.desc.bLength, r);
 
-	di = 0;
-	for (si = 2; si < str.desc.bLength; si += 2) {
-		if (di >= (length - 1))
+	string_cache_put(dev_handle->dev, desc_index, ascii, r);
+	return string_copy_out(data, length, ascii, r);
+}
+
+struct string_batch {
+	int remaining;
+	int completed;
+};
+
+static void LIBUSB_CALL string_batch_cb(struct libusb_transfer *transfer)
+{
+	struct string_batch *batch = transfer->user_data;
+
+	if (--batch->remaining == 0)
+		batch->completed = 1;
+}
+
+/** \ingroup libusb_desc
+ * Retrieve several string descriptors in C style ASCII.
+ *
+ * This gives the same results as calling libusb_get_string_descriptor_ascii()
+ * for each index, but the strings that have to be requested from the device
+ * are requested all at once, so that reading the manufacturer, product and
+ * serial number strings costs about one round trip instead of several.
+ *
+ * Since version 1.0.27, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param dev_handle a device handle
+ * \param desc_indices the indices of the descriptors to retrieve
+ * \param data array of count output buffers
+ * \param lengths array of count lengths. On input, the size of each buffer
+ * in data. On output, the number of bytes returned in that buffer, or a
+ * LIBUSB_ERROR code if that string could not be retrieved.
+ * \param count the number of descriptors to retrieve
+ * \returns the number of strings retrieved, or a LIBUSB_ERROR code for an
+ * error affecting them all, such as failing to read the language, in which
+ * case lengths is not valid
+ * \returns \ref LIBUSB_ERROR_BUSY if called from event handling context
+ */
+int API_EXPORTED libusb_get_string_descriptors_ascii(libusb_device_handle *dev_handle,
+	const uint8_t *desc_indices, unsigned char **data, int *lengths, int count)
+{
+	struct libusb_context *ctx = HANDLE_CTX(dev_handle);
+	struct libusb_transfer **transfers;
+	struct string_batch batch = { 0, 0 };
+	uint16_t langid = 0;
+	int i, r, found = 0;
+
+	if (count < 0 || (count && (!desc_indices || !data || !lengths)))
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	if (usbi_handling_events(ctx))
+		return LIBUSB_ERROR_BUSY;
+
+	transfers = calloc((size_t)count + 1, sizeof(*transfers));
+	if (!transfers)
+		return LIBUSB_ERROR_NO_MEM;
+
+	for (i = 0; i < count; i++) {
+		struct libusb_transfer *transfer;
+		unsigned char *buffer;
+
+		if (desc_indices[i] == 0) {
+			lengths[i] = LIBUSB_ERROR_INVALID_PARAM;
+			continue;
+		}
+
+		r = get_known_string(dev_handle->dev, desc_indices[i], data[i], lengths[i]);
+		if (r != LIBUSB_ERROR_NOT_FOUND) {
+			lengths[i] = r;
+			if (r >= 0)
+				found++;
+			continue;
+		}
+
+		if (!langid) {
+			r = get_string_langid(dev_handle, &langid);
+			if (r < 0)
+				goto out;
+		}
+
+		transfer = libusb_alloc_transfer(0);
+		buffer = malloc(LIBUSB_CONTROL_SETUP_SIZE + sizeof(union usbi_string_desc_buf));
+		if (!transfer || !buffer) {
+			libusb_free_transfer(transfer);
+			free(buffer);
+			r = LIBUSB_ERROR_NO_MEM;
+			goto out;
+		}
+
+		libusb_fill_control_setup(buffer, LIBUSB_ENDPOINT_IN,
+			LIBUSB_REQUEST_GET_DESCRIPTOR, (uint16_t)((LIBUSB_DT_STRING << 8) | desc_indices[i]),
+			langid, (uint16_t)sizeof(union usbi_string_desc_buf));
+		libusb_fill_control_transfer(transfer, dev_handle, buffer,
+			string_batch_cb, &batch, 1000);
+		transfer->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+		transfers[i] = transfer;
+	}
+
+	/* everything that was not known goes out in one go */
+	for (i = 0; i < count; i++) {
+		if (!transfers[i])
+			continue;
+
+		r = libusb_submit_transfer(transfers[i]);
+		if (r < 0) {
+			lengths[i] = r;
+			libusb_free_transfer(transfers[i]);
+			transfers[i] = NULL;
+			continue;
+		}
+		batch.remaining++;
+	}
+
+	while (batch.remaining) {
+		r = libusb_handle_events_completed(ctx, &batch.completed);
+		if (r < 0 && r != LIBUSB_ERROR_INTERRUPTED) {
+			usbi_err(ctx, "libusb_handle_events failed: %s, cancelling transfers and retrying",
+				 libusb_error_name(r));
+			for (i = 0; i < count; i++) {
+				if (transfers[i])
+					libusb_cancel_transfer(transfers[i]);
+			}
+		}
+	}
+
+	for (i = 0; i < count; i++) {
+		struct libusb_transfer *transfer = transfers[i];
+		unsigned char ascii[sizeof(union usbi_string_desc_buf)];
+		union usbi_string_desc_buf str;
+
+		if (!transfer)
+			continue;
+
+		switch (transfer->status) {
+		case LIBUSB_TRANSFER_COMPLETED:
+			memcpy(str.buf, libusb_control_transfer_get_data(transfer),
+			       (size_t)transfer->actual_length);
+			r = string_desc_to_ascii(ctx, &str, transfer->actual_length, ascii);
+			break;
+		case LIBUSB_TRANSFER_TIMED_OUT:
+			r = LIBUSB_ERROR_TIMEOUT;
+			break;
+		case LIBUSB_TRANSFER_STALL:
+			r = LIBUSB_ERROR_PIPE;
+			break;
+		case LIBUSB_TRANSFER_NO_DEVICE:
+			r = LIBUSB_ERROR_NO_DEVICE;
+			break;
+		case LIBUSB_TRANSFER_OVERFLOW:
+			r = LIBUSB_ERROR_OVERFLOW;
 			break;
+		default:
+			r = LIBUSB_ERROR_IO;
+			break;
+		}
 
-		wdata = libusb_le16_to_cpu(str.desc.wData[di]);
-		if (wdata < 0x80)
-			data[di++] = (unsigned char)wdata;
-		else
-			data[di++] = '?'; /* non-ASCII */
+		if (r >= 0) {
+			string_cache_put(dev_handle->dev, desc_indices[i], ascii, r);
+			r = string_copy_out(data[i], lengths[i], ascii, r);
+			found++;
+		}
+		lengths[i] = r;
 	}
+	r = found;
 
-	data[di] = 0;
-	return di;
+out:
+	for (i = 0; i < count; i++)
+		libusb_free_transfer(transfers[i]);
+	free(transfers);
+	return r;
 }
 
 static int parse_iad_array(struct libusb_context *ctx,
@@ -1219,7 +2079,7 @@ static int parse_iad_array(struct libusb_context *ctx,
 	// First pass: Iterate through desc list, count number of IADs
 	iad_array->length = 0;
 	while (consumed < size) {
-		parse_descriptor(buf, "bb", &header);
+		parse_descriptor_header(buf, &header);
 		if (header.bLength < 2) {
 			usbi_err(ctx, "invalid descriptor bLength %d",
 				 header.bLength);
@@ -1243,9 +2103,9 @@ static int parse_iad_array(struct libusb_context *ctx,
 		consumed = 0;
 		i = 0;
 		while (consumed < size) {
-		   parse_descriptor(buffer, "bb", &header);
+		   parse_descriptor_header(buffer, &header);
 		   if (header.bDescriptorType == LIBUSB_DT_INTERFACE_ASSOCIATION)
-			  parse_descriptor(buffer, "bbbbbbbb", &iad[i++]);
+			  parse_iad_descriptor(buffer, &iad[i++]);
 		   buffer += header.bLength;
 		   consumed += header.bLength;
 		}
@@ -1389,3 +2249,106 @@ void API_EXPORTED libusb_free_interface_association_descriptors(
 		free((void*)iad_array->iad);
 	free(iad_array);
 }
+
+/** \ingroup libusb_desc
+ * Get the raw configuration descriptor with a specific bConfigurationValue,
+ * including all of its interface, endpoint and class or vendor specific
+ * descriptors, as held by the backend. Nothing is copied or parsed, which
+ * makes this cheaper than libusb_get_config_descriptor_by_value() when
+ * only a few descriptors are of interest. Walk the result with
+ * libusb_descriptor_iterator_init() and libusb_descriptor_iterator_next().
+ *
+ * Since version 1.0.27, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param dev a device
+ * \param bConfigurationValue the bConfigurationValue of the configuration you
+ * wish to retrieve
+ * \param buffer output location for the descriptor. Only valid if a length
+ * was returned. The buffer belongs to the device and remains valid for as
+ * long as the device does; it must not be freed or modified.
+ * \returns the length of the descriptor in bytes on success
+ * \returns \ref LIBUSB_ERROR_NOT_FOUND if the configuration does not exist
+ * \returns \ref LIBUSB_ERROR_NOT_SUPPORTED if the backend does not hold the
+ * raw descriptors
+ * \returns another LIBUSB_ERROR code on error
+ */
+int API_EXPORTED libusb_get_raw_config_descriptor_by_value(libusb_device *dev,
+	uint8_t bConfigurationValue, const unsigned char **buffer)
+{
+	void *buf;
+	int r;
+
+	if (!buffer)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	if (!usbi_backend.get_config_descriptor_by_value)
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+
+	r = usbi_backend.get_config_descriptor_by_value(dev,
+		bConfigurationValue, &buf);
+	if (r < 0)
+		return r;
+
+	*buffer = buf;
+	return r;
+}
+
+/** \ingroup libusb_desc
+ * Prepare to walk the descriptors of a raw descriptor buffer, for instance
+ * one returned by libusb_get_raw_config_descriptor_by_value() or the
+ * <tt>extra</tt> field of a parsed descriptor. The iterator does not
+ * allocate anything and needs no cleanup.
+ *
+ * Since version 1.0.27, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param iter the iterator to initialize
+ * \param buffer the descriptors to walk
+ * \param length the length of buffer in bytes
+ */
+void API_EXPORTED libusb_descriptor_iterator_init(
+	struct libusb_descriptor_iterator *iter, const unsigned char *buffer,
+	int length)
+{
+	iter->pos = buffer;
+	iter->remaining = buffer ? MAX(length, 0) : 0;
+}
+
+/** \ingroup libusb_desc
+ * Step to the next descriptor of a raw descriptor buffer. The descriptor
+ * is checked to fit within what remains of the buffer, so a malformed
+ * buffer can never be read past its end.
+ *
+ * Since version 1.0.27, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param iter an iterator initialized with libusb_descriptor_iterator_init()
+ * \param desc output location for the descriptor. Only valid if 0 was
+ * returned.
+ * \returns 0 on success
+ * \returns \ref LIBUSB_ERROR_NOT_FOUND once all of the descriptors have been
+ * returned
+ * \returns \ref LIBUSB_ERROR_IO if the next descriptor is malformed, after
+ * which the iterator stays at the end
+ */
+int API_EXPORTED libusb_descriptor_iterator_next(
+	struct libusb_descriptor_iterator *iter, struct libusb_raw_descriptor *desc)
+{
+	uint8_t length;
+
+	if (!iter->remaining)
+		return LIBUSB_ERROR_NOT_FOUND;
+
+	length = iter->pos[0];
+	if (iter->remaining < DESC_HEADER_LENGTH || length < DESC_HEADER_LENGTH ||
+	    length > iter->remaining) {
+		iter->remaining = 0;
+		return LIBUSB_ERROR_IO;
+	}
+
+	desc->bLength = length;
+	desc->bDescriptorType = iter->pos[1];
+	desc->data = iter->pos;
+
+	iter->pos += length;
+	iter->remaining -= length;
+	return LIBUSB_SUCCESS;
+}
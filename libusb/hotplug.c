@@ -149,14 +149,55 @@ int main (void) {
 #define VALID_HOTPLUG_FLAGS			\
 	(LIBUSB_HOTPLUG_ENUMERATE)
 
+/* Callbacks are filed in the index under the most specific field they
+ * match on: vendor ID, then product ID, then device class. A device then
+ * only needs to be matched against the callbacks in the buckets of its
+ * vendor ID, product ID and device class, and the ones that match any
+ * device. */
+static struct list_head *hotplug_cb_index_bucket(struct libusb_context *ctx,
+	unsigned int field, unsigned int value)
+{
+	uint32_t key = ((uint32_t)field << 16) | value;
+
+	return &ctx->hotplug_cb_index[((key * 2654435761U) >> 16) % USBI_HOTPLUG_CB_INDEX_SIZE];
+}
+
+static struct list_head *hotplug_cb_bucket(struct libusb_context *ctx,
+	struct usbi_hotplug_callback *hotplug_cb)
+{
+	if (hotplug_cb->flags & USBI_HOTPLUG_VENDOR_ID_VALID)
+		return hotplug_cb_index_bucket(ctx, USBI_HOTPLUG_VENDOR_ID_VALID,
+					       hotplug_cb->vendor_id);
+	else if (hotplug_cb->flags & USBI_HOTPLUG_PRODUCT_ID_VALID)
+		return hotplug_cb_index_bucket(ctx, USBI_HOTPLUG_PRODUCT_ID_VALID,
+					       hotplug_cb->product_id);
+	else if (hotplug_cb->flags & USBI_HOTPLUG_DEV_CLASS_VALID)
+		return hotplug_cb_index_bucket(ctx, USBI_HOTPLUG_DEV_CLASS_VALID,
+					       hotplug_cb->dev_class);
+	else
+		return &ctx->hotplug_cbs_any;
+}
+
+static void free_hotplug_cb(struct usbi_hotplug_callback *hotplug_cb)
+{
+	list_del(&hotplug_cb->list);
+	list_del(&hotplug_cb->index_list);
+	free(hotplug_cb);
+}
+
 void usbi_hotplug_init(struct libusb_context *ctx)
 {
+	int i;
+
 	/* check for hotplug support */
 	if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG))
 		return;
 
 	usbi_mutex_init(&ctx->hotplug_cbs_lock);
 	list_init(&ctx->hotplug_cbs);
+	for (i = 0; i < USBI_HOTPLUG_CB_INDEX_SIZE; i++)
+		list_init(&ctx->hotplug_cb_index[i]);
+	list_init(&ctx->hotplug_cbs_any);
 	ctx->next_hotplug_cb_handle = 1;
 	usbi_atomic_store(&ctx->hotplug_ready, 1);
 }
@@ -175,12 +216,12 @@ void usbi_hotplug_exit(struct libusb_context *ctx)
 		return;
 
 	/* free all registered hotplug callbacks */
-	for_each_hotplug_cb_safe(ctx, hotplug_cb, next_cb) {
-		list_del(&hotplug_cb->list);
-		free(hotplug_cb);
-	}
+	for_each_hotplug_cb_safe(ctx, hotplug_cb, next_cb)
+		free_hotplug_cb(hotplug_cb);
 
 	/* free all pending hotplug messages */
+	if (!list_empty(&ctx->hotplug_batch_msgs))
+		list_splice_front(&ctx->hotplug_batch_msgs, &ctx->hotplug_msgs);
 	while (!list_empty(&ctx->hotplug_msgs)) {
 		msg = list_first_entry(&ctx->hotplug_msgs, struct usbi_hotplug_message, list);
 
@@ -200,6 +241,7 @@ void usbi_hotplug_exit(struct libusb_context *ctx)
 		 * warning message will be shown */
 		if (usbi_atomic_load(&dev->refcnt) == 1) {
 			list_del(&dev->list);
+			list_del(&dev->session_list);
 		}
 		if (dev->parent_dev && usbi_atomic_load(&dev->parent_dev->refcnt) == 1) {
 			/* the parent was before this device in the list and will be released.
@@ -207,6 +249,7 @@ void usbi_hotplug_exit(struct libusb_context *ctx)
 			   equal to next_dev. */
 			assert (dev->parent_dev != next_dev);
 			list_del(&dev->parent_dev->list);
+			list_del(&dev->parent_dev->session_list);
 		}
 		libusb_unref_device(dev);
 	}
@@ -251,6 +294,8 @@ void usbi_hotplug_notification(struct libusb_context *ctx, struct libusb_device
 	if (!usbi_atomic_load(&ctx->hotplug_ready))
 		return;
 
+	usbi_trace3(hotplug__event, dev->bus_number, dev->device_address, event);
+
 	msg = calloc(1, sizeof(*msg));
 	if (!msg) {
 		usbi_err(ctx, "error allocating hotplug message");
@@ -261,50 +306,154 @@ void usbi_hotplug_notification(struct libusb_context *ctx, struct libusb_device
 	msg->device = dev;
 
 	/* Take the event data lock and add this message to the list.
-	 * Only signal an event if there are no prior pending events. */
+	 * Only signal an event if there are no prior pending events. During
+	 * a batch, hold the message back until the batch ends. */
 	usbi_mutex_lock(&ctx->event_data_lock);
-	event_flags = ctx->event_flags;
-	ctx->event_flags |= USBI_EVENT_HOTPLUG_MSG_PENDING;
-	list_add_tail(&msg->list, &ctx->hotplug_msgs);
-	if (!event_flags)
-		usbi_signal_event(&ctx->event);
+	if (usbi_atomic_load(&ctx->hotplug_batch_depth)) {
+		list_add_tail(&msg->list, &ctx->hotplug_batch_msgs);
+	} else {
+		event_flags = ctx->event_flags;
+		ctx->event_flags |= USBI_EVENT_HOTPLUG_MSG_PENDING;
+		list_add_tail(&msg->list, &ctx->hotplug_msgs);
+		if (!event_flags)
+			usbi_signal_event(&ctx->event);
+	}
 	usbi_mutex_unlock(&ctx->event_data_lock);
 }
 
-void usbi_hotplug_process(struct libusb_context *ctx, struct list_head *hotplug_msgs)
+/* Backends bracket the hotplug events they apply to a context together
+ * with usbi_hotplug_batch_begin() and usbi_hotplug_batch_end(). The
+ * messages generated in between are held back, and delivered with a single
+ * wakeup once the batch ends. */
+void usbi_hotplug_batch_begin(struct libusb_context *ctx)
 {
-	struct usbi_hotplug_callback *hotplug_cb, *next_cb;
-	struct usbi_hotplug_message *msg;
-	int r;
+	(void)usbi_atomic_inc(&ctx->hotplug_batch_depth);
+}
 
-	usbi_mutex_lock(&ctx->hotplug_cbs_lock);
+void usbi_hotplug_batch_end(struct libusb_context *ctx)
+{
+	unsigned int event_flags;
 
-	/* dispatch all pending hotplug messages */
-	while (!list_empty(hotplug_msgs)) {
-		msg = list_first_entry(hotplug_msgs, struct usbi_hotplug_message, list);
+	if (usbi_atomic_dec(&ctx->hotplug_batch_depth))
+		return;
+
+	usbi_mutex_lock(&ctx->event_data_lock);
+	if (!list_empty(&ctx->hotplug_batch_msgs)) {
+		/* append the batch to the pending messages */
+		if (!list_empty(&ctx->hotplug_msgs))
+			list_splice_front(&ctx->hotplug_msgs, &ctx->hotplug_batch_msgs);
+		list_cut(&ctx->hotplug_msgs, &ctx->hotplug_batch_msgs);
+
+		event_flags = ctx->event_flags;
+		ctx->event_flags |= USBI_EVENT_HOTPLUG_MSG_PENDING;
+		if (!event_flags)
+			usbi_signal_event(&ctx->event);
+	}
+	usbi_mutex_unlock(&ctx->event_data_lock);
+}
 
-		for_each_hotplug_cb_safe(ctx, hotplug_cb, next_cb) {
-			/* skip callbacks that have unregistered */
-			if (hotplug_cb->flags & USBI_HOTPLUG_NEEDS_FREE)
+static void free_hotplug_message(struct usbi_hotplug_message *msg)
+{
+	/* if the device left, the message holds a reference
+	 * and we must drop it */
+	if (msg->event == LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT)
+		libusb_unref_device(msg->device);
+
+	list_del(&msg->list);
+	free(msg);
+}
+
+/* Drop the messages of devices which arrived and left again before the
+ * messages could be delivered. */
+static void cancel_transient_devices(struct list_head *hotplug_msgs)
+{
+	struct usbi_hotplug_message *msg, *next_msg, *arrival;
+
+	list_for_each_entry_safe(msg, next_msg, hotplug_msgs, list, struct usbi_hotplug_message) {
+		if (msg->event != LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT)
+			continue;
+
+		list_for_each_entry(arrival, hotplug_msgs, list, struct usbi_hotplug_message) {
+			if (arrival == msg)
+				break;
+
+			if (arrival->event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED &&
+			    arrival->device == msg->device) {
+				free_hotplug_message(arrival);
+				free_hotplug_message(msg);
+				break;
+			}
+		}
+	}
+}
+
+/* dispatch a hotplug message to the callbacks that may match it, with the
+ * context hotplug lock held */
+static void hotplug_dispatch(struct libusb_context *ctx,
+	struct usbi_hotplug_message *msg)
+{
+	const struct libusb_device_descriptor *desc = &msg->device->device_descriptor;
+	struct usbi_hotplug_callback *hotplug_cb, *next_cb;
+	struct list_head *candidates[3] = {
+		hotplug_cb_index_bucket(ctx, USBI_HOTPLUG_VENDOR_ID_VALID, desc->idVendor),
+		hotplug_cb_index_bucket(ctx, USBI_HOTPLUG_PRODUCT_ID_VALID, desc->idProduct),
+		hotplug_cb_index_bucket(ctx, USBI_HOTPLUG_DEV_CLASS_VALID, desc->bDeviceClass),
+	};
+	struct list_head *buckets[4];
+	uint64_t serial_end = ctx->next_hotplug_cb_serial;
+	unsigned int i, j, num_buckets = 0;
+	int r;
+
+	/* the fields may hash to the same bucket, which must not be walked
+	 * twice */
+	for (i = 0; i < 3; i++) {
+		for (j = 0; j < num_buckets; j++) {
+			if (buckets[j] == candidates[i])
+				break;
+		}
+		if (j == num_buckets)
+			buckets[num_buckets++] = candidates[i];
+	}
+	buckets[num_buckets++] = &ctx->hotplug_cbs_any;
+
+	for (i = 0; i < num_buckets; i++) {
+		list_for_each_entry_safe(hotplug_cb, next_cb, buckets[i], index_list,
+				struct usbi_hotplug_callback) {
+			/* skip callbacks that have unregistered, and the ones
+			 * registered by the callbacks called so far, which may
+			 * be in a bucket not walked yet */
+			if ((hotplug_cb->flags & USBI_HOTPLUG_NEEDS_FREE) ||
+			    hotplug_cb->serial >= serial_end)
 				continue;
 
 			usbi_mutex_unlock(&ctx->hotplug_cbs_lock);
 			r = usbi_hotplug_match_cb(msg->device, msg->event, hotplug_cb);
 			usbi_mutex_lock(&ctx->hotplug_cbs_lock);
 
-			if (r) {
-				list_del(&hotplug_cb->list);
-				free(hotplug_cb);
-			}
+			if (r)
+				free_hotplug_cb(hotplug_cb);
 		}
+	}
+}
 
-		/* if the device left, the message holds a reference
-		 * and we must drop it */
-		if (msg->event == LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT)
-			libusb_unref_device(msg->device);
+void usbi_hotplug_process(struct libusb_context *ctx, struct list_head *hotplug_msgs)
+{
+	struct usbi_hotplug_callback *hotplug_cb, *next_cb;
+	struct usbi_hotplug_message *msg;
 
-		list_del(&msg->list);
-		free(msg);
+	/* without a batch window of its own, the context gets every event,
+	 * even if the monitor batches them for another context */
+	if (usbi_atomic_load(&ctx->hotplug_batch_window))
+		cancel_transient_devices(hotplug_msgs);
+
+	usbi_mutex_lock(&ctx->hotplug_cbs_lock);
+
+	/* dispatch all pending hotplug messages */
+	while (!list_empty(hotplug_msgs)) {
+		msg = list_first_entry(hotplug_msgs, struct usbi_hotplug_message, list);
+
+		hotplug_dispatch(ctx, msg);
+		free_hotplug_message(msg);
 	}
 
 	/* free any callbacks that have unregistered */
@@ -312,8 +461,7 @@ void usbi_hotplug_process(struct libusb_context *ctx, struct list_head *hotplug_
 		if (hotplug_cb->flags & USBI_HOTPLUG_NEEDS_FREE) {
 			usbi_dbg(ctx, "freeing hotplug cb %p with handle %d",
 				 (void *) hotplug_cb, hotplug_cb->handle);
-			list_del(&hotplug_cb->list);
-			free(hotplug_cb);
+			free_hotplug_cb(hotplug_cb);
 		}
 	}
 
@@ -368,12 +516,14 @@ int API_EXPORTED libusb_hotplug_register_callback(libusb_context *ctx,
 
 	/* protect the handle by the context hotplug lock */
 	hotplug_cb->handle = ctx->next_hotplug_cb_handle++;
+	hotplug_cb->serial = ctx->next_hotplug_cb_serial++;
 
 	/* handle the unlikely case of overflow */
 	if (ctx->next_hotplug_cb_handle < 0)
 		ctx->next_hotplug_cb_handle = 1;
 
 	list_add(&hotplug_cb->list, &ctx->hotplug_cbs);
+	list_add(&hotplug_cb->index_list, hotplug_cb_bucket(ctx, hotplug_cb));
 
 	usbi_mutex_unlock(&ctx->hotplug_cbs_lock);
 
@@ -23,6 +23,16 @@
 
 #include "libusbi.h"
 
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#if !defined(PLATFORM_WINDOWS)
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
 /**
  * \page libusb_io Synchronous and asynchronous device I/O
  *
@@ -789,6 +799,17 @@ while (user has not requested application exit) {
  * call libusb_get_pollfds(), you can set up notification functions for when
  * the file descriptor set changes using libusb_set_pollfd_notifiers().
  *
+ * \subsection eventfd Monitoring a single file descriptor
+ *
+ * On Linux, macOS and the BSDs, a context initialized with
+ * \ref libusb_option::LIBUSB_OPTION_USE_EPOLL "LIBUSB_OPTION_USE_EPOLL"
+ * can instead be monitored through the one file descriptor returned by
+ * libusb_get_event_fd(), which never changes. It becomes readable whenever
+ * one of the event sources of the context is ready, including the timer that
+ * libusb uses for transfer timeouts where libusb_pollfds_handle_timeouts()
+ * returns 1, so that calling libusb_handle_events_timeout() with a zero
+ * timeout at that point handles everything that is pending.
+ *
  * \subsection mtissues Multi-threaded considerations
  *
  * Unfortunately, the situation is complicated further when multiple threads
@@ -1161,21 +1182,33 @@ int usbi_io_init(struct libusb_context *ctx)
 {
 	int r;
 
-	usbi_mutex_init(&ctx->flying_transfers_lock);
+	usbi_mutex_init(&ctx->timeouts_lock);
 	usbi_mutex_init(&ctx->events_lock);
 	usbi_mutex_init(&ctx->event_waiters_lock);
 	usbi_cond_init(&ctx->event_waiters_cond);
 	usbi_mutex_init(&ctx->event_data_lock);
+	usbi_mutex_init(&ctx->capture_lock);
 	usbi_tls_key_create(&ctx->event_handling_key);
-	list_init(&ctx->flying_transfers);
 	list_init(&ctx->event_sources);
 	list_init(&ctx->removed_event_sources);
 	list_init(&ctx->hotplug_msgs);
+	list_init(&ctx->hotplug_batch_msgs);
 	list_init(&ctx->completed_transfers);
+	list_init(&ctx->ring_batches);
+
+#ifdef HAVE_EVENT_SET
+	ctx->epoll_fd = -1;
+	if (ctx->use_epoll) {
+		r = usbi_epoll_init(ctx);
+		if (r < 0)
+			goto err;
+		usbi_dbg(ctx, "using epoll for event sources");
+	}
+#endif
 
 	r = usbi_create_event(&ctx->event);
 	if (r < 0)
-		goto err;
+		goto err_exit_epoll;
 
 	r = usbi_add_event_source(ctx, USBI_EVENT_OS_HANDLE(&ctx->event), USBI_EVENT_POLL_EVENTS);
 	if (r < 0)
@@ -1202,12 +1235,17 @@ err_destroy_timer:
 #endif
 err_destroy_event:
 	usbi_destroy_event(&ctx->event);
+err_exit_epoll:
+#ifdef HAVE_EVENT_SET
+	usbi_epoll_exit(ctx);
 err:
-	usbi_mutex_destroy(&ctx->flying_transfers_lock);
+#endif
+	usbi_mutex_destroy(&ctx->timeouts_lock);
 	usbi_mutex_destroy(&ctx->events_lock);
 	usbi_mutex_destroy(&ctx->event_waiters_lock);
 	usbi_cond_destroy(&ctx->event_waiters_cond);
 	usbi_mutex_destroy(&ctx->event_data_lock);
+	usbi_mutex_destroy(&ctx->capture_lock);
 	usbi_tls_key_delete(ctx->event_handling_key);
 	return r;
 }
@@ -1232,20 +1270,27 @@ void usbi_io_exit(struct libusb_context *ctx)
 #endif
 	usbi_remove_event_source(ctx, USBI_EVENT_OS_HANDLE(&ctx->event));
 	usbi_destroy_event(&ctx->event);
-	usbi_mutex_destroy(&ctx->flying_transfers_lock);
+#ifdef HAVE_EVENT_SET
+	usbi_epoll_exit(ctx);
+#endif
+	libusb_capture_stop(ctx);
+	usbi_mutex_destroy(&ctx->timeouts_lock);
 	usbi_mutex_destroy(&ctx->events_lock);
 	usbi_mutex_destroy(&ctx->event_waiters_lock);
 	usbi_cond_destroy(&ctx->event_waiters_cond);
 	usbi_mutex_destroy(&ctx->event_data_lock);
+	usbi_mutex_destroy(&ctx->capture_lock);
 	usbi_tls_key_delete(ctx->event_handling_key);
 	cleanup_removed_event_sources(ctx);
 	free(ctx->event_data);
+	free(ctx->timeout_heap);
 }
 
 static void calculate_timeout(struct usbi_transfer *itransfer)
 {
 	unsigned int timeout =
 		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer)->timeout;
+	long granularity;
 
 	if (!timeout) {
 		TIMESPEC_CLEAR(&itransfer->timeout);
@@ -1260,6 +1305,106 @@ static void calculate_timeout(struct usbi_transfer *itransfer)
 		++itransfer->timeout.tv_sec;
 		itransfer->timeout.tv_nsec -= NSEC_PER_SEC;
 	}
+
+	/* round up to the granularity, so that transfers whose timeouts are
+	 * close together share one timer expiry */
+	granularity = usbi_atomic_load(&ITRANSFER_CTX(itransfer)->timeout_granularity);
+	if (granularity) {
+		int64_t nsec = (int64_t)itransfer->timeout.tv_sec * NSEC_PER_SEC +
+			itransfer->timeout.tv_nsec;
+		int64_t step = (int64_t)granularity * 1000000;
+
+		nsec = (nsec + step - 1) / step * step;
+		itransfer->timeout.tv_sec = (time_t)(nsec / NSEC_PER_SEC);
+		itransfer->timeout.tv_nsec = (long)(nsec % NSEC_PER_SEC);
+	}
+}
+
+/* Freed transfers are kept in a small cache for reuse, with one free list for
+ * each of a few common iso packet counts, so that short-lived transfers such
+ * as those of the synchronous API skip the allocator and the mutex setup.
+ * libusb_alloc_transfer() is not given a context, so the cache is shared by
+ * the whole library and emptied when the last context exits. */
+#define TRANSFER_CACHE_DEPTH	16
+
+static const int transfer_cache_iso_packets[] = { 0, 8, 32, 128 };
+
+static usbi_mutex_static_t transfer_cache_lock = USBI_MUTEX_INITIALIZER;
+static struct list_head transfer_cache[ARRAYSIZE(transfer_cache_iso_packets)];
+static unsigned int transfer_cache_count[ARRAYSIZE(transfer_cache_iso_packets)];
+
+/* returns the size class for a number of iso packets, or -1 if transfers
+ * with that many packets are not cached. transfers are only cached with the
+ * exact number of packets of a class, so that the packet count of a recycled
+ * transfer is the one asked for. */
+static int transfer_cache_class(int iso_packets)
+{
+	int i;
+
+	for (i = 0; i < (int)ARRAYSIZE(transfer_cache_iso_packets); i++) {
+		if (iso_packets == transfer_cache_iso_packets[i])
+			return i;
+	}
+
+	return -1;
+}
+
+static struct usbi_transfer *transfer_cache_get(int cls)
+{
+	struct usbi_transfer *itransfer = NULL;
+
+	usbi_mutex_static_lock(&transfer_cache_lock);
+	if (transfer_cache_count[cls]) {
+		itransfer = list_first_entry(&transfer_cache[cls], struct usbi_transfer, list);
+		list_del(&itransfer->list);
+		transfer_cache_count[cls]--;
+	}
+	usbi_mutex_static_unlock(&transfer_cache_lock);
+
+	return itransfer;
+}
+
+/* returns 1 if the transfer was kept in the cache */
+static int transfer_cache_put(struct usbi_transfer *itransfer)
+{
+	int cls = transfer_cache_class(itransfer->num_iso_packets);
+	int r = 0;
+
+	if (cls < 0)
+		return 0;
+
+	usbi_mutex_static_lock(&transfer_cache_lock);
+	if (transfer_cache_count[cls] < TRANSFER_CACHE_DEPTH) {
+		if (!transfer_cache_count[cls])
+			list_init(&transfer_cache[cls]);
+		list_add(&itransfer->list, &transfer_cache[cls]);
+		transfer_cache_count[cls]++;
+		r = 1;
+	}
+	usbi_mutex_static_unlock(&transfer_cache_lock);
+
+	return r;
+}
+
+void usbi_transfer_cache_flush(void)
+{
+	struct usbi_transfer *itransfer, *tmp;
+	int cls;
+
+	usbi_mutex_static_lock(&transfer_cache_lock);
+	for (cls = 0; cls < (int)ARRAYSIZE(transfer_cache_iso_packets); cls++) {
+		if (!transfer_cache_count[cls])
+			continue;
+		list_for_each_entry_safe(itransfer, tmp, &transfer_cache[cls], list, struct usbi_transfer) {
+			list_del(&itransfer->list);
+			if (usbi_backend.destroy_transfer_priv)
+				usbi_backend.destroy_transfer_priv(itransfer);
+			usbi_mutex_destroy(&itransfer->lock);
+			free(itransfer->priv);
+		}
+		transfer_cache_count[cls] = 0;
+	}
+	usbi_mutex_static_unlock(&transfer_cache_lock);
 }
 
 /** \ingroup libusb_asyncio
@@ -1294,12 +1439,33 @@ struct libusb_transfer * LIBUSB_CALL libusb_alloc_transfer(
 	unsigned char *ptr;
 	struct usbi_transfer *itransfer;
 	struct libusb_transfer *transfer;
+	int cls;
 
 	assert(iso_packets >= 0);
 	if (iso_packets < 0)
 		return NULL;
 
 	priv_size = PTR_ALIGN(usbi_backend.transfer_priv_size);
+
+	cls = transfer_cache_class(iso_packets);
+	if (cls >= 0) {
+		itransfer = transfer_cache_get(cls);
+		if (itransfer) {
+			/* reset everything but the lock to the state of a newly
+			 * allocated transfer */
+			ptr = itransfer->priv;
+			if (!usbi_backend.destroy_transfer_priv)
+				memset(ptr, 0, priv_size);
+			memset(itransfer, 0, offsetof(struct usbi_transfer, lock));
+			itransfer->num_iso_packets = iso_packets;
+			itransfer->priv = ptr;
+			transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+			memset(transfer, 0, sizeof(*transfer) +
+				sizeof(struct libusb_iso_packet_descriptor) * (size_t)iso_packets);
+			return transfer;
+		}
+	}
+
 	alloc_size = priv_size
 		+ sizeof(struct usbi_transfer)
 		+ sizeof(struct libusb_transfer)
@@ -1347,22 +1513,177 @@ void API_EXPORTED libusb_free_transfer(struct libusb_transfer *transfer)
 		free(transfer->buffer);
 
 	itransfer = LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
-	usbi_mutex_destroy(&itransfer->lock);
 	if (itransfer->dev)
 		libusb_unref_device(itransfer->dev);
 
+	if (transfer_cache_put(itransfer))
+		return;
+
+	if (usbi_backend.destroy_transfer_priv)
+		usbi_backend.destroy_transfer_priv(itransfer);
+	usbi_mutex_destroy(&itransfer->lock);
 	priv_size = PTR_ALIGN(usbi_backend.transfer_priv_size);
 	ptr = (unsigned char *)itransfer - priv_size;
 	assert(ptr == itransfer->priv);
 	free(ptr);
 }
 
-/* iterates through the flying transfers, and rearms the timer based on the
- * next upcoming timeout.
- * must be called with flying_list locked.
+/* Helpers to maintain the timeout heap. The heap is stored in
+ * ctx->timeout_heap using 1-based indexing so that the parent of the entry
+ * at index i is at index i / 2, and each transfer records its current
+ * position so that it can be removed without a search.
+ * All of these must be called with the timeouts_lock held. */
+static inline void timeout_heap_set(struct libusb_context *ctx,
+	unsigned int idx, struct usbi_transfer *itransfer)
+{
+	ctx->timeout_heap[idx] = itransfer;
+	itransfer->timeout_heap_idx = idx;
+}
+
+static void timeout_heap_sift_up(struct libusb_context *ctx, unsigned int idx)
+{
+	struct usbi_transfer *itransfer = ctx->timeout_heap[idx];
+
+	while (idx > 1) {
+		struct usbi_transfer *parent = ctx->timeout_heap[idx / 2];
+
+		if (!TIMESPEC_CMP(&itransfer->timeout, &parent->timeout, <))
+			break;
+
+		timeout_heap_set(ctx, idx, parent);
+		idx /= 2;
+	}
+
+	timeout_heap_set(ctx, idx, itransfer);
+}
+
+static void timeout_heap_sift_down(struct libusb_context *ctx, unsigned int idx)
+{
+	struct usbi_transfer **heap = ctx->timeout_heap;
+	struct usbi_transfer *itransfer = heap[idx];
+	unsigned int len = ctx->timeout_heap_len;
+
+	while (idx * 2 <= len) {
+		unsigned int child = idx * 2;
+
+		/* pick the child which times out first */
+		if (child < len && TIMESPEC_CMP(&heap[child + 1]->timeout, &heap[child]->timeout, <))
+			child++;
+
+		if (!TIMESPEC_CMP(&heap[child]->timeout, &itransfer->timeout, <))
+			break;
+
+		timeout_heap_set(ctx, idx, heap[child]);
+		idx = child;
+	}
+
+	timeout_heap_set(ctx, idx, itransfer);
+}
+
+static int timeout_heap_insert(struct libusb_context *ctx,
+	struct usbi_transfer *itransfer)
+{
+	if (ctx->timeout_heap_len + 1 >= ctx->timeout_heap_size) {
+		unsigned int size = ctx->timeout_heap_size ? 2 * ctx->timeout_heap_size : 64;
+		struct usbi_transfer **heap;
+
+		heap = realloc(ctx->timeout_heap, size * sizeof(*heap));
+		if (!heap)
+			return LIBUSB_ERROR_NO_MEM;
+
+		ctx->timeout_heap = heap;
+		ctx->timeout_heap_size = size;
+	}
+
+	ctx->timeout_heap[++ctx->timeout_heap_len] = itransfer;
+	timeout_heap_sift_up(ctx, ctx->timeout_heap_len);
+
+	return 0;
+}
+
+static void timeout_heap_remove(struct libusb_context *ctx,
+	struct usbi_transfer *itransfer)
+{
+	unsigned int idx = itransfer->timeout_heap_idx;
+	struct usbi_transfer *last;
+
+	if (!idx)
+		return;
+
+	itransfer->timeout_heap_idx = 0;
+	last = ctx->timeout_heap[ctx->timeout_heap_len--];
+	if (last == itransfer)
+		return;
+
+	/* move the last entry into the hole and restore the heap property */
+	timeout_heap_set(ctx, idx, last);
+	if (idx > 1 && TIMESPEC_CMP(&last->timeout, &ctx->timeout_heap[idx / 2]->timeout, <))
+		timeout_heap_sift_up(ctx, idx);
+	else
+		timeout_heap_sift_down(ctx, idx);
+}
+
+/* returns the transfer with the earliest timeout that libusb still needs to
+ * handle, or NULL if there is none. Transfers whose timeout has already been
+ * handled, or is handled by the OS, are dropped from the heap on the way.
+ * must be called with the timeouts_lock held. */
+static struct usbi_transfer *timeout_heap_peek(struct libusb_context *ctx)
+{
+	while (ctx->timeout_heap_len) {
+		struct usbi_transfer *itransfer = ctx->timeout_heap[1];
+
+		if (!(itransfer->timeout_flags & (USBI_TRANSFER_TIMEOUT_HANDLED | USBI_TRANSFER_OS_HANDLES_TIMEOUT)))
+			return itransfer;
+
+		timeout_heap_remove(ctx, itransfer);
+	}
+
+	return NULL;
+}
+
+/* rearms the timer based on the next upcoming timeout.
+ * must be called with the timeouts_lock held.
  * returns 0 on success or a LIBUSB_ERROR code on failure.
  */
 #ifdef HAVE_OS_TIMER
+/* arms the timer unless it is already armed with the same expiry, which is
+ * common once timeouts are rounded to a granularity.
+ * must be called with the timeouts_lock held. */
+static int arm_timer(struct libusb_context *ctx, const struct timespec *timeout)
+{
+	int r;
+
+	if (ctx->timer_armed && TIMESPEC_CMP(&ctx->timer_expiry, timeout, ==))
+		return 0;
+
+	r = usbi_arm_timer(&ctx->timer, timeout);
+	if (r) {
+		/* the state of the timer is unknown, so make sure the next
+		 * call to disarm_timer() does not skip it */
+		ctx->timer_armed = 1;
+		TIMESPEC_CLEAR(&ctx->timer_expiry);
+		return r;
+	}
+
+	ctx->timer_armed = 1;
+	ctx->timer_expiry = *timeout;
+	return 0;
+}
+
+/* must be called with the timeouts_lock held */
+static int disarm_timer(struct libusb_context *ctx)
+{
+	int r;
+
+	if (!ctx->timer_armed)
+		return 0;
+
+	r = usbi_disarm_timer(&ctx->timer);
+	if (!r)
+		ctx->timer_armed = 0;
+	return r;
+}
+
 static int arm_timer_for_next_timeout(struct libusb_context *ctx)
 {
 	struct usbi_transfer *itransfer;
@@ -1370,23 +1691,14 @@ static int arm_timer_for_next_timeout(struct libusb_context *ctx)
 	if (!usbi_using_timer(ctx))
 		return 0;
 
-	for_each_transfer(ctx, itransfer) {
-		struct timespec *cur_ts = &itransfer->timeout;
-
-		/* if we've reached transfers of infinite timeout, then we have no
-		 * arming to do */
-		if (!TIMESPEC_IS_SET(cur_ts))
-			break;
-
-		/* act on first transfer that has not already been handled */
-		if (!(itransfer->timeout_flags & (USBI_TRANSFER_TIMEOUT_HANDLED | USBI_TRANSFER_OS_HANDLES_TIMEOUT))) {
-			usbi_dbg(ctx, "next timeout originally %ums", USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer)->timeout);
-			return usbi_arm_timer(&ctx->timer, cur_ts);
-		}
+	itransfer = timeout_heap_peek(ctx);
+	if (itransfer) {
+		usbi_dbg(ctx, "next timeout originally %ums", USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer)->timeout);
+		return arm_timer(ctx, &itransfer->timeout);
 	}
 
 	usbi_dbg(ctx, "no timeouts, disarming timer");
-	return usbi_disarm_timer(&ctx->timer);
+	return disarm_timer(ctx);
 }
 #else
 static inline int arm_timer_for_next_timeout(struct libusb_context *ctx)
@@ -1396,197 +1708,2201 @@ static inline int arm_timer_for_next_timeout(struct libusb_context *ctx)
 }
 #endif
 
-/* add a transfer to the (timeout-sorted) active transfers list.
+/* add a transfer to its handle's active transfers list and, if it has a
+ * finite timeout, to the timeout heap.
+ * must be called with the handle's flying_transfers_lock held, and also with
+ * the timeouts_lock held if the transfer has a timeout.
  * This function will return non 0 if fails to update the timer,
  * in which case the transfer is *not* on the flying_transfers list. */
 static int add_to_flying_list(struct usbi_transfer *itransfer)
 {
-	struct usbi_transfer *cur;
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
 	struct timespec *timeout = &itransfer->timeout;
 	struct libusb_context *ctx = ITRANSFER_CTX(itransfer);
-	int r = 0;
-	int first = 1;
+	int r;
 
 	calculate_timeout(itransfer);
 
-	/* if we have no other flying transfers, start the list with this one */
-	if (list_empty(&ctx->flying_transfers)) {
-		list_add(&itransfer->list, &ctx->flying_transfers);
-		goto out;
-	}
-
-	/* if we have infinite timeout, append to end of list */
-	if (!TIMESPEC_IS_SET(timeout)) {
-		list_add_tail(&itransfer->list, &ctx->flying_transfers);
-		/* first is irrelevant in this case */
-		goto out;
-	}
+	list_add_tail(&itransfer->list, &transfer->dev_handle->flying_transfers);
 
-	/* otherwise, find appropriate place in list */
-	for_each_transfer(ctx, cur) {
-		/* find first timeout that occurs after the transfer in question */
-		struct timespec *cur_ts = &cur->timeout;
+	/* transfers with infinite timeout are not tracked in the heap */
+	if (!TIMESPEC_IS_SET(timeout))
+		return 0;
 
-		if (!TIMESPEC_IS_SET(cur_ts) || TIMESPEC_CMP(cur_ts, timeout, >)) {
-			list_add_tail(&itransfer->list, &cur->list);
-			goto out;
-		}
-		first = 0;
+	r = timeout_heap_insert(ctx, itransfer);
+	if (r) {
+		list_del(&itransfer->list);
+		return r;
 	}
-	/* first is 0 at this stage (list not empty) */
 
-	/* otherwise we need to be inserted at the end */
-	list_add_tail(&itransfer->list, &ctx->flying_transfers);
-out:
 #ifdef HAVE_OS_TIMER
-	if (first && usbi_using_timer(ctx) && TIMESPEC_IS_SET(timeout)) {
+	if (itransfer->timeout_heap_idx == 1 && usbi_using_timer(ctx)) {
 		/* if this transfer has the lowest timeout of all active transfers,
 		 * rearm the timer with this transfer's timeout */
 		usbi_dbg(ctx, "arm timer for timeout in %ums (first in line)",
-			USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer)->timeout);
-		r = usbi_arm_timer(&ctx->timer, timeout);
+			transfer->timeout);
+		r = arm_timer(ctx, timeout);
 	}
-#else
-	UNUSED(first);
 #endif
 
-	if (r)
+	if (r) {
+		timeout_heap_remove(ctx, itransfer);
 		list_del(&itransfer->list);
+	}
 
 	return r;
 }
 
-/* remove a transfer from the active transfers list.
- * This function will *always* remove the transfer from the
- * flying_transfers list. It will return a LIBUSB_ERROR code
- * if it fails to update the timer for the next timeout. */
-static int remove_from_flying_list(struct usbi_transfer *itransfer)
+/* remove a transfer from the timeout heap, rearming the timer if it was the
+ * next one to time out. Takes the timeouts_lock, so it must not be called
+ * with usbi_transfer->lock held.
+ * returns 0 on success or a LIBUSB_ERROR code if it fails to update the timer.
+ */
+static int remove_from_timeout_heap(struct usbi_transfer *itransfer)
 {
 	struct libusb_context *ctx = ITRANSFER_CTX(itransfer);
 	int rearm_timer;
 	int r = 0;
 
-	usbi_mutex_lock(&ctx->flying_transfers_lock);
-	rearm_timer = (TIMESPEC_IS_SET(&itransfer->timeout) &&
-		list_first_entry(&ctx->flying_transfers, struct usbi_transfer, list) == itransfer);
-	list_del(&itransfer->list);
+	/* transfers with infinite timeout never enter the heap, and the
+	 * timeout does not change while the transfer is in flight, so there is
+	 * no need to take the context-wide lock for them */
+	if (!TIMESPEC_IS_SET(&itransfer->timeout))
+		return 0;
+
+	usbi_mutex_lock(&ctx->timeouts_lock);
+	rearm_timer = (itransfer->timeout_heap_idx == 1);
+	timeout_heap_remove(ctx, itransfer);
 	if (rearm_timer)
 		r = arm_timer_for_next_timeout(ctx);
-	usbi_mutex_unlock(&ctx->flying_transfers_lock);
+	usbi_mutex_unlock(&ctx->timeouts_lock);
 
 	return r;
 }
 
-/** \ingroup libusb_asyncio
- * Submit a transfer. This function will fire off the USB transfer and then
- * return immediately.
- *
- * \param transfer the transfer to submit
- * \returns 0 on success
- * \returns \ref LIBUSB_ERROR_NO_DEVICE if the device has been disconnected
- * \returns \ref LIBUSB_ERROR_BUSY if the transfer has already been submitted.
- * \returns \ref LIBUSB_ERROR_NOT_SUPPORTED if the transfer flags are not supported
- * by the operating system.
- * \returns \ref LIBUSB_ERROR_INVALID_PARAM if the transfer size is larger than
- * the operating system and/or hardware can support (see \ref asynclimits)
- * \returns another LIBUSB_ERROR code on other failure
+/* remove a transfer from its handle's active transfers list and from the
+ * timeout heap.
+ * must be called with the handle's flying_transfers_lock held.
+ * returns 0 on success or a LIBUSB_ERROR code if it fails to update the timer.
  */
-int API_EXPORTED libusb_submit_transfer(struct libusb_transfer *transfer)
+int usbi_remove_from_flying_list_locked(struct usbi_transfer *itransfer)
 {
-	struct usbi_transfer *itransfer =
-		LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
-	struct libusb_context *ctx;
+	list_del(&itransfer->list);
+	return remove_from_timeout_heap(itransfer);
+}
+
+/* remove a transfer from the active transfers list.
+ * This function will *always* remove the transfer from the
+ * flying_transfers list. It will return a LIBUSB_ERROR code
+ * if it fails to update the timer for the next timeout. */
+static int remove_from_flying_list(struct usbi_transfer *itransfer)
+{
+	struct libusb_device_handle *dev_handle =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer)->dev_handle;
 	int r;
 
-	assert(transfer->dev_handle);
-	if (itransfer->dev)
-		libusb_unref_device(itransfer->dev);
-	itransfer->dev = libusb_ref_device(transfer->dev_handle->dev);
+	/* the transfer was already taken off the list if its handle was
+	 * closed while it was in flight */
+	if (!dev_handle)
+		return remove_from_timeout_heap(itransfer);
 
-	ctx = HANDLE_CTX(transfer->dev_handle);
-	usbi_dbg(ctx, "transfer %p", (void *) transfer);
+	usbi_mutex_lock(&dev_handle->flying_transfers_lock);
+	r = usbi_remove_from_flying_list_locked(itransfer);
+	usbi_mutex_unlock(&dev_handle->flying_transfers_lock);
 
-	/*
-	 * Important note on locking, this function takes / releases locks
-	 * in the following order:
-	 *  take flying_transfers_lock
-	 *  take itransfer->lock
-	 *  clear transfer
-	 *  add to flying_transfers list
-	 *  release flying_transfers_lock
-	 *  submit transfer
-	 *  release itransfer->lock
-	 *  if submit failed:
-	 *   take flying_transfers_lock
-	 *   remove from flying_transfers list
-	 *   release flying_transfers_lock
-	 *
-	 * Note that it takes locks in the order a-b and then releases them
-	 * in the same order a-b. This is somewhat unusual but not wrong,
-	 * release order is not important as long as *all* locks are released
-	 * before re-acquiring any locks.
-	 *
-	 * This means that the ordering of first releasing itransfer->lock
-	 * and then re-acquiring the flying_transfers_list on error is
-	 * important and must not be changed!
-	 *
-	 * This is done this way because when we take both locks we must always
-	 * take flying_transfers_lock first to avoid ab-ba style deadlocks with
-	 * the timeout handling and usbi_handle_disconnect paths.
-	 *
-	 * And we cannot release itransfer->lock before the submission is
-	 * complete otherwise timeout handling for transfers with short
-	 * timeouts may run before submission.
-	 */
-	usbi_mutex_lock(&ctx->flying_transfers_lock);
-	usbi_mutex_lock(&itransfer->lock);
-	if (itransfer->state_flags & USBI_TRANSFER_IN_FLIGHT) {
-		usbi_mutex_unlock(&ctx->flying_transfers_lock);
-		usbi_mutex_unlock(&itransfer->lock);
-		return LIBUSB_ERROR_BUSY;
-	}
-	itransfer->transferred = 0;
-	itransfer->state_flags = 0;
-	itransfer->timeout_flags = 0;
-	r = add_to_flying_list(itransfer);
-	if (r) {
-		usbi_mutex_unlock(&ctx->flying_transfers_lock);
-		usbi_mutex_unlock(&itransfer->lock);
-		return r;
-	}
-	/*
-	 * We must release the flying transfers lock here, because with
-	 * some backends the submit_transfer method is synchronous.
-	 */
-	usbi_mutex_unlock(&ctx->flying_transfers_lock);
+	return r;
+}
 
-	r = usbi_backend.submit_transfer(itransfer);
-	if (r == LIBUSB_SUCCESS) {
-		itransfer->state_flags |= USBI_TRANSFER_IN_FLIGHT;
-	}
-	usbi_mutex_unlock(&itransfer->lock);
+/* starts measuring an event handling step, returns nonzero if event
+ * statistics are enabled on the context */
+static int event_stats_start(struct libusb_context *ctx, struct timespec *start)
+{
+	if (!usbi_atomic_load(&ctx->event_stats_enabled))
+		return 0;
 
-	if (r != LIBUSB_SUCCESS)
-		remove_from_flying_list(itransfer);
+	usbi_get_monotonic_time(start);
+	return 1;
+}
 
-	return r;
+static uint64_t event_stats_elapsed(const struct timespec *start)
+{
+	struct timespec now;
+
+	usbi_get_monotonic_time(&now);
+	TIMESPEC_SUB(&now, start, &now);
+	return (uint64_t)now.tv_sec * 1000000 + (uint64_t)(now.tv_nsec / 1000);
 }
 
-/** \ingroup libusb_asyncio
- * Asynchronously cancel a previously submitted transfer.
- * This function returns immediately, but this does not indicate cancellation
- * is complete. Your callback function will be invoked at some later time
- * with a transfer status of
- * \ref libusb_transfer_status::LIBUSB_TRANSFER_CANCELLED
- * "LIBUSB_TRANSFER_CANCELLED."
- *
- * This function behaves differently on Darwin-based systems (macOS and iOS):
- *
- * - Calling this function for one transfer will cause all transfers on the
- *   same endpoint to be cancelled. Your callback function will be invoked with
- *   a transfer status of
- *   \ref libusb_transfer_status::LIBUSB_TRANSFER_CANCELLED
- *   "LIBUSB_TRANSFER_CANCELLED" for each transfer that was cancelled.
+/* accounts for an event handling step which started at start. the time
+ * spent in the transfer callbacks that the step called is accounted for
+ * separately, so it is left out */
+static void event_stats_add(struct libusb_context *ctx, int measuring,
+	usbi_atomic64_t *counter, const struct timespec *start)
+{
+	struct usbi_event_handling *handling;
+	uint64_t elapsed;
+
+	if (!measuring)
+		return;
+
+	elapsed = event_stats_elapsed(start);
+	handling = usbi_event_handling_state(ctx);
+	if (handling) {
+		elapsed -= MIN(elapsed, handling->callback_time_us);
+		handling->callback_time_us = 0;
+	}
+	usbi_atomic64_add(counter, elapsed);
+}
+
+/* accounts for a wakeup of an event handler which started waiting at start */
+static void event_stats_wakeup(struct libusb_context *ctx, int measuring,
+	const struct timespec *start, struct usbi_reported_events *reported_events)
+{
+	if (!measuring)
+		return;
+
+	event_stats_add(ctx, measuring, &ctx->event_stats.wait_time_us, start);
+	usbi_atomic64_add(&ctx->event_stats.wakeups, 1);
+	if (!reported_events->event_bits && !reported_events->num_ready)
+		usbi_atomic64_add(&ctx->event_stats.empty_wakeups, 1);
+}
+
+/* accounts for a transfer callback that was called at start */
+static void event_stats_callback(struct libusb_context *ctx, int measuring,
+	const struct timespec *start)
+{
+	struct usbi_event_handling *handling;
+	uint64_t elapsed;
+
+	if (!measuring)
+		return;
+
+	elapsed = event_stats_elapsed(start);
+	usbi_atomic64_add(&ctx->event_stats.callbacks, 1);
+	usbi_atomic64_add(&ctx->event_stats.callback_time_us, elapsed);
+	usbi_atomic64_max(&ctx->event_stats.max_callback_time_us, elapsed);
+
+	handling = usbi_event_handling_state(ctx);
+	if (handling)
+		handling->callback_time_us += elapsed;
+}
+
+static struct usbi_endpoint_stats *transfer_stats(struct libusb_transfer *transfer)
+{
+	return &transfer->dev_handle->ep_stats[USBI_ENDPOINT_INDEX(transfer->endpoint)];
+}
+
+/* update the endpoint statistics for a transfer which the backend accepted,
+ * submit_time having been set before handing it over */
+static void stats_transfer_submitted(struct usbi_transfer *itransfer)
+{
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+
+	usbi_atomic64_add(&transfer_stats(transfer)->transfers_submitted, 1);
+}
+
+/* count a finished request of bytes bytes, submitted at submit_time */
+static void stats_add_completion(struct usbi_endpoint_stats *stats,
+	enum libusb_transfer_status status, uint64_t bytes, int is_short,
+	const struct timespec *submit_time)
+{
+	struct timespec latency;
+	long long usec;
+	int bucket = 0;
+
+	switch (status) {
+	case LIBUSB_TRANSFER_COMPLETED:
+		usbi_atomic64_add(&stats->transfers_completed, 1);
+		break;
+	case LIBUSB_TRANSFER_CANCELLED:
+		usbi_atomic64_add(&stats->transfers_cancelled, 1);
+		break;
+	case LIBUSB_TRANSFER_TIMED_OUT:
+		usbi_atomic64_add(&stats->transfers_timed_out, 1);
+		break;
+	default:
+		usbi_atomic64_add(&stats->transfers_failed, 1);
+		break;
+	}
+
+	if (is_short)
+		usbi_atomic64_add(&stats->short_transfers, 1);
+	if (bytes)
+		usbi_atomic64_add(&stats->bytes_transferred, bytes);
+
+	usbi_get_monotonic_time(&latency);
+	TIMESPEC_SUB(&latency, submit_time, &latency);
+	usec = (long long)latency.tv_sec * 1000000 + latency.tv_nsec / 1000;
+	while (usec > 0 && bucket < LIBUSB_ENDPOINT_STATS_LATENCY_BUCKETS - 1) {
+		usec >>= 1;
+		bucket++;
+	}
+	usbi_atomic64_add(&stats->latency_histogram[bucket], 1);
+}
+
+static void stats_transfer_completed(struct usbi_transfer *itransfer,
+	enum libusb_transfer_status status)
+{
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	struct usbi_endpoint_stats *stats;
+	uint64_t bytes = 0, iso_errors = 0;
+	int i, is_short = 0;
+
+	/* the handle was closed while the transfer was in flight */
+	if (!transfer->dev_handle)
+		return;
+
+	stats = transfer_stats(transfer);
+
+	if (transfer->type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS) {
+		if (itransfer->iso_summary_valid) {
+			bytes = itransfer->iso_summary.actual_length;
+			iso_errors = (uint64_t)itransfer->iso_summary.num_error_packets;
+		} else {
+			for (i = 0; i < transfer->num_iso_packets; i++) {
+				bytes += transfer->iso_packet_desc[i].actual_length;
+				if (transfer->iso_packet_desc[i].status != LIBUSB_TRANSFER_COMPLETED)
+					iso_errors++;
+			}
+		}
+		if (iso_errors)
+			usbi_atomic64_add(&stats->iso_packet_errors, iso_errors);
+	} else {
+		int rqlen = transfer->length;
+
+		if (transfer->type == LIBUSB_TRANSFER_TYPE_CONTROL)
+			rqlen -= LIBUSB_CONTROL_SETUP_SIZE;
+		is_short = status == LIBUSB_TRANSFER_COMPLETED && itransfer->transferred < rqlen;
+		bytes = (uint64_t)itransfer->transferred;
+	}
+
+	stats_add_completion(stats, status, bytes, is_short, &itransfer->submit_time);
+}
+
+/* Update the endpoint statistics for a synchronous request that the backend
+ * performed directly, without a transfer. r is the error code it returned,
+ * and transferred the number of bytes it moved out of length. */
+void usbi_stats_sync_transfer(struct libusb_device_handle *dev_handle,
+	unsigned char endpoint, int length, int transferred, int r,
+	const struct timespec *submit_time)
+{
+	struct usbi_endpoint_stats *stats =
+		&dev_handle->ep_stats[USBI_ENDPOINT_INDEX(endpoint)];
+	enum libusb_transfer_status status;
+
+	if (r == LIBUSB_SUCCESS)
+		status = LIBUSB_TRANSFER_COMPLETED;
+	else if (r == LIBUSB_ERROR_TIMEOUT)
+		status = LIBUSB_TRANSFER_TIMED_OUT;
+	else
+		status = LIBUSB_TRANSFER_ERROR;
+
+	usbi_atomic64_add(&stats->transfers_submitted, 1);
+	stats_add_completion(stats, status, (uint64_t)transferred,
+		status == LIBUSB_TRANSFER_COMPLETED && transferred < length,
+		submit_time);
+}
+
+/* transfer capture, see libusb_capture_start() */
+
+#define CAPTURE_MAX_RECORDS	(1UL << 24)
+#define CAPTURE_MAX_SNAPLEN	65535U
+
+struct usbi_capture {
+	/* the records, num_records slots of record_size bytes, in a shared
+	 * mapping of the capture file if map_len is non-zero */
+	unsigned char *records;
+	size_t record_size;
+	size_t map_len;
+
+	/* num_records is a power of 2, so that the slot of a record is the
+	 * low bits of its sequence minus 1, even once the sequence wraps */
+	unsigned long mask;
+	unsigned int snaplen;
+
+	/* number of records started so far */
+	usbi_atomic_t next;
+
+	/* sequence of the record completely written to each slot, 0 while it
+	 * is empty and CAPTURE_SLOT_BUSY while one is being written */
+	usbi_atomic_t *seqs;
+
+	/* number of records dropped because their slot was still being
+	 * written, or already held a newer record, see capture_claim() */
+	usbi_atomic_t dropped;
+};
+
+static struct libusb_capture_record *capture_slot(struct usbi_capture *capture,
+	unsigned long slot)
+{
+	return (struct libusb_capture_record *)
+		(capture->records + slot * capture->record_size);
+}
+
+/* copy the data of a transfer starting at offset, from the segments of a
+ * scatter-gather transfer if the backend uses them directly */
+static void capture_copy_data(struct usbi_transfer *itransfer, int offset,
+	unsigned char *dst, int len)
+{
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	int i;
+
+	if (!itransfer->iov || itransfer->iov_bounce) {
+		memcpy(dst, transfer->buffer + offset, (size_t)len);
+		return;
+	}
+
+	for (i = 0; i < itransfer->iovcnt && len > 0; i++) {
+		const struct libusb_iovec *iov = &itransfer->iov[i];
+		int n;
+
+		if (offset >= iov->length) {
+			offset -= iov->length;
+			continue;
+		}
+		n = MIN(iov->length - offset, len);
+		memcpy(dst, iov->buffer + offset, (size_t)n);
+		dst += n;
+		len -= n;
+		offset = 0;
+	}
+}
+
+#define CAPTURE_SLOT_BUSY	(-1L)
+
+/* Take a slot for writing the record with sequence seq, by replacing the
+ * sequence last published in it. A writer which is lapped by the ring while
+ * still writing keeps the slot until it is done, and a writer which comes
+ * after a newer record has been published must not replace it, so in both
+ * cases the record is dropped. Returns non-zero if the slot was taken. */
+static int capture_claim(struct usbi_capture *capture, unsigned long slot,
+	unsigned long seq)
+{
+	long cur = usbi_atomic_load(&capture->seqs[slot]);
+
+	for (;;) {
+		if (cur == CAPTURE_SLOT_BUSY ||
+		    (cur != 0 && (long)((unsigned long)cur - seq) >= 0)) {
+			(void)usbi_atomic_inc(&capture->dropped);
+			return 0;
+		}
+		if (usbi_atomic_cas(&capture->seqs[slot], cur, CAPTURE_SLOT_BUSY))
+			return 1;
+		cur = usbi_atomic_load(&capture->seqs[slot]);
+	}
+}
+
+static void capture_record(struct usbi_capture *capture,
+	struct usbi_transfer *itransfer, uint8_t event, int status)
+{
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	struct libusb_capture_record *record;
+	struct timespec now;
+	unsigned long seq, slot;
+	uint8_t endpoint = transfer->endpoint;
+	int has_data, offset = 0, length, data_length = 0;
+
+	has_data = transfer->buffer || (itransfer->iov && !itransfer->iov_bounce);
+	if (transfer->type == LIBUSB_TRANSFER_TYPE_CONTROL && transfer->buffer &&
+	    transfer->length >= (int)LIBUSB_CONTROL_SETUP_SIZE)
+		endpoint |= transfer->buffer[0] & LIBUSB_ENDPOINT_IN;
+
+	if (event == LIBUSB_CAPTURE_SUBMIT) {
+		length = transfer->length;
+		if (!(endpoint & LIBUSB_ENDPOINT_IN))
+			data_length = length;
+		else if (transfer->type == LIBUSB_TRANSFER_TYPE_CONTROL)
+			data_length = MIN(length, (int)LIBUSB_CONTROL_SETUP_SIZE);
+	} else if (event == LIBUSB_CAPTURE_COMPLETE) {
+		length = transfer->actual_length;
+		if (endpoint & LIBUSB_ENDPOINT_IN) {
+			data_length = length;
+			if (transfer->type == LIBUSB_TRANSFER_TYPE_CONTROL)
+				offset = LIBUSB_CONTROL_SETUP_SIZE;
+		}
+	} else {
+		length = transfer->length;
+	}
+	if (!has_data || data_length < 0)
+		data_length = 0;
+	data_length = MIN(data_length, (int)capture->snaplen);
+
+	usbi_get_real_time(&now);
+	seq = (unsigned long)usbi_atomic_inc(&capture->next);
+	slot = (seq - 1) & capture->mask;
+	record = capture_slot(capture, slot);
+
+	/* mark the slot as being written before overwriting it, both for
+	 * capture_write_pcap() and for readers of the capture file */
+	if (!capture_claim(capture, slot, seq))
+		return;
+	record->sequence = 0;
+	usbi_atomic_fence_release();
+
+	record->timestamp_ns = (uint64_t)now.tv_sec * NSEC_PER_SEC +
+		(uint64_t)now.tv_nsec;
+	record->transfer_id = (uint64_t)(uintptr_t)transfer;
+	record->record_size = (uint32_t)capture->record_size;
+	record->length = length;
+	record->status = status;
+	record->data_length = (uint32_t)data_length;
+	record->event = event;
+	record->type = transfer->type;
+	record->endpoint = endpoint;
+	record->bus_number = itransfer->dev->bus_number;
+	record->device_address = itransfer->dev->device_address;
+	if (data_length)
+		capture_copy_data(itransfer, offset, record->data, data_length);
+
+	/* publish the record once it is complete */
+	usbi_atomic_fence_release();
+	record->sequence = seq;
+	usbi_atomic_store(&capture->seqs[slot], (long)seq);
+}
+
+/* add a record for a transfer to the capture of its context, if any. this
+ * is a single load for contexts which are not capturing. */
+static void capture_transfer(struct usbi_transfer *itransfer, uint8_t event,
+	int status)
+{
+	struct libusb_context *ctx = ITRANSFER_CTX(itransfer);
+	struct usbi_capture *capture;
+
+	if (!ctx || !usbi_atomic_ptr_load(&ctx->capture))
+		return;
+
+	/* libusb_capture_stop() waits for writers after having cleared the
+	 * capture, so it is still there if it was seen here */
+	(void)usbi_atomic_inc(&ctx->capture_writers);
+	capture = usbi_atomic_ptr_load(&ctx->capture);
+	if (capture)
+		capture_record(capture, itransfer, event, status);
+	(void)usbi_atomic_dec(&ctx->capture_writers);
+}
+
+/* segment lengths that are a multiple of this are a whole number of packets
+ * for every maximum packet size that a bulk endpoint can have */
+#define IOVEC_PACKET_ALIGN	1024
+
+/* prepare the scatter-gather segments of a transfer for submission, either
+ * leaving them to the backend or gathering them into a bounce buffer */
+static int iovec_prepare(struct usbi_transfer *itransfer)
+{
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	const struct libusb_iovec *iov = itransfer->iov;
+	int direct, length = 0;
+	int i;
+
+	if (!iov)
+		return 0;
+
+	/* the bounce buffer of a transfer is only released on completion */
+	if (itransfer->iov_bounce)
+		return LIBUSB_ERROR_BUSY;
+
+	switch (transfer->type) {
+	case LIBUSB_TRANSFER_TYPE_BULK:
+	case LIBUSB_TRANSFER_TYPE_BULK_STREAM:
+		direct = IS_XFEROUT(transfer) &&
+			(usbi_backend.caps & USBI_CAP_SUPPORTS_BULK_OUT_IOVEC);
+		break;
+	case LIBUSB_TRANSFER_TYPE_INTERRUPT:
+		direct = 0;
+		break;
+	default:
+		return LIBUSB_ERROR_INVALID_PARAM;
+	}
+
+	for (i = 0; i < itransfer->iovcnt; i++) {
+		if (i < itransfer->iovcnt - 1 &&
+		    (iov[i].length % IOVEC_PACKET_ALIGN) != 0)
+			direct = 0;
+		length += iov[i].length;
+	}
+	transfer->length = length;
+
+	if (direct && length)
+		return 0;
+
+	itransfer->iov_bounce = malloc(length ? (size_t)length : 1);
+	if (!itransfer->iov_bounce)
+		return LIBUSB_ERROR_NO_MEM;
+
+	if (IS_XFEROUT(transfer)) {
+		unsigned char *p = itransfer->iov_bounce;
+
+		for (i = 0; i < itransfer->iovcnt; i++) {
+			memcpy(p, iov[i].buffer, (size_t)iov[i].length);
+			p += iov[i].length;
+		}
+	}
+	transfer->buffer = itransfer->iov_bounce;
+
+	return 0;
+}
+
+/* release the bounce buffer of a scatter-gather transfer, scattering the
+ * received data back into the segments if requested */
+static void iovec_release(struct usbi_transfer *itransfer, int copy_back)
+{
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	int i;
+
+	if (!itransfer->iov_bounce)
+		return;
+
+	if (copy_back && IS_XFERIN(transfer)) {
+		const unsigned char *p = itransfer->iov_bounce;
+		int remaining = itransfer->transferred;
+
+		for (i = 0; i < itransfer->iovcnt && remaining > 0; i++) {
+			int n = MIN(itransfer->iov[i].length, remaining);
+
+			memcpy(itransfer->iov[i].buffer, p, (size_t)n);
+			p += n;
+			remaining -= n;
+		}
+	}
+
+	free(itransfer->iov_bounce);
+	itransfer->iov_bounce = NULL;
+	transfer->buffer = NULL;
+}
+
+/* count the high-priority transfers in flight on the context, which decide
+ * whether other completions are held back in usbi_handle_transfer_completion().
+ * the count is taken before the backend sees the transfer, as it may complete
+ * it right away */
+static void priority_transfer_submitted(struct usbi_transfer *itransfer)
+{
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+
+	if (!(transfer->flags & LIBUSB_TRANSFER_HIGH_PRIORITY))
+		return;
+
+	itransfer->high_priority = 1;
+	(void)usbi_atomic_inc(&ITRANSFER_CTX(itransfer)->high_priority_in_flight);
+}
+
+static void priority_transfer_refused(struct usbi_transfer *itransfer)
+{
+	if (!itransfer->high_priority)
+		return;
+
+	itransfer->high_priority = 0;
+	(void)usbi_atomic_dec(&ITRANSFER_CTX(itransfer)->high_priority_in_flight);
+}
+
+/* add a transfer to the flying list and hand it to the backend. the caller
+ * must already hold a reference to the transfer's device in itransfer->dev. */
+static int submit_transfer(struct usbi_transfer *itransfer)
+{
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	struct libusb_device_handle *dev_handle = transfer->dev_handle;
+	struct libusb_context *ctx = HANDLE_CTX(dev_handle);
+	int has_timeout;
+	int r;
+
+	/*
+	 * Important note on locking, this function takes / releases locks
+	 * in the following order:
+	 *  take dev_handle->flying_transfers_lock
+	 *  take ctx->timeouts_lock (only if the transfer has a timeout)
+	 *  take itransfer->lock
+	 *  clear transfer
+	 *  add to flying_transfers list (and timeout heap)
+	 *  release ctx->timeouts_lock
+	 *  release dev_handle->flying_transfers_lock
+	 *  submit transfer
+	 *  release itransfer->lock
+	 *  if submit failed:
+	 *   take dev_handle->flying_transfers_lock
+	 *   remove from flying_transfers list
+	 *   release dev_handle->flying_transfers_lock
+	 *   take and release ctx->timeouts_lock to remove from timeout heap
+	 *
+	 * Note that it takes locks in the order a-b and then releases them
+	 * in the same order a-b. This is somewhat unusual but not wrong,
+	 * release order is not important as long as *all* locks are released
+	 * before re-acquiring any locks.
+	 *
+	 * This means that the ordering of first releasing itransfer->lock
+	 * and then re-acquiring the flying_transfers_list on error is
+	 * important and must not be changed!
+	 *
+	 * This is done this way because when we take these locks together we
+	 * must always take flying_transfers_lock first, then timeouts_lock, to
+	 * avoid ab-ba style deadlocks with the timeout handling and
+	 * usbi_handle_disconnect paths.
+	 *
+	 * And we cannot release itransfer->lock before the submission is
+	 * complete otherwise timeout handling for transfers with short
+	 * timeouts may run before submission.
+	 *
+	 * Transfers with infinite timeout never touch the context-wide
+	 * timeouts_lock, so transfers on different handles do not contend.
+	 */
+	has_timeout = (transfer->timeout != 0);
+	usbi_mutex_lock(&dev_handle->flying_transfers_lock);
+	if (has_timeout)
+		usbi_mutex_lock(&ctx->timeouts_lock);
+	usbi_mutex_lock(&itransfer->lock);
+	if (usbi_transfer_state(itransfer) & USBI_TRANSFER_IN_FLIGHT) {
+		if (has_timeout)
+			usbi_mutex_unlock(&ctx->timeouts_lock);
+		usbi_mutex_unlock(&dev_handle->flying_transfers_lock);
+		usbi_mutex_unlock(&itransfer->lock);
+		return LIBUSB_ERROR_BUSY;
+	}
+	itransfer->transferred = 0;
+	usbi_atomic_store(&itransfer->state_flags, 0);
+	itransfer->timeout_flags = 0;
+	itransfer->iso_summary_valid = 0;
+	r = add_to_flying_list(itransfer);
+	if (has_timeout)
+		usbi_mutex_unlock(&ctx->timeouts_lock);
+	if (r) {
+		usbi_mutex_unlock(&dev_handle->flying_transfers_lock);
+		usbi_mutex_unlock(&itransfer->lock);
+		return r;
+	}
+	/*
+	 * We must release the flying transfers lock here, because with
+	 * some backends the submit_transfer method is synchronous.
+	 */
+	usbi_mutex_unlock(&dev_handle->flying_transfers_lock);
+
+	/* the flag is set before the backend sees the transfer, so that the
+	 * lock-free checks never miss it. its completion clears it under the
+	 * lock held here, so cannot run before this function is done. */
+	usbi_get_monotonic_time(&itransfer->submit_time);
+	(void)usbi_transfer_update_state(itransfer, USBI_TRANSFER_IN_FLIGHT, 0);
+	priority_transfer_submitted(itransfer);
+	usbi_trace6(transfer__submit, transfer, dev_handle->dev->bus_number,
+		dev_handle->dev->device_address, transfer->endpoint, transfer->type,
+		transfer->length);
+	capture_transfer(itransfer, LIBUSB_CAPTURE_SUBMIT, 0);
+	r = usbi_backend.submit_transfer(itransfer);
+	if (r == LIBUSB_SUCCESS) {
+		stats_transfer_submitted(itransfer);
+	} else {
+		capture_transfer(itransfer, LIBUSB_CAPTURE_SUBMIT_ERROR, r);
+		priority_transfer_refused(itransfer);
+		(void)usbi_transfer_update_state(itransfer, 0, USBI_TRANSFER_IN_FLIGHT);
+	}
+	usbi_mutex_unlock(&itransfer->lock);
+
+	if (r != LIBUSB_SUCCESS)
+		remove_from_flying_list(itransfer);
+
+	return r;
+}
+
+/** \ingroup libusb_asyncio
+ * Submit a transfer. This function will fire off the USB transfer and then
+ * return immediately.
+ *
+ * \param transfer the transfer to submit
+ * \returns 0 on success
+ * \returns \ref LIBUSB_ERROR_NO_DEVICE if the device has been disconnected
+ * \returns \ref LIBUSB_ERROR_BUSY if the transfer has already been submitted.
+ * \returns \ref LIBUSB_ERROR_NOT_SUPPORTED if the transfer flags are not supported
+ * by the operating system.
+ * \returns \ref LIBUSB_ERROR_INVALID_PARAM if the transfer size is larger than
+ * the operating system and/or hardware can support (see \ref asynclimits)
+ * \returns another LIBUSB_ERROR code on other failure
+ */
+int API_EXPORTED libusb_submit_transfer(struct libusb_transfer *transfer)
+{
+	struct usbi_transfer *itransfer =
+		LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
+	int r;
+
+	assert(transfer->dev_handle);
+	if (itransfer->dev)
+		libusb_unref_device(itransfer->dev);
+	itransfer->dev = libusb_ref_device(transfer->dev_handle->dev);
+
+	usbi_dbg(HANDLE_CTX(transfer->dev_handle), "transfer %p", (void *) transfer);
+
+	r = iovec_prepare(itransfer);
+	if (r < 0)
+		return r;
+
+	r = submit_transfer(itransfer);
+	if (r < 0)
+		iovec_release(itransfer, 0);
+
+	return r;
+}
+
+/* number of transfers whose lock libusb_submit_transfers() holds at once */
+#define SUBMIT_BATCH_CHUNK	32
+
+/* Lock count transfers, at most SUBMIT_BATCH_CHUNK, in the order of their
+ * addresses rather than that of the array. The transfers are submitted in
+ * any order, and may be submitted again in another one after some of them
+ * were freed and reallocated, so this keeps them from ever being locked in
+ * opposite orders. */
+static void lock_transfer_chunk(struct libusb_transfer **transfers, int count)
+{
+	struct usbi_transfer *sorted[SUBMIT_BATCH_CHUNK];
+	int i, j;
+
+	for (i = 0; i < count; i++) {
+		struct usbi_transfer *itransfer =
+			LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfers[i]);
+
+		for (j = i; j > 0 && (uintptr_t)sorted[j - 1] > (uintptr_t)itransfer; j--)
+			sorted[j] = sorted[j - 1];
+		sorted[j] = itransfer;
+	}
+
+	for (i = 0; i < count; i++)
+		usbi_mutex_lock(&sorted[i]->lock);
+}
+
+/** \ingroup libusb_asyncio
+ * Submit several transfers at once. This behaves as if libusb_submit_transfer()
+ * was called on each transfer in turn, but the bookkeeping is done for groups
+ * of transfers while taking the internal locks only once per group, which
+ * reduces the per-transfer overhead when refilling a queue of transfers.
+ *
+ * All transfers must belong to the same device handle, and a transfer may
+ * appear only once in the array. They are submitted to the operating system
+ * in array order. If a submission fails, the remaining transfers are not
+ * submitted.
+ *
+ * \param transfers array of transfers to submit
+ * \param count number of transfers in the array
+ * \param error if not NULL, set to 0 if all transfers were submitted, or to
+ * the LIBUSB_ERROR code of the first transfer that could not be submitted.
+ * This is the only way to find out why a transfer other than the first one
+ * failed.
+ * \returns the number of transfers that were submitted, which is less than
+ * count if a submission failed
+ * \returns \ref LIBUSB_ERROR_INVALID_PARAM if the array is empty, a transfer
+ * appears more than once or the transfers do not all belong to the same
+ * device handle
+ * \returns a LIBUSB_ERROR code if the first transfer could not be submitted,
+ * see libusb_submit_transfer() for the possible values
+ *
+ * Since version 1.0.27, \ref LIBUSB_API_VERSION >= 0x0100010B
+ */
+int API_EXPORTED libusb_submit_transfers(struct libusb_transfer **transfers,
+	int count, int *error)
+{
+	struct libusb_device_handle *dev_handle;
+	struct libusb_context *ctx;
+	int has_timeout = 0;
+	int i, j, end, added, n, r = 0, add_r;
+
+	if (error)
+		*error = LIBUSB_ERROR_INVALID_PARAM;
+
+	if (!transfers || count <= 0)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	dev_handle = transfers[0]->dev_handle;
+	assert(dev_handle);
+	for (i = 0; i < count; i++) {
+		if (transfers[i]->dev_handle != dev_handle)
+			return LIBUSB_ERROR_INVALID_PARAM;
+		if (transfers[i]->timeout)
+			has_timeout = 1;
+
+		/* the transfer lock would be taken twice */
+		for (j = 0; j < i; j++) {
+			if (transfers[j] == transfers[i])
+				return LIBUSB_ERROR_INVALID_PARAM;
+		}
+	}
+
+	ctx = HANDLE_CTX(dev_handle);
+	usbi_dbg(ctx, "%d transfers starting with %p", count, (void *) transfers[0]);
+
+	for (i = 0; i < count; i++) {
+		struct usbi_transfer *itransfer =
+			LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfers[i]);
+
+		r = iovec_prepare(itransfer);
+		if (r < 0) {
+			while (i-- > 0)
+				iovec_release(LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfers[i]), 0);
+			if (error)
+				*error = r;
+			return r;
+		}
+
+		if (itransfer->dev)
+			libusb_unref_device(itransfer->dev);
+		itransfer->dev = libusb_ref_device(dev_handle->dev);
+	}
+
+	/*
+	 * The locks are taken in the same order as in libusb_submit_transfer(),
+	 * but the flying_transfers_lock and timeouts_lock are only taken once
+	 * for each chunk of up to SUBMIT_BATCH_CHUNK transfers. The locks of
+	 * all the transfers of the chunk are taken together, see
+	 * lock_transfer_chunk(). The lock of every transfer that made it onto
+	 * the flying list is kept until that transfer has been handed to the
+	 * backend, and all of them are released before the flying list is
+	 * touched again, either for the next chunk or to undo a failed
+	 * submission.
+	 */
+	r = LIBUSB_SUCCESS;
+	for (n = 0; n < count && r == LIBUSB_SUCCESS; ) {
+		end = MIN(count, n + SUBMIT_BATCH_CHUNK);
+
+		usbi_mutex_lock(&dev_handle->flying_transfers_lock);
+		if (has_timeout)
+			usbi_mutex_lock(&ctx->timeouts_lock);
+		lock_transfer_chunk(transfers + n, end - n);
+		for (added = n; added < end; added++) {
+			struct usbi_transfer *itransfer =
+				LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfers[added]);
+
+			if (usbi_transfer_state(itransfer) & USBI_TRANSFER_IN_FLIGHT) {
+				r = LIBUSB_ERROR_BUSY;
+				break;
+			}
+			itransfer->transferred = 0;
+			usbi_atomic_store(&itransfer->state_flags, 0);
+			itransfer->timeout_flags = 0;
+			itransfer->iso_summary_valid = 0;
+			r = add_to_flying_list(itransfer);
+			if (r)
+				break;
+		}
+		for (i = added; i < end; i++)
+			usbi_mutex_unlock(&LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfers[i])->lock);
+		if (has_timeout)
+			usbi_mutex_unlock(&ctx->timeouts_lock);
+		usbi_mutex_unlock(&dev_handle->flying_transfers_lock);
+
+		/* the transfers from n to added are on the flying list with
+		 * their lock held, and n counts those the backend accepts. They
+		 * are handed to the backend even if the transfer after them
+		 * could not be added, that error is only reported once they
+		 * have been. */
+		add_r = r;
+		r = LIBUSB_SUCCESS;
+		for (i = n; i < added; i++) {
+			struct usbi_transfer *itransfer =
+				LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfers[i]);
+
+			if (r == LIBUSB_SUCCESS) {
+				usbi_get_monotonic_time(&itransfer->submit_time);
+				(void)usbi_transfer_update_state(itransfer, USBI_TRANSFER_IN_FLIGHT, 0);
+				priority_transfer_submitted(itransfer);
+				usbi_trace6(transfer__submit, transfers[i], dev_handle->dev->bus_number,
+					dev_handle->dev->device_address, transfers[i]->endpoint,
+					transfers[i]->type, transfers[i]->length);
+				capture_transfer(itransfer, LIBUSB_CAPTURE_SUBMIT, 0);
+				r = usbi_backend.submit_transfer(itransfer);
+				if (r == LIBUSB_SUCCESS) {
+					stats_transfer_submitted(itransfer);
+					n++;
+				} else {
+					capture_transfer(itransfer, LIBUSB_CAPTURE_SUBMIT_ERROR, r);
+					priority_transfer_refused(itransfer);
+					(void)usbi_transfer_update_state(itransfer, 0, USBI_TRANSFER_IN_FLIGHT);
+				}
+			}
+			usbi_mutex_unlock(&itransfer->lock);
+		}
+
+		if (r == LIBUSB_SUCCESS) {
+			r = add_r;
+		} else {
+			/* take the transfers that were not submitted back off
+			 * the flying list */
+			for (i = n; i < added; i++)
+				remove_from_flying_list(LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfers[i]));
+		}
+	}
+
+	if (error)
+		*error = r;
+	if (r == LIBUSB_SUCCESS)
+		return count;
+
+	for (i = n; i < count; i++)
+		iovec_release(LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfers[i]), 0);
+
+	return n ? n : r;
+}
+
+struct libusb_transfer_ring {
+	struct libusb_context *ctx;
+	struct libusb_transfer **transfers;
+	int num_transfers;
+
+	/* backs the data buffers of the transfers */
+	struct libusb_dev_mem_pool *pool;
+
+	/* protects the fields below, and is held while a transfer of the ring
+	 * is being resubmitted or cancelled so that stopping the ring cannot
+	 * race with a resubmission */
+	usbi_mutex_t lock;
+	int running;
+	int in_flight;
+	int free_pending;
+
+	/* set once no transfer of the ring is in flight, for use with
+	 * libusb_handle_events_completed() */
+	int idle;
+
+	/* when set, completed transfers are collected in batch and handed to
+	 * batch_callback at the end of the event handling iteration. batch and
+	 * batch_count are protected by the context's event_waiters_lock, and
+	 * the ring is on the context's ring_batches while batch_count is not
+	 * zero. */
+	libusb_transfer_ring_batch_cb_fn batch_callback;
+	void *user_data;
+	struct libusb_transfer **batch;
+	int batch_count;
+	struct list_head batch_list;
+
+	/* number of transfers kept in flight. it stays at num_transfers unless
+	 * latency_target (in microseconds) is set, in which case it is adjusted
+	 * between min_depth and num_transfers once per round of completions,
+	 * and the transfers not needed are parked in spare. the averages are
+	 * in microseconds. */
+	int depth;
+	int min_depth;
+	unsigned int latency_target;
+	struct libusb_transfer **spare;
+	int num_spare;
+	int round;
+	long long latency_avg;
+	long long interval_avg;
+	struct timespec last_completion;
+};
+
+static void destroy_transfer_ring(struct libusb_transfer_ring *ring)
+{
+	int i;
+
+	/* the buffers are released along with the pool */
+	for (i = 0; i < ring->num_transfers; i++)
+		libusb_free_transfer(ring->transfers[i]);
+	libusb_dev_mem_pool_destroy(ring->pool);
+	usbi_mutex_destroy(&ring->lock);
+	free(ring->spare);
+	free(ring->batch);
+	free(ring->transfers);
+	free(ring);
+}
+
+/* Feed a completed transfer into the depth controller. Once the bus is kept
+ * busy, every transfer waits behind the others in flight and its latency from
+ * submission to completion is about depth times the interval between
+ * completions. A latency clearly below that means the queue ran dry and the
+ * bus sat idle, so the depth grows while the resulting latency stays within
+ * the target; a latency above the target makes it shrink. Called with the
+ * ring lock held. */
+static void transfer_ring_autotune(struct libusb_transfer_ring *ring,
+	struct usbi_transfer *itransfer)
+{
+	struct timespec now, delta;
+	long long latency, interval;
+
+	usbi_get_monotonic_time(&now);
+	TIMESPEC_SUB(&now, &itransfer->submit_time, &delta);
+	latency = (long long)delta.tv_sec * 1000000 + delta.tv_nsec / 1000;
+	if (!TIMESPEC_IS_SET(&ring->last_completion)) {
+		ring->last_completion = now;
+		ring->latency_avg = latency;
+		return;
+	}
+	TIMESPEC_SUB(&now, &ring->last_completion, &delta);
+	interval = (long long)delta.tv_sec * 1000000 + delta.tv_nsec / 1000;
+	ring->last_completion = now;
+
+	if (!ring->interval_avg)
+		ring->interval_avg = interval;
+	ring->latency_avg += (latency - ring->latency_avg) / 8;
+	ring->interval_avg += (interval - ring->interval_avg) / 8;
+
+	/* let the stream settle before looking at the averages again */
+	if (++ring->round < ring->depth)
+		return;
+	ring->round = 0;
+
+	if (ring->latency_avg > (long long)ring->latency_target) {
+		if (ring->depth > ring->min_depth)
+			ring->depth--;
+	} else if (ring->depth < ring->num_transfers &&
+	    ring->latency_avg * 10 < ring->interval_avg * ring->depth * 9 &&
+	    ring->latency_avg + ring->interval_avg <= (long long)ring->latency_target) {
+		ring->depth++;
+	} else {
+		return;
+	}
+
+	usbi_dbg(ring->ctx, "ring %p depth now %d (latency %lldus, interval %lldus)",
+		 (void *) ring, ring->depth, ring->latency_avg, ring->interval_avg);
+}
+
+/* submit parked transfers until the ring is back at its depth. called with the
+ * ring lock held */
+static void transfer_ring_fill(struct libusb_transfer_ring *ring)
+{
+	while (ring->in_flight < ring->depth && ring->num_spare) {
+		struct libusb_transfer *transfer = ring->spare[ring->num_spare - 1];
+
+		if (libusb_submit_transfer(transfer) < 0)
+			break;
+		ring->num_spare--;
+		ring->in_flight++;
+	}
+}
+
+/* called from usbi_handle_transfer_completion() with the event waiters lock
+ * held, after the user callback has returned */
+static void transfer_ring_completion(struct usbi_transfer *itransfer,
+	enum libusb_transfer_status status)
+{
+	struct libusb_transfer_ring *ring = itransfer->ring;
+	int destroy = 0;
+	int r;
+
+	usbi_mutex_lock(&ring->lock);
+	if (ring->running && (status == LIBUSB_TRANSFER_COMPLETED ||
+	    status == LIBUSB_TRANSFER_TIMED_OUT)) {
+		if (ring->latency_target) {
+			transfer_ring_autotune(ring, itransfer);
+			if (ring->in_flight > ring->depth) {
+				/* in_flight cannot drop to zero, depth is at least 1 */
+				ring->spare[ring->num_spare++] = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+				ring->in_flight--;
+				usbi_mutex_unlock(&ring->lock);
+				return;
+			}
+		}
+
+		/* the transfer was validated when it was first submitted and it
+		 * still holds its device reference, so go straight to the
+		 * flying list and the backend */
+		r = submit_transfer(itransfer);
+		if (r == LIBUSB_SUCCESS) {
+			if (ring->latency_target)
+				transfer_ring_fill(ring);
+			usbi_mutex_unlock(&ring->lock);
+			return;
+		}
+		usbi_dbg(ring->ctx, "resubmit of ring transfer %p failed: %s",
+			 (void *) USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer),
+			 libusb_error_name(r));
+	}
+
+	if (--ring->in_flight == 0) {
+		ring->idle = 1;
+		destroy = ring->free_pending;
+	}
+	usbi_mutex_unlock(&ring->lock);
+
+	if (destroy)
+		destroy_transfer_ring(ring);
+}
+
+/* called from usbi_handle_transfer_completion() in place of the callback when
+ * the ring has a batch callback */
+static void transfer_ring_batch_add(struct usbi_transfer *itransfer)
+{
+	struct libusb_transfer_ring *ring = itransfer->ring;
+	struct libusb_context *ctx = ring->ctx;
+
+	libusb_lock_event_waiters(ctx);
+	if (ring->batch_count++ == 0)
+		list_add_tail(&ring->batch_list, &ctx->ring_batches);
+	ring->batch[ring->batch_count - 1] = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	libusb_unlock_event_waiters(ctx);
+}
+
+/* Hand the transfers collected during this event handling iteration to the
+ * batch callbacks, then resubmit or retire them. Called by the event handler
+ * before it returns. */
+static void flush_ring_batches(struct libusb_context *ctx)
+{
+	struct timespec start;
+	int measuring;
+
+	libusb_lock_event_waiters(ctx);
+	while (!list_empty(&ctx->ring_batches)) {
+		struct libusb_transfer_ring *ring;
+		int i, count;
+
+		ring = list_first_entry(&ctx->ring_batches, struct libusb_transfer_ring, batch_list);
+		list_del(&ring->batch_list);
+		count = ring->batch_count;
+		ring->batch_count = 0;
+
+		measuring = event_stats_start(ctx, &start);
+		ring->batch_callback(ring, ring->batch, count, ring->user_data);
+		event_stats_callback(ctx, measuring, &start);
+
+		/* the last transfer retired may free the ring */
+		for (i = 0; i < count; i++) {
+			struct libusb_transfer *transfer = ring->batch[i];
+
+			transfer_ring_completion(LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer),
+				transfer->status);
+		}
+	}
+	libusb_unlock_event_waiters(ctx);
+}
+
+/** \ingroup libusb_asyncio
+ * Allocate a ring of transfers that libusb keeps queued on an endpoint for
+ * continuous streaming.
+ *
+ * The ring owns num_transfers transfers and a data buffer of length bytes for
+ * each of them. The buffers come from a \ref libusb_dev_mem_pool, so they use
+ * device memory where the platform supports it. Once started with libusb_start_transfer_ring(), every
+ * transfer that completes is passed to callback and is then resubmitted by
+ * libusb as soon as the callback returns, without the full validation done
+ * by libusb_submit_transfer(). The callback receives the transfer with
+ * user_data set to the value given here, and must not submit, cancel or free
+ * the transfer itself.
+ *
+ * A transfer is only resubmitted if it completed with status
+ * \ref LIBUSB_TRANSFER_COMPLETED or \ref LIBUSB_TRANSFER_TIMED_OUT. A
+ * transfer that fails for any other reason is retired from the ring, so
+ * that a stalled or disconnected endpoint does not cause a resubmission
+ * loop.
+ *
+ * For isochronous endpoints, each transfer has num_iso_packets packets and
+ * the buffer is split evenly between them. The transfers have no timeout.
+ * Other fields, such as the flags or the timeout, may be adjusted through
+ * libusb_transfer_ring_get_transfer() before the ring is started, except
+ * for \ref libusb_transfer_flags::LIBUSB_TRANSFER_FREE_BUFFER
+ * "LIBUSB_TRANSFER_FREE_BUFFER" and
+ * \ref libusb_transfer_flags::LIBUSB_TRANSFER_FREE_TRANSFER
+ * "LIBUSB_TRANSFER_FREE_TRANSFER", which are not allowed.
+ *
+ * Since version 1.0.27, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param dev_handle handle of the device the endpoint belongs to
+ * \param endpoint address of the endpoint
+ * \param type the endpoint type, one of \ref LIBUSB_TRANSFER_TYPE_BULK,
+ * \ref LIBUSB_TRANSFER_TYPE_INTERRUPT or
+ * \ref LIBUSB_TRANSFER_TYPE_ISOCHRONOUS
+ * \param num_transfers number of transfers kept queued
+ * \param length size of the data buffer of each transfer
+ * \param num_iso_packets number of isochronous packets per transfer, must be
+ * 0 for other endpoint types
+ * \param callback function called for each completed transfer
+ * \param user_data user data passed to the callback through the transfer
+ * \param ring output location for the newly allocated ring
+ * \returns 0 on success
+ * \returns \ref LIBUSB_ERROR_INVALID_PARAM if a parameter is invalid
+ * \returns \ref LIBUSB_ERROR_NO_MEM on memory allocation failure
+ */
+int API_EXPORTED libusb_alloc_transfer_ring(libusb_device_handle *dev_handle,
+	unsigned char endpoint, unsigned char type, int num_transfers,
+	int length, int num_iso_packets, libusb_transfer_cb_fn callback,
+	void *user_data, libusb_transfer_ring **ring)
+{
+	struct libusb_transfer_ring *_ring;
+	int i, r;
+
+	if (!dev_handle || !callback || !ring || num_transfers <= 0 ||
+	    length < 0)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	switch (type) {
+	case LIBUSB_TRANSFER_TYPE_BULK:
+	case LIBUSB_TRANSFER_TYPE_INTERRUPT:
+		if (num_iso_packets != 0)
+			return LIBUSB_ERROR_INVALID_PARAM;
+		break;
+	case LIBUSB_TRANSFER_TYPE_ISOCHRONOUS:
+		if (num_iso_packets <= 0)
+			return LIBUSB_ERROR_INVALID_PARAM;
+		break;
+	default:
+		return LIBUSB_ERROR_INVALID_PARAM;
+	}
+
+	_ring = calloc(1, sizeof(*_ring));
+	if (!_ring)
+		return LIBUSB_ERROR_NO_MEM;
+
+	_ring->transfers = calloc((size_t)num_transfers, sizeof(*_ring->transfers));
+	if (!_ring->transfers) {
+		free(_ring);
+		return LIBUSB_ERROR_NO_MEM;
+	}
+
+	_ring->batch = calloc((size_t)num_transfers, sizeof(*_ring->batch));
+	_ring->spare = calloc((size_t)num_transfers, sizeof(*_ring->spare));
+	if (!_ring->batch || !_ring->spare) {
+		free(_ring->spare);
+		free(_ring->batch);
+		free(_ring->transfers);
+		free(_ring);
+		return LIBUSB_ERROR_NO_MEM;
+	}
+
+	_ring->ctx = HANDLE_CTX(dev_handle);
+	_ring->num_transfers = num_transfers;
+	_ring->user_data = user_data;
+	_ring->idle = 1;
+	usbi_mutex_init(&_ring->lock);
+
+	r = libusb_dev_mem_pool_create(dev_handle, length ? (size_t)length : 1,
+		(unsigned int)num_transfers, &_ring->pool);
+	if (r < 0) {
+		destroy_transfer_ring(_ring);
+		return r;
+	}
+
+	for (i = 0; i < num_transfers; i++) {
+		struct libusb_transfer *transfer;
+		unsigned char *buffer;
+
+		transfer = libusb_alloc_transfer(num_iso_packets);
+		if (!transfer)
+			goto err_no_mem;
+		_ring->transfers[i] = transfer;
+
+		buffer = libusb_dev_mem_pool_alloc(_ring->pool);
+		if (!buffer)
+			goto err_no_mem;
+
+		transfer->dev_handle = dev_handle;
+		transfer->endpoint = endpoint;
+		transfer->type = type;
+		transfer->timeout = 0;
+		transfer->buffer = buffer;
+		transfer->length = length;
+		transfer->user_data = user_data;
+		transfer->callback = callback;
+		if (type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS) {
+			transfer->num_iso_packets = num_iso_packets;
+			libusb_set_iso_packet_lengths(transfer,
+				(unsigned int)(length / num_iso_packets));
+		}
+		LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer)->ring = _ring;
+	}
+
+	*ring = _ring;
+	return 0;
+
+err_no_mem:
+	destroy_transfer_ring(_ring);
+	return LIBUSB_ERROR_NO_MEM;
+}
+
+/** \ingroup libusb_asyncio
+ * Get one of the transfers of a ring, for example to adjust its fields
+ * before the ring is started.
+ *
+ * Since version 1.0.27, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param ring the transfer ring
+ * \param index index of the transfer, from 0 to num_transfers - 1
+ * \returns the transfer, or NULL if index is out of range
+ */
+DEFAULT_VISIBILITY
+struct libusb_transfer * LIBUSB_CALL libusb_transfer_ring_get_transfer(
+	libusb_transfer_ring *ring, int index)
+{
+	if (index < 0 || index >= ring->num_transfers)
+		return NULL;
+
+	return ring->transfers[index];
+}
+
+/** \ingroup libusb_asyncio
+ * Set a batch callback for a transfer ring. Instead of calling the callback
+ * given to libusb_alloc_transfer_ring() once per transfer, the event handler
+ * then collects the transfers of the ring that complete while it handles
+ * events, and passes them all to callback in a single call before returning.
+ * The transfers are resubmitted or retired, with the same rules as for the
+ * per-transfer callback, once callback returns.
+ *
+ * This amortises the callback overhead for high-rate streams, and lets the
+ * application process the packets of several transfers in one go. The
+ * callback must not submit, cancel or free the transfers.
+ *
+ * Since version 1.0.27, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param ring the transfer ring
+ * \param callback the batch callback, or NULL to go back to calling the
+ * per-transfer callback
+ * \returns 0 on success
+ * \returns \ref LIBUSB_ERROR_BUSY if the ring is running or still has
+ * transfers in flight
+ */
+int API_EXPORTED libusb_transfer_ring_set_batch_callback(
+	libusb_transfer_ring *ring, libusb_transfer_ring_batch_cb_fn callback)
+{
+	int r = 0;
+
+	usbi_mutex_lock(&ring->lock);
+	if (ring->running || ring->in_flight)
+		r = LIBUSB_ERROR_BUSY;
+	else
+		ring->batch_callback = callback;
+	usbi_mutex_unlock(&ring->lock);
+
+	return r;
+}
+
+/** \ingroup libusb_asyncio
+ * Let libusb adjust how many transfers of a ring are kept in flight. The ring
+ * then starts with min_depth transfers queued and, while running, watches the
+ * time each transfer takes from submission to completion and the interval
+ * between completions. It queues more transfers when the endpoint sits idle
+ * between completions, as long as the latency stays within latency_target,
+ * and fewer when the latency exceeds it. The depth never goes below min_depth
+ * nor above the number of transfers of the ring.
+ *
+ * Since version 1.0.27, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param ring the transfer ring
+ * \param min_depth the smallest number of transfers kept in flight
+ * \param latency_target the latency to stay within, in microseconds, or 0
+ * to keep all transfers of the ring in flight
+ * \returns 0 on success
+ * \returns \ref LIBUSB_ERROR_INVALID_PARAM if min_depth is out of range
+ * \returns \ref LIBUSB_ERROR_BUSY if the ring is running or still has
+ * transfers in flight
+ */
+int API_EXPORTED libusb_transfer_ring_set_autotune(libusb_transfer_ring *ring,
+	int min_depth, unsigned int latency_target)
+{
+	int r = 0;
+
+	if (latency_target && (min_depth < 1 || min_depth > ring->num_transfers))
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	usbi_mutex_lock(&ring->lock);
+	if (ring->running || ring->in_flight) {
+		r = LIBUSB_ERROR_BUSY;
+	} else {
+		ring->min_depth = min_depth;
+		ring->latency_target = latency_target;
+	}
+	usbi_mutex_unlock(&ring->lock);
+
+	return r;
+}
+
+/** \ingroup libusb_asyncio
+ * Start a transfer ring by submitting all of its transfers, or min_depth of
+ * them if libusb_transfer_ring_set_autotune() was used. From then on,
+ * completed transfers are resubmitted automatically until
+ * libusb_stop_transfer_ring() is called.
+ *
+ * Since version 1.0.27, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param ring the transfer ring
+ * \returns 0 on success
+ * \returns \ref LIBUSB_ERROR_BUSY if the ring is already running or still
+ * has transfers in flight
+ * \returns \ref LIBUSB_ERROR_INVALID_PARAM if a transfer has the
+ * \ref libusb_transfer_flags::LIBUSB_TRANSFER_FREE_BUFFER
+ * "LIBUSB_TRANSFER_FREE_BUFFER" or
+ * \ref libusb_transfer_flags::LIBUSB_TRANSFER_FREE_TRANSFER
+ * "LIBUSB_TRANSFER_FREE_TRANSFER" flag set
+ * \returns another LIBUSB_ERROR code if no transfer could be submitted, see
+ * libusb_submit_transfer(). If only some of the transfers could be submitted,
+ * the ring runs with those.
+ */
+int API_EXPORTED libusb_start_transfer_ring(libusb_transfer_ring *ring)
+{
+	int i, r;
+
+	for (i = 0; i < ring->num_transfers; i++) {
+		if (ring->transfers[i]->flags &
+		    (LIBUSB_TRANSFER_FREE_BUFFER | LIBUSB_TRANSFER_FREE_TRANSFER))
+			return LIBUSB_ERROR_INVALID_PARAM;
+		if (LIBUSB_TRANSFER_TO_USBI_TRANSFER(ring->transfers[i])->iov)
+			return LIBUSB_ERROR_INVALID_PARAM;
+	}
+
+	usbi_mutex_lock(&ring->lock);
+	if (ring->running || ring->in_flight) {
+		usbi_mutex_unlock(&ring->lock);
+		return LIBUSB_ERROR_BUSY;
+	}
+
+	ring->depth = ring->latency_target ? ring->min_depth : ring->num_transfers;
+	r = libusb_submit_transfers(ring->transfers, ring->depth, NULL);
+	if (r > 0) {
+		usbi_dbg(ring->ctx, "started ring %p with %d transfers", (void *) ring, r);
+		ring->running = 1;
+		ring->in_flight = r;
+		ring->idle = 0;
+
+		/* park the others in reverse order so they are used in order */
+		ring->num_spare = 0;
+		for (i = ring->num_transfers - 1; i >= r; i--)
+			ring->spare[ring->num_spare++] = ring->transfers[i];
+		ring->round = 0;
+		ring->latency_avg = 0;
+		ring->interval_avg = 0;
+		TIMESPEC_CLEAR(&ring->last_completion);
+		r = 0;
+	}
+	usbi_mutex_unlock(&ring->lock);
+
+	return r;
+}
+
+/** \ingroup libusb_asyncio
+ * Stop a transfer ring. Completed transfers are no longer resubmitted and
+ * the transfers still in flight are cancelled. This function returns
+ * immediately; the callback is still invoked for each cancelled transfer
+ * when events are handled. It is safe to call this function from the
+ * transfer callback.
+ *
+ * Since version 1.0.27, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param ring the transfer ring
+ */
+void API_EXPORTED libusb_stop_transfer_ring(libusb_transfer_ring *ring)
+{
+	int i;
+
+	usbi_mutex_lock(&ring->lock);
+	ring->running = 0;
+	if (ring->in_flight) {
+		for (i = 0; i < ring->num_transfers; i++)
+			libusb_cancel_transfer(ring->transfers[i]);
+	}
+	usbi_mutex_unlock(&ring->lock);
+}
+
+/** \ingroup libusb_asyncio
+ * Free a transfer ring, its transfers and their buffers. The ring is stopped
+ * first if needed, and this function then handles events until all of its
+ * transfers have been retired. When called from a transfer callback the
+ * ring is instead freed as soon as its last transfer is retired.
+ *
+ * Since version 1.0.27, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param ring the transfer ring to free. If NULL, no action is taken.
+ */
+void API_EXPORTED libusb_free_transfer_ring(libusb_transfer_ring *ring)
+{
+	struct libusb_context *ctx;
+	int r;
+
+	if (!ring)
+		return;
+
+	ctx = ring->ctx;
+	libusb_stop_transfer_ring(ring);
+
+	usbi_mutex_lock(&ring->lock);
+	if (ring->in_flight && usbi_handling_events(ctx)) {
+		ring->free_pending = 1;
+		usbi_mutex_unlock(&ring->lock);
+		return;
+	}
+	usbi_mutex_unlock(&ring->lock);
+
+	while (!ring->idle) {
+		r = libusb_handle_events_completed(ctx, &ring->idle);
+		if (r < 0 && r != LIBUSB_ERROR_INTERRUPTED) {
+			usbi_err(ctx, "libusb_handle_events failed: %s, freeing ring when it is idle",
+				 libusb_error_name(r));
+			usbi_mutex_lock(&ring->lock);
+			if (ring->in_flight) {
+				ring->free_pending = 1;
+				usbi_mutex_unlock(&ring->lock);
+				return;
+			}
+			usbi_mutex_unlock(&ring->lock);
+		}
+	}
+
+	destroy_transfer_ring(ring);
+}
+
+struct libusb_completion_queue {
+	struct libusb_context *ctx;
+
+	/* protects the list of completed transfers, whose callbacks are yet
+	 * to be invoked by libusb_completion_queue_dispatch() */
+	usbi_mutex_t lock;
+	usbi_cond_t cond;
+	struct list_head transfers;
+};
+
+/* Called by the event handler in place of invoking the callback */
+static void completion_queue_push(struct usbi_transfer *itransfer)
+{
+	struct libusb_completion_queue *queue = itransfer->completion_queue;
+
+	usbi_mutex_lock(&queue->lock);
+	list_add_tail(&itransfer->completed_list, &queue->transfers);
+	usbi_cond_broadcast(&queue->cond);
+	usbi_mutex_unlock(&queue->lock);
+}
+
+/** \ingroup libusb_asyncio
+ * Create a completion queue. Transfers that are associated with the queue
+ * through libusb_transfer_set_completion_queue() have their completion
+ * delivered to it by the event handler, and their callback is only invoked
+ * once a thread calls libusb_completion_queue_dispatch() on the queue.
+ *
+ * This lets each of several worker threads wait for the transfers it owns
+ * without taking part in event handling. Only the threads dispatching the
+ * queue are woken up when one of its transfers completes. Some thread still
+ * has to handle events on the context, as usual.
+ *
+ * Since version 1.0.27, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \param queue output location for the new queue
+ * \returns 0 on success
+ * \returns \ref LIBUSB_ERROR_INVALID_PARAM if queue is NULL
+ * \returns \ref LIBUSB_ERROR_NO_MEM on memory allocation failure
+ */
+int API_EXPORTED libusb_completion_queue_create(libusb_context *ctx,
+	libusb_completion_queue **queue)
+{
+	struct libusb_completion_queue *_queue;
+
+	if (!queue)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	_queue = calloc(1, sizeof(*_queue));
+	if (!_queue)
+		return LIBUSB_ERROR_NO_MEM;
+
+	_queue->ctx = usbi_get_context(ctx);
+	usbi_mutex_init(&_queue->lock);
+	usbi_cond_init(&_queue->cond);
+	list_init(&_queue->transfers);
+
+	*queue = _queue;
+	return 0;
+}
+
+/** \ingroup libusb_asyncio
+ * Destroy a completion queue. No transfer associated with the queue may be in
+ * flight, and any completion that has not been dispatched yet is lost.
+ *
+ * Since version 1.0.27, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param queue the queue to destroy. If NULL then the function simply returns.
+ */
+void API_EXPORTED libusb_completion_queue_destroy(libusb_completion_queue *queue)
+{
+	if (!queue)
+		return;
+
+	if (!list_empty(&queue->transfers))
+		usbi_warn(queue->ctx, "destroying completion queue with undispatched transfers");
+
+	usbi_cond_destroy(&queue->cond);
+	usbi_mutex_destroy(&queue->lock);
+	free(queue);
+}
+
+/** \ingroup libusb_asyncio
+ * Invoke the callbacks of the transfers that completed into a completion
+ * queue, waiting for one to complete if there are none yet. The callbacks are
+ * invoked from the calling thread. The same rules apply to them as to
+ * callbacks invoked from the event handler, including the handling of
+ * \ref libusb_transfer_flags::LIBUSB_TRANSFER_FREE_TRANSFER
+ * "LIBUSB_TRANSFER_FREE_TRANSFER".
+ *
+ * This function does not handle events. Another thread must do that for the
+ * transfers to complete at all.
+ *
+ * Since version 1.0.27, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param queue the queue to dispatch
+ * \param tv the maximum time to wait for a completion. A NULL value indicates
+ * unlimited timeout, a zeroed timeval makes the function non-blocking.
+ * \returns the number of callbacks that were invoked, which is 0 if the
+ * timeout expired
+ * \returns \ref LIBUSB_ERROR_INVALID_PARAM if tv is invalid
+ */
+int API_EXPORTED libusb_completion_queue_dispatch(libusb_completion_queue *queue,
+	struct timeval *tv)
+{
+	struct list_head completed;
+	struct usbi_transfer *itransfer;
+	struct timespec deadline, now, remaining;
+	struct timeval remaining_tv;
+	int count = 0;
+
+	if (tv && !TIMEVAL_IS_VALID(tv))
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	list_init(&completed);
+
+	/* the wait can wake up without a completion, so it is bounded by a
+	 * deadline rather than by tv each time */
+	if (tv) {
+		usbi_get_monotonic_time(&deadline);
+		deadline.tv_sec += tv->tv_sec;
+		deadline.tv_nsec += tv->tv_usec * 1000L;
+		if (deadline.tv_nsec >= NSEC_PER_SEC) {
+			deadline.tv_nsec -= NSEC_PER_SEC;
+			deadline.tv_sec++;
+		}
+	}
+
+	usbi_mutex_lock(&queue->lock);
+	while (list_empty(&queue->transfers)) {
+		if (!tv) {
+			usbi_cond_wait(&queue->cond, &queue->lock);
+			continue;
+		}
+
+		usbi_get_monotonic_time(&now);
+		if (!TIMESPEC_CMP(&now, &deadline, <)) {
+			usbi_mutex_unlock(&queue->lock);
+			return 0;
+		}
+		TIMESPEC_SUB(&deadline, &now, &remaining);
+		TIMESPEC_TO_TIMEVAL(&remaining_tv, &remaining);
+		(void)usbi_cond_timedwait(&queue->cond, &queue->lock, &remaining_tv);
+	}
+
+	/* only take what has completed so far, so that transfers resubmitted
+	 * by the callbacks cannot keep this thread here indefinitely */
+	while (!list_empty(&queue->transfers)) {
+		itransfer = list_first_entry(&queue->transfers, struct usbi_transfer, completed_list);
+		list_del(&itransfer->completed_list);
+		list_add_tail(&itransfer->completed_list, &completed);
+	}
+	usbi_mutex_unlock(&queue->lock);
+
+	while (!list_empty(&completed)) {
+		struct libusb_transfer *transfer;
+		uint8_t flags;
+
+		itransfer = list_first_entry(&completed, struct usbi_transfer, completed_list);
+		list_del(&itransfer->completed_list);
+		transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+
+		flags = transfer->flags;
+		if (transfer->callback)
+			transfer->callback(transfer);
+		/* transfer might have been freed by the above call, do not use
+		 * from this point. */
+		if (flags & LIBUSB_TRANSFER_FREE_TRANSFER)
+			libusb_free_transfer(transfer);
+		count++;
+	}
+
+	return count;
+}
+
+/** \ingroup libusb_asyncio
+ * Deliver the completion of a transfer to a completion queue, see
+ * libusb_completion_queue_create(). The association lasts until it is
+ * changed again and applies to all later submissions of the transfer.
+ *
+ * Transfers that belong to a transfer ring cannot use a completion queue.
+ *
+ * Since version 1.0.27, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param transfer the transfer, which must not be in flight
+ * \param queue the queue, which must belong to the context of the device the
+ * transfer is submitted to, or NULL to have the event handler invoke the
+ * callback again
+ * \returns 0 on success
+ * \returns \ref LIBUSB_ERROR_BUSY if the transfer is in flight
+ * \returns \ref LIBUSB_ERROR_NOT_SUPPORTED if the transfer belongs to a ring
+ */
+int API_EXPORTED libusb_transfer_set_completion_queue(
+	struct libusb_transfer *transfer, libusb_completion_queue *queue)
+{
+	struct usbi_transfer *itransfer =
+		LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
+	int r = 0;
+
+	if (itransfer->ring)
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+
+	usbi_mutex_lock(&itransfer->lock);
+	if (usbi_transfer_state(itransfer) & USBI_TRANSFER_IN_FLIGHT)
+		r = LIBUSB_ERROR_BUSY;
+	else
+		itransfer->completion_queue = queue;
+	usbi_mutex_unlock(&itransfer->lock);
+
+	return r;
+}
+
+static void capture_free(struct usbi_capture *capture)
+{
+#if !defined(PLATFORM_WINDOWS)
+	if (capture->map_len)
+		munmap(capture->records, capture->map_len);
+	else
+#endif
+		free(capture->records);
+	free(capture->seqs);
+	free(capture);
+}
+
+#if !defined(PLATFORM_WINDOWS)
+/* place the records in a shared mapping of a file, so that other processes
+ * can look at them while they are being captured */
+static int capture_map_file(struct usbi_capture *capture, const char *path,
+	size_t size)
+{
+	void *records;
+	int fd, r = 0;
+
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0)
+		return errno == EACCES ? LIBUSB_ERROR_ACCESS : LIBUSB_ERROR_IO;
+
+	if (ftruncate(fd, (off_t)size) < 0) {
+		r = LIBUSB_ERROR_IO;
+	} else {
+		records = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (records == MAP_FAILED) {
+			r = LIBUSB_ERROR_NO_MEM;
+		} else {
+			capture->records = records;
+			capture->map_len = size;
+		}
+	}
+	close(fd);
+
+	return r;
+}
+#endif
+
+/** \ingroup libusb_asyncio
+ * Start recording the transfers of a context. Each submission and each
+ * completion of a transfer, on any device of the context, adds a
+ * \ref libusb_capture_record to a ring of num_records records, which
+ * replaces the oldest ones once it is full. Writing a record takes no lock
+ * and does not allocate, and contexts which are not capturing only pay for
+ * checking that they are not. If the ring wraps around onto a slot while a
+ * record is still being written to it, only one of the two records is kept,
+ * and the number of records dropped is logged when the capture stops.
+ *
+ * The records can be written out with libusb_capture_write_pcap(). If path
+ * is not NULL, the ring is also a shared mapping of the file at path, so
+ * that other processes can inspect the records as they are made: the file
+ * is num_records slots of \ref libusb_capture_record::record_size
+ * "record_size" bytes, ordered by their
+ * \ref libusb_capture_record::sequence "sequence". A slot which is being
+ * overwritten has a sequence of 0, so a reader which copies a slot keeps
+ * the copy only if the sequence is the same, and not 0, before and after.
+ *
+ * Since version 1.0.27, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \param path file to keep the records in, or NULL to keep them in memory
+ * \param num_records number of records in the ring, rounded up to a power
+ * of 2, at most 16777216
+ * \param snaplen maximum number of bytes of data per record, at most 65535
+ * \returns 0 on success
+ * \returns \ref LIBUSB_ERROR_BUSY if the context is already capturing
+ * \returns \ref LIBUSB_ERROR_INVALID_PARAM if num_records or snaplen is out
+ * of range
+ * \returns \ref LIBUSB_ERROR_NOT_SUPPORTED if path is not NULL on Windows
+ * \returns \ref LIBUSB_ERROR_NO_MEM on memory allocation failure
+ * \returns \ref LIBUSB_ERROR_ACCESS or \ref LIBUSB_ERROR_IO if the file
+ * cannot be created
+ */
+int API_EXPORTED libusb_capture_start(libusb_context *ctx, const char *path,
+	unsigned int num_records, unsigned int snaplen)
+{
+	struct usbi_capture *capture;
+	unsigned long n = 1;
+	size_t size;
+	int r = 0;
+
+	ctx = usbi_get_context(ctx);
+	if (!num_records || num_records > CAPTURE_MAX_RECORDS ||
+	    snaplen > CAPTURE_MAX_SNAPLEN)
+		return LIBUSB_ERROR_INVALID_PARAM;
+#if defined(PLATFORM_WINDOWS)
+	if (path)
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+#endif
+
+	while (n < num_records)
+		n <<= 1;
+
+	capture = calloc(1, sizeof(*capture));
+	if (!capture)
+		return LIBUSB_ERROR_NO_MEM;
+
+	capture->record_size = (sizeof(struct libusb_capture_record) + snaplen + 7) &
+		~(size_t)7;
+	capture->mask = n - 1;
+	capture->snaplen = snaplen;
+	size = (size_t)n * capture->record_size;
+
+	capture->seqs = calloc(n, sizeof(*capture->seqs));
+	if (!capture->seqs) {
+		r = LIBUSB_ERROR_NO_MEM;
+#if !defined(PLATFORM_WINDOWS)
+	} else if (path) {
+		r = capture_map_file(capture, path, size);
+#endif
+	} else {
+		capture->records = calloc(1, size);
+		if (!capture->records)
+			r = LIBUSB_ERROR_NO_MEM;
+	}
+
+	if (r == 0) {
+		usbi_mutex_lock(&ctx->capture_lock);
+		if (!usbi_atomic_ptr_cas(&ctx->capture, NULL, capture))
+			r = LIBUSB_ERROR_BUSY;
+		usbi_mutex_unlock(&ctx->capture_lock);
+	}
+
+	if (r < 0) {
+		capture_free(capture);
+		return r;
+	}
+
+	usbi_dbg(ctx, "capturing %lu records of %u bytes of data", n, snaplen);
+	return 0;
+}
+
+/** \ingroup libusb_asyncio
+ * Stop the capture started with libusb_capture_start() and discard its
+ * records. A capture file stays behind with the records made until then.
+ * This is done automatically when the context is destroyed.
+ *
+ * Since version 1.0.27, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ */
+void API_EXPORTED libusb_capture_stop(libusb_context *ctx)
+{
+	struct usbi_capture *capture;
+
+	ctx = usbi_get_context(ctx);
+
+	usbi_mutex_lock(&ctx->capture_lock);
+	capture = usbi_atomic_ptr_exchange(&ctx->capture, NULL);
+
+	/* a record is written without blocking, so the writers which may still
+	 * be using the capture are done shortly */
+	while (usbi_atomic_load(&ctx->capture_writers))
+		;
+	usbi_mutex_unlock(&ctx->capture_lock);
+
+	if (capture) {
+		if (usbi_atomic_load(&capture->dropped))
+			usbi_warn(ctx, "%ld records dropped", (long)usbi_atomic_load(&capture->dropped));
+		capture_free(capture);
+	}
+}
+
+/* the pcap file format, with the header of the binary usbmon interface of
+ * Linux before each packet (LINKTYPE_USB_LINUX_MMAPPED), all fields in host
+ * byte order */
+#define PCAP_MAGIC			0xa1b2c3d4U
+#define PCAP_LINKTYPE_USB_LINUX_MMAPPED	220
+
+struct pcap_file_header {
+	uint32_t magic;
+	uint16_t version_major;
+	uint16_t version_minor;
+	int32_t thiszone;
+	uint32_t sigfigs;
+	uint32_t snaplen;
+	uint32_t linktype;
+};
+
+struct pcap_packet_header {
+	uint32_t ts_sec;
+	uint32_t ts_usec;
+	uint32_t incl_len;
+	uint32_t orig_len;
+};
+
+struct usbmon_packet {
+	uint64_t id;
+	uint8_t type;
+	uint8_t xfer_type;
+	uint8_t epnum;
+	uint8_t devnum;
+	uint16_t busnum;
+	int8_t flag_setup;
+	int8_t flag_data;
+	int64_t ts_sec;
+	int32_t ts_usec;
+	int32_t status;
+	uint32_t length;
+	uint32_t len_cap;
+	uint8_t setup[LIBUSB_CONTROL_SETUP_SIZE];
+	int32_t interval;
+	int32_t start_frame;
+	uint32_t xfer_flags;
+	uint32_t ndesc;
+};
+
+static uint8_t usbmon_xfer_type(uint8_t type)
+{
+	switch (type) {
+	case LIBUSB_TRANSFER_TYPE_ISOCHRONOUS:
+		return 0;
+	case LIBUSB_TRANSFER_TYPE_INTERRUPT:
+		return 1;
+	case LIBUSB_TRANSFER_TYPE_CONTROL:
+		return 2;
+	default:
+		return 3;
+	}
+}
+
+/* status of a record as the negative Linux errno that usbmon reports */
+static int32_t usbmon_status(const struct libusb_capture_record *record)
+{
+	if (record->event == LIBUSB_CAPTURE_SUBMIT)
+		return -115;	/* EINPROGRESS */
+
+	if (record->event == LIBUSB_CAPTURE_COMPLETE) {
+		switch (record->status) {
+		case LIBUSB_TRANSFER_COMPLETED:
+			return 0;
+		case LIBUSB_TRANSFER_TIMED_OUT:
+			return -110;	/* ETIMEDOUT */
+		case LIBUSB_TRANSFER_CANCELLED:
+			return -2;	/* ENOENT */
+		case LIBUSB_TRANSFER_STALL:
+			return -32;	/* EPIPE */
+		case LIBUSB_TRANSFER_NO_DEVICE:
+			return -19;	/* ENODEV */
+		case LIBUSB_TRANSFER_OVERFLOW:
+			return -75;	/* EOVERFLOW */
+		default:
+			return -71;	/* EPROTO */
+		}
+	}
+
+	switch (record->status) {
+	case LIBUSB_ERROR_NO_DEVICE:
+		return -19;	/* ENODEV */
+	case LIBUSB_ERROR_BUSY:
+		return -16;	/* EBUSY */
+	case LIBUSB_ERROR_INVALID_PARAM:
+		return -22;	/* EINVAL */
+	case LIBUSB_ERROR_NO_MEM:
+		return -12;	/* ENOMEM */
+	default:
+		return -5;	/* EIO */
+	}
+}
+
+static int pcap_write_record(FILE *f, const struct libusb_capture_record *record)
+{
+	struct pcap_packet_header packet;
+	struct usbmon_packet usbmon;
+	const unsigned char *data = record->data;
+	uint32_t data_length = record->data_length;
+	uint32_t length = record->length > 0 ? (uint32_t)record->length : 0;
+
+	memset(&usbmon, 0, sizeof(usbmon));
+	usbmon.id = record->transfer_id;
+	if (record->event == LIBUSB_CAPTURE_SUBMIT)
+		usbmon.type = 'S';
+	else if (record->event == LIBUSB_CAPTURE_COMPLETE)
+		usbmon.type = 'C';
+	else
+		usbmon.type = 'E';
+	usbmon.xfer_type = usbmon_xfer_type(record->type);
+	usbmon.epnum = record->endpoint;
+	usbmon.devnum = record->device_address;
+	usbmon.busnum = record->bus_number;
+	usbmon.ts_sec = (int64_t)(record->timestamp_ns / NSEC_PER_SEC);
+	usbmon.ts_usec = (int32_t)((record->timestamp_ns % NSEC_PER_SEC) / 1000);
+	usbmon.status = usbmon_status(record);
+
+	/* usbmon reports the setup packet of a control transfer separately
+	 * from its data */
+	usbmon.flag_setup = '-';
+	if (record->type == LIBUSB_TRANSFER_TYPE_CONTROL &&
+	    record->event == LIBUSB_CAPTURE_SUBMIT &&
+	    data_length >= LIBUSB_CONTROL_SETUP_SIZE) {
+		memcpy(usbmon.setup, data, LIBUSB_CONTROL_SETUP_SIZE);
+		usbmon.flag_setup = 0;
+		data += LIBUSB_CONTROL_SETUP_SIZE;
+		data_length -= LIBUSB_CONTROL_SETUP_SIZE;
+		length -= LIBUSB_CONTROL_SETUP_SIZE;
+	}
+	usbmon.length = length;
+	usbmon.len_cap = data_length;
+	if (data_length)
+		usbmon.flag_data = 0;
+	else
+		usbmon.flag_data = (record->endpoint & LIBUSB_ENDPOINT_IN) ? '<' : '>';
+
+	packet.ts_sec = (uint32_t)usbmon.ts_sec;
+	packet.ts_usec = (uint32_t)usbmon.ts_usec;
+	packet.incl_len = (uint32_t)sizeof(usbmon) + data_length;
+	packet.orig_len = (uint32_t)sizeof(usbmon) + (data_length ? length : 0);
+
+	if (fwrite(&packet, sizeof(packet), 1, f) != 1 ||
+	    fwrite(&usbmon, sizeof(usbmon), 1, f) != 1 ||
+	    (data_length && fwrite(data, data_length, 1, f) != 1))
+		return LIBUSB_ERROR_IO;
+
+	return 0;
+}
+
+static int capture_write_pcap(struct usbi_capture *capture, const char *path)
+{
+	struct pcap_file_header header;
+	struct libusb_capture_record *record;
+	unsigned long seq, end, count;
+	FILE *f;
+	int r = 0;
+
+	record = malloc(capture->record_size);
+	if (!record)
+		return LIBUSB_ERROR_NO_MEM;
+
+	f = fopen(path, "wb");
+	if (!f) {
+		free(record);
+		return LIBUSB_ERROR_IO;
+	}
+
+	header.magic = PCAP_MAGIC;
+	header.version_major = 2;
+	header.version_minor = 4;
+	header.thiszone = 0;
+	header.sigfigs = 0;
+	header.snaplen = (uint32_t)sizeof(struct usbmon_packet) + capture->snaplen;
+	header.linktype = PCAP_LINKTYPE_USB_LINUX_MMAPPED;
+	if (fwrite(&header, sizeof(header), 1, f) != 1)
+		r = LIBUSB_ERROR_IO;
+
+	/* the records still in the ring, oldest first. those overwritten
+	 * while being copied are skipped */
+	end = (unsigned long)usbi_atomic_load(&capture->next);
+	count = MIN(end, capture->mask + 1);
+	for (seq = end - count + 1; r == 0 && count; seq++, count--) {
+		unsigned long slot = (seq - 1) & capture->mask;
+
+		if ((unsigned long)usbi_atomic_load(&capture->seqs[slot]) != seq)
+			continue;
+		memcpy(record, capture_slot(capture, slot), capture->record_size);
+		usbi_atomic_fence_acquire();
+		if ((unsigned long)usbi_atomic_load(&capture->seqs[slot]) != seq)
+			continue;
+
+		r = pcap_write_record(f, record);
+	}
+
+	if (fclose(f) != 0 && r == 0)
+		r = LIBUSB_ERROR_IO;
+	free(record);
+
+	return r;
+}
+
+/** \ingroup libusb_asyncio
+ * Write the records of the capture started with libusb_capture_start() to
+ * a file in the pcap format, as if they had been captured with usbmon on
+ * Linux, so that tools such as Wireshark can read it. The capture goes on
+ * and records made while the file is written may or may not be included.
+ *
+ * Isochronous packet descriptors are not captured, so for isochronous
+ * transfers only their data, up to the snapshot length, is in the file.
+ *
+ * Since version 1.0.27, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \param path file to write, which is replaced if it exists
+ * \returns 0 on success
+ * \returns \ref LIBUSB_ERROR_NOT_FOUND if the context is not capturing
+ * \returns \ref LIBUSB_ERROR_IO if the file cannot be written
+ * \returns \ref LIBUSB_ERROR_NO_MEM on memory allocation failure
+ */
+int API_EXPORTED libusb_capture_write_pcap(libusb_context *ctx,
+	const char *path)
+{
+	struct usbi_capture *capture;
+	int r;
+
+	ctx = usbi_get_context(ctx);
+
+	usbi_mutex_lock(&ctx->capture_lock);
+	capture = usbi_atomic_ptr_load(&ctx->capture);
+	if (capture)
+		r = capture_write_pcap(capture, path);
+	else
+		r = LIBUSB_ERROR_NOT_FOUND;
+	usbi_mutex_unlock(&ctx->capture_lock);
+
+	return r;
+}
+
+/* Request cancellation of a transfer. Must be called with the transfer's
+ * lock held. */
+static int cancel_transfer_locked(struct usbi_transfer *itransfer)
+{
+	struct libusb_context *ctx = ITRANSFER_CTX(itransfer);
+	uint32_t state = usbi_transfer_state(itransfer);
+	int r;
+
+	if (!(state & USBI_TRANSFER_IN_FLIGHT) || (state & USBI_TRANSFER_CANCELLING))
+		return LIBUSB_ERROR_NOT_FOUND;
+
+	usbi_trace4(transfer__cancel, USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer),
+		itransfer->dev->bus_number, itransfer->dev->device_address,
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer)->endpoint);
+
+	r = usbi_backend.cancel_transfer(itransfer);
+	if (r < 0) {
+		if (r != LIBUSB_ERROR_NOT_FOUND &&
+		    r != LIBUSB_ERROR_NO_DEVICE)
+			usbi_err(ctx, "cancel transfer failed error %d", r);
+		else
+			usbi_dbg(ctx, "cancel transfer failed error %d", r);
+
+		if (r == LIBUSB_ERROR_NO_DEVICE)
+			(void)usbi_transfer_update_state(itransfer,
+				USBI_TRANSFER_DEVICE_DISAPPEARED, 0);
+	}
+
+	(void)usbi_transfer_update_state(itransfer, USBI_TRANSFER_CANCELLING, 0);
+
+	return r;
+}
+
+/** \ingroup libusb_asyncio
+ * Asynchronously cancel a previously submitted transfer.
+ * This function returns immediately, but this does not indicate cancellation
+ * is complete. Your callback function will be invoked at some later time
+ * with a transfer status of
+ * \ref libusb_transfer_status::LIBUSB_TRANSFER_CANCELLED
+ * "LIBUSB_TRANSFER_CANCELLED."
+ *
+ * This function behaves differently on Darwin-based systems (macOS and iOS):
+ *
+ * - Calling this function for one transfer will cause all transfers on the
+ *   same endpoint to be cancelled. Your callback function will be invoked with
+ *   a transfer status of
+ *   \ref libusb_transfer_status::LIBUSB_TRANSFER_CANCELLED
+ *   "LIBUSB_TRANSFER_CANCELLED" for each transfer that was cancelled.
 
  * - When built for macOS versions prior to 10.5, this function sends a
  *   \c ClearFeature(ENDPOINT_HALT) request for the transfer's endpoint.
@@ -1604,78 +3920,694 @@ int API_EXPORTED libusb_submit_transfer(struct libusb_transfer *transfer)
  *
  * \param transfer the transfer to cancel
  * \returns 0 on success
- * \returns \ref LIBUSB_ERROR_NOT_FOUND if the transfer is not in progress,
- * already complete, or already cancelled.
- * \returns a LIBUSB_ERROR code on failure
+ * \returns \ref LIBUSB_ERROR_NOT_FOUND if the transfer is not in progress,
+ * already complete, or already cancelled.
+ * \returns a LIBUSB_ERROR code on failure
+ */
+int API_EXPORTED libusb_cancel_transfer(struct libusb_transfer *transfer)
+{
+	struct usbi_transfer *itransfer =
+		LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
+	int r;
+
+	usbi_dbg(ITRANSFER_CTX(itransfer), "transfer %p", (void *) transfer );
+
+	/* nothing to do, and no need to wait for a submission or completion
+	 * in progress to find that out */
+	if ((usbi_transfer_state(itransfer) & (USBI_TRANSFER_IN_FLIGHT | USBI_TRANSFER_CANCELLING))
+			!= USBI_TRANSFER_IN_FLIGHT)
+		return LIBUSB_ERROR_NOT_FOUND;
+
+	usbi_mutex_lock(&itransfer->lock);
+	r = cancel_transfer_locked(itransfer);
+	usbi_mutex_unlock(&itransfer->lock);
+	return r;
+}
+
+/** \ingroup libusb_asyncio
+ * Asynchronously cancel all the transfers in flight on an endpoint of a
+ * device handle. This function returns immediately, and each cancelled
+ * transfer completes later with status \ref LIBUSB_TRANSFER_CANCELLED, as
+ * with libusb_cancel_transfer().
+ *
+ * This is cheaper than cancelling a deep queue one transfer at a time: the
+ * list of transfers of the handle is walked once, and where the platform can
+ * abort a whole pipe (macOS) that is done with a single request. Transfers
+ * submitted while this function runs are not affected.
+ *
+ * The same caveats as for libusb_cancel_transfer() apply regarding the
+ * state of the endpoint after cancellation.
+ *
+ * Since version 1.0.27, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param dev_handle a device handle
+ * \param endpoint address of the endpoint
+ * \returns the number of transfers whose cancellation was requested, 0 if
+ * no transfer was in flight on the endpoint
+ * \returns \ref LIBUSB_ERROR_NO_DEVICE if the device has been disconnected
+ * \returns another LIBUSB_ERROR code on failure
+ */
+int API_EXPORTED libusb_cancel_endpoint_transfers(libusb_device_handle *dev_handle,
+	unsigned char endpoint)
+{
+	struct libusb_context *ctx = HANDLE_CTX(dev_handle);
+	struct usbi_transfer *itransfer;
+	int try_abort = usbi_backend.cancel_endpoint_transfers != NULL;
+	int aborted = 0, count = 0;
+	int r = LIBUSB_SUCCESS;
+
+	usbi_dbg(ctx, "endpoint 0x%02x", endpoint);
+
+	/* holding the flying transfers lock keeps new transfers off the
+	 * endpoint until every transfer found here is marked as cancelling */
+	usbi_mutex_lock(&dev_handle->flying_transfers_lock);
+	for_each_transfer(dev_handle, itransfer) {
+		struct libusb_transfer *transfer =
+			USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+
+		if (transfer->endpoint != endpoint)
+			continue;
+
+		if ((usbi_transfer_state(itransfer) & (USBI_TRANSFER_IN_FLIGHT | USBI_TRANSFER_CANCELLING))
+				!= USBI_TRANSFER_IN_FLIGHT)
+			continue;
+
+		/* look again, the transfer may have completed meanwhile */
+		usbi_mutex_lock(&itransfer->lock);
+		if ((usbi_transfer_state(itransfer) & (USBI_TRANSFER_IN_FLIGHT | USBI_TRANSFER_CANCELLING))
+				!= USBI_TRANSFER_IN_FLIGHT) {
+			usbi_mutex_unlock(&itransfer->lock);
+			continue;
+		}
+
+		if (try_abort) {
+			try_abort = 0;
+			r = usbi_backend.cancel_endpoint_transfers(dev_handle, endpoint);
+			if (r == LIBUSB_SUCCESS) {
+				aborted = 1;
+			} else if (r != LIBUSB_ERROR_NOT_SUPPORTED) {
+				usbi_mutex_unlock(&itransfer->lock);
+				break;
+			}
+		}
+
+		if (aborted) {
+			(void)usbi_transfer_update_state(itransfer, USBI_TRANSFER_CANCELLING, 0);
+		} else {
+			r = cancel_transfer_locked(itransfer);
+			if (r == LIBUSB_ERROR_NO_DEVICE) {
+				usbi_mutex_unlock(&itransfer->lock);
+				break;
+			}
+		}
+		usbi_mutex_unlock(&itransfer->lock);
+		count++;
+	}
+	usbi_mutex_unlock(&dev_handle->flying_transfers_lock);
+
+	if (r == LIBUSB_ERROR_NO_DEVICE || (r < 0 && count == 0))
+		return r;
+
+	return count;
+}
+
+/** \ingroup libusb_asyncio
+ * Get the transfer statistics of an endpoint. libusb counts the transfers
+ * submitted on each endpoint of a device handle as they are submitted and
+ * complete, as well as their outcome, the amount of data and the time they
+ * took, see \ref libusb_endpoint_stats. The requests of the synchronous I/O
+ * functions are counted as well, whether or not the backend performed them
+ * without a transfer.
+ *
+ * Each counter is read atomically, but transfers completing meanwhile may be
+ * reflected in some of the counters and not yet in others.
+ *
+ * Since version 1.0.27, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param dev_handle a device handle
+ * \param endpoint the address of the endpoint, 0 for the default control
+ * endpoint
+ * \param stats output location for the statistics
+ * \returns 0 on success
+ * \returns \ref LIBUSB_ERROR_INVALID_PARAM if endpoint is not a valid
+ * endpoint address
+ */
+int API_EXPORTED libusb_get_endpoint_stats(libusb_device_handle *dev_handle,
+	unsigned char endpoint, struct libusb_endpoint_stats *stats)
+{
+	struct usbi_endpoint_stats *ep_stats;
+	int i;
+
+	if (endpoint & ~(LIBUSB_ENDPOINT_DIR_MASK | LIBUSB_ENDPOINT_ADDRESS_MASK))
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	ep_stats = &dev_handle->ep_stats[USBI_ENDPOINT_INDEX(endpoint)];
+
+	stats->transfers_submitted = usbi_atomic64_load(&ep_stats->transfers_submitted);
+	stats->transfers_completed = usbi_atomic64_load(&ep_stats->transfers_completed);
+	stats->transfers_cancelled = usbi_atomic64_load(&ep_stats->transfers_cancelled);
+	stats->transfers_timed_out = usbi_atomic64_load(&ep_stats->transfers_timed_out);
+	stats->transfers_failed = usbi_atomic64_load(&ep_stats->transfers_failed);
+	stats->bytes_transferred = usbi_atomic64_load(&ep_stats->bytes_transferred);
+	stats->short_transfers = usbi_atomic64_load(&ep_stats->short_transfers);
+	stats->iso_packet_errors = usbi_atomic64_load(&ep_stats->iso_packet_errors);
+	for (i = 0; i < LIBUSB_ENDPOINT_STATS_LATENCY_BUCKETS; i++)
+		stats->latency_histogram[i] = usbi_atomic64_load(&ep_stats->latency_histogram[i]);
+
+	return LIBUSB_SUCCESS;
+}
+
+/** \ingroup libusb_asyncio
+ * Get the outcome of all the packets of a completed isochronous transfer,
+ * see \ref libusb_iso_transfer_summary. Call this from the transfer callback
+ * or later, before the transfer is submitted again.
+ *
+ * Backends that already visit every packet when the transfer completes
+ * provide the summary for free, otherwise the packet descriptors are
+ * scanned here.
+ *
+ * Since version 1.0.27, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param transfer a completed isochronous transfer
+ * \param summary output location for the summary
+ * \returns 0 on success
+ * \returns \ref LIBUSB_ERROR_INVALID_PARAM if the transfer is not
+ * isochronous
+ */
+int API_EXPORTED libusb_get_iso_transfer_summary(struct libusb_transfer *transfer,
+	struct libusb_iso_transfer_summary *summary)
+{
+	struct usbi_transfer *itransfer = LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
+	int i;
+
+	if (transfer->type != LIBUSB_TRANSFER_TYPE_ISOCHRONOUS)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	if (itransfer->iso_summary_valid) {
+		*summary = itransfer->iso_summary;
+		return LIBUSB_SUCCESS;
+	}
+
+	summary->actual_length = 0;
+	summary->num_error_packets = 0;
+	summary->first_error_packet = -1;
+	summary->last_error_packet = -1;
+	for (i = 0; i < transfer->num_iso_packets; i++) {
+		summary->actual_length += transfer->iso_packet_desc[i].actual_length;
+		if (transfer->iso_packet_desc[i].status != LIBUSB_TRANSFER_COMPLETED) {
+			if (!summary->num_error_packets++)
+				summary->first_error_packet = i;
+			summary->last_error_packet = i;
+		}
+	}
+
+	return LIBUSB_SUCCESS;
+}
+
+/** \ingroup libusb_asyncio
+ * Set a transfers bulk stream id. Note users are advised to use
+ * libusb_fill_bulk_stream_transfer() instead of calling this function
+ * directly.
+ *
+ * Since version 1.0.19, \ref LIBUSB_API_VERSION >= 0x01000103
+ *
+ * \param transfer the transfer to set the stream id for
+ * \param stream_id the stream id to set
+ * \see libusb_alloc_streams()
+ */
+void API_EXPORTED libusb_transfer_set_stream_id(
+	struct libusb_transfer *transfer, uint32_t stream_id)
+{
+	struct usbi_transfer *itransfer =
+		LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
+
+	itransfer->stream_id = stream_id;
+}
+
+/** \ingroup libusb_asyncio
+ * Use a list of buffer segments instead of a single contiguous buffer for a
+ * bulk or interrupt transfer. For OUT transfers the segments are sent
+ * back to back, and for IN transfers the received data fills them in order,
+ * so that a payload assembled from several pieces does not need to be copied
+ * into one buffer first.
+ *
+ * The transfer length is set to the total length of the segments, and the
+ * buffer field of the transfer must not be used while segments are set.
+ * The segment array is not copied. It must remain valid, together with the
+ * segments it describes, until the transfer has completed.
+ *
+ * Where the platform supports it, bulk OUT transfers are submitted straight
+ * from the segments when every segment but the last is a multiple of 1024
+ * bytes. In all other cases an internal buffer is used and data is copied
+ * to or from the segments around the transfer.
+ *
+ * Since version 1.0.27, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param transfer the transfer to set the segments for
+ * \param iov array of segments, or NULL to go back to using the buffer
+ * field of the transfer
+ * \param iovcnt number of segments in the array
+ * \returns 0 on success
+ * \returns \ref LIBUSB_ERROR_INVALID_PARAM if a segment has a negative
+ * length, or if the total length does not fit in an int
+ */
+int API_EXPORTED libusb_transfer_set_iovec(struct libusb_transfer *transfer,
+	const struct libusb_iovec *iov, int iovcnt)
+{
+	struct usbi_transfer *itransfer =
+		LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
+	int length = 0;
+	int i;
+
+	if (!iov || iovcnt <= 0) {
+		itransfer->iov = NULL;
+		itransfer->iovcnt = 0;
+		return 0;
+	}
+
+	for (i = 0; i < iovcnt; i++) {
+		if (iov[i].length < 0 || iov[i].length > INT_MAX - length)
+			return LIBUSB_ERROR_INVALID_PARAM;
+		length += iov[i].length;
+	}
+
+	itransfer->iov = iov;
+	itransfer->iovcnt = iovcnt;
+	transfer->buffer = NULL;
+	transfer->length = length;
+	return 0;
+}
+
+/** \ingroup libusb_asyncio
+ * Get a transfers bulk stream id.
+ *
+ * Since version 1.0.19, \ref LIBUSB_API_VERSION >= 0x01000103
+ *
+ * \param transfer the transfer to get the stream id for
+ * \returns the stream id for the transfer
+ */
+uint32_t API_EXPORTED libusb_transfer_get_stream_id(
+	struct libusb_transfer *transfer)
+{
+	struct usbi_transfer *itransfer =
+		LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
+
+	return itransfer->stream_id;
+}
+
+struct stream_sched_stream {
+	int in_flight;
+	uint64_t transfers_completed;
+	uint64_t bytes_transferred;
+};
+
+struct libusb_stream_scheduler {
+	struct libusb_device_handle *dev_handle;
+	uint32_t num_streams;
+	int depth;
+
+	/* protects the fields below */
+	usbi_mutex_t lock;
+
+	/* transfers waiting for a stream, oldest first, linked through their
+	 * completed_list */
+	struct list_head queued;
+
+	/* the stream with ID n is streams[n - 1] */
+	struct stream_sched_stream *streams;
+	int in_flight;
+
+	/* where the search for the least busy stream starts, so that streams
+	 * with the same load take turns */
+	uint32_t next_stream;
+};
+
+/* Pick the stream with the fewest transfers in flight, or return 0 if every
+ * stream has depth transfers in flight. Called with the scheduler lock
+ * held. */
+static uint32_t stream_sched_pick(struct libusb_stream_scheduler *sched)
+{
+	uint32_t i, best = 0;
+	int best_in_flight = sched->depth;
+
+	for (i = 0; i < sched->num_streams && best_in_flight; i++) {
+		uint32_t s = (sched->next_stream + i) % sched->num_streams;
+
+		if (sched->streams[s].in_flight < best_in_flight) {
+			best = s + 1;
+			best_in_flight = sched->streams[s].in_flight;
+		}
+	}
+	if (best)
+		sched->next_stream = best % sched->num_streams;
+
+	return best;
+}
+
+/* Report a transfer that was queued on the scheduler but never submitted */
+static void stream_sched_complete_queued(struct usbi_transfer *itransfer,
+	enum libusb_transfer_status status)
+{
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	struct libusb_context *ctx = TRANSFER_CTX(transfer);
+	uint8_t flags = transfer->flags;
+
+	itransfer->stream_sched = NULL;
+	transfer->status = status;
+	transfer->actual_length = 0;
+	if (transfer->callback) {
+		libusb_lock_event_waiters(ctx);
+		transfer->callback(transfer);
+		libusb_unlock_event_waiters(ctx);
+	}
+	if (flags & LIBUSB_TRANSFER_FREE_TRANSFER)
+		libusb_free_transfer(transfer);
+}
+
+/* Submit a transfer on one of the streams, with the scheduler lock held. The
+ * lock is dropped while the transfer is handed to the backend. */
+static int stream_sched_submit_locked(struct libusb_stream_scheduler *sched,
+	struct usbi_transfer *itransfer, uint32_t stream_id)
+{
+	int r;
+
+	itransfer->stream_id = stream_id;
+	sched->streams[stream_id - 1].in_flight++;
+	sched->in_flight++;
+	usbi_mutex_unlock(&sched->lock);
+
+	r = libusb_submit_transfer(USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer));
+
+	usbi_mutex_lock(&sched->lock);
+	if (r < 0) {
+		sched->streams[stream_id - 1].in_flight--;
+		sched->in_flight--;
+	}
+
+	return r;
+}
+
+/* called from usbi_handle_transfer_completion() before the callback of a
+ * transfer that was submitted through a stream scheduler. the stream it
+ * leaves free is given to the oldest queued transfer. */
+static void stream_sched_completion(struct usbi_transfer *itransfer)
+{
+	struct libusb_stream_scheduler *sched = itransfer->stream_sched;
+	struct stream_sched_stream *stream = &sched->streams[itransfer->stream_id - 1];
+
+	itransfer->stream_sched = NULL;
+
+	usbi_mutex_lock(&sched->lock);
+	stream->in_flight--;
+	sched->in_flight--;
+	stream->transfers_completed++;
+	stream->bytes_transferred += (uint64_t)itransfer->transferred;
+
+	while (!list_empty(&sched->queued) && stream->in_flight < sched->depth) {
+		struct usbi_transfer *next = list_first_entry(&sched->queued,
+			struct usbi_transfer, completed_list);
+
+		list_del(&next->completed_list);
+		if (stream_sched_submit_locked(sched, next, itransfer->stream_id) < 0) {
+			usbi_mutex_unlock(&sched->lock);
+			stream_sched_complete_queued(next, LIBUSB_TRANSFER_ERROR);
+			usbi_mutex_lock(&sched->lock);
+		}
+	}
+	usbi_mutex_unlock(&sched->lock);
+}
+
+/** \ingroup libusb_asyncio
+ * Create a scheduler that spreads bulk transfers over the streams of an
+ * endpoint. The streams must have been allocated with libusb_alloc_streams(),
+ * and the scheduler uses stream IDs 1 to num_streams. Each transfer submitted
+ * through libusb_stream_scheduler_submit() is given to the stream with the
+ * fewest transfers in flight, and is queued if every stream already has depth
+ * transfers in flight. Queued transfers are submitted, oldest first, as soon
+ * as a transfer completes and leaves room on its stream.
+ *
+ * Since version 1.0.27, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param dev_handle a device handle
+ * \param num_streams number of streams to use
+ * \param depth largest number of transfers in flight on each stream
+ * \param sched output location for the new scheduler
+ * \returns 0 on success
+ * \returns \ref LIBUSB_ERROR_INVALID_PARAM if a parameter is invalid
+ * \returns \ref LIBUSB_ERROR_NO_MEM on memory allocation failure
+ */
+int API_EXPORTED libusb_stream_scheduler_create(libusb_device_handle *dev_handle,
+	uint32_t num_streams, int depth, libusb_stream_scheduler **sched)
+{
+	struct libusb_stream_scheduler *_sched;
+
+	if (!dev_handle || !sched || !num_streams || depth <= 0)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	_sched = calloc(1, sizeof(*_sched));
+	if (!_sched)
+		return LIBUSB_ERROR_NO_MEM;
+
+	_sched->streams = calloc(num_streams, sizeof(*_sched->streams));
+	if (!_sched->streams) {
+		free(_sched);
+		return LIBUSB_ERROR_NO_MEM;
+	}
+
+	_sched->dev_handle = dev_handle;
+	_sched->num_streams = num_streams;
+	_sched->depth = depth;
+	usbi_mutex_init(&_sched->lock);
+	list_init(&_sched->queued);
+
+	*sched = _sched;
+	return 0;
+}
+
+/** \ingroup libusb_asyncio
+ * Destroy a stream scheduler. No transfer submitted through the scheduler
+ * may be in flight or queued, see libusb_stream_scheduler_cancel().
+ *
+ * Since version 1.0.27, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param sched the scheduler to destroy. If NULL then the function simply
+ * returns.
+ */
+void API_EXPORTED libusb_stream_scheduler_destroy(libusb_stream_scheduler *sched)
+{
+	if (!sched)
+		return;
+
+	if (sched->in_flight || !list_empty(&sched->queued))
+		usbi_warn(HANDLE_CTX(sched->dev_handle), "destroying stream scheduler with transfers in flight");
+
+	usbi_mutex_destroy(&sched->lock);
+	free(sched->streams);
+	free(sched);
+}
+
+/** \ingroup libusb_asyncio
+ * Submit a bulk transfer through a stream scheduler. The stream ID of the
+ * transfer is set by the scheduler, and can be read back with
+ * libusb_transfer_get_stream_id() once the transfer has completed. The
+ * transfer is either submitted right away, or queued until a stream has room
+ * for it; in both cases its callback is invoked on completion as usual. To
+ * resubmit the transfer from its callback, submit it through the scheduler
+ * again.
+ *
+ * Since version 1.0.27, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param sched the scheduler
+ * \param transfer a bulk transfer
+ * \returns 0 on success
+ * \returns \ref LIBUSB_ERROR_INVALID_PARAM if the transfer is not a bulk
+ * transfer
+ * \returns another LIBUSB_ERROR code on failure, see libusb_submit_transfer()
  */
-int API_EXPORTED libusb_cancel_transfer(struct libusb_transfer *transfer)
+int API_EXPORTED libusb_stream_scheduler_submit(libusb_stream_scheduler *sched,
+	struct libusb_transfer *transfer)
 {
 	struct usbi_transfer *itransfer =
 		LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
-	struct libusb_context *ctx = ITRANSFER_CTX(itransfer);
-	int r;
+	uint32_t stream_id;
+	int r = 0;
 
-	usbi_dbg(ctx, "transfer %p", (void *) transfer );
-	usbi_mutex_lock(&itransfer->lock);
-	if (!(itransfer->state_flags & USBI_TRANSFER_IN_FLIGHT)
-			|| (itransfer->state_flags & USBI_TRANSFER_CANCELLING)) {
-		r = LIBUSB_ERROR_NOT_FOUND;
-		goto out;
-	}
-	r = usbi_backend.cancel_transfer(itransfer);
-	if (r < 0) {
-		if (r != LIBUSB_ERROR_NOT_FOUND &&
-		    r != LIBUSB_ERROR_NO_DEVICE)
-			usbi_err(ctx, "cancel transfer failed error %d", r);
-		else
-			usbi_dbg(ctx, "cancel transfer failed error %d", r);
+	if (transfer->type != LIBUSB_TRANSFER_TYPE_BULK && transfer->type !=
+	    LIBUSB_TRANSFER_TYPE_BULK_STREAM)
+		return LIBUSB_ERROR_INVALID_PARAM;
 
-		if (r == LIBUSB_ERROR_NO_DEVICE)
-			itransfer->state_flags |= USBI_TRANSFER_DEVICE_DISAPPEARED;
-	}
+	transfer->type = LIBUSB_TRANSFER_TYPE_BULK_STREAM;
+	itransfer->stream_sched = sched;
 
-	itransfer->state_flags |= USBI_TRANSFER_CANCELLING;
+	usbi_mutex_lock(&sched->lock);
+	stream_id = stream_sched_pick(sched);
+	if (stream_id)
+		r = stream_sched_submit_locked(sched, itransfer, stream_id);
+	else
+		list_add_tail(&itransfer->completed_list, &sched->queued);
+	usbi_mutex_unlock(&sched->lock);
+
+	if (r < 0)
+		itransfer->stream_sched = NULL;
 
-out:
-	usbi_mutex_unlock(&itransfer->lock);
 	return r;
 }
 
 /** \ingroup libusb_asyncio
- * Set a transfers bulk stream id. Note users are advised to use
- * libusb_fill_bulk_stream_transfer() instead of calling this function
- * directly.
+ * Cancel all the transfers of a stream scheduler. Transfers in flight are
+ * cancelled as with libusb_cancel_transfer(), and complete later when events
+ * are handled. Transfers still queued complete with status
+ * \ref LIBUSB_TRANSFER_CANCELLED before this function returns, their callback
+ * being invoked from the calling thread.
  *
- * Since version 1.0.19, \ref LIBUSB_API_VERSION >= 0x01000103
+ * Since version 1.0.27, \ref LIBUSB_API_VERSION >= 0x0100010B
  *
- * \param transfer the transfer to set the stream id for
- * \param stream_id the stream id to set
- * \see libusb_alloc_streams()
+ * \param sched the scheduler
  */
-void API_EXPORTED libusb_transfer_set_stream_id(
-	struct libusb_transfer *transfer, uint32_t stream_id)
+void API_EXPORTED libusb_stream_scheduler_cancel(libusb_stream_scheduler *sched)
 {
-	struct usbi_transfer *itransfer =
-		LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
+	struct libusb_device_handle *dev_handle = sched->dev_handle;
+	struct usbi_transfer *itransfer;
+	struct list_head queued;
 
-	itransfer->stream_id = stream_id;
+	usbi_mutex_lock(&sched->lock);
+	list_init(&queued);
+	list_cut(&queued, &sched->queued);
+	usbi_mutex_unlock(&sched->lock);
+
+	while (!list_empty(&queued)) {
+		itransfer = list_first_entry(&queued, struct usbi_transfer, completed_list);
+		list_del(&itransfer->completed_list);
+		stream_sched_complete_queued(itransfer, LIBUSB_TRANSFER_CANCELLED);
+	}
+
+	usbi_mutex_lock(&dev_handle->flying_transfers_lock);
+	for_each_transfer(dev_handle, itransfer) {
+		if (itransfer->stream_sched != sched)
+			continue;
+
+		usbi_mutex_lock(&itransfer->lock);
+		cancel_transfer_locked(itransfer);
+		usbi_mutex_unlock(&itransfer->lock);
+	}
+	usbi_mutex_unlock(&dev_handle->flying_transfers_lock);
 }
 
 /** \ingroup libusb_asyncio
- * Get a transfers bulk stream id.
+ * Get the statistics of one stream of a stream scheduler.
  *
- * Since version 1.0.19, \ref LIBUSB_API_VERSION >= 0x01000103
+ * Since version 1.0.27, \ref LIBUSB_API_VERSION >= 0x0100010B
  *
- * \param transfer the transfer to get the stream id for
- * \returns the stream id for the transfer
+ * \param sched the scheduler
+ * \param stream_id the stream ID, from 1 to the number of streams
+ * \param stats output location for the statistics
+ * \returns 0 on success
+ * \returns \ref LIBUSB_ERROR_INVALID_PARAM if stream_id is out of range
  */
-uint32_t API_EXPORTED libusb_transfer_get_stream_id(
-	struct libusb_transfer *transfer)
+int API_EXPORTED libusb_stream_scheduler_get_stream_stats(
+	libusb_stream_scheduler *sched, uint32_t stream_id,
+	struct libusb_stream_stats *stats)
 {
-	struct usbi_transfer *itransfer =
-		LIBUSB_TRANSFER_TO_USBI_TRANSFER(transfer);
+	struct stream_sched_stream *stream;
 
-	return itransfer->stream_id;
+	if (!stats || !stream_id || stream_id > sched->num_streams)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	stream = &sched->streams[stream_id - 1];
+	usbi_mutex_lock(&sched->lock);
+	stats->in_flight = stream->in_flight;
+	stats->transfers_completed = stream->transfers_completed;
+	stats->bytes_transferred = stream->bytes_transferred;
+	usbi_mutex_unlock(&sched->lock);
+
+	return 0;
+}
+
+/* Move the data of each packet of an isochronous IN transfer up against
+ * the data of the previous one. Returns the total number of bytes. */
+static int iso_compact(struct libusb_transfer *transfer)
+{
+	unsigned char *dst = transfer->buffer;
+	size_t src = 0;
+	int i;
+
+	for (i = 0; i < transfer->num_iso_packets; i++) {
+		struct libusb_iso_packet_descriptor *desc = &transfer->iso_packet_desc[i];
+		unsigned int len = MIN(desc->actual_length, desc->length);
+
+		if (len && dst != transfer->buffer + src)
+			memmove(dst, transfer->buffer + src, len);
+		dst += len;
+		src += desc->length;
+	}
+
+	return (int)(dst - transfer->buffer);
+}
+
+/* Invoke the callback of a completed transfer, or hand the transfer to its
+ * ring or completion queue. The transfer may be freed by the callback, so it
+ * cannot be used afterwards. */
+static void dispatch_transfer_completion(struct usbi_transfer *itransfer)
+{
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	struct libusb_context *ctx = ITRANSFER_CTX(itransfer);
+	struct timespec start;
+	uint8_t flags = transfer->flags;
+	int measuring;
+
+	iovec_release(itransfer, 1);
+	if (itransfer->stream_sched)
+		stream_sched_completion(itransfer);
+	usbi_dbg(ctx, "transfer %p has callback %p",
+		 (void *) transfer, transfer->callback);
+	if (itransfer->ring) {
+		if (itransfer->ring->batch_callback) {
+			transfer_ring_batch_add(itransfer);
+			return;
+		}
+
+		/* ring transfers are never freed by the callback */
+		libusb_lock_event_waiters(ctx);
+		measuring = event_stats_start(ctx, &start);
+		transfer->callback(transfer);
+		event_stats_callback(ctx, measuring, &start);
+		transfer_ring_completion(itransfer, transfer->status);
+		libusb_unlock_event_waiters(ctx);
+		return;
+	}
+	if (itransfer->completion_queue) {
+		/* the callback, and freeing the transfer, are left to the
+		 * thread that dispatches the queue */
+		completion_queue_push(itransfer);
+		return;
+	}
+	if (transfer->callback) {
+		libusb_lock_event_waiters (ctx);
+		measuring = event_stats_start(ctx, &start);
+		transfer->callback(transfer);
+		event_stats_callback(ctx, measuring, &start);
+		libusb_unlock_event_waiters(ctx);
+	}
+	/* transfer might have been freed by the above call, do not use from
+	 * this point. */
+	if (flags & LIBUSB_TRANSFER_FREE_TRANSFER)
+		libusb_free_transfer(transfer);
+}
+
+/* Dispatch the completions held back by usbi_handle_transfer_completion()
+ * while high-priority transfers were in flight, in the order they completed.
+ * Called by the event handler before it returns. */
+static void flush_deferred_completions(struct usbi_event_handling *handling)
+{
+	while (!list_empty(&handling->deferred_completions)) {
+		struct usbi_transfer *itransfer = list_first_entry(
+			&handling->deferred_completions, struct usbi_transfer, completed_list);
+
+		list_del(&itransfer->completed_list);
+		dispatch_transfer_completion(itransfer);
+	}
 }
 
 /* Handle completion of a transfer (completion might be an error condition).
@@ -1685,22 +4617,29 @@ uint32_t API_EXPORTED libusb_transfer_get_stream_id(
  * data before calling it.
  * Do not call this function with the usbi_transfer lock held. User-specified
  * callback functions may attempt to directly resubmit the transfer, which
- * will attempt to take the lock. */
+ * will attempt to take the lock.
+ *
+ * While a transfer with LIBUSB_TRANSFER_HIGH_PRIORITY is in flight on the
+ * context, the event handler holds the callbacks of the other transfers back
+ * until the end of its iteration, so the high-priority ones come first. */
 int usbi_handle_transfer_completion(struct usbi_transfer *itransfer,
 	enum libusb_transfer_status status)
 {
 	struct libusb_transfer *transfer =
 		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
 	struct libusb_context *ctx = ITRANSFER_CTX(itransfer);
-	uint8_t flags;
+	struct usbi_event_handling *handling;
 	int r;
 
 	r = remove_from_flying_list(itransfer);
 	if (r < 0)
 		usbi_err(ctx, "failed to set timer for next timeout");
 
+	/* the submitter still holds the lock until it is done with the
+	 * transfer, which a backend completing on another thread must wait
+	 * for before the callback may free it */
 	usbi_mutex_lock(&itransfer->lock);
-	itransfer->state_flags &= ~USBI_TRANSFER_IN_FLIGHT;
+	(void)usbi_transfer_update_state(itransfer, 0, USBI_TRANSFER_IN_FLIGHT);
 	usbi_mutex_unlock(&itransfer->lock);
 
 	if (status == LIBUSB_TRANSFER_COMPLETED
@@ -1714,20 +4653,29 @@ int usbi_handle_transfer_completion(struct usbi_transfer *itransfer,
 		}
 	}
 
-	flags = transfer->flags;
+	stats_transfer_completed(itransfer, status);
+	usbi_trace6(transfer__complete, transfer, itransfer->dev->bus_number,
+		itransfer->dev->device_address, transfer->endpoint, status,
+		itransfer->transferred);
+
 	transfer->status = status;
 	transfer->actual_length = itransfer->transferred;
-	usbi_dbg(ctx, "transfer %p has callback %p",
-		 (void *) transfer, transfer->callback);
-	if (transfer->callback) {
-		libusb_lock_event_waiters (ctx);
-		transfer->callback(transfer);
-		libusb_unlock_event_waiters(ctx);
+	if (transfer->type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS
+			&& (transfer->flags & LIBUSB_TRANSFER_ISO_COMPACT)
+			&& IS_XFERIN(transfer))
+		transfer->actual_length = iso_compact(transfer);
+	capture_transfer(itransfer, LIBUSB_CAPTURE_COMPLETE, status);
+
+	if (itransfer->high_priority) {
+		itransfer->high_priority = 0;
+		(void)usbi_atomic_dec(&ctx->high_priority_in_flight);
+	} else if (usbi_atomic_load(&ctx->high_priority_in_flight) &&
+		   (handling = usbi_event_handling_state(ctx)) != NULL) {
+		list_add_tail(&itransfer->completed_list, &handling->deferred_completions);
+		return r;
 	}
-	/* transfer might have been freed by the above call, do not use from
-	 * this point. */
-	if (flags & LIBUSB_TRANSFER_FREE_TRANSFER)
-		libusb_free_transfer(transfer);
+
+	dispatch_transfer_completion(itransfer);
 	return r;
 }
 
@@ -1740,11 +4688,14 @@ int usbi_handle_transfer_completion(struct usbi_transfer *itransfer,
 int usbi_handle_transfer_cancellation(struct usbi_transfer *itransfer)
 {
 	struct libusb_context *ctx = ITRANSFER_CTX(itransfer);
-	uint8_t timed_out;
+	uint8_t timed_out = 0;
 
-	usbi_mutex_lock(&ctx->flying_transfers_lock);
-	timed_out = itransfer->timeout_flags & USBI_TRANSFER_TIMED_OUT;
-	usbi_mutex_unlock(&ctx->flying_transfers_lock);
+	/* only transfers with a timeout can have timed out */
+	if (TIMESPEC_IS_SET(&itransfer->timeout)) {
+		usbi_mutex_lock(&ctx->timeouts_lock);
+		timed_out = itransfer->timeout_flags & USBI_TRANSFER_TIMED_OUT;
+		usbi_mutex_unlock(&ctx->timeouts_lock);
+	}
 
 	/* if the URB was cancelled due to timeout, report timeout to the user */
 	if (timed_out) {
@@ -1756,24 +4707,36 @@ int usbi_handle_transfer_cancellation(struct usbi_transfer *itransfer)
 	return usbi_handle_transfer_completion(itransfer, LIBUSB_TRANSFER_CANCELLED);
 }
 
-/* Add a completed transfer to the completed_transfers list of the
- * context and signal the event. The backend's handle_transfer_completion()
- * function will be called the next time an event handler runs. */
+/* Add a completed transfer to the completed transfers of the context and
+ * signal the event. The backend's handle_transfer_completion() function will
+ * be called the next time an event handler runs.
+ *
+ * The transfer is pushed without taking a lock, and the event handler takes
+ * all of them off at once, so only the completion that finds the stack empty
+ * needs to flag the event. The others are picked up along with it. */
 void usbi_signal_transfer_completion(struct usbi_transfer *itransfer)
 {
 	struct libusb_device *dev = itransfer->dev;
 
 	if (dev) {
 		struct libusb_context *ctx = DEVICE_CTX(dev);
-		unsigned int event_flags;
+		struct usbi_transfer *head;
 
-		usbi_mutex_lock(&ctx->event_data_lock);
-		event_flags = ctx->event_flags;
-		ctx->event_flags |= USBI_EVENT_TRANSFER_COMPLETED;
-		list_add_tail(&itransfer->completed_list, &ctx->completed_transfers);
-		if (!event_flags)
-			usbi_signal_event(&ctx->event);
-		usbi_mutex_unlock(&ctx->event_data_lock);
+		do {
+			head = usbi_atomic_ptr_load(&ctx->completed_stack);
+			itransfer->completed_next = head;
+		} while (!usbi_atomic_ptr_cas(&ctx->completed_stack, head, itransfer));
+
+		if (!head) {
+			unsigned int event_flags;
+
+			usbi_mutex_lock(&ctx->event_data_lock);
+			event_flags = ctx->event_flags;
+			ctx->event_flags |= USBI_EVENT_TRANSFER_COMPLETED;
+			if (!event_flags)
+				usbi_signal_event(&ctx->event);
+			usbi_mutex_unlock(&ctx->event_data_lock);
+		}
 	}
 }
 
@@ -1814,8 +4777,11 @@ int API_EXPORTED libusb_try_lock_events(libusb_context *ctx)
 	}
 
 	r = usbi_mutex_trylock(&ctx->events_lock);
-	if (!r)
+	if (!r) {
+		if (usbi_atomic_load(&ctx->event_stats_enabled))
+			usbi_atomic64_add(&ctx->event_stats.events_lock_contended, 1);
 		return 1;
+	}
 
 	ctx->event_handler_active = 1;
 	return 0;
@@ -2047,6 +5013,41 @@ int API_EXPORTED libusb_wait_for_event(libusb_context *ctx, struct timeval *tv)
 	return 0;
 }
 
+/** \ingroup libusb_poll
+ * Get the event handling statistics of a context, see
+ * \ref libusb_event_stats. They are only kept while
+ * \ref libusb_option::LIBUSB_OPTION_EVENT_STATS "LIBUSB_OPTION_EVENT_STATS"
+ * is enabled on the context, and all read as zero until it is first
+ * enabled.
+ *
+ * Since version 1.0.27, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \param stats output location for the statistics
+ * \returns 0 on success
+ */
+int API_EXPORTED libusb_get_event_stats(libusb_context *ctx,
+	struct libusb_event_stats *stats)
+{
+	struct usbi_event_stats *event_stats;
+
+	ctx = usbi_get_context(ctx);
+	event_stats = &ctx->event_stats;
+
+	stats->wakeups = usbi_atomic64_load(&event_stats->wakeups);
+	stats->empty_wakeups = usbi_atomic64_load(&event_stats->empty_wakeups);
+	stats->events_lock_contended = usbi_atomic64_load(&event_stats->events_lock_contended);
+	stats->wait_time_us = usbi_atomic64_load(&event_stats->wait_time_us);
+	stats->internal_events_time_us = usbi_atomic64_load(&event_stats->internal_events_time_us);
+	stats->backend_time_us = usbi_atomic64_load(&event_stats->backend_time_us);
+	stats->timeouts_time_us = usbi_atomic64_load(&event_stats->timeouts_time_us);
+	stats->callbacks = usbi_atomic64_load(&event_stats->callbacks);
+	stats->callback_time_us = usbi_atomic64_load(&event_stats->callback_time_us);
+	stats->max_callback_time_us = usbi_atomic64_load(&event_stats->max_callback_time_us);
+
+	return LIBUSB_SUCCESS;
+}
+
 static void handle_timeout(struct usbi_transfer *itransfer)
 {
 	struct libusb_transfer *transfer =
@@ -2064,43 +5065,39 @@ static void handle_timeout(struct usbi_transfer *itransfer)
 
 static void handle_timeouts_locked(struct libusb_context *ctx)
 {
-	struct timespec systime;
+	struct timespec systime, start;
 	struct usbi_transfer *itransfer;
+	int measuring;
 
-	if (list_empty(&ctx->flying_transfers))
+	if (!ctx->timeout_heap_len)
 		return;
 
+	measuring = event_stats_start(ctx, &start);
+
 	/* get current time */
 	usbi_get_monotonic_time(&systime);
 
-	/* iterate through flying transfers list, finding all transfers that
-	 * have expired timeouts */
-	for_each_transfer(ctx, itransfer) {
-		struct timespec *cur_ts = &itransfer->timeout;
-
-		/* if we've reached transfers of infinite timeout, we're all done */
-		if (!TIMESPEC_IS_SET(cur_ts))
-			return;
-
-		/* ignore timeouts we've already handled */
-		if (itransfer->timeout_flags & (USBI_TRANSFER_TIMEOUT_HANDLED | USBI_TRANSFER_OS_HANDLES_TIMEOUT))
-			continue;
-
+	/* pull transfers off the top of the timeout heap until we find one
+	 * that has not expired yet. handle_timeout() marks each transfer as
+	 * handled, so the next peek drops it from the heap. */
+	while ((itransfer = timeout_heap_peek(ctx))) {
 		/* if transfer has non-expired timeout, nothing more to do */
-		if (TIMESPEC_CMP(cur_ts, &systime, >))
-			return;
+		if (TIMESPEC_CMP(&itransfer->timeout, &systime, >))
+			break;
 
 		/* otherwise, we've got an expired timeout to handle */
 		handle_timeout(itransfer);
 	}
+
+	event_stats_add(ctx, measuring, &ctx->event_stats.timeouts_time_us, &start);
 }
 
 static void handle_timeouts(struct libusb_context *ctx)
 {
 	ctx = usbi_get_context(ctx);
-	usbi_mutex_lock(&ctx->flying_transfers_lock);
+	usbi_mutex_lock(&ctx->timeouts_lock);
 	handle_timeouts_locked(ctx);
-	usbi_mutex_unlock(&ctx->flying_transfers_lock);
+	usbi_mutex_unlock(&ctx->timeouts_lock);
 }
 
 static int handle_event_trigger(struct libusb_context *ctx)
@@ -2148,11 +5145,22 @@ static int handle_event_trigger(struct libusb_context *ctx)
 	if (ctx->event_flags & USBI_EVENT_TRANSFER_COMPLETED) {
 		struct usbi_transfer *itransfer, *tmp;
 		struct list_head completed_transfers;
+		struct list_head *tail;
 
-		assert(!list_empty(&ctx->completed_transfers));
+		/* clear the flag before draining the stack, so that a transfer
+		 * completing after the drain flags the event again */
+		ctx->event_flags &= ~USBI_EVENT_TRANSFER_COMPLETED;
 		list_cut(&completed_transfers, &ctx->completed_transfers);
 		usbi_mutex_unlock(&ctx->event_data_lock);
 
+		/* append the stack behind any leftovers, oldest first */
+		tail = completed_transfers.prev;
+		itransfer = usbi_atomic_ptr_exchange(&ctx->completed_stack, NULL);
+		while (itransfer) {
+			list_add(&itransfer->completed_list, tail);
+			itransfer = itransfer->completed_next;
+		}
+
 		__for_each_completed_transfer_safe(&completed_transfers, itransfer, tmp) {
 			list_del(&itransfer->completed_list);
 			r = usbi_backend.handle_transfer_completion(itransfer);
@@ -2166,8 +5174,7 @@ static int handle_event_trigger(struct libusb_context *ctx)
 		if (!list_empty(&completed_transfers)) {
 			/* an error occurred, put the remaining transfers back on the list */
 			list_splice_front(&completed_transfers, &ctx->completed_transfers);
-		} else if (list_empty(&ctx->completed_transfers)) {
-			ctx->event_flags &= ~USBI_EVENT_TRANSFER_COMPLETED;
+			ctx->event_flags |= USBI_EVENT_TRANSFER_COMPLETED;
 		}
 	}
 
@@ -2189,7 +5196,12 @@ static int handle_timer_trigger(struct libusb_context *ctx)
 {
 	int r;
 
-	usbi_mutex_lock(&ctx->flying_transfers_lock);
+	usbi_mutex_lock(&ctx->timeouts_lock);
+
+	/* the timer has expired and stays readable until it is set again, so
+	 * it must be armed or disarmed below even if the expiry is the same */
+	ctx->timer_armed = 1;
+	TIMESPEC_CLEAR(&ctx->timer_expiry);
 
 	/* process the timeout that just happened */
 	handle_timeouts_locked(ctx);
@@ -2197,18 +5209,68 @@ static int handle_timer_trigger(struct libusb_context *ctx)
 	/* arm for next timeout */
 	r = arm_timer_for_next_timeout(ctx);
 
-	usbi_mutex_unlock(&ctx->flying_transfers_lock);
+	usbi_mutex_unlock(&ctx->timeouts_lock);
 
 	return r;
 }
 #endif
 
+/* wait for events, first polling for them for the busy-poll budget if one
+ * is set. The time spent polling halves each time it finds nothing, and
+ * returns to the full budget once events arrive. */
+static int wait_for_events(struct libusb_context *ctx,
+	struct usbi_reported_events *reported_events, int timeout_ms)
+{
+	long budget = usbi_atomic_load(&ctx->busy_poll);
+	struct timespec start, now;
+	long spin, elapsed;
+	int r;
+
+	if (budget != ctx->busy_poll_last) {
+		ctx->busy_poll_last = budget;
+		ctx->busy_poll_spin = budget;
+	}
+
+	spin = MIN(ctx->busy_poll_spin, timeout_ms * 1000L);
+	if (spin > 0) {
+		usbi_get_monotonic_time(&start);
+		do {
+			/* with a timer nothing being ready is not a timeout, but
+			 * is reported as success without any event */
+			r = usbi_wait_for_events(ctx, reported_events, 0);
+			if (r == LIBUSB_SUCCESS && (reported_events->event_bits ||
+					reported_events->num_ready)) {
+				ctx->busy_poll_spin = budget;
+				return r;
+			} else if (r != LIBUSB_SUCCESS && r != LIBUSB_ERROR_TIMEOUT) {
+				return r;
+			}
+			usbi_get_monotonic_time(&now);
+			TIMESPEC_SUB(&now, &start, &now);
+			elapsed = (long)now.tv_sec * 1000000L + now.tv_nsec / 1000L;
+		} while (elapsed < spin);
+
+		ctx->busy_poll_spin = spin / 2;
+		timeout_ms -= (int)((elapsed + 500L) / 1000L);
+		if (timeout_ms <= 0)
+			return LIBUSB_ERROR_TIMEOUT;
+	}
+
+	r = usbi_wait_for_events(ctx, reported_events, timeout_ms);
+	if (r == LIBUSB_SUCCESS && (reported_events->event_bits ||
+			reported_events->num_ready))
+		ctx->busy_poll_spin = budget;
+	return r;
+}
+
 /* do the actual event handling. assumes that no other thread is concurrently
  * doing the same thing. */
 static int handle_events(struct libusb_context *ctx, struct timeval *tv)
 {
+	struct usbi_event_handling handling;
 	struct usbi_reported_events reported_events;
-	int r, timeout_ms;
+	struct timespec start;
+	int measuring, r, timeout_ms;
 
 	/* prevent attempts to recursively handle events (e.g. calling into
 	 * libusb_handle_events() from within a hotplug or transfer callback) */
@@ -2239,6 +5301,12 @@ static int handle_events(struct libusb_context *ctx, struct timeval *tv)
 		if (!ctx->event_flags)
 			usbi_clear_event(&ctx->event);
 	}
+#ifdef HAVE_EVENT_SET
+	else if (usbi_using_epoll(ctx)) {
+		/* sources removed without interrupting us */
+		cleanup_removed_event_sources(ctx);
+	}
+#endif
 	usbi_mutex_unlock(&ctx->event_data_lock);
 
 	timeout_ms = (int)(tv->tv_sec * 1000) + (tv->tv_usec / 1000);
@@ -2249,9 +5317,11 @@ static int handle_events(struct libusb_context *ctx, struct timeval *tv)
 
 	reported_events.event_bits = 0;
 
-	usbi_start_event_handling(ctx);
+	usbi_start_event_handling(ctx, &handling);
 
-	r = usbi_wait_for_events(ctx, &reported_events, timeout_ms);
+	measuring = event_stats_start(ctx, &start);
+	r = wait_for_events(ctx, &reported_events, timeout_ms);
+	event_stats_wakeup(ctx, measuring, &start, &reported_events);
 	if (r != LIBUSB_SUCCESS) {
 		if (r == LIBUSB_ERROR_TIMEOUT) {
 			handle_timeouts(ctx);
@@ -2261,7 +5331,9 @@ static int handle_events(struct libusb_context *ctx, struct timeval *tv)
 	}
 
 	if (reported_events.event_triggered) {
+		measuring = event_stats_start(ctx, &start);
 		r = handle_event_trigger(ctx);
+		event_stats_add(ctx, measuring, &ctx->event_stats.internal_events_time_us, &start);
 		if (r) {
 			/* return error code */
 			goto done;
@@ -2281,12 +5353,16 @@ static int handle_events(struct libusb_context *ctx, struct timeval *tv)
 	if (!reported_events.num_ready)
 		goto done;
 
+	measuring = event_stats_start(ctx, &start);
 	r = usbi_backend.handle_events(ctx, reported_events.event_data,
 		reported_events.event_data_count, reported_events.num_ready);
+	event_stats_add(ctx, measuring, &ctx->event_stats.backend_time_us, &start);
 	if (r)
 		usbi_err(ctx, "backend handle_events failed with error %d", r);
 
 done:
+	flush_deferred_completions(&handling);
+	flush_ring_batches(ctx);
 	usbi_end_event_handling(ctx);
 	return r;
 }
@@ -2508,6 +5584,98 @@ int API_EXPORTED libusb_handle_events_locked(libusb_context *ctx,
 	return handle_events(ctx, &poll_timeout);
 }
 
+/** \ingroup libusb_poll
+ * Handle any pending events of one of the event loops of a context, see
+ * \ref libusb_option::LIBUSB_OPTION_EVENT_LOOPS "LIBUSB_OPTION_EVENT_LOOPS".
+ *
+ * Loop 0 is the primary loop, for which this function behaves like
+ * libusb_handle_events_timeout(). The other loops only reap the transfers of
+ * the devices assigned to them and invoke their callbacks from the calling
+ * thread, regardless of what the other loops are doing. Only one thread at a
+ * time may run a given loop.
+ *
+ * Since version 1.0.27, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \param loop the index of the loop to run
+ * \param tv the maximum time to block waiting for events, or an all zero
+ * timeval struct for non-blocking mode
+ * \returns 0 on success
+ * \returns \ref LIBUSB_ERROR_INVALID_PARAM if timeval is invalid or the loop
+ * does not exist
+ * \returns \ref LIBUSB_ERROR_BUSY if another thread is running the loop, or if
+ * called from event handling context
+ * \returns another LIBUSB_ERROR code on other failure
+ */
+int API_EXPORTED libusb_handle_events_loop(libusb_context *ctx, int loop,
+	struct timeval *tv)
+{
+#ifdef HAVE_EVENT_SET
+	struct usbi_event_handling handling;
+	struct usbi_reported_events reported_events;
+	struct usbi_event_loop *event_loop;
+	struct timespec start;
+	int measuring, r, timeout_ms;
+#endif
+
+	if (!TIMEVAL_IS_VALID(tv))
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	ctx = usbi_get_context(ctx);
+	if (loop == 0)
+		return libusb_handle_events_timeout(ctx, tv);
+
+#ifdef HAVE_EVENT_SET
+	if (loop < 0 || loop >= ctx->num_event_loops)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	if (usbi_handling_events(ctx))
+		return LIBUSB_ERROR_BUSY;
+
+	event_loop = &ctx->event_loops[loop - 1];
+	if (!usbi_mutex_trylock(&event_loop->lock))
+		return LIBUSB_ERROR_BUSY;
+
+	timeout_ms = (int)(tv->tv_sec * 1000) + (tv->tv_usec / 1000);
+
+	/* round up to next millisecond */
+	if (tv->tv_usec % 1000)
+		timeout_ms++;
+
+	reported_events.event_bits = 0;
+
+	usbi_start_event_handling(ctx, &handling);
+
+	measuring = event_stats_start(ctx, &start);
+	r = usbi_wait_for_loop_events(ctx, loop, &reported_events, timeout_ms);
+	event_stats_wakeup(ctx, measuring, &start, &reported_events);
+	if (r != LIBUSB_SUCCESS) {
+		if (r == LIBUSB_ERROR_TIMEOUT)
+			r = LIBUSB_SUCCESS;
+		goto done;
+	}
+
+	if (!reported_events.num_ready)
+		goto done;
+
+	measuring = event_stats_start(ctx, &start);
+	r = usbi_backend.handle_events(ctx, reported_events.event_data,
+		reported_events.event_data_count, reported_events.num_ready);
+	event_stats_add(ctx, measuring, &ctx->event_stats.backend_time_us, &start);
+	if (r)
+		usbi_err(ctx, "backend handle_events failed with error %d", r);
+
+done:
+	flush_deferred_completions(&handling);
+	flush_ring_batches(ctx);
+	usbi_end_event_handling(ctx);
+	usbi_mutex_unlock(&event_loop->lock);
+	return r;
+#else
+	return LIBUSB_ERROR_INVALID_PARAM;
+#endif
+}
+
 /** \ingroup libusb_poll
  * Determines whether your application must apply special timing considerations
  * when monitoring libusb's file descriptors.
@@ -2581,26 +5749,18 @@ int API_EXPORTED libusb_get_next_timeout(libusb_context *ctx,
 	if (usbi_using_timer(ctx))
 		return 0;
 
-	usbi_mutex_lock(&ctx->flying_transfers_lock);
-	if (list_empty(&ctx->flying_transfers)) {
-		usbi_mutex_unlock(&ctx->flying_transfers_lock);
-		usbi_dbg(ctx, "no URBs, no timeout!");
+	usbi_mutex_lock(&ctx->timeouts_lock);
+	if (!ctx->timeout_heap_len) {
+		usbi_mutex_unlock(&ctx->timeouts_lock);
+		usbi_dbg(ctx, "no URBs with timeout, no timeout!");
 		return 0;
 	}
 
 	/* find next transfer which hasn't already been processed as timed out */
-	for_each_transfer(ctx, itransfer) {
-		if (itransfer->timeout_flags & (USBI_TRANSFER_TIMEOUT_HANDLED | USBI_TRANSFER_OS_HANDLES_TIMEOUT))
-			continue;
-
-		/* if we've reached transfers of infinite timeout, we're done looking */
-		if (!TIMESPEC_IS_SET(&itransfer->timeout))
-			break;
-
+	itransfer = timeout_heap_peek(ctx);
+	if (itransfer)
 		next_timeout = itransfer->timeout;
-		break;
-	}
-	usbi_mutex_unlock(&ctx->flying_transfers_lock);
+	usbi_mutex_unlock(&ctx->timeouts_lock);
 
 	if (!TIMESPEC_IS_SET(&next_timeout)) {
 		usbi_dbg(ctx, "no URB with timeout or all handled by OS; no timeout!");
@@ -2690,8 +5850,24 @@ int usbi_add_event_source(struct libusb_context *ctx, usbi_os_handle_t os_handle
 	ievent_source->data.os_handle = os_handle;
 	ievent_source->data.poll_events = poll_events;
 	usbi_mutex_lock(&ctx->event_data_lock);
-	list_add_tail(&ievent_source->list, &ctx->event_sources);
-	usbi_event_source_notification(ctx);
+#ifdef HAVE_EVENT_SET
+	if (usbi_using_epoll(ctx)) {
+		/* the interest set is updated in place, so there is no need to
+		 * interrupt the event handler to rebuild its list of fds */
+		int r = usbi_epoll_add(ctx, os_handle, poll_events);
+
+		if (r < 0) {
+			usbi_mutex_unlock(&ctx->event_data_lock);
+			free(ievent_source);
+			return r;
+		}
+		list_add_tail(&ievent_source->list, &ctx->event_sources);
+	} else
+#endif
+	{
+		list_add_tail(&ievent_source->list, &ctx->event_sources);
+		usbi_event_source_notification(ctx);
+	}
 	usbi_mutex_unlock(&ctx->event_data_lock);
 
 #if !defined(PLATFORM_WINDOWS)
@@ -2723,9 +5899,21 @@ void usbi_remove_event_source(struct libusb_context *ctx, usbi_os_handle_t os_ha
 		return;
 	}
 
+#ifdef HAVE_EVENT_SET
+	if (usbi_using_epoll(ctx))
+		usbi_epoll_remove(ctx, os_handle, ievent_source->data.poll_events);
+#endif
+
+	/* the event handler may still hold a copy of this source in its list
+	 * of ready fds, so it is only freed once the handler has been told.
+	 * With epoll the interest set is already up to date and the handler
+	 * frees it on its next iteration, without being interrupted. */
 	list_del(&ievent_source->list);
 	list_add_tail(&ievent_source->list, &ctx->removed_event_sources);
-	usbi_event_source_notification(ctx);
+#ifdef HAVE_EVENT_SET
+	if (!usbi_using_epoll(ctx))
+#endif
+		usbi_event_source_notification(ctx);
 	usbi_mutex_unlock(&ctx->event_data_lock);
 
 #if !defined(PLATFORM_WINDOWS)
@@ -2787,6 +5975,40 @@ out:
 #endif
 }
 
+/** \ingroup libusb_poll
+ * Retrieve a single file descriptor standing for all the event sources of a
+ * context, see \ref eventfd.
+ *
+ * The file descriptor is an epoll instance holding the event sources, or a
+ * kqueue on macOS and the BSDs, and is only available when the context
+ * monitors them that way, which needs
+ * \ref libusb_option::LIBUSB_OPTION_USE_EPOLL "LIBUSB_OPTION_USE_EPOLL" to be
+ * set at initialization. Poll it for POLLIN, and call
+ * libusb_handle_events_timeout() or a variant when it is readable. It stays
+ * valid until the context is destroyed and must not be closed, read or
+ * modified with epoll_ctl() or kevent() by the application.
+ *
+ * Event sources of the additional loops set up with
+ * \ref libusb_option::LIBUSB_OPTION_EVENT_LOOPS "LIBUSB_OPTION_EVENT_LOOPS"
+ * are not covered, those loops are run with libusb_handle_events_loop().
+ *
+ * Since version 1.0.27, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param ctx the context to operate on, or NULL for the default context
+ * \returns the file descriptor
+ * \returns \ref LIBUSB_ERROR_NOT_SUPPORTED if the context does not use epoll,
+ * or on platforms where the functionality is not available
+ */
+int API_EXPORTED libusb_get_event_fd(libusb_context *ctx)
+{
+	ctx = usbi_get_context(ctx);
+#ifdef HAVE_EVENT_SET
+	if (usbi_using_epoll(ctx))
+		return ctx->epoll_fd;
+#endif
+	return LIBUSB_ERROR_NOT_SUPPORTED;
+}
+
 /** \ingroup libusb_poll
  * Free a list of libusb_pollfd structures. This should be called for all
  * pollfd lists allocated with libusb_get_pollfds().
@@ -2807,6 +6029,9 @@ void API_EXPORTED libusb_free_pollfds(const struct libusb_pollfd **pollfds)
 #endif
 }
 
+/* number of transfers collected per pass of usbi_handle_disconnect() */
+#define DISCONNECT_BATCH_SIZE	64
+
 /* Backends may call this from handle_events to report disconnection of a
  * device. This function ensures transfers get cancelled appropriately.
  * Callers of this function must hold the events_lock.
@@ -2815,7 +6040,8 @@ void usbi_handle_disconnect(struct libusb_device_handle *dev_handle)
 {
 	struct libusb_context *ctx = HANDLE_CTX(dev_handle);
 	struct usbi_transfer *cur;
-	struct usbi_transfer *to_cancel;
+	struct usbi_transfer *to_cancel[DISCONNECT_BATCH_SIZE];
+	unsigned int i, num_to_cancel;
 
 	usbi_dbg(ctx, "device %d.%d",
 		dev_handle->dev->bus_number, dev_handle->dev->device_address);
@@ -2831,33 +6057,46 @@ void usbi_handle_disconnect(struct libusb_device_handle *dev_handle)
 	 *    libusb_submit_transfer, has failed to submit and
 	 *    libusb_submit_transfer is waiting for us to release the
 	 *    flying_transfers_lock to remove it, so we ignore it
+	 *
+	 * the in-flight transfers are collected in batches with a single pass
+	 * over the list each, and another pass is made until none is left,
+	 * which also catches transfers resubmitted from the callbacks.
+	 *
+	 * a collected transfer is claimed by clearing its in-flight flag, under
+	 * its lock so that a submission in progress is over first. nothing else
+	 * completes it then, so it stays valid while the callbacks of the
+	 * transfers before it in the batch run.
 	 */
 
-	while (1) {
-		to_cancel = NULL;
-		usbi_mutex_lock(&ctx->flying_transfers_lock);
-		for_each_transfer(ctx, cur) {
-			if (USBI_TRANSFER_TO_LIBUSB_TRANSFER(cur)->dev_handle == dev_handle) {
-				usbi_mutex_lock(&cur->lock);
-				if (cur->state_flags & USBI_TRANSFER_IN_FLIGHT)
-					to_cancel = cur;
-				usbi_mutex_unlock(&cur->lock);
-
-				if (to_cancel)
-					break;
-			}
-		}
-		usbi_mutex_unlock(&ctx->flying_transfers_lock);
+	do {
+		num_to_cancel = 0;
+		usbi_mutex_lock(&dev_handle->flying_transfers_lock);
+		for_each_transfer(dev_handle, cur) {
+			uint32_t state;
 
-		if (!to_cancel)
-			break;
+			if (!(usbi_transfer_state(cur) & USBI_TRANSFER_IN_FLIGHT))
+				continue;
 
-		usbi_dbg(ctx, "cancelling transfer %p from disconnect",
-			 (void *) USBI_TRANSFER_TO_LIBUSB_TRANSFER(to_cancel));
+			usbi_mutex_lock(&cur->lock);
+			state = usbi_transfer_update_state(cur, 0, USBI_TRANSFER_IN_FLIGHT);
+			usbi_mutex_unlock(&cur->lock);
+			if (!(state & USBI_TRANSFER_IN_FLIGHT))
+				continue;
 
-		usbi_mutex_lock(&to_cancel->lock);
-		usbi_backend.clear_transfer_priv(to_cancel);
-		usbi_mutex_unlock(&to_cancel->lock);
-		usbi_handle_transfer_completion(to_cancel, LIBUSB_TRANSFER_NO_DEVICE);
-	}
+			to_cancel[num_to_cancel++] = cur;
+			if (num_to_cancel == DISCONNECT_BATCH_SIZE)
+				break;
+		}
+		usbi_mutex_unlock(&dev_handle->flying_transfers_lock);
+
+		for (i = 0; i < num_to_cancel; i++) {
+			usbi_dbg(ctx, "cancelling transfer %p from disconnect",
+				 (void *) USBI_TRANSFER_TO_LIBUSB_TRANSFER(to_cancel[i]));
+
+			usbi_mutex_lock(&to_cancel[i]->lock);
+			usbi_backend.clear_transfer_priv(to_cancel[i]);
+			usbi_mutex_unlock(&to_cancel[i]->lock);
+			usbi_handle_transfer_completion(to_cancel[i], LIBUSB_TRANSFER_NO_DEVICE);
+		}
+	} while (num_to_cancel);
 }
@@ -146,7 +146,7 @@ typedef SSIZE_T ssize_t;
  * Internally, LIBUSB_API_VERSION is defined as follows:
  * (libusb major << 24) | (libusb minor << 16) | (16 bit incremental)
  */
-#define LIBUSB_API_VERSION 0x0100010A
+#define LIBUSB_API_VERSION 0x0100010B
 
 /* The following is kept for compatibility, but will be deprecated in the future */
 #define LIBUSBX_API_VERSION LIBUSB_API_VERSION
@@ -699,6 +699,34 @@ struct libusb_interface_association_descriptor_array {
 	int length;
 };
 
+/** \ingroup libusb_desc
+ * A view of a single descriptor within a raw descriptor buffer, as returned
+ * by libusb_descriptor_iterator_next(). The descriptor is not converted to
+ * host-endian format.
+ */
+struct libusb_raw_descriptor {
+	/** Size of this descriptor (in bytes) */
+	uint8_t  bLength;
+
+	/** Descriptor type. Will have one of the \ref libusb_descriptor_type
+	 * values, or a class or vendor specific value. */
+	uint8_t  bDescriptorType;
+
+	/** The bLength bytes of the descriptor, header included. Points into
+	 * the buffer being iterated over. */
+	const unsigned char *data;
+};
+
+/** \ingroup libusb_desc
+ * Iterator over the descriptors of a raw descriptor buffer. Initialize it
+ * with libusb_descriptor_iterator_init(). The fields are private.
+ */
+struct libusb_descriptor_iterator {
+	/** \privatesection */
+	const unsigned char *pos;
+	int remaining;
+};
+
 /** \ingroup libusb_desc
  * A structure representing the standard USB interface descriptor. This
  * descriptor is documented in section 9.6.5 of the USB 3.0 specification.
@@ -766,6 +794,10 @@ struct libusb_interface {
  * A structure representing the standard USB configuration descriptor. This
  * descriptor is documented in section 9.6.3 of the USB 3.0 specification.
  * All multiple-byte fields are represented in host-endian format.
+ *
+ * The configuration descriptors returned by libusb are shared between their
+ * callers, so they and everything they point to are read-only. See
+ * libusb_get_active_config_descriptor().
  */
 struct libusb_config_descriptor {
 	/** Size of this descriptor (in bytes) */
@@ -1120,6 +1152,40 @@ typedef struct libusb_device libusb_device;
  */
 typedef struct libusb_device_handle libusb_device_handle;
 
+/** \ingroup libusb_asyncio
+ * Structure representing a pool of fixed-size data buffers carved out of
+ * a few large device memory regions, see libusb_dev_mem_pool_create(). This
+ * is an opaque type for which you are only ever provided with a pointer.
+ *
+ * Since version 1.0.27, \ref LIBUSB_API_VERSION >= 0x0100010B
+ */
+typedef struct libusb_dev_mem_pool libusb_dev_mem_pool;
+
+/** \ingroup libusb_asyncio
+ * Flags for libusb_dev_mem_pool_create_with_flags(). They only affect the
+ * regions of a pool that are made of host memory, and are ignored where the
+ * platform does not support them.
+ *
+ * Since version 1.0.27, \ref LIBUSB_API_VERSION >= 0x0100010B
+ */
+enum libusb_dev_mem_pool_flags {
+	/** Always use host memory for the regions of the pool instead of
+	 * memory from libusb_dev_mem_alloc(). Device memory is a limited
+	 * resource on most platforms, so this suits large pools. */
+	LIBUSB_DEV_MEM_POOL_HOST_MEMORY = (1U << 0),
+
+	/** Place host memory regions on the NUMA node of the host controller
+	 * the device is attached to. The node is a preference, so allocations
+	 * still succeed when that node runs out of memory. */
+	LIBUSB_DEV_MEM_POOL_NUMA_LOCAL = (1U << 1),
+
+	/** Back host memory regions with huge pages, falling back to
+	 * transparent huge pages and then to normal pages. Regions are rounded
+	 * up to a multiple of the huge page size, so buffers_per_region should
+	 * be chosen to fill one or more huge pages. */
+	LIBUSB_DEV_MEM_POOL_HUGE_PAGES = (1U << 2)
+};
+
 /** \ingroup libusb_dev
  * Speed codes. Indicates the speed at which the device is operating.
  */
@@ -1291,7 +1357,58 @@ enum libusb_transfer_flags {
 	 *
 	 * Available since libusb-1.0.9.
 	 */
-	LIBUSB_TRANSFER_ADD_ZERO_PACKET = (1U << 3)
+	LIBUSB_TRANSFER_ADD_ZERO_PACKET = (1U << 3),
+
+	/** All packets of this isochronous transfer have the length of the
+	 * first one, as set by libusb_set_iso_packet_lengths(). Backends then
+	 * do not read the length of every packet descriptor on submission.
+	 *
+	 * Since version 1.0.27, \ref LIBUSB_API_VERSION >= 0x0100010B
+	 */
+	LIBUSB_TRANSFER_ISO_UNIFORM_PACKETS = (1U << 4),
+
+	/** Before the callback of this isochronous IN transfer is invoked,
+	 * move the data received in each packet to the start of the buffer,
+	 * one packet directly after the other, closing the gaps left by short
+	 * packets. \ref libusb_transfer::actual_length "actual_length" is then
+	 * set to the total number of bytes received.
+	 *
+	 * The packet descriptors are left untouched, so packet offsets computed
+	 * from their lengths no longer point at the packet data once this flag
+	 * has been applied.
+	 *
+	 * Since version 1.0.27, \ref LIBUSB_API_VERSION >= 0x0100010B
+	 */
+	LIBUSB_TRANSFER_ISO_COMPACT = (1U << 5),
+
+	/** Schedule this isochronous transfer in the frame directly after the
+	 * last frame of the transfer previously submitted on the same endpoint,
+	 * instead of as soon as possible. Queuing several transfers with this
+	 * flag keeps a stream free of gaps; packets whose frame has already
+	 * passed are reported with an error status instead of shifting the
+	 * rest of the stream. When nothing is queued on the endpoint the
+	 * transfer is scheduled as soon as possible.
+	 *
+	 * This flag is currently honoured on Linux and Darwin, and ignored
+	 * elsewhere.
+	 *
+	 * Since version 1.0.27, \ref LIBUSB_API_VERSION >= 0x0100010B
+	 */
+	LIBUSB_TRANSFER_ISO_CONTINUE = (1U << 6),
+
+	/** Dispatch the completion of this transfer ahead of the completions
+	 * of other transfers handled in the same event handling iteration.
+	 * While a transfer with this flag is in flight on a context, the
+	 * callbacks of the other transfers that complete while events are
+	 * handled are held back until the end of the iteration. A
+	 * latency-critical interrupt or control transfer then does not wait
+	 * behind a long run of bulk completions, and whatever its callback
+	 * resubmits reaches the backend before the bulk transfers resubmitted
+	 * by theirs.
+	 *
+	 * Since version 1.0.27, \ref LIBUSB_API_VERSION >= 0x0100010B
+	 */
+	LIBUSB_TRANSFER_HIGH_PRIORITY = (1U << 7)
 };
 
 /** \ingroup libusb_asyncio
@@ -1357,7 +1474,7 @@ struct libusb_transfer {
 
 	/** Actual length of data that was transferred. Read-only, and only for
 	 * use within transfer callback function. Not valid for isochronous
-	 * endpoint transfers. */
+	 * endpoint transfers, unless \ref LIBUSB_TRANSFER_ISO_COMPACT is set. */
 	int actual_length;
 
 	/** Callback function. This will be invoked when the transfer completes,
@@ -1387,6 +1504,287 @@ struct libusb_transfer {
 	struct libusb_iso_packet_descriptor iso_packet_desc[ZERO_SIZED_ARRAY];
 };
 
+/** \ingroup libusb_asyncio
+ * A segment of a scatter-gather transfer buffer, see
+ * libusb_transfer_set_iovec().
+ *
+ * Since version 1.0.27, \ref LIBUSB_API_VERSION >= 0x0100010B
+ */
+struct libusb_iovec {
+	/** Start of the segment */
+	unsigned char *buffer;
+
+	/** Length of the segment in bytes */
+	int length;
+};
+
+/** \ingroup libusb_poll
+ * Event handling statistics of a context, see libusb_get_event_stats().
+ * They are only kept while \ref LIBUSB_OPTION_EVENT_STATS is enabled.
+ *
+ * Since version 1.0.27, \ref LIBUSB_API_VERSION >= 0x0100010B
+ */
+struct libusb_event_stats {
+	/** Number of times the event handler returned from waiting for events */
+	uint64_t wakeups;
+
+	/** Number of wakeups without any event to handle, usually because the
+	 * wait timed out */
+	uint64_t empty_wakeups;
+
+	/** Number of times libusb_try_lock_events() found the event handling
+	 * lock held by another thread */
+	uint64_t events_lock_contended;
+
+	/** Time spent waiting for events, in microseconds */
+	uint64_t wait_time_us;
+
+	/** Time spent handling internal events such as completions signalled
+	 * by the backend and hotplug messages, in microseconds, not counting
+	 * the transfer callbacks */
+	uint64_t internal_events_time_us;
+
+	/** Time spent in the backend handling events on device file
+	 * descriptors, in microseconds, not counting the transfer callbacks */
+	uint64_t backend_time_us;
+
+	/** Time spent handling transfer timeouts, in microseconds */
+	uint64_t timeouts_time_us;
+
+	/** Number of transfer callbacks called by the event handler */
+	uint64_t callbacks;
+
+	/** Time spent in transfer callbacks, in microseconds. It is not part
+	 * of the internal events or backend time of the event handling step
+	 * that called the callbacks. */
+	uint64_t callback_time_us;
+
+	/** Longest time spent in a single transfer callback, in microseconds */
+	uint64_t max_callback_time_us;
+};
+
+/** \ingroup libusb_asyncio
+ * Outcome of all the packets of a completed isochronous transfer, see
+ * libusb_get_iso_transfer_summary().
+ *
+ * Since version 1.0.27, \ref LIBUSB_API_VERSION >= 0x0100010B
+ */
+struct libusb_iso_transfer_summary {
+	/** Sum of the actual_length of all packets */
+	unsigned int actual_length;
+
+	/** Number of packets whose status is not
+	 * \ref LIBUSB_TRANSFER_COMPLETED */
+	int num_error_packets;
+
+	/** Index of the first and the last of those packets, or -1 if there
+	 * are none. Only the packets in this range need to be looked at to
+	 * find the failed ones. */
+	int first_error_packet;
+	int last_error_packet;
+};
+
+/** \ingroup libusb_asyncio
+ * Kinds of \ref libusb_capture_record.
+ *
+ * Since version 1.0.27, \ref LIBUSB_API_VERSION >= 0x0100010B
+ */
+enum libusb_capture_event {
+	/** The transfer is about to be handed to the backend */
+	LIBUSB_CAPTURE_SUBMIT = 0,
+
+	/** The transfer completed, \ref libusb_capture_record::status "status"
+	 * is its \ref libusb_transfer_status */
+	LIBUSB_CAPTURE_COMPLETE = 1,
+
+	/** The backend refused the transfer, \ref libusb_capture_record::status
+	 * "status" is the \ref libusb_error it returned */
+	LIBUSB_CAPTURE_SUBMIT_ERROR = 2
+};
+
+/** \ingroup libusb_asyncio
+ * A transfer event recorded by libusb_capture_start(). All records of a
+ * capture have the same size, \ref record_size, of which this header is
+ * the start and the captured data is the rest.
+ *
+ * Since version 1.0.27, \ref LIBUSB_API_VERSION >= 0x0100010B
+ */
+struct libusb_capture_record {
+	/** Position of the record in the capture, starting at 1. It is 0
+	 * while the record is written and set last, so a reader of the
+	 * capture file can tell the order of the records and skip slots which
+	 * are being written. */
+	uint64_t sequence;
+
+	/** Time of the event, in nanoseconds since the epoch */
+	uint64_t timestamp_ns;
+
+	/** Identifies the transfer, the same for its submit and completion */
+	uint64_t transfer_id;
+
+	/** Size of the record in bytes, including the captured data */
+	uint32_t record_size;
+
+	/** Length of the transfer when submitted, actual length when
+	 * completed. Includes the setup packet of submitted control transfers,
+	 * like \ref libusb_transfer::length "length". */
+	int32_t length;
+
+	/** See \ref libusb_capture_event */
+	int32_t status;
+
+	/** Number of bytes in \ref data. Data going out is captured on submit,
+	 * data coming in on completion, each up to the snapshot length of the
+	 * capture. For control transfers, the setup packet is captured on
+	 * submit in both directions. */
+	uint32_t data_length;
+
+	/** A \ref libusb_capture_event */
+	uint8_t event;
+
+	/** A \ref libusb_transfer_type */
+	uint8_t type;
+
+	/** Endpoint address. The direction of control transfers is taken from
+	 * their setup packet. */
+	uint8_t endpoint;
+
+	/** Bus number and address of the device */
+	uint8_t bus_number;
+	uint8_t device_address;
+
+	/** Always 0 */
+	uint8_t reserved[3];
+
+	/** Captured data */
+	unsigned char data[ZERO_SIZED_ARRAY];
+};
+
+/** \ingroup libusb_asyncio
+ * Number of buckets in \ref libusb_endpoint_stats::latency_histogram
+ * "latency_histogram".
+ *
+ * Since version 1.0.27, \ref LIBUSB_API_VERSION >= 0x0100010B
+ */
+#define LIBUSB_ENDPOINT_STATS_LATENCY_BUCKETS	24
+
+/** \ingroup libusb_asyncio
+ * Transfer statistics which libusb keeps for each endpoint of an open device
+ * handle, see libusb_get_endpoint_stats(). All counters start at zero when
+ * the device is opened.
+ *
+ * Since version 1.0.27, \ref LIBUSB_API_VERSION >= 0x0100010B
+ */
+struct libusb_endpoint_stats {
+	/** Number of transfers successfully submitted */
+	uint64_t transfers_submitted;
+
+	/** Number of transfers that completed with
+	 * \ref LIBUSB_TRANSFER_COMPLETED */
+	uint64_t transfers_completed;
+
+	/** Number of transfers that were cancelled */
+	uint64_t transfers_cancelled;
+
+	/** Number of transfers that timed out */
+	uint64_t transfers_timed_out;
+
+	/** Number of transfers that failed with any other status */
+	uint64_t transfers_failed;
+
+	/** Number of bytes transferred, whatever the transfer status */
+	uint64_t bytes_transferred;
+
+	/** Number of completed transfers that transferred less data than
+	 * requested. Not counted for isochronous transfers. */
+	uint64_t short_transfers;
+
+	/** Number of isochronous packets that did not complete successfully */
+	uint64_t iso_packet_errors;
+
+	/** Histogram of the time from submission to completion. Bucket 0
+	 * counts transfers that took under a microsecond, bucket i counts
+	 * those that took at least 2^(i-1) and less than 2^i microseconds, and
+	 * the last bucket also counts all transfers that took longer. */
+	uint64_t latency_histogram[LIBUSB_ENDPOINT_STATS_LATENCY_BUCKETS];
+};
+
+/** \ingroup libusb_asyncio
+ * Structure representing a ring of transfers that libusb keeps queued on a
+ * single endpoint. This is an opaque type for which you are only ever
+ * provided with a pointer, usually originating from
+ * libusb_alloc_transfer_ring().
+ *
+ * Since version 1.0.27, \ref LIBUSB_API_VERSION >= 0x0100010B
+ */
+typedef struct libusb_transfer_ring libusb_transfer_ring;
+
+/** \ingroup libusb_asyncio
+ * Batch callback function type for a transfer ring. When set with
+ * libusb_transfer_ring_set_batch_callback(), it is called once per event
+ * handling iteration with all the transfers of the ring that completed during
+ * that iteration, oldest first, in place of the per-transfer callback.
+ *
+ * Since version 1.0.27, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param ring the transfer ring
+ * \param transfers the completed transfers
+ * \param num_transfers number of entries in transfers
+ * \param user_data user data given to libusb_alloc_transfer_ring()
+ */
+typedef void (LIBUSB_CALL *libusb_transfer_ring_batch_cb_fn)(
+	libusb_transfer_ring *ring, struct libusb_transfer **transfers,
+	int num_transfers, void *user_data);
+
+/** \ingroup libusb_asyncio
+ * Structure representing a queue that transfer completions can be delivered
+ * to, so that their callbacks run in a thread of the application's choosing
+ * rather than in the event handler. This is an opaque type for which you are
+ * only ever provided with a pointer, usually originating from
+ * libusb_completion_queue_create().
+ *
+ * Since version 1.0.27, \ref LIBUSB_API_VERSION >= 0x0100010B
+ */
+typedef struct libusb_completion_queue libusb_completion_queue;
+
+/** \ingroup libusb_syncio
+ * Structure representing a queue of control requests that libusb keeps
+ * several of in flight on a device. This is an opaque type for which you are
+ * only ever provided with a pointer, usually originating from
+ * libusb_control_queue_create().
+ *
+ * Since version 1.0.27, \ref LIBUSB_API_VERSION >= 0x0100010B
+ */
+typedef struct libusb_control_queue libusb_control_queue;
+
+/** \ingroup libusb_asyncio
+ * Structure representing a scheduler that spreads bulk transfers over the
+ * streams of an endpoint. This is an opaque type for which you are only ever
+ * provided with a pointer, usually originating from
+ * libusb_stream_scheduler_create().
+ *
+ * Since version 1.0.27, \ref LIBUSB_API_VERSION >= 0x0100010B
+ */
+typedef struct libusb_stream_scheduler libusb_stream_scheduler;
+
+/** \ingroup libusb_asyncio
+ * Statistics of one stream of a stream scheduler, see
+ * libusb_stream_scheduler_get_stream_stats().
+ *
+ * Since version 1.0.27, \ref LIBUSB_API_VERSION >= 0x0100010B
+ */
+struct libusb_stream_stats {
+	/** Number of transfers currently in flight on the stream */
+	int in_flight;
+
+	/** Number of transfers that completed on the stream, whatever their
+	 * status */
+	uint64_t transfers_completed;
+
+	/** Number of bytes transferred on the stream */
+	uint64_t bytes_transferred;
+};
+
 /** \ingroup libusb_misc
  * Capabilities supported by an instance of libusb on the current running
  * platform. Test if the loaded library supports a given capability by calling
@@ -1545,7 +1943,209 @@ enum libusb_option {
 	 */
 	LIBUSB_OPTION_LOG_CB = 4,
 
-	LIBUSB_OPTION_MAX = 5
+	/** Monitor the context's event sources with epoll.
+	 *
+	 * With this option set, the event sources of a context are kept in a
+	 * persistent epoll interest set instead of a poll() array that is
+	 * rebuilt whenever an event source is added or removed. Each iteration
+	 * of the event handler then only processes the event sources that are
+	 * actually ready, and opening a device no longer interrupts a thread
+	 * that is handling events.
+	 *
+	 * libusb_get_pollfds() and the pollfd notifiers keep reporting the
+	 * individual file descriptors, so applications that poll them directly
+	 * are not affected.
+	 *
+	 * This option must be set at initialization with libusb_init_context(),
+	 * or as a default option before the context is created. Setting it on
+	 * an initialized context has no effect.
+	 *
+	 * Valid on Linux, where the set is an epoll instance, and on macOS,
+	 * NetBSD and OpenBSD, where it is a kqueue. Returns
+	 * \ref LIBUSB_ERROR_NOT_SUPPORTED on all other platforms.
+	 *
+	 *  Since version 1.0.27, \ref LIBUSB_API_VERSION >= 0x0100010B
+	 */
+	LIBUSB_OPTION_USE_EPOLL = 5,
+
+	/** Spread the event sources of a context over several event loops.
+	 *
+	 * This option should be set with an integer argument giving the number
+	 * of event loops, between 1 and 64. It implies
+	 * \ref LIBUSB_OPTION_USE_EPOLL.
+	 *
+	 * Loop 0 is the primary loop. It is run by the regular event handling
+	 * functions such as libusb_handle_events() and handles the timeouts and
+	 * internal events of the context. The other loops are only run by
+	 * libusb_handle_events_loop(), typically each from a thread of its own.
+	 * Every opened device is assigned to one of the loops, which reaps its
+	 * transfers and invokes their callbacks. The primary loop must keep
+	 * running for transfer timeouts to be handled.
+	 *
+	 * With more than one loop, applications must not monitor the file
+	 * descriptors of the context themselves.
+	 *
+	 * This option must be set at initialization with libusb_init_context(),
+	 * or as a default option before the context is created. Setting it on
+	 * an initialized context has no effect.
+	 *
+	 * Valid where \ref LIBUSB_OPTION_USE_EPOLL is. Returns
+	 * \ref LIBUSB_ERROR_NOT_SUPPORTED on all other platforms.
+	 *
+	 *  Since version 1.0.27, \ref LIBUSB_API_VERSION >= 0x0100010B
+	 */
+	LIBUSB_OPTION_EVENT_LOOPS = 6,
+
+	/** Set the number of threads that dequeue I/O completions.
+	 *
+	 * This option should be set with an integer argument between 1 and 64,
+	 * the default being 1. The threads take completions off the I/O
+	 * completion port of the context in batches and hand them to the event
+	 * handler. With several devices streaming at once a single thread can
+	 * become the bottleneck.
+	 *
+	 * With more than one thread, completions of transfers that were
+	 * submitted to the same endpoint may reach the event handler, and thus
+	 * their callbacks, in a different order than they were submitted.
+	 *
+	 * This option must be set at initialization with libusb_init_context(),
+	 * or as a default option before the context is created. Setting it on
+	 * an initialized context has no effect.
+	 *
+	 * Only valid on Windows. Returns \ref LIBUSB_ERROR_NOT_SUPPORTED on all
+	 * other platforms.
+	 *
+	 *  Since version 1.0.27, \ref LIBUSB_API_VERSION >= 0x0100010B
+	 */
+	LIBUSB_OPTION_IO_THREADS = 7,
+
+	/** Set the number of threads that initialize devices when the context
+	 * enumerates them.
+	 *
+	 * This option should be set with an integer argument between 1 and 64,
+	 * the default being 1. The initial scan of the devices done by
+	 * libusb_init_context() reads the descriptors of every device, and on
+	 * hosts with many devices doing so one device after the other makes the
+	 * initialization slow. With more than one thread, the devices are read
+	 * in parallel before being added to the context.
+	 *
+	 * This option must be set at initialization with libusb_init_context(),
+	 * or as a default option before the context is created. Setting it on
+	 * an initialized context has no effect.
+	 *
+	 * Only valid on Linux. Returns \ref LIBUSB_ERROR_NOT_SUPPORTED on all
+	 * other platforms.
+	 *
+	 *  Since version 1.0.27, \ref LIBUSB_API_VERSION >= 0x0100010B
+	 */
+	LIBUSB_OPTION_ENUMERATION_THREADS = 8,
+
+	/** Set how long, in milliseconds, the hotplug monitor gathers device
+	 * arrivals and removals before delivering them to this context.
+	 *
+	 * This option should be set with an integer argument between 0 and
+	 * 1000, the default being 0. When a hub full of devices re-enumerates,
+	 * each of its devices comes and goes separately, and delivering the
+	 * events one by one wakes the event handlers of every context each
+	 * time. With a window, the events that arrive within it of the first
+	 * are delivered together, and a device that arrives and leaves again
+	 * within a batch is not reported at all. Hotplug events are delayed by
+	 * up to the window. The hotplug monitor is shared by all contexts, and
+	 * uses the largest window set on any of them, but only contexts with a
+	 * window of their own drop the events of such devices.
+	 *
+	 * Only valid on Linux. Returns \ref LIBUSB_ERROR_NOT_SUPPORTED on all
+	 * other platforms.
+	 *
+	 *  Since version 1.0.27, \ref LIBUSB_API_VERSION >= 0x0100010B
+	 */
+	LIBUSB_OPTION_HOTPLUG_BATCH_WINDOW = 9,
+
+	/** Output log messages from a background thread
+	 *
+	 * This option should be set with an integer argument, nonzero to enable
+	 * and 0 to disable. While enabled, the thread that logs a message only
+	 * formats its text into a ring buffer, while the message header, the
+	 * output to stderr or the system log and the calls to the log callbacks
+	 * happen on a background thread. This keeps debug logging from slowing
+	 * down event handling. Messages are dropped if the ring is full, and
+	 * the number of dropped messages is logged once there is room again.
+	 *
+	 * This option applies to all contexts. It is turned off again when
+	 * the last context is destroyed, after all queued messages have been
+	 * output.
+	 *
+	 *  Since version 1.0.27, \ref LIBUSB_API_VERSION >= 0x0100010B
+	 */
+	LIBUSB_OPTION_LOG_ASYNC = 10,
+
+	/** Keep statistics about event handling on this context
+	 *
+	 * This option should be set with an integer argument, nonzero to enable
+	 * and 0 to disable. While enabled, the event handler measures the time
+	 * it spends waiting for events, handling them and calling transfer
+	 * callbacks, see \ref libusb_event_stats and libusb_get_event_stats().
+	 * The statistics are disabled by default, which costs a single test per
+	 * measured step.
+	 *
+	 *  Since version 1.0.27, \ref LIBUSB_API_VERSION >= 0x0100010B
+	 */
+	LIBUSB_OPTION_EVENT_STATS = 11,
+
+	/** Round transfer timeouts up to a granularity
+	 *
+	 * This option should be set with an integer argument, the granularity
+	 * in milliseconds between 0 and 1000, the default being 0. The time at
+	 * which a transfer submitted afterwards times out is rounded up to a
+	 * multiple of the granularity, so that transfers with slightly
+	 * different timeouts time out together. Fewer distinct timeouts mean
+	 * that the timer of the event handler is armed and fires less often.
+	 * Transfers never time out early, but may time out up to the
+	 * granularity late.
+	 *
+	 *  Since version 1.0.27, \ref LIBUSB_API_VERSION >= 0x0100010B
+	 */
+	LIBUSB_OPTION_TIMEOUT_GRANULARITY = 12,
+
+	/** Poll for events before sleeping in the event handler
+	 *
+	 * This option should be set with an integer argument, the busy-poll
+	 * budget in microseconds between 0 and 100000, the default being 0.
+	 * Before the event handler sleeps waiting for events, it polls for
+	 * them without sleeping for up to the budget. This saves the scheduler
+	 * latency of waking up for a completion that arrives soon, at the cost
+	 * of keeping a CPU busy. Each time the budget passes without an event
+	 * the handler polls for half as long, and it returns to the full
+	 * budget once events arrive again, so an idle context backs off to
+	 * sleeping.
+	 *
+	 * Busy polling happens on the thread that handles events, which the
+	 * application can pin to a CPU of its choice.
+	 *
+	 *  Since version 1.0.27, \ref LIBUSB_API_VERSION >= 0x0100010B
+	 */
+	LIBUSB_OPTION_BUSY_POLL = 13,
+
+	/** Set a callback called by each internal thread of libusb when it
+	 * starts
+	 *
+	 * This option must be provided an argument of type libusb_thread_cb,
+	 * or NULL to remove the callback. The callback runs on the new thread
+	 * before it does any work, see \ref libusb_thread_cb, so that the
+	 * application can set its CPU affinity and scheduling policy with the
+	 * APIs of the platform.
+	 *
+	 * Threads started for a context use the callback of that context, or
+	 * the one set with a NULL context if it has none. Threads shared by
+	 * all contexts, such as the hotplug monitor, only use the one set with
+	 * a NULL context, which must therefore be set before the first context
+	 * is initialized.
+	 *
+	 *  Since version 1.0.27, \ref LIBUSB_API_VERSION >= 0x0100010B
+	 */
+	LIBUSB_OPTION_THREAD_CB = 14,
+
+	LIBUSB_OPTION_MAX = 15
 };
 
 /** \ingroup libusb_lib
@@ -1562,6 +2162,50 @@ enum libusb_option {
 typedef void (LIBUSB_CALL *libusb_log_cb)(libusb_context *ctx,
 	enum libusb_log_level level, const char *str);
 
+/** \ingroup libusb_lib
+ * Kinds of internal threads reported to a \ref libusb_thread_cb. Which
+ * ones exist depends on the platform and the options in use.
+ *
+ * Since version 1.0.27, \ref LIBUSB_API_VERSION >= 0x0100010B
+ */
+enum libusb_thread_type {
+	/** Monitors device arrival and removal for hotplug. On Darwin, this
+	 * thread also runs the run loop that completes transfers. */
+	LIBUSB_THREAD_EVENT = 0,
+
+	/** Completes transfers, such as the Windows I/O completion threads
+	 * set with \ref LIBUSB_OPTION_IO_THREADS */
+	LIBUSB_THREAD_COMPLETION = 1,
+
+	/** Performs the transfers of one endpoint, on backends without
+	 * asynchronous I/O (Haiku, NetBSD, OpenBSD) */
+	LIBUSB_THREAD_TRANSFER = 2,
+
+	/** Initializes devices during enumeration, see
+	 * \ref LIBUSB_OPTION_ENUMERATION_THREADS */
+	LIBUSB_THREAD_ENUMERATION = 3,
+
+	/** Outputs log messages, see \ref LIBUSB_OPTION_LOG_ASYNC */
+	LIBUSB_THREAD_LOG = 4
+};
+
+/** \ingroup libusb_lib
+ * Callback function called by each internal thread of libusb when it starts,
+ * on that thread, see \ref LIBUSB_OPTION_THREAD_CB. The thread has already
+ * been given a name where the platform supports it.
+ *
+ * The callback must not call libusb functions.
+ *
+ * \param ctx the context the thread was started for, or NULL if it is
+ * shared by all contexts
+ * \param type the kind of thread, see \ref libusb_thread_type
+ * \param name the name of the thread
+ *
+ * Since version 1.0.27, \ref LIBUSB_API_VERSION >= 0x0100010B
+ */
+typedef void (LIBUSB_CALL *libusb_thread_cb)(libusb_context *ctx,
+	enum libusb_thread_type type, const char *name);
+
 /** \ingroup libusb_lib
  * Structure used for setting options through \ref libusb_init_context.
  *
@@ -1573,6 +2217,7 @@ struct libusb_init_option {
   union {
     int64_t ival;
     libusb_log_cb log_cbval;
+    libusb_thread_cb thread_cbval;
   } value;
 };
 
@@ -1660,6 +2305,14 @@ int LIBUSB_CALL libusb_get_active_interface_association_descriptors(libusb_devic
 void LIBUSB_CALL libusb_free_interface_association_descriptors(
 	struct libusb_interface_association_descriptor_array *iad_array);
 
+int LIBUSB_CALL libusb_get_raw_config_descriptor_by_value(libusb_device *dev,
+	uint8_t bConfigurationValue, const unsigned char **buffer);
+void LIBUSB_CALL libusb_descriptor_iterator_init(
+	struct libusb_descriptor_iterator *iter, const unsigned char *buffer,
+	int length);
+int LIBUSB_CALL libusb_descriptor_iterator_next(
+	struct libusb_descriptor_iterator *iter, struct libusb_raw_descriptor *desc);
+
 int LIBUSB_CALL libusb_wrap_sys_device(libusb_context *ctx, intptr_t sys_dev, libusb_device_handle **dev_handle);
 int LIBUSB_CALL libusb_open(libusb_device *dev, libusb_device_handle **dev_handle);
 void LIBUSB_CALL libusb_close(libusb_device_handle *dev_handle);
@@ -1690,6 +2343,17 @@ unsigned char * LIBUSB_CALL libusb_dev_mem_alloc(libusb_device_handle *dev_handl
 	size_t length);
 int LIBUSB_CALL libusb_dev_mem_free(libusb_device_handle *dev_handle,
 	unsigned char *buffer, size_t length);
+int LIBUSB_CALL libusb_dev_mem_pool_create(libusb_device_handle *dev_handle,
+	size_t buffer_size, unsigned int buffers_per_region,
+	libusb_dev_mem_pool **pool);
+int LIBUSB_CALL libusb_dev_mem_pool_create_with_flags(
+	libusb_device_handle *dev_handle, size_t buffer_size,
+	unsigned int buffers_per_region, uint32_t flags,
+	libusb_dev_mem_pool **pool);
+unsigned char * LIBUSB_CALL libusb_dev_mem_pool_alloc(libusb_dev_mem_pool *pool);
+void LIBUSB_CALL libusb_dev_mem_pool_free(libusb_dev_mem_pool *pool,
+	unsigned char *buffer);
+void LIBUSB_CALL libusb_dev_mem_pool_destroy(libusb_dev_mem_pool *pool);
 
 int LIBUSB_CALL libusb_kernel_driver_active(libusb_device_handle *dev_handle,
 	int interface_number);
@@ -1775,12 +2439,56 @@ static inline void libusb_fill_control_setup(unsigned char *buffer,
 
 struct libusb_transfer * LIBUSB_CALL libusb_alloc_transfer(int iso_packets);
 int LIBUSB_CALL libusb_submit_transfer(struct libusb_transfer *transfer);
+int LIBUSB_CALL libusb_submit_transfers(struct libusb_transfer **transfers,
+	int count, int *error);
+int LIBUSB_CALL libusb_alloc_transfer_ring(libusb_device_handle *dev_handle,
+	unsigned char endpoint, unsigned char type, int num_transfers,
+	int length, int num_iso_packets, libusb_transfer_cb_fn callback,
+	void *user_data, libusb_transfer_ring **ring);
+struct libusb_transfer * LIBUSB_CALL libusb_transfer_ring_get_transfer(
+	libusb_transfer_ring *ring, int index);
+int LIBUSB_CALL libusb_transfer_ring_set_batch_callback(
+	libusb_transfer_ring *ring, libusb_transfer_ring_batch_cb_fn callback);
+int LIBUSB_CALL libusb_transfer_ring_set_autotune(libusb_transfer_ring *ring,
+	int min_depth, unsigned int latency_target);
+int LIBUSB_CALL libusb_start_transfer_ring(libusb_transfer_ring *ring);
+void LIBUSB_CALL libusb_stop_transfer_ring(libusb_transfer_ring *ring);
+void LIBUSB_CALL libusb_free_transfer_ring(libusb_transfer_ring *ring);
 int LIBUSB_CALL libusb_cancel_transfer(struct libusb_transfer *transfer);
+int LIBUSB_CALL libusb_cancel_endpoint_transfers(libusb_device_handle *dev_handle,
+	unsigned char endpoint);
 void LIBUSB_CALL libusb_free_transfer(struct libusb_transfer *transfer);
+int LIBUSB_CALL libusb_get_endpoint_stats(libusb_device_handle *dev_handle,
+	unsigned char endpoint, struct libusb_endpoint_stats *stats);
+int LIBUSB_CALL libusb_get_iso_transfer_summary(struct libusb_transfer *transfer,
+	struct libusb_iso_transfer_summary *summary);
 void LIBUSB_CALL libusb_transfer_set_stream_id(
 	struct libusb_transfer *transfer, uint32_t stream_id);
 uint32_t LIBUSB_CALL libusb_transfer_get_stream_id(
 	struct libusb_transfer *transfer);
+int LIBUSB_CALL libusb_stream_scheduler_create(libusb_device_handle *dev_handle,
+	uint32_t num_streams, int depth, libusb_stream_scheduler **sched);
+void LIBUSB_CALL libusb_stream_scheduler_destroy(libusb_stream_scheduler *sched);
+int LIBUSB_CALL libusb_stream_scheduler_submit(libusb_stream_scheduler *sched,
+	struct libusb_transfer *transfer);
+void LIBUSB_CALL libusb_stream_scheduler_cancel(libusb_stream_scheduler *sched);
+int LIBUSB_CALL libusb_stream_scheduler_get_stream_stats(
+	libusb_stream_scheduler *sched, uint32_t stream_id,
+	struct libusb_stream_stats *stats);
+int LIBUSB_CALL libusb_transfer_set_iovec(struct libusb_transfer *transfer,
+	const struct libusb_iovec *iov, int iovcnt);
+int LIBUSB_CALL libusb_completion_queue_create(libusb_context *ctx,
+	libusb_completion_queue **queue);
+void LIBUSB_CALL libusb_completion_queue_destroy(libusb_completion_queue *queue);
+int LIBUSB_CALL libusb_completion_queue_dispatch(libusb_completion_queue *queue,
+	struct timeval *tv);
+int LIBUSB_CALL libusb_transfer_set_completion_queue(
+	struct libusb_transfer *transfer, libusb_completion_queue *queue);
+int LIBUSB_CALL libusb_capture_start(libusb_context *ctx, const char *path,
+	unsigned int num_records, unsigned int snaplen);
+void LIBUSB_CALL libusb_capture_stop(libusb_context *ctx);
+int LIBUSB_CALL libusb_capture_write_pcap(libusb_context *ctx,
+	const char *path);
 
 /** \ingroup libusb_asyncio
  * Helper function to populate the required \ref libusb_transfer fields
@@ -2035,12 +2743,87 @@ static inline unsigned char *libusb_get_iso_packet_buffer_simple(
 	return transfer->buffer + ((int) transfer->iso_packet_desc[0].length * _packet);
 }
 
+/** \ingroup libusb_asyncio
+ * Cursor over the packets of an isochronous transfer. Initialise it with
+ * libusb_iso_packet_iter_init() and advance it with
+ * libusb_iso_packet_iter_next(). The offset of each packet is carried from
+ * one call to the next, so walking all packets of a transfer is linear in
+ * the number of packets, unlike repeated calls to
+ * libusb_get_iso_packet_buffer().
+ *
+ * Since version 1.0.27, \ref LIBUSB_API_VERSION >= 0x0100010B
+ */
+struct libusb_iso_packet_iter {
+	/** The transfer being walked */
+	struct libusb_transfer *transfer;
+
+	/** Index of the next packet to return */
+	int packet;
+
+	/** Offset of the next packet within the transfer buffer */
+	size_t offset;
+};
+
+/** \ingroup libusb_asyncio
+ * Initialise an isochronous packet cursor at the first packet of a transfer.
+ *
+ * Since version 1.0.27, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param iter the cursor to initialise
+ * \param transfer an isochronous transfer
+ */
+static inline void libusb_iso_packet_iter_init(
+	struct libusb_iso_packet_iter *iter, struct libusb_transfer *transfer)
+{
+	iter->transfer = transfer;
+	iter->packet = 0;
+	iter->offset = 0;
+}
+
+/** \ingroup libusb_asyncio
+ * Return the next packet of an isochronous transfer and advance the cursor.
+ *
+ * Since version 1.0.27, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param iter a cursor initialised by libusb_iso_packet_iter_init()
+ * \param desc output location for the descriptor of the packet. May be NULL.
+ * \returns the base address of the packet buffer inside the transfer buffer,
+ * or NULL once all packets have been returned.
+ */
+static inline unsigned char *libusb_iso_packet_iter_next(
+	struct libusb_iso_packet_iter *iter,
+	struct libusb_iso_packet_descriptor **desc)
+{
+	struct libusb_transfer *transfer = iter->transfer;
+	unsigned char *buffer;
+
+	if (iter->packet >= transfer->num_iso_packets)
+		return NULL;
+
+	buffer = transfer->buffer + iter->offset;
+	if (desc)
+		*desc = &transfer->iso_packet_desc[iter->packet];
+	iter->offset += transfer->iso_packet_desc[iter->packet].length;
+	iter->packet++;
+
+	return buffer;
+}
+
 /* sync I/O */
 
 int LIBUSB_CALL libusb_control_transfer(libusb_device_handle *dev_handle,
 	uint8_t request_type, uint8_t bRequest, uint16_t wValue, uint16_t wIndex,
 	unsigned char *data, uint16_t wLength, unsigned int timeout);
 
+int LIBUSB_CALL libusb_control_queue_create(libusb_device_handle *dev_handle,
+	int window, libusb_control_queue **queue);
+int LIBUSB_CALL libusb_control_queue_submit(libusb_control_queue *queue,
+	uint8_t request_type, uint8_t bRequest, uint16_t wValue, uint16_t wIndex,
+	unsigned char *data, uint16_t wLength, unsigned int timeout);
+int LIBUSB_CALL libusb_control_queue_flush(libusb_control_queue *queue,
+	int *failed);
+void LIBUSB_CALL libusb_control_queue_destroy(libusb_control_queue *queue);
+
 int LIBUSB_CALL libusb_bulk_transfer(libusb_device_handle *dev_handle,
 	unsigned char endpoint, unsigned char *data, int length,
 	int *actual_length, unsigned int timeout);
@@ -2093,6 +2876,8 @@ static inline int libusb_get_string_descriptor(libusb_device_handle *dev_handle,
 
 int LIBUSB_CALL libusb_get_string_descriptor_ascii(libusb_device_handle *dev_handle,
 	uint8_t desc_index, unsigned char *data, int length);
+int LIBUSB_CALL libusb_get_string_descriptors_ascii(libusb_device_handle *dev_handle,
+	const uint8_t *desc_indices, unsigned char **data, int *lengths, int count);
 
 /* polling and timeouts */
 
@@ -2105,6 +2890,8 @@ void LIBUSB_CALL libusb_interrupt_event_handler(libusb_context *ctx);
 void LIBUSB_CALL libusb_lock_event_waiters(libusb_context *ctx);
 void LIBUSB_CALL libusb_unlock_event_waiters(libusb_context *ctx);
 int LIBUSB_CALL libusb_wait_for_event(libusb_context *ctx, struct timeval *tv);
+int LIBUSB_CALL libusb_get_event_stats(libusb_context *ctx,
+	struct libusb_event_stats *stats);
 
 int LIBUSB_CALL libusb_handle_events_timeout(libusb_context *ctx,
 	struct timeval *tv);
@@ -2114,6 +2901,8 @@ int LIBUSB_CALL libusb_handle_events(libusb_context *ctx);
 int LIBUSB_CALL libusb_handle_events_completed(libusb_context *ctx, int *completed);
 int LIBUSB_CALL libusb_handle_events_locked(libusb_context *ctx,
 	struct timeval *tv);
+int LIBUSB_CALL libusb_handle_events_loop(libusb_context *ctx, int loop,
+	struct timeval *tv);
 int LIBUSB_CALL libusb_pollfds_handle_timeouts(libusb_context *ctx);
 int LIBUSB_CALL libusb_get_next_timeout(libusb_context *ctx,
 	struct timeval *tv);
@@ -2159,6 +2948,7 @@ typedef void (LIBUSB_CALL *libusb_pollfd_removed_cb)(int fd, void *user_data);
 const struct libusb_pollfd ** LIBUSB_CALL libusb_get_pollfds(
 	libusb_context *ctx);
 void LIBUSB_CALL libusb_free_pollfds(const struct libusb_pollfd **pollfds);
+int LIBUSB_CALL libusb_get_event_fd(libusb_context *ctx);
 void LIBUSB_CALL libusb_set_pollfd_notifiers(libusb_context *ctx,
 	libusb_pollfd_added_cb added_cb, libusb_pollfd_removed_cb removed_cb,
 	void *user_data);
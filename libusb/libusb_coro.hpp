@@ -0,0 +1,563 @@
+/*
+ * Optional C++20 coroutine layer over the libusb asynchronous API
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+#ifndef LIBUSB_CORO_HPP
+#define LIBUSB_CORO_HPP
+
+/*
+ * This header lets C++20 coroutines co_await libusb transfers. It only uses
+ * the public libusb API and needs nothing else from the library.
+ *
+ * A transfer is submitted with libusb_submit_transfer() when it is awaited,
+ * and the awaiting coroutine is resumed directly from the transfer callback,
+ * on the thread handling events. Nothing is allocated per transfer: the
+ * awaiter lives in the coroutine frame, the libusb_transfer is owned by a
+ * reusable libusb::coro::transfer, and coroutine frames of libusb::coro::task
+ * can be placed with an allocator passed as std::allocator_arg.
+ *
+ * As with any transfer callback, code running in a resumed coroutine must not
+ * block and must not handle events, but may submit and cancel transfers.
+ *
+ *	libusb::coro::task<int> read_status(libusb_device_handle *h)
+ *	{
+ *		libusb::coro::transfer t;
+ *		unsigned char buf[64];
+ *		auto r = co_await t.bulk(h, 0x81, buf, sizeof(buf), 1000);
+ *		co_return r ? r.actual_length : -1;
+ *	}
+ *
+ *	int n = libusb::coro::run(ctx, read_status(h));
+ */
+
+#if !defined(__cplusplus) || __cplusplus < 202002L || !defined(__cpp_impl_coroutine)
+#error "libusb_coro.hpp requires C++20 coroutines"
+#endif
+
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <memory>
+#include <new>
+#include <span>
+#include <stdexcept>
+#include <utility>
+#include <variant>
+
+#include "libusb.h"
+
+namespace libusb {
+namespace coro {
+
+/* A libusb error, thrown where a constructor or run() cannot report it. */
+class error : public std::runtime_error {
+public:
+	explicit error(int code)
+		: std::runtime_error(libusb_error_name(code)), code_(code) {}
+
+	/* the libusb_error */
+	int code() const noexcept { return code_; }
+
+private:
+	int code_;
+};
+
+/* Outcome of an awaited transfer. It converts to true if the transfer was
+ * submitted and completed with LIBUSB_TRANSFER_COMPLETED. */
+struct transfer_result {
+	/* 0, or the libusb_error returned by libusb_submit_transfer(), in which
+	 * case the coroutine was not suspended and status is meaningless */
+	int error;
+
+	enum libusb_transfer_status status;
+	int actual_length;
+	struct libusb_transfer *transfer;
+
+	explicit operator bool() const noexcept
+	{
+		return error == 0 && status == LIBUSB_TRANSFER_COMPLETED;
+	}
+};
+
+/* Awaiter that submits a transfer as filled in and resumes the coroutine from
+ * its callback. The callback and user_data of the transfer are taken over. */
+class submit_awaiter {
+public:
+	explicit submit_awaiter(struct libusb_transfer *transfer) noexcept
+		: transfer_(transfer) {}
+
+	bool await_ready() const noexcept { return false; }
+
+	bool await_suspend(std::coroutine_handle<> handle) noexcept
+	{
+		handle_ = handle;
+		transfer_->callback = &submit_awaiter::callback;
+		transfer_->user_data = this;
+
+		/* once submitted, the transfer may complete and resume the
+		 * coroutine on another thread, so this must not be touched
+		 * again unless the submission failed */
+		int r = libusb_submit_transfer(transfer_);
+		if (r == 0)
+			return true;
+
+		error_ = r;
+		return false;
+	}
+
+	transfer_result await_resume() const noexcept
+	{
+		return transfer_result{error_, transfer_->status,
+			transfer_->actual_length, transfer_};
+	}
+
+private:
+	static void LIBUSB_CALL callback(struct libusb_transfer *transfer)
+	{
+		static_cast<submit_awaiter *>(transfer->user_data)->handle_.resume();
+	}
+
+	struct libusb_transfer *transfer_;
+	std::coroutine_handle<> handle_;
+	int error_ = 0;
+};
+
+/* A libusb_transfer owned by the coroutine that awaits it. It is allocated
+ * once and can be filled and awaited any number of times, one at a time.
+ * The buffers are the caller's, for instance from libusb_dev_mem_pool_alloc(). */
+class transfer {
+public:
+	explicit transfer(int iso_packets = 0)
+		: transfer_(libusb_alloc_transfer(iso_packets))
+	{
+		if (!transfer_)
+			throw error(LIBUSB_ERROR_NO_MEM);
+	}
+
+	~transfer() { libusb_free_transfer(transfer_); }
+
+	transfer(const transfer &) = delete;
+	transfer &operator=(const transfer &) = delete;
+
+	struct libusb_transfer *get() const noexcept { return transfer_; }
+
+	/* submit the transfer as it has been filled in */
+	submit_awaiter operator co_await() const noexcept
+	{
+		return submit_awaiter(transfer_);
+	}
+
+	submit_awaiter bulk(libusb_device_handle *dev_handle,
+		unsigned char endpoint, unsigned char *buffer, int length,
+		unsigned int timeout = 0) noexcept
+	{
+		libusb_fill_bulk_transfer(transfer_, dev_handle, endpoint, buffer,
+			length, nullptr, nullptr, timeout);
+		return submit_awaiter(transfer_);
+	}
+
+	submit_awaiter interrupt(libusb_device_handle *dev_handle,
+		unsigned char endpoint, unsigned char *buffer, int length,
+		unsigned int timeout = 0) noexcept
+	{
+		libusb_fill_interrupt_transfer(transfer_, dev_handle, endpoint,
+			buffer, length, nullptr, nullptr, timeout);
+		return submit_awaiter(transfer_);
+	}
+
+	/* buffer starts with the setup packet, see libusb_fill_control_setup(),
+	 * and the data is at libusb_control_transfer_get_data() */
+	submit_awaiter control(libusb_device_handle *dev_handle,
+		unsigned char *buffer, unsigned int timeout = 0) noexcept
+	{
+		libusb_fill_control_transfer(transfer_, dev_handle, buffer,
+			nullptr, nullptr, timeout);
+		return submit_awaiter(transfer_);
+	}
+
+	/* buffer holds LIBUSB_CONTROL_SETUP_SIZE + wLength bytes */
+	submit_awaiter control(libusb_device_handle *dev_handle,
+		uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue,
+		uint16_t wIndex, unsigned char *buffer, uint16_t wLength,
+		unsigned int timeout = 0) noexcept
+	{
+		libusb_fill_control_setup(buffer, bmRequestType, bRequest, wValue,
+			wIndex, wLength);
+		return control(dev_handle, buffer, timeout);
+	}
+
+	/* num_iso_packets must not exceed the iso_packets the transfer was
+	 * constructed with */
+	submit_awaiter iso(libusb_device_handle *dev_handle,
+		unsigned char endpoint, unsigned char *buffer, int length,
+		int num_iso_packets, unsigned int packet_length,
+		unsigned int timeout = 0) noexcept
+	{
+		libusb_fill_iso_transfer(transfer_, dev_handle, endpoint, buffer,
+			length, num_iso_packets, nullptr, nullptr, timeout);
+		libusb_set_iso_packet_lengths(transfer_, packet_length);
+		return submit_awaiter(transfer_);
+	}
+
+private:
+	struct libusb_transfer *transfer_;
+};
+
+/* A transfer ring with a batch callback, see libusb_alloc_transfer_ring(),
+ * whose batches are awaited with next_batch(). The awaiting coroutine is
+ * resumed from the batch callback and owns the batch until it awaits the next
+ * one; the transfers are resubmitted after that. Batches that complete while
+ * no coroutine is waiting are counted in missed_batches() and resubmitted
+ * unseen. Once the ring is stopped and its transfers retired, there are no
+ * more batches to resume a waiting coroutine with. */
+class ring {
+public:
+	ring(libusb_device_handle *dev_handle, unsigned char endpoint,
+		unsigned char type, int num_transfers, int length,
+		int num_iso_packets = 0)
+	{
+		int r = libusb_alloc_transfer_ring(dev_handle, endpoint, type,
+			num_transfers, length, num_iso_packets, &ring::transfer_callback,
+			this, &ring_);
+		if (r == 0) {
+			r = libusb_transfer_ring_set_batch_callback(ring_,
+				&ring::batch_callback);
+			if (r < 0)
+				libusb_free_transfer_ring(ring_);
+		}
+		if (r < 0)
+			throw error(r);
+	}
+
+	/* handles events until the transfers are retired, without resuming a
+	 * coroutine still waiting for a batch */
+	~ring()
+	{
+		waiter_ = nullptr;
+		libusb_free_transfer_ring(ring_);
+	}
+
+	ring(const ring &) = delete;
+	ring &operator=(const ring &) = delete;
+
+	libusb_transfer_ring *get() const noexcept { return ring_; }
+
+	int start() noexcept { return libusb_start_transfer_ring(ring_); }
+	void stop() noexcept { libusb_stop_transfer_ring(ring_); }
+
+	uint64_t missed_batches() const noexcept { return missed_; }
+
+	class batch_awaiter {
+	public:
+		explicit batch_awaiter(ring &r) noexcept : ring_(r) {}
+
+		bool await_ready() const noexcept { return false; }
+
+		void await_suspend(std::coroutine_handle<> handle) noexcept
+		{
+			ring_.waiter_ = handle;
+		}
+
+		/* the completed transfers, oldest first */
+		std::span<struct libusb_transfer *const> await_resume() const noexcept
+		{
+			return ring_.batch_;
+		}
+
+	private:
+		ring &ring_;
+	};
+
+	/* only one coroutine may wait for a batch at a time */
+	batch_awaiter next_batch() noexcept { return batch_awaiter(*this); }
+
+private:
+	static void LIBUSB_CALL transfer_callback(struct libusb_transfer *)
+	{
+	}
+
+	static void LIBUSB_CALL batch_callback(libusb_transfer_ring *,
+		struct libusb_transfer **transfers, int num_transfers,
+		void *user_data)
+	{
+		ring *self = static_cast<ring *>(user_data);
+		std::coroutine_handle<> waiter = std::exchange(self->waiter_, nullptr);
+
+		if (!waiter) {
+			self->missed_++;
+			return;
+		}
+
+		self->batch_ = std::span<struct libusb_transfer *const>(transfers,
+			static_cast<std::size_t>(num_transfers));
+		waiter.resume();
+	}
+
+	libusb_transfer_ring *ring_ = nullptr;
+	std::coroutine_handle<> waiter_;
+	std::span<struct libusb_transfer *const> batch_;
+	uint64_t missed_ = 0;
+};
+
+namespace detail {
+
+/* Coroutine frames are allocated with the allocator passed after
+ * std::allocator_arg, or std::allocator otherwise. The function that releases
+ * the frame is stored behind it, followed by a copy of the allocator.
+ *
+ * GCC 12 warns with -Wmismatched-new-delete about coroutines given an
+ * allocator, as the frame is released with the usual operator delete. This
+ * is how the language releases coroutine frames, the warning is spurious. */
+class frame_allocation {
+	struct alignas(__STDCPP_DEFAULT_NEW_ALIGNMENT__) block {
+		std::byte bytes[__STDCPP_DEFAULT_NEW_ALIGNMENT__];
+	};
+
+	using deallocate_fn = void (*)(void *frame, std::size_t size) noexcept;
+
+	template <typename Alloc>
+	using block_alloc =
+		typename std::allocator_traits<Alloc>::template rebind_alloc<block>;
+
+	static constexpr std::size_t align_up(std::size_t n, std::size_t a) noexcept
+	{
+		return (n + a - 1) & ~(a - 1);
+	}
+
+	static constexpr std::size_t fn_offset(std::size_t size) noexcept
+	{
+		return align_up(size, alignof(deallocate_fn));
+	}
+
+	template <typename Alloc>
+	static constexpr std::size_t alloc_offset(std::size_t size) noexcept
+	{
+		return align_up(fn_offset(size) + sizeof(deallocate_fn),
+			alignof(block_alloc<Alloc>));
+	}
+
+	template <typename Alloc>
+	static constexpr std::size_t num_blocks(std::size_t size) noexcept
+	{
+		return (alloc_offset<Alloc>(size) + sizeof(block_alloc<Alloc>) +
+			sizeof(block) - 1) / sizeof(block);
+	}
+
+	template <typename Alloc>
+	static void *allocate(std::size_t size, const Alloc &alloc)
+	{
+		block_alloc<Alloc> a(alloc);
+		std::byte *frame = reinterpret_cast<std::byte *>(
+			std::allocator_traits<block_alloc<Alloc>>::allocate(a,
+				num_blocks<Alloc>(size)));
+
+		::new (frame + fn_offset(size)) deallocate_fn(&deallocate<Alloc>);
+		::new (frame + alloc_offset<Alloc>(size)) block_alloc<Alloc>(std::move(a));
+		return frame;
+	}
+
+	template <typename Alloc>
+	static void deallocate(void *p, std::size_t size) noexcept
+	{
+		std::byte *frame = static_cast<std::byte *>(p);
+		block_alloc<Alloc> *stored = std::launder(
+			reinterpret_cast<block_alloc<Alloc> *>(frame + alloc_offset<Alloc>(size)));
+		block_alloc<Alloc> a(std::move(*stored));
+
+		stored->~block_alloc<Alloc>();
+		std::allocator_traits<block_alloc<Alloc>>::deallocate(a,
+			reinterpret_cast<block *>(frame), num_blocks<Alloc>(size));
+	}
+
+public:
+	static void *operator new(std::size_t size)
+	{
+		return allocate(size, std::allocator<block>());
+	}
+
+	template <typename Alloc, typename... Args>
+	static void *operator new(std::size_t size, std::allocator_arg_t,
+		const Alloc &alloc, const Args &...)
+	{
+		return allocate(size, alloc);
+	}
+
+	/* member function coroutines get the object first */
+	template <typename Object, typename Alloc, typename... Args>
+	static void *operator new(std::size_t size, const Object &,
+		std::allocator_arg_t, const Alloc &alloc, const Args &...)
+	{
+		return allocate(size, alloc);
+	}
+
+	static void operator delete(void *frame, std::size_t size) noexcept
+	{
+		deallocate_fn fn = *std::launder(reinterpret_cast<deallocate_fn *>(
+			static_cast<std::byte *>(frame) + fn_offset(size)));
+
+		fn(frame, size);
+	}
+};
+
+template <typename Promise>
+struct final_awaiter {
+	bool await_ready() const noexcept { return false; }
+
+	std::coroutine_handle<> await_suspend(
+		std::coroutine_handle<Promise> handle) const noexcept
+	{
+		std::coroutine_handle<> continuation = handle.promise().continuation;
+
+		return continuation ? continuation : std::noop_coroutine();
+	}
+
+	void await_resume() const noexcept {}
+};
+
+template <typename T>
+class promise_result {
+public:
+	template <typename U>
+	void return_value(U &&value)
+	{
+		result_.template emplace<1>(std::forward<U>(value));
+	}
+
+	void unhandled_exception() noexcept
+	{
+		result_.template emplace<2>(std::current_exception());
+	}
+
+	T result()
+	{
+		if (result_.index() == 2)
+			std::rethrow_exception(std::get<2>(result_));
+		return std::move(std::get<1>(result_));
+	}
+
+private:
+	std::variant<std::monostate, T, std::exception_ptr> result_;
+};
+
+template <>
+class promise_result<void> {
+public:
+	void return_void() noexcept {}
+
+	void unhandled_exception() noexcept
+	{
+		exception_ = std::current_exception();
+	}
+
+	void result()
+	{
+		if (exception_)
+			std::rethrow_exception(exception_);
+	}
+
+private:
+	std::exception_ptr exception_;
+};
+
+} /* namespace detail */
+
+/* A lazily started coroutine returning T. It runs when awaited, or when
+ * started by run(), and resumes its awaiter directly when it finishes. */
+template <typename T = void>
+class task {
+public:
+	struct promise_type : detail::frame_allocation, detail::promise_result<T> {
+		std::coroutine_handle<> continuation;
+
+		task get_return_object() noexcept
+		{
+			return task(std::coroutine_handle<promise_type>::from_promise(*this));
+		}
+
+		std::suspend_always initial_suspend() const noexcept { return {}; }
+
+		detail::final_awaiter<promise_type> final_suspend() const noexcept
+		{
+			return {};
+		}
+	};
+
+	task(task &&other) noexcept
+		: handle_(std::exchange(other.handle_, nullptr)) {}
+
+	task &operator=(task &&other) noexcept
+	{
+		if (this != &other) {
+			if (handle_)
+				handle_.destroy();
+			handle_ = std::exchange(other.handle_, nullptr);
+		}
+		return *this;
+	}
+
+	~task()
+	{
+		if (handle_)
+			handle_.destroy();
+	}
+
+	bool await_ready() const noexcept { return false; }
+
+	std::coroutine_handle<> await_suspend(
+		std::coroutine_handle<> awaiter) noexcept
+	{
+		handle_.promise().continuation = awaiter;
+		return handle_;
+	}
+
+	T await_resume() { return handle_.promise().result(); }
+
+	/* run the coroutine up to its first suspension */
+	void start() { handle_.resume(); }
+
+	bool done() const noexcept { return handle_.done(); }
+
+	/* the value returned by the coroutine, which must be done */
+	T result() { return handle_.promise().result(); }
+
+private:
+	explicit task(std::coroutine_handle<promise_type> handle) noexcept
+		: handle_(handle) {}
+
+	std::coroutine_handle<promise_type> handle_;
+};
+
+/* Start a task and handle events on ctx until it finishes, returning its
+ * result. This must not be called from a coroutine or a callback. */
+template <typename T>
+T run(libusb_context *ctx, task<T> t)
+{
+	t.start();
+	while (!t.done()) {
+		int r = libusb_handle_events(ctx);
+
+		if (r < 0 && r != LIBUSB_ERROR_INTERRUPTED)
+			throw error(r);
+	}
+	return t.result();
+}
+
+} /* namespace coro */
+} /* namespace libusb */
+
+#endif /* LIBUSB_CORO_HPP */
@@ -79,6 +79,13 @@
 #define UNUSED(var)	do { (void)(var); } while(0)
 #endif
 
+/* Branch prediction hint for conditions that are rarely true */
+#if defined(__GNUC__) || defined(__clang__)
+#define usbi_unlikely(cond)	__builtin_expect(!!(cond), 0)
+#else
+#define usbi_unlikely(cond)	(cond)
+#endif
+
 /* Macro to align a value up to the next multiple of the size of a pointer */
 #define PTR_ALIGN(v) \
 	(((v) + (sizeof(void *) - 1)) & ~(sizeof(void *) - 1))
@@ -92,9 +99,26 @@
  *   usbi_atomic_store() - Atomically write a new value value to a variable
  *   usbi_atomic_inc() - Atomically increment a variable's value and return the new value
  *   usbi_atomic_dec() - Atomically decrement a variable's value and return the new value
+ *   usbi_atomic_cas() - Atomically write a new value if the current one
+ *                       matches an expected value, returns nonzero if so
+ *   usbi_atomic_ptr_load() - Atomically read a pointer
+ *   usbi_atomic_ptr_exchange() - Atomically write a new pointer and return the old one
+ *   usbi_atomic_ptr_cas() - Atomically write a new pointer if the current one
+ *                           matches an expected value, returns nonzero if so
  *
  * All of these operations are ordered with each other, thus the effects of
  * any one operation is guaranteed to be seen by any other operation.
+ *
+ * For statistics counters, the following unordered 64-bit operations are
+ * also defined:
+ *   usbi_atomic64_load() - Atomically read a counter's value
+ *   usbi_atomic64_add() - Atomically add to a counter
+ *   usbi_atomic64_max() - Atomically raise a counter to at least a value
+ *
+ * To order plain memory accesses around the ones above, such as the data
+ * guarded by a sequence number:
+ *   usbi_atomic_fence_release() - Earlier accesses happen before later stores
+ *   usbi_atomic_fence_acquire() - Earlier loads happen before later accesses
  */
 #ifdef _MSC_VER
 typedef volatile LONG usbi_atomic_t;
@@ -102,6 +126,29 @@ typedef volatile LONG usbi_atomic_t;
 #define usbi_atomic_store(a, v)	(*(a)) = (v)
 #define usbi_atomic_inc(a)	InterlockedIncrement((a))
 #define usbi_atomic_dec(a)	InterlockedDecrement((a))
+#define usbi_atomic_cas(a, e, v)	\
+	(InterlockedCompareExchange((a), (v), (e)) == (e))
+typedef volatile LONG64 usbi_atomic64_t;
+#define usbi_atomic64_load(a)	((uint64_t)InterlockedCompareExchange64((a), 0, 0))
+#define usbi_atomic64_add(a, v)	((void)InterlockedExchangeAdd64((a), (LONG64)(v)))
+static inline void usbi_atomic64_max(usbi_atomic64_t *a, uint64_t v)
+{
+	LONG64 cur = *a;
+
+	while ((uint64_t)cur < v) {
+		LONG64 prev = InterlockedCompareExchange64(a, (LONG64)v, cur);
+		if (prev == cur)
+			break;
+		cur = prev;
+	}
+}
+typedef PVOID volatile usbi_atomic_ptr_t;
+#define usbi_atomic_ptr_load(a)	(*(a))
+#define usbi_atomic_ptr_exchange(a, v)	InterlockedExchangePointer((a), (v))
+#define usbi_atomic_ptr_cas(a, e, v)	\
+	(InterlockedCompareExchangePointer((a), (v), (e)) == (e))
+#define usbi_atomic_fence_release()	MemoryBarrier()
+#define usbi_atomic_fence_acquire()	MemoryBarrier()
 #else
 #include <stdatomic.h>
 typedef atomic_long usbi_atomic_t;
@@ -109,6 +156,33 @@ typedef atomic_long usbi_atomic_t;
 #define usbi_atomic_store(a, v)	atomic_store((a), (v))
 #define usbi_atomic_inc(a)	(atomic_fetch_add((a), 1) + 1)
 #define usbi_atomic_dec(a)	(atomic_fetch_add((a), -1) - 1)
+static inline int usbi_atomic_cas(usbi_atomic_t *a, long expected,
+	long desired)
+{
+	return atomic_compare_exchange_strong(a, &expected, desired);
+}
+typedef _Atomic(uint64_t) usbi_atomic64_t;
+#define usbi_atomic64_load(a)	atomic_load_explicit((a), memory_order_relaxed)
+#define usbi_atomic64_add(a, v)	\
+	((void)atomic_fetch_add_explicit((a), (v), memory_order_relaxed))
+static inline void usbi_atomic64_max(usbi_atomic64_t *a, uint64_t v)
+{
+	uint64_t cur = atomic_load_explicit(a, memory_order_relaxed);
+
+	while (cur < v && !atomic_compare_exchange_weak_explicit(a, &cur, v,
+			memory_order_relaxed, memory_order_relaxed))
+		;
+}
+typedef _Atomic(void *) usbi_atomic_ptr_t;
+#define usbi_atomic_ptr_load(a)	atomic_load((a))
+#define usbi_atomic_ptr_exchange(a, v)	atomic_exchange((a), (v))
+static inline int usbi_atomic_ptr_cas(usbi_atomic_ptr_t *a, void *expected,
+	void *desired)
+{
+	return atomic_compare_exchange_strong(a, &expected, desired);
+}
+#define usbi_atomic_fence_release()	atomic_thread_fence(memory_order_release)
+#define usbi_atomic_fence_acquire()	atomic_thread_fence(memory_order_acquire)
 #endif
 
 /* Internal abstractions for event handling and thread synchronization */
@@ -138,9 +212,30 @@ extern "C" {
 #define USB_MAXINTERFACES	32
 #define USB_MAXCONFIG		8
 
+/* Number of buckets of the per-context hotplug callback index */
+#define USBI_HOTPLUG_CB_INDEX_SIZE	64
+
+/* Number of buckets of the per-context device session ID index */
+#define USBI_SESSION_INDEX_SIZE		64
+
+/* Slot of an endpoint address in a table of USB_MAXENDPOINTS entries */
+#define USBI_ENDPOINT_INDEX(ep)	\
+	(((ep) & LIBUSB_ENDPOINT_ADDRESS_MASK) | (((ep) & LIBUSB_ENDPOINT_DIR_MASK) >> 3))
+
 /* Backend specific capabilities */
 #define USBI_CAP_HAS_HID_ACCESS			0x00010000
 #define USBI_CAP_SUPPORTS_DETACH_KERNEL_DRIVER	0x00020000
+/* The backend can submit bulk OUT transfers directly from the segments set
+ * with libusb_transfer_set_iovec(), provided that every segment but the last
+ * is a multiple of the endpoint's maximum packet size */
+#define USBI_CAP_SUPPORTS_BULK_OUT_IOVEC	0x00040000
+/* The backend uses the enumeration_threads of the context to initialize
+ * devices in parallel */
+#define USBI_CAP_PARALLEL_ENUMERATION		0x00080000
+/* The backend hotplug monitor gathers events over the hotplug_batch_window
+ * of the contexts, and applies them to each context as a batch, see
+ * usbi_hotplug_batch_begin() */
+#define USBI_CAP_HOTPLUG_BATCHING		0x00100000
 
 /* Maximum number of bytes in a log line */
 #define USBI_MAX_LOG_LEN	1024
@@ -256,6 +351,14 @@ static inline void *usbi_reallocf(void *ptr, size_t size)
 	return ret;
 }
 
+/* Spread a device session ID over the buckets of a hash index */
+static inline unsigned int usbi_hash_session_id(uint64_t session_id)
+{
+	uint32_t key = (uint32_t)(session_id ^ (session_id >> 32));
+
+	return (key * 2654435761U) >> 16;
+}
+
 #if !defined(USEC_PER_SEC)
 #define USEC_PER_SEC	1000000L
 #endif
@@ -310,10 +413,23 @@ int usbi_vsnprintf(char *dst, size_t size, const char *format, va_list args);
 #define LIBUSB_PRINTF_WIN32
 #endif /* defined(_MSC_VER) && (_MSC_VER < 1900) */
 
+/* Messages above this level are compiled out, e.g. building with
+ * -DUSBI_MAX_LOG_LEVEL=LIBUSB_LOG_LEVEL_INFO removes every usbi_dbg() */
+#ifndef USBI_MAX_LOG_LEVEL
+#define USBI_MAX_LOG_LEVEL	LIBUSB_LOG_LEVEL_DEBUG
+#endif
+
 void usbi_log(struct libusb_context *ctx, enum libusb_log_level level,
 	const char *function, const char *format, ...) PRINTF_FORMAT(4, 5);
 
-#define _usbi_log(ctx, level, ...) usbi_log(ctx, level, __func__, __VA_ARGS__)
+/* Only call into usbi_log() when the message may actually be output, so that
+ * a disabled log statement costs a single load and compare. */
+#define _usbi_log(ctx, level, ...)					\
+	do {								\
+		if ((level) <= USBI_MAX_LOG_LEVEL &&			\
+		    usbi_unlikely(usbi_log_enabled(ctx, level)))	\
+			usbi_log(ctx, level, __func__, __VA_ARGS__);	\
+	} while (0)
 
 #define usbi_err(ctx, ...)	_usbi_log(ctx, LIBUSB_LOG_LEVEL_ERROR, __VA_ARGS__)
 #define usbi_warn(ctx, ...)	_usbi_log(ctx, LIBUSB_LOG_LEVEL_WARNING, __VA_ARGS__)
@@ -329,6 +445,23 @@ void usbi_log(struct libusb_context *ctx, enum libusb_log_level level,
 
 #endif /* ENABLE_LOGGING */
 
+/* Static tracepoints of the "libusb" provider, which SystemTap, bpftrace
+ * and DTrace can attach to. They are only a nop instruction until a tracer
+ * attaches, and compile to nothing without HAVE_USDT. */
+#ifdef HAVE_USDT
+#include <sys/sdt.h>
+#define usbi_trace3(name, a1, a2, a3) \
+	DTRACE_PROBE3(libusb, name, a1, a2, a3)
+#define usbi_trace4(name, a1, a2, a3, a4) \
+	DTRACE_PROBE4(libusb, name, a1, a2, a3, a4)
+#define usbi_trace6(name, a1, a2, a3, a4, a5, a6) \
+	DTRACE_PROBE6(libusb, name, a1, a2, a3, a4, a5, a6)
+#else
+#define usbi_trace3(name, a1, a2, a3)			do { } while (0)
+#define usbi_trace4(name, a1, a2, a3, a4)		do { } while (0)
+#define usbi_trace6(name, a1, a2, a3, a4, a5, a6)	do { } while (0)
+#endif
+
 #define DEVICE_CTX(dev)		((dev)->ctx)
 #define HANDLE_CTX(handle)	((handle) ? DEVICE_CTX((handle)->dev) : NULL)
 #define ITRANSFER_CTX(itransfer) \
@@ -341,6 +474,19 @@ void usbi_log(struct libusb_context *ctx, enum libusb_log_level level,
 #define IS_XFERIN(xfer)		(0 != ((xfer)->endpoint & LIBUSB_ENDPOINT_IN))
 #define IS_XFEROUT(xfer)	(!IS_XFERIN(xfer))
 
+struct usbi_event_stats {
+	usbi_atomic64_t wakeups;
+	usbi_atomic64_t empty_wakeups;
+	usbi_atomic64_t events_lock_contended;
+	usbi_atomic64_t wait_time_us;
+	usbi_atomic64_t internal_events_time_us;
+	usbi_atomic64_t backend_time_us;
+	usbi_atomic64_t timeouts_time_us;
+	usbi_atomic64_t callbacks;
+	usbi_atomic64_t callback_time_us;
+	usbi_atomic64_t max_callback_time_us;
+};
+
 struct libusb_context {
 #if defined(ENABLE_LOGGING) && !defined(ENABLE_DEBUG_LOGGING)
 	enum libusb_log_level debug;
@@ -348,6 +494,10 @@ struct libusb_context {
 	libusb_log_cb log_handler;
 #endif
 
+	/* called by the internal threads of this context when they start, set
+	 * with LIBUSB_OPTION_THREAD_CB */
+	libusb_thread_cb thread_cb;
+
 	/* used for signalling occurrence of an internal event. */
 	usbi_event_t event;
 
@@ -355,11 +505,19 @@ struct libusb_context {
 	/* used for timeout handling, if supported by OS.
 	 * this timer is maintained to trigger on the next pending timeout */
 	usbi_timer_t timer;
+
+	/* the expiry the timer was last armed with, so that it is not armed
+	 * again with the same one. Protected by timeouts_lock. */
+	struct timespec timer_expiry;
+	int timer_armed;
 #endif
 
 	struct list_head usb_devs;
 	usbi_mutex_t usb_devs_lock;
 
+	/* usb_devs again, hashed by session ID. Protected by usb_devs_lock. */
+	struct list_head usb_devs_by_session[USBI_SESSION_INDEX_SIZE];
+
 	/* A list of open handles. Backends are free to traverse this if required.
 	 */
 	struct list_head open_devs;
@@ -370,17 +528,33 @@ struct libusb_context {
 	libusb_hotplug_callback_handle next_hotplug_cb_handle;
 	usbi_mutex_t hotplug_cbs_lock;
 
+	/* The registered hotplug callbacks again, hashed by the most specific
+	 * of vendor ID, product ID and device class they match on, or in
+	 * hotplug_cbs_any if they match any device. Protected by
+	 * hotplug_cbs_lock. */
+	struct list_head hotplug_cb_index[USBI_HOTPLUG_CB_INDEX_SIZE];
+	struct list_head hotplug_cbs_any;
+
+	/* Serial number of the next hotplug callback to be registered, which
+	 * unlike the handle does not wrap. Protected by hotplug_cbs_lock. */
+	uint64_t next_hotplug_cb_serial;
+
 	/* A flag to indicate that the context is ready for hotplug notifications */
 	usbi_atomic_t hotplug_ready;
 
-	/* this is a list of in-flight transfer handles, sorted by timeout
-	 * expiration. URBs to timeout the soonest are placed at the beginning of
-	 * the list, URBs that will time out later are placed after, and urbs with
-	 * infinite timeout are always placed at the very end. */
-	struct list_head flying_transfers;
-	/* Note paths taking both this and usbi_transfer->lock must always
+	/* a binary min-heap of the in-flight transfers that have a finite
+	 * timeout, keyed on usbi_transfer->timeout. The transfer that will time
+	 * out the soonest is always at index 1 (index 0 is unused). Transfers
+	 * with infinite timeout are never placed in the heap.
+	 * Protected by timeouts_lock. */
+	struct usbi_transfer **timeout_heap;
+	unsigned int timeout_heap_len;
+	unsigned int timeout_heap_size;
+
+	/* Protects the timeout heap and usbi_transfer->timeout_flags.
+	 * Note paths taking both this and usbi_transfer->lock must always
 	 * take this lock first */
-	usbi_mutex_t flying_transfers_lock;
+	usbi_mutex_t timeouts_lock;
 
 #if !defined(PLATFORM_WINDOWS)
 	/* user callbacks for pollfd changes */
@@ -395,6 +569,18 @@ struct libusb_context {
 	/* used to see if there is an active thread doing event handling */
 	int event_handler_active;
 
+	/* event handling statistics, only updated while event_stats_enabled
+	 * is set (LIBUSB_OPTION_EVENT_STATS) */
+	usbi_atomic_t event_stats_enabled;
+	struct usbi_event_stats event_stats;
+
+	/* transfer capture started with libusb_capture_start(), or NULL.
+	 * capture_writers counts the threads currently adding a record to it,
+	 * capture_lock serializes starting, stopping and exporting it */
+	usbi_atomic_ptr_t capture;
+	usbi_atomic_t capture_writers;
+	usbi_mutex_t capture_lock;
+
 	/* A thread-local storage key to track which thread is performing event
 	 * handling */
 	usbi_tls_key_t event_handling_key;
@@ -427,18 +613,106 @@ struct libusb_context {
 	void *event_data;
 	unsigned int event_data_cnt;
 
+#ifdef HAVE_EVENT_SET
+	/* set if the context was asked to monitor event sources with epoll */
+	int use_epoll;
+
+	/* epoll instance (kqueue on macOS and the BSDs) holding the persistent
+	 * interest set of event sources, or -1 when event sources are monitored
+	 * with poll() */
+	int epoll_fd;
+
+	/* number of event loops asked for with LIBUSB_OPTION_EVENT_LOOPS, and
+	 * the number actually set up by usbi_io_init(). Device event sources
+	 * are spread over the loops, loop 0 being the one monitored through
+	 * epoll_fd by the regular event handling functions. event_loops holds
+	 * the other num_event_loops - 1 loops. */
+	int requested_event_loops;
+	int num_event_loops;
+	struct usbi_event_loop *event_loops;
+#endif
+
+#ifdef PLATFORM_WINDOWS
+	/* number of I/O completion threads asked for with LIBUSB_OPTION_IO_THREADS,
+	 * or 0 for the default of one */
+	int io_threads;
+#endif
+
+	/* number of threads asked for with LIBUSB_OPTION_ENUMERATION_THREADS, or
+	 * 0 for the default of one */
+	int enumeration_threads;
+
+	/* milliseconds asked for with LIBUSB_OPTION_HOTPLUG_BATCH_WINDOW */
+	usbi_atomic_t hotplug_batch_window;
+
+	/* milliseconds that transfer timeouts are rounded up to a multiple of,
+	 * set with LIBUSB_OPTION_TIMEOUT_GRANULARITY */
+	usbi_atomic_t timeout_granularity;
+
+	/* microseconds that the event handler polls for events before it
+	 * sleeps, set with LIBUSB_OPTION_BUSY_POLL. busy_poll_spin is the time
+	 * it currently spins for, which backs off while nothing arrives, and
+	 * busy_poll_last is the budget it was derived from. Both are only used
+	 * by the thread handling events. */
+	usbi_atomic_t busy_poll;
+	long busy_poll_spin;
+	long busy_poll_last;
+
 	/* A list of pending hotplug messages. Protected by event_data_lock. */
 	struct list_head hotplug_msgs;
 
-	/* A list of pending completed transfers. Protected by event_data_lock. */
+	/* Hotplug messages held back until the end of the current batch.
+	 * Protected by event_data_lock. */
+	struct list_head hotplug_batch_msgs;
+
+	/* nesting depth of the current hotplug batch */
+	usbi_atomic_t hotplug_batch_depth;
+
+	/* Transfers completed by usbi_signal_transfer_completion(), pushed
+	 * without taking a lock, most recent first. Linked through
+	 * completed_next and drained at once by the event handler. */
+	usbi_atomic_ptr_t completed_stack;
+
+	/* Completed transfers that the event handler took off the stack but
+	 * could not process yet. Protected by event_data_lock. */
 	struct list_head completed_transfers;
 
+	/* Number of transfers with LIBUSB_TRANSFER_HIGH_PRIORITY which are in
+	 * flight. While it is non-zero, the event handler defers the other
+	 * completions until the end of its iteration. */
+	usbi_atomic_t high_priority_in_flight;
+
+	/* Transfer rings with a batch callback that have completed transfers
+	 * waiting for the end of the current event handling iteration.
+	 * Protected by event_waiters_lock. */
+	struct list_head ring_batches;
+
 	struct list_head list;
 };
 
 extern struct libusb_context *usbi_default_context;
 extern struct libusb_context *usbi_fallback_context;
 
+#ifdef ENABLE_LOGGING
+#ifdef ENABLE_DEBUG_LOGGING
+#define usbi_log_enabled(ctx, level)	1
+#else
+/* -1 until a context is initialized, LIBUSB_DEBUG is consulted then */
+extern usbi_atomic_t usbi_default_debug_level;
+
+static inline int usbi_log_enabled(struct libusb_context *ctx, enum libusb_log_level level)
+{
+	long default_level;
+
+	if (ctx)
+		return ctx->debug >= level;
+
+	default_level = usbi_atomic_load(&usbi_default_debug_level);
+	return default_level < 0 || default_level >= (long)level;
+}
+#endif
+#endif
+
 extern struct list_head active_contexts_list;
 extern usbi_mutex_static_t active_contexts_lock;
 
@@ -479,15 +753,37 @@ enum usbi_event_flags {
 	USBI_EVENT_DEVICE_CLOSE = 1U << 5,
 };
 
+/* State of one event handling iteration, private to the thread running it.
+ * Several threads can handle events of a context at once, one per event
+ * loop. */
+struct usbi_event_handling {
+	/* completions held back while high-priority transfers are in flight,
+	 * dispatched at the end of the iteration */
+	struct list_head deferred_completions;
+
+	/* time spent in transfer callbacks since the last event handling step
+	 * was accounted for, with event statistics enabled */
+	uint64_t callback_time_us;
+};
+
 /* Macros for managing event handling state */
 static inline int usbi_handling_events(struct libusb_context *ctx)
 {
 	return usbi_tls_key_get(ctx->event_handling_key) != NULL;
 }
 
-static inline void usbi_start_event_handling(struct libusb_context *ctx)
+static inline struct usbi_event_handling *usbi_event_handling_state(
+	struct libusb_context *ctx)
 {
-	usbi_tls_key_set(ctx->event_handling_key, ctx);
+	return usbi_tls_key_get(ctx->event_handling_key);
+}
+
+static inline void usbi_start_event_handling(struct libusb_context *ctx,
+	struct usbi_event_handling *handling)
+{
+	list_init(&handling->deferred_completions);
+	handling->callback_time_us = 0;
+	usbi_tls_key_set(ctx->event_handling_key, handling);
 }
 
 static inline void usbi_end_event_handling(struct libusb_context *ctx)
@@ -509,8 +805,37 @@ struct libusb_device {
 	struct list_head list;
 	unsigned long session_data;
 
+	/* session ID index bucket of the device (ctx->usb_devs_by_session),
+	 * while it is connected */
+	struct list_head session_list;
+
 	struct libusb_device_descriptor device_descriptor;
 	usbi_atomic_t attached;
+
+	/* parsed configuration descriptors, by index and for the active
+	 * configuration, each holding a reference. Protected by
+	 * config_cache_lock. */
+	usbi_mutex_t config_cache_lock;
+	struct libusb_config_descriptor *config_cache[USB_MAXCONFIG];
+	struct libusb_config_descriptor *active_config_cache;
+
+	/* ASCII strings read from the device, and the language they are read
+	 * in (0 until known). Protected by string_cache_lock. */
+	usbi_mutex_t string_cache_lock;
+	uint16_t string_langid;
+	struct list_head string_cache;
+};
+
+struct usbi_endpoint_stats {
+	usbi_atomic64_t transfers_submitted;
+	usbi_atomic64_t transfers_completed;
+	usbi_atomic64_t transfers_cancelled;
+	usbi_atomic64_t transfers_timed_out;
+	usbi_atomic64_t transfers_failed;
+	usbi_atomic64_t bytes_transferred;
+	usbi_atomic64_t short_transfers;
+	usbi_atomic64_t iso_packet_errors;
+	usbi_atomic64_t latency_histogram[LIBUSB_ENDPOINT_STATS_LATENCY_BUCKETS];
 };
 
 struct libusb_device_handle {
@@ -518,9 +843,19 @@ struct libusb_device_handle {
 	usbi_mutex_t lock;
 	unsigned long claimed_interfaces;
 
+	/* this is a list of in-flight transfers submitted on this handle, in
+	 * submission order. Timeouts are tracked separately by the context.
+	 * Note paths taking both this and the context's timeouts_lock must
+	 * always take this lock first */
+	struct list_head flying_transfers;
+	usbi_mutex_t flying_transfers_lock;
+
 	struct list_head list;
 	struct libusb_device *dev;
 	int auto_detach_kernel_driver;
+
+	/* transfer statistics, indexed by USBI_ENDPOINT_INDEX() */
+	struct usbi_endpoint_stats ep_stats[USB_MAXENDPOINTS];
 };
 
 /* Function called by backend during device initialization to convert
@@ -570,17 +905,48 @@ void usbi_get_real_time(struct timespec *tp);
 struct usbi_transfer {
 	int num_iso_packets;
 	struct list_head list;
+	/* on ctx->completed_transfers until the event handler processes the
+	 * completion, then on the event handler's deferred_completions if its
+	 * dispatch is held back, then on the completion queue if the transfer has one.
+	 * also links a transfer waiting for a stream of its stream scheduler */
 	struct list_head completed_list;
+	/* next older entry while on ctx->completed_stack */
+	struct usbi_transfer *completed_next;
 	struct timespec timeout;
+	struct timespec submit_time;
 	int transferred;
+	/* set by backends that fill iso_summary as they complete the packets
+	 * of an isochronous transfer */
+	int iso_summary_valid;
+	/* set while the transfer is counted in ctx->high_priority_in_flight */
+	int high_priority;
+	struct libusb_iso_transfer_summary iso_summary;
 	uint32_t stream_id;
-	uint32_t state_flags;   /* Protected by usbi_transfer->lock */
-	uint32_t timeout_flags; /* Protected by the flying_stransfers_lock */
+	usbi_atomic_t state_flags; /* See usbi_transfer_state() */
+	uint32_t timeout_flags; /* Protected by the timeouts_lock */
+	unsigned int timeout_heap_idx; /* Position in ctx->timeout_heap, 0 if not present */
 
 	/* The device reference is held until destruction for logging
 	 * even after dev_handle is set to NULL.  */
 	struct libusb_device *dev;
 
+	/* The transfer ring that owns this transfer, or NULL */
+	struct libusb_transfer_ring *ring;
+
+	/* The queue the completion is delivered to, or NULL to invoke the
+	 * callback from the event handler */
+	struct libusb_completion_queue *completion_queue;
+
+	/* The stream scheduler the transfer was submitted through, or NULL */
+	struct libusb_stream_scheduler *stream_sched;
+
+	/* Scatter-gather segments set with libusb_transfer_set_iovec(). When
+	 * the backend cannot use them directly, the data goes through
+	 * iov_bounce instead, which is then used as the transfer buffer */
+	const struct libusb_iovec *iov;
+	int iovcnt;
+	unsigned char *iov_bounce;
+
 	/* this lock is held during libusb_submit_transfer() and
 	 * libusb_cancel_transfer() (allowing the OS backend to prevent duplicate
 	 * cancellation, submission-during-cancellation, etc). the OS backend
@@ -588,10 +954,12 @@ struct usbi_transfer {
 	 * cancelling the transfer from another thread while you are processing
 	 * its completion (presumably there would be races within your OS backend
 	 * if this were possible).
-	 * Note paths taking both this and the flying_transfers_lock must
-	 * always take the flying_transfers_lock first */
+	 * Note paths taking both this and the flying_transfers_lock or the
+	 * timeouts_lock must always take those locks first */
 	usbi_mutex_t lock;
 
+	/* Must remain the only field after the lock, as a transfer taken from
+	 * the transfer cache is reset by clearing everything up to the lock */
 	void *priv;
 };
 
@@ -606,6 +974,31 @@ enum usbi_transfer_state_flags {
 	USBI_TRANSFER_DEVICE_DISAPPEARED = 1U << 2,
 };
 
+/* The state flags are read and updated atomically, so that checking them
+ * does not take the transfer lock. Submission and cancellation still hold the
+ * lock while they call into the backend, and a completion clears
+ * USBI_TRANSFER_IN_FLIGHT under it, which keeps them from running
+ * concurrently. */
+static inline uint32_t usbi_transfer_state(struct usbi_transfer *itransfer)
+{
+	return (uint32_t)usbi_atomic_load(&itransfer->state_flags);
+}
+
+/* Set the flags in set and clear those in clear, returning the previous
+ * flags */
+static inline uint32_t usbi_transfer_update_state(struct usbi_transfer *itransfer,
+	uint32_t set, uint32_t clear)
+{
+	long cur, next;
+
+	do {
+		cur = usbi_atomic_load(&itransfer->state_flags);
+		next = (long)(((uint32_t)cur | set) & ~clear);
+	} while (!usbi_atomic_cas(&itransfer->state_flags, cur, next));
+
+	return (uint32_t)cur;
+}
+
 enum usbi_transfer_timeout_flags {
 	/* Set by backend submit_transfer() if the OS handles timeout */
 	USBI_TRANSFER_OS_HANDLES_TIMEOUT = 1U << 0,
@@ -754,11 +1147,19 @@ struct usbi_hotplug_callback {
 	/* Handle for this callback (used to match on deregister) */
 	libusb_hotplug_callback_handle handle;
 
+	/* Registration order, so that an event being dispatched skips the
+	 * callbacks registered since it started */
+	uint64_t serial;
+
 	/* User data that will be passed to the callback function */
 	void *user_data;
 
 	/* List this callback is registered in (ctx->hotplug_cbs) */
 	struct list_head list;
+
+	/* Index bucket this callback is in (ctx->hotplug_cb_index or
+	 * ctx->hotplug_cbs_any) */
+	struct list_head index_list;
 };
 
 struct usbi_hotplug_message {
@@ -779,6 +1180,8 @@ void usbi_hotplug_exit(struct libusb_context *ctx);
 void usbi_hotplug_notification(struct libusb_context *ctx, struct libusb_device *dev,
 	libusb_hotplug_event event);
 void usbi_hotplug_process(struct libusb_context *ctx, struct list_head *hotplug_msgs);
+void usbi_hotplug_batch_begin(struct libusb_context *ctx);
+void usbi_hotplug_batch_end(struct libusb_context *ctx);
 
 int usbi_io_init(struct libusb_context *ctx);
 void usbi_io_exit(struct libusb_context *ctx);
@@ -790,13 +1193,36 @@ struct libusb_device *usbi_get_device_by_session_id(struct libusb_context *ctx,
 int usbi_sanitize_device(struct libusb_device *dev);
 void usbi_handle_disconnect(struct libusb_device_handle *dev_handle);
 
+void *usbi_desc_store_get(const void *data, size_t len);
+void *usbi_desc_store_ref(void *blob);
+void usbi_desc_store_put(void *blob);
+
+void usbi_invalidate_active_config(struct libusb_device *dev);
+void usbi_clear_config_cache(struct libusb_device *dev);
+void usbi_clear_string_cache(struct libusb_device *dev);
+const struct libusb_endpoint_descriptor *usbi_find_config_endpoint(
+	const struct libusb_config_descriptor *config, uint8_t endpoint);
+
+int usbi_remove_from_flying_list_locked(struct usbi_transfer *itransfer);
+void usbi_transfer_cache_flush(void);
 int usbi_handle_transfer_completion(struct usbi_transfer *itransfer,
 	enum libusb_transfer_status status);
 int usbi_handle_transfer_cancellation(struct usbi_transfer *itransfer);
 void usbi_signal_transfer_completion(struct usbi_transfer *itransfer);
+void usbi_stats_sync_transfer(struct libusb_device_handle *dev_handle,
+	unsigned char endpoint, int length, int transferred, int r,
+	const struct timespec *submit_time);
 
 void usbi_connect_device(struct libusb_device *dev);
 void usbi_disconnect_device(struct libusb_device *dev);
+void usbi_set_device_session_id(struct libusb_device *dev,
+	unsigned long session_id);
+
+/* Must be called first thing on each internal thread. Names the thread and
+ * calls the thread callback of ctx, or the global one if ctx is NULL or has
+ * none. */
+void usbi_thread_started(struct libusb_context *ctx,
+	enum libusb_thread_type type, const char *name);
 
 struct usbi_event_source {
 	struct usbi_event_source_data {
@@ -815,6 +1241,7 @@ struct usbi_option {
   union {
     int ival;
     libusb_log_cb log_cbval;
+    libusb_thread_cb thread_cbval;
   } arg;
 };
 
@@ -842,6 +1269,51 @@ static inline int usbi_using_timer(struct libusb_context *ctx)
 #endif
 }
 
+/* upper bound for LIBUSB_OPTION_EVENT_LOOPS */
+#define USBI_MAX_EVENT_LOOPS	64
+
+/* upper bound for LIBUSB_OPTION_IO_THREADS */
+#define USBI_MAX_IO_THREADS	64
+
+/* upper bound for LIBUSB_OPTION_ENUMERATION_THREADS */
+#define USBI_MAX_ENUMERATION_THREADS	64
+
+/* upper bound for LIBUSB_OPTION_HOTPLUG_BATCH_WINDOW, in milliseconds */
+#define USBI_MAX_HOTPLUG_BATCH_WINDOW	1000
+
+/* upper bound for LIBUSB_OPTION_TIMEOUT_GRANULARITY, in milliseconds */
+#define USBI_MAX_TIMEOUT_GRANULARITY	1000
+
+/* upper bound for LIBUSB_OPTION_BUSY_POLL, in microseconds */
+#define USBI_MAX_BUSY_POLL	100000
+
+#ifdef HAVE_EVENT_SET
+/* A secondary event loop, see libusb_handle_events_loop() */
+struct usbi_event_loop {
+	/* held by the thread running the loop */
+	usbi_mutex_t lock;
+
+	/* epoll instance or kqueue holding the event sources assigned to this
+	 * loop */
+	int epoll_fd;
+
+	/* ready fds of the last wait */
+	void *event_data;
+};
+
+int usbi_epoll_init(struct libusb_context *ctx);
+void usbi_epoll_exit(struct libusb_context *ctx);
+int usbi_epoll_add(struct libusb_context *ctx, usbi_os_handle_t os_handle,
+	short poll_events);
+void usbi_epoll_remove(struct libusb_context *ctx, usbi_os_handle_t os_handle,
+	short poll_events);
+
+static inline int usbi_using_epoll(struct libusb_context *ctx)
+{
+	return ctx->epoll_fd >= 0;
+}
+#endif
+
 struct usbi_reported_events {
 	union {
 		struct {
@@ -860,6 +1332,10 @@ struct usbi_reported_events {
 int usbi_alloc_event_data(struct libusb_context *ctx);
 int usbi_wait_for_events(struct libusb_context *ctx,
 	struct usbi_reported_events *reported_events, int timeout_ms);
+#ifdef HAVE_EVENT_SET
+int usbi_wait_for_loop_events(struct libusb_context *ctx, int loop,
+	struct usbi_reported_events *reported_events, int timeout_ms);
+#endif
 
 /* accessor functions for structure private data */
 
@@ -1005,12 +1481,12 @@ struct usbi_os_backend {
 	 * To avoid this libusb_get_device_list will call this optional
 	 * function for backends with hotplug support before copying
 	 * ctx->usb_devs to the user. In this function the backend should
-	 * ensure any pending hotplug events are fully processed before
+	 * ensure any pending hotplug events are fully processed for ctx before
 	 * returning.
 	 *
 	 * Optional, should be implemented by backends with hotplug support.
 	 */
-	void (*hotplug_poll)(void);
+	void (*hotplug_poll)(struct libusb_context *ctx);
 
 	/* Wrap a platform-specific device handle for I/O and other USB
 	 * operations. The device handle is preallocated for you.
@@ -1137,6 +1613,24 @@ struct usbi_os_backend {
 	int (*get_config_descriptor_by_value)(struct libusb_device *device,
 		uint8_t bConfigurationValue, void **buffer);
 
+	/* Get a string of a device that the operating system already read
+	 * from it, converted to ASCII with non-ASCII characters replaced by
+	 * '?'. Optional.
+	 *
+	 * The string is written to data without a terminating NUL, truncated
+	 * to length bytes. It must be the one libusb would read using the
+	 * first language supported by the device.
+	 *
+	 * This function must not do any I/O to the device.
+	 *
+	 * Return:
+	 * - the length of the string on success
+	 * - LIBUSB_ERROR_NOT_SUPPORTED if the string is not known, in which case
+	 *   libusb requests it from the device
+	 */
+	int (*get_device_string)(struct libusb_device *device,
+		uint8_t desc_index, unsigned char *data, int length);
+
 	/* Get the bConfigurationValue for the active configuration for a device.
 	 * Optional. This should only be implemented if you can retrieve it from
 	 * cache (don't generate I/O).
@@ -1275,6 +1769,21 @@ struct usbi_os_backend {
 	int (*dev_mem_free)(struct libusb_device_handle *handle, void *buffer,
 		size_t len);
 
+	/* Allocate host memory for a region of a buffer pool of the given
+	 * device. flags are the libusb_dev_mem_pool_flags of the pool, which
+	 * ask for the memory to be placed near the device's host controller
+	 * and/or backed by huge pages. The memory must be aligned to at least
+	 * 64 bytes. May return NULL, in which case the pool falls back to
+	 * malloc(). Optional to implement.
+	 */
+	void *(*host_mem_alloc)(struct libusb_device_handle *handle, size_t len,
+		uint32_t flags);
+
+	/* Free memory allocated by host_mem_alloc, with the same length and
+	 * flags. */
+	void (*host_mem_free)(struct libusb_device_handle *handle, void *buffer,
+		size_t len, uint32_t flags);
+
 	/* Determine if a kernel driver is active on an interface. Optional.
 	 *
 	 * The presence of a kernel driver on an interface indicates that any
@@ -1337,7 +1846,7 @@ struct usbi_os_backend {
 	 *
 	 * This function must not block.
 	 *
-	 * This function gets called with the flying_transfers_lock locked!
+	 * This function gets called with usbi_transfer->lock locked!
 	 *
 	 * Return:
 	 * - 0 on success
@@ -1354,6 +1863,26 @@ struct usbi_os_backend {
 	 */
 	int (*cancel_transfer)(struct usbi_transfer *itransfer);
 
+	/* Cancel all the transfers in flight on an endpoint of a device handle
+	 * at once, for instance by aborting the pipe. Optional.
+	 *
+	 * This is used by libusb_cancel_endpoint_transfers(), which calls it
+	 * with the handle's flying_transfers_lock held so that no transfer can
+	 * be submitted to the endpoint meanwhile. Like cancel_transfer(), it
+	 * must not block, and each cancellation must complete later through
+	 * usbi_handle_transfer_cancellation().
+	 *
+	 * Return:
+	 * - 0 on success
+	 * - LIBUSB_ERROR_NOT_SUPPORTED if the transfers cannot be cancelled
+	 *   together, in which case the library cancels them one by one with
+	 *   cancel_transfer()
+	 * - LIBUSB_ERROR_NO_DEVICE if the device has been disconnected
+	 * - another LIBUSB_ERROR code on other failure
+	 */
+	int (*cancel_endpoint_transfers)(struct libusb_device_handle *dev_handle,
+		unsigned char endpoint);
+
 	/* Clear a transfer as if it has completed or cancelled, but do not
 	 * report any completion/cancellation to the library. You should free
 	 * all private data from the transfer as if you were just about to report
@@ -1366,6 +1895,65 @@ struct usbi_os_backend {
 	 */
 	void (*clear_transfer_priv)(struct usbi_transfer *itransfer);
 
+	/* Release any resources that the backend keeps in the private data of
+	 * a transfer across submissions. Called when the transfer is
+	 * destroyed, never while it is in flight.
+	 *
+	 * Backends that implement this function take over the lifetime of
+	 * their transfer private data: it is zero-initialized when the
+	 * transfer is first allocated, but left as it is when a freed transfer
+	 * is recycled by the transfer cache.
+	 *
+	 * Optional.
+	 */
+	void (*destroy_transfer_priv)(struct usbi_transfer *itransfer);
+
+	/* Perform a control transfer synchronously, without going through
+	 * the asynchronous transfer machinery and the event loop. Optional.
+	 *
+	 * This is used by libusb_control_transfer() when no asynchronous
+	 * transfers are in flight on the device handle. The arguments are the
+	 * same as those of libusb_control_transfer().
+	 *
+	 * This function may block for up to the given timeout.
+	 *
+	 * Return:
+	 * - the number of bytes actually transferred on success
+	 * - LIBUSB_ERROR_NOT_SUPPORTED if this particular request cannot be
+	 *   handled synchronously, in which case the library falls back to an
+	 *   asynchronous transfer
+	 * - any other error code that libusb_control_transfer() can return
+	 */
+	int (*sync_control_transfer)(struct libusb_device_handle *dev_handle,
+		uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue,
+		uint16_t wIndex, unsigned char *data, uint16_t wLength,
+		unsigned int timeout);
+
+	/* Perform a bulk or interrupt transfer synchronously, without going
+	 * through the asynchronous transfer machinery and the event loop.
+	 * Optional.
+	 *
+	 * This is used by libusb_bulk_transfer() and libusb_interrupt_transfer()
+	 * when no asynchronous transfers are in flight on the device handle.
+	 * The arguments are the same as those of libusb_bulk_transfer(),
+	 * except that transferred is never NULL.
+	 *
+	 * This function may block for up to the given timeout. As with
+	 * libusb_bulk_transfer(), transferred must be set on timeout and on
+	 * error too, so return LIBUSB_ERROR_NOT_SUPPORTED for requests whose
+	 * partial progress could not be reported.
+	 *
+	 * Return:
+	 * - 0 on success
+	 * - LIBUSB_ERROR_NOT_SUPPORTED if this particular request cannot be
+	 *   handled synchronously, in which case the library falls back to an
+	 *   asynchronous transfer
+	 * - any other error code that libusb_bulk_transfer() can return
+	 */
+	int (*sync_bulk_transfer)(struct libusb_device_handle *dev_handle,
+		unsigned char endpoint, unsigned char *data, int length,
+		int *transferred, unsigned int timeout);
+
 	/* Handle any pending events on event sources. Optional.
 	 *
 	 * Provide this function when event sources directly indicate device
@@ -1469,14 +2057,14 @@ extern const struct usbi_os_backend usbi_backend;
 #define __for_each_transfer(list, t) \
 	for_each_helper(t, (list), struct usbi_transfer)
 
-#define for_each_transfer(ctx, t) \
-	__for_each_transfer(&(ctx)->flying_transfers, t)
+#define for_each_transfer(dev_handle, t) \
+	__for_each_transfer(&(dev_handle)->flying_transfers, t)
 
 #define __for_each_transfer_safe(list, t, n) \
 	for_each_safe_helper(t, n, (list), struct usbi_transfer)
 
-#define for_each_transfer_safe(ctx, t, n) \
-	__for_each_transfer_safe(&(ctx)->flying_transfers, t, n)
+#define for_each_transfer_safe(dev_handle, t, n) \
+	__for_each_transfer_safe(&(dev_handle)->flying_transfers, t, n)
 
 #define __for_each_completed_transfer_safe(list, t, n) \
 	list_for_each_entry_safe(t, n, (list), completed_list, struct usbi_transfer)
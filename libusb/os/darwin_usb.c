@@ -67,6 +67,8 @@ static CFRunLoopSourceRef libusb_darwin_acfls = NULL; /* shutdown signal for eve
 
 static usbi_mutex_t darwin_cached_devices_mutex = PTHREAD_MUTEX_INITIALIZER;
 static struct list_head darwin_cached_devices;
+/* darwin_cached_devices again, hashed by session ID */
+static struct list_head darwin_cached_devices_by_session[USBI_SESSION_INDEX_SIZE];
 static const char *darwin_device_class = "IOUSBDevice";
 
 #define DARWIN_CACHED_DEVICE(a) (((struct darwin_device_priv *)usbi_get_device_priv((a)))->dev)
@@ -74,6 +76,10 @@ static const char *darwin_device_class = "IOUSBDevice";
 /* async event thread */
 static pthread_t libusb_darwin_at;
 
+/* transfers completed during the current run loop pass. only touched from
+ * the event thread, so no locking is needed. */
+static struct list_head darwin_pending_completions;
+
 /* protected by libusb_darwin_at_mutex */
 static bool libusb_darwin_at_started;
 
@@ -170,12 +176,27 @@ static enum libusb_error darwin_to_libusb (IOReturn result) {
   }
 }
 
+static struct list_head *darwin_session_bucket(UInt64 session) {
+  return &darwin_cached_devices_by_session[usbi_hash_session_id(session) % USBI_SESSION_INDEX_SIZE];
+}
+
+/* this function must be called with the darwin_cached_devices_mutex held */
+static void darwin_set_cached_device_session(struct darwin_cached_device *cached_dev, UInt64 session) {
+  if (cached_dev->session_list.next)
+    list_del(&cached_dev->session_list);
+
+  cached_dev->session = session;
+  list_add(&cached_dev->session_list, darwin_session_bucket(session));
+}
+
 /* this function must be called with the darwin_cached_devices_mutex held */
 static void darwin_deref_cached_device(struct darwin_cached_device *cached_dev) {
   cached_dev->refcount--;
   /* free the device and remove it from the cache */
   if (0 == cached_dev->refcount) {
     list_del(&cached_dev->list);
+    if (cached_dev->session_list.next)
+      list_del(&cached_dev->session_list);
 
     if (cached_dev->device) {
       (*(cached_dev->device))->Release(cached_dev->device);
@@ -202,6 +223,25 @@ static int ep_to_pipeRef(struct libusb_device_handle *dev_handle, uint8_t ep, ui
 
   usbi_dbg (ctx, "converting ep address 0x%02x to pipeRef and interface", ep);
 
+  /* look up the endpoint table first, then fall back to searching all of
+   * the claimed interfaces */
+  if (!(ep & 0x70)) {
+    struct darwin_endpoint_ref *ref = &priv->endpoint_refs[USBI_ENDPOINT_INDEX(ep)];
+
+    if (ref->pipeRef && (dev_handle->claimed_interfaces & (1U << ref->iface))) {
+      *pipep = ref->pipeRef;
+
+      if (ifcp)
+        *ifcp = ref->iface;
+
+      if (interface_out)
+        *interface_out = &priv->interfaces[ref->iface];
+
+      usbi_dbg (ctx, "pipe %d on interface %d matches", *pipep, ref->iface);
+      return LIBUSB_SUCCESS;
+    }
+  }
+
   for (iface = 0 ; iface < USB_MAXINTERFACES ; iface++) {
     cInterface = &priv->interfaces[iface];
 
@@ -393,7 +433,7 @@ static void darwin_devices_detached (void *ptr, io_iterator_t rem_devices) {
     /* we need to match darwin_ref_cached_device call made in darwin_get_cached_device function
        otherwise no cached device will ever get freed */
     usbi_mutex_lock(&darwin_cached_devices_mutex);
-    list_for_each_entry(old_device, &darwin_cached_devices, list, struct darwin_cached_device) {
+    list_for_each_entry(old_device, darwin_session_bucket(session), session_list, struct darwin_cached_device) {
       if (old_device->session == session) {
         if (old_device->in_reenumerate) {
           /* device is re-enumerating. do not dereference the device at this time. libusb_reset_device()
@@ -437,8 +477,10 @@ static void darwin_devices_detached (void *ptr, io_iterator_t rem_devices) {
   usbi_mutex_unlock(&active_contexts_lock);
 }
 
-static void darwin_hotplug_poll (void)
+static void darwin_hotplug_poll (struct libusb_context *ctx)
 {
+  UNUSED(ctx);
+
   /* not sure if 1 ms will be too long/short but it should work ok */
   mach_timespec_t timeout = {.tv_sec = 0, .tv_nsec = 1000000ul};
 
@@ -463,18 +505,32 @@ static void darwin_fail_startup(void) {
   pthread_exit (NULL);
 }
 
+static void darwin_flush_completions (CFRunLoopObserverRef observer, CFRunLoopActivity activity, void *info) {
+  struct usbi_transfer *itransfer, *tmp;
+  UNUSED(observer);
+  UNUSED(activity);
+  UNUSED(info);
+
+  /* hand the whole batch to the core back to back. the core only signals a
+   * context when its completion stack goes from empty to non-empty, so this
+   * costs at most one wakeup per context per run loop pass. */
+  list_for_each_entry_safe (itransfer, tmp, &darwin_pending_completions, completed_list, struct usbi_transfer) {
+    list_del (&itransfer->completed_list);
+    usbi_signal_transfer_completion (itransfer);
+  }
+}
+
 static void *darwin_event_thread_main (void *arg0) {
   UNUSED(arg0);
   IOReturn kresult;
   CFRunLoopRef runloop;
   CFRunLoopSourceRef libusb_shutdown_cfsource;
   CFRunLoopSourceContext libusb_shutdown_cfsourcectx;
+  CFRunLoopObserverRef libusb_completion_observer;
 
-#if MAC_OS_X_VERSION_MIN_REQUIRED >= 1060
   /* Set this thread's name, so it can be seen in the debugger
      and crash reports. */
-  pthread_setname_np ("org.libusb.device-hotplug");
-#endif
+  usbi_thread_started (NULL, LIBUSB_THREAD_EVENT, "org.libusb.device-hotplug");
 
 #if MAC_OS_X_VERSION_MIN_REQUIRED >= 1060 && MAC_OS_X_VERSION_MIN_REQUIRED < 101200
   /* Tell the Objective-C garbage collector about this thread.
@@ -505,6 +561,12 @@ static void *darwin_event_thread_main (void *arg0) {
   libusb_shutdown_cfsource = CFRunLoopSourceCreate(NULL, 0, &libusb_shutdown_cfsourcectx);
   CFRunLoopAddSource(runloop, libusb_shutdown_cfsource, kCFRunLoopDefaultMode);
 
+  /* flush completed transfers before the run loop goes back to sleep */
+  list_init (&darwin_pending_completions);
+  libusb_completion_observer = CFRunLoopObserverCreate (NULL, kCFRunLoopBeforeWaiting | kCFRunLoopExit,
+                                                        true, 0, darwin_flush_completions, NULL);
+  CFRunLoopAddObserver (runloop, libusb_completion_observer, kCFRunLoopCommonModes);
+
   /* add the notification port to the run loop */
   libusb_notification_port     = IONotificationPortCreate (darwin_default_master_port);
   libusb_notification_cfsource = IONotificationPortGetRunLoopSource (libusb_notification_port);
@@ -518,6 +580,8 @@ static void *darwin_event_thread_main (void *arg0) {
 
   if (kresult != kIOReturnSuccess) {
     usbi_err (NULL, "could not add hotplug event source: %s", darwin_error_str (kresult));
+    CFRunLoopRemoveObserver (runloop, libusb_completion_observer, kCFRunLoopCommonModes);
+    CFRelease (libusb_completion_observer);
     CFRelease (libusb_shutdown_cfsource);
     CFRelease (runloop);
     darwin_fail_startup ();
@@ -531,6 +595,8 @@ static void *darwin_event_thread_main (void *arg0) {
 
   if (kresult != kIOReturnSuccess) {
     usbi_err (NULL, "could not add hotplug event source: %s", darwin_error_str (kresult));
+    CFRunLoopRemoveObserver (runloop, libusb_completion_observer, kCFRunLoopCommonModes);
+    CFRelease (libusb_completion_observer);
     CFRelease (libusb_shutdown_cfsource);
     CFRelease (runloop);
     darwin_fail_startup ();
@@ -567,6 +633,11 @@ static void *darwin_event_thread_main (void *arg0) {
   /* remove the shutdown cfsource */
   CFRunLoopRemoveSource(runloop, libusb_shutdown_cfsource, kCFRunLoopDefaultMode);
 
+  /* remove the completion observer. the exit notification already flushed
+   * anything left over from the last pass. */
+  CFRunLoopRemoveObserver (runloop, libusb_completion_observer, kCFRunLoopCommonModes);
+  CFRelease (libusb_completion_observer);
+
   /* delete notification port */
   IONotificationPortDestroy (libusb_notification_port);
 
@@ -596,6 +667,8 @@ static void darwin_cleanup_devices(void) {
 static int darwin_first_time_init(void) {
   if (NULL == darwin_cached_devices.next) {
     list_init (&darwin_cached_devices);
+    for (int i = 0 ; i < USBI_SESSION_INDEX_SIZE ; i++)
+      list_init (&darwin_cached_devices_by_session[i]);
   }
 
   if (!list_empty(&darwin_cached_devices)) {
@@ -1074,7 +1147,7 @@ static enum libusb_error darwin_get_cached_device(struct libusb_context *ctx, io
        prevent them from being enumerated multiple times */
     *cached_out = new_device;
 
-    new_device->session = sessionID;
+    darwin_set_cached_device_session (new_device, sessionID);
     new_device->device = device;
     new_device->service = service;
 
@@ -1147,7 +1220,7 @@ static enum libusb_error process_new_device (struct libusb_context *ctx, struct
                   "mismatch between libusb and IOKit device descriptor sizes");
     memcpy(&dev->device_descriptor, &cached_device->dev_descriptor, LIBUSB_DT_DEVICE_SIZE);
     usbi_localize_device_descriptor(&dev->device_descriptor);
-    dev->session_data = cached_device->session;
+    usbi_set_device_session_id (dev, (unsigned long) cached_device->session);
 
     if (NULL != dev->parent_dev) {
       libusb_unref_device(dev->parent_dev);
@@ -1400,6 +1473,26 @@ static const struct libusb_interface_descriptor *get_interface_descriptor_by_num
   return NULL;
 }
 
+static void darwin_map_endpoints (struct darwin_device_handle_priv *priv, uint8_t iface, bool map) {
+  struct darwin_interface *cInterface = &priv->interfaces[iface];
+
+  for (uint8_t i = 0 ; i < cInterface->num_endpoints ; i++) {
+    uint8_t ep = cInterface->endpoint_addrs[i];
+    struct darwin_endpoint_ref *ref;
+
+    if (ep & 0x70)
+      continue;
+
+    ref = &priv->endpoint_refs[USBI_ENDPOINT_INDEX(ep)];
+    if (map && !ref->pipeRef) {
+      ref->iface = iface;
+      ref->pipeRef = i + 1;
+    } else if (!map && ref->pipeRef && ref->iface == iface) {
+      ref->pipeRef = 0;
+    }
+  }
+}
+
 static enum libusb_error get_endpoints (struct libusb_device_handle *dev_handle, uint8_t iface) {
   struct darwin_device_handle_priv *priv = usbi_get_device_handle_priv(dev_handle);
 
@@ -1421,6 +1514,10 @@ static enum libusb_error get_endpoints (struct libusb_device_handle *dev_handle,
 
   usbi_dbg (ctx, "building table of endpoints.");
 
+  /* the endpoints of the previous alternate setting go away */
+  darwin_map_endpoints (priv, iface, false);
+  cInterface->num_endpoints = 0;
+
   /* retrieve the total number of endpoints on this interface */
   kresult = (*(cInterface->interface))->GetNumEndpoints(cInterface->interface, &numep);
   if (kresult != kIOReturnSuccess) {
@@ -1475,6 +1572,7 @@ static enum libusb_error get_endpoints (struct libusb_device_handle *dev_handle,
   }
 
   cInterface->num_endpoints = numep;
+  darwin_map_endpoints (priv, iface, true);
 
   return LIBUSB_SUCCESS;
 }
@@ -1598,6 +1696,7 @@ static int darwin_release_interface(struct libusb_device_handle *dev_handle, uin
     return LIBUSB_SUCCESS;
 
   /* clean up endpoint data */
+  darwin_map_endpoints (priv, iface, false);
   cInterface->num_endpoints = 0;
 
   /* delete the interface's async event source */
@@ -2146,11 +2245,17 @@ static int submit_iso_transfer(struct usbi_transfer *itransfer) {
     return darwin_to_libusb (kresult);
   }
 
-  /* schedule for a frame a little in the future */
-  frame += 4;
-
-  if (cInterface->frames[transfer->endpoint] && frame < cInterface->frames[transfer->endpoint])
+  /* continue the stream in the frame following the previous transfer as long
+   * as that frame has not passed yet, otherwise schedule for a frame a little
+   * in the future */
+  if ((transfer->flags & LIBUSB_TRANSFER_ISO_CONTINUE) && cInterface->frames[transfer->endpoint] > frame) {
     frame = cInterface->frames[transfer->endpoint];
+  } else {
+    frame += 4;
+
+    if (cInterface->frames[transfer->endpoint] && frame < cInterface->frames[transfer->endpoint])
+      frame = cInterface->frames[transfer->endpoint];
+  }
 
   /* submit the request */
   if (IS_XFERIN(transfer))
@@ -2265,16 +2370,16 @@ static int cancel_control_transfer(struct usbi_transfer *itransfer) {
   return darwin_to_libusb (kresult);
 }
 
-static int darwin_abort_transfers (struct usbi_transfer *itransfer) {
-  struct libusb_transfer *transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
-  struct darwin_cached_device *dpriv = DARWIN_CACHED_DEVICE(transfer->dev_handle->dev);
+static int darwin_abort_pipe (struct libusb_device_handle *dev_handle, unsigned char endpoint,
+                              uint8_t type, uint32_t stream_id) {
+  struct darwin_cached_device *dpriv = DARWIN_CACHED_DEVICE(dev_handle->dev);
   struct darwin_interface *cInterface;
   uint8_t pipeRef, iface;
   IOReturn kresult;
 
-  struct libusb_context *ctx = ITRANSFER_CTX (itransfer);
+  struct libusb_context *ctx = HANDLE_CTX (dev_handle);
 
-  if (ep_to_pipeRef (transfer->dev_handle, transfer->endpoint, &pipeRef, &iface, &cInterface) != 0) {
+  if (ep_to_pipeRef (dev_handle, endpoint, &pipeRef, &iface, &cInterface) != 0) {
     usbi_err (ctx, "endpoint not found on any open interface");
 
     return LIBUSB_ERROR_NOT_FOUND;
@@ -2287,9 +2392,12 @@ static int darwin_abort_transfers (struct usbi_transfer *itransfer) {
 
   /* abort transactions */
 #if InterfaceVersion >= 550
-  if (LIBUSB_TRANSFER_TYPE_BULK_STREAM == transfer->type)
-    kresult = (*(cInterface->interface))->AbortStreamsPipe (cInterface->interface, pipeRef, itransfer->stream_id);
+  if (LIBUSB_TRANSFER_TYPE_BULK_STREAM == type)
+    kresult = (*(cInterface->interface))->AbortStreamsPipe (cInterface->interface, pipeRef, stream_id);
   else
+#else
+  UNUSED(type);
+  UNUSED(stream_id);
 #endif
     kresult = (*(cInterface->interface))->AbortPipe (cInterface->interface, pipeRef);
 
@@ -2303,6 +2411,25 @@ static int darwin_abort_transfers (struct usbi_transfer *itransfer) {
   return darwin_to_libusb (kresult);
 }
 
+static int darwin_abort_transfers (struct usbi_transfer *itransfer) {
+  struct libusb_transfer *transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+
+  return darwin_abort_pipe (transfer->dev_handle, transfer->endpoint, transfer->type, itransfer->stream_id);
+}
+
+static int darwin_cancel_endpoint_transfers (struct libusb_device_handle *dev_handle, unsigned char endpoint) {
+  uint8_t pipeRef;
+
+  /* control transfers are cancelled individually, and the pipe of an
+     endpoint that is not on a claimed interface cannot be aborted */
+  if (0 == (endpoint & LIBUSB_ENDPOINT_ADDRESS_MASK) ||
+      ep_to_pipeRef (dev_handle, endpoint, &pipeRef, NULL, NULL) != 0)
+    return LIBUSB_ERROR_NOT_SUPPORTED;
+
+  /* a single AbortPipe completes every transaction queued on the pipe */
+  return darwin_abort_pipe (dev_handle, endpoint, LIBUSB_TRANSFER_TYPE_BULK, 0);
+}
+
 static int darwin_cancel_transfer(struct usbi_transfer *itransfer) {
   struct libusb_transfer *transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
 
@@ -2339,8 +2466,9 @@ static void darwin_async_io_callback (void *refcon, IOReturn result, void *arg0)
   tpriv->result = result;
   tpriv->size = (UInt32) (uintptr_t) arg0;
 
-  /* signal the core that this transfer is complete */
-  usbi_signal_transfer_completion(itransfer);
+  /* queue the transfer; darwin_flush_completions signals the core once the
+   * run loop has drained everything that is ready */
+  list_add_tail (&itransfer->completed_list, &darwin_pending_completions);
 }
 
 static enum libusb_transfer_status darwin_transfer_status (struct usbi_transfer *itransfer, IOReturn result) {
@@ -2688,6 +2816,7 @@ const struct usbi_os_backend usbi_backend = {
 
         .submit_transfer = darwin_submit_transfer,
         .cancel_transfer = darwin_cancel_transfer,
+        .cancel_endpoint_transfers = darwin_cancel_endpoint_transfers,
 
         .handle_transfer_completion = darwin_handle_transfer_completion,
 
@@ -176,6 +176,7 @@ typedef IONotificationPortRef io_notification_port_t;
 /* private structures */
 struct darwin_cached_device {
   struct list_head      list;
+  struct list_head      session_list;
   IOUSBDeviceDescriptor dev_descriptor;
   UInt32                location;
   UInt64                parent_session;
@@ -207,6 +208,13 @@ struct darwin_device_handle_priv {
     uint64_t             frames[256];
     uint8_t              endpoint_addrs[USB_MAXENDPOINTS];
   } interfaces[USB_MAXINTERFACES];
+
+  /* interface and pipeRef of each endpoint, by USBI_ENDPOINT_INDEX(). a
+   * pipeRef of 0 means the endpoint is not mapped. */
+  struct darwin_endpoint_ref {
+    uint8_t              iface;
+    uint8_t              pipeRef;
+  } endpoint_refs[USB_MAXENDPOINTS];
 };
 
 struct darwin_transfer_priv {
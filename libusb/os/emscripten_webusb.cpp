@@ -378,7 +378,62 @@ int em_reset_device(libusb_device_handle *handle) {
 
 void em_destroy_device(libusb_device *dev) { WebUsbDevicePtr(dev).take(); }
 
-thread_local const val Uint8Array = val::global("Uint8Array");
+// clang-format off
+// Builds the parameters of a WebUSB control transfer in one call into JS,
+// rather than setting each of them through `val`.
+EM_JS(EM_VAL, em_control_transfer_params_impl, (const char *request_type,
+      const char *recipient, int request, int value, int index), {
+  return Emval.toHandle({
+    requestType: UTF8ToString(request_type),
+    recipient: UTF8ToString(recipient),
+    request: request,
+    value: value,
+    index: index,
+  });
+});
+
+// Returns the data of an OUT transfer. WebUSB copies the data when the
+// transfer starts, so a view of the wasm heap can be passed as is, without a
+// copy of its own, unless the heap is shared, which WebUSB does not accept.
+EM_JS(EM_VAL, em_transfer_out_data_impl, (const uint8_t *data, int length), {
+  let view = HEAPU8.subarray(data, data + length);
+  if (typeof SharedArrayBuffer !== 'undefined' &&
+      view.buffer instanceof SharedArrayBuffer) {
+    view = view.slice();
+  }
+  return Emval.toHandle(view);
+});
+
+// Unpacks the `{value, error}` result of a transfer in one call into JS.
+// Copies the data of an IN transfer straight from its `DataView` into the
+// transfer buffer, and returns the transfer status.
+EM_JS(int, em_transfer_result_impl, (EM_VAL handle, uint8_t *buffer,
+      int length, int *transferred), {
+  const result = Emval.toValue(handle);
+  if (result.error) {
+    return 1; // LIBUSB_TRANSFER_ERROR
+  }
+
+  const data = result.value.data;
+  if (data) {
+    const actual = Math.min(data.byteLength, length);
+    HEAPU8.set(new Uint8Array(data.buffer, data.byteOffset, actual), buffer);
+    HEAP32[transferred >> 2] = actual;
+  } else if (result.value.bytesWritten !== undefined) {
+    HEAP32[transferred >> 2] = result.value.bytesWritten;
+  }
+
+  switch (result.value.status) {
+    case 'ok':
+      return 0; // LIBUSB_TRANSFER_COMPLETED
+    case 'stall':
+      return 4; // LIBUSB_TRANSFER_STALL
+    case 'babble':
+      return 6; // LIBUSB_TRANSFER_OVERFLOW
+  }
+  return 1; // LIBUSB_TRANSFER_ERROR
+});
+// clang-format on
 
 EMSCRIPTEN_KEEPALIVE
 extern "C" void em_signal_transfer_completion(usbi_transfer *itransfer,
@@ -411,7 +466,6 @@ int em_submit_transfer(usbi_transfer *itransfer) {
   switch (transfer->type) {
     case LIBUSB_TRANSFER_TYPE_CONTROL: {
       auto setup = libusb_control_transfer_get_setup(transfer);
-      auto web_usb_control_transfer_params = val::object();
 
       const char *web_usb_request_type = "unknown";
       // See LIBUSB_REQ_TYPE in windows_winusb.h (or docs for `bmRequestType`).
@@ -453,8 +507,6 @@ int em_submit_transfer(usbi_transfer *itransfer) {
           web_usb_request_type = "vendor";
           break;
       }
-      web_usb_control_transfer_params.set("requestType", web_usb_request_type);
-
       const char *recipient = "other";
       switch (setup->bmRequestType & 0x0f) {
         case LIBUSB_RECIPIENT_DEVICE:
@@ -467,11 +519,10 @@ int em_submit_transfer(usbi_transfer *itransfer) {
           recipient = "endpoint";
           break;
       }
-      web_usb_control_transfer_params.set("recipient", recipient);
-
-      web_usb_control_transfer_params.set("request", setup->bRequest);
-      web_usb_control_transfer_params.set("value", setup->wValue);
-      web_usb_control_transfer_params.set("index", setup->wIndex);
+      auto web_usb_control_transfer_params =
+          val::take_ownership(em_control_transfer_params_impl(
+              web_usb_request_type, recipient, setup->bRequest, setup->wValue,
+              setup->wIndex));
 
       if (setup->bmRequestType & LIBUSB_ENDPOINT_IN) {
         em_start_transfer(
@@ -480,10 +531,8 @@ int em_submit_transfer(usbi_transfer *itransfer) {
                                      std::move(web_usb_control_transfer_params),
                                      setup->wLength));
       } else {
-        auto data =
-            val(typed_memory_view(setup->wLength,
-                                  libusb_control_transfer_get_data(transfer)))
-                .call<val>("slice");
+        auto data = val::take_ownership(em_transfer_out_data_impl(
+            libusb_control_transfer_get_data(transfer), setup->wLength));
         em_start_transfer(
             itransfer, web_usb_device.call<val>(
                            "controlTransferOut",
@@ -501,8 +550,8 @@ int em_submit_transfer(usbi_transfer *itransfer) {
             itransfer,
             web_usb_device.call<val>("transferIn", endpoint, transfer->length));
       } else {
-        auto data = val(typed_memory_view(transfer->length, transfer->buffer))
-                        .call<val>("slice");
+        auto data = val::take_ownership(
+            em_transfer_out_data_impl(transfer->buffer, transfer->length));
         em_start_transfer(
             itransfer, web_usb_device.call<val>("transferOut", endpoint, data));
       }
@@ -531,7 +580,7 @@ int em_handle_transfer_completion(usbi_transfer *itransfer) {
 
   auto result_val = WebUsbTransferPtr(itransfer).take();
 
-  if (itransfer->state_flags & USBI_TRANSFER_CANCELLING) {
+  if (usbi_transfer_state(itransfer) & USBI_TRANSFER_CANCELLING) {
     return usbi_handle_transfer_cancellation(itransfer);
   }
 
@@ -556,42 +605,13 @@ int em_handle_transfer_completion(usbi_transfer *itransfer) {
   } else {
     // Otherwise we should have a `{value, error}` object by now (see
     // `em_start_transfer_impl` callback).
-    promise_result result(std::move(result_val));
-
-    if (!result.error) {
-      auto web_usb_transfer_status = result.value["status"].as<std::string>();
-      if (web_usb_transfer_status == "ok") {
-        status = LIBUSB_TRANSFER_COMPLETED;
-      } else if (web_usb_transfer_status == "stall") {
-        status = LIBUSB_TRANSFER_STALL;
-      } else if (web_usb_transfer_status == "babble") {
-        status = LIBUSB_TRANSFER_OVERFLOW;
-      }
-
-      int skip;
-      unsigned char endpointDir;
+    int skip = transfer->type == LIBUSB_TRANSFER_TYPE_CONTROL
+                   ? LIBUSB_CONTROL_SETUP_SIZE
+                   : 0;
 
-      if (transfer->type == LIBUSB_TRANSFER_TYPE_CONTROL) {
-        skip = LIBUSB_CONTROL_SETUP_SIZE;
-        endpointDir =
-            libusb_control_transfer_get_setup(transfer)->bmRequestType;
-      } else {
-        skip = 0;
-        endpointDir = transfer->endpoint;
-      }
-
-      if (endpointDir & LIBUSB_ENDPOINT_IN) {
-        auto data = result.value["data"];
-        if (!data.isNull()) {
-          itransfer->transferred = data["byteLength"].as<int>();
-          val(typed_memory_view(transfer->length - skip,
-                                transfer->buffer + skip))
-              .call<void>("set", Uint8Array.new_(data["buffer"]));
-        }
-      } else {
-        itransfer->transferred = result.value["bytesWritten"].as<int>();
-      }
-    }
+    status = static_cast<libusb_transfer_status>(em_transfer_result_impl(
+        result_val.as_handle(), transfer->buffer + skip,
+        transfer->length - skip, &itransfer->transferred));
   }
 
   return usbi_handle_transfer_completion(itransfer, status);
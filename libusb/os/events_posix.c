@@ -22,9 +22,17 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <string.h>
+#ifdef HAVE_EPOLL
+#include <sys/epoll.h>
+#endif
 #ifdef HAVE_EVENTFD
 #include <sys/eventfd.h>
 #endif
+#ifdef HAVE_KQUEUE
+#include <sys/event.h>
+#include <sys/time.h>
+#endif
 #ifdef HAVE_TIMERFD
 #include <sys/timerfd.h>
 #endif
@@ -38,8 +46,18 @@
  * Therefore use a custom event system based on browser event emitters. */
 #include <emscripten.h>
 
+/* Transfers that complete together each signal an event, so the wakeups
+ * are coalesced into one dispatch once the current task is done. A waiter
+ * cannot miss it, as em_libusb_wait() is only called after polling the
+ * event sources. */
 EM_JS(void, em_libusb_notify, (void), {
-	dispatchEvent(new Event("em-libusb"));
+	if (globalThis.emLibusbNotifyPending)
+		return;
+	globalThis.emLibusbNotifyPending = true;
+	queueMicrotask(() => {
+		globalThis.emLibusbNotifyPending = false;
+		dispatchEvent(new Event("em-libusb"));
+	});
 });
 
 EM_ASYNC_JS(int, em_libusb_wait, (int timeout), {
@@ -74,6 +92,34 @@ typedef nfds_t usbi_nfds_t;
 typedef unsigned int usbi_nfds_t;
 #endif
 
+#ifdef HAVE_EVENT_SET
+/* maximum number of ready event sources retrieved by a single wait */
+#define USBI_EPOLL_MAX_EVENTS	64
+#endif
+
+#ifdef HAVE_KQUEUE
+/* the ident of the single EVFILT_TIMER held by a timer kqueue */
+#define USBI_KQUEUE_TIMER_IDENT	1
+
+static int create_kqueue(void)
+{
+	int kq = kqueue();
+
+	if (kq == -1)
+		return -1;
+
+	if (fcntl(kq, F_SETFD, FD_CLOEXEC) == -1) {
+		int err = errno;
+
+		close(kq);
+		errno = err;
+		return -1;
+	}
+
+	return kq;
+}
+#endif
+
 int usbi_create_event(usbi_event_t *event)
 {
 #ifdef HAVE_EVENTFD
@@ -217,6 +263,360 @@ int usbi_disarm_timer(usbi_timer_t *timer)
 
 	return 0;
 }
+#elif defined(HAVE_KQUEUE)
+int usbi_create_timer(usbi_timer_t *timer)
+{
+	timer->kq = create_kqueue();
+	if (timer->kq == -1) {
+		usbi_warn(NULL, "failed to create timer kqueue, errno=%d", errno);
+		return LIBUSB_ERROR_OTHER;
+	}
+
+	return 0;
+}
+
+void usbi_destroy_timer(usbi_timer_t *timer)
+{
+	if (close(timer->kq) == -1)
+		usbi_warn(NULL, "failed to close timer kqueue, errno=%d", errno);
+}
+
+int usbi_arm_timer(usbi_timer_t *timer, const struct timespec *timeout)
+{
+	struct timespec now;
+	struct kevent kev;
+	int64_t delta_ns;
+	intptr_t data;
+	unsigned int fflags = 0;
+
+	/* EVFILT_TIMER only takes relative timeouts, so the absolute monotonic
+	 * deadline is turned into a delta. An expired deadline still arms the
+	 * timer so that it fires right away. */
+	usbi_get_monotonic_time(&now);
+	delta_ns = (int64_t)(timeout->tv_sec - now.tv_sec) * NSEC_PER_SEC +
+		(timeout->tv_nsec - now.tv_nsec);
+	if (delta_ns < 1)
+		delta_ns = 1;
+#ifdef NOTE_NSECONDS
+	fflags = NOTE_NSECONDS;
+	data = (intptr_t)delta_ns;
+#else
+	/* the default unit is milliseconds, rounded up so that the timer never
+	 * fires before the deadline */
+	data = (intptr_t)((delta_ns + 999999) / 1000000);
+#endif
+
+	/* re-adding a timer replaces it, but a timer that has already fired
+	 * may have a pending event that would report the new one too early */
+	EV_SET(&kev, USBI_KQUEUE_TIMER_IDENT, EVFILT_TIMER, EV_DELETE, 0, 0, 0);
+	if (kevent(timer->kq, &kev, 1, NULL, 0, NULL) == -1 && errno != ENOENT) {
+		usbi_warn(NULL, "failed to clear timer kqueue, errno=%d", errno);
+		return LIBUSB_ERROR_OTHER;
+	}
+
+	EV_SET(&kev, USBI_KQUEUE_TIMER_IDENT, EVFILT_TIMER, EV_ADD | EV_ONESHOT, fflags, data, 0);
+	if (kevent(timer->kq, &kev, 1, NULL, 0, NULL) == -1) {
+		usbi_warn(NULL, "failed to arm timer kqueue, errno=%d", errno);
+		return LIBUSB_ERROR_OTHER;
+	}
+
+	return 0;
+}
+
+int usbi_disarm_timer(usbi_timer_t *timer)
+{
+	struct kevent kev;
+
+	/* deleting the timer also drops an event that has not been read yet */
+	EV_SET(&kev, USBI_KQUEUE_TIMER_IDENT, EVFILT_TIMER, EV_DELETE, 0, 0, 0);
+	if (kevent(timer->kq, &kev, 1, NULL, 0, NULL) == -1 && errno != ENOENT) {
+		usbi_warn(NULL, "failed to disarm timer kqueue, errno=%d", errno);
+		return LIBUSB_ERROR_OTHER;
+	}
+
+	return 0;
+}
+#endif
+
+#ifdef HAVE_EVENT_SET
+#ifdef HAVE_EPOLL
+static int create_event_set(void)
+{
+	return epoll_create1(EPOLL_CLOEXEC);
+}
+
+static int event_set_add(int epoll_fd, usbi_os_handle_t os_handle,
+	short poll_events)
+{
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	/* the POLL* and EPOLL* event bits share the same values on Linux */
+	ev.events = (uint32_t)poll_events;
+	ev.data.fd = os_handle;
+	return epoll_ctl(epoll_fd, EPOLL_CTL_ADD, os_handle, &ev);
+}
+
+static int event_set_remove(int epoll_fd, usbi_os_handle_t os_handle,
+	short poll_events)
+{
+	UNUSED(poll_events);
+	return epoll_ctl(epoll_fd, EPOLL_CTL_DEL, os_handle, NULL);
+}
+
+/* Waits for ready fds and stores them with their events in fds, which holds
+ * USBI_EPOLL_MAX_EVENTS entries. Returns the number of ready fds, or -1 with
+ * errno set. */
+static int event_set_wait(int epoll_fd, struct pollfd *fds, int timeout_ms)
+{
+	struct epoll_event events[USBI_EPOLL_MAX_EVENTS];
+	int i, num_ready;
+
+	num_ready = epoll_wait(epoll_fd, events, USBI_EPOLL_MAX_EVENTS, timeout_ms);
+	for (i = 0; i < num_ready; i++) {
+		fds[i].fd = events[i].data.fd;
+		fds[i].events = (short)events[i].events;
+		fds[i].revents = (short)events[i].events;
+	}
+
+	return num_ready;
+}
+#else
+static int create_event_set(void)
+{
+	return create_kqueue();
+}
+
+/* kqueue knows one filter per direction, so an event source asking for both
+ * POLLIN and POLLOUT takes two entries */
+static int event_set_add(int kq, usbi_os_handle_t os_handle, short poll_events)
+{
+	struct kevent kev[2];
+	int n = 0;
+
+	/* EV_SET() may evaluate its first argument more than once */
+	if (poll_events & POLLIN) {
+		EV_SET(&kev[n], (uintptr_t)os_handle, EVFILT_READ, EV_ADD, 0, 0, 0);
+		n++;
+	}
+	if (poll_events & POLLOUT) {
+		EV_SET(&kev[n], (uintptr_t)os_handle, EVFILT_WRITE, EV_ADD, 0, 0, 0);
+		n++;
+	}
+	if (!n)
+		return 0;
+
+	return kevent(kq, kev, n, NULL, 0, NULL);
+}
+
+static int event_set_remove(int kq, usbi_os_handle_t os_handle, short poll_events)
+{
+	struct kevent kev;
+	int r = 0;
+
+	/* deleted one at a time so that a missing filter does not keep the
+	 * other one in the set */
+	if (poll_events & POLLIN) {
+		EV_SET(&kev, (uintptr_t)os_handle, EVFILT_READ, EV_DELETE, 0, 0, 0);
+		if (kevent(kq, &kev, 1, NULL, 0, NULL) == -1)
+			r = -1;
+	}
+	if (poll_events & POLLOUT) {
+		EV_SET(&kev, (uintptr_t)os_handle, EVFILT_WRITE, EV_DELETE, 0, 0, 0);
+		if (kevent(kq, &kev, 1, NULL, 0, NULL) == -1)
+			r = -1;
+	}
+
+	return r;
+}
+
+/* Waits for ready fds and stores them with their events in fds, which holds
+ * USBI_EPOLL_MAX_EVENTS entries. The filters of an fd that fire together
+ * are merged into a single entry. Returns the number of ready fds, or -1
+ * with errno set. */
+static int event_set_wait(int kq, struct pollfd *fds, int timeout_ms)
+{
+	struct kevent events[USBI_EPOLL_MAX_EVENTS];
+	struct timespec timeout, *ptimeout = NULL;
+	int i, n, num_events, nfds = 0;
+
+	if (timeout_ms >= 0) {
+		timeout.tv_sec = timeout_ms / 1000;
+		timeout.tv_nsec = (long)(timeout_ms % 1000) * 1000000L;
+		ptimeout = &timeout;
+	}
+
+	num_events = kevent(kq, NULL, 0, events, USBI_EPOLL_MAX_EVENTS, ptimeout);
+	for (i = 0; i < num_events; i++) {
+		int fd = (int)events[i].ident;
+		short revents;
+
+		if (events[i].flags & EV_ERROR)
+			revents = POLLERR;
+		else if (events[i].filter == EVFILT_READ)
+			revents = POLLIN;
+		else
+			revents = POLLOUT;
+		if (events[i].flags & EV_EOF)
+			revents |= POLLHUP;
+
+		for (n = 0; n < nfds; n++) {
+			if (fds[n].fd == fd)
+				break;
+		}
+		if (n == nfds) {
+			fds[n].fd = fd;
+			fds[n].events = 0;
+			fds[n].revents = 0;
+			nfds++;
+		}
+		fds[n].events |= revents & (POLLIN | POLLOUT);
+		fds[n].revents |= revents;
+	}
+
+	return num_events < 0 ? num_events : nfds;
+}
+#endif
+
+static int create_epoll(struct libusb_context *ctx, int *epoll_fd,
+	void **event_data)
+{
+	struct pollfd *fds;
+
+	/* in epoll mode the event data only holds the ready fds of the last
+	 * wait, so it is allocated once and never needs to be rebuilt */
+	fds = calloc(USBI_EPOLL_MAX_EVENTS, sizeof(*fds));
+	if (!fds)
+		return LIBUSB_ERROR_NO_MEM;
+
+	*epoll_fd = create_event_set();
+	if (*epoll_fd == -1) {
+		usbi_err(ctx, "failed to create event set, errno=%d", errno);
+		free(fds);
+		return LIBUSB_ERROR_OTHER;
+	}
+
+	*event_data = fds;
+	return 0;
+}
+
+static void destroy_epoll(struct libusb_context *ctx, int epoll_fd,
+	void *event_data)
+{
+	if (close(epoll_fd) == -1)
+		usbi_warn(ctx, "failed to close event set, errno=%d", errno);
+	free(event_data);
+}
+
+static void destroy_event_loops(struct libusb_context *ctx, int count)
+{
+	int i;
+
+	for (i = 0; i < count; i++) {
+		struct usbi_event_loop *loop = &ctx->event_loops[i];
+
+		destroy_epoll(ctx, loop->epoll_fd, loop->event_data);
+		usbi_mutex_destroy(&loop->lock);
+	}
+
+	free(ctx->event_loops);
+	ctx->event_loops = NULL;
+	ctx->num_event_loops = 1;
+}
+
+int usbi_epoll_init(struct libusb_context *ctx)
+{
+	int i, r;
+
+	r = create_epoll(ctx, &ctx->epoll_fd, &ctx->event_data);
+	if (r < 0) {
+		ctx->epoll_fd = -1;
+		return r;
+	}
+	ctx->event_data_cnt = 0;
+
+	ctx->num_event_loops = 1;
+	if (ctx->requested_event_loops <= 1)
+		return 0;
+
+	ctx->event_loops = calloc((size_t)ctx->requested_event_loops - 1,
+		sizeof(*ctx->event_loops));
+	if (!ctx->event_loops) {
+		r = LIBUSB_ERROR_NO_MEM;
+		goto err_exit;
+	}
+
+	for (i = 0; i < ctx->requested_event_loops - 1; i++) {
+		struct usbi_event_loop *loop = &ctx->event_loops[i];
+
+		r = create_epoll(ctx, &loop->epoll_fd, &loop->event_data);
+		if (r < 0) {
+			destroy_event_loops(ctx, i);
+			goto err_exit;
+		}
+		usbi_mutex_init(&loop->lock);
+	}
+
+	ctx->num_event_loops = ctx->requested_event_loops;
+	return 0;
+
+err_exit:
+	usbi_epoll_exit(ctx);
+	return r;
+}
+
+void usbi_epoll_exit(struct libusb_context *ctx)
+{
+	if (ctx->epoll_fd == -1)
+		return;
+
+	if (ctx->event_loops)
+		destroy_event_loops(ctx, ctx->num_event_loops - 1);
+	destroy_epoll(ctx, ctx->epoll_fd, ctx->event_data);
+	ctx->epoll_fd = -1;
+	ctx->event_data = NULL;
+}
+
+/* Returns the epoll instance or kqueue that monitors an event source. The internal
+ * event sources always belong to the primary loop, which also handles the
+ * timeouts, while the device event sources are spread over all the loops.
+ * Since the file descriptor picks the loop, a descriptor that is closed and
+ * reused later always lands in the loop that handled it before. */
+static int epoll_fd_for_event_source(struct libusb_context *ctx,
+	usbi_os_handle_t os_handle)
+{
+	int loop;
+
+	if (ctx->num_event_loops <= 1 || os_handle == USBI_EVENT_OS_HANDLE(&ctx->event))
+		return ctx->epoll_fd;
+#ifdef HAVE_OS_TIMER
+	if (usbi_using_timer(ctx) && os_handle == USBI_TIMER_OS_HANDLE(&ctx->timer))
+		return ctx->epoll_fd;
+#endif
+
+	loop = os_handle % ctx->num_event_loops;
+	return loop ? ctx->event_loops[loop - 1].epoll_fd : ctx->epoll_fd;
+}
+
+int usbi_epoll_add(struct libusb_context *ctx, usbi_os_handle_t os_handle,
+	short poll_events)
+{
+	if (event_set_add(epoll_fd_for_event_source(ctx, os_handle), os_handle, poll_events) == -1) {
+		usbi_err(ctx, "failed to add fd %d to event set, errno=%d", os_handle, errno);
+		return errno == ENOMEM || errno == ENOSPC ? LIBUSB_ERROR_NO_MEM : LIBUSB_ERROR_OTHER;
+	}
+
+	return 0;
+}
+
+void usbi_epoll_remove(struct libusb_context *ctx, usbi_os_handle_t os_handle,
+	short poll_events)
+{
+	/* a closed fd is dropped from the interest set by the kernel, so
+	 * failures here are not an error */
+	if (event_set_remove(epoll_fd_for_event_source(ctx, os_handle), os_handle, poll_events) == -1)
+		usbi_dbg(ctx, "failed to remove fd %d from event set, errno=%d", os_handle, errno);
+}
 #endif
 
 int usbi_alloc_event_data(struct libusb_context *ctx)
@@ -225,6 +625,11 @@ int usbi_alloc_event_data(struct libusb_context *ctx)
 	struct pollfd *fds;
 	size_t i = 0;
 
+#ifdef HAVE_EVENT_SET
+	if (usbi_using_epoll(ctx))
+		return 0;
+#endif
+
 	if (ctx->event_data) {
 		free(ctx->event_data);
 		ctx->event_data = NULL;
@@ -248,6 +653,110 @@ int usbi_alloc_event_data(struct libusb_context *ctx)
 	return 0;
 }
 
+/* Clear the events raised on fds whose event source was removed since the
+ * fds array was built. Returns the number of ready fds remaining. */
+static int filter_removed_event_sources(struct libusb_context *ctx,
+	struct pollfd *fds, usbi_nfds_t nfds, int num_ready)
+{
+	usbi_mutex_lock(&ctx->event_data_lock);
+	if (!list_empty(&ctx->removed_event_sources)) {
+		struct usbi_event_source *ievent_source;
+
+		for_each_removed_event_source(ctx, ievent_source) {
+			usbi_nfds_t n;
+
+			for (n = 0; n < nfds; n++) {
+				if (ievent_source->data.os_handle != fds[n].fd)
+					continue;
+				if (!fds[n].revents)
+					continue;
+				/* pollfd was removed between the creation of the fds array and
+				 * here. remove triggered revent as it is no longer relevant. */
+				usbi_dbg(ctx, "fd %d was removed, ignoring raised events", fds[n].fd);
+				fds[n].revents = 0;
+				num_ready--;
+				break;
+			}
+		}
+	}
+	usbi_mutex_unlock(&ctx->event_data_lock);
+
+	return num_ready;
+}
+
+#ifdef HAVE_EVENT_SET
+static int wait_for_events_epoll(struct libusb_context *ctx, int epoll_fd,
+	struct pollfd *fds, struct usbi_reported_events *reported_events,
+	int timeout_ms)
+{
+	usbi_nfds_t nfds = 0;
+	int i, num_ready;
+
+	usbi_dbg(ctx, "event set wait with timeout in %dms", timeout_ms);
+	num_ready = event_set_wait(epoll_fd, fds, timeout_ms);
+	usbi_dbg(ctx, "event set wait returned %d", num_ready);
+	if (num_ready == 0) {
+		if (usbi_using_timer(ctx))
+			goto done;
+		return LIBUSB_ERROR_TIMEOUT;
+	} else if (num_ready == -1) {
+		if (errno == EINTR)
+			return LIBUSB_ERROR_INTERRUPTED;
+		usbi_err(ctx, "event set wait failed, errno=%d", errno);
+		return LIBUSB_ERROR_IO;
+	}
+
+	reported_events->event_triggered = 0;
+#ifdef HAVE_OS_TIMER
+	reported_events->timer_triggered = 0;
+#endif
+
+	/* only ready fds are returned, so the internal ones are picked out
+	 * and the rest are handed to the backend as pollfds */
+	for (i = 0; i < num_ready; i++) {
+		int fd = fds[i].fd;
+
+		if (fd == USBI_EVENT_OS_HANDLE(&ctx->event)) {
+			reported_events->event_triggered = 1;
+			continue;
+		}
+#ifdef HAVE_OS_TIMER
+		if (usbi_using_timer(ctx) && fd == USBI_TIMER_OS_HANDLE(&ctx->timer)) {
+			reported_events->timer_triggered = 1;
+			continue;
+		}
+#endif
+		if (nfds != (usbi_nfds_t)i)
+			fds[nfds] = fds[i];
+		nfds++;
+	}
+
+	num_ready = (int)nfds;
+	if (!num_ready)
+		goto done;
+
+	num_ready = filter_removed_event_sources(ctx, fds, nfds, num_ready);
+	if (num_ready) {
+		assert(num_ready > 0);
+		reported_events->event_data = fds;
+		reported_events->event_data_count = (unsigned int)nfds;
+	}
+
+done:
+	reported_events->num_ready = num_ready;
+	return LIBUSB_SUCCESS;
+}
+
+int usbi_wait_for_loop_events(struct libusb_context *ctx, int loop,
+	struct usbi_reported_events *reported_events, int timeout_ms)
+{
+	struct usbi_event_loop *event_loop = &ctx->event_loops[loop - 1];
+
+	return wait_for_events_epoll(ctx, event_loop->epoll_fd,
+		event_loop->event_data, reported_events, timeout_ms);
+}
+#endif
+
 int usbi_wait_for_events(struct libusb_context *ctx,
 	struct usbi_reported_events *reported_events, int timeout_ms)
 {
@@ -255,6 +764,12 @@ int usbi_wait_for_events(struct libusb_context *ctx,
 	usbi_nfds_t nfds = (usbi_nfds_t)ctx->event_data_cnt;
 	int internal_fds, num_ready;
 
+#ifdef HAVE_EVENT_SET
+	if (usbi_using_epoll(ctx))
+		return wait_for_events_epoll(ctx, ctx->epoll_fd, ctx->event_data,
+			reported_events, timeout_ms);
+#endif
+
 	usbi_dbg(ctx, "poll() %u fds with timeout in %dms", (unsigned int)nfds, timeout_ms);
 #ifdef __EMSCRIPTEN__
 	/* TODO: improve event system to watch only for fd events we're interested in
@@ -314,28 +829,7 @@ int usbi_wait_for_events(struct libusb_context *ctx,
 	fds += internal_fds;
 	nfds -= internal_fds;
 
-	usbi_mutex_lock(&ctx->event_data_lock);
-	if (ctx->event_flags & USBI_EVENT_EVENT_SOURCES_MODIFIED) {
-		struct usbi_event_source *ievent_source;
-
-		for_each_removed_event_source(ctx, ievent_source) {
-			usbi_nfds_t n;
-
-			for (n = 0; n < nfds; n++) {
-				if (ievent_source->data.os_handle != fds[n].fd)
-					continue;
-				if (!fds[n].revents)
-					continue;
-				/* pollfd was removed between the creation of the fds array and
-				 * here. remove triggered revent as it is no longer relevant. */
-				usbi_dbg(ctx, "fd %d was removed, ignoring raised events", fds[n].fd);
-				fds[n].revents = 0;
-				num_ready--;
-				break;
-			}
-		}
-	}
-	usbi_mutex_unlock(&ctx->event_data_lock);
+	num_ready = filter_removed_event_sources(ctx, fds, nfds, num_ready);
 
 	if (num_ready) {
 		assert(num_ready > 0);
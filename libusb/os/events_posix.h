@@ -54,6 +54,27 @@ static inline int usbi_timer_valid(usbi_timer_t *timer)
 {
 	return timer->timerfd >= 0;
 }
+#elif defined(HAVE_KQUEUE)
+#define HAVE_OS_TIMER 1
+/* a kqueue holding a single EVFILT_TIMER, which is readable once the timer
+ * has fired */
+typedef struct usbi_timer {
+	int kq;
+} usbi_timer_t;
+#define USBI_TIMER_OS_HANDLE(t)	((t)->kq)
+#define USBI_TIMER_POLL_EVENTS	POLLIN
+
+static inline int usbi_timer_valid(usbi_timer_t *timer)
+{
+	return timer->kq >= 0;
+}
+#endif
+
+/* event sources can be kept in a persistent interest set of the kernel, an
+ * epoll instance on Linux or a kqueue on macOS and the BSDs, see
+ * LIBUSB_OPTION_USE_EPOLL */
+#if defined(HAVE_EPOLL) || defined(HAVE_KQUEUE)
+#define HAVE_EVENT_SET 1
 #endif
 
 #endif
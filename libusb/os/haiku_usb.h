@@ -74,15 +74,25 @@ public:
 	status_t		CancelTransfer(USBTransfer *);
 	bool			InitCheck();
 private:
+	// Transfers are executed by one worker thread per endpoint, so that a
+	// blocking transfer on one endpoint does not hold up the others
+	struct TransferQueue {
+		USBDeviceHandle*	handle;
+		struct libusb_context*	ctx;
+		char			name[B_OS_NAME_LENGTH];
+		BList			transfers;
+		BLocker			lock;
+		sem_id			sem;
+		thread_id		thread;
+	};
 	int			fRawFD;
 	static status_t		TransfersThread(void *);
-	void			TransfersWorker();
+	void			TransfersWorker(TransferQueue *);
+	TransferQueue*		QueueForEndpoint(uint8, struct libusb_context *);
 	USBDevice*		fUSBDevice;
 	unsigned int		fClaimedInterfaces;
-	BList			fTransfers;
-	BLocker			fTransfersLock;
-	sem_id			fTransfersSem;
-	thread_id		fTransfersThread;
+	BLocker			fQueuesLock;
+	TransferQueue*		fQueues[USB_MAXENDPOINTS];
 	bool			fInitCheck;
 };
 
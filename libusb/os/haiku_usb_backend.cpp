@@ -19,6 +19,7 @@
 
 
 #include <unistd.h>
+#include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <new>
@@ -173,48 +174,88 @@ USBDeviceHandle::InitCheck()
 }
 
 status_t
-USBDeviceHandle::TransfersThread(void *self)
+USBDeviceHandle::TransfersThread(void *data)
 {
-	USBDeviceHandle *handle = (USBDeviceHandle *)self;
-	handle->TransfersWorker();
+	TransferQueue *queue = (TransferQueue *)data;
+	usbi_thread_started(queue->ctx, LIBUSB_THREAD_TRANSFER, queue->name);
+	queue->handle->TransfersWorker(queue);
 	return B_OK;
 }
 
 void
-USBDeviceHandle::TransfersWorker()
+USBDeviceHandle::TransfersWorker(TransferQueue *queue)
 {
 	while (true) {
-		status_t status = acquire_sem(fTransfersSem);
+		status_t status = acquire_sem(queue->sem);
 		if (status == B_BAD_SEM_ID)
 			break;
 		if (status == B_INTERRUPTED)
 			continue;
-		fTransfersLock.Lock();
-		USBTransfer *fPendingTransfer = (USBTransfer *) fTransfers.RemoveItem((int32)0);
-		fTransfersLock.Unlock();
+		queue->lock.Lock();
+		USBTransfer *fPendingTransfer = (USBTransfer *) queue->transfers.RemoveItem((int32)0);
+		queue->lock.Unlock();
 		fPendingTransfer->Do(fRawFD);
 		usbi_signal_transfer_completion(fPendingTransfer->UsbiTransfer());
 	}
 }
 
+USBDeviceHandle::TransferQueue *
+USBDeviceHandle::QueueForEndpoint(uint8 endpoint, struct libusb_context *ctx)
+{
+	BAutolock locker(fQueuesLock);
+	int index = USBI_ENDPOINT_INDEX(endpoint);
+	if (fQueues[index])
+		return fQueues[index];
+
+	TransferQueue *queue = new(std::nothrow) TransferQueue;
+	if (queue == NULL)
+		return NULL;
+	queue->handle = this;
+	queue->ctx = ctx;
+	queue->sem = create_sem(0, "Transfers Queue Sem");
+	if (queue->sem < 0) {
+		delete queue;
+		return NULL;
+	}
+	snprintf(queue->name, sizeof(queue->name), "Transfer Worker 0x%02x", endpoint);
+	queue->thread = spawn_thread(TransfersThread, queue->name, B_NORMAL_PRIORITY, queue);
+	if (queue->thread < 0) {
+		delete_sem(queue->sem);
+		delete queue;
+		return NULL;
+	}
+	resume_thread(queue->thread);
+	fQueues[index] = queue;
+	return queue;
+}
+
 status_t
 USBDeviceHandle::SubmitTransfer(struct usbi_transfer *itransfer)
 {
+	struct libusb_transfer *libusbTransfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	TransferQueue *queue = QueueForEndpoint(libusbTransfer->endpoint, ITRANSFER_CTX(itransfer));
+	if (queue == NULL)
+		return LIBUSB_ERROR_NO_MEM;
 	USBTransfer *transfer = new USBTransfer(itransfer, fUSBDevice);
 	*((USBTransfer **)usbi_get_transfer_priv(itransfer)) = transfer;
-	BAutolock locker(fTransfersLock);
-	fTransfers.AddItem(transfer);
-	release_sem(fTransfersSem);
+	BAutolock locker(queue->lock);
+	queue->transfers.AddItem(transfer);
+	release_sem(queue->sem);
 	return LIBUSB_SUCCESS;
 }
 
 status_t
 USBDeviceHandle::CancelTransfer(USBTransfer *transfer)
 {
+	struct libusb_transfer *libusbTransfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(transfer->UsbiTransfer());
+	TransferQueue *queue = QueueForEndpoint(libusbTransfer->endpoint,
+		ITRANSFER_CTX(transfer->UsbiTransfer()));
 	transfer->SetCancelled();
-	fTransfersLock.Lock();
-	bool removed = fTransfers.RemoveItem(transfer);
-	fTransfersLock.Unlock();
+	if (queue == NULL)
+		return LIBUSB_SUCCESS;
+	queue->lock.Lock();
+	bool removed = queue->transfers.RemoveItem(transfer);
+	queue->lock.Unlock();
 	if (removed)
 		usbi_signal_transfer_completion(transfer->UsbiTransfer());
 	return LIBUSB_SUCCESS;
@@ -224,17 +265,14 @@ USBDeviceHandle::USBDeviceHandle(USBDevice *dev)
 	:
 	fUSBDevice(dev),
 	fClaimedInterfaces(0),
-	fTransfersThread(-1),
 	fInitCheck(false)
 {
+	memset(fQueues, 0, sizeof(fQueues));
 	fRawFD = open(dev->Location(), O_RDWR | O_CLOEXEC);
 	if (fRawFD < 0) {
 		usbi_err(NULL,"failed to open device");
 		return;
 	}
-	fTransfersSem = create_sem(0, "Transfers Queue Sem");
-	fTransfersThread = spawn_thread(TransfersThread, "Transfer Worker", B_NORMAL_PRIORITY, this);
-	resume_thread(fTransfersThread);
 	fInitCheck = true;
 }
 
@@ -246,9 +284,13 @@ USBDeviceHandle::~USBDeviceHandle()
 		if (fClaimedInterfaces & (1U << i))
 			ReleaseInterface(i);
 	}
-	delete_sem(fTransfersSem);
-	if (fTransfersThread > 0)
-		wait_for_thread(fTransfersThread, NULL);
+	for (int i = 0; i < USB_MAXENDPOINTS; i++) {
+		if (fQueues[i] == NULL)
+			continue;
+		delete_sem(fQueues[i]->sem);
+		wait_for_thread(fQueues[i]->thread, NULL);
+		delete fQueues[i];
+	}
 }
 
 int
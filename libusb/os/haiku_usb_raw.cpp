@@ -194,6 +194,7 @@ const struct usbi_os_backend usbi_backend = {
 	/*.get_active_config_descriptor =*/ haiku_get_active_config_descriptor,
 	/*.get_config_descriptor =*/ haiku_get_config_descriptor,
 	/*.get_config_descriptor_by_value =*/ NULL,
+	/*.get_device_string =*/ NULL,
 
 	/*.get_configuration =*/ NULL,
 	/*.set_configuration =*/ haiku_set_configuration,
@@ -210,6 +211,8 @@ const struct usbi_os_backend usbi_backend = {
 
 	/*.dev_mem_alloc =*/ NULL,
 	/*.dev_mem_free =*/ NULL,
+	/*.host_mem_alloc =*/ NULL,
+	/*.host_mem_free =*/ NULL,
 
 	/*.kernel_driver_active =*/ NULL,
 	/*.detach_kernel_driver =*/ NULL,
@@ -219,7 +222,12 @@ const struct usbi_os_backend usbi_backend = {
 
 	/*.submit_transfer =*/ haiku_submit_transfer,
 	/*.cancel_transfer =*/ haiku_cancel_transfer,
+	/*.cancel_endpoint_transfers =*/ NULL,
 	/*.clear_transfer_priv =*/ NULL,
+	/*.destroy_transfer_priv =*/ NULL,
+
+	/*.sync_control_transfer =*/ NULL,
+	/*.sync_bulk_transfer =*/ NULL,
 
 	/*.handle_events =*/ NULL,
 	/*.handle_transfer_completion =*/ haiku_handle_transfer_completion,
@@ -36,9 +36,16 @@
 #endif
 #include <sys/socket.h>
 #include <linux/netlink.h>
+#ifdef HAVE_LINUX_FILTER_H
+#include <linux/filter.h>
+#endif
 
 #define NL_GROUP_KERNEL 1
 
+/* number of messages received per recvmmsg() call */
+#define NL_MAX_MESSAGES	8
+#define NL_MESSAGE_SIZE	2048
+
 #ifndef SOCK_CLOEXEC
 #define SOCK_CLOEXEC	0
 #endif
@@ -90,6 +97,35 @@ static int set_fd_cloexec_nb(int fd, int socktype)
 	return 0;
 }
 
+#ifdef HAVE_LINUX_FILTER_H
+/* Kernel uevents start with an "<action>@<devpath>" header. The subsystem
+ * only appears further in, at no fixed offset, so the filter can only drop
+ * the actions we never handle (bind, unbind, change, ...) and the rest is
+ * checked by linux_netlink_parse(). */
+static void attach_uevent_filter(int fd)
+{
+	struct sock_filter filter[] = {
+		BPF_STMT(BPF_LD | BPF_W | BPF_ABS, 0),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0x61646440 /* "add@" */, 5, 0),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0x72656d6f /* "remo" */, 0, 5),
+		BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 4),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0x7665 /* "ve" */, 0, 3),
+		BPF_STMT(BPF_LD | BPF_B | BPF_ABS, 6),
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, '@', 0, 1),
+		BPF_STMT(BPF_RET | BPF_K, 0xffffffff),
+		BPF_STMT(BPF_RET | BPF_K, 0),
+	};
+	struct sock_fprog prog = {
+		.len = (unsigned short)ARRAYSIZE(filter),
+		.filter = filter,
+	};
+
+	/* not fatal, every message is still checked in userspace */
+	if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) == -1)
+		usbi_dbg(NULL, "failed to attach netlink socket filter, errno=%d", errno);
+}
+#endif
+
 int linux_netlink_start_event_monitor(void)
 {
 	struct sockaddr_nl sa_nl = { .nl_family = AF_NETLINK, .nl_groups = NL_GROUP_KERNEL };
@@ -125,6 +161,10 @@ int linux_netlink_start_event_monitor(void)
 		goto err_close_socket;
 	}
 
+#ifdef HAVE_LINUX_FILTER_H
+	attach_uevent_filter(linux_netlink_socket);
+#endif
+
 	ret = usbi_create_event(&netlink_control_event);
 	if (ret) {
 		usbi_err(NULL, "failed to create netlink control event");
@@ -171,24 +211,13 @@ int linux_netlink_stop_event_monitor(void)
 	return LIBUSB_SUCCESS;
 }
 
-static const char *netlink_message_parse(const char *buffer, size_t len, const char *key)
-{
-	const char *end = buffer + len;
-	size_t keylen = strlen(key);
-
-	while (buffer < end && *buffer) {
-		if (strncmp(buffer, key, keylen) == 0 && buffer[keylen] == '=')
-			return buffer + keylen + 1;
-		buffer += strlen(buffer) + 1;
-	}
-
-	return NULL;
-}
-
 /* parse parts of netlink message common to both libudev and the kernel */
 static int linux_netlink_parse(const char *buffer, size_t len, int *detached,
 	const char **sys_name, uint8_t *busnum, uint8_t *devaddr)
 {
+	const char *end = buffer + len;
+	const char *action = NULL, *subsystem = NULL, *devtype = NULL;
+	const char *bus = NULL, *dev = NULL, *device = NULL, *devpath = NULL;
 	const char *tmp, *slash;
 
 	errno = 0;
@@ -198,57 +227,76 @@ static int linux_netlink_parse(const char *buffer, size_t len, int *detached,
 	*busnum   = 0;
 	*devaddr  = 0;
 
-	tmp = netlink_message_parse(buffer, len, "ACTION");
-	if (!tmp) {
+	/* collect every key we need in a single pass over the message */
+	while (buffer < end && *buffer) {
+		tmp = strchr(buffer, '=');
+		if (tmp) {
+			size_t keylen = (size_t)(tmp - buffer);
+
+			tmp++;
+			if (keylen == 6 && strncmp(buffer, "ACTION", 6) == 0)
+				action = tmp;
+			else if (keylen == 9 && strncmp(buffer, "SUBSYSTEM", 9) == 0)
+				subsystem = tmp;
+			else if (keylen == 7 && strncmp(buffer, "DEVTYPE", 7) == 0)
+				devtype = tmp;
+			else if (keylen == 6 && strncmp(buffer, "BUSNUM", 6) == 0)
+				bus = tmp;
+			else if (keylen == 6 && strncmp(buffer, "DEVNUM", 6) == 0)
+				dev = tmp;
+			else if (keylen == 6 && strncmp(buffer, "DEVICE", 6) == 0)
+				device = tmp;
+			else if (keylen == 7 && strncmp(buffer, "DEVPATH", 7) == 0)
+				devpath = tmp;
+		}
+		buffer += strlen(buffer) + 1;
+	}
+
+	if (!action) {
 		return -1;
-	} else if (strcmp(tmp, "remove") == 0) {
+	} else if (strcmp(action, "remove") == 0) {
 		*detached = 1;
-	} else if (strcmp(tmp, "add") != 0) {
-		usbi_dbg(NULL, "unknown device action %s", tmp);
+	} else if (strcmp(action, "add") != 0) {
+		usbi_dbg(NULL, "unknown device action %s", action);
 		return -1;
 	}
 
 	/* check that this is a usb message */
-	tmp = netlink_message_parse(buffer, len, "SUBSYSTEM");
-	if (!tmp || strcmp(tmp, "usb") != 0) {
+	if (!subsystem || strcmp(subsystem, "usb") != 0) {
 		/* not usb. ignore */
 		return -1;
 	}
 
 	/* check that this is an actual usb device */
-	tmp = netlink_message_parse(buffer, len, "DEVTYPE");
-	if (!tmp || strcmp(tmp, "usb_device") != 0) {
+	if (!devtype || strcmp(devtype, "usb_device") != 0) {
 		/* not usb. ignore */
 		return -1;
 	}
 
-	tmp = netlink_message_parse(buffer, len, "BUSNUM");
-	if (tmp) {
-		*busnum = (uint8_t)(strtoul(tmp, NULL, 10) & 0xff);
+	if (bus) {
+		*busnum = (uint8_t)(strtoul(bus, NULL, 10) & 0xff);
 		if (errno) {
 			errno = 0;
 			return -1;
 		}
 
-		tmp = netlink_message_parse(buffer, len, "DEVNUM");
-		if (NULL == tmp)
+		if (NULL == dev)
 			return -1;
 
-		*devaddr = (uint8_t)(strtoul(tmp, NULL, 10) & 0xff);
+		*devaddr = (uint8_t)(strtoul(dev, NULL, 10) & 0xff);
 		if (errno) {
 			errno = 0;
 			return -1;
 		}
 	} else {
 		/* no bus number. try "DEVICE" */
-		tmp = netlink_message_parse(buffer, len, "DEVICE");
-		if (!tmp) {
+		if (!device) {
 			/* not usb. ignore */
 			return -1;
 		}
 
 		/* Parse a device path such as /dev/bus/usb/003/004 */
-		slash = strrchr(tmp, '/');
+		slash = strrchr(device, '/');
 		if (!slash)
 			return -1;
 
@@ -267,11 +315,10 @@ static int linux_netlink_parse(const char *buffer, size_t len, int *detached,
 		return 0;
 	}
 
-	tmp = netlink_message_parse(buffer, len, "DEVPATH");
-	if (!tmp)
+	if (!devpath)
 		return -1;
 
-	slash = strrchr(tmp, '/');
+	slash = strrchr(devpath, '/');
 	if (slash)
 		*sys_name = slash + 1;
 
@@ -279,71 +326,121 @@ static int linux_netlink_parse(const char *buffer, size_t len, int *detached,
 	return 0;
 }
 
-static int linux_netlink_read_message(void)
+static void linux_netlink_handle_message(struct msghdr *msg, char *msg_buffer, size_t len)
 {
-	char cred_buffer[CMSG_SPACE(sizeof(struct ucred))];
-	char msg_buffer[2048];
 	const char *sys_name = NULL;
 	uint8_t busnum, devaddr;
-	int detached, r;
-	ssize_t len;
+	int detached;
 	struct cmsghdr *cmsg;
 	struct ucred *cred;
-	struct sockaddr_nl sa_nl;
-	struct iovec iov = { .iov_base = msg_buffer, .iov_len = sizeof(msg_buffer) };
-	struct msghdr msg = {
-		.msg_iov = &iov, .msg_iovlen = 1,
-		.msg_control = cred_buffer, .msg_controllen = sizeof(cred_buffer),
-		.msg_name = &sa_nl, .msg_namelen = sizeof(sa_nl)
-	};
-
-	/* read netlink message */
-	len = recvmsg(linux_netlink_socket, &msg, 0);
-	if (len == -1) {
-		if (errno != EAGAIN && errno != EINTR)
-			usbi_err(NULL, "error receiving message from netlink, errno=%d", errno);
-		return -1;
-	}
+	struct sockaddr_nl *sa_nl = msg->msg_name;
 
-	if (len < 32 || (msg.msg_flags & MSG_TRUNC)) {
+	if (len < 32 || (msg->msg_flags & MSG_TRUNC)) {
 		usbi_err(NULL, "invalid netlink message length");
-		return -1;
+		return;
 	}
 
-	if (sa_nl.nl_groups != NL_GROUP_KERNEL || sa_nl.nl_pid != 0) {
+	if (sa_nl->nl_groups != NL_GROUP_KERNEL || sa_nl->nl_pid != 0) {
 		usbi_dbg(NULL, "ignoring netlink message from unknown group/PID (%u/%u)",
-			 (unsigned int)sa_nl.nl_groups, (unsigned int)sa_nl.nl_pid);
-		return -1;
+			 (unsigned int)sa_nl->nl_groups, (unsigned int)sa_nl->nl_pid);
+		return;
 	}
 
-	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg = CMSG_FIRSTHDR(msg);
 	if (!cmsg || cmsg->cmsg_type != SCM_CREDENTIALS) {
 		usbi_dbg(NULL, "ignoring netlink message with no sender credentials");
-		return -1;
+		return;
 	}
 
 	cred = (struct ucred *)CMSG_DATA(cmsg);
 	if (cred->uid != 0) {
 		usbi_dbg(NULL, "ignoring netlink message with non-zero sender UID %u", (unsigned int)cred->uid);
-		return -1;
+		return;
 	}
 
-	r = linux_netlink_parse(msg_buffer, (size_t)len, &detached, &sys_name, &busnum, &devaddr);
-	if (r)
-		return r;
+	/* the parser relies on the message being NUL terminated */
+	msg_buffer[len] = '\0';
+
+	if (linux_netlink_parse(msg_buffer, len, &detached, &sys_name, &busnum, &devaddr))
+		return;
 
 	usbi_dbg(NULL, "netlink hotplug found device busnum: %hhu, devaddr: %hhu, sys_name: %s, removed: %s",
 		 busnum, devaddr, sys_name, detached ? "yes" : "no");
 
 	/* signal device is available (or not) to all contexts */
 	if (detached)
-		linux_device_disconnected(busnum, devaddr);
+		linux_hotplug_disconnected(busnum, devaddr);
 	else
 		linux_hotplug_enumerate(busnum, devaddr, sys_name);
+}
+
+/* Reads the pending netlink messages, up to NL_MAX_MESSAGES at a time.
+ * Returns 0 if anything was received, -1 once the socket has been drained.
+ * Callers hold linux_hotplug_lock, which also protects the buffers, and
+ * publish the events read. */
+static int linux_netlink_read_message(void)
+{
+	static char cred_buffer[NL_MAX_MESSAGES][CMSG_SPACE(sizeof(struct ucred))];
+	static char msg_buffer[NL_MAX_MESSAGES][NL_MESSAGE_SIZE + 1];
+	static struct sockaddr_nl sa_nl[NL_MAX_MESSAGES];
+	static struct iovec iov[NL_MAX_MESSAGES];
+#ifdef HAVE_RECVMMSG
+	static struct mmsghdr msgs[NL_MAX_MESSAGES];
+	int i, count;
+#else
+	struct msghdr msg;
+	ssize_t len;
+#endif
+
+#ifdef HAVE_RECVMMSG
+	for (i = 0; i < NL_MAX_MESSAGES; i++) {
+		iov[i].iov_base = msg_buffer[i];
+		iov[i].iov_len = NL_MESSAGE_SIZE;
+		msgs[i].msg_hdr = (struct msghdr) {
+			.msg_iov = &iov[i], .msg_iovlen = 1,
+			.msg_control = cred_buffer[i], .msg_controllen = sizeof(cred_buffer[i]),
+			.msg_name = &sa_nl[i], .msg_namelen = sizeof(sa_nl[i])
+		};
+	}
+
+	/* read netlink messages */
+	count = recvmmsg(linux_netlink_socket, msgs, NL_MAX_MESSAGES, 0, NULL);
+	if (count == -1) {
+		if (errno != EAGAIN && errno != EINTR)
+			usbi_err(NULL, "error receiving message from netlink, errno=%d", errno);
+		return -1;
+	}
+
+	for (i = 0; i < count; i++)
+		linux_netlink_handle_message(&msgs[i].msg_hdr, msg_buffer[i], msgs[i].msg_len);
+#else
+	iov[0].iov_base = msg_buffer[0];
+	iov[0].iov_len = NL_MESSAGE_SIZE;
+	msg = (struct msghdr) {
+		.msg_iov = &iov[0], .msg_iovlen = 1,
+		.msg_control = cred_buffer[0], .msg_controllen = sizeof(cred_buffer[0]),
+		.msg_name = &sa_nl[0], .msg_namelen = sizeof(sa_nl[0])
+	};
+
+	/* read netlink message */
+	len = recvmsg(linux_netlink_socket, &msg, 0);
+	if (len == -1) {
+		if (errno != EAGAIN && errno != EINTR)
+			usbi_err(NULL, "error receiving message from netlink, errno=%d", errno);
+		return -1;
+	}
+
+	linux_netlink_handle_message(&msg, msg_buffer[0], (size_t)len);
+#endif
 
 	return 0;
 }
 
+static void linux_netlink_read_event(void)
+{
+	linux_netlink_read_message();
+}
+
 static void *linux_netlink_event_thread_main(void *arg)
 {
 	struct pollfd fds[] = {
@@ -356,11 +453,7 @@ static void *linux_netlink_event_thread_main(void *arg)
 
 	UNUSED(arg);
 
-#if defined(HAVE_PTHREAD_SETNAME_NP)
-	r = pthread_setname_np(pthread_self(), "libusb_event");
-	if (r)
-		usbi_warn(NULL, "failed to set hotplug event thread name, error=%d", r);
-#endif
+	usbi_thread_started(NULL, LIBUSB_THREAD_EVENT, "libusb_event");
 
 	usbi_dbg(NULL, "netlink event thread entering");
 
@@ -378,9 +471,9 @@ static void *linux_netlink_event_thread_main(void *arg)
 			break;
 		}
 		if (fds[1].revents) {
-			usbi_mutex_static_lock(&linux_hotplug_lock);
-			linux_netlink_read_message();
-			usbi_mutex_static_unlock(&linux_hotplug_lock);
+			/* exit if the control event fired meanwhile */
+			if (linux_hotplug_read_batch(fds, linux_netlink_read_event))
+				break;
 		}
 	}
 
@@ -397,5 +490,6 @@ void linux_netlink_hotplug_poll(void)
 	do {
 		r = linux_netlink_read_message();
 	} while (r == 0);
+	linux_hotplug_publish();
 	usbi_mutex_static_unlock(&linux_hotplug_lock);
 }
@@ -158,6 +158,15 @@ int linux_udev_stop_event_monitor(void)
 	return LIBUSB_SUCCESS;
 }
 
+static void linux_udev_read_event(void)
+{
+	struct udev_device *udev_dev;
+
+	udev_dev = udev_monitor_receive_device(udev_monitor);
+	if (udev_dev)
+		udev_hotplug_event(udev_dev);
+}
+
 static void *linux_udev_event_thread_main(void *arg)
 {
 	struct pollfd fds[] = {
@@ -166,16 +175,11 @@ static void *linux_udev_event_thread_main(void *arg)
 		{ .fd = udev_monitor_fd,
 		  .events = POLLIN },
 	};
-	struct udev_device *udev_dev;
 	int r;
 
 	UNUSED(arg);
 
-#if defined(HAVE_PTHREAD_SETNAME_NP)
-	r = pthread_setname_np(pthread_self(), "libusb_event");
-	if (r)
-		usbi_warn(NULL, "failed to set hotplug event thread name, error=%d", r);
-#endif
+	usbi_thread_started(NULL, LIBUSB_THREAD_EVENT, "libusb_event");
 
 	usbi_dbg(NULL, "udev event thread entering");
 
@@ -193,11 +197,9 @@ static void *linux_udev_event_thread_main(void *arg)
 			break;
 		}
 		if (fds[1].revents) {
-			usbi_mutex_static_lock(&linux_hotplug_lock);
-			udev_dev = udev_monitor_receive_device(udev_monitor);
-			if (udev_dev)
-				udev_hotplug_event(udev_dev);
-			usbi_mutex_static_unlock(&linux_hotplug_lock);
+			/* exit if the control event fired meanwhile */
+			if (linux_hotplug_read_batch(fds, linux_udev_read_event))
+				break;
 		}
 	}
 
@@ -251,7 +253,7 @@ static void udev_hotplug_event(struct udev_device *udev_dev)
 		if (strncmp(udev_action, "add", 3) == 0) {
 			linux_hotplug_enumerate(busnum, devaddr, sys_name);
 		} else if (detached) {
-			linux_device_disconnected(busnum, devaddr);
+			linux_hotplug_disconnected(busnum, devaddr);
 		} else if (strncmp(udev_action, "bind", 4) == 0) {
 			/* silently ignore "known unhandled" action */
 		} else {
@@ -267,6 +269,8 @@ int linux_udev_scan_devices(struct libusb_context *ctx)
 	struct udev_enumerate *enumerator;
 	struct udev_list_entry *devices, *entry;
 	struct udev_device *udev_dev;
+	struct linux_scan_entry *entries = NULL;
+	size_t num_entries = 0, max_entries = 0;
 	const char *sys_name;
 	int r;
 
@@ -296,12 +300,48 @@ int linux_udev_scan_devices(struct libusb_context *ctx)
 			continue;
 		}
 
-		linux_enumerate_device(ctx, busnum, devaddr, sys_name);
+		if (ctx->enumeration_threads > 1) {
+			/* collect the devices, they are enumerated below */
+			r = LIBUSB_SUCCESS;
+			if (num_entries == max_entries) {
+				struct linux_scan_entry *new_entries;
+
+				max_entries = max_entries ? 2 * max_entries : 64;
+				new_entries = realloc(entries, max_entries * sizeof(*entries));
+				if (new_entries)
+					entries = new_entries;
+				else
+					r = LIBUSB_ERROR_NO_MEM;
+			}
+			if (r == LIBUSB_SUCCESS) {
+				entries[num_entries].sysfs_dir = strdup(sys_name);
+				if (!entries[num_entries].sysfs_dir)
+					r = LIBUSB_ERROR_NO_MEM;
+			}
+			if (r == LIBUSB_SUCCESS) {
+				entries[num_entries].have_address = 1;
+				entries[num_entries].busnum = busnum;
+				entries[num_entries].devaddr = devaddr;
+				num_entries++;
+			} else {
+				/* enumerate this one in place */
+				linux_enumerate_device(ctx, busnum, devaddr, sys_name);
+			}
+		} else {
+			linux_enumerate_device(ctx, busnum, devaddr, sys_name);
+		}
 		udev_device_unref(udev_dev);
 	}
 
 	udev_enumerate_unref(enumerator);
 
+	if (num_entries)
+		linux_enumerate_devices(ctx, entries, num_entries);
+
+	while (num_entries)
+		free(entries[--num_entries].sysfs_dir);
+	free(entries);
+
 	return LIBUSB_SUCCESS;
 }
 
@@ -317,5 +357,6 @@ void linux_udev_hotplug_poll(void)
 			udev_hotplug_event(udev_dev);
 		}
 	} while (udev_dev);
+	linux_hotplug_publish();
 	usbi_mutex_static_unlock(&linux_hotplug_lock);
 }
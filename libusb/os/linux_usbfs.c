@@ -30,10 +30,14 @@
 #include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/utsname.h>
 #include <sys/vfs.h>
 #include <unistd.h>
@@ -95,10 +99,65 @@ static int sysfs_available = -1;
 /* how many times have we initted (and not exited) ? */
 static int init_count = 0;
 
-/* Serialize scan-devices, event-thread, and poll */
+/* Serialize reading the hotplug monitor, from the event thread and from
+ * hotplug_poll, and protect the subscribed contexts. Contexts only take it
+ * to subscribe and unsubscribe, the events reach them through queues of
+ * their own, see linux_hotplug_publish(). */
 usbi_mutex_static_t linux_hotplug_lock = USBI_MUTEX_INITIALIZER;
 
+/* room for the sysfs name of a device, such as "3-1.4.2" */
+#define LINUX_SYS_NAME_MAX	64
+
+/* A hotplug event read from the monitor */
+struct linux_hotplug_uevent {
+	uint8_t busnum;
+	uint8_t devaddr;
+	uint8_t detached;
+	/* empty if the monitor did not report one */
+	char sys_name[LINUX_SYS_NAME_MAX];
+};
+
+/* Events published to a context together, see linux_hotplug_publish() */
+struct linux_hotplug_batch {
+	struct linux_hotplug_batch *next;
+	size_t num_events;
+	struct linux_hotplug_uevent events[ZERO_SIZED_ARRAY];
+};
+
+/* contexts receiving hotplug events, and the events read from the monitor
+ * but not published yet. Protected by linux_hotplug_lock. */
+static struct list_head linux_hotplug_subscribers = { &linux_hotplug_subscribers, &linux_hotplug_subscribers };
+static struct linux_hotplug_uevent *linux_hotplug_pending;
+static size_t linux_hotplug_num_pending;
+static size_t linux_hotplug_max_pending;
+
+/* Speed and descriptors read from sysfs, shared by all contexts so that a
+ * context does not read them again for devices that another context already
+ * enumerated. An entry is only used while the sysfs directory of the device
+ * still has the inode it had when the entry was made, which tells apart a
+ * device that was unplugged and replaced in the meantime. Entries are
+ * dropped on disconnect, and all of them when the last context exits. */
+struct linux_cached_device {
+	struct list_head list;
+	unsigned long session_id;
+	ino_t sysfs_ino;
+	enum libusb_speed speed;
+	/* shared through the descriptor store */
+	void *descriptors;
+	size_t descriptors_len;
+};
+
+static usbi_mutex_static_t linux_device_cache_lock = USBI_MUTEX_INITIALIZER;
+static struct list_head linux_device_cache = { &linux_device_cache, &linux_device_cache };
+
 static int linux_scan_devices(struct libusb_context *ctx);
+static void device_cache_clear(void);
+static void device_cache_remove(unsigned long session_id);
+static int hotplug_subscribe(struct libusb_context *ctx);
+static void hotplug_unsubscribe(struct libusb_context *ctx);
+static void hotplug_drain(struct libusb_context *ctx);
+static int enumerate_device(struct libusb_context *ctx,
+	uint8_t busnum, uint8_t devaddr, const char *sysfs_dir, int sysfs_fd);
 static int detach_kernel_driver_and_claim(struct libusb_device_handle *, uint8_t);
 
 #if !defined(HAVE_LIBUDEV)
@@ -119,21 +178,48 @@ struct config_descriptor {
 struct linux_context_priv {
 	/* no enumeration or hot-plug detection */
 	int no_device_discovery;
+
+	/* The hotplug subscription of the context. The reader of the monitor
+	 * pushes batches of events onto hotplug_batches without taking a lock,
+	 * and signals hotplug_event, an event source of the context, when
+	 * hotplug_signaled goes from 0 to 1. hotplug_lock serializes applying
+	 * the events, so that the devices of the context change in order. */
+	struct libusb_context *ctx;
+	struct list_head hotplug_list;
+	usbi_atomic_ptr_t hotplug_batches;
+	usbi_atomic_t hotplug_signaled;
+	usbi_event_t hotplug_event;
+	usbi_mutex_t hotplug_lock;
 };
 
 struct linux_device_priv {
 	char *sysfs_dir;
+	/* shared through the descriptor store, see usbi_desc_store_get() */
 	void *descriptors;
 	size_t descriptors_len;
 	struct config_descriptor *config_descriptors;
 	int active_config; /* cache val for !sysfs_available  */
+	/* USBFS_CAP_* of the device with USBFS_CAPS_KNOWN set, once it has
+	 * been opened */
+	usbi_atomic_t usbfs_caps;
 };
 
+/* not a kernel capability, marks linux_device_priv.usbfs_caps as valid */
+#define USBFS_CAPS_KNOWN	0x80000000U
+
 struct linux_device_handle_priv {
 	int fd;
 	int fd_removed;
 	int fd_keep;
 	uint32_t caps;
+	/* number of URBs submitted on this fd that have not been reaped yet */
+	usbi_atomic_t urbs_in_flight;
+	/* iso URBs not reaped yet, per endpoint */
+	usbi_atomic_t iso_urbs_in_flight[USB_MAXENDPOINTS];
+	/* held by the event handler while it reaps URBs of this handle, so
+	 * that op_close() waits for it. it is taken under open_devs_lock,
+	 * which the handler releases before reaping */
+	usbi_mutex_t reap_lock;
 };
 
 enum reap_action {
@@ -165,6 +251,11 @@ struct linux_transfer_priv {
 
 	/* next iso packet in user-supplied transfer to be populated */
 	int iso_packet_offset;
+
+	/* memory backing urbs/iso_urbs, kept across submissions so that it
+	 * only needs to be reallocated when a submission needs more of it */
+	void *urb_storage;
+	size_t urb_storage_size;
 };
 
 static int dev_has_config0(struct libusb_device *dev)
@@ -408,16 +499,24 @@ static int op_init(struct libusb_context *ctx)
 	if (init_count == 0) {
 		/* start up hotplug event handler */
 		r = linux_start_event_monitor();
+		if (r != LIBUSB_SUCCESS) {
+			usbi_err(ctx, "error starting hotplug event monitor");
+			return r;
+		}
 	}
+
+	/* subscribe before scanning, the events that arrive meanwhile are
+	 * applied on top of the scan */
+	r = hotplug_subscribe(ctx);
 	if (r == LIBUSB_SUCCESS) {
 		r = linux_scan_devices(ctx);
 		if (r == LIBUSB_SUCCESS)
 			init_count++;
-		else if (init_count == 0)
-			linux_stop_event_monitor();
-	} else {
-		usbi_err(ctx, "error starting hotplug event monitor");
+		else
+			hotplug_unsubscribe(ctx);
 	}
+	if (r != LIBUSB_SUCCESS && init_count == 0)
+		linux_stop_event_monitor();
 
 	return r;
 }
@@ -430,10 +529,13 @@ static void op_exit(struct libusb_context *ctx)
 		return;
 	}
 
+	hotplug_unsubscribe(ctx);
+
 	assert(init_count != 0);
 	if (!--init_count) {
 		/* tear down event handler */
 		linux_stop_event_monitor();
+		device_cache_clear();
 	}
 }
 
@@ -456,22 +558,41 @@ static int linux_scan_devices(struct libusb_context *ctx)
 {
 	int ret;
 
-	usbi_mutex_static_lock(&linux_hotplug_lock);
-
 #if defined(HAVE_LIBUDEV)
+	/* the objects of a udev context must not be used by several threads at
+	 * once, and the monitor shares its udev context with the scan */
+	usbi_mutex_static_lock(&linux_hotplug_lock);
 	ret = linux_udev_scan_devices(ctx);
+	usbi_mutex_static_unlock(&linux_hotplug_lock);
 #else
 	ret = linux_default_scan_devices(ctx);
 #endif
 
-	usbi_mutex_static_unlock(&linux_hotplug_lock);
-
 	return ret;
 }
 
-static void op_hotplug_poll(void)
+static void op_hotplug_poll(struct libusb_context *ctx)
 {
+	struct linux_context_priv *cpriv = usbi_get_context_priv(ctx);
+
 	linux_hotplug_poll();
+	if (!cpriv->no_device_discovery)
+		hotplug_drain(ctx);
+}
+
+static int sysfs_open_error(struct libusb_context *ctx, const char *name)
+{
+#ifndef ENABLE_LOGGING
+	UNUSED(name);
+#endif
+
+	if (errno == ENOENT) {
+		/* File doesn't exist. Assume the device has been
+		   disconnected (see trac ticket #70). */
+		return LIBUSB_ERROR_NO_DEVICE;
+	}
+	usbi_err(ctx, "open %s failed, errno=%d", name, errno);
+	return LIBUSB_ERROR_IO;
 }
 
 static int open_sysfs_attr(struct libusb_context *ctx,
@@ -482,31 +603,52 @@ static int open_sysfs_attr(struct libusb_context *ctx,
 
 	snprintf(filename, sizeof(filename), SYSFS_DEVICE_PATH "/%s/%s", sysfs_dir, attr);
 	fd = open(filename, O_RDONLY | O_CLOEXEC);
-	if (fd < 0) {
-		if (errno == ENOENT) {
-			/* File doesn't exist. Assume the device has been
-			   disconnected (see trac ticket #70). */
-			return LIBUSB_ERROR_NO_DEVICE;
-		}
-		usbi_err(ctx, "open %s failed, errno=%d", filename, errno);
-		return LIBUSB_ERROR_IO;
-	}
+	if (fd < 0)
+		return sysfs_open_error(ctx, filename);
 
 	return fd;
 }
 
-/* Note only suitable for attributes which always read >= 0, < 0 is error */
-static int read_sysfs_attr(struct libusb_context *ctx,
-	const char *sysfs_dir, const char *attr, int max_value, int *value_p)
+/* Open the sysfs directory of a device. When several attributes of a device
+ * are read in a row, opening them relative to the directory saves resolving
+ * the full path each time. */
+static int open_sysfs_dir(struct libusb_context *ctx, const char *sysfs_dir)
+{
+	char dirname[256];
+	int fd;
+
+	snprintf(dirname, sizeof(dirname), SYSFS_DEVICE_PATH "/%s", sysfs_dir);
+	fd = open(dirname, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0)
+		return sysfs_open_error(ctx, dirname);
+
+	return fd;
+}
+
+static int open_sysfs_attr_at(struct libusb_context *ctx, int sysfs_fd,
+	const char *attr)
+{
+	int fd;
+
+	fd = openat(sysfs_fd, attr, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return sysfs_open_error(ctx, attr);
+
+	return fd;
+}
+
+/* Note only suitable for attributes which always read >= 0, < 0 is error.
+ * Closes fd. */
+static int parse_sysfs_attr(struct libusb_context *ctx, int fd,
+	const char *attr, int max_value, int *value_p)
 {
 	char buf[20], *endptr;
 	long value;
 	ssize_t r;
-	int fd;
 
-	fd = open_sysfs_attr(ctx, sysfs_dir, attr);
-	if (fd < 0)
-		return fd;
+#ifndef ENABLE_LOGGING
+	UNUSED(attr);
+#endif
 
 	r = read(fd, buf, sizeof(buf) - 1);
 	if (r < 0) {
@@ -564,16 +706,68 @@ static int read_sysfs_attr(struct libusb_context *ctx,
 	return 0;
 }
 
+static int read_sysfs_attr(struct libusb_context *ctx,
+	const char *sysfs_dir, const char *attr, int max_value, int *value_p)
+{
+	int fd;
+
+	fd = open_sysfs_attr(ctx, sysfs_dir, attr);
+	if (fd < 0)
+		return fd;
+
+	return parse_sysfs_attr(ctx, fd, attr, max_value, value_p);
+}
+
+static int read_sysfs_attr_at(struct libusb_context *ctx, int sysfs_fd,
+	const char *attr, int max_value, int *value_p)
+{
+	int fd;
+
+	fd = open_sysfs_attr_at(ctx, sysfs_fd, attr);
+	if (fd < 0)
+		return fd;
+
+	return parse_sysfs_attr(ctx, fd, attr, max_value, value_p);
+}
+
+static int sysfs_get_device_address(struct libusb_context *ctx, int sysfs_fd,
+	uint8_t *busnum, uint8_t *devaddr)
+{
+	int sysfs_val;
+	int r;
+
+	r = read_sysfs_attr_at(ctx, sysfs_fd, "busnum", UINT8_MAX, &sysfs_val);
+	if (r < 0)
+		return r;
+	*busnum = (uint8_t)sysfs_val;
+
+	r = read_sysfs_attr_at(ctx, sysfs_fd, "devnum", UINT8_MAX, &sysfs_val);
+	if (r < 0)
+		return r;
+	*devaddr = (uint8_t)sysfs_val;
+
+	usbi_dbg(ctx, "bus=%u dev=%u", *busnum, *devaddr);
+
+	return LIBUSB_SUCCESS;
+}
+
 static int sysfs_scan_device(struct libusb_context *ctx, const char *devname)
 {
 	uint8_t busnum, devaddr;
-	int ret;
+	int sysfs_fd, ret;
 
-	ret = linux_get_device_address(ctx, 0, &busnum, &devaddr, NULL, devname, -1);
-	if (ret != LIBUSB_SUCCESS)
-		return ret;
+	usbi_dbg(ctx, "scan %s", devname);
 
-	return linux_enumerate_device(ctx, busnum, devaddr, devname);
+	sysfs_fd = open_sysfs_dir(ctx, devname);
+	if (sysfs_fd < 0)
+		return sysfs_fd;
+
+	ret = sysfs_get_device_address(ctx, sysfs_fd, &busnum, &devaddr);
+	if (ret == LIBUSB_SUCCESS)
+		ret = enumerate_device(ctx, busnum, devaddr, devname, sysfs_fd);
+
+	close(sysfs_fd);
+	return ret;
 }
 
 /* read the bConfigurationValue for a device */
@@ -589,7 +783,7 @@ int linux_get_device_address(struct libusb_context *ctx, int detached,
 	uint8_t *busnum, uint8_t *devaddr, const char *dev_node,
 	const char *sys_name, int fd)
 {
-	int sysfs_val;
+	int sysfs_fd;
 	int r;
 
 	usbi_dbg(ctx, "getting address for device: %s detached: %d", sys_name, detached);
@@ -623,19 +817,14 @@ int linux_get_device_address(struct libusb_context *ctx, int detached,
 
 	usbi_dbg(ctx, "scan %s", sys_name);
 
-	r = read_sysfs_attr(ctx, sys_name, "busnum", UINT8_MAX, &sysfs_val);
-	if (r < 0)
-		return r;
-	*busnum = (uint8_t)sysfs_val;
-
-	r = read_sysfs_attr(ctx, sys_name, "devnum", UINT8_MAX, &sysfs_val);
-	if (r < 0)
-		return r;
-	*devaddr = (uint8_t)sysfs_val;
+	sysfs_fd = open_sysfs_dir(ctx, sys_name);
+	if (sysfs_fd < 0)
+		return sysfs_fd;
 
-	usbi_dbg(ctx, "bus=%u dev=%u", *busnum, *devaddr);
+	r = sysfs_get_device_address(ctx, sysfs_fd, busnum, devaddr);
+	close(sysfs_fd);
 
-	return LIBUSB_SUCCESS;
+	return r;
 }
 
 /* Return offset of the next config descriptor */
@@ -840,6 +1029,63 @@ static int op_get_config_descriptor(struct libusb_device *dev,
 	return len;
 }
 
+/* The kernel reads the manufacturer, product and serial number strings when
+ * the device is enumerated and exposes them in sysfs as UTF-8 */
+static int op_get_device_string(struct libusb_device *dev,
+	uint8_t desc_index, unsigned char *data, int length)
+{
+	struct linux_device_priv *priv = usbi_get_device_priv(dev);
+	char filename[256], buf[256];
+	const char *attr;
+	ssize_t r;
+	int fd, si, di;
+
+	if (!priv->sysfs_dir)
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+
+	if (desc_index == dev->device_descriptor.iManufacturer)
+		attr = "manufacturer";
+	else if (desc_index == dev->device_descriptor.iProduct)
+		attr = "product";
+	else if (desc_index == dev->device_descriptor.iSerialNumber)
+		attr = "serial";
+	else
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+
+	/* the attribute is missing if the kernel could not read the string,
+	 * which is not an error here */
+	snprintf(filename, sizeof(filename), SYSFS_DEVICE_PATH "/%s/%s", priv->sysfs_dir, attr);
+	fd = open(filename, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+
+	r = read(fd, buf, sizeof(buf));
+	close(fd);
+	if (r <= 0)
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+
+	if (buf[r - 1] == '\n')
+		r--;
+
+	di = 0;
+	for (si = 0; si < r && di < length; si++) {
+		unsigned char c = (unsigned char)buf[si];
+
+		if (c < 0x80) {
+			data[di++] = c;
+		} else if (c >= 0xc0) {
+			/* non-ASCII, continuation bytes are skipped. characters
+			 * outside the BMP are a surrogate pair in the string
+			 * descriptor, which gives two '?' there */
+			data[di++] = '?';
+			if (c >= 0xf0 && di < length)
+				data[di++] = '?';
+		}
+	}
+
+	return di;
+}
+
 /* send a control message to retrieve active configuration */
 static int usbfs_get_active_config(struct libusb_device *dev, int fd)
 {
@@ -907,12 +1153,94 @@ static enum libusb_speed usbfs_get_speed(struct libusb_context *ctx, int fd)
 	return LIBUSB_SPEED_UNKNOWN;
 }
 
+static void device_cache_free(struct linux_cached_device *cdev)
+{
+	list_del(&cdev->list);
+	usbi_desc_store_put(cdev->descriptors);
+	free(cdev);
+}
+
+static void device_cache_clear(void)
+{
+	struct linux_cached_device *cdev, *tmp;
+
+	usbi_mutex_static_lock(&linux_device_cache_lock);
+	list_for_each_entry_safe(cdev, tmp, &linux_device_cache, list, struct linux_cached_device)
+		device_cache_free(cdev);
+	usbi_mutex_static_unlock(&linux_device_cache_lock);
+}
+
+static void device_cache_remove(unsigned long session_id)
+{
+	struct linux_cached_device *cdev, *tmp;
+
+	usbi_mutex_static_lock(&linux_device_cache_lock);
+	list_for_each_entry_safe(cdev, tmp, &linux_device_cache, list, struct linux_cached_device) {
+		if (cdev->session_id == session_id)
+			device_cache_free(cdev);
+	}
+	usbi_mutex_static_unlock(&linux_device_cache_lock);
+}
+
+/* fill in the speed and descriptors of dev from the cache. returns 1 if they
+ * were found, 0 otherwise */
+static int device_cache_lookup(struct libusb_device *dev, ino_t sysfs_ino)
+{
+	struct linux_device_priv *priv = usbi_get_device_priv(dev);
+	struct linux_cached_device *cdev;
+	int found = 0;
+
+	usbi_mutex_static_lock(&linux_device_cache_lock);
+	for_each_helper(cdev, &linux_device_cache, struct linux_cached_device) {
+		if (cdev->session_id != dev->session_data)
+			continue;
+
+		if (cdev->sysfs_ino == sysfs_ino) {
+			priv->descriptors = usbi_desc_store_ref(cdev->descriptors);
+			priv->descriptors_len = cdev->descriptors_len;
+			dev->speed = cdev->speed;
+			found = 1;
+		} else {
+			/* the device has been replaced */
+			device_cache_free(cdev);
+		}
+		break;
+	}
+	usbi_mutex_static_unlock(&linux_device_cache_lock);
+
+	return found;
+}
+
+static void device_cache_store(struct libusb_device *dev, ino_t sysfs_ino)
+{
+	struct linux_device_priv *priv = usbi_get_device_priv(dev);
+	struct linux_cached_device *cdev;
+
+	cdev = malloc(sizeof(*cdev));
+	if (!cdev)
+		return;
+
+	cdev->descriptors = usbi_desc_store_ref(priv->descriptors);
+	cdev->descriptors_len = priv->descriptors_len;
+	cdev->session_id = dev->session_data;
+	cdev->sysfs_ino = sysfs_ino;
+	cdev->speed = dev->speed;
+
+	device_cache_remove(cdev->session_id);
+	usbi_mutex_static_lock(&linux_device_cache_lock);
+	list_add(&cdev->list, &linux_device_cache);
+	usbi_mutex_static_unlock(&linux_device_cache_lock);
+}
+
+/* sysfs_fd is the open sysfs directory of the device when sysfs_dir is set */
 static int initialize_device(struct libusb_device *dev, uint8_t busnum,
-	uint8_t devaddr, const char *sysfs_dir, int wrapped_fd)
+	uint8_t devaddr, const char *sysfs_dir, int sysfs_fd, int wrapped_fd)
 {
 	struct linux_device_priv *priv = usbi_get_device_priv(dev);
 	struct libusb_context *ctx = DEVICE_CTX(dev);
-	size_t alloc_len;
+	ino_t sysfs_ino = 0;
+	uint8_t *descriptors = NULL;
+	size_t alloc_len, descriptors_len;
 	int fd, speed, r;
 	ssize_t nb;
 
@@ -920,13 +1248,23 @@ static int initialize_device(struct libusb_device *dev, uint8_t busnum,
 	dev->device_address = devaddr;
 
 	if (sysfs_dir) {
+		struct stat st;
+
 		priv->sysfs_dir = strdup(sysfs_dir);
 		if (!priv->sysfs_dir)
 			return LIBUSB_ERROR_NO_MEM;
 
+		if (fstat(sysfs_fd, &st) == 0) {
+			sysfs_ino = st.st_ino;
+			if (device_cache_lookup(dev, sysfs_ino)) {
+				usbi_dbg(ctx, "using cached descriptors for %s", sysfs_dir);
+				goto parse;
+			}
+		}
+
 		/* Note speed can contain 1.5, in this case read_sysfs_attr()
 		   will stop parsing at the '.' and return 1 */
-		if (read_sysfs_attr(ctx, sysfs_dir, "speed", INT_MAX, &speed) == 0) {
+		if (read_sysfs_attr_at(ctx, sysfs_fd, "speed", INT_MAX, &speed) == 0) {
 			switch (speed) {
 			case     1: dev->speed = LIBUSB_SPEED_LOW; break;
 			case    12: dev->speed = LIBUSB_SPEED_FULL; break;
@@ -943,7 +1281,7 @@ static int initialize_device(struct libusb_device *dev, uint8_t busnum,
 
 	/* cache descriptors in memory */
 	if (sysfs_dir) {
-		fd = open_sysfs_attr(ctx, sysfs_dir, "descriptors");
+		fd = open_sysfs_attr_at(ctx, sysfs_fd, "descriptors");
 	} else if (wrapped_fd < 0) {
 		fd = get_usbfs_fd(dev, O_RDONLY, 0);
 	} else {
@@ -958,18 +1296,21 @@ static int initialize_device(struct libusb_device *dev, uint8_t busnum,
 		return fd;
 
 	alloc_len = 0;
+	descriptors_len = 0;
 	do {
-		const size_t desc_read_length = 256;
+		/* large enough for the descriptors of most devices to be
+		 * read at once */
+		const size_t desc_read_length = 1024;
 		uint8_t *read_ptr;
 
 		alloc_len += desc_read_length;
-		priv->descriptors = usbi_reallocf(priv->descriptors, alloc_len);
-		if (!priv->descriptors) {
+		descriptors = usbi_reallocf(descriptors, alloc_len);
+		if (!descriptors) {
 			if (fd != wrapped_fd)
 				close(fd);
 			return LIBUSB_ERROR_NO_MEM;
 		}
-		read_ptr = (uint8_t *)priv->descriptors + priv->descriptors_len;
+		read_ptr = descriptors + descriptors_len;
 		/* usbfs has holes in the file */
 		if (!sysfs_dir)
 			memset(read_ptr, 0, desc_read_length);
@@ -978,19 +1319,32 @@ static int initialize_device(struct libusb_device *dev, uint8_t busnum,
 			usbi_err(ctx, "read descriptor failed, errno=%d", errno);
 			if (fd != wrapped_fd)
 				close(fd);
+			free(descriptors);
 			return LIBUSB_ERROR_IO;
 		}
-		priv->descriptors_len += (size_t)nb;
-	} while (priv->descriptors_len == alloc_len);
+		descriptors_len += (size_t)nb;
+	} while (descriptors_len == alloc_len);
 
 	if (fd != wrapped_fd)
 		close(fd);
 
-	if (priv->descriptors_len < LIBUSB_DT_DEVICE_SIZE) {
-		usbi_err(ctx, "short descriptor read (%zu)", priv->descriptors_len);
+	if (descriptors_len < LIBUSB_DT_DEVICE_SIZE) {
+		usbi_err(ctx, "short descriptor read (%zu)", descriptors_len);
+		free(descriptors);
 		return LIBUSB_ERROR_IO;
 	}
 
+	/* identical devices share their descriptors */
+	priv->descriptors = usbi_desc_store_get(descriptors, descriptors_len);
+	free(descriptors);
+	if (!priv->descriptors)
+		return LIBUSB_ERROR_NO_MEM;
+	priv->descriptors_len = descriptors_len;
+
+	if (sysfs_ino)
+		device_cache_store(dev, sysfs_ino);
+
+parse:
 	r = parse_config_descriptors(dev);
 	if (r < 0)
 		return r;
@@ -1097,80 +1451,511 @@ retry:
 	return LIBUSB_SUCCESS;
 }
 
+/* sysfs_fd is the open sysfs directory of the device, or -1 to have it
+ * opened here if the device needs to be initialized */
+static int enumerate_device(struct libusb_context *ctx,
+	uint8_t busnum, uint8_t devaddr, const char *sysfs_dir, int sysfs_fd)
+{
+	unsigned long session_id;
+	struct libusb_device *dev;
+	int own_fd = -1;
+	int r;
+
+	/* FIXME: session ID is not guaranteed unique as addresses can wrap and
+	 * will be reused. instead we should add a simple sysfs attribute with
+	 * a session ID. */
+	session_id = busnum << 8 | devaddr;
+	usbi_dbg(ctx, "busnum %u devaddr %u session_id %lu", busnum, devaddr, session_id);
+
+	dev = usbi_get_device_by_session_id(ctx, session_id);
+	if (dev) {
+		/* device already exists in the context */
+		usbi_dbg(ctx, "session_id %lu already exists", session_id);
+		libusb_unref_device(dev);
+		return LIBUSB_SUCCESS;
+	}
+
+	usbi_dbg(ctx, "allocating new device for %u/%u (session %lu)",
+		 busnum, devaddr, session_id);
+	dev = usbi_alloc_device(ctx, session_id);
+	if (!dev)
+		return LIBUSB_ERROR_NO_MEM;
+
+	if (sysfs_dir && sysfs_fd < 0) {
+		r = own_fd = sysfs_fd = open_sysfs_dir(ctx, sysfs_dir);
+		if (r < 0)
+			goto out;
+	}
+
+	r = initialize_device(dev, busnum, devaddr, sysfs_dir, sysfs_fd, -1);
+	if (own_fd >= 0)
+		close(own_fd);
+	if (r < 0)
+		goto out;
+	r = usbi_sanitize_device(dev);
+	if (r < 0)
+		goto out;
+
+	r = linux_get_parent_info(dev, sysfs_dir);
+	if (r < 0)
+		goto out;
+out:
+	if (r < 0)
+		libusb_unref_device(dev);
+	else
+		usbi_connect_device(dev);
+
+	return r;
+}
+
 int linux_enumerate_device(struct libusb_context *ctx,
 	uint8_t busnum, uint8_t devaddr, const char *sysfs_dir)
+{
+	return enumerate_device(ctx, busnum, devaddr, sysfs_dir, -1);
+}
+
+struct linux_scan_job {
+	struct libusb_context *ctx;
+	struct linux_scan_entry *entries;
+	size_t num_entries;
+	usbi_atomic_t next;
+};
+
+/* the part of enumerate_device() that can run in parallel: read the device
+ * from sysfs, but leave adding it to the context to the caller */
+static void scan_entry_initialize(struct libusb_context *ctx,
+	struct linux_scan_entry *entry)
 {
 	unsigned long session_id;
 	struct libusb_device *dev;
+	int sysfs_fd, r;
+
+	sysfs_fd = open_sysfs_dir(ctx, entry->sysfs_dir);
+	if (sysfs_fd < 0) {
+		entry->r = sysfs_fd;
+		return;
+	}
+
+	if (!entry->have_address) {
+		r = sysfs_get_device_address(ctx, sysfs_fd, &entry->busnum, &entry->devaddr);
+		if (r < 0)
+			goto out;
+	}
+
+	session_id = entry->busnum << 8 | entry->devaddr;
+	dev = usbi_get_device_by_session_id(ctx, session_id);
+	if (dev) {
+		/* device already exists in the context */
+		libusb_unref_device(dev);
+		r = LIBUSB_SUCCESS;
+		goto out;
+	}
+
+	dev = usbi_alloc_device(ctx, session_id);
+	if (!dev) {
+		r = LIBUSB_ERROR_NO_MEM;
+		goto out;
+	}
+
+	r = initialize_device(dev, entry->busnum, entry->devaddr, entry->sysfs_dir, sysfs_fd, -1);
+	if (r == LIBUSB_SUCCESS)
+		r = usbi_sanitize_device(dev);
+	if (r < 0)
+		libusb_unref_device(dev);
+	else
+		entry->dev = dev;
+
+out:
+	close(sysfs_fd);
+	entry->r = r;
+}
+
+static void *linux_scan_thread_main(void *arg)
+{
+	struct linux_scan_job *job = arg;
+	size_t i;
+
+	while ((i = (size_t)usbi_atomic_inc(&job->next) - 1) < job->num_entries)
+		scan_entry_initialize(job->ctx, &job->entries[i]);
+
+	return NULL;
+}
+
+static void *linux_scan_worker_main(void *arg)
+{
+	struct linux_scan_job *job = arg;
+
+	usbi_thread_started(job->ctx, LIBUSB_THREAD_ENUMERATION, "libusb_enum");
+	return linux_scan_thread_main(job);
+}
+
+/* root hubs first, then by increasing length of the sysfs name. as the name
+ * of a hub is a prefix of the names of the devices behind it, this orders
+ * every parent before its children */
+static int compare_scan_entries(const void *a, const void *b)
+{
+	const struct linux_scan_entry *ea = a, *eb = b;
+	int ra = !strncmp(ea->sysfs_dir, "usb", 3);
+	int rb = !strncmp(eb->sysfs_dir, "usb", 3);
+	size_t la, lb;
+
+	if (ra != rb)
+		return rb - ra;
+
+	la = strlen(ea->sysfs_dir);
+	lb = strlen(eb->sysfs_dir);
+	return (la > lb) - (la < lb);
+}
+
+/* Enumerate the devices found by a scan. The devices are read from sysfs on
+ * up to ctx->enumeration_threads threads, then added to the context one at
+ * a time, parents first. Returns the number of devices that were
+ * enumerated. */
+int linux_enumerate_devices(struct libusb_context *ctx,
+	struct linux_scan_entry *entries, size_t num_entries)
+{
+	pthread_t threads[USBI_MAX_ENUMERATION_THREADS - 1];
+	struct linux_scan_job job;
+	unsigned int i, num_threads = 0;
+	int num_enumerated = 0;
+	size_t n;
+
+	job.ctx = ctx;
+	job.entries = entries;
+	job.num_entries = num_entries;
+	usbi_atomic_store(&job.next, 0);
+
+	for (n = 0; n < num_entries; n++) {
+		entries[n].dev = NULL;
+		entries[n].r = LIBUSB_SUCCESS;
+	}
+
+	/* the calling thread is one of the workers */
+	while ((int)num_threads + 1 < ctx->enumeration_threads && num_threads + 1 < num_entries) {
+		if (pthread_create(&threads[num_threads], NULL, linux_scan_worker_main, &job)) {
+			usbi_warn(ctx, "failed to create enumeration thread, going on with %u",
+				  num_threads + 1);
+			break;
+		}
+		num_threads++;
+	}
+
+	usbi_dbg(ctx, "enumerating %zu devices on %u threads", num_entries, num_threads + 1);
+
+	linux_scan_thread_main(&job);
+	for (i = 0; i < num_threads; i++)
+		pthread_join(threads[i], NULL);
+
+	qsort(entries, num_entries, sizeof(*entries), compare_scan_entries);
+
+	for (n = 0; n < num_entries; n++) {
+		struct linux_scan_entry *entry = &entries[n];
+		struct libusb_device *dev = entry->dev;
+		int r = entry->r;
+
+		if (!r && dev) {
+			struct libusb_device *other;
+
+			/* the device may have been enumerated as the parent of
+			 * another one whose own parent could not be read */
+			other = usbi_get_device_by_session_id(ctx, dev->session_data);
+			if (other) {
+				libusb_unref_device(other);
+				libusb_unref_device(dev);
+			} else {
+				r = linux_get_parent_info(dev, entry->sysfs_dir);
+				if (r < 0)
+					libusb_unref_device(dev);
+				else
+					usbi_connect_device(dev);
+			}
+		}
+
+		if (r < 0) {
+			usbi_dbg(ctx, "failed to enumerate %s", entry->sysfs_dir);
+			continue;
+		}
+
+		num_enumerated++;
+	}
+
+	return num_enumerated;
+}
+
+static void disconnect_device(struct libusb_context *ctx, uint8_t busnum,
+	uint8_t devaddr)
+{
+	struct libusb_device *dev;
+	unsigned long session_id = busnum << 8 | devaddr;
+
+	dev = usbi_get_device_by_session_id(ctx, session_id);
+	if (dev) {
+		usbi_disconnect_device(dev);
+		libusb_unref_device(dev);
+	} else {
+		usbi_dbg(ctx, "device not found for session %lx", session_id);
+	}
+}
+
+static int hotplug_subscribe(struct libusb_context *ctx)
+{
+	struct linux_context_priv *cpriv = usbi_get_context_priv(ctx);
 	int r;
 
-	/* FIXME: session ID is not guaranteed unique as addresses can wrap and
-	 * will be reused. instead we should add a simple sysfs attribute with
-	 * a session ID. */
-	session_id = busnum << 8 | devaddr;
-	usbi_dbg(ctx, "busnum %u devaddr %u session_id %lu", busnum, devaddr, session_id);
+	r = usbi_create_event(&cpriv->hotplug_event);
+	if (r)
+		return r;
+
+	r = usbi_add_event_source(ctx, USBI_EVENT_OS_HANDLE(&cpriv->hotplug_event),
+		USBI_EVENT_POLL_EVENTS);
+	if (r) {
+		usbi_destroy_event(&cpriv->hotplug_event);
+		return r;
+	}
+
+	cpriv->ctx = ctx;
+	usbi_mutex_init(&cpriv->hotplug_lock);
+
+	usbi_mutex_static_lock(&linux_hotplug_lock);
+	list_add_tail(&cpriv->hotplug_list, &linux_hotplug_subscribers);
+	usbi_mutex_static_unlock(&linux_hotplug_lock);
+
+	return LIBUSB_SUCCESS;
+}
+
+static void hotplug_unsubscribe(struct libusb_context *ctx)
+{
+	struct linux_context_priv *cpriv = usbi_get_context_priv(ctx);
+	struct linux_hotplug_batch *batch, *next;
+
+	usbi_mutex_static_lock(&linux_hotplug_lock);
+	list_del(&cpriv->hotplug_list);
+	usbi_mutex_static_unlock(&linux_hotplug_lock);
+
+	/* nothing is published to the context anymore */
+	batch = usbi_atomic_ptr_exchange(&cpriv->hotplug_batches, NULL);
+	for (; batch; batch = next) {
+		next = batch->next;
+		free(batch);
+	}
+
+	usbi_remove_event_source(ctx, USBI_EVENT_OS_HANDLE(&cpriv->hotplug_event));
+	usbi_destroy_event(&cpriv->hotplug_event);
+	usbi_mutex_destroy(&cpriv->hotplug_lock);
+}
+
+/* Apply the hotplug events published to a context, oldest first. The
+ * messages they generate reach the application with a single wakeup. */
+static void hotplug_drain(struct libusb_context *ctx)
+{
+	struct linux_context_priv *cpriv = usbi_get_context_priv(ctx);
+	struct linux_hotplug_batch *batch, *next, *oldest = NULL;
+	size_t i;
+
+	usbi_mutex_lock(&cpriv->hotplug_lock);
+
+	/* every signal is cleared exactly once, and a batch published after
+	 * the flag is reset signals the event again */
+	if (usbi_atomic_load(&cpriv->hotplug_signaled)) {
+		usbi_clear_event(&cpriv->hotplug_event);
+		usbi_atomic_store(&cpriv->hotplug_signaled, 0);
+	}
+
+	batch = usbi_atomic_ptr_exchange(&cpriv->hotplug_batches, NULL);
+	for (; batch; batch = next) {
+		next = batch->next;
+		batch->next = oldest;
+		oldest = batch;
+	}
+
+	if (oldest)
+		usbi_hotplug_batch_begin(ctx);
+
+	for (batch = oldest; batch; batch = next) {
+		for (i = 0; i < batch->num_events; i++) {
+			struct linux_hotplug_uevent *event = &batch->events[i];
+
+			if (event->detached)
+				disconnect_device(ctx, event->busnum, event->devaddr);
+			else
+				linux_enumerate_device(ctx, event->busnum, event->devaddr,
+					event->sys_name[0] ? event->sys_name : NULL);
+		}
+
+		next = batch->next;
+		free(batch);
+	}
+
+	if (oldest)
+		usbi_hotplug_batch_end(ctx);
+
+	usbi_mutex_unlock(&cpriv->hotplug_lock);
+}
+
+/* add an event read from the monitor to the pending ones.
+ * must be called with linux_hotplug_lock held. */
+static void hotplug_queue(uint8_t busnum, uint8_t devaddr, const char *sys_name,
+	int detached)
+{
+	struct linux_hotplug_uevent *event;
+
+	if (sys_name && strlen(sys_name) >= LINUX_SYS_NAME_MAX) {
+		usbi_err(NULL, "ignoring hotplug event for %s, name too long", sys_name);
+		return;
+	}
+
+	if (linux_hotplug_num_pending == linux_hotplug_max_pending) {
+		size_t max_pending = linux_hotplug_max_pending ? 2 * linux_hotplug_max_pending : 16;
+
+		event = realloc(linux_hotplug_pending, max_pending * sizeof(*event));
+		if (!event) {
+			usbi_err(NULL, "failed to queue hotplug event");
+			return;
+		}
+		linux_hotplug_pending = event;
+		linux_hotplug_max_pending = max_pending;
+	}
+
+	event = &linux_hotplug_pending[linux_hotplug_num_pending++];
+	event->busnum = busnum;
+	event->devaddr = devaddr;
+	event->detached = (uint8_t)detached;
+	if (sys_name)
+		strcpy(event->sys_name, sys_name);
+	else
+		event->sys_name[0] = '\0';
+}
+
+/* Hand the pending events to every subscribed context, as one batch each.
+ * The batches are pushed without taking a lock of the contexts, which apply
+ * them on their own, so contexts do not wait for each other. Only the batch
+ * that finds the context idle wakes it up.
+ * must be called with linux_hotplug_lock held. */
+void linux_hotplug_publish(void)
+{
+	struct linux_context_priv *cpriv;
+	size_t size;
+
+	if (!linux_hotplug_num_pending)
+		return;
+
+	size = sizeof(struct linux_hotplug_batch) +
+		linux_hotplug_num_pending * sizeof(struct linux_hotplug_uevent);
+
+	list_for_each_entry(cpriv, &linux_hotplug_subscribers, hotplug_list, struct linux_context_priv) {
+		struct linux_hotplug_batch *batch, *head;
+
+		batch = malloc(size);
+		if (!batch) {
+			usbi_err(cpriv->ctx, "failed to allocate hotplug events");
+			continue;
+		}
+		batch->num_events = linux_hotplug_num_pending;
+		memcpy(batch->events, linux_hotplug_pending,
+			linux_hotplug_num_pending * sizeof(struct linux_hotplug_uevent));
+
+		do {
+			head = usbi_atomic_ptr_load(&cpriv->hotplug_batches);
+			batch->next = head;
+		} while (!usbi_atomic_ptr_cas(&cpriv->hotplug_batches, head, batch));
+
+		if (usbi_atomic_cas(&cpriv->hotplug_signaled, 0, 1))
+			usbi_signal_event(&cpriv->hotplug_event);
+	}
+
+	linux_hotplug_num_pending = 0;
+}
+
+/* The largest hotplug batch window asked for by the subscribed contexts, in
+ * milliseconds. must be called with linux_hotplug_lock held. */
+static int hotplug_batch_window(void)
+{
+	struct linux_context_priv *cpriv;
+	int window = 0;
+
+	list_for_each_entry(cpriv, &linux_hotplug_subscribers, hotplug_list, struct linux_context_priv)
+		window = MAX(window, (int)usbi_atomic_load(&cpriv->ctx->hotplug_batch_window));
+
+	return window;
+}
+
+/* Handle a burst of events for a hotplug monitor thread, once fds[1], its
+ * monitor socket, is readable. read_event() handles a single event, with
+ * linux_hotplug_lock held. Events keep being handled for as long as they
+ * arrive within the hotplug batch window, and are published to the
+ * contexts together. Returns nonzero if fds[0], the control event, fired
+ * meanwhile. */
+int linux_hotplug_read_batch(struct pollfd *fds, void (*read_event)(void))
+{
+	struct timespec start, now, elapsed;
+	int window, timeout, r, stop = 0;
+
+	usbi_get_monotonic_time(&start);
 
-	dev = usbi_get_device_by_session_id(ctx, session_id);
-	if (dev) {
-		/* device already exists in the context */
-		usbi_dbg(ctx, "session_id %lu already exists", session_id);
-		libusb_unref_device(dev);
-		return LIBUSB_SUCCESS;
-	}
+	usbi_mutex_static_lock(&linux_hotplug_lock);
+	window = hotplug_batch_window();
+	usbi_mutex_static_unlock(&linux_hotplug_lock);
 
-	usbi_dbg(ctx, "allocating new device for %u/%u (session %lu)",
-		 busnum, devaddr, session_id);
-	dev = usbi_alloc_device(ctx, session_id);
-	if (!dev)
-		return LIBUSB_ERROR_NO_MEM;
+	do {
+		usbi_mutex_static_lock(&linux_hotplug_lock);
+		read_event();
+		usbi_mutex_static_unlock(&linux_hotplug_lock);
 
-	r = initialize_device(dev, busnum, devaddr, sysfs_dir, -1);
-	if (r < 0)
-		goto out;
-	r = usbi_sanitize_device(dev);
-	if (r < 0)
-		goto out;
+		/* without a window, this still picks up the events which are
+		 * already queued */
+		usbi_get_monotonic_time(&now);
+		TIMESPEC_SUB(&now, &start, &elapsed);
+		timeout = window - (int)(elapsed.tv_sec * 1000 + elapsed.tv_nsec / 1000000);
+		timeout = MAX(timeout, 0);
 
-	r = linux_get_parent_info(dev, sysfs_dir);
-	if (r < 0)
-		goto out;
-out:
-	if (r < 0)
-		libusb_unref_device(dev);
-	else
-		usbi_connect_device(dev);
+		do {
+			r = poll(fds, 2, timeout);
+		} while (r == -1 && errno == EINTR);
 
-	return r;
+		if (r > 0 && fds[0].revents)
+			stop = 1;
+	} while (!stop && r > 0 && fds[1].revents);
+
+	usbi_mutex_static_lock(&linux_hotplug_lock);
+	linux_hotplug_publish();
+	usbi_mutex_static_unlock(&linux_hotplug_lock);
+
+	return stop;
 }
 
+/* called by the monitors for a device that arrived, with linux_hotplug_lock
+ * held */
 void linux_hotplug_enumerate(uint8_t busnum, uint8_t devaddr, const char *sys_name)
 {
-	struct libusb_context *ctx;
+	hotplug_queue(busnum, devaddr, sys_name, 0);
+}
 
-	usbi_mutex_static_lock(&active_contexts_lock);
-	for_each_context(ctx) {
-		linux_enumerate_device(ctx, busnum, devaddr, sys_name);
-	}
-	usbi_mutex_static_unlock(&active_contexts_lock);
+/* called by the monitors for a device that left, with linux_hotplug_lock
+ * held */
+void linux_hotplug_disconnected(uint8_t busnum, uint8_t devaddr)
+{
+	device_cache_remove(busnum << 8 | devaddr);
+	hotplug_queue(busnum, devaddr, NULL, 1);
 }
 
-void linux_device_disconnected(uint8_t busnum, uint8_t devaddr)
+/* Remove a device that left from a context, once the context noticed it
+ * before the monitor reported it. Serialized with the hotplug events of the
+ * context, so that the device is only disconnected once. */
+void linux_device_disconnected(struct libusb_context *ctx, uint8_t busnum,
+	uint8_t devaddr)
 {
-	struct libusb_context *ctx;
-	struct libusb_device *dev;
-	unsigned long session_id = busnum << 8 | devaddr;
+	struct linux_context_priv *cpriv = usbi_get_context_priv(ctx);
 
-	usbi_mutex_static_lock(&active_contexts_lock);
-	for_each_context(ctx) {
-		dev = usbi_get_device_by_session_id(ctx, session_id);
-		if (dev) {
-			usbi_disconnect_device(dev);
-			libusb_unref_device(dev);
-		} else {
-			usbi_dbg(ctx, "device not found for session %lx", session_id);
-		}
+	device_cache_remove(busnum << 8 | devaddr);
+
+	if (cpriv->no_device_discovery) {
+		disconnect_device(ctx, busnum, devaddr);
+		return;
 	}
-	usbi_mutex_static_unlock(&active_contexts_lock);
+
+	usbi_mutex_lock(&cpriv->hotplug_lock);
+	disconnect_device(ctx, busnum, devaddr);
+	usbi_mutex_unlock(&cpriv->hotplug_lock);
 }
 
 #if !defined(HAVE_LIBUDEV)
@@ -1282,8 +2067,11 @@ static int sysfs_get_device_list(struct libusb_context *ctx)
 {
 	DIR *devices = opendir(SYSFS_DEVICE_PATH);
 	struct dirent *entry;
+	struct linux_scan_entry *entries = NULL;
+	size_t num_entries = 0, max_entries = 0;
 	int num_devices = 0;
 	int num_enumerated = 0;
+	int r = LIBUSB_SUCCESS;
 
 	if (!devices) {
 		usbi_err(ctx, "opendir devices failed, errno=%d", errno);
@@ -1297,6 +2085,29 @@ static int sysfs_get_device_list(struct libusb_context *ctx)
 
 		num_devices++;
 
+		if (ctx->enumeration_threads > 1) {
+			/* collect the devices, they are enumerated below */
+			if (num_entries == max_entries) {
+				struct linux_scan_entry *new_entries;
+
+				max_entries = max_entries ? 2 * max_entries : 64;
+				new_entries = realloc(entries, max_entries * sizeof(*entries));
+				if (!new_entries) {
+					r = LIBUSB_ERROR_NO_MEM;
+					break;
+				}
+				entries = new_entries;
+			}
+			entries[num_entries].sysfs_dir = strdup(entry->d_name);
+			if (!entries[num_entries].sysfs_dir) {
+				r = LIBUSB_ERROR_NO_MEM;
+				break;
+			}
+			entries[num_entries].have_address = 0;
+			num_entries++;
+			continue;
+		}
+
 		if (sysfs_scan_device(ctx, entry->d_name)) {
 			usbi_dbg(ctx, "failed to enumerate dir entry %s", entry->d_name);
 			continue;
@@ -1307,6 +2118,16 @@ static int sysfs_get_device_list(struct libusb_context *ctx)
 
 	closedir(devices);
 
+	if (r == LIBUSB_SUCCESS && num_entries)
+		num_enumerated = linux_enumerate_devices(ctx, entries, num_entries);
+
+	while (num_entries)
+		free(entries[--num_entries].sysfs_dir);
+	free(entries);
+
+	if (r < 0)
+		return r;
+
 	/* successful if at least one device was enumerated or no devices were found */
 	if (num_enumerated || !num_devices)
 		return LIBUSB_SUCCESS;
@@ -1331,20 +2152,41 @@ static int linux_default_scan_devices(struct libusb_context *ctx)
 static int initialize_handle(struct libusb_device_handle *handle, int fd)
 {
 	struct linux_device_handle_priv *hpriv = usbi_get_device_handle_priv(handle);
+	struct linux_device_priv *priv = usbi_get_device_priv(handle->dev);
+	unsigned long caps;
 	int r;
 
 	hpriv->fd = fd;
 
-	r = ioctl(fd, IOCTL_USBFS_GET_CAPABILITIES, &hpriv->caps);
-	if (r < 0) {
-		if (errno == ENOTTY)
+	/* the capabilities depend on the kernel and the host controller, so
+	 * they are only asked for on the first open of a device */
+	caps = (unsigned long)usbi_atomic_load(&priv->usbfs_caps);
+	if (caps & USBFS_CAPS_KNOWN) {
+		hpriv->caps = (uint32_t)(caps & ~USBFS_CAPS_KNOWN);
+	} else {
+		r = ioctl(fd, IOCTL_USBFS_GET_CAPABILITIES, &hpriv->caps);
+		if (r == 0) {
+			caps = hpriv->caps | USBFS_CAPS_KNOWN;
+		} else if (errno == ENOTTY) {
 			usbi_dbg(HANDLE_CTX(handle), "getcap not available");
-		else
+			hpriv->caps = USBFS_CAP_BULK_CONTINUATION;
+			caps = hpriv->caps | USBFS_CAPS_KNOWN;
+		} else {
+			/* ask again on the next open */
 			usbi_err(HANDLE_CTX(handle), "getcap failed, errno=%d", errno);
-		hpriv->caps = USBFS_CAP_BULK_CONTINUATION;
+			hpriv->caps = USBFS_CAP_BULK_CONTINUATION;
+			caps = 0;
+		}
+		if (caps)
+			usbi_atomic_store(&priv->usbfs_caps, (long)caps);
 	}
 
-	return usbi_add_event_source(HANDLE_CTX(handle), hpriv->fd, POLLOUT);
+	usbi_mutex_init(&hpriv->reap_lock);
+	r = usbi_add_event_source(HANDLE_CTX(handle), hpriv->fd, POLLOUT);
+	if (r < 0)
+		usbi_mutex_destroy(&hpriv->reap_lock);
+
+	return r;
 }
 
 static int op_wrap_sys_device(struct libusb_context *ctx,
@@ -1377,7 +2219,7 @@ static int op_wrap_sys_device(struct libusb_context *ctx,
 	if (!dev)
 		return LIBUSB_ERROR_NO_MEM;
 
-	r = initialize_device(dev, busnum, devaddr, NULL, fd);
+	r = initialize_device(dev, busnum, devaddr, NULL, -1, fd);
 	if (r < 0)
 		goto out;
 	r = usbi_sanitize_device(dev);
@@ -1404,15 +2246,14 @@ static int op_open(struct libusb_device_handle *handle)
 	fd = get_usbfs_fd(handle->dev, O_RDWR, 0);
 	if (fd < 0) {
 		if (fd == LIBUSB_ERROR_NO_DEVICE) {
-			/* device will still be marked as attached if hotplug monitor thread
-			 * hasn't processed remove event yet */
-			usbi_mutex_static_lock(&linux_hotplug_lock);
+			/* device will still be marked as attached if the context
+			 * hasn't processed the remove event yet */
 			if (usbi_atomic_load(&handle->dev->attached)) {
 				usbi_dbg(HANDLE_CTX(handle), "open failed with no device, but device still attached");
-				linux_device_disconnected(handle->dev->bus_number,
+				linux_device_disconnected(HANDLE_CTX(handle),
+							  handle->dev->bus_number,
 							  handle->dev->device_address);
 			}
-			usbi_mutex_static_unlock(&linux_hotplug_lock);
 		}
 		return fd;
 	}
@@ -1431,6 +2272,13 @@ static void op_close(struct libusb_device_handle *dev_handle)
 	/* fd may have already been removed by POLLERR condition in op_handle_events() */
 	if (!hpriv->fd_removed)
 		usbi_remove_event_source(HANDLE_CTX(dev_handle), hpriv->fd);
+
+	/* the handle is off the open devices list, so an event handler that has
+	 * not taken it by now will not find it any more */
+	usbi_mutex_lock(&hpriv->reap_lock);
+	usbi_mutex_unlock(&hpriv->reap_lock);
+	usbi_mutex_destroy(&hpriv->reap_lock);
+
 	if (!hpriv->fd_keep)
 		close(hpriv->fd);
 }
@@ -1701,6 +2549,155 @@ static int op_dev_mem_free(struct libusb_device_handle *handle, void *buffer,
 	}
 }
 
+/* Find the NUMA node of the host controller a device is attached to. USB
+ * devices have no numa_node attribute, so walk up the sysfs device path to
+ * the first ancestor that has one, normally the controller's PCI function.
+ * Returns -1 if the node is unknown. */
+static int get_device_numa_node(struct libusb_device *dev)
+{
+	struct linux_device_priv *priv = usbi_get_device_priv(dev);
+	char path[PATH_MAX + sizeof("/numa_node")], real_path[PATH_MAX];
+	char buf[16], *slash;
+	ssize_t r;
+	int fd;
+
+	if (!priv->sysfs_dir)
+		return -1;
+
+	snprintf(path, sizeof(path), SYSFS_DEVICE_PATH "/%s", priv->sysfs_dir);
+	if (!realpath(path, real_path))
+		return -1;
+
+	while ((slash = strrchr(real_path, '/')) != NULL && slash != real_path) {
+		*slash = '\0';
+		snprintf(path, sizeof(path), "%s/numa_node", real_path);
+		fd = open(path, O_RDONLY | O_CLOEXEC);
+		if (fd < 0)
+			continue;
+
+		r = read(fd, buf, sizeof(buf) - 1);
+		close(fd);
+		if (r <= 0)
+			return -1;
+		buf[r] = '\0';
+		return atoi(buf);
+	}
+
+	return -1;
+}
+
+/* the default huge page size, or 0 if the kernel has no huge pages */
+static size_t get_huge_page_size(void)
+{
+	char line[64];
+	unsigned long kb;
+	size_t size = 0;
+	FILE *f;
+
+	f = fopen("/proc/meminfo", "re");
+	if (!f)
+		return 0;
+
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, "Hugepagesize: %lu kB", &kb) == 1) {
+			size = (size_t)kb * 1024;
+			break;
+		}
+	}
+
+	fclose(f);
+	return size;
+}
+
+static size_t host_mem_length(size_t len, uint32_t flags)
+{
+	size_t huge_page_size;
+
+	if (!(flags & LIBUSB_DEV_MEM_POOL_HUGE_PAGES))
+		return len;
+
+	huge_page_size = get_huge_page_size();
+	if (!huge_page_size || len > SIZE_MAX - huge_page_size)
+		return len;
+
+	return (len + huge_page_size - 1) / huge_page_size * huge_page_size;
+}
+
+#define LINUX_MPOL_PREFERRED	1
+#define LINUX_MAX_NUMA_NODES	1024
+
+/* express a preference for the pages of a mapping to come from a given node,
+ * before any of them is touched */
+static void bind_host_mem(struct libusb_context *ctx, void *buffer, size_t len,
+	int node)
+{
+#ifdef SYS_mbind
+	unsigned long nodemask[LINUX_MAX_NUMA_NODES / (8 * sizeof(unsigned long))];
+
+	if (node < 0 || node >= LINUX_MAX_NUMA_NODES)
+		return;
+
+	memset(nodemask, 0, sizeof(nodemask));
+	nodemask[node / (8 * sizeof(unsigned long))] = 1UL << (node % (8 * sizeof(unsigned long)));
+
+	/* the kernel reads one bit less than maxnode */
+	if (syscall(SYS_mbind, buffer, len, LINUX_MPOL_PREFERRED, nodemask,
+		    (unsigned long)LINUX_MAX_NUMA_NODES + 1, 0U) != 0)
+		usbi_dbg(ctx, "mbind to node %d failed, errno=%d", node, errno);
+	else
+		usbi_dbg(ctx, "host memory bound to node %d", node);
+#else
+	UNUSED(ctx);
+	UNUSED(buffer);
+	UNUSED(len);
+	UNUSED(node);
+#endif
+}
+
+static void *op_host_mem_alloc(struct libusb_device_handle *handle, size_t len,
+	uint32_t flags)
+{
+	struct libusb_context *ctx = HANDLE_CTX(handle);
+	void *buffer = MAP_FAILED;
+
+	len = host_mem_length(len, flags);
+
+#ifdef MAP_HUGETLB
+	if (flags & LIBUSB_DEV_MEM_POOL_HUGE_PAGES) {
+		buffer = mmap(NULL, len, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (buffer == MAP_FAILED)
+			usbi_dbg(ctx, "no explicit huge pages, errno=%d", errno);
+	}
+#endif
+
+	if (buffer == MAP_FAILED) {
+		buffer = mmap(NULL, len, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (buffer == MAP_FAILED) {
+			usbi_err(ctx, "alloc host mem failed, errno=%d", errno);
+			return NULL;
+		}
+#ifdef MADV_HUGEPAGE
+		if ((flags & LIBUSB_DEV_MEM_POOL_HUGE_PAGES) &&
+		    madvise(buffer, len, MADV_HUGEPAGE) != 0)
+			usbi_dbg(ctx, "no transparent huge pages, errno=%d", errno);
+#endif
+	}
+
+	if (flags & LIBUSB_DEV_MEM_POOL_NUMA_LOCAL)
+		bind_host_mem(ctx, buffer, len, get_device_numa_node(handle->dev));
+
+	return buffer;
+}
+
+static void op_host_mem_free(struct libusb_device_handle *handle, void *buffer,
+	size_t len, uint32_t flags)
+{
+	if (munmap(buffer, host_mem_length(len, flags)) != 0)
+		usbi_err(HANDLE_CTX(handle), "free host mem failed, errno=%d", errno);
+}
+
 static int op_kernel_driver_active(struct libusb_device_handle *handle,
 	uint8_t interface)
 {
@@ -1853,7 +2850,7 @@ static void op_destroy_device(struct libusb_device *dev)
 	struct linux_device_priv *priv = usbi_get_device_priv(dev);
 
 	free(priv->config_descriptors);
-	free(priv->descriptors);
+	usbi_desc_store_put(priv->descriptors);
 	free(priv->sysfs_dir);
 }
 
@@ -1892,20 +2889,54 @@ static int discard_urbs(struct usbi_transfer *itransfer, int first, int last_plu
 	return ret;
 }
 
+/* Returns zeroed memory for the URBs of a new submission, reusing the
+ * storage of earlier submissions when it is large enough. The storage stays
+ * attached to the transfer until the transfer is destroyed. */
+static void *get_urb_storage(struct linux_transfer_priv *tpriv, size_t size)
+{
+	if (size > tpriv->urb_storage_size) {
+		free(tpriv->urb_storage);
+		tpriv->urb_storage = calloc(1, size);
+		tpriv->urb_storage_size = tpriv->urb_storage ? size : 0;
+	} else {
+		memset(tpriv->urb_storage, 0, size);
+	}
+
+	return tpriv->urb_storage;
+}
+
 static void free_iso_urbs(struct linux_transfer_priv *tpriv)
 {
-	int i;
+	/* the URBs live in the transfer's URB storage */
+	tpriv->iso_urbs = NULL;
+}
+
+/* Submit a single URB, keeping count of the URBs that are outstanding on the
+ * handle so that reaping can stop without an extra ioctl once every URB has
+ * been retired. The count is raised before the ioctl so that it can never be
+ * lower than the real number of outstanding URBs. */
+static int submit_urb(struct linux_device_handle_priv *hpriv,
+	struct usbfs_urb *urb)
+{
+	int r;
 
-	for (i = 0; i < tpriv->num_urbs; i++) {
-		struct usbfs_urb *urb = tpriv->iso_urbs[i];
+	usbi_trace3(urb__submit, USBI_TRANSFER_TO_LIBUSB_TRANSFER((struct usbi_transfer *)urb->usercontext),
+		urb->endpoint, urb->buffer_length);
 
-		if (!urb)
-			break;
-		free(urb);
+	(void)usbi_atomic_inc(&hpriv->urbs_in_flight);
+	if (urb->type == USBFS_URB_TYPE_ISO)
+		(void)usbi_atomic_inc(&hpriv->iso_urbs_in_flight[USBI_ENDPOINT_INDEX(urb->endpoint)]);
+	r = ioctl(hpriv->fd, IOCTL_USBFS_SUBMITURB, urb);
+	if (r < 0) {
+		int err = errno;
+
+		(void)usbi_atomic_dec(&hpriv->urbs_in_flight);
+		if (urb->type == USBFS_URB_TYPE_ISO)
+			(void)usbi_atomic_dec(&hpriv->iso_urbs_in_flight[USBI_ENDPOINT_INDEX(urb->endpoint)]);
+		errno = err;
 	}
 
-	free(tpriv->iso_urbs);
-	tpriv->iso_urbs = NULL;
+	return r;
 }
 
 static int submit_bulk_transfer(struct usbi_transfer *itransfer)
@@ -1917,6 +2948,9 @@ static int submit_bulk_transfer(struct usbi_transfer *itransfer)
 		usbi_get_device_handle_priv(transfer->dev_handle);
 	struct usbfs_urb *urbs;
 	int is_out = IS_XFEROUT(transfer);
+	/* segments are only handed to the backend when no bounce buffer is used */
+	const struct libusb_iovec *iov =
+		itransfer->iov_bounce ? NULL : itransfer->iov;
 	int bulk_buffer_len, use_bulk_continuation;
 	int num_urbs;
 	int last_urb_partial = 0;
@@ -1965,18 +2999,41 @@ static int submit_bulk_transfer(struct usbi_transfer *itransfer)
 		use_bulk_continuation = 0;
 	}
 
-	num_urbs = transfer->length / bulk_buffer_len;
+	if (iov) {
+		/* each segment is split on its own, the core guarantees that
+		 * all but the last are a whole number of packets */
+		num_urbs = 0;
+		for (i = 0; i < itransfer->iovcnt; i++)
+			num_urbs += (iov[i].length + bulk_buffer_len - 1) / bulk_buffer_len;
+	} else {
+		num_urbs = transfer->length / bulk_buffer_len;
 
-	if (transfer->length == 0) {
-		num_urbs = 1;
-	} else if ((transfer->length % bulk_buffer_len) > 0) {
-		last_urb_partial = 1;
-		num_urbs++;
+		if (transfer->length == 0) {
+			num_urbs = 1;
+		} else if ((transfer->length % bulk_buffer_len) > 0) {
+			last_urb_partial = 1;
+			num_urbs++;
+		}
 	}
 	usbi_dbg(TRANSFER_CTX(transfer), "need %d urbs for new transfer with length %d", num_urbs, transfer->length);
-	urbs = calloc(num_urbs, sizeof(*urbs));
+	urbs = get_urb_storage(tpriv, (size_t)num_urbs * sizeof(*urbs));
 	if (!urbs)
 		return LIBUSB_ERROR_NO_MEM;
+
+	if (iov) {
+		struct usbfs_urb *urb = urbs;
+		int seg;
+
+		for (seg = 0; seg < itransfer->iovcnt; seg++) {
+			int offset;
+
+			for (offset = 0; offset < iov[seg].length; offset += bulk_buffer_len) {
+				urb->buffer = iov[seg].buffer + offset;
+				urb->buffer_length = MIN(iov[seg].length - offset, bulk_buffer_len);
+				urb++;
+			}
+		}
+	}
 	tpriv->urbs = urbs;
 	tpriv->num_urbs = num_urbs;
 	tpriv->num_retired = 0;
@@ -2001,18 +3058,22 @@ static int submit_bulk_transfer(struct usbi_transfer *itransfer)
 			break;
 		}
 		urb->endpoint = transfer->endpoint;
-		urb->buffer = transfer->buffer + (i * bulk_buffer_len);
 
 		/* don't set the short not ok flag for the last URB */
 		if (use_bulk_continuation && !is_out && (i < num_urbs - 1))
 			urb->flags = USBFS_URB_SHORT_NOT_OK;
 
-		if (i == num_urbs - 1 && last_urb_partial)
-			urb->buffer_length = transfer->length % bulk_buffer_len;
-		else if (transfer->length == 0)
-			urb->buffer_length = 0;
-		else
-			urb->buffer_length = bulk_buffer_len;
+		if (iov) {
+			/* buffer and length were set from the segments */
+		} else {
+			urb->buffer = transfer->buffer + (i * bulk_buffer_len);
+			if (i == num_urbs - 1 && last_urb_partial)
+				urb->buffer_length = transfer->length % bulk_buffer_len;
+			else if (transfer->length == 0)
+				urb->buffer_length = 0;
+			else
+				urb->buffer_length = bulk_buffer_len;
+		}
 
 		if (i > 0 && use_bulk_continuation)
 			urb->flags |= USBFS_URB_BULK_CONTINUATION;
@@ -2022,7 +3083,7 @@ static int submit_bulk_transfer(struct usbi_transfer *itransfer)
 		    (transfer->flags & LIBUSB_TRANSFER_ADD_ZERO_PACKET))
 			urb->flags |= USBFS_URB_ZERO_PACKET;
 
-		r = ioctl(hpriv->fd, IOCTL_USBFS_SUBMITURB, urb);
+		r = submit_urb(hpriv, urb);
 		if (r == 0)
 			continue;
 
@@ -2039,7 +3100,6 @@ static int submit_bulk_transfer(struct usbi_transfer *itransfer)
 		 * return failure immediately. */
 		if (i == 0) {
 			usbi_dbg(TRANSFER_CTX(transfer), "first URB failed, easy peasy");
-			free(urbs);
 			tpriv->urbs = NULL;
 			return r;
 		}
@@ -2090,11 +3150,15 @@ static int submit_iso_transfer(struct usbi_transfer *itransfer)
 	struct usbfs_urb **urbs;
 	int num_packets = transfer->num_iso_packets;
 	int num_packets_remaining;
+	int uniform = transfer->flags & LIBUSB_TRANSFER_ISO_UNIFORM_PACKETS;
+	int follow = 0;
 	int i, j;
 	int num_urbs;
 	unsigned int packet_len;
 	unsigned int total_len = 0;
 	unsigned char *urb_buffer = transfer->buffer;
+	unsigned char *urb_storage;
+	size_t alloc_size;
 
 	if (num_packets < 1)
 		return LIBUSB_ERROR_INVALID_PARAM;
@@ -2103,8 +3167,9 @@ static int submit_iso_transfer(struct usbi_transfer *itransfer)
 	 * at least three times, but we attempt to detect this limit during
 	 * init and check it here. if the kernel rejects the request due to
 	 * its size, we return an error indicating such to the user.
+	 * with uniform packets only the first length needs checking.
 	 */
-	for (i = 0; i < num_packets; i++) {
+	for (i = 0; i < (uniform ? 1 : num_packets); i++) {
 		packet_len = transfer->iso_packet_desc[i].length;
 
 		if (packet_len > max_iso_packet_len) {
@@ -2116,6 +3181,11 @@ static int submit_iso_transfer(struct usbi_transfer *itransfer)
 
 		total_len += packet_len;
 	}
+	if (uniform) {
+		if ((uint64_t)packet_len * (unsigned int)num_packets > (unsigned int)transfer->length)
+			return LIBUSB_ERROR_INVALID_PARAM;
+		total_len = packet_len * (unsigned int)num_packets;
+	}
 
 	if (transfer->length < (int)total_len)
 		return LIBUSB_ERROR_INVALID_PARAM;
@@ -2125,9 +3195,22 @@ static int submit_iso_transfer(struct usbi_transfer *itransfer)
 
 	usbi_dbg(TRANSFER_CTX(transfer), "need %d urbs for new transfer with length %d", num_urbs, transfer->length);
 
-	urbs = calloc(num_urbs, sizeof(*urbs));
+	/* the pointer array and all the URBs share a single allocation, each
+	 * URB followed by its packet descriptors */
+	alloc_size = PTR_ALIGN((size_t)num_urbs * sizeof(*urbs));
+	num_packets_remaining = num_packets;
+	for (i = 0; i < num_urbs; i++) {
+		int num_packets_in_urb = MIN(num_packets_remaining, MAX_ISO_PACKETS_PER_URB);
+
+		alloc_size += PTR_ALIGN(sizeof(struct usbfs_urb)
+			+ (num_packets_in_urb * sizeof(struct usbfs_iso_packet_desc)));
+		num_packets_remaining -= num_packets_in_urb;
+	}
+
+	urbs = get_urb_storage(tpriv, alloc_size);
 	if (!urbs)
 		return LIBUSB_ERROR_NO_MEM;
+	urb_storage = (unsigned char *)urbs + PTR_ALIGN((size_t)num_urbs * sizeof(*urbs));
 
 	tpriv->iso_urbs = urbs;
 	tpriv->num_urbs = num_urbs;
@@ -2135,34 +3218,51 @@ static int submit_iso_transfer(struct usbi_transfer *itransfer)
 	tpriv->reap_action = NORMAL;
 	tpriv->iso_packet_offset = 0;
 
+	/* filled in as the URBs complete */
+	itransfer->iso_summary.actual_length = 0;
+	itransfer->iso_summary.num_error_packets = 0;
+	itransfer->iso_summary.first_error_packet = -1;
+	itransfer->iso_summary.last_error_packet = -1;
+	itransfer->iso_summary_valid = 1;
+
+	/* without the ASAP flag the kernel schedules an URB right after the
+	 * previous one on the endpoint. that is only defined while the endpoint
+	 * is busy, otherwise the (unset) start frame would be used. */
+	if (transfer->flags & LIBUSB_TRANSFER_ISO_CONTINUE)
+		follow = usbi_atomic_load(&hpriv->iso_urbs_in_flight[USBI_ENDPOINT_INDEX(transfer->endpoint)]) != 0;
+
 	/* allocate + initialize each URB with the correct number of packets */
 	num_packets_remaining = num_packets;
 	for (i = 0, j = 0; i < num_urbs; i++) {
 		int num_packets_in_urb = MIN(num_packets_remaining, MAX_ISO_PACKETS_PER_URB);
 		struct usbfs_urb *urb;
-		size_t alloc_size;
 		int k;
 
-		alloc_size = sizeof(*urb)
-			+ (num_packets_in_urb * sizeof(struct usbfs_iso_packet_desc));
-		urb = calloc(1, alloc_size);
-		if (!urb) {
-			free_iso_urbs(tpriv);
-			return LIBUSB_ERROR_NO_MEM;
-		}
+		urb = (struct usbfs_urb *)urb_storage;
+		urb_storage += PTR_ALIGN(sizeof(*urb)
+			+ (num_packets_in_urb * sizeof(struct usbfs_iso_packet_desc)));
 		urbs[i] = urb;
 
 		/* populate packet lengths */
-		for (k = 0; k < num_packets_in_urb; j++, k++) {
-			packet_len = transfer->iso_packet_desc[j].length;
-			urb->buffer_length += packet_len;
-			urb->iso_frame_desc[k].length = packet_len;
+		if (uniform) {
+			for (k = 0; k < num_packets_in_urb; k++)
+				urb->iso_frame_desc[k].length = packet_len;
+			urb->buffer_length = (int)(packet_len * (unsigned int)num_packets_in_urb);
+		} else {
+			for (k = 0; k < num_packets_in_urb; j++, k++) {
+				packet_len = transfer->iso_packet_desc[j].length;
+				urb->buffer_length += packet_len;
+				urb->iso_frame_desc[k].length = packet_len;
+			}
 		}
 
 		urb->usercontext = itransfer;
 		urb->type = USBFS_URB_TYPE_ISO;
-		/* FIXME: interface for non-ASAP data? */
-		urb->flags = USBFS_URB_ISO_ASAP;
+		/* the URBs of a transfer follow each other on the endpoint */
+		if ((transfer->flags & LIBUSB_TRANSFER_ISO_CONTINUE) && (follow || i > 0))
+			urb->flags = 0;
+		else
+			urb->flags = USBFS_URB_ISO_ASAP;
 		urb->endpoint = transfer->endpoint;
 		urb->number_of_packets = num_packets_in_urb;
 		urb->buffer = urb_buffer;
@@ -2173,7 +3273,7 @@ static int submit_iso_transfer(struct usbi_transfer *itransfer)
 
 	/* submit URBs */
 	for (i = 0; i < num_urbs; i++) {
-		int r = ioctl(hpriv->fd, IOCTL_USBFS_SUBMITURB, urbs[i]);
+		int r = submit_urb(hpriv, urbs[i]);
 
 		if (r == 0)
 			continue;
@@ -2240,7 +3340,7 @@ static int submit_control_transfer(struct usbi_transfer *itransfer)
 	if (transfer->length - LIBUSB_CONTROL_SETUP_SIZE > MAX_CTRL_BUFFER_LENGTH)
 		return LIBUSB_ERROR_INVALID_PARAM;
 
-	urb = calloc(1, sizeof(*urb));
+	urb = get_urb_storage(tpriv, sizeof(*urb));
 	if (!urb)
 		return LIBUSB_ERROR_NO_MEM;
 	tpriv->urbs = urb;
@@ -2253,9 +3353,8 @@ static int submit_control_transfer(struct usbi_transfer *itransfer)
 	urb->buffer = transfer->buffer;
 	urb->buffer_length = transfer->length;
 
-	r = ioctl(hpriv->fd, IOCTL_USBFS_SUBMITURB, urb);
+	r = submit_urb(hpriv, urb);
 	if (r < 0) {
-		free(urb);
 		tpriv->urbs = NULL;
 		if (errno == ENODEV)
 			return LIBUSB_ERROR_NO_DEVICE;
@@ -2266,6 +3365,91 @@ static int submit_control_transfer(struct usbi_transfer *itransfer)
 	return 0;
 }
 
+static int sync_transfer_errno_to_libusb(int err)
+{
+	switch (err) {
+	case ETIMEDOUT:
+		return LIBUSB_ERROR_TIMEOUT;
+	case EPIPE:
+		return LIBUSB_ERROR_PIPE;
+	case EOVERFLOW:
+		return LIBUSB_ERROR_OVERFLOW;
+	case ENODEV:
+	case ESHUTDOWN:
+		return LIBUSB_ERROR_NO_DEVICE;
+	case ENOMEM:
+		return LIBUSB_ERROR_NO_MEM;
+	default:
+		return LIBUSB_ERROR_IO;
+	}
+}
+
+static int op_sync_control_transfer(struct libusb_device_handle *handle,
+	uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue,
+	uint16_t wIndex, unsigned char *data, uint16_t wLength,
+	unsigned int timeout)
+{
+	struct linux_device_handle_priv *hpriv = usbi_get_device_handle_priv(handle);
+	struct usbfs_ctrltransfer ctrl;
+	int r;
+
+	/* older kernels refuse anything larger than a page */
+	if (wLength > MAX_CTRL_BUFFER_LENGTH)
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+
+	ctrl.bmRequestType = bmRequestType;
+	ctrl.bRequest = bRequest;
+	ctrl.wValue = wValue;
+	ctrl.wIndex = wIndex;
+	ctrl.wLength = wLength;
+	ctrl.timeout = timeout;
+	ctrl.data = data;
+
+	/* the kernel waits for the request uninterruptibly, so EINTR means it
+	 * was not started */
+	do {
+		r = ioctl(hpriv->fd, IOCTL_USBFS_CONTROL, &ctrl);
+	} while (r < 0 && errno == EINTR);
+	if (r < 0) {
+		usbi_dbg(HANDLE_CTX(handle), "control ioctl failed, errno=%d", errno);
+		return sync_transfer_errno_to_libusb(errno);
+	}
+
+	return r;
+}
+
+static int op_sync_bulk_transfer(struct libusb_device_handle *handle,
+	unsigned char endpoint, unsigned char *data, int length,
+	int *transferred, unsigned int timeout)
+{
+	struct linux_device_handle_priv *hpriv = usbi_get_device_handle_priv(handle);
+	struct usbfs_bulktransfer bulk;
+	int r;
+
+	/* IOCTL_USBFS_BULK does not report partial progress when it times
+	 * out, so only take it for transfers that cannot time out and fit in
+	 * a single URB */
+	if (timeout || length < 0 || length > MAX_BULK_BUFFER_LENGTH)
+		return LIBUSB_ERROR_NOT_SUPPORTED;
+
+	bulk.ep = endpoint;
+	bulk.len = (unsigned int)length;
+	bulk.timeout = timeout;
+	bulk.data = data;
+
+	do {
+		r = ioctl(hpriv->fd, IOCTL_USBFS_BULK, &bulk);
+	} while (r < 0 && errno == EINTR);
+	if (r < 0) {
+		*transferred = 0;
+		usbi_dbg(HANDLE_CTX(handle), "bulk ioctl failed, errno=%d", errno);
+		return sync_transfer_errno_to_libusb(errno);
+	}
+
+	*transferred = r;
+	return 0;
+}
+
 static int op_submit_transfer(struct usbi_transfer *itransfer)
 {
 	struct libusb_transfer *transfer =
@@ -2314,6 +3498,15 @@ static int op_cancel_transfer(struct usbi_transfer *itransfer)
 	return 0;
 }
 
+static void op_destroy_transfer_priv(struct usbi_transfer *itransfer)
+{
+	struct linux_transfer_priv *tpriv = usbi_get_transfer_priv(itransfer);
+
+	free(tpriv->urb_storage);
+	tpriv->urb_storage = NULL;
+	tpriv->urb_storage_size = 0;
+}
+
 static void op_clear_transfer_priv(struct usbi_transfer *itransfer)
 {
 	struct libusb_transfer *transfer =
@@ -2325,16 +3518,10 @@ static void op_clear_transfer_priv(struct usbi_transfer *itransfer)
 	case LIBUSB_TRANSFER_TYPE_BULK:
 	case LIBUSB_TRANSFER_TYPE_BULK_STREAM:
 	case LIBUSB_TRANSFER_TYPE_INTERRUPT:
-		if (tpriv->urbs) {
-			free(tpriv->urbs);
-			tpriv->urbs = NULL;
-		}
+		tpriv->urbs = NULL;
 		break;
 	case LIBUSB_TRANSFER_TYPE_ISOCHRONOUS:
-		if (tpriv->iso_urbs) {
-			free_iso_urbs(tpriv);
-			tpriv->iso_urbs = NULL;
-		}
+		free_iso_urbs(tpriv);
 		break;
 	default:
 		usbi_err(TRANSFER_CTX(transfer), "unknown transfer type %u", transfer->type);
@@ -2375,14 +3562,19 @@ static int handle_bulk_completion(struct usbi_transfer *itransfer,
 		 * transferred data and presents it in a contiguous chunk.
 		 */
 		if (urb->actual_length > 0) {
-			unsigned char *target = transfer->buffer + itransfer->transferred;
-
 			usbi_dbg(TRANSFER_CTX(transfer), "received %d bytes of surplus data", urb->actual_length);
-			if (urb->buffer != target) {
-				usbi_dbg(TRANSFER_CTX(transfer), "moving surplus data from offset %zu to offset %zu",
-					 (unsigned char *)urb->buffer - transfer->buffer,
-					 target - transfer->buffer);
-				memmove(target, urb->buffer, urb->actual_length);
+
+			/* only received data needs to be made contiguous, and IN
+			 * transfers never use scatter-gather segments directly */
+			if (IS_XFERIN(transfer)) {
+				unsigned char *target = transfer->buffer + itransfer->transferred;
+
+				if (urb->buffer != target) {
+					usbi_dbg(TRANSFER_CTX(transfer), "moving surplus data from offset %zu to offset %zu",
+						 (unsigned char *)urb->buffer - transfer->buffer,
+						 target - transfer->buffer);
+					memmove(target, urb->buffer, urb->actual_length);
+				}
 			}
 			itransfer->transferred += urb->actual_length;
 		}
@@ -2470,7 +3662,6 @@ out_unlock:
 	return 0;
 
 completed:
-	free(tpriv->urbs);
 	tpriv->urbs = NULL;
 	usbi_mutex_unlock(&itransfer->lock);
 	return tpriv->reap_action == CANCELLED ?
@@ -2484,6 +3675,7 @@ static int handle_iso_completion(struct usbi_transfer *itransfer,
 	struct libusb_transfer *transfer =
 		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
 	struct linux_transfer_priv *tpriv = usbi_get_transfer_priv(itransfer);
+	struct libusb_iso_transfer_summary *summary;
 	int num_urbs = tpriv->num_urbs;
 	int urb_idx = 0;
 	int i;
@@ -2505,12 +3697,13 @@ static int handle_iso_completion(struct usbi_transfer *itransfer,
 	usbi_dbg(TRANSFER_CTX(transfer), "handling completion status %d of iso urb %d/%d", urb->status,
 		 urb_idx, num_urbs);
 
-	/* copy isochronous results back in */
-
+	/* copy isochronous results back in, keeping the summary */
+	summary = &itransfer->iso_summary;
 	for (i = 0; i < urb->number_of_packets; i++) {
 		struct usbfs_iso_packet_desc *urb_desc = &urb->iso_frame_desc[i];
+		int packet = tpriv->iso_packet_offset++;
 		struct libusb_iso_packet_descriptor *lib_desc =
-			&transfer->iso_packet_desc[tpriv->iso_packet_offset++];
+			&transfer->iso_packet_desc[packet];
 
 		lib_desc->status = LIBUSB_TRANSFER_COMPLETED;
 		switch (urb_desc->status) {
@@ -2548,6 +3741,13 @@ static int handle_iso_completion(struct usbi_transfer *itransfer,
 			break;
 		}
 		lib_desc->actual_length = urb_desc->actual_length;
+
+		summary->actual_length += urb_desc->actual_length;
+		if (lib_desc->status != LIBUSB_TRANSFER_COMPLETED) {
+			if (!summary->num_error_packets++)
+				summary->first_error_packet = packet;
+			summary->last_error_packet = packet;
+		}
 	}
 
 	tpriv->num_retired++;
@@ -2613,7 +3813,6 @@ static int handle_control_completion(struct usbi_transfer *itransfer,
 		if (urb->status && urb->status != -ENOENT)
 			usbi_warn(ITRANSFER_CTX(itransfer), "cancel: unrecognised urb status %d",
 				  urb->status);
-		free(tpriv->urbs);
 		tpriv->urbs = NULL;
 		usbi_mutex_unlock(&itransfer->lock);
 		return usbi_handle_transfer_cancellation(itransfer);
@@ -2653,7 +3852,6 @@ static int handle_control_completion(struct usbi_transfer *itransfer,
 		break;
 	}
 
-	free(tpriv->urbs);
 	tpriv->urbs = NULL;
 	usbi_mutex_unlock(&itransfer->lock);
 	return usbi_handle_transfer_completion(itransfer, status);
@@ -2667,6 +3865,11 @@ static int reap_for_handle(struct libusb_device_handle *handle)
 	struct usbi_transfer *itransfer;
 	struct libusb_transfer *transfer;
 
+	/* every submitted URB has already been reaped, so don't spend an ioctl
+	 * just to be told there is nothing left */
+	if (!usbi_atomic_load(&hpriv->urbs_in_flight))
+		return 1;
+
 	r = ioctl(hpriv->fd, IOCTL_USBFS_REAPURBNDELAY, &urb);
 	if (r < 0) {
 		if (errno == EAGAIN)
@@ -2678,10 +3881,15 @@ static int reap_for_handle(struct libusb_device_handle *handle)
 		return LIBUSB_ERROR_IO;
 	}
 
+	(void)usbi_atomic_dec(&hpriv->urbs_in_flight);
+	if (urb->type == USBFS_URB_TYPE_ISO)
+		(void)usbi_atomic_dec(&hpriv->iso_urbs_in_flight[USBI_ENDPOINT_INDEX(urb->endpoint)]);
+
 	itransfer = urb->usercontext;
 	transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
 
 	usbi_dbg(HANDLE_CTX(handle), "urb type=%u status=%d transferred=%d", urb->type, urb->status, urb->actual_length);
+	usbi_trace4(urb__reap, transfer, urb->endpoint, urb->status, urb->actual_length);
 
 	switch (transfer->type) {
 	case LIBUSB_TRANSFER_TYPE_ISOCHRONOUS:
@@ -2701,11 +3909,24 @@ static int reap_for_handle(struct libusb_device_handle *handle)
 static int op_handle_events(struct libusb_context *ctx,
 	void *event_data, unsigned int count, unsigned int num_ready)
 {
+	struct linux_context_priv *cpriv = usbi_get_context_priv(ctx);
 	struct pollfd *fds = event_data;
 	unsigned int n;
 	int r;
 
-	usbi_mutex_lock(&ctx->open_devs_lock);
+	if (!cpriv->no_device_discovery) {
+		for (n = 0; n < count && num_ready > 0; n++) {
+			if (fds[n].fd != USBI_EVENT_OS_HANDLE(&cpriv->hotplug_event))
+				continue;
+			if (fds[n].revents) {
+				fds[n].revents = 0;
+				num_ready--;
+				hotplug_drain(ctx);
+			}
+			break;
+		}
+	}
+
 	for (n = 0; n < count && num_ready > 0; n++) {
 		struct pollfd *pollfd = &fds[n];
 		struct libusb_device_handle *handle;
@@ -2716,6 +3937,12 @@ static int op_handle_events(struct libusb_context *ctx,
 			continue;
 
 		num_ready--;
+
+		/* other event loops handle other devices meanwhile, so
+		 * open_devs_lock is only held to find the handle. its reap_lock
+		 * keeps it open while its URBs are reaped and their callbacks
+		 * run */
+		usbi_mutex_lock(&ctx->open_devs_lock);
 		for_each_open_device(ctx, handle) {
 			hpriv = usbi_get_device_handle_priv(handle);
 			if (hpriv->fd == pollfd->fd)
@@ -2723,10 +3950,13 @@ static int op_handle_events(struct libusb_context *ctx,
 		}
 
 		if (!hpriv || hpriv->fd != pollfd->fd) {
+			usbi_mutex_unlock(&ctx->open_devs_lock);
 			usbi_err(ctx, "cannot find handle for fd %d",
 				 pollfd->fd);
 			continue;
 		}
+		usbi_mutex_lock(&hpriv->reap_lock);
+		usbi_mutex_unlock(&ctx->open_devs_lock);
 
 		if (pollfd->revents & POLLERR) {
 			/* remove the fd from the pollfd set so that it doesn't continuously
@@ -2735,13 +3965,11 @@ static int op_handle_events(struct libusb_context *ctx,
 			usbi_remove_event_source(HANDLE_CTX(handle), hpriv->fd);
 			hpriv->fd_removed = 1;
 
-			/* device will still be marked as attached if hotplug monitor thread
-			 * hasn't processed remove event yet */
-			usbi_mutex_static_lock(&linux_hotplug_lock);
+			/* device will still be marked as attached if the context
+			 * hasn't processed the remove event yet */
 			if (usbi_atomic_load(&handle->dev->attached))
-				linux_device_disconnected(handle->dev->bus_number,
+				linux_device_disconnected(ctx, handle->dev->bus_number,
 							  handle->dev->device_address);
-			usbi_mutex_static_unlock(&linux_hotplug_lock);
 
 			if (hpriv->caps & USBFS_CAP_REAP_AFTER_DISCONNECT) {
 				do {
@@ -2750,6 +3978,7 @@ static int op_handle_events(struct libusb_context *ctx,
 			}
 
 			usbi_handle_disconnect(handle);
+			usbi_mutex_unlock(&hpriv->reap_lock);
 			continue;
 		}
 
@@ -2757,22 +3986,22 @@ static int op_handle_events(struct libusb_context *ctx,
 		do {
 			r = reap_for_handle(handle);
 		} while (r == 0 && ++reap_count <= 25);
+		usbi_mutex_unlock(&hpriv->reap_lock);
 
 		if (r == 1 || r == LIBUSB_ERROR_NO_DEVICE)
 			continue;
 		else if (r < 0)
-			goto out;
+			return r;
 	}
 
-	r = 0;
-out:
-	usbi_mutex_unlock(&ctx->open_devs_lock);
-	return r;
+	return 0;
 }
 
 const struct usbi_os_backend usbi_backend = {
 	.name = "Linux usbfs",
-	.caps = USBI_CAP_HAS_HID_ACCESS|USBI_CAP_SUPPORTS_DETACH_KERNEL_DRIVER,
+	.caps = USBI_CAP_HAS_HID_ACCESS|USBI_CAP_SUPPORTS_DETACH_KERNEL_DRIVER|
+		USBI_CAP_SUPPORTS_BULK_OUT_IOVEC|USBI_CAP_PARALLEL_ENUMERATION|
+		USBI_CAP_HOTPLUG_BATCHING,
 	.init = op_init,
 	.exit = op_exit,
 	.set_option = op_set_option,
@@ -2780,6 +4009,7 @@ const struct usbi_os_backend usbi_backend = {
 	.get_active_config_descriptor = op_get_active_config_descriptor,
 	.get_config_descriptor = op_get_config_descriptor,
 	.get_config_descriptor_by_value = op_get_config_descriptor_by_value,
+	.get_device_string = op_get_device_string,
 
 	.wrap_sys_device = op_wrap_sys_device,
 	.open = op_open,
@@ -2798,6 +4028,8 @@ const struct usbi_os_backend usbi_backend = {
 
 	.dev_mem_alloc = op_dev_mem_alloc,
 	.dev_mem_free = op_dev_mem_free,
+	.host_mem_alloc = op_host_mem_alloc,
+	.host_mem_free = op_host_mem_free,
 
 	.kernel_driver_active = op_kernel_driver_active,
 	.detach_kernel_driver = op_detach_kernel_driver,
@@ -2808,6 +4040,9 @@ const struct usbi_os_backend usbi_backend = {
 	.submit_transfer = op_submit_transfer,
 	.cancel_transfer = op_cancel_transfer,
 	.clear_transfer_priv = op_clear_transfer_priv,
+	.destroy_transfer_priv = op_destroy_transfer_priv,
+	.sync_control_transfer = op_sync_control_transfer,
+	.sync_bulk_transfer = op_sync_bulk_transfer,
 
 	.handle_events = op_handle_events,
 
@@ -40,6 +40,16 @@ struct usbfs_ctrltransfer {
 	void *data;
 };
 
+struct usbfs_bulktransfer {
+	/* keep in sync with usbdevice_fs.h:usbdevfs_bulktransfer */
+	unsigned int ep;
+	unsigned int len;
+	unsigned int timeout;	/* in milliseconds */
+
+	/* pointer to data */
+	void *data;
+};
+
 struct usbfs_setinterface {
 	/* keep in sync with usbdevice_fs.h:usbdevfs_setinterface */
 	unsigned int interface;
@@ -136,6 +146,7 @@ struct usbfs_streams {
 #define USBFS_SPEED_SUPER_PLUS			6
 
 #define IOCTL_USBFS_CONTROL		_IOWR('U', 0, struct usbfs_ctrltransfer)
+#define IOCTL_USBFS_BULK		_IOWR('U', 2, struct usbfs_bulktransfer)
 #define IOCTL_USBFS_SETINTERFACE	_IOR('U', 4, struct usbfs_setinterface)
 #define IOCTL_USBFS_SETCONFIGURATION	_IOR('U', 5, unsigned int)
 #define IOCTL_USBFS_GETDRIVER		_IOW('U', 8, struct usbfs_getdriver)
@@ -199,8 +210,13 @@ static inline void linux_hotplug_poll(void)
 #endif
 }
 
+struct pollfd;
+int linux_hotplug_read_batch(struct pollfd *fds, void (*read_event)(void));
 void linux_hotplug_enumerate(uint8_t busnum, uint8_t devaddr, const char *sys_name);
-void linux_device_disconnected(uint8_t busnum, uint8_t devaddr);
+void linux_hotplug_disconnected(uint8_t busnum, uint8_t devaddr);
+void linux_hotplug_publish(void);
+void linux_device_disconnected(struct libusb_context *ctx, uint8_t busnum,
+	uint8_t devaddr);
 
 int linux_get_device_address(struct libusb_context *ctx, int detached,
 	uint8_t *busnum, uint8_t *devaddr, const char *dev_node,
@@ -208,4 +224,21 @@ int linux_get_device_address(struct libusb_context *ctx, int detached,
 int linux_enumerate_device(struct libusb_context *ctx,
 	uint8_t busnum, uint8_t devaddr, const char *sysfs_dir);
 
+/* A device found by a scan, see linux_enumerate_devices() */
+struct linux_scan_entry {
+	char *sysfs_dir;
+	/* set if the scan already knows busnum and devaddr, otherwise they
+	 * are read from sysfs */
+	int have_address;
+	uint8_t busnum;
+	uint8_t devaddr;
+
+	/* used by linux_enumerate_devices() */
+	struct libusb_device *dev;
+	int r;
+};
+
+int linux_enumerate_devices(struct libusb_context *ctx,
+	struct linux_scan_entry *entries, size_t num_entries);
+
 #endif
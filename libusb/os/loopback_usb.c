@@ -0,0 +1,692 @@
+/*
+ * In-process loopback backend for libusb
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * This backend emulates a single high-speed device, so that the overhead of
+ * libusb itself can be measured without hardware. It is selected at build time
+ * with --enable-loopback-backend.
+ *
+ * The device has the IDs of the Linux "Gadget Zero" source/sink gadget and
+ * one interface with these endpoints:
+ *   0x01 bulk OUT, 0x81 bulk IN (512 bytes)
+ *   0x02 isochronous OUT, 0x82 isochronous IN (1024 bytes, every microframe)
+ *   0x83 interrupt IN (64 bytes, every 8 microframes)
+ *
+ * Every transfer succeeds with its full length. OUT data is dropped and the
+ * buffer of an IN transfer is left untouched. Control requests reading the
+ * device, configuration or string descriptors are answered, requests for any
+ * other descriptor stall and other IN requests return zeroes. The
+ * timing is set through two environment variables read at libusb_init():
+ *   LIBUSB_LOOPBACK_LATENCY    time added to every transfer, in microseconds
+ *   LIBUSB_LOOPBACK_BANDWIDTH  data rate of each endpoint, in bytes per second
+ * With neither set, transfers complete as they are submitted. Otherwise a
+ * thread per context completes them once they are due, through
+ * usbi_signal_transfer_completion() like the asynchronous backends do.
+ *
+ * Like the backends of real devices, each device keeps its configuration
+ * descriptor in the descriptor store, so that the devices of all the
+ * contexts share a single copy of it.
+ *
+ * The vendor request LOOPBACK_REQUEST_DISCONNECT, sent to the device, stands
+ * for the device being unplugged from the handle it was sent on. It completes
+ * at once, the latency and bandwidth notwithstanding, and the other transfers
+ * in flight on the handle then complete with LIBUSB_TRANSFER_NO_DEVICE, as
+ * do those resubmitted by their callbacks. Any later submission on the handle
+ * fails with LIBUSB_ERROR_NO_DEVICE. None of those transfers may be due by
+ * then, so this is meant to be used with a latency longer than the test.
+ *
+ * The backend supports hotplug: the device is plugged into each context as
+ * it is created. The vendor request LOOPBACK_REQUEST_REENUMERATE makes the
+ * device re-enumerate, which disconnects it from the handle like
+ * LOOPBACK_REQUEST_DISCONNECT does, and then has a new device with the same
+ * session ID take the place of the old one in the context. Each step comes
+ * with its hotplug event. LOOPBACK_REQUEST_REMOVE does the same but leaves
+ * the context without a device. Both requests find the device by its session
+ * ID, and stall, without disconnecting, if it is gone.
+ */
+
+#include "libusbi.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define LOOPBACK_SESSION_ID	1
+
+#define LOOPBACK_REQUEST_DISCONNECT	0x01
+#define LOOPBACK_REQUEST_REENUMERATE	0x02
+#define LOOPBACK_REQUEST_REMOVE		0x03
+
+static const uint8_t loopback_device_desc[LIBUSB_DT_DEVICE_SIZE] = {
+	LIBUSB_DT_DEVICE_SIZE, LIBUSB_DT_DEVICE,
+	0x00, 0x02,			/* bcdUSB */
+	0x00, 0x00, 0x00,		/* class, subclass, protocol */
+	64,				/* bMaxPacketSize0 */
+	0x25, 0x05,			/* idVendor */
+	0xa0, 0xa4,			/* idProduct */
+	0x00, 0x01,			/* bcdDevice */
+	1, 2, 3,			/* iManufacturer, iProduct, iSerialNumber */
+	1,				/* bNumConfigurations */
+};
+
+#define LOOPBACK_CONFIG_SIZE	\
+	(LIBUSB_DT_CONFIG_SIZE + LIBUSB_DT_INTERFACE_SIZE + 5 * LIBUSB_DT_ENDPOINT_SIZE)
+
+#define LOOPBACK_ENDPOINT(address, attributes, size, interval)	\
+	LIBUSB_DT_ENDPOINT_SIZE, LIBUSB_DT_ENDPOINT, (address), (attributes),	\
+	(size) & 0xff, (size) >> 8, (interval)
+
+static const uint8_t loopback_config_desc[LOOPBACK_CONFIG_SIZE] = {
+	LIBUSB_DT_CONFIG_SIZE, LIBUSB_DT_CONFIG,
+	LOOPBACK_CONFIG_SIZE & 0xff, LOOPBACK_CONFIG_SIZE >> 8,
+	1,				/* bNumInterfaces */
+	1,				/* bConfigurationValue */
+	0,				/* iConfiguration */
+	0x80,				/* bmAttributes */
+	50,				/* bMaxPower */
+
+	LIBUSB_DT_INTERFACE_SIZE, LIBUSB_DT_INTERFACE,
+	0, 0,				/* bInterfaceNumber, bAlternateSetting */
+	5,				/* bNumEndpoints */
+	LIBUSB_CLASS_VENDOR_SPEC, 0, 0,
+	0,				/* iInterface */
+
+	LOOPBACK_ENDPOINT(0x01, LIBUSB_ENDPOINT_TRANSFER_TYPE_BULK, 512, 0),
+	LOOPBACK_ENDPOINT(0x81, LIBUSB_ENDPOINT_TRANSFER_TYPE_BULK, 512, 0),
+	LOOPBACK_ENDPOINT(0x02, LIBUSB_ENDPOINT_TRANSFER_TYPE_ISOCHRONOUS, 1024, 1),
+	LOOPBACK_ENDPOINT(0x82, LIBUSB_ENDPOINT_TRANSFER_TYPE_ISOCHRONOUS, 1024, 1),
+	LOOPBACK_ENDPOINT(0x83, LIBUSB_ENDPOINT_TRANSFER_TYPE_INTERRUPT, 64, 4),
+};
+
+/* string descriptors by index, index 0 being the list of languages */
+static const char * const loopback_strings[] = {
+	"\x09\x04", "libusb", "Loopback", "0001",
+};
+
+struct loopback_context_priv {
+	long latency;		/* microseconds */
+	long long bandwidth;	/* bytes per second */
+	int no_device_discovery;
+
+	/* protects the fields below */
+	usbi_mutex_t lock;
+	usbi_cond_t cond;
+	usbi_thread_t thread;
+	int thread_running;
+	int stop;
+
+	/* transfers not completed yet, in the order they are due */
+	struct list_head pending;
+
+	/* when each endpoint is done with the transfers queued on it */
+	struct timespec busy_until[USB_MAXENDPOINTS];
+};
+
+struct loopback_device_priv {
+	/* loopback_config_desc, shared through the descriptor store */
+	void *config_desc;
+};
+
+struct loopback_device_handle_priv {
+	/* set once LOOPBACK_REQUEST_DISCONNECT has completed */
+	usbi_atomic_t disconnected;
+};
+
+struct loopback_transfer_priv {
+	struct list_head list;
+	struct usbi_transfer *itransfer;
+	struct timespec due;
+	enum libusb_transfer_status status;
+	int cancelled;
+	int disconnect;
+};
+
+static int timespec_before(const struct timespec *a, const struct timespec *b)
+{
+	return a->tv_sec < b->tv_sec ||
+		(a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+static void timespec_add_nsec(struct timespec *ts, long long nsec)
+{
+	nsec += ts->tv_nsec;
+	ts->tv_sec += (time_t)(nsec / NSEC_PER_SEC);
+	ts->tv_nsec = (long)(nsec % NSEC_PER_SEC);
+}
+
+static long long loopback_getenv(const char *name)
+{
+	const char *value = getenv(name);
+
+	if (!value)
+		return 0;
+
+	return MAX(strtoll(value, NULL, 10), 0);
+}
+
+static void *loopback_completion_thread(void *arg)
+{
+	struct libusb_context *ctx = arg;
+	struct loopback_context_priv *cpriv = usbi_get_context_priv(ctx);
+
+	usbi_thread_started(ctx, LIBUSB_THREAD_COMPLETION, "libusb_loopback");
+
+	usbi_mutex_lock(&cpriv->lock);
+	while (!cpriv->stop) {
+		struct loopback_transfer_priv *tpriv;
+		struct timespec now, delta;
+		struct timeval tv;
+
+		if (list_empty(&cpriv->pending)) {
+			usbi_cond_wait(&cpriv->cond, &cpriv->lock);
+			continue;
+		}
+
+		tpriv = list_first_entry(&cpriv->pending, struct loopback_transfer_priv, list);
+		usbi_get_monotonic_time(&now);
+		if (!timespec_before(&now, &tpriv->due)) {
+			list_del(&tpriv->list);
+			usbi_mutex_unlock(&cpriv->lock);
+			usbi_signal_transfer_completion(tpriv->itransfer);
+			usbi_mutex_lock(&cpriv->lock);
+			continue;
+		}
+
+		TIMESPEC_SUB(&tpriv->due, &now, &delta);
+		TIMESPEC_TO_TIMEVAL(&tv, &delta);
+		if (!tv.tv_sec && !tv.tv_usec)
+			tv.tv_usec = 1;
+		(void)usbi_cond_timedwait(&cpriv->cond, &cpriv->lock, &tv);
+	}
+	usbi_mutex_unlock(&cpriv->lock);
+
+	return NULL;
+}
+
+/* Plug a new device into the context */
+static int loopback_connect_device(struct libusb_context *ctx)
+{
+	struct loopback_device_priv *dpriv;
+	struct libusb_device *dev;
+	int r;
+
+	dev = usbi_alloc_device(ctx, LOOPBACK_SESSION_ID);
+	if (!dev)
+		return LIBUSB_ERROR_NO_MEM;
+
+	dev->bus_number = 1;
+	dev->device_address = 1;
+	dev->speed = LIBUSB_SPEED_HIGH;
+	memcpy(&dev->device_descriptor, loopback_device_desc, LIBUSB_DT_DEVICE_SIZE);
+	usbi_localize_device_descriptor(&dev->device_descriptor);
+
+	dpriv = usbi_get_device_priv(dev);
+	dpriv->config_desc = usbi_desc_store_get(loopback_config_desc,
+		sizeof(loopback_config_desc));
+	if (!dpriv->config_desc) {
+		libusb_unref_device(dev);
+		return LIBUSB_ERROR_NO_MEM;
+	}
+
+	r = usbi_sanitize_device(dev);
+	if (r) {
+		libusb_unref_device(dev);
+		return r;
+	}
+
+	usbi_connect_device(dev);
+	return LIBUSB_SUCCESS;
+}
+
+/* Unplug the device from the context and, if it re-enumerates, plug a new
+ * one in its place. Returns LIBUSB_ERROR_NOT_FOUND if the device is not
+ * plugged in. */
+static int loopback_unplug(struct libusb_context *ctx, int reenumerate)
+{
+	struct libusb_device *dev;
+
+	dev = usbi_get_device_by_session_id(ctx, LOOPBACK_SESSION_ID);
+	if (!dev)
+		return LIBUSB_ERROR_NOT_FOUND;
+
+	/* the reference of the context goes to the departure message */
+	usbi_disconnect_device(dev);
+	libusb_unref_device(dev);
+
+	if (!reenumerate)
+		return LIBUSB_SUCCESS;
+
+	return loopback_connect_device(ctx);
+}
+
+static int loopback_set_option(struct libusb_context *ctx,
+	enum libusb_option option, va_list ap)
+{
+	UNUSED(ap);
+
+	if (option == LIBUSB_OPTION_NO_DEVICE_DISCOVERY) {
+		struct loopback_context_priv *cpriv = usbi_get_context_priv(ctx);
+
+		usbi_dbg(ctx, "the loopback device will not be listed");
+		cpriv->no_device_discovery = 1;
+		return LIBUSB_SUCCESS;
+	}
+
+	return LIBUSB_ERROR_NOT_SUPPORTED;
+}
+
+static void loopback_exit(struct libusb_context *ctx)
+{
+	struct loopback_context_priv *cpriv = usbi_get_context_priv(ctx);
+
+	if (cpriv->thread_running) {
+		usbi_mutex_lock(&cpriv->lock);
+		cpriv->stop = 1;
+		usbi_cond_broadcast(&cpriv->cond);
+		usbi_mutex_unlock(&cpriv->lock);
+		usbi_thread_join(cpriv->thread);
+	}
+	usbi_cond_destroy(&cpriv->cond);
+	usbi_mutex_destroy(&cpriv->lock);
+}
+
+static int loopback_init(struct libusb_context *ctx)
+{
+	struct loopback_context_priv *cpriv = usbi_get_context_priv(ctx);
+	int r;
+
+	cpriv->latency = (long)MIN(loopback_getenv("LIBUSB_LOOPBACK_LATENCY"), 10000000);
+	cpriv->bandwidth = loopback_getenv("LIBUSB_LOOPBACK_BANDWIDTH");
+	usbi_mutex_init(&cpriv->lock);
+	usbi_cond_init(&cpriv->cond);
+	list_init(&cpriv->pending);
+
+	if (cpriv->latency || cpriv->bandwidth) {
+		r = usbi_thread_create(&cpriv->thread, loopback_completion_thread, ctx);
+		if (r) {
+			usbi_cond_destroy(&cpriv->cond);
+			usbi_mutex_destroy(&cpriv->lock);
+			return r;
+		}
+		cpriv->thread_running = 1;
+
+		usbi_dbg(ctx, "latency %ldus, bandwidth %lld bytes/s",
+			 cpriv->latency, cpriv->bandwidth);
+	}
+
+	if (cpriv->no_device_discovery)
+		return LIBUSB_SUCCESS;
+
+	r = loopback_connect_device(ctx);
+	if (r)
+		loopback_exit(ctx);
+	return r;
+}
+
+static int loopback_open(struct libusb_device_handle *dev_handle)
+{
+	struct loopback_device_handle_priv *hpriv = usbi_get_device_handle_priv(dev_handle);
+
+	usbi_atomic_store(&hpriv->disconnected, 0);
+	return LIBUSB_SUCCESS;
+}
+
+static void loopback_close(struct libusb_device_handle *dev_handle)
+{
+	UNUSED(dev_handle);
+}
+
+static void loopback_destroy_device(struct libusb_device *dev)
+{
+	struct loopback_device_priv *dpriv = usbi_get_device_priv(dev);
+
+	usbi_desc_store_put(dpriv->config_desc);
+}
+
+static int loopback_get_config_descriptor(struct libusb_device *dev,
+	uint8_t config_index, void *buffer, size_t len)
+{
+	struct loopback_device_priv *dpriv = usbi_get_device_priv(dev);
+
+	if (config_index != 0)
+		return LIBUSB_ERROR_NOT_FOUND;
+
+	len = MIN(len, sizeof(loopback_config_desc));
+	memcpy(buffer, dpriv->config_desc, len);
+	return (int)len;
+}
+
+static int loopback_get_active_config_descriptor(struct libusb_device *dev,
+	void *buffer, size_t len)
+{
+	return loopback_get_config_descriptor(dev, 0, buffer, len);
+}
+
+static int loopback_get_configuration(struct libusb_device_handle *dev_handle,
+	uint8_t *config)
+{
+	UNUSED(dev_handle);
+	*config = 1;
+	return LIBUSB_SUCCESS;
+}
+
+static int loopback_set_configuration(struct libusb_device_handle *dev_handle,
+	int config)
+{
+	UNUSED(dev_handle);
+	return (config == 1 || config == -1) ? LIBUSB_SUCCESS : LIBUSB_ERROR_NOT_FOUND;
+}
+
+static int loopback_claim_interface(struct libusb_device_handle *dev_handle,
+	uint8_t iface)
+{
+	UNUSED(dev_handle);
+	return iface == 0 ? LIBUSB_SUCCESS : LIBUSB_ERROR_NOT_FOUND;
+}
+
+static int loopback_release_interface(struct libusb_device_handle *dev_handle,
+	uint8_t iface)
+{
+	UNUSED(dev_handle);
+	return iface == 0 ? LIBUSB_SUCCESS : LIBUSB_ERROR_NOT_FOUND;
+}
+
+static int loopback_set_interface_altsetting(struct libusb_device_handle *dev_handle,
+	uint8_t iface, uint8_t altsetting)
+{
+	UNUSED(dev_handle);
+	return (iface == 0 && altsetting == 0) ? LIBUSB_SUCCESS : LIBUSB_ERROR_NOT_FOUND;
+}
+
+static int loopback_clear_halt(struct libusb_device_handle *dev_handle,
+	unsigned char endpoint)
+{
+	UNUSED(dev_handle);
+	UNUSED(endpoint);
+	return LIBUSB_SUCCESS;
+}
+
+static int loopback_reset_device(struct libusb_device_handle *dev_handle)
+{
+	UNUSED(dev_handle);
+	return LIBUSB_SUCCESS;
+}
+
+/* Carry out a control request, returning the number of data bytes or -1 if
+ * the device stalls the request */
+static int loopback_control(struct libusb_transfer *transfer)
+{
+	struct libusb_control_setup *setup =
+		(struct libusb_control_setup *)(void *)transfer->buffer;
+	unsigned char *data = libusb_control_transfer_get_data(transfer);
+	uint16_t length = libusb_le16_to_cpu(setup->wLength);
+	const uint8_t *desc = NULL;
+	size_t desc_len = 0;
+	uint8_t string_desc[2 + 2 * 16];
+	uint8_t index = libusb_le16_to_cpu(setup->wValue) & 0xff;
+	size_t i;
+
+	if (setup->bmRequestType ==
+	    (LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE) &&
+	    (setup->bRequest == LOOPBACK_REQUEST_REENUMERATE ||
+	     setup->bRequest == LOOPBACK_REQUEST_REMOVE))
+		return loopback_unplug(TRANSFER_CTX(transfer),
+			setup->bRequest == LOOPBACK_REQUEST_REENUMERATE) ? -1 : length;
+
+	if (!(setup->bmRequestType & LIBUSB_ENDPOINT_IN))
+		return length;
+
+	if (setup->bmRequestType == LIBUSB_ENDPOINT_IN &&
+	    setup->bRequest == LIBUSB_REQUEST_GET_DESCRIPTOR) {
+		switch (libusb_le16_to_cpu(setup->wValue) >> 8) {
+		case LIBUSB_DT_DEVICE:
+			desc = loopback_device_desc;
+			desc_len = sizeof(loopback_device_desc);
+			break;
+		case LIBUSB_DT_CONFIG:
+			desc = loopback_config_desc;
+			desc_len = sizeof(loopback_config_desc);
+			break;
+		case LIBUSB_DT_STRING:
+			if (index >= ARRAYSIZE(loopback_strings))
+				return -1;
+			if (index == 0) {
+				desc_len = 4;
+				memcpy(string_desc + 2, loopback_strings[0], 2);
+			} else {
+				desc_len = 2 + 2 * strlen(loopback_strings[index]);
+				for (i = 0; loopback_strings[index][i]; i++) {
+					string_desc[2 + 2 * i] = (uint8_t)loopback_strings[index][i];
+					string_desc[3 + 2 * i] = 0;
+				}
+			}
+			string_desc[0] = (uint8_t)desc_len;
+			string_desc[1] = LIBUSB_DT_STRING;
+			desc = string_desc;
+			break;
+		default:
+			return -1;
+		}
+	}
+
+	if (desc) {
+		length = (uint16_t)MIN(length, desc_len);
+		memcpy(data, desc, length);
+	} else {
+		memset(data, 0, length);
+	}
+
+	return length;
+}
+
+static int loopback_is_disconnect(struct libusb_transfer *transfer)
+{
+	struct libusb_control_setup *setup =
+		(struct libusb_control_setup *)(void *)transfer->buffer;
+
+	return setup->bmRequestType ==
+		(LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE) &&
+		(setup->bRequest == LOOPBACK_REQUEST_DISCONNECT ||
+		 setup->bRequest == LOOPBACK_REQUEST_REENUMERATE ||
+		 setup->bRequest == LOOPBACK_REQUEST_REMOVE);
+}
+
+static int loopback_submit_transfer(struct usbi_transfer *itransfer)
+{
+	struct libusb_transfer *transfer =
+		USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	struct loopback_context_priv *cpriv = usbi_get_context_priv(ITRANSFER_CTX(itransfer));
+	struct loopback_transfer_priv *tpriv = usbi_get_transfer_priv(itransfer);
+	struct loopback_device_handle_priv *hpriv =
+		usbi_get_device_handle_priv(transfer->dev_handle);
+	struct timespec *busy_until;
+	struct list_head *pos;
+	int i;
+
+	if (usbi_atomic_load(&hpriv->disconnected))
+		return LIBUSB_ERROR_NO_DEVICE;
+
+	tpriv->status = LIBUSB_TRANSFER_COMPLETED;
+	tpriv->disconnect = 0;
+	switch (transfer->type) {
+	case LIBUSB_TRANSFER_TYPE_CONTROL:
+		itransfer->transferred = loopback_control(transfer);
+		if (itransfer->transferred < 0) {
+			itransfer->transferred = 0;
+			tpriv->status = LIBUSB_TRANSFER_STALL;
+		} else {
+			tpriv->disconnect = loopback_is_disconnect(transfer);
+		}
+		break;
+	case LIBUSB_TRANSFER_TYPE_BULK:
+	case LIBUSB_TRANSFER_TYPE_BULK_STREAM:
+	case LIBUSB_TRANSFER_TYPE_INTERRUPT:
+		itransfer->transferred = transfer->length;
+		break;
+	case LIBUSB_TRANSFER_TYPE_ISOCHRONOUS:
+		itransfer->transferred = 0;
+		for (i = 0; i < transfer->num_iso_packets; i++) {
+			struct libusb_iso_packet_descriptor *desc = &transfer->iso_packet_desc[i];
+
+			desc->actual_length = desc->length;
+			desc->status = LIBUSB_TRANSFER_COMPLETED;
+			itransfer->transferred += (int)desc->length;
+		}
+		break;
+	default:
+		return LIBUSB_ERROR_INVALID_PARAM;
+	}
+
+	tpriv->itransfer = itransfer;
+	tpriv->cancelled = 0;
+	if (!cpriv->thread_running) {
+		usbi_signal_transfer_completion(itransfer);
+		return LIBUSB_SUCCESS;
+	}
+
+	usbi_mutex_lock(&cpriv->lock);
+
+	/* the data of an endpoint goes out one transfer after the other, and
+	 * the latency comes on top of that */
+	usbi_get_monotonic_time(&tpriv->due);
+	if (!tpriv->disconnect) {
+		busy_until = &cpriv->busy_until[USBI_ENDPOINT_INDEX(transfer->endpoint)];
+		if (timespec_before(&tpriv->due, busy_until))
+			tpriv->due = *busy_until;
+		if (cpriv->bandwidth)
+			timespec_add_nsec(&tpriv->due,
+				(long long)itransfer->transferred * NSEC_PER_SEC / cpriv->bandwidth);
+		*busy_until = tpriv->due;
+		timespec_add_nsec(&tpriv->due, (long long)cpriv->latency * 1000);
+	}
+
+	/* keep the list ordered, most transfers go to the end */
+	for (pos = cpriv->pending.prev; pos != &cpriv->pending; pos = pos->prev) {
+		struct loopback_transfer_priv *cur =
+			list_entry(pos, struct loopback_transfer_priv, list);
+
+		if (!timespec_before(&tpriv->due, &cur->due))
+			break;
+	}
+	list_add(&tpriv->list, pos);
+	if (pos == &cpriv->pending)
+		usbi_cond_broadcast(&cpriv->cond);
+
+	usbi_mutex_unlock(&cpriv->lock);
+
+	return LIBUSB_SUCCESS;
+}
+
+static int loopback_cancel_transfer(struct usbi_transfer *itransfer)
+{
+	struct loopback_context_priv *cpriv = usbi_get_context_priv(ITRANSFER_CTX(itransfer));
+	struct loopback_transfer_priv *tpriv = usbi_get_transfer_priv(itransfer);
+	struct loopback_transfer_priv *cur;
+	int found = 0;
+
+	if (!cpriv->thread_running)
+		return LIBUSB_ERROR_NOT_FOUND;
+
+	usbi_mutex_lock(&cpriv->lock);
+	for_each_helper(cur, &cpriv->pending, struct loopback_transfer_priv) {
+		if (cur == tpriv) {
+			list_del(&tpriv->list);
+			found = 1;
+			break;
+		}
+	}
+	usbi_mutex_unlock(&cpriv->lock);
+
+	if (!found)
+		return LIBUSB_ERROR_NOT_FOUND;
+
+	tpriv->cancelled = 1;
+	itransfer->transferred = 0;
+	usbi_signal_transfer_completion(itransfer);
+
+	return LIBUSB_SUCCESS;
+}
+
+static void loopback_clear_transfer_priv(struct usbi_transfer *itransfer)
+{
+	struct loopback_context_priv *cpriv = usbi_get_context_priv(ITRANSFER_CTX(itransfer));
+	struct loopback_transfer_priv *tpriv = usbi_get_transfer_priv(itransfer);
+	struct loopback_transfer_priv *cur;
+
+	if (!cpriv->thread_running)
+		return;
+
+	usbi_mutex_lock(&cpriv->lock);
+	for_each_helper(cur, &cpriv->pending, struct loopback_transfer_priv) {
+		if (cur == tpriv) {
+			list_del(&tpriv->list);
+			break;
+		}
+	}
+	usbi_mutex_unlock(&cpriv->lock);
+}
+
+static int loopback_handle_transfer_completion(struct usbi_transfer *itransfer)
+{
+	struct loopback_transfer_priv *tpriv = usbi_get_transfer_priv(itransfer);
+	struct libusb_device_handle *dev_handle;
+	struct loopback_device_handle_priv *hpriv;
+	int r;
+
+	if (tpriv->cancelled)
+		return usbi_handle_transfer_cancellation(itransfer);
+	if (!tpriv->disconnect)
+		return usbi_handle_transfer_completion(itransfer, tpriv->status);
+
+	/* the transfer may be gone once its callback has run, and the events
+	 * lock is held as usbi_handle_disconnect() wants */
+	dev_handle = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer)->dev_handle;
+	hpriv = usbi_get_device_handle_priv(dev_handle);
+	usbi_atomic_store(&hpriv->disconnected, 1);
+	r = usbi_handle_transfer_completion(itransfer, tpriv->status);
+	usbi_handle_disconnect(dev_handle);
+
+	return r;
+}
+
+const struct usbi_os_backend usbi_backend = {
+	.name = "Loopback backend",
+	.caps = 0,
+	.init = loopback_init,
+	.exit = loopback_exit,
+	.set_option = loopback_set_option,
+	.open = loopback_open,
+	.close = loopback_close,
+	.get_active_config_descriptor = loopback_get_active_config_descriptor,
+	.get_config_descriptor = loopback_get_config_descriptor,
+	.get_configuration = loopback_get_configuration,
+	.set_configuration = loopback_set_configuration,
+	.claim_interface = loopback_claim_interface,
+	.release_interface = loopback_release_interface,
+	.set_interface_altsetting = loopback_set_interface_altsetting,
+	.clear_halt = loopback_clear_halt,
+	.reset_device = loopback_reset_device,
+	.destroy_device = loopback_destroy_device,
+	.submit_transfer = loopback_submit_transfer,
+	.cancel_transfer = loopback_cancel_transfer,
+	.clear_transfer_priv = loopback_clear_transfer_priv,
+	.handle_transfer_completion = loopback_handle_transfer_completion,
+	.context_priv_size = sizeof(struct loopback_context_priv),
+	.device_priv_size = sizeof(struct loopback_device_priv),
+	.device_handle_priv_size = sizeof(struct loopback_device_handle_priv),
+	.transfer_priv_size = sizeof(struct loopback_transfer_priv),
+};
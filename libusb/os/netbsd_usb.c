@@ -39,8 +39,35 @@ struct device_priv {
 	usb_config_descriptor_t *cdesc;		/* active config descriptor */
 };
 
+/*
+ * Bulk, interrupt and isochronous transfers are blocking read(2) and
+ * write(2) calls on the endpoint node, so they are handed to a worker
+ * thread per endpoint, which performs them in turn.  This lets the caller
+ * of libusb_submit_transfer() queue several transfers and carry on.
+ */
+struct endpoint_worker {
+	usbi_thread_t thread;
+	struct libusb_context *ctx;
+	usbi_mutex_t lock;
+	usbi_cond_t cond;
+	struct list_head transfers;		/* transfers waiting their turn */
+	int running;
+	int stop;
+};
+
 struct handle_priv {
 	int endpoints[USB_MAX_ENDPOINTS];
+
+	usbi_mutex_t workers_lock;		/* serializes worker start/stop */
+	struct endpoint_worker workers[USB_MAX_ENDPOINTS];
+};
+
+struct transfer_priv {
+	struct usbi_transfer *itransfer;
+	struct list_head list;			/* entry in the worker queue */
+	int queued;				/* protected by the worker lock */
+	int cancelled;
+	int err;				/* result from the worker */
 };
 
 /*
@@ -78,7 +105,11 @@ static int _errno_to_libusb(int);
 static int _cache_active_config_descriptor(struct libusb_device *, int);
 static int _sync_control_transfer(struct usbi_transfer *);
 static int _sync_gen_transfer(struct usbi_transfer *);
+static int _async_gen_transfer(struct usbi_transfer *);
 static int _access_endpoint(struct libusb_transfer *);
+static int _start_worker(struct libusb_device_handle *, int);
+static void _stop_workers(struct libusb_device_handle *);
+static void *_worker_main(void *);
 
 const struct usbi_os_backend usbi_backend = {
 	.name = "Synchronous NetBSD backend",
@@ -108,6 +139,7 @@ const struct usbi_os_backend usbi_backend = {
 
 	.device_priv_size = sizeof(struct device_priv),
 	.device_handle_priv_size = sizeof(struct handle_priv),
+	.transfer_priv_size = sizeof(struct transfer_priv),
 };
 
 int
@@ -205,6 +237,8 @@ netbsd_open(struct libusb_device_handle *handle)
 	for (i = 0; i < USB_MAX_ENDPOINTS; i++)
 		hpriv->endpoints[i] = -1;
 
+	usbi_mutex_init(&hpriv->workers_lock);
+
 	usbi_dbg(HANDLE_CTX(handle), "open %s: fd %d", dpriv->devnode, dpriv->fd);
 
 	return LIBUSB_SUCCESS;
@@ -214,6 +248,10 @@ void
 netbsd_close(struct libusb_device_handle *handle)
 {
 	struct device_priv *dpriv = usbi_get_device_priv(handle->dev);
+	struct handle_priv *hpriv = usbi_get_device_handle_priv(handle);
+
+	_stop_workers(handle);
+	usbi_mutex_destroy(&hpriv->workers_lock);
 
 	usbi_dbg(HANDLE_CTX(handle), "close: fd %d", dpriv->fd);
 
@@ -324,6 +362,9 @@ netbsd_release_interface(struct libusb_device_handle *handle, uint8_t iface)
 
 	UNUSED(iface);
 
+	/* The workers use the endpoint nodes */
+	_stop_workers(handle);
+
 	for (i = 0; i < USB_MAX_ENDPOINTS; i++)
 		if (hpriv->endpoints[i] >= 0)
 			close(hpriv->endpoints[i]);
@@ -385,11 +426,15 @@ int
 netbsd_submit_transfer(struct usbi_transfer *itransfer)
 {
 	struct libusb_transfer *transfer;
+	struct transfer_priv *tpriv;
 	int err = 0;
 
 	usbi_dbg(ITRANSFER_CTX(itransfer), " ");
 
 	transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	tpriv = usbi_get_transfer_priv(itransfer);
+	tpriv->cancelled = 0;
+	tpriv->err = 0;
 
 	switch (transfer->type) {
 	case LIBUSB_TRANSFER_TYPE_CONTROL:
@@ -401,7 +446,7 @@ netbsd_submit_transfer(struct usbi_transfer *itransfer)
 			err = LIBUSB_ERROR_NOT_SUPPORTED;
 			break;
 		}
-		err = _sync_gen_transfer(itransfer);
+		err = _async_gen_transfer(itransfer);
 		break;
 	case LIBUSB_TRANSFER_TYPE_BULK:
 	case LIBUSB_TRANSFER_TYPE_INTERRUPT:
@@ -410,7 +455,7 @@ netbsd_submit_transfer(struct usbi_transfer *itransfer)
 			err = LIBUSB_ERROR_NOT_SUPPORTED;
 			break;
 		}
-		err = _sync_gen_transfer(itransfer);
+		err = _async_gen_transfer(itransfer);
 		break;
 	case LIBUSB_TRANSFER_TYPE_BULK_STREAM:
 		err = LIBUSB_ERROR_NOT_SUPPORTED;
@@ -420,7 +465,9 @@ netbsd_submit_transfer(struct usbi_transfer *itransfer)
 	if (err)
 		return err;
 
-	usbi_signal_transfer_completion(itransfer);
+	/* Control transfers are performed inline, the others by a worker */
+	if (transfer->type == LIBUSB_TRANSFER_TYPE_CONTROL)
+		usbi_signal_transfer_completion(itransfer);
 
 	return LIBUSB_SUCCESS;
 }
@@ -428,17 +475,66 @@ netbsd_submit_transfer(struct usbi_transfer *itransfer)
 int
 netbsd_cancel_transfer(struct usbi_transfer *itransfer)
 {
-	UNUSED(itransfer);
+	struct libusb_transfer *transfer;
+	struct handle_priv *hpriv;
+	struct transfer_priv *tpriv;
+	struct endpoint_worker *worker;
+	int err = LIBUSB_ERROR_NOT_SUPPORTED;
 
 	usbi_dbg(ITRANSFER_CTX(itransfer), " ");
 
-	return LIBUSB_ERROR_NOT_SUPPORTED;
+	transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	if (transfer->type == LIBUSB_TRANSFER_TYPE_CONTROL)
+		return err;
+
+	/*
+	 * Only transfers still waiting for the worker can be cancelled,
+	 * there is no way to interrupt the one it is performing.
+	 */
+	hpriv = usbi_get_device_handle_priv(transfer->dev_handle);
+	tpriv = usbi_get_transfer_priv(itransfer);
+	worker = &hpriv->workers[UE_GET_ADDR(transfer->endpoint)];
+
+	usbi_mutex_lock(&worker->lock);
+	if (tpriv->queued) {
+		list_del(&tpriv->list);
+		tpriv->queued = 0;
+		tpriv->cancelled = 1;
+		err = LIBUSB_SUCCESS;
+	}
+	usbi_mutex_unlock(&worker->lock);
+
+	if (err == LIBUSB_SUCCESS)
+		usbi_signal_transfer_completion(itransfer);
+
+	return err;
 }
 
 int
 netbsd_handle_transfer_completion(struct usbi_transfer *itransfer)
 {
-	return usbi_handle_transfer_completion(itransfer, LIBUSB_TRANSFER_COMPLETED);
+	struct transfer_priv *tpriv = usbi_get_transfer_priv(itransfer);
+	enum libusb_transfer_status status;
+
+	if (tpriv->cancelled)
+		return usbi_handle_transfer_cancellation(itransfer);
+
+	switch (tpriv->err) {
+	case 0:
+		status = LIBUSB_TRANSFER_COMPLETED;
+		break;
+	case LIBUSB_ERROR_TIMEOUT:
+		status = LIBUSB_TRANSFER_TIMED_OUT;
+		break;
+	case LIBUSB_ERROR_NO_DEVICE:
+		status = LIBUSB_TRANSFER_NO_DEVICE;
+		break;
+	default:
+		status = LIBUSB_TRANSFER_ERROR;
+		break;
+	}
+
+	return usbi_handle_transfer_completion(itransfer, status);
 }
 
 int
@@ -615,3 +711,124 @@ _sync_gen_transfer(struct usbi_transfer *itransfer)
 
 	return 0;
 }
+
+int
+_async_gen_transfer(struct usbi_transfer *itransfer)
+{
+	struct libusb_transfer *transfer;
+	struct handle_priv *hpriv;
+	struct transfer_priv *tpriv;
+	struct endpoint_worker *worker;
+	int endpt, err;
+
+	transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	hpriv = usbi_get_device_handle_priv(transfer->dev_handle);
+	tpriv = usbi_get_transfer_priv(itransfer);
+
+	endpt = UE_GET_ADDR(transfer->endpoint);
+	if ((err = _start_worker(transfer->dev_handle, endpt)) != 0)
+		return err;
+
+	/* The transfer is timed out by the device, see USB_SET_TIMEOUT */
+	itransfer->timeout_flags |= USBI_TRANSFER_OS_HANDLES_TIMEOUT;
+	tpriv->itransfer = itransfer;
+
+	worker = &hpriv->workers[endpt];
+	usbi_mutex_lock(&worker->lock);
+	list_add_tail(&tpriv->list, &worker->transfers);
+	tpriv->queued = 1;
+	usbi_cond_broadcast(&worker->cond);
+	usbi_mutex_unlock(&worker->lock);
+
+	return 0;
+}
+
+int
+_start_worker(struct libusb_device_handle *handle, int endpt)
+{
+	struct handle_priv *hpriv = usbi_get_device_handle_priv(handle);
+	struct endpoint_worker *worker = &hpriv->workers[endpt];
+	int err = 0;
+
+	usbi_mutex_lock(&hpriv->workers_lock);
+	if (!worker->running) {
+		usbi_mutex_init(&worker->lock);
+		usbi_cond_init(&worker->cond);
+		list_init(&worker->transfers);
+		worker->ctx = HANDLE_CTX(handle);
+		worker->stop = 0;
+
+		err = usbi_thread_create(&worker->thread, _worker_main, worker);
+		if (err) {
+			usbi_err(HANDLE_CTX(handle), "failed to start the worker of endpoint %d", endpt);
+			usbi_cond_destroy(&worker->cond);
+			usbi_mutex_destroy(&worker->lock);
+		} else {
+			worker->running = 1;
+		}
+	}
+	usbi_mutex_unlock(&hpriv->workers_lock);
+
+	return err;
+}
+
+/*
+ * Stop the workers of a handle once they have performed the transfers
+ * already queued to them.
+ */
+void
+_stop_workers(struct libusb_device_handle *handle)
+{
+	struct handle_priv *hpriv = usbi_get_device_handle_priv(handle);
+	struct endpoint_worker *worker;
+	int i;
+
+	usbi_mutex_lock(&hpriv->workers_lock);
+	for (i = 0; i < USB_MAX_ENDPOINTS; i++) {
+		worker = &hpriv->workers[i];
+		if (!worker->running)
+			continue;
+
+		usbi_mutex_lock(&worker->lock);
+		worker->stop = 1;
+		usbi_cond_broadcast(&worker->cond);
+		usbi_mutex_unlock(&worker->lock);
+
+		usbi_thread_join(worker->thread);
+		usbi_cond_destroy(&worker->cond);
+		usbi_mutex_destroy(&worker->lock);
+		worker->running = 0;
+	}
+	usbi_mutex_unlock(&hpriv->workers_lock);
+}
+
+void *
+_worker_main(void *arg)
+{
+	struct endpoint_worker *worker = arg;
+	struct transfer_priv *tpriv;
+
+	usbi_thread_started(worker->ctx, LIBUSB_THREAD_TRANSFER, "libusb_worker");
+
+	usbi_mutex_lock(&worker->lock);
+	for (;;) {
+		while (list_empty(&worker->transfers) && !worker->stop)
+			usbi_cond_wait(&worker->cond, &worker->lock);
+		if (list_empty(&worker->transfers))
+			break;
+
+		tpriv = list_first_entry(&worker->transfers,
+		    struct transfer_priv, list);
+		list_del(&tpriv->list);
+		tpriv->queued = 0;
+		usbi_mutex_unlock(&worker->lock);
+
+		tpriv->err = _sync_gen_transfer(tpriv->itransfer);
+		usbi_signal_transfer_completion(tpriv->itransfer);
+
+		usbi_mutex_lock(&worker->lock);
+	}
+	usbi_mutex_unlock(&worker->lock);
+
+	return NULL;
+}
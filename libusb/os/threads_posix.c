@@ -22,8 +22,11 @@
 #include "libusbi.h"
 
 #include <errno.h>
+#include <string.h>
 #if defined(__ANDROID__)
 # include <unistd.h>
+#elif defined(__APPLE__)
+# include <AvailabilityMacros.h>
 #elif defined(__HAIKU__)
 # include <os/kernel/OS.h>
 #elif defined(__linux__)
@@ -32,6 +35,7 @@
 #elif defined(__NetBSD__)
 # include <lwp.h>
 #elif defined(__OpenBSD__)
+# include <pthread_np.h>
 # include <unistd.h>
 #elif defined(__sun__)
 # include <sys/lwp.h>
@@ -123,3 +127,27 @@ unsigned int usbi_get_tid(void)
 
 	return tl_tid = (unsigned int)tid;
 }
+
+int usbi_thread_set_name(const char *name)
+{
+#if defined(__APPLE__) && MAC_OS_X_VERSION_MIN_REQUIRED >= 1060
+	return pthread_setname_np(name);
+#elif defined(__HAIKU__)
+	return rename_thread(find_thread(NULL), name) == B_OK ? 0 : EINVAL;
+#elif defined(__linux__) && defined(HAVE_PTHREAD_SETNAME_NP)
+	char short_name[16];
+
+	/* the kernel limits names to 15 characters */
+	strncpy(short_name, name, sizeof(short_name) - 1);
+	short_name[sizeof(short_name) - 1] = '\0';
+	return pthread_setname_np(pthread_self(), short_name);
+#elif defined(__NetBSD__)
+	return pthread_setname_np(pthread_self(), "%s", (void *)(uintptr_t)name);
+#elif defined(__OpenBSD__)
+	pthread_set_name_np(pthread_self(), name);
+	return 0;
+#else
+	UNUSED(name);
+	return 0;
+#endif
+}
@@ -75,6 +75,17 @@ static inline void usbi_cond_destroy(usbi_cond_t *cond)
 	PTHREAD_CHECK(pthread_cond_destroy(cond));
 }
 
+typedef pthread_t usbi_thread_t;
+static inline int usbi_thread_create(usbi_thread_t *thread,
+	void *(*start)(void *), void *arg)
+{
+	return pthread_create(thread, NULL, start, arg) == 0 ? 0 : LIBUSB_ERROR_OTHER;
+}
+static inline void usbi_thread_join(usbi_thread_t thread)
+{
+	PTHREAD_CHECK(pthread_join(thread, NULL));
+}
+
 typedef pthread_key_t usbi_tls_key_t;
 static inline void usbi_tls_key_create(usbi_tls_key_t *key)
 {
@@ -95,4 +106,7 @@ static inline void usbi_tls_key_delete(usbi_tls_key_t key)
 
 unsigned int usbi_get_tid(void);
 
+/* name the calling thread, returns 0 or an errno value */
+int usbi_thread_set_name(const char *name);
+
 #endif /* LIBUSB_THREADS_POSIX_H */
@@ -38,3 +38,59 @@ int usbi_cond_timedwait(usbi_cond_t *cond,
 	else
 		return LIBUSB_ERROR_OTHER;
 }
+
+struct usbi_thread_start {
+	void *(*start)(void *);
+	void *arg;
+};
+
+static DWORD WINAPI usbi_thread_main(LPVOID param)
+{
+	struct usbi_thread_start thread_start = *(struct usbi_thread_start *)param;
+
+	free(param);
+	thread_start.start(thread_start.arg);
+	return 0;
+}
+
+typedef HRESULT (WINAPI *usbi_set_thread_description_t)(HANDLE, PCWSTR);
+
+int usbi_thread_set_name(const char *name)
+{
+	usbi_set_thread_description_t set_thread_description;
+	WCHAR wide_name[64];
+	HRESULT hr;
+
+	/* SetThreadDescription() only exists since Windows 10 1607 */
+	set_thread_description = (usbi_set_thread_description_t)(void *)
+		GetProcAddress(GetModuleHandleA("kernel32"), "SetThreadDescription");
+	if (!set_thread_description)
+		return 0;
+
+	if (!MultiByteToWideChar(CP_UTF8, 0, name, -1, wide_name, (int)ARRAYSIZE(wide_name)))
+		return (int)GetLastError();
+
+	hr = set_thread_description(GetCurrentThread(), wide_name);
+	return SUCCEEDED(hr) ? 0 : (int)hr;
+}
+
+int usbi_thread_create(usbi_thread_t *thread,
+	void *(*start)(void *), void *arg)
+{
+	struct usbi_thread_start *thread_start;
+
+	thread_start = malloc(sizeof(*thread_start));
+	if (!thread_start)
+		return LIBUSB_ERROR_NO_MEM;
+
+	thread_start->start = start;
+	thread_start->arg = arg;
+
+	*thread = CreateThread(NULL, 0, usbi_thread_main, thread_start, 0, NULL);
+	if (!*thread) {
+		free(thread_start);
+		return LIBUSB_ERROR_OTHER;
+	}
+
+	return 0;
+}
@@ -86,6 +86,15 @@ static inline void usbi_cond_destroy(usbi_cond_t *cond)
 	UNUSED(cond);
 }
 
+typedef HANDLE usbi_thread_t;
+int usbi_thread_create(usbi_thread_t *thread,
+	void *(*start)(void *), void *arg);
+static inline void usbi_thread_join(usbi_thread_t thread)
+{
+	WINAPI_CHECK(WaitForSingleObject(thread, INFINITE) == WAIT_OBJECT_0);
+	WINAPI_CHECK(CloseHandle(thread));
+}
+
 typedef DWORD usbi_tls_key_t;
 static inline void usbi_tls_key_create(usbi_tls_key_t *key)
 {
@@ -110,4 +119,7 @@ static inline unsigned int usbi_get_tid(void)
 	return (unsigned int)GetCurrentThreadId();
 }
 
+/* name the calling thread, returns 0 or a Windows error code */
+int usbi_thread_set_name(const char *name);
+
 #endif /* LIBUSB_THREADS_WINDOWS_H */
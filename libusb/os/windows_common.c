@@ -425,87 +425,235 @@ static enum windows_version get_windows_version(void)
 	return winver;
 }
 
+// Initial number of slots of the active transfers table, must be a power of 2
+#define ACTIVE_TRANSFERS_MIN_SIZE	64
+
+static size_t active_transfer_slot(struct windows_context_priv *priv, const OVERLAPPED *overlapped)
+{
+	// OVERLAPPED structures are at least pointer aligned, ignore the low bits
+	size_t hash = (size_t)((uintptr_t)overlapped >> 3) * (size_t)2654435761U;
+
+	return hash & (priv->active_transfers_size - 1);
+}
+
+static int active_transfers_grow(struct windows_context_priv *priv)
+{
+	struct windows_transfer_priv **old_slots = priv->active_transfers;
+	size_t old_size = priv->active_transfers_size;
+	size_t i, new_size = old_size ? old_size * 2 : ACTIVE_TRANSFERS_MIN_SIZE;
+
+	priv->active_transfers = calloc(new_size, sizeof(*priv->active_transfers));
+	if (priv->active_transfers == NULL) {
+		priv->active_transfers = old_slots;
+		return LIBUSB_ERROR_NO_MEM;
+	}
+	priv->active_transfers_size = new_size;
+
+	for (i = 0; i < old_size; i++) {
+		struct windows_transfer_priv *transfer_priv = old_slots[i];
+		size_t slot;
+
+		if (transfer_priv == NULL)
+			continue;
+
+		slot = active_transfer_slot(priv, &transfer_priv->overlapped);
+		while (priv->active_transfers[slot] != NULL)
+			slot = (slot + 1) & (new_size - 1);
+		priv->active_transfers[slot] = transfer_priv;
+	}
+
+	free(old_slots);
+	return LIBUSB_SUCCESS;
+}
+
+// Empty a slot of the active transfers table, moving back the entries that
+// follow it so that lookups never stop early at the hole
+// Must be called with the active transfers lock held
+static void active_transfers_clear_slot(struct windows_context_priv *priv, size_t hole)
+{
+	size_t mask = priv->active_transfers_size - 1;
+	size_t slot = hole;
+
+	priv->active_transfers[hole] = NULL;
+	while (true) {
+		struct windows_transfer_priv *transfer_priv;
+		size_t home;
+
+		slot = (slot + 1) & mask;
+		transfer_priv = priv->active_transfers[slot];
+		if (transfer_priv == NULL)
+			return;
+
+		// The entry can fill the hole unless it is still between its home
+		// slot and the hole
+		home = active_transfer_slot(priv, &transfer_priv->overlapped);
+		if (((slot - home) & mask) < ((slot - hole) & mask))
+			continue;
+
+		priv->active_transfers[hole] = transfer_priv;
+		priv->active_transfers[slot] = NULL;
+		hole = slot;
+	}
+}
+
+static int active_transfers_add(struct windows_context_priv *priv, struct windows_transfer_priv *transfer_priv)
+{
+	size_t slot;
+	int r = LIBUSB_SUCCESS;
+
+	usbi_mutex_lock(&priv->active_transfers_lock);
+	// Keep the table at most half full
+	if ((priv->active_transfers_count + 1) * 2 > priv->active_transfers_size)
+		r = active_transfers_grow(priv);
+
+	if (r == LIBUSB_SUCCESS) {
+		slot = active_transfer_slot(priv, &transfer_priv->overlapped);
+		while (priv->active_transfers[slot] != NULL)
+			slot = (slot + 1) & (priv->active_transfers_size - 1);
+		priv->active_transfers[slot] = transfer_priv;
+		priv->active_transfers_count++;
+	}
+	usbi_mutex_unlock(&priv->active_transfers_lock);
+
+	return r;
+}
+
+// Remove the transfer that owns an OVERLAPPED from the active transfers table
+// The OVERLAPPED is never dereferenced, since it might not belong to libusb
+static struct windows_transfer_priv *active_transfers_take(struct windows_context_priv *priv, const OVERLAPPED *overlapped)
+{
+	struct windows_transfer_priv *transfer_priv = NULL;
+	size_t slot;
+
+	usbi_mutex_lock(&priv->active_transfers_lock);
+	if (priv->active_transfers_count) {
+		slot = active_transfer_slot(priv, overlapped);
+		while (priv->active_transfers[slot] != NULL) {
+			if (&priv->active_transfers[slot]->overlapped == overlapped) {
+				transfer_priv = priv->active_transfers[slot];
+				active_transfers_clear_slot(priv, slot);
+				priv->active_transfers_count--;
+				break;
+			}
+			slot = (slot + 1) & (priv->active_transfers_size - 1);
+		}
+	}
+	usbi_mutex_unlock(&priv->active_transfers_lock);
+
+	return transfer_priv;
+}
+
+// Forget the transfers still in flight on a device handle that is being
+// closed, so that late completion packets for them are ignored
+static void active_transfers_remove_handle(struct windows_context_priv *priv, struct libusb_device_handle *dev_handle)
+{
+	size_t slot = 0;
+
+	usbi_mutex_lock(&priv->active_transfers_lock);
+	while (slot < priv->active_transfers_size && priv->active_transfers_count) {
+		struct windows_transfer_priv *transfer_priv = priv->active_transfers[slot];
+
+		if (transfer_priv != NULL && transfer_priv->dev_handle == dev_handle) {
+			// Check the same slot again, another entry may have moved in
+			active_transfers_clear_slot(priv, slot);
+			priv->active_transfers_count--;
+			continue;
+		}
+		slot++;
+	}
+	usbi_mutex_unlock(&priv->active_transfers_lock);
+}
+
+// Maximum number of completion packets dequeued at once by an I/O completion thread
+#define IOCP_BATCH_SIZE	64
+
 static unsigned __stdcall windows_iocp_thread(void *arg)
 {
 	struct libusb_context *ctx = arg;
 	struct windows_context_priv *priv = usbi_get_context_priv(ctx);
 	HANDLE iocp = priv->completion_port;
-	DWORD num_bytes;
-	ULONG_PTR completion_key;
-	OVERLAPPED *overlapped;
-	struct libusb_device_handle *dev_handle;
-	struct libusb_device_handle *opened_device_handle;
-	struct windows_device_handle_priv *handle_priv;
+	OVERLAPPED_ENTRY entries[IOCP_BATCH_SIZE];
+	ULONG i, num_entries;
 	struct windows_transfer_priv *transfer_priv;
 	struct usbi_transfer *itransfer;
-	bool found;
+	bool quit = false;
 
+	usbi_thread_started(ctx, LIBUSB_THREAD_COMPLETION, "libusb_iocp");
 	usbi_dbg(ctx, "I/O completion thread started");
 
-	while (true) {
-		overlapped = NULL;
-		if (!GetQueuedCompletionStatus(iocp, &num_bytes, &completion_key, &overlapped, INFINITE) && (overlapped == NULL)) {
-			usbi_err(ctx, "GetQueuedCompletionStatus failed: %s", windows_error_str(0));
+	while (!quit) {
+		if (!GetQueuedCompletionStatusEx(iocp, entries, IOCP_BATCH_SIZE, &num_entries, INFINITE, FALSE)) {
+			usbi_err(ctx, "GetQueuedCompletionStatusEx failed: %s", windows_error_str(0));
 			break;
 		}
 
-		if (overlapped == NULL) {
-			// Signal to quit
-			if (completion_key != (ULONG_PTR)ctx)
-				usbi_err(ctx, "program assertion failed - overlapped is NULL");
-			break;
-		}
+		for (i = 0; i < num_entries; i++) {
+			OVERLAPPED *overlapped = entries[i].lpOverlapped;
+			ULONG_PTR completion_key = entries[i].lpCompletionKey;
 
-		// Find the transfer associated with the OVERLAPPED that just completed.
-		// If we cannot find a match, the I/O operation originated from outside of libusb
-		// (e.g. within libusbK) and we need to ignore it.
-		dev_handle = (struct libusb_device_handle *)completion_key;
-
-		found = false;
-		transfer_priv = NULL;
-
-		// Issue 912: lock opened device handles in context to search the current device handle
-		// to avoid accessing unallocated memory after device has been closed
-		usbi_mutex_lock(&ctx->open_devs_lock);
-		for_each_open_device(ctx, opened_device_handle) {
-			if (dev_handle == opened_device_handle) {
-				handle_priv = usbi_get_device_handle_priv(dev_handle);
-
-				usbi_mutex_lock(&dev_handle->lock);
-				list_for_each_entry(transfer_priv, &handle_priv->active_transfers, list, struct windows_transfer_priv) {
-					if (overlapped == &transfer_priv->overlapped) {
-						// This OVERLAPPED belongs to us, remove the transfer from the device handle's list
-						list_del(&transfer_priv->list);
-						found = true;
-						break;
-					}
-				}
-				usbi_mutex_unlock(&dev_handle->lock);
+			if (overlapped == NULL) {
+				// Signal to quit, finish the batch first since it may hold
+				// completions that were dequeued along with it
+				if (completion_key != (ULONG_PTR)ctx)
+					usbi_err(ctx, "program assertion failed - overlapped is NULL");
+				quit = true;
+				continue;
 			}
-		}
-		usbi_mutex_unlock(&ctx->open_devs_lock);
 
-		if (!found) {
-			usbi_dbg(ctx, "ignoring overlapped %p for handle %p",
-				 overlapped, dev_handle);
-			continue;
-		}
+			// Find the transfer associated with the OVERLAPPED that just completed.
+			// If we cannot find a match, the I/O operation originated from outside of libusb
+			// (e.g. within libusbK) and we need to ignore it.
+			// Issue 912: the transfers of a device handle are dropped from the table when
+			// the handle is closed, so neither the handle nor the OVERLAPPED is accessed
+			// unless the transfer is known to be alive
+			transfer_priv = active_transfers_take(priv, overlapped);
+			if (transfer_priv == NULL) {
+				usbi_dbg(ctx, "ignoring overlapped %p for handle %p",
+					 overlapped, (void *)completion_key);
+				continue;
+			}
 
-		itransfer = (struct usbi_transfer *)((unsigned char *)transfer_priv + PTR_ALIGN(sizeof(*transfer_priv)));
-		usbi_dbg(ctx, "transfer %p completed, length %lu",
-			 USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer), ULONG_CAST(num_bytes));
-		usbi_signal_transfer_completion(itransfer);
+			itransfer = (struct usbi_transfer *)((unsigned char *)transfer_priv + PTR_ALIGN(sizeof(*transfer_priv)));
+			usbi_dbg(ctx, "transfer %p completed, length %lu",
+				 USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer), ULONG_CAST(entries[i].dwNumberOfBytesTransferred));
+			usbi_signal_transfer_completion(itransfer);
+		}
 	}
 
+	// Pass the signal to quit on to the next thread of the pool
+	if (quit && !PostQueuedCompletionStatus(iocp, 0, (ULONG_PTR)ctx, NULL))
+		usbi_err(ctx, "failed to post I/O completion: %s", windows_error_str(0));
+
 	usbi_dbg(ctx, "I/O completion thread exiting");
 
 	return 0;
 }
 
+static void windows_stop_iocp_threads(struct libusb_context *ctx, unsigned int num_threads)
+{
+	struct windows_context_priv *priv = usbi_get_context_priv(ctx);
+	unsigned int i;
+
+	if (num_threads == 0)
+		return;
+
+	// A NULL completion status will indicate to the threads that it is time to exit.
+	// Each thread reposts it before exiting, so a single one reaches all of them.
+	if (!PostQueuedCompletionStatus(priv->completion_port, 0, (ULONG_PTR)ctx, NULL))
+		usbi_err(ctx, "failed to post I/O completion: %s", windows_error_str(0));
+
+	for (i = 0; i < num_threads; i++) {
+		if (WaitForSingleObject(priv->completion_port_threads[i], INFINITE) == WAIT_FAILED)
+			usbi_err(ctx, "failed to wait for I/O completion port thread: %s", windows_error_str(0));
+		CloseHandle(priv->completion_port_threads[i]);
+	}
+}
+
 static int windows_init(struct libusb_context *ctx)
 {
 	struct windows_context_priv *priv = usbi_get_context_priv(ctx);
 	bool winusb_backend_init = false;
+	unsigned int i;
 	int r;
 
 	// NB: concurrent usage supposes that init calls are equally balanced with
@@ -547,21 +695,46 @@ static int windows_init(struct libusb_context *ctx)
 
 	r = LIBUSB_ERROR_NO_MEM;
 
+	usbi_mutex_init(&priv->active_transfers_lock);
+	if (active_transfers_grow(priv) != LIBUSB_SUCCESS) {
+		usbi_mutex_destroy(&priv->active_transfers_lock);
+		goto init_exit;
+	}
+
+	priv->num_completion_port_threads = ctx->io_threads ? (unsigned int)ctx->io_threads : 1;
+	priv->completion_port_threads = calloc(priv->num_completion_port_threads, sizeof(HANDLE));
+	if (priv->completion_port_threads == NULL) {
+		free(priv->active_transfers);
+		usbi_mutex_destroy(&priv->active_transfers_lock);
+		goto init_exit;
+	}
+
 	// Use an I/O completion port to manage all transfers for this context
-	priv->completion_port = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 1);
+	priv->completion_port = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0,
+		(DWORD)priv->num_completion_port_threads);
 	if (priv->completion_port == NULL) {
 		usbi_err(ctx, "failed to create I/O completion port: %s", windows_error_str(0));
+		free(priv->completion_port_threads);
+		free(priv->active_transfers);
+		usbi_mutex_destroy(&priv->active_transfers_lock);
 		goto init_exit;
 	}
 
-	// And a dedicated thread to wait for I/O completions
-	priv->completion_port_thread = (HANDLE)_beginthreadex(NULL, 0, windows_iocp_thread, ctx, 0, NULL);
-	if (priv->completion_port_thread == NULL) {
-		usbi_err(ctx, "failed to create I/O completion port thread");
-		CloseHandle(priv->completion_port);
-		goto init_exit;
+	// And dedicated threads to wait for I/O completions
+	for (i = 0; i < priv->num_completion_port_threads; i++) {
+		priv->completion_port_threads[i] = (HANDLE)_beginthreadex(NULL, 0, windows_iocp_thread, ctx, 0, NULL);
+		if (priv->completion_port_threads[i] == NULL) {
+			usbi_err(ctx, "failed to create I/O completion port thread");
+			windows_stop_iocp_threads(ctx, i);
+			CloseHandle(priv->completion_port);
+			free(priv->completion_port_threads);
+			free(priv->active_transfers);
+			usbi_mutex_destroy(&priv->active_transfers_lock);
+			goto init_exit;
+		}
 	}
 
+	usbi_mutex_init(&priv->scan_cache_lock);
 	r = LIBUSB_SUCCESS;
 
 init_exit: // Holds semaphore here
@@ -582,16 +755,18 @@ init_exit: // Holds semaphore here
 static void windows_exit(struct libusb_context *ctx)
 {
 	struct windows_context_priv *priv = usbi_get_context_priv(ctx);
+	size_t i;
 
-	// A NULL completion status will indicate to the thread that it is time to exit
-	if (!PostQueuedCompletionStatus(priv->completion_port, 0, (ULONG_PTR)ctx, NULL))
-		usbi_err(ctx, "failed to post I/O completion: %s", windows_error_str(0));
-
-	if (WaitForSingleObject(priv->completion_port_thread, INFINITE) == WAIT_FAILED)
-		usbi_err(ctx, "failed to wait for I/O completion port thread: %s", windows_error_str(0));
-
-	CloseHandle(priv->completion_port_thread);
+	windows_stop_iocp_threads(ctx, priv->num_completion_port_threads);
+	free(priv->completion_port_threads);
 	CloseHandle(priv->completion_port);
+	free(priv->active_transfers);
+	usbi_mutex_destroy(&priv->active_transfers_lock);
+
+	for (i = 0; i < priv->scan_cache_len; i++)
+		libusb_unref_device(priv->scan_cache[i]);
+	free(priv->scan_cache);
+	usbi_mutex_destroy(&priv->scan_cache_lock);
 
 	// Only works if exits and inits are balanced exactly
 	if (--init_count == 0) { // Last exit
@@ -634,15 +809,15 @@ static int windows_get_device_list(struct libusb_context *ctx, struct discovered
 static int windows_open(struct libusb_device_handle *dev_handle)
 {
 	struct windows_context_priv *priv = usbi_get_context_priv(HANDLE_CTX(dev_handle));
-	struct windows_device_handle_priv *handle_priv = usbi_get_device_handle_priv(dev_handle);
 
-	list_init(&handle_priv->active_transfers);
 	return priv->backend->open(dev_handle);
 }
 
 static void windows_close(struct libusb_device_handle *dev_handle)
 {
 	struct windows_context_priv *priv = usbi_get_context_priv(HANDLE_CTX(dev_handle));
+
+	active_transfers_remove_handle(priv, dev_handle);
 	priv->backend->close(dev_handle);
 }
 
@@ -724,7 +899,6 @@ static int windows_submit_transfer(struct usbi_transfer *itransfer)
 	struct libusb_device_handle *dev_handle = transfer->dev_handle;
 	struct libusb_context *ctx = HANDLE_CTX(dev_handle);
 	struct windows_context_priv *priv = usbi_get_context_priv(ctx);
-	struct windows_device_handle_priv *handle_priv = usbi_get_device_handle_priv(dev_handle);
 	struct windows_transfer_priv *transfer_priv = usbi_get_transfer_priv(itransfer);
 	int r;
 
@@ -747,17 +921,17 @@ static int windows_submit_transfer(struct usbi_transfer *itransfer)
 		transfer_priv->handle = NULL;
 	}
 
-	// Add transfer to the device handle's list
-	usbi_mutex_lock(&dev_handle->lock);
-	list_add_tail(&transfer_priv->list, &handle_priv->active_transfers);
-	usbi_mutex_unlock(&dev_handle->lock);
+	// Add transfer to the active transfers before the I/O can complete
+	transfer_priv->dev_handle = dev_handle;
+	transfer_priv->backend = priv->backend;
+	r = active_transfers_add(priv, transfer_priv);
+	if (r != LIBUSB_SUCCESS)
+		return r;
 
 	r = priv->backend->submit_transfer(itransfer);
 	if (r != LIBUSB_SUCCESS) {
-		// Remove the unsuccessful transfer from the device handle's list
-		usbi_mutex_lock(&dev_handle->lock);
-		list_del(&transfer_priv->list);
-		usbi_mutex_unlock(&dev_handle->lock);
+		// Remove the unsuccessful transfer from the active transfers
+		active_transfers_take(priv, &transfer_priv->overlapped);
 
 		// Always call the backend's clear_transfer_priv() function on failure
 		priv->backend->clear_transfer_priv(itransfer);
@@ -854,6 +1028,16 @@ static int windows_handle_transfer_completion(struct usbi_transfer *itransfer)
 		return usbi_handle_transfer_completion(itransfer, status);
 }
 
+static void windows_destroy_transfer_priv(struct usbi_transfer *itransfer)
+{
+	struct windows_transfer_priv *transfer_priv = usbi_get_transfer_priv(itransfer);
+
+	// The transfer may outlive its context, so use the backend recorded at
+	// submission. A transfer that was never submitted holds nothing.
+	if (transfer_priv->backend != NULL && transfer_priv->backend->destroy_transfer_priv != NULL)
+		transfer_priv->backend->destroy_transfer_priv(itransfer);
+}
+
 #ifndef HAVE_CLOCK_GETTIME
 void usbi_get_monotonic_time(struct timespec *tp)
 {
@@ -896,6 +1080,7 @@ const struct usbi_os_backend usbi_backend = {
 	windows_get_active_config_descriptor,
 	windows_get_config_descriptor,
 	windows_get_config_descriptor_by_value,
+	NULL,	/* get_device_string */
 	windows_get_configuration,
 	windows_set_configuration,
 	windows_claim_interface,
@@ -907,13 +1092,19 @@ const struct usbi_os_backend usbi_backend = {
 	NULL,	/* free_streams */
 	NULL,	/* dev_mem_alloc */
 	NULL,	/* dev_mem_free */
+	NULL,	/* host_mem_alloc */
+	NULL,	/* host_mem_free */
 	NULL,	/* kernel_driver_active */
 	NULL,	/* detach_kernel_driver */
 	NULL,	/* attach_kernel_driver */
 	windows_destroy_device,
 	windows_submit_transfer,
 	windows_cancel_transfer,
+	NULL,	/* cancel_endpoint_transfers */
 	NULL,	/* clear_transfer_priv */
+	windows_destroy_transfer_priv,
+	NULL,	/* sync_control_transfer */
+	NULL,	/* sync_bulk_transfer */
 	NULL,	/* handle_events */
 	windows_handle_transfer_completion,
 	sizeof(struct windows_context_priv),
@@ -282,6 +282,22 @@ enum WINUSB_ZLP {
 	WINUSB_ZLP_ON = 2
 };
 
+// Registering an isoch buffer with Microsoft WinUSB pins and maps it, so the
+// registration a transfer makes is kept for its later submissions of the same
+// buffer, in a small per-handle table
+#define WINUSB_ISOCH_REGISTRATIONS	32
+
+struct winusb_isoch_registration {
+	void *isoch_buffer_handle; // NULL if the slot is free
+	HANDLE api_handle;
+	uint8_t endpoint;
+	unsigned char *buffer;
+	int length;
+	struct usbi_transfer *owner; // The transfer that made the registration
+	bool in_use; // Whether the owner is in flight
+	bool stale; // Whether to unregister once the owner completes
+};
+
 struct winusb_device_handle_priv {
 	int active_interface;
 	struct {
@@ -290,6 +306,8 @@ struct winusb_device_handle_priv {
 		uint8_t zlp[USB_MAXENDPOINTS]; // Current per-endpoint SHORT_PACKET_TERMINATE status (enum WINUSB_ZLP)
 	} interface_handle[USB_MAXINTERFACES];
 	int autoclaim_count[USB_MAXINTERFACES]; // For auto-release
+	// Protected by the dev_handle lock
+	struct winusb_isoch_registration isoch_registrations[WINUSB_ISOCH_REGISTRATIONS];
 };
 
 struct usbdk_transfer_priv {
@@ -309,7 +327,9 @@ struct winusb_transfer_priv {
 	void *iso_context;
 
 	// For isochronous transfers with Microsoft WinUSB driver:
-	void *isoch_buffer_handle; // The isoch_buffer_handle to free at the end of the transfer
+	void *isoch_buffer_handle; // The isoch_buffer_handle to free at the end of the transfer, if not kept
+	int isoch_registration; // 1-based slot of the kept registration, 0 if none
+	struct libusb_device_handle *isoch_dev_handle; // The device handle whose table holds that slot
 	BOOL iso_break_stream;	// Whether the isoch. stream was to be continued in the last call of libusb_submit_transfer.
 							// As we this structure is zeroed out upon initialization, we need to use inverse logic here.
 	libusb_transfer_cb_fn iso_user_callback; // Original transfer callback of the user. Might be used for isochronous transfers.
@@ -341,6 +361,7 @@ struct windows_backend {
 	int (*submit_transfer)(struct usbi_transfer *itransfer);
 	int (*cancel_transfer)(struct usbi_transfer *itransfer);
 	void (*clear_transfer_priv)(struct usbi_transfer *itransfer);
+	void (*destroy_transfer_priv)(struct usbi_transfer *itransfer);
 	enum libusb_transfer_status (*copy_transfer_data)(struct usbi_transfer *itransfer, DWORD length);
 	int (*set_option)(struct libusb_context *ctx, enum libusb_option option, va_list args);
 };
@@ -348,7 +369,25 @@ struct windows_backend {
 struct windows_context_priv {
 	const struct windows_backend *backend;
 	HANDLE completion_port;
-	HANDLE completion_port_thread;
+	HANDLE *completion_port_threads;
+	unsigned int num_completion_port_threads;
+
+	// In-flight transfers, hashed by the address of their OVERLAPPED so
+	// that the I/O completion thread can match a completion packet without
+	// walking the open device handles
+	usbi_mutex_t active_transfers_lock;
+	struct windows_transfer_priv **active_transfers;
+	size_t active_transfers_size;
+	size_t active_transfers_count;
+
+	// WinUSB: devices found by the last enumeration, each holding a
+	// reference. They are reported again as long as PnP notifications
+	// have not seen any device or interface change since.
+	usbi_mutex_t scan_cache_lock;
+	long scan_cache_changes;
+	struct libusb_device **scan_cache;
+	size_t scan_cache_len;
+	bool scan_cache_valid;
 };
 
 union windows_device_priv {
@@ -357,7 +396,6 @@ union windows_device_priv {
 };
 
 struct windows_device_handle_priv {
-	struct list_head active_transfers;
 	union {
 		struct usbdk_device_handle_priv usbdk_priv;
 		struct winusb_device_handle_priv winusb_priv;
@@ -367,7 +405,8 @@ struct windows_device_handle_priv {
 struct windows_transfer_priv {
 	OVERLAPPED overlapped;
 	HANDLE handle;
-	struct list_head list;
+	struct libusb_device_handle *dev_handle;
+	const struct windows_backend *backend; // The backend the transfer was last submitted with
 	union {
 		struct usbdk_transfer_priv usbdk_priv;
 		struct winusb_transfer_priv winusb_priv;
@@ -233,7 +233,7 @@ static void usbdk_release_config_descriptors(struct usbdk_device_priv *priv, uin
 	uint8_t i;
 
 	for (i = 0; i < count; i++)
-		usbdk_helper.ReleaseConfigurationDescriptor(priv->config_descriptors[i]);
+		usbi_desc_store_put(priv->config_descriptors[i]);
 
 	free(priv->config_descriptors);
 	priv->config_descriptors = NULL;
@@ -253,14 +253,24 @@ static int usbdk_cache_config_descriptors(struct libusb_context *ctx,
 	}
 
 	for (i = 0; i < info->DeviceDescriptor.bNumConfigurations; i++) {
+		PUSB_CONFIGURATION_DESCRIPTOR desc;
 		ULONG Length;
 
 		Request.Index = i;
-		if (!usbdk_helper.GetConfigurationDescriptor(&Request, &priv->config_descriptors[i], &Length)) {
+		if (!usbdk_helper.GetConfigurationDescriptor(&Request, &desc, &Length)) {
 			usbi_err(ctx, "failed to retrieve configuration descriptors");
 			usbdk_release_config_descriptors(priv, i);
 			return LIBUSB_ERROR_OTHER;
 		}
+
+		/* keep a copy shared with identical devices instead */
+		priv->config_descriptors[i] = usbi_desc_store_get(desc, Length);
+		usbdk_helper.ReleaseConfigurationDescriptor(desc);
+		if (priv->config_descriptors[i] == NULL) {
+			usbi_err(ctx, "failed to store configuration descriptors");
+			usbdk_release_config_descriptors(priv, i);
+			return LIBUSB_ERROR_NO_MEM;
+		}
 	}
 
 	return LIBUSB_SUCCESS;
@@ -720,6 +730,7 @@ const struct windows_backend usbdk_backend = {
 	usbdk_submit_transfer,
 	NULL,	/* cancel_transfer */
 	usbdk_clear_transfer_priv,
+	NULL,	/* destroy_transfer_priv */
 	usbdk_copy_transfer_data,
 	NULL /* usbdk_set_option */,
 };
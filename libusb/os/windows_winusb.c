@@ -89,6 +89,11 @@ static enum libusb_transfer_status composite_copy_transfer_data(int sub_api, str
 
 static usbi_mutex_t autoclaim_lock;
 
+// PnP change notifications, shared by all contexts
+static HANDLE pnp_notifications[2];
+static bool pnp_notifications_active;
+static usbi_atomic_t pnp_changes;
+
 // API globals
 static struct winusb_interface WinUSBX[SUB_API_MAX];
 #define CHECK_WINUSBX_AVAILABLE(sub_api)		\
@@ -179,6 +184,8 @@ static bool init_dlls(struct libusb_context *ctx)
 	DLL_GET_HANDLE(ctx, Cfgmgr32);
 	DLL_LOAD_FUNC(Cfgmgr32, CM_Get_Parent, true);
 	DLL_LOAD_FUNC(Cfgmgr32, CM_Get_Child, true);
+	DLL_LOAD_FUNC_PREFIXED(Cfgmgr32, p, CM_Register_Notification, false);
+	DLL_LOAD_FUNC_PREFIXED(Cfgmgr32, p, CM_Unregister_Notification, false);
 
 	// Prefixed to avoid conflict with header files
 	DLL_GET_HANDLE(ctx, AdvAPI32);
@@ -679,6 +686,71 @@ static void auto_release(struct usbi_transfer *itransfer)
 	usbi_mutex_unlock(&autoclaim_lock);
 }
 
+/*
+ * PnP notifications, counting device and interface changes so that the
+ * result of an enumeration can be reused until something changed
+ */
+static DWORD CALLBACK pnp_notification_cb(HANDLE notify, PVOID context,
+	DWORD action, PVOID event_data, DWORD event_data_size)
+{
+	UNUSED(notify);
+	UNUSED(context);
+	UNUSED(action);
+	UNUSED(event_data);
+	UNUSED(event_data_size);
+
+	usbi_atomic_inc(&pnp_changes);
+	return ERROR_SUCCESS;
+}
+
+static void unregister_pnp_notifications(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAYSIZE(pnp_notifications); i++) {
+		if (pnp_notifications[i] != NULL) {
+			pCM_Unregister_Notification(pnp_notifications[i]);
+			pnp_notifications[i] = NULL;
+		}
+	}
+	pnp_notifications_active = false;
+}
+
+static void register_pnp_notifications(struct libusb_context *ctx)
+{
+	struct libusb_cm_notify_filter filter;
+	CONFIGRET r;
+
+	if (pCM_Register_Notification == NULL || pCM_Unregister_Notification == NULL) {
+		usbi_dbg(ctx, "PnP notifications not available, enumerating on every call");
+		return;
+	}
+
+	// Interfaces come and go with drivers, device instances cover the
+	// devices that have none
+	memset(&filter, 0, sizeof(filter));
+	filter.cbSize = sizeof(filter);
+	filter.Flags = USBI_CM_NOTIFY_FILTER_FLAG_ALL_INTERFACE_CLASSES;
+	filter.FilterType = USBI_CM_NOTIFY_FILTER_TYPE_DEVICEINTERFACE;
+	r = pCM_Register_Notification(&filter, NULL, pnp_notification_cb, &pnp_notifications[0]);
+	if (r == CR_SUCCESS) {
+		memset(&filter, 0, sizeof(filter));
+		filter.cbSize = sizeof(filter);
+		filter.Flags = USBI_CM_NOTIFY_FILTER_FLAG_ALL_DEVICE_INSTANCES;
+		filter.FilterType = USBI_CM_NOTIFY_FILTER_TYPE_DEVICEINSTANCE;
+		r = pCM_Register_Notification(&filter, NULL, pnp_notification_cb, &pnp_notifications[1]);
+	}
+
+	if (r != CR_SUCCESS) {
+		usbi_warn(ctx, "could not register for PnP notifications (%lu), enumerating on every call",
+			(unsigned long)r);
+		unregister_pnp_notifications();
+		return;
+	}
+
+	pnp_notifications_active = true;
+}
+
 /*
  * init: libusb backend init function
  */
@@ -702,6 +774,8 @@ static int winusb_init(struct libusb_context *ctx)
 	// We need a lock for proper auto-release
 	usbi_mutex_init(&autoclaim_lock);
 
+	register_pnp_notifications(ctx);
+
 	return LIBUSB_SUCCESS;
 }
 
@@ -714,6 +788,7 @@ static void winusb_exit(struct libusb_context *ctx)
 
 	UNUSED(ctx);
 
+	unregister_pnp_notifications();
 	usbi_mutex_destroy(&autoclaim_lock);
 
 	for (i = 0; i < USB_API_MAX; i++) {
@@ -816,9 +891,10 @@ static void cache_config_descriptors(struct libusb_device *dev, HANDLE hub_handl
 		usbi_dbg(ctx, "cached config descriptor %u (bConfigurationValue=%u, %u bytes)",
 			i, cd_data->bConfigurationValue, cd_data->wTotalLength);
 
-		// Cache the descriptor
-		priv->config_descriptor[i] = cd_data;
-		cd_buf_actual = NULL;
+		// Cache the descriptor, shared with identical devices
+		priv->config_descriptor[i] = usbi_desc_store_get(cd_data, cd_data->wTotalLength);
+		if (priv->config_descriptor[i] == NULL)
+			usbi_err(ctx, "could not store configuration descriptor %u for '%s'", i, priv->dev_id);
 	}
 }
 
@@ -868,30 +944,22 @@ static int alloc_root_hub_config_desc(struct libusb_device *dev, ULONG num_ports
 	uint8_t config_desc_length, uint8_t ep_interval)
 {
 	struct winusb_device_priv *priv = usbi_get_device_priv(dev);
-	uint8_t *ptr;
+	uint8_t desc[sizeof(root_hub_config_descriptor_template)];
 
-	priv->config_descriptor = malloc(sizeof(*priv->config_descriptor));
+	priv->config_descriptor = calloc(1, sizeof(*priv->config_descriptor));
 	if (priv->config_descriptor == NULL)
 		return LIBUSB_ERROR_NO_MEM;
 
-	// Most config descriptors come from cache_config_descriptors() which obtains the
-	// descriptors from the hub using an allocated USB_DESCRIPTOR_REQUEST structure.
-	// To avoid an extra malloc + memcpy we just hold on to the USB_DESCRIPTOR_REQUEST
-	// structure we already have and back up the pointer in windows_device_priv_release()
-	// when freeing the descriptors. To keep a single execution path, we need to offset
-	// the pointer here by the same amount.
-	ptr = malloc(USB_DESCRIPTOR_REQUEST_SIZE + config_desc_length);
-	if (ptr == NULL)
-		return LIBUSB_ERROR_NO_MEM;
-
-	ptr += USB_DESCRIPTOR_REQUEST_SIZE;
+	// Like the descriptors from cache_config_descriptors(), the root hub descriptors go
+	// through the descriptor store, where the hubs with the same port count share them.
+	memcpy(desc, root_hub_config_descriptor_template, config_desc_length);
+	desc[CONFIG_DESC_WTOTAL_LENGTH_OFFSET] = config_desc_length;
+	desc[CONFIG_DESC_EP_MAX_PACKET_OFFSET] = (uint8_t)((num_ports + 7) / 8);
+	desc[CONFIG_DESC_EP_BINTERVAL_OFFSET] = ep_interval;
 
-	memcpy(ptr, root_hub_config_descriptor_template, config_desc_length);
-	ptr[CONFIG_DESC_WTOTAL_LENGTH_OFFSET] = config_desc_length;
-	ptr[CONFIG_DESC_EP_MAX_PACKET_OFFSET] = (uint8_t)((num_ports + 7) / 8);
-	ptr[CONFIG_DESC_EP_BINTERVAL_OFFSET] = ep_interval;
-
-	priv->config_descriptor[0] = (PUSB_CONFIGURATION_DESCRIPTOR)ptr;
+	priv->config_descriptor[0] = usbi_desc_store_get(desc, config_desc_length);
+	if (priv->config_descriptor[0] == NULL)
+		return LIBUSB_ERROR_NO_MEM;
 	priv->active_config = 1;
 
 	return 0;
@@ -1585,9 +1653,9 @@ exit:
 }
 
 /*
- * get_device_list: libusb backend device enumeration function
+ * Enumerate all the devices through SetupAPI, appending them to *_discdevs
  */
-static int winusb_get_device_list(struct libusb_context *ctx, struct discovered_devs **_discdevs)
+static int scan_devices(struct libusb_context *ctx, struct discovered_devs **_discdevs)
 {
 	struct discovered_devs *discdevs;
 	HDEVINFO *dev_info, dev_info_intf, dev_info_enum;
@@ -2018,6 +2086,71 @@ static int winusb_get_device_list(struct libusb_context *ctx, struct discovered_
 	return r;
 }
 
+static void clear_scan_cache(struct windows_context_priv *priv)
+{
+	size_t i;
+
+	for (i = 0; i < priv->scan_cache_len; i++)
+		libusb_unref_device(priv->scan_cache[i]);
+	free(priv->scan_cache);
+	priv->scan_cache = NULL;
+	priv->scan_cache_len = 0;
+	priv->scan_cache_valid = false;
+}
+
+/*
+ * get_device_list: libusb backend device enumeration function
+ *
+ * A scan goes through SetupAPI several times and queries each device, so
+ * its result is reported again for as long as no PnP change was notified.
+ * Devices that were seen before are not queried again either way, as
+ * init_device() skips them.
+ */
+static int winusb_get_device_list(struct libusb_context *ctx, struct discovered_devs **_discdevs)
+{
+	struct windows_context_priv *priv = usbi_get_context_priv(ctx);
+	struct discovered_devs *discdevs;
+	size_t first, i;
+	long changes;
+	int r;
+
+	usbi_mutex_lock(&priv->scan_cache_lock);
+	changes = (long)usbi_atomic_load(&pnp_changes);
+	if (pnp_notifications_active && priv->scan_cache_valid && priv->scan_cache_changes == changes) {
+		for (i = 0; i < priv->scan_cache_len; i++) {
+			discdevs = discovered_devs_append(*_discdevs, priv->scan_cache[i]);
+			if (discdevs == NULL) {
+				usbi_mutex_unlock(&priv->scan_cache_lock);
+				return LIBUSB_ERROR_NO_MEM;
+			}
+			*_discdevs = discdevs;
+		}
+		usbi_dbg(ctx, "no PnP change since the last scan, reusing its %u devices",
+			(unsigned int)priv->scan_cache_len);
+		usbi_mutex_unlock(&priv->scan_cache_lock);
+		return LIBUSB_SUCCESS;
+	}
+
+	clear_scan_cache(priv);
+	first = (*_discdevs)->len;
+	r = scan_devices(ctx, _discdevs);
+	if (r == LIBUSB_SUCCESS && pnp_notifications_active) {
+		size_t len = (*_discdevs)->len - first;
+
+		priv->scan_cache = malloc((len + 1) * sizeof(*priv->scan_cache));
+		if (priv->scan_cache != NULL) {
+			for (i = 0; i < len; i++)
+				priv->scan_cache[i] = libusb_ref_device((*_discdevs)->devices[first + i]);
+			priv->scan_cache_len = len;
+			priv->scan_cache_changes = changes;
+			priv->scan_cache_valid = true;
+		}
+	}
+	usbi_mutex_unlock(&priv->scan_cache_lock);
+
+	return r;
+}
+
 static int winusb_get_config_descriptor(struct libusb_device *dev, uint8_t config_index, void *buffer, size_t len)
 {
 	struct winusb_device_priv *priv = usbi_get_device_priv(dev);
@@ -2191,6 +2324,157 @@ static void winusb_destroy_device(struct libusb_device *dev)
 	winusb_device_priv_release(dev);
 }
 
+static void isoch_registration_release(struct libusb_device_handle *dev_handle,
+	struct winusb_isoch_registration *reg)
+{
+	struct winusb_transfer_priv *owner_priv = get_winusb_transfer_priv(reg->owner);
+
+	if (!WinUSBX[SUB_API_WINUSB].UnregisterIsochBuffer(reg->isoch_buffer_handle))
+		usbi_warn(HANDLE_CTX(dev_handle), "failed to unregister WinUSB isoch buffer: %s", windows_error_str(0));
+
+	// The owner is still allocated, as it drops its registration when it
+	// is destroyed
+	owner_priv->isoch_registration = 0;
+	owner_priv->isoch_dev_handle = NULL;
+	memset(reg, 0, sizeof(*reg));
+}
+
+// Release the registration kept by a transfer that is not in flight, if any
+static void isoch_registration_drop(struct usbi_transfer *itransfer)
+{
+	struct winusb_transfer_priv *transfer_priv = get_winusb_transfer_priv(itransfer);
+	struct libusb_device_handle *dev_handle = transfer_priv->isoch_dev_handle;
+	struct winusb_device_handle_priv *handle_priv;
+
+	if (!transfer_priv->isoch_registration)
+		return;
+
+	handle_priv = get_winusb_device_handle_priv(dev_handle);
+	usbi_mutex_lock(&dev_handle->lock);
+	if (transfer_priv->isoch_registration)
+		isoch_registration_release(dev_handle, &handle_priv->isoch_registrations[transfer_priv->isoch_registration - 1]);
+	usbi_mutex_unlock(&dev_handle->lock);
+}
+
+// Release the kept isoch buffer registrations made with an interface handle,
+// or all of them if api_handle is NULL. Those still in use are released when
+// their transfer completes.
+// Must be called with the dev_handle lock held or with no transfer in flight.
+static void isoch_registrations_release(struct libusb_device_handle *dev_handle, HANDLE api_handle)
+{
+	struct winusb_device_handle_priv *handle_priv = get_winusb_device_handle_priv(dev_handle);
+	struct winusb_isoch_registration *reg;
+	int i;
+
+	for (i = 0; i < WINUSB_ISOCH_REGISTRATIONS; i++) {
+		reg = &handle_priv->isoch_registrations[i];
+		if (reg->isoch_buffer_handle == NULL || (api_handle != NULL && reg->api_handle != api_handle))
+			continue;
+
+		if (reg->in_use)
+			reg->stale = true;
+		else
+			isoch_registration_release(dev_handle, reg);
+	}
+}
+
+// Return the isoch buffer handle to submit a transfer with, reusing the
+// registration the transfer made on a previous submission if its buffer is
+// the same. Returns NULL if the buffer could not be registered.
+static WINUSB_ISOCH_BUFFER_HANDLE isoch_buffer_get(struct usbi_transfer *itransfer, HANDLE winusb_handle)
+{
+	struct libusb_transfer *transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	struct winusb_transfer_priv *transfer_priv = get_winusb_transfer_priv(itransfer);
+	struct libusb_device_handle *dev_handle = transfer->dev_handle;
+	struct winusb_device_handle_priv *handle_priv = get_winusb_device_handle_priv(dev_handle);
+	struct winusb_isoch_registration *reg, *slot = NULL;
+	WINUSB_ISOCH_BUFFER_HANDLE buffer_handle = NULL;
+	int i;
+
+	// A registration kept on another device handle is of no use here
+	if (transfer_priv->isoch_dev_handle != dev_handle)
+		isoch_registration_drop(itransfer);
+
+	usbi_mutex_lock(&dev_handle->lock);
+
+	if (transfer_priv->isoch_registration) {
+		reg = &handle_priv->isoch_registrations[transfer_priv->isoch_registration - 1];
+		if (!reg->stale && reg->api_handle == winusb_handle && reg->endpoint == transfer->endpoint
+				&& reg->buffer == transfer->buffer && reg->length == transfer->length) {
+			reg->in_use = true;
+			buffer_handle = reg->isoch_buffer_handle;
+			goto out;
+		}
+		isoch_registration_release(dev_handle, reg);
+	}
+
+	// Take a free slot, or else one whose transfer is not in flight
+	for (i = 0; i < WINUSB_ISOCH_REGISTRATIONS; i++) {
+		reg = &handle_priv->isoch_registrations[i];
+		if (reg->isoch_buffer_handle == NULL) {
+			slot = reg;
+			break;
+		}
+		if (slot == NULL && !reg->in_use)
+			slot = reg;
+	}
+	if (slot != NULL && slot->isoch_buffer_handle != NULL)
+		isoch_registration_release(dev_handle, slot);
+
+	if (!WinUSBX[SUB_API_WINUSB].RegisterIsochBuffer(winusb_handle, transfer->endpoint, transfer->buffer, transfer->length, &buffer_handle)) {
+		usbi_err(TRANSFER_CTX(transfer), "failed to register WinUSB isoch buffer: %s", windows_error_str(0));
+		buffer_handle = NULL;
+		goto out;
+	}
+
+	if (slot != NULL) {
+		slot->isoch_buffer_handle = buffer_handle;
+		slot->api_handle = winusb_handle;
+		slot->endpoint = transfer->endpoint;
+		slot->buffer = transfer->buffer;
+		slot->length = transfer->length;
+		slot->owner = itransfer;
+		slot->in_use = true;
+		transfer_priv->isoch_registration = (int)(slot - handle_priv->isoch_registrations) + 1;
+		transfer_priv->isoch_dev_handle = dev_handle;
+	} else {
+		// Every slot is in use, so this registration is not kept
+		transfer_priv->isoch_buffer_handle = buffer_handle;
+	}
+
+out:
+	usbi_mutex_unlock(&dev_handle->lock);
+	return buffer_handle;
+}
+
+// Called once a transfer submitted with isoch_buffer_get() is done
+static void isoch_buffer_put(struct usbi_transfer *itransfer)
+{
+	struct libusb_transfer *transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
+	struct winusb_transfer_priv *transfer_priv = get_winusb_transfer_priv(itransfer);
+	struct libusb_device_handle *dev_handle = transfer->dev_handle;
+	struct winusb_device_handle_priv *handle_priv = get_winusb_device_handle_priv(dev_handle);
+	struct winusb_isoch_registration *reg;
+
+	if (transfer_priv->isoch_buffer_handle != NULL) {
+		if (WinUSBX[SUB_API_WINUSB].UnregisterIsochBuffer(transfer_priv->isoch_buffer_handle)) {
+			transfer_priv->isoch_buffer_handle = NULL;
+		} else {
+			usbi_warn(TRANSFER_CTX(transfer), "failed to unregister WinUSB isoch buffer: %s", windows_error_str(0));
+		}
+	}
+
+	if (!transfer_priv->isoch_registration)
+		return;
+
+	usbi_mutex_lock(&dev_handle->lock);
+	reg = &handle_priv->isoch_registrations[transfer_priv->isoch_registration - 1];
+	reg->in_use = false;
+	if (reg->stale)
+		isoch_registration_release(dev_handle, reg);
+	usbi_mutex_unlock(&dev_handle->lock);
+}
+
 static void winusb_clear_transfer_priv(struct usbi_transfer *itransfer)
 {
 	struct winusb_transfer_priv *transfer_priv = get_winusb_transfer_priv(itransfer);
@@ -2200,15 +2484,8 @@ static void winusb_clear_transfer_priv(struct usbi_transfer *itransfer)
 
 	safe_free(transfer_priv->hid_buffer);
 
-	if (transfer->type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS && sub_api == SUB_API_WINUSB) {
-		if (transfer_priv->isoch_buffer_handle != NULL) {
-			if (WinUSBX[sub_api].UnregisterIsochBuffer(transfer_priv->isoch_buffer_handle)) {
-				transfer_priv->isoch_buffer_handle = NULL;
-			} else {
-				usbi_warn(TRANSFER_CTX(transfer), "failed to unregister WinUSB isoch buffer: %s", windows_error_str(0));
-			}
-		}
-	}
+	if (transfer->type == LIBUSB_TRANSFER_TYPE_ISOCHRONOUS && sub_api == SUB_API_WINUSB)
+		isoch_buffer_put(itransfer);
 
 	safe_free(transfer_priv->iso_context);
 
@@ -2216,6 +2493,13 @@ static void winusb_clear_transfer_priv(struct usbi_transfer *itransfer)
 	auto_release(itransfer);
 }
 
+static void winusb_destroy_transfer_priv(struct usbi_transfer *itransfer)
+{
+	// Unpin the buffer the transfer kept registered, which may already have
+	// been freed by the application
+	isoch_registration_drop(itransfer);
+}
+
 static int winusb_submit_transfer(struct usbi_transfer *itransfer)
 {
 	struct libusb_transfer *transfer = USBI_TRANSFER_TO_LIBUSB_TRANSFER(itransfer);
@@ -2399,6 +2683,7 @@ const struct windows_backend winusb_backend = {
 	winusb_submit_transfer,
 	winusb_cancel_transfer,
 	winusb_clear_transfer_priv,
+	winusb_destroy_transfer_priv,
 	winusb_copy_transfer_data,
 	winusb_set_option,
 };
@@ -2730,6 +3015,9 @@ static void winusbx_close(int sub_api, struct libusb_device_handle *dev_handle)
 	if (WinUSBX[sub_api].hDll == NULL)
 		return;
 
+	if (sub_api == SUB_API_WINUSB)
+		isoch_registrations_release(dev_handle, NULL);
+
 	if (priv->apib->id == USB_API_COMPOSITE) {
 		// If this is a composite device, just free and close any WinUSB-like
 		// interfaces that are not part of an associated group
@@ -2987,6 +3275,9 @@ static int winusbx_release_interface(int sub_api, struct libusb_device_handle *d
 	if (!HANDLE_VALID(winusb_handle))
 		return LIBUSB_ERROR_NOT_FOUND;
 
+	if (sub_api == SUB_API_WINUSB)
+		isoch_registrations_release(dev_handle, winusb_handle);
+
 	WinUSBX[sub_api].Free(winusb_handle);
 	handle_priv->interface_handle[iface].api_handle = INVALID_HANDLE_VALUE;
 
@@ -3316,21 +3607,12 @@ static int winusbx_submit_iso_transfer(int sub_api, struct usbi_transfer *itrans
 			}
 		}
 
-		if (transfer_priv->isoch_buffer_handle != NULL) {
-			if (WinUSBX[sub_api].UnregisterIsochBuffer(transfer_priv->isoch_buffer_handle)) {
-				transfer_priv->isoch_buffer_handle = NULL;
-			} else {
-				usbi_err(TRANSFER_CTX(transfer), "failed to unregister WinUSB isoch buffer: %s", windows_error_str(0));
-				return LIBUSB_ERROR_OTHER;
-			}
-		}
-
-		// Register the isoch buffer to the operating system.
-		ret = WinUSBX[sub_api].RegisterIsochBuffer(winusb_handle, transfer->endpoint, transfer->buffer, transfer->length, &buffer_handle);
-		if (!ret) {
-			usbi_err(TRANSFER_CTX(transfer), "failed to register WinUSB isoch buffer: %s", windows_error_str(0));
+		// Register the isoch buffer to the operating system, unless this transfer
+		// already did on a previous submission. Whatever the outcome, the
+		// registration is handed back in winusb_clear_transfer_priv().
+		buffer_handle = isoch_buffer_get(itransfer, winusb_handle);
+		if (buffer_handle == NULL)
 			return LIBUSB_ERROR_NO_MEM;
-		}
 
 		// Important note: the WinUSB_Read/WriteIsochPipeAsap API requires a ContinueStream parameter that tells whether the isochronous
 		// stream must be continued or if the WinUSB driver can schedule the transfer at its convenience. Profiling subsequent transfers
@@ -3352,16 +3634,12 @@ static int winusbx_submit_iso_transfer(int sub_api, struct usbi_transfer *itrans
 
 		if (!ret && GetLastError() != ERROR_IO_PENDING) {
 			usbi_err(TRANSFER_CTX(transfer), "ReadIsochPipeAsap/WriteIsochPipeAsap failed: %s", windows_error_str(0));
-			if (!WinUSBX[sub_api].UnregisterIsochBuffer(buffer_handle))
-				usbi_warn(TRANSFER_CTX(transfer), "failed to unregister WinUSB isoch buffer: %s", windows_error_str(0));
 			return LIBUSB_ERROR_IO;
 		}
 
 		// Restore the ContinueStream parameter to TRUE.
 		transfer_priv->iso_break_stream = FALSE;
 
-		transfer_priv->isoch_buffer_handle = buffer_handle;
-
 		return LIBUSB_SUCCESS;
 	} else {
 		PRINT_UNSUPPORTED_API(winusbx_submit_iso_transfer);
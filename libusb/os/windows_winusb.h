@@ -194,11 +194,8 @@ static inline void winusb_device_priv_release(struct libusb_device *dev)
 	free(priv->dev_id);
 	free(priv->path);
 	if ((dev->device_descriptor.bNumConfigurations > 0) && (priv->config_descriptor != NULL)) {
-		for (i = 0; i < dev->device_descriptor.bNumConfigurations; i++) {
-			if (priv->config_descriptor[i] == NULL)
-				continue;
-			free((UCHAR *)priv->config_descriptor[i] - USB_DESCRIPTOR_REQUEST_SIZE);
-		}
+		for (i = 0; i < dev->device_descriptor.bNumConfigurations; i++)
+			usbi_desc_store_put(priv->config_descriptor[i]);
 	}
 	free(priv->config_descriptor);
 	free(priv->hid);
@@ -230,6 +227,31 @@ DLL_DECLARE_HANDLE(Cfgmgr32);
 DLL_DECLARE_FUNC(WINAPI, CONFIGRET, CM_Get_Parent, (PDEVINST, DEVINST, ULONG));
 DLL_DECLARE_FUNC(WINAPI, CONFIGRET, CM_Get_Child, (PDEVINST, DEVINST, ULONG));
 
+// CM_NOTIFY_FILTER and its constants, for the filter types used here
+#define USBI_CM_NOTIFY_FILTER_FLAG_ALL_INTERFACE_CLASSES	0x00000001
+#define USBI_CM_NOTIFY_FILTER_FLAG_ALL_DEVICE_INSTANCES	0x00000002
+#define USBI_CM_NOTIFY_FILTER_TYPE_DEVICEINTERFACE		0
+#define USBI_CM_NOTIFY_FILTER_TYPE_DEVICEINSTANCE		2
+
+struct libusb_cm_notify_filter {
+	DWORD cbSize;
+	DWORD Flags;
+	DWORD FilterType;
+	DWORD Reserved;
+	union {
+		GUID ClassGuid;
+		HANDLE hTarget;
+		WCHAR InstanceId[200];
+	} u;
+};
+
+typedef DWORD (CALLBACK *LIBUSB_CM_NOTIFY_CALLBACK)(HANDLE, PVOID, DWORD, PVOID, DWORD);
+
+// Windows 8 and later, prefixed to avoid conflict with header files
+DLL_DECLARE_FUNC_PREFIXED(WINAPI, CONFIGRET, p, CM_Register_Notification,
+	(struct libusb_cm_notify_filter *, PVOID, LIBUSB_CM_NOTIFY_CALLBACK, HANDLE *));
+DLL_DECLARE_FUNC_PREFIXED(WINAPI, CONFIGRET, p, CM_Unregister_Notification, (HANDLE));
+
 /* AdvAPI32 dependencies */
 DLL_DECLARE_HANDLE(AdvAPI32);
 DLL_DECLARE_FUNC_PREFIXED(WINAPI, LONG, p, RegQueryValueExA, (HKEY, LPCSTR, LPDWORD, LPDWORD, LPBYTE, LPDWORD));
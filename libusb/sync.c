@@ -68,6 +68,57 @@ static void sync_transfer_wait_for_completion(struct libusb_transfer *transfer)
 	}
 }
 
+/* The backend may perform a synchronous request directly when nothing else
+ * is in flight on the handle. Otherwise there would be no ordering guarantee
+ * between the request and anything queued ahead of it.
+ *
+ * Such a request has no transfer, so it is kept on the transfer path while
+ * a capture is running, and in builds with tracepoints, which both record
+ * transfers. */
+static int sync_transfer_use_backend(struct libusb_device_handle *dev_handle)
+{
+#ifdef HAVE_USDT
+	UNUSED(dev_handle);
+	return 0;
+#else
+	int idle;
+
+	if (usbi_atomic_ptr_load(&HANDLE_CTX(dev_handle)->capture))
+		return 0;
+
+	usbi_mutex_lock(&dev_handle->flying_transfers_lock);
+	idle = list_empty(&dev_handle->flying_transfers);
+	usbi_mutex_unlock(&dev_handle->flying_transfers_lock);
+
+	return idle;
+#endif
+}
+
+/* Result of a completed control transfer, as returned by
+ * libusb_control_transfer() */
+static int control_transfer_result(struct libusb_transfer *transfer)
+{
+	switch (transfer->status) {
+	case LIBUSB_TRANSFER_COMPLETED:
+		return transfer->actual_length;
+	case LIBUSB_TRANSFER_TIMED_OUT:
+		return LIBUSB_ERROR_TIMEOUT;
+	case LIBUSB_TRANSFER_STALL:
+		return LIBUSB_ERROR_PIPE;
+	case LIBUSB_TRANSFER_NO_DEVICE:
+		return LIBUSB_ERROR_NO_DEVICE;
+	case LIBUSB_TRANSFER_OVERFLOW:
+		return LIBUSB_ERROR_OVERFLOW;
+	case LIBUSB_TRANSFER_ERROR:
+	case LIBUSB_TRANSFER_CANCELLED:
+		return LIBUSB_ERROR_IO;
+	default:
+		usbi_warn(TRANSFER_CTX(transfer),
+			"unrecognised status code %d", transfer->status);
+		return LIBUSB_ERROR_OTHER;
+	}
+}
+
 /** \ingroup libusb_syncio
  * Perform a USB control transfer.
  *
@@ -111,6 +162,20 @@ int API_EXPORTED libusb_control_transfer(libusb_device_handle *dev_handle,
 	if (usbi_handling_events(HANDLE_CTX(dev_handle)))
 		return LIBUSB_ERROR_BUSY;
 
+	if (usbi_backend.sync_control_transfer &&
+	    sync_transfer_use_backend(dev_handle)) {
+		struct timespec start;
+
+		usbi_get_monotonic_time(&start);
+		r = usbi_backend.sync_control_transfer(dev_handle, bmRequestType,
+			bRequest, wValue, wIndex, data, wLength, timeout);
+		if (r != LIBUSB_ERROR_NOT_SUPPORTED) {
+			usbi_stats_sync_transfer(dev_handle, 0, wLength, r < 0 ? 0 : r,
+				r < 0 ? r : LIBUSB_SUCCESS, &start);
+			return r;
+		}
+	}
+
 	transfer = libusb_alloc_transfer(0);
 	if (!transfer)
 		return LIBUSB_ERROR_NO_MEM;
@@ -141,36 +206,304 @@ int API_EXPORTED libusb_control_transfer(libusb_device_handle *dev_handle,
 		memcpy(data, libusb_control_transfer_get_data(transfer),
 			transfer->actual_length);
 
-	switch (transfer->status) {
-	case LIBUSB_TRANSFER_COMPLETED:
-		r = transfer->actual_length;
-		break;
-	case LIBUSB_TRANSFER_TIMED_OUT:
-		r = LIBUSB_ERROR_TIMEOUT;
-		break;
-	case LIBUSB_TRANSFER_STALL:
-		r = LIBUSB_ERROR_PIPE;
-		break;
-	case LIBUSB_TRANSFER_NO_DEVICE:
-		r = LIBUSB_ERROR_NO_DEVICE;
-		break;
-	case LIBUSB_TRANSFER_OVERFLOW:
-		r = LIBUSB_ERROR_OVERFLOW;
-		break;
-	case LIBUSB_TRANSFER_ERROR:
-	case LIBUSB_TRANSFER_CANCELLED:
-		r = LIBUSB_ERROR_IO;
-		break;
-	default:
-		usbi_warn(HANDLE_CTX(dev_handle),
-			"unrecognised status code %d", transfer->status);
-		r = LIBUSB_ERROR_OTHER;
+	r = control_transfer_result(transfer);
+	libusb_free_transfer(transfer);
+	return r;
+}
+
+struct control_queue_slot {
+	struct libusb_control_queue *queue;
+	struct libusb_transfer *transfer;
+	size_t capacity;
+
+	/* where the data of a device-to-host request is copied to */
+	unsigned char *data;
+
+	/* position of the request since the last flush */
+	int seq;
+};
+
+struct libusb_control_queue {
+	struct libusb_device_handle *dev_handle;
+	struct control_queue_slot *slots;
+	int window;
+
+	/* protects the fields below, which are updated by the transfer
+	 * callback in whichever thread handles events */
+	usbi_mutex_t lock;
+	int *free_slots;
+	int num_free;
+	int submitted;
+	int error;
+	int error_seq;
+
+	/* set by the transfer callback for libusb_handle_events_completed() */
+	int slot_freed;
+};
+
+static void LIBUSB_CALL control_queue_cb(struct libusb_transfer *transfer)
+{
+	struct control_queue_slot *slot = transfer->user_data;
+	struct libusb_control_queue *queue = slot->queue;
+	int r = control_transfer_result(transfer);
+
+	if (r > 0 && slot->data)
+		memcpy(slot->data, libusb_control_transfer_get_data(transfer),
+			(size_t)r);
+
+	usbi_mutex_lock(&queue->lock);
+	if (r < 0 && (!queue->error || slot->seq < queue->error_seq)) {
+		queue->error = r;
+		queue->error_seq = slot->seq;
 	}
+	queue->free_slots[queue->num_free++] = (int)(slot - queue->slots);
+	queue->slot_freed = 1;
+	usbi_mutex_unlock(&queue->lock);
+}
+
+/* handle events until a slot is free, or until all are if all is set */
+static void control_queue_wait(struct libusb_control_queue *queue, int all)
+{
+	struct libusb_context *ctx = HANDLE_CTX(queue->dev_handle);
+	int i, r, done;
+
+	for (;;) {
+		usbi_mutex_lock(&queue->lock);
+		done = all ? queue->num_free == queue->window : queue->num_free > 0;
+		if (!done)
+			queue->slot_freed = 0;
+		usbi_mutex_unlock(&queue->lock);
+		if (done)
+			return;
+
+		r = libusb_handle_events_completed(ctx, &queue->slot_freed);
+		if (r < 0 && r != LIBUSB_ERROR_INTERRUPTED) {
+			usbi_err(ctx, "libusb_handle_events failed: %s, cancelling queued requests and retrying",
+				 libusb_error_name(r));
+			for (i = 0; i < queue->window; i++)
+				libusb_cancel_transfer(queue->slots[i].transfer);
+		}
+	}
+}
+
+/** \ingroup libusb_syncio
+ * Create a queue for issuing many control requests to a device without a
+ * full round trip per request. Requests given to
+ * libusb_control_queue_submit() are submitted right away, and up to window
+ * of them are kept in flight on the default control pipe, where the device
+ * processes them in order. libusb_control_queue_flush() then waits for all of
+ * them and reports the first one that failed.
+ *
+ * A queue is meant to be used from one thread at a time, and like the other
+ * synchronous functions it must not be used from event handling context.
+ *
+ * Since version 1.0.27, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param dev_handle a handle for the device to communicate with
+ * \param window the largest number of requests in flight
+ * \param queue output location for the newly created queue
+ * \returns 0 on success
+ * \returns \ref LIBUSB_ERROR_INVALID_PARAM if window is not positive
+ * \returns \ref LIBUSB_ERROR_NO_MEM on memory allocation failure
+ */
+int API_EXPORTED libusb_control_queue_create(libusb_device_handle *dev_handle,
+	int window, libusb_control_queue **queue)
+{
+	struct libusb_control_queue *_queue;
+	int i;
+
+	if (!dev_handle || !queue || window <= 0)
+		return LIBUSB_ERROR_INVALID_PARAM;
+
+	_queue = calloc(1, sizeof(*_queue));
+	if (!_queue)
+		return LIBUSB_ERROR_NO_MEM;
+
+	_queue->slots = calloc((size_t)window, sizeof(*_queue->slots));
+	_queue->free_slots = calloc((size_t)window, sizeof(*_queue->free_slots));
+	if (!_queue->slots || !_queue->free_slots)
+		goto err_no_mem;
+
+	_queue->dev_handle = dev_handle;
+	_queue->window = window;
+	usbi_mutex_init(&_queue->lock);
+
+	for (i = 0; i < window; i++) {
+		struct control_queue_slot *slot = &_queue->slots[i];
+
+		slot->queue = _queue;
+		slot->transfer = libusb_alloc_transfer(0);
+		if (!slot->transfer)
+			goto err_free_transfers;
+		_queue->free_slots[_queue->num_free++] = i;
+	}
+
+	*queue = _queue;
+	return 0;
+
+err_free_transfers:
+	while (i--)
+		libusb_free_transfer(_queue->slots[i].transfer);
+	usbi_mutex_destroy(&_queue->lock);
+err_no_mem:
+	free(_queue->free_slots);
+	free(_queue->slots);
+	free(_queue);
+	return LIBUSB_ERROR_NO_MEM;
+}
+
+/** \ingroup libusb_syncio
+ * Submit a control request through a queue. This function returns as soon as
+ * the request is in flight, first handling events until a request completes
+ * if window requests are already in flight.
+ *
+ * The parameters are those of libusb_control_transfer(). The data of a
+ * host-to-device request is copied, while the buffer of a device-to-host
+ * request must stay valid until libusb_control_queue_flush() returns.
+ *
+ * Once a request of the queue has failed, no further requests are submitted
+ * until the queue is flushed. Requests that were already in flight behind
+ * the failed one may still have been executed by the device.
+ *
+ * Since version 1.0.27, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param queue the queue to submit the request through
+ * \param bmRequestType the request type field for the setup packet
+ * \param bRequest the request field for the setup packet
+ * \param wValue the value field for the setup packet
+ * \param wIndex the index field for the setup packet
+ * \param data a suitably-sized data buffer for either input or output
+ * \param wLength the length field for the setup packet
+ * \param timeout timeout (in milliseconds) for this request, or 0 for an
+ * unlimited timeout
+ * \returns 0 on success
+ * \returns \ref LIBUSB_ERROR_BUSY if called from event handling context
+ * \returns the error of an earlier request that failed, see
+ * libusb_control_transfer()
+ * \returns another LIBUSB_ERROR code if the request could not be submitted
+ */
+int API_EXPORTED libusb_control_queue_submit(libusb_control_queue *queue,
+	uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex,
+	unsigned char *data, uint16_t wLength, unsigned int timeout)
+{
+	struct libusb_device_handle *dev_handle = queue->dev_handle;
+	size_t size = LIBUSB_CONTROL_SETUP_SIZE + (size_t)wLength;
+	struct control_queue_slot *slot = NULL;
+	int r;
+
+	if (usbi_handling_events(HANDLE_CTX(dev_handle)))
+		return LIBUSB_ERROR_BUSY;
+
+	control_queue_wait(queue, 0);
+
+	usbi_mutex_lock(&queue->lock);
+	r = queue->error;
+	if (!r)
+		slot = &queue->slots[queue->free_slots[--queue->num_free]];
+	usbi_mutex_unlock(&queue->lock);
+	if (r)
+		return r;
+
+	if (slot->capacity < size) {
+		unsigned char *buffer = realloc(slot->transfer->buffer, size);
+
+		if (!buffer) {
+			r = LIBUSB_ERROR_NO_MEM;
+			goto out_release;
+		}
+		slot->transfer->buffer = buffer;
+		slot->capacity = size;
+	}
+
+	libusb_fill_control_setup(slot->transfer->buffer, bmRequestType, bRequest,
+		wValue, wIndex, wLength);
+	if ((bmRequestType & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_OUT) {
+		if (wLength)
+			memcpy(slot->transfer->buffer + LIBUSB_CONTROL_SETUP_SIZE, data, wLength);
+		slot->data = NULL;
+	} else {
+		slot->data = data;
+	}
+
+	libusb_fill_control_transfer(slot->transfer, dev_handle,
+		slot->transfer->buffer, control_queue_cb, slot, timeout);
+	slot->seq = queue->submitted;
+	r = libusb_submit_transfer(slot->transfer);
+	if (r < 0)
+		goto out_release;
+
+	queue->submitted++;
+	return 0;
+
+out_release:
+	usbi_mutex_lock(&queue->lock);
+	queue->free_slots[queue->num_free++] = (int)(slot - queue->slots);
+	usbi_mutex_unlock(&queue->lock);
+	return r;
+}
+
+/** \ingroup libusb_syncio
+ * Wait for all the requests submitted through a queue to complete. The queue
+ * can then be used for another batch of requests.
+ *
+ * Since version 1.0.27, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param queue the queue to flush
+ * \param failed output location for the position, counted from 0 since the
+ * previous flush, of the first request that failed. May be NULL.
+ * \returns 0 if all requests succeeded
+ * \returns \ref LIBUSB_ERROR_BUSY if called from event handling context
+ * \returns the error of the first request that failed, see
+ * libusb_control_transfer()
+ */
+int API_EXPORTED libusb_control_queue_flush(libusb_control_queue *queue,
+	int *failed)
+{
+	int r;
+
+	if (usbi_handling_events(HANDLE_CTX(queue->dev_handle)))
+		return LIBUSB_ERROR_BUSY;
+
+	control_queue_wait(queue, 1);
+
+	r = queue->error;
+	if (r && failed)
+		*failed = queue->error_seq;
+	queue->error = 0;
+	queue->submitted = 0;
 
-	libusb_free_transfer(transfer);
 	return r;
 }
 
+/** \ingroup libusb_syncio
+ * Destroy a control request queue, first waiting for the requests still in
+ * flight.
+ *
+ * Since version 1.0.27, \ref LIBUSB_API_VERSION >= 0x0100010B
+ *
+ * \param queue the queue to destroy. If NULL, no action is taken.
+ */
+void API_EXPORTED libusb_control_queue_destroy(libusb_control_queue *queue)
+{
+	int i;
+
+	if (!queue)
+		return;
+
+	control_queue_wait(queue, 1);
+
+	for (i = 0; i < queue->window; i++) {
+		struct libusb_transfer *transfer = queue->slots[i].transfer;
+
+		free(transfer->buffer);
+		libusb_free_transfer(transfer);
+	}
+	usbi_mutex_destroy(&queue->lock);
+	free(queue->free_slots);
+	free(queue->slots);
+	free(queue);
+}
+
 static int do_sync_bulk_transfer(struct libusb_device_handle *dev_handle,
 	unsigned char endpoint, unsigned char *buffer, int length,
 	int *transferred, unsigned int timeout, unsigned char type)
@@ -182,6 +515,23 @@ static int do_sync_bulk_transfer(struct libusb_device_handle *dev_handle,
 	if (usbi_handling_events(HANDLE_CTX(dev_handle)))
 		return LIBUSB_ERROR_BUSY;
 
+	if (usbi_backend.sync_bulk_transfer &&
+	    sync_transfer_use_backend(dev_handle)) {
+		struct timespec start;
+		int done = 0;
+
+		usbi_get_monotonic_time(&start);
+		r = usbi_backend.sync_bulk_transfer(dev_handle, endpoint, buffer,
+			length, &done, timeout);
+		if (r != LIBUSB_ERROR_NOT_SUPPORTED) {
+			usbi_stats_sync_transfer(dev_handle, endpoint, length, done, r,
+				&start);
+			if (transferred)
+				*transferred = done;
+			return r;
+		}
+	}
+
 	transfer = libusb_alloc_transfer(0);
 	if (!transfer)
 		return LIBUSB_ERROR_NO_MEM;
@@ -0,0 +1,425 @@
+/*
+ * libusb throughput and latency benchmarks
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * Usage: bench [-d vid:pid] [-e endpoint] [-n count] [benchmark...]
+ *
+ * The benchmarks are "bulk", "control", "enum" and "events", all of them run
+ * by default. The device defaults to the one emulated by the loopback backend
+ * (./configure --enable-loopback-backend) but any device with a bulk endpoint
+ * works. Benchmarks needing a device are skipped when it cannot be opened.
+ *
+ * Each result is printed on a line of its own as space separated key=value
+ * pairs, the first being the name of the benchmark, so that the output can be
+ * collected and compared between runs. Times are in nanoseconds.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(PLATFORM_WINDOWS)
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+#include "libusb.h"
+
+static uint16_t vendor_id = 0x0525;
+static uint16_t product_id = 0xa4a0;
+static unsigned char bulk_endpoint = 0x81;
+static int iterations = 1000;
+
+static uint64_t now_ns(void)
+{
+#if defined(PLATFORM_WINDOWS)
+	LARGE_INTEGER count, freq;
+
+	QueryPerformanceCounter(&count);
+	QueryPerformanceFrequency(&freq);
+	return (uint64_t)(count.QuadPart / freq.QuadPart) * 1000000000ULL +
+		(uint64_t)(count.QuadPart % freq.QuadPart) * 1000000000ULL / (uint64_t)freq.QuadPart;
+#else
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+static int compare_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Print the distribution of a set of latencies, sorting them */
+static void print_latencies(const char *name, uint64_t *samples, int count)
+{
+	uint64_t total = 0;
+	int i;
+
+	qsort(samples, (size_t)count, sizeof(*samples), compare_u64);
+	for (i = 0; i < count; i++)
+		total += samples[i];
+
+	printf("%s count=%d mean=%llu p50=%llu p90=%llu p99=%llu max=%llu\n",
+	       name, count, (unsigned long long)(total / (uint64_t)count),
+	       (unsigned long long)samples[count / 2],
+	       (unsigned long long)samples[(int)((int64_t)count * 90 / 100)],
+	       (unsigned long long)samples[(int)((int64_t)count * 99 / 100)],
+	       (unsigned long long)samples[count - 1]);
+}
+
+struct bulk_state {
+	int total;
+	int submitted;
+	int completed;
+	int error;
+	uint64_t bytes;
+};
+
+static void LIBUSB_CALL bulk_cb(struct libusb_transfer *transfer)
+{
+	struct bulk_state *state = transfer->user_data;
+
+	state->completed++;
+	state->bytes += (uint64_t)transfer->actual_length;
+	if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+		fprintf(stderr, "bulk transfer failed: %s\n",
+			libusb_error_name((int)transfer->status));
+		state->error = 1;
+		return;
+	}
+
+	if (state->error || state->submitted == state->total)
+		return;
+
+	if (libusb_submit_transfer(transfer) == LIBUSB_SUCCESS)
+		state->submitted++;
+	else
+		state->error = 1;
+}
+
+static int bench_bulk_one(libusb_context *ctx, libusb_device_handle *handle,
+	int size, int depth)
+{
+	struct libusb_transfer **transfers;
+	struct bulk_state state;
+	uint64_t start, elapsed;
+	int i, r = 0;
+
+	transfers = calloc((size_t)depth, sizeof(*transfers));
+	if (!transfers)
+		return -1;
+
+	memset(&state, 0, sizeof(state));
+	state.total = iterations > depth ? iterations : depth;
+
+	for (i = 0; i < depth; i++) {
+		unsigned char *buffer = malloc((size_t)size);
+
+		transfers[i] = libusb_alloc_transfer(0);
+		if (!buffer || !transfers[i]) {
+			free(buffer);
+			r = -1;
+			goto out;
+		}
+		libusb_fill_bulk_transfer(transfers[i], handle, bulk_endpoint,
+			buffer, size, bulk_cb, &state, 1000);
+		transfers[i]->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+	}
+
+	start = now_ns();
+	for (i = 0; i < depth; i++) {
+		if (libusb_submit_transfer(transfers[i]) != LIBUSB_SUCCESS) {
+			state.error = 1;
+			break;
+		}
+		state.submitted++;
+	}
+
+	while (state.completed < state.submitted) {
+		if (libusb_handle_events(ctx) != LIBUSB_SUCCESS) {
+			r = -1;
+			goto out;
+		}
+	}
+	elapsed = now_ns() - start;
+
+	if (state.error) {
+		r = -1;
+		goto out;
+	}
+
+	if (!elapsed)
+		elapsed = 1;
+	printf("bulk size=%d depth=%d transfers=%d ns=%llu transfers_per_s=%.0f mb_per_s=%.2f\n",
+	       size, depth, state.completed, (unsigned long long)elapsed,
+	       state.completed * 1e9 / (double)elapsed,
+	       (double)state.bytes * 1e3 / (double)elapsed);
+
+out:
+	for (i = 0; i < depth; i++)
+		libusb_free_transfer(transfers[i]);
+	free(transfers);
+	return r;
+}
+
+static int bench_bulk(libusb_context *ctx, libusb_device_handle *handle)
+{
+	static const int sizes[] = { 512, 4096, 16384, 65536, 262144 };
+	static const int depths[] = { 1, 4, 16 };
+	size_t i, j;
+
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		for (j = 0; j < sizeof(depths) / sizeof(depths[0]); j++) {
+			if (bench_bulk_one(ctx, handle, sizes[i], depths[j]))
+				return -1;
+		}
+	}
+
+	return 0;
+}
+
+static void LIBUSB_CALL control_cb(struct libusb_transfer *transfer)
+{
+	*(int *)transfer->user_data = 1;
+}
+
+/* Round trips of GET_STATUS, which every device has to answer */
+static int bench_control(libusb_context *ctx, libusb_device_handle *handle)
+{
+	unsigned char buffer[LIBUSB_CONTROL_SETUP_SIZE + 2];
+	struct libusb_transfer *transfer;
+	uint64_t *samples;
+	int i, r = -1;
+
+	samples = malloc((size_t)iterations * sizeof(*samples));
+	transfer = libusb_alloc_transfer(0);
+	if (!samples || !transfer)
+		goto out;
+
+	for (i = 0; i < iterations; i++) {
+		uint64_t start = now_ns();
+
+		if (libusb_control_transfer(handle, LIBUSB_ENDPOINT_IN,
+				LIBUSB_REQUEST_GET_STATUS, 0, 0, buffer, 2, 1000) < 0)
+			goto out;
+		samples[i] = now_ns() - start;
+	}
+	print_latencies("control_sync", samples, iterations);
+
+	libusb_fill_control_setup(buffer, LIBUSB_ENDPOINT_IN,
+		LIBUSB_REQUEST_GET_STATUS, 0, 0, 2);
+	for (i = 0; i < iterations; i++) {
+		uint64_t start = now_ns();
+		int completed = 0;
+
+		libusb_fill_control_transfer(transfer, handle, buffer,
+			control_cb, &completed, 1000);
+		if (libusb_submit_transfer(transfer) != LIBUSB_SUCCESS)
+			goto out;
+		while (!completed) {
+			if (libusb_handle_events_completed(ctx, &completed) != LIBUSB_SUCCESS)
+				goto out;
+		}
+		if (transfer->status != LIBUSB_TRANSFER_COMPLETED)
+			goto out;
+		samples[i] = now_ns() - start;
+	}
+	print_latencies("control_async", samples, iterations);
+	r = 0;
+
+out:
+	libusb_free_transfer(transfer);
+	free(samples);
+	return r;
+}
+
+static int bench_enum(libusb_context *ctx)
+{
+	libusb_device **list;
+	uint64_t start, elapsed;
+	ssize_t count = 0, i;
+	int configs = 0;
+	int n;
+
+	start = now_ns();
+	for (n = 0; n < iterations; n++) {
+		count = libusb_get_device_list(ctx, &list);
+		if (count < 0)
+			return -1;
+		libusb_free_device_list(list, 1);
+	}
+	elapsed = now_ns() - start;
+	printf("get_device_list devices=%ld ns_per_call=%llu\n", (long)count,
+	       (unsigned long long)(elapsed / (uint64_t)iterations));
+
+	count = libusb_get_device_list(ctx, &list);
+	if (count < 0)
+		return -1;
+
+	start = now_ns();
+	for (n = 0; n < iterations; n++) {
+		configs = 0;
+		for (i = 0; i < count; i++) {
+			struct libusb_config_descriptor *config;
+
+			if (libusb_get_config_descriptor(list[i], 0, &config) != LIBUSB_SUCCESS)
+				continue;
+			libusb_free_config_descriptor(config);
+			configs++;
+		}
+	}
+	elapsed = now_ns() - start;
+	libusb_free_device_list(list, 1);
+
+	if (configs)
+		printf("get_config_descriptor devices=%ld ns_per_call=%llu\n", (long)count,
+		       (unsigned long long)(elapsed / ((uint64_t)iterations * (uint64_t)configs)));
+
+	return 0;
+}
+
+static int bench_events(libusb_context *ctx)
+{
+	struct timeval zero = { 0, 0 }, second = { 1, 0 };
+	uint64_t start, elapsed;
+	int n;
+
+	start = now_ns();
+	for (n = 0; n < iterations; n++) {
+		if (libusb_handle_events_timeout_completed(ctx, &zero, NULL) != LIBUSB_SUCCESS)
+			return -1;
+	}
+	elapsed = now_ns() - start;
+	printf("events_poll ns_per_call=%llu\n",
+	       (unsigned long long)(elapsed / (uint64_t)iterations));
+
+	start = now_ns();
+	for (n = 0; n < iterations; n++) {
+		libusb_interrupt_event_handler(ctx);
+		if (libusb_handle_events_timeout_completed(ctx, &second, NULL) != LIBUSB_SUCCESS)
+			return -1;
+	}
+	elapsed = now_ns() - start;
+	printf("events_wakeup ns_per_call=%llu\n",
+	       (unsigned long long)(elapsed / (uint64_t)iterations));
+
+	return 0;
+}
+
+static int selected(int argc, char *argv[], int first, const char *name)
+{
+	int i;
+
+	if (first == argc)
+		return 1;
+
+	for (i = first; i < argc; i++) {
+		if (!strcmp(argv[i], name))
+			return 1;
+	}
+
+	return 0;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "usage: %s [-d vid:pid] [-e endpoint] [-n count] [bulk|control|enum|events...]\n",
+		name);
+}
+
+int main(int argc, char *argv[])
+{
+	libusb_context *ctx;
+	libusb_device_handle *handle;
+	int i, r, ret = 0;
+
+	for (i = 1; i < argc && argv[i][0] == '-'; i++) {
+		if (!strcmp(argv[i], "-d") && i + 1 < argc) {
+			unsigned int vid, pid;
+
+			if (sscanf(argv[++i], "%x:%x", &vid, &pid) != 2) {
+				usage(argv[0]);
+				return 2;
+			}
+			vendor_id = (uint16_t)vid;
+			product_id = (uint16_t)pid;
+		} else if (!strcmp(argv[i], "-e") && i + 1 < argc) {
+			bulk_endpoint = (unsigned char)strtoul(argv[++i], NULL, 16);
+		} else if (!strcmp(argv[i], "-n") && i + 1 < argc) {
+			iterations = atoi(argv[++i]);
+			if (iterations < 1) {
+				usage(argv[0]);
+				return 2;
+			}
+		} else {
+			usage(argv[0]);
+			return 2;
+		}
+	}
+
+	r = libusb_init_context(&ctx, /*options=*/NULL, /*num_options=*/0);
+	if (r != LIBUSB_SUCCESS) {
+		fprintf(stderr, "failed to init libusb: %s\n", libusb_error_name(r));
+		return 1;
+	}
+
+	handle = libusb_open_device_with_vid_pid(ctx, vendor_id, product_id);
+	if (handle) {
+		libusb_set_auto_detach_kernel_driver(handle, 1);
+		if (libusb_claim_interface(handle, 0) != LIBUSB_SUCCESS) {
+			libusb_close(handle);
+			handle = NULL;
+		}
+	}
+	if (!handle)
+		fprintf(stderr, "cannot use device %04x:%04x, skipping bulk and control\n",
+			vendor_id, product_id);
+
+	if (handle && selected(argc, argv, i, "bulk") && bench_bulk(ctx, handle)) {
+		fprintf(stderr, "bulk benchmark failed\n");
+		ret = 1;
+	}
+	if (handle && selected(argc, argv, i, "control") && bench_control(ctx, handle)) {
+		fprintf(stderr, "control benchmark failed\n");
+		ret = 1;
+	}
+	if (selected(argc, argv, i, "enum") && bench_enum(ctx)) {
+		fprintf(stderr, "enumeration benchmark failed\n");
+		ret = 1;
+	}
+	if (selected(argc, argv, i, "events") && bench_events(ctx)) {
+		fprintf(stderr, "event benchmark failed\n");
+		ret = 1;
+	}
+
+	if (handle) {
+		libusb_release_interface(handle, 0);
+		libusb_close(handle);
+	}
+	libusb_exit(ctx);
+
+	return ret;
+}
@@ -0,0 +1,779 @@
+/*
+ * libusb descriptor parsing tests
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * These tests feed well-formed and malformed descriptors to the parsers of
+ * descriptor.c, which are static. The file is built into this program
+ * rather than linked from the library, along with stubs for the few parts
+ * of libusb it calls, none of which the parsers need.
+ *
+ * Each buffer is copied to an allocation of its exact size, so that running
+ * the tests under a memory checker catches the parsers reading past it.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libusb_testlib.h"
+
+#include "descriptor.c"
+
+#ifdef ENABLE_LOGGING
+#ifndef ENABLE_DEBUG_LOGGING
+usbi_atomic_t usbi_default_debug_level = LIBUSB_LOG_LEVEL_DEBUG;
+#endif
+
+/* the messages of the parsers only show with -v, like those of libusb */
+void usbi_log(struct libusb_context *ctx, enum libusb_log_level level,
+	const char *function, const char *format, ...)
+{
+	va_list args;
+
+	UNUSED(ctx);
+	UNUSED(level);
+
+	fprintf(stderr, "%s: ", function);
+	va_start(args, format);
+	vfprintf(stderr, format, args);
+	va_end(args);
+	fputc('\n', stderr);
+}
+#endif
+
+const struct usbi_os_backend usbi_backend = {
+	.name = "Descriptor tests",
+};
+
+const char * LIBUSB_CALL libusb_error_name(int errcode)
+{
+	UNUSED(errcode);
+	return "**UNKNOWN**";
+}
+
+struct libusb_transfer * LIBUSB_CALL libusb_alloc_transfer(int iso_packets)
+{
+	UNUSED(iso_packets);
+	return NULL;
+}
+
+void LIBUSB_CALL libusb_free_transfer(struct libusb_transfer *transfer)
+{
+	UNUSED(transfer);
+}
+
+int LIBUSB_CALL libusb_submit_transfer(struct libusb_transfer *transfer)
+{
+	UNUSED(transfer);
+	return LIBUSB_ERROR_NOT_SUPPORTED;
+}
+
+int LIBUSB_CALL libusb_cancel_transfer(struct libusb_transfer *transfer)
+{
+	UNUSED(transfer);
+	return LIBUSB_ERROR_NOT_SUPPORTED;
+}
+
+int LIBUSB_CALL libusb_handle_events_completed(libusb_context *ctx,
+	int *completed)
+{
+	UNUSED(ctx);
+	UNUSED(completed);
+	return LIBUSB_ERROR_NOT_SUPPORTED;
+}
+
+int LIBUSB_CALL libusb_control_transfer(libusb_device_handle *dev_handle,
+	uint8_t request_type, uint8_t bRequest, uint16_t wValue, uint16_t wIndex,
+	unsigned char *data, uint16_t wLength, unsigned int timeout)
+{
+	UNUSED(dev_handle);
+	UNUSED(request_type);
+	UNUSED(bRequest);
+	UNUSED(wValue);
+	UNUSED(wIndex);
+	UNUSED(data);
+	UNUSED(wLength);
+	UNUSED(timeout);
+	return LIBUSB_ERROR_NOT_SUPPORTED;
+}
+
+#define MAX_DESCRIPTOR_SIZE	128
+
+#define CONFIG(total, num_interfaces)					\
+	LIBUSB_DT_CONFIG_SIZE, LIBUSB_DT_CONFIG, (total) & 0xff, (total) >> 8,	\
+	(num_interfaces), 1, 0, 0x80, 50
+
+#define INTERFACE(number, altsetting, num_endpoints)			\
+	LIBUSB_DT_INTERFACE_SIZE, LIBUSB_DT_INTERFACE, (number), (altsetting),	\
+	(num_endpoints), LIBUSB_CLASS_VENDOR_SPEC, 0, 0, 0
+
+#define ENDPOINT(address)						\
+	LIBUSB_DT_ENDPOINT_SIZE, LIBUSB_DT_ENDPOINT, (address),		\
+	LIBUSB_ENDPOINT_TRANSFER_TYPE_BULK, 0x00, 0x02, 0
+
+#define AUDIO_ENDPOINT(address)						\
+	LIBUSB_DT_ENDPOINT_AUDIO_SIZE, LIBUSB_DT_ENDPOINT, (address),	\
+	LIBUSB_ENDPOINT_TRANSFER_TYPE_ISOCHRONOUS, 0xc0, 0x00, 1, 2, 0
+
+/* a class specific descriptor, which ends up in an extra field */
+#define CLASS_SPECIFIC	4, 0x24, 0x01, 0x02
+
+struct config_case {
+	const char *name;
+	uint8_t data[MAX_DESCRIPTOR_SIZE];
+	int size;
+
+	/* what parse_configuration() returns, and what it parses when it
+	 * succeeds */
+	int result;
+	uint8_t num_interfaces;
+	size_t num_altsettings;
+	size_t num_endpoints;
+
+	/* the first pass is exact for well-formed descriptors, and only an
+	 * upper bound when the parser stops early */
+	int exact;
+};
+
+#define CONFIG_CASE(name, result, interfaces, altsettings, endpoints, exact, ...) \
+	{ (name), { __VA_ARGS__ }, sizeof((uint8_t[]){ __VA_ARGS__ }),	\
+	  (result), (interfaces), (altsettings), (endpoints), (exact) }
+
+static const struct config_case config_cases[] = {
+	CONFIG_CASE("one interface", 0, 1, 1, 2, 1,
+		CONFIG(32, 1),
+		INTERFACE(0, 0, 2),
+		ENDPOINT(0x81),
+		ENDPOINT(0x01)),
+	CONFIG_CASE("extra descriptors", 0, 1, 1, 2, 1,
+		CONFIG(44, 1),
+		CLASS_SPECIFIC,
+		INTERFACE(0, 0, 2),
+		CLASS_SPECIFIC,
+		ENDPOINT(0x81),
+		CLASS_SPECIFIC,
+		ENDPOINT(0x01)),
+	CONFIG_CASE("alternate settings", 0, 2, 3, 3, 1,
+		CONFIG(66, 2),
+		INTERFACE(0, 0, 1),
+		ENDPOINT(0x81),
+		INTERFACE(0, 1, 2),
+		ENDPOINT(0x81),
+		ENDPOINT(0x01),
+		INTERFACE(1, 0, 0)),
+	CONFIG_CASE("audio endpoint", 0, 1, 1, 1, 1,
+		CONFIG(27, 1),
+		INTERFACE(0, 0, 1),
+		AUDIO_ENDPOINT(0x82)),
+	CONFIG_CASE("oversized wTotalLength", 0, 1, 1, 1, 1,
+		CONFIG(0xffff, 1),
+		INTERFACE(0, 0, 1),
+		ENDPOINT(0x81)),
+	CONFIG_CASE("undersized wTotalLength", 0, 1, 1, 1, 1,
+		CONFIG(LIBUSB_DT_CONFIG_SIZE, 1),
+		INTERFACE(0, 0, 1),
+		ENDPOINT(0x81)),
+	CONFIG_CASE("truncated configuration", LIBUSB_ERROR_IO, 0, 0, 0, 0,
+		LIBUSB_DT_CONFIG_SIZE, LIBUSB_DT_CONFIG, 25, 0, 1),
+	CONFIG_CASE("configuration shorter than its header", LIBUSB_ERROR_IO, 0, 0, 0, 0,
+		1, LIBUSB_DT_CONFIG, 25, 0, 1, 1, 0, 0x80, 50,
+		INTERFACE(0, 0, 1),
+		ENDPOINT(0x81)),
+	CONFIG_CASE("configuration longer than the buffer", LIBUSB_ERROR_IO, 0, 0, 0, 0,
+		64, LIBUSB_DT_CONFIG, 64, 0, 1, 1, 0, 0x80, 50,
+		INTERFACE(0, 0, 0)),
+	CONFIG_CASE("no interface descriptor", 0, 0, 0, 0, 0,
+		CONFIG(LIBUSB_DT_CONFIG_SIZE, 1)),
+	CONFIG_CASE("too many interfaces", LIBUSB_ERROR_IO, 0, 0, 0, 0,
+		CONFIG(18, USB_MAXINTERFACES + 1),
+		INTERFACE(0, 0, 0)),
+	CONFIG_CASE("fewer interfaces than bNumInterfaces", 0, 1, 1, 1, 0,
+		CONFIG(25, 3),
+		INTERFACE(0, 0, 1),
+		ENDPOINT(0x81)),
+	CONFIG_CASE("more interfaces than bNumInterfaces", 9, 1, 1, 1, 0,
+		CONFIG(34, 1),
+		INTERFACE(0, 0, 1),
+		ENDPOINT(0x81),
+		INTERFACE(1, 0, 0)),
+	CONFIG_CASE("truncated interface", 5, 0, 0, 0, 0,
+		CONFIG(14, 1),
+		LIBUSB_DT_INTERFACE_SIZE, LIBUSB_DT_INTERFACE, 0, 0, 1),
+	CONFIG_CASE("interface shorter than the descriptor header", LIBUSB_ERROR_IO, 0, 0, 0, 0,
+		CONFIG(25, 1),
+		1, LIBUSB_DT_INTERFACE, 0, 0, 1, LIBUSB_CLASS_VENDOR_SPEC, 0, 0, 0,
+		ENDPOINT(0x81)),
+	CONFIG_CASE("interface shorter than its header", LIBUSB_ERROR_IO, 0, 0, 0, 0,
+		CONFIG(25, 1),
+		4, LIBUSB_DT_INTERFACE, 0, 0, 1, LIBUSB_CLASS_VENDOR_SPEC, 0, 0, 0,
+		ENDPOINT(0x81)),
+	CONFIG_CASE("interface overlapping its endpoint", 0, 2, 2, 0, 0,
+		CONFIG(34, 2),
+		16, LIBUSB_DT_INTERFACE, 0, 0, 1, LIBUSB_CLASS_VENDOR_SPEC, 0, 0, 0,
+		ENDPOINT(0x81),
+		INTERFACE(1, 0, 0)),
+	CONFIG_CASE("too many endpoints", LIBUSB_ERROR_IO, 0, 0, 0, 0,
+		CONFIG(25, 1),
+		INTERFACE(0, 0, USB_MAXENDPOINTS + 1),
+		ENDPOINT(0x81)),
+	CONFIG_CASE("fewer endpoints than bNumEndpoints", 0, 2, 2, 1, 0,
+		CONFIG(34, 2),
+		INTERFACE(0, 0, 5),
+		ENDPOINT(0x81),
+		INTERFACE(1, 0, 0)),
+	CONFIG_CASE("missing endpoints at the end", LIBUSB_ERROR_IO, 0, 0, 0, 0,
+		CONFIG(25, 1),
+		INTERFACE(0, 0, 2),
+		ENDPOINT(0x81)),
+	CONFIG_CASE("maximum bNumEndpoints", LIBUSB_ERROR_IO, 0, 0, 0, 0,
+		CONFIG(25, 1),
+		INTERFACE(0, 0, 255),
+		ENDPOINT(0x81)),
+	CONFIG_CASE("truncated endpoint", 4, 1, 1, 0, 0,
+		CONFIG(22, 1),
+		INTERFACE(0, 0, 1),
+		LIBUSB_DT_ENDPOINT_SIZE, LIBUSB_DT_ENDPOINT, 0x81, 0x02),
+	CONFIG_CASE("endpoint shorter than its header", LIBUSB_ERROR_IO, 0, 0, 0, 0,
+		CONFIG(25, 1),
+		INTERFACE(0, 0, 1),
+		5, LIBUSB_DT_ENDPOINT, 0x81, 0x02, 0x00, 0x02, 0),
+	CONFIG_CASE("endpoint overlapping the next one", 0, 2, 2, 1, 0,
+		CONFIG(41, 2),
+		INTERFACE(0, 0, 2),
+		14, LIBUSB_DT_ENDPOINT, 0x81, 0x02, 0x00, 0x02, 0,
+		ENDPOINT(0x01),
+		INTERFACE(1, 0, 0)),
+	CONFIG_CASE("empty extra descriptor", LIBUSB_ERROR_IO, 0, 0, 0, 0,
+		CONFIG(29, 1),
+		INTERFACE(0, 0, 1),
+		0, 0x24, 0x01, 0x02,
+		ENDPOINT(0x81)),
+	CONFIG_CASE("extra descriptor overlapping the end", 6, 1, 1, 0, 0,
+		CONFIG(24, 1),
+		INTERFACE(0, 0, 1),
+		8, 0x24, 0x01, 0x02, 0x03, 0x04),
+	CONFIG_CASE("extra configuration descriptor overlapping the end", 6, 0, 0, 0, 0,
+		CONFIG(15, 1),
+		8, 0x24, 0x01, 0x02, 0x03, 0x04),
+};
+
+static size_t region_used(const struct arena_region *region, const uint8_t *start)
+{
+	return (size_t)(region->next - start);
+}
+
+static int in_region(const void *ptr, size_t length, const uint8_t *start,
+	const struct arena_region *region)
+{
+	const uint8_t *p = ptr;
+
+	return p >= start && p + length <= region->next;
+}
+
+/* Check what the second pass of a case took from the regions sized by the
+ * first one, and that the tree it built lies within them. */
+static int check_config(const struct config_case *test,
+	const struct config_layout *layout, const struct config_arena *arena,
+	const uint8_t *const starts[4], const struct libusb_config_descriptor *config)
+{
+	size_t num_altsettings = 0, num_endpoints = 0, extra_length = 0;
+	size_t used_altsettings, used_endpoints, used_extra;
+	uint8_t i;
+	int j, k;
+
+	used_altsettings = region_used(&arena->altsettings, starts[0]) /
+		sizeof(struct libusb_interface_descriptor);
+	used_endpoints = region_used(&arena->endpoints, starts[1]) /
+		sizeof(struct libusb_endpoint_descriptor);
+	used_extra = region_used(&arena->extra, starts[3]);
+
+	if (config->bNumInterfaces != test->num_interfaces ||
+	    config->bNumInterfaces > layout->num_interfaces) {
+		libusb_testlib_logf("%s: %u interfaces parsed, %u expected, %zu sized",
+			test->name, config->bNumInterfaces, test->num_interfaces,
+			layout->num_interfaces);
+		return 0;
+	}
+	if (config->extra_length != (int)region_used(&arena->config_extra, starts[2]) ||
+	    (config->extra_length &&
+	     !in_region(config->extra, (size_t)config->extra_length, starts[2],
+			&arena->config_extra))) {
+		libusb_testlib_logf("%s: configuration extra outside of its region",
+			test->name);
+		return 0;
+	}
+
+	for (i = 0; i < config->bNumInterfaces; i++) {
+		const struct libusb_interface *iface = &config->interface[i];
+
+		for (j = 0; j < iface->num_altsetting; j++) {
+			const struct libusb_interface_descriptor *altsetting = &iface->altsetting[j];
+
+			if (!in_region(altsetting, sizeof(*altsetting), starts[0],
+					&arena->altsettings) ||
+			    (altsetting->bNumEndpoints &&
+			     !in_region(altsetting->endpoint,
+					altsetting->bNumEndpoints * sizeof(*altsetting->endpoint),
+					starts[1], &arena->endpoints)) ||
+			    (altsetting->extra_length &&
+			     !in_region(altsetting->extra, (size_t)altsetting->extra_length,
+					starts[3], &arena->extra))) {
+				libusb_testlib_logf("%s: alternate setting outside of its region",
+					test->name);
+				return 0;
+			}
+			num_altsettings++;
+			num_endpoints += altsetting->bNumEndpoints;
+			extra_length += (size_t)altsetting->extra_length;
+
+			for (k = 0; k < altsetting->bNumEndpoints; k++) {
+				const struct libusb_endpoint_descriptor *ep = &altsetting->endpoint[k];
+
+				if (ep->extra_length &&
+				    !in_region(ep->extra, (size_t)ep->extra_length, starts[3],
+					       &arena->extra)) {
+					libusb_testlib_logf("%s: endpoint extra outside of its region",
+						test->name);
+					return 0;
+				}
+				extra_length += (size_t)ep->extra_length;
+			}
+		}
+	}
+
+	/* the endpoint arrays are taken whole, even when fewer endpoints are
+	 * parsed than an interface announces */
+	if (num_altsettings != test->num_altsettings || num_altsettings != used_altsettings ||
+	    num_endpoints != test->num_endpoints || num_endpoints > used_endpoints ||
+	    extra_length != used_extra) {
+		libusb_testlib_logf("%s: %zu/%zu alternate settings, %zu/%zu endpoints and %zu/%zu extra bytes parsed/taken, %zu and %zu expected",
+			test->name, num_altsettings, used_altsettings, num_endpoints,
+			used_endpoints, extra_length, used_extra, test->num_altsettings,
+			test->num_endpoints);
+		return 0;
+	}
+
+	if (test->exact &&
+	    (config->bNumInterfaces != layout->num_interfaces ||
+	     used_altsettings != layout->num_altsettings ||
+	     used_endpoints != layout->num_endpoints ||
+	     (size_t)config->extra_length != layout->config_extra_length ||
+	     used_extra != layout->extra_length)) {
+		libusb_testlib_logf("%s: the first pass does not match the second one",
+			test->name);
+		return 0;
+	}
+
+	return 1;
+}
+
+static int run_config_case(const struct config_case *test)
+{
+	struct libusb_config_descriptor config;
+	struct libusb_interface *interfaces;
+	struct config_layout layout;
+	struct config_arena arena;
+	const uint8_t *starts[4];
+	uint8_t *buffer, *storage, *ptr;
+	size_t interfaces_size, storage_size;
+	int ok = 0, r;
+
+	buffer = malloc((size_t)test->size);
+	if (!buffer)
+		return 0;
+	memcpy(buffer, test->data, (size_t)test->size);
+
+	size_configuration(buffer, test->size, &layout);
+
+	/* each region ends where the next one starts, as in parse_config(),
+	 * so a region overrun would show as a mismatch */
+	interfaces_size = layout.num_interfaces * sizeof(struct libusb_interface);
+	storage_size = layout.num_altsettings * sizeof(struct libusb_interface_descriptor) +
+		layout.num_endpoints * sizeof(struct libusb_endpoint_descriptor) +
+		layout.config_extra_length + layout.extra_length;
+	interfaces = calloc(1, interfaces_size ? interfaces_size : 1);
+	storage = calloc(1, storage_size ? storage_size : 1);
+	if (!interfaces || !storage)
+		goto out;
+
+	ptr = storage;
+	starts[0] = ptr;
+	arena_region_init(&arena.altsettings, &ptr,
+		layout.num_altsettings * sizeof(struct libusb_interface_descriptor));
+	starts[1] = ptr;
+	arena_region_init(&arena.endpoints, &ptr,
+		layout.num_endpoints * sizeof(struct libusb_endpoint_descriptor));
+	starts[2] = ptr;
+	arena_region_init(&arena.config_extra, &ptr, layout.config_extra_length);
+	starts[3] = ptr;
+	arena_region_init(&arena.extra, &ptr, layout.extra_length);
+
+	memset(&config, 0, sizeof(config));
+	r = parse_configuration(NULL, &arena, &config, interfaces, buffer, test->size);
+	if (r != test->result) {
+		libusb_testlib_logf("%s: parse_configuration returned %d, %d expected",
+			test->name, r, test->result);
+		goto out;
+	}
+
+	ok = r < 0 || check_config(test, &layout, &arena, starts, &config);
+
+out:
+	free(storage);
+	free(interfaces);
+	free(buffer);
+	return ok;
+}
+
+/** Tests both passes of the configuration parser on the descriptors of
+ * config_cases */
+static libusb_testlib_result test_parse_configuration(void)
+{
+	libusb_testlib_result result = TEST_STATUS_SUCCESS;
+	size_t i;
+
+	for (i = 0; i < sizeof(config_cases) / sizeof(config_cases[0]); i++) {
+		if (!run_config_case(&config_cases[i]))
+			result = TEST_STATUS_FAILURE;
+	}
+
+	return result;
+}
+
+/* The sizes at which the descriptors of test_parse_config_truncated() are
+ * cut less than a descriptor header past where an endpoint descriptor is
+ * expected, which the parser rejects. At any other size from that of the
+ * configuration descriptor on, it parses as much as the buffer holds. */
+static const int truncation_errors[] = { 22, 23, 26, 27, 33, 34, 37, 38, 64, 65 };
+
+/** Tests the whole parser, from the raw descriptors to the parsed
+ * configuration, over every truncation of a descriptor set with all the
+ * kinds of descriptors parse_configuration() handles */
+static libusb_testlib_result test_parse_config_truncated(void)
+{
+	static const uint8_t data[] = {
+		CONFIG(71, 2),
+		CLASS_SPECIFIC,
+		INTERFACE(0, 0, 2),
+		CLASS_SPECIFIC,
+		ENDPOINT(0x81),
+		CLASS_SPECIFIC,
+		AUDIO_ENDPOINT(0x02),
+		INTERFACE(0, 1, 0),
+		INTERFACE(1, 0, 1),
+		ENDPOINT(0x83),
+	};
+	libusb_testlib_result result = TEST_STATUS_SUCCESS;
+	size_t next_error = 0;
+	int size;
+
+	for (size = 0; size <= (int)sizeof(data); size++) {
+		struct parsed_config *parsed;
+		uint8_t *buffer = malloc(size ? (size_t)size : 1);
+		int expected = LIBUSB_SUCCESS;
+		int r;
+
+		if (size < LIBUSB_DT_CONFIG_SIZE) {
+			expected = LIBUSB_ERROR_IO;
+		} else if (next_error < sizeof(truncation_errors) / sizeof(truncation_errors[0]) &&
+			   size == truncation_errors[next_error]) {
+			expected = LIBUSB_ERROR_IO;
+			next_error++;
+		}
+
+		if (!buffer)
+			return TEST_STATUS_ERROR;
+		memcpy(buffer, data, (size_t)size);
+
+		r = parse_config(NULL, buffer, size, &parsed);
+		if (r == LIBUSB_ERROR_NO_MEM) {
+			libusb_testlib_logf("%d bytes: the first pass is too short", size);
+			result = TEST_STATUS_FAILURE;
+		} else if (r != expected) {
+			libusb_testlib_logf("%d bytes: parse_config returned %d, %d expected",
+				size, r, expected);
+			result = TEST_STATUS_FAILURE;
+		} else if (r == LIBUSB_SUCCESS) {
+			if (size == (int)sizeof(data) &&
+			    (parsed->config.bNumInterfaces != 2 ||
+			     parsed->config.interface[0].num_altsetting != 2 ||
+			     parsed->config.interface[0].altsetting[0].bNumEndpoints != 2 ||
+			     parsed->config.interface[0].altsetting[0].endpoint[1].bRefresh != 2 ||
+			     parsed->config.interface[1].altsetting[0].endpoint[0].bEndpointAddress != 0x83 ||
+			     parsed->endpoints[USBI_ENDPOINT_INDEX(0x83)] !=
+					&parsed->config.interface[1].altsetting[0].endpoint[0])) {
+				libusb_testlib_logf("the whole descriptor set is misparsed");
+				result = TEST_STATUS_FAILURE;
+			}
+			free(parsed);
+		}
+		free(buffer);
+	}
+
+	return result;
+}
+
+#define BOS(total, num_caps)						\
+	LIBUSB_DT_BOS_SIZE, LIBUSB_DT_BOS, (total) & 0xff, (total) >> 8, (num_caps)
+
+#define USB_2_0_EXTENSION						\
+	LIBUSB_BT_USB_2_0_EXTENSION_SIZE, LIBUSB_DT_DEVICE_CAPABILITY,	\
+	LIBUSB_BT_USB_2_0_EXTENSION, 0x1e, 0x64, 0x00, 0x00
+
+struct bos_case {
+	const char *name;
+	uint8_t data[MAX_DESCRIPTOR_SIZE];
+	int size;
+	int result;
+	uint8_t num_caps;
+};
+
+#define BOS_CASE(name, result, num_caps, ...)				\
+	{ (name), { __VA_ARGS__ }, sizeof((uint8_t[]){ __VA_ARGS__ }),	\
+	  (result), (num_caps) }
+
+static const struct bos_case bos_cases[] = {
+	BOS_CASE("two capabilities", 0, 2,
+		BOS(19, 2),
+		USB_2_0_EXTENSION,
+		USB_2_0_EXTENSION),
+	BOS_CASE("truncated BOS", LIBUSB_ERROR_IO, 0,
+		LIBUSB_DT_BOS_SIZE, LIBUSB_DT_BOS, 12, 0),
+	BOS_CASE("BOS shorter than its header", LIBUSB_ERROR_IO, 0,
+		1, LIBUSB_DT_BOS, 12, 0, 1,
+		USB_2_0_EXTENSION),
+	BOS_CASE("BOS longer than the buffer", LIBUSB_ERROR_IO, 0,
+		32, LIBUSB_DT_BOS, 32, 0, 1,
+		USB_2_0_EXTENSION),
+	BOS_CASE("fewer capabilities than bNumDeviceCaps", 0, 1,
+		BOS(12, 255),
+		USB_2_0_EXTENSION),
+	BOS_CASE("truncated capability", 0, 1,
+		BOS(16, 2),
+		USB_2_0_EXTENSION,
+		LIBUSB_BT_USB_2_0_EXTENSION_SIZE, LIBUSB_DT_DEVICE_CAPABILITY,
+		LIBUSB_BT_USB_2_0_EXTENSION, 0x1e),
+	BOS_CASE("capability shorter than its header", LIBUSB_ERROR_IO, 0,
+		BOS(12, 1),
+		2, LIBUSB_DT_DEVICE_CAPABILITY, LIBUSB_BT_USB_2_0_EXTENSION,
+		0x1e, 0x64, 0x00, 0x00),
+	BOS_CASE("unexpected descriptor", 0, 1,
+		BOS(19, 2),
+		USB_2_0_EXTENSION,
+		ENDPOINT(0x81)),
+};
+
+/** Tests the BOS parser on the descriptors of bos_cases */
+static libusb_testlib_result test_parse_bos(void)
+{
+	libusb_testlib_result result = TEST_STATUS_SUCCESS;
+	size_t i;
+
+	for (i = 0; i < sizeof(bos_cases) / sizeof(bos_cases[0]); i++) {
+		const struct bos_case *test = &bos_cases[i];
+		struct libusb_bos_descriptor *bos = NULL;
+		uint8_t *buffer = malloc((size_t)test->size);
+		int r;
+
+		if (!buffer)
+			return TEST_STATUS_ERROR;
+		memcpy(buffer, test->data, (size_t)test->size);
+
+		r = parse_bos(NULL, &bos, buffer, test->size);
+		if (r != test->result || (r == LIBUSB_SUCCESS && bos->bNumDeviceCaps != test->num_caps)) {
+			libusb_testlib_logf("%s: parse_bos returned %d with %u capabilities, %d with %u expected",
+				test->name, r, r == LIBUSB_SUCCESS ? bos->bNumDeviceCaps : 0,
+				test->result, test->num_caps);
+			result = TEST_STATUS_FAILURE;
+		}
+		if (r == LIBUSB_SUCCESS)
+			libusb_free_bos_descriptor(bos);
+		free(buffer);
+	}
+
+	return result;
+}
+
+/* Fixed-layout decoders, with the descriptors filled in with distinct byte
+ * values so that a field read from the wrong offset or with the wrong
+ * endianness shows */
+
+#define DECODER(name, type)						\
+static void decode_##name(const uint8_t *sp, void *out)			\
+{									\
+	parse_##name##_descriptor(sp, (type *)out);			\
+}
+
+DECODER(config, struct libusb_config_descriptor)
+DECODER(interface, struct libusb_interface_descriptor)
+DECODER(ss_endpoint_companion, struct libusb_ss_endpoint_companion_descriptor)
+DECODER(bos, struct libusb_bos_descriptor)
+DECODER(usb_2_0_extension, struct libusb_usb_2_0_extension_descriptor)
+DECODER(ss_usb_device_capability, struct libusb_ss_usb_device_capability_descriptor)
+DECODER(container_id, struct libusb_container_id_descriptor)
+DECODER(platform, struct libusb_platform_descriptor)
+DECODER(iad, struct libusb_interface_association_descriptor)
+
+static void decode_endpoint(const uint8_t *sp, void *out)
+{
+	parse_endpoint_descriptor(sp, 0, out);
+}
+
+static void decode_audio_endpoint(const uint8_t *sp, void *out)
+{
+	parse_endpoint_descriptor(sp, 1, out);
+}
+
+static const struct libusb_config_descriptor config_expected = {
+	.bLength = 9, .bDescriptorType = LIBUSB_DT_CONFIG, .wTotalLength = 0x1234,
+	.bNumInterfaces = 5, .bConfigurationValue = 6, .iConfiguration = 7,
+	.bmAttributes = 8, .MaxPower = 9,
+};
+static const struct libusb_interface_descriptor interface_expected = {
+	.bLength = 9, .bDescriptorType = LIBUSB_DT_INTERFACE, .bInterfaceNumber = 3,
+	.bAlternateSetting = 4, .bNumEndpoints = 5, .bInterfaceClass = 6,
+	.bInterfaceSubClass = 7, .bInterfaceProtocol = 8, .iInterface = 9,
+};
+static const struct libusb_endpoint_descriptor endpoint_expected = {
+	.bLength = 7, .bDescriptorType = LIBUSB_DT_ENDPOINT, .bEndpointAddress = 3,
+	.bmAttributes = 4, .wMaxPacketSize = 0x0605, .bInterval = 7,
+};
+static const struct libusb_endpoint_descriptor audio_endpoint_expected = {
+	.bLength = 9, .bDescriptorType = LIBUSB_DT_ENDPOINT, .bEndpointAddress = 3,
+	.bmAttributes = 4, .wMaxPacketSize = 0x0605, .bInterval = 7,
+	.bRefresh = 8, .bSynchAddress = 9,
+};
+static const struct libusb_ss_endpoint_companion_descriptor ss_endpoint_companion_expected = {
+	.bLength = 6, .bDescriptorType = LIBUSB_DT_SS_ENDPOINT_COMPANION,
+	.bMaxBurst = 3, .bmAttributes = 4, .wBytesPerInterval = 0x0605,
+};
+static const struct libusb_bos_descriptor bos_expected = {
+	.bLength = 5, .bDescriptorType = LIBUSB_DT_BOS, .wTotalLength = 0x0403,
+	.bNumDeviceCaps = 5,
+};
+static const struct libusb_usb_2_0_extension_descriptor usb_2_0_extension_expected = {
+	.bLength = 7, .bDescriptorType = LIBUSB_DT_DEVICE_CAPABILITY,
+	.bDevCapabilityType = LIBUSB_BT_USB_2_0_EXTENSION, .bmAttributes = 0x07060504,
+};
+static const struct libusb_ss_usb_device_capability_descriptor ss_usb_device_capability_expected = {
+	.bLength = 10, .bDescriptorType = LIBUSB_DT_DEVICE_CAPABILITY,
+	.bDevCapabilityType = LIBUSB_BT_SS_USB_DEVICE_CAPABILITY, .bmAttributes = 4,
+	.wSpeedSupported = 0x0605, .bFunctionalitySupport = 7, .bU1DevExitLat = 8,
+	.bU2DevExitLat = 0x0a09,
+};
+static const struct libusb_container_id_descriptor container_id_expected = {
+	.bLength = 20, .bDescriptorType = LIBUSB_DT_DEVICE_CAPABILITY,
+	.bDevCapabilityType = LIBUSB_BT_CONTAINER_ID, .bReserved = 4,
+	.ContainerID = { 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19, 20 },
+};
+static const struct libusb_platform_descriptor platform_expected = {
+	.bLength = 20, .bDescriptorType = LIBUSB_DT_DEVICE_CAPABILITY,
+	.bDevCapabilityType = LIBUSB_BT_PLATFORM_DESCRIPTOR, .bReserved = 4,
+	.PlatformCapabilityUUID = { 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19, 20 },
+};
+static const struct libusb_interface_association_descriptor iad_expected = {
+	.bLength = 8, .bDescriptorType = LIBUSB_DT_INTERFACE_ASSOCIATION,
+	.bFirstInterface = 3, .bInterfaceCount = 4, .bFunctionClass = 5,
+	.bFunctionSubClass = 6, .bFunctionProtocol = 7, .iFunction = 8,
+};
+
+struct decoder_case {
+	const char *name;
+	void (*decode)(const uint8_t *sp, void *out);
+	uint8_t data[LIBUSB_BT_CONTAINER_ID_SIZE];
+	const void *expected;
+	size_t size;
+};
+
+#define DECODER_CASE(name, decode, expected, ...)			\
+	{ (name), (decode), { __VA_ARGS__ }, &(expected), sizeof(expected) }
+
+static const struct decoder_case decoder_cases[] = {
+	DECODER_CASE("configuration", decode_config, config_expected,
+		9, LIBUSB_DT_CONFIG, 0x34, 0x12, 5, 6, 7, 8, 9),
+	DECODER_CASE("interface", decode_interface, interface_expected,
+		9, LIBUSB_DT_INTERFACE, 3, 4, 5, 6, 7, 8, 9),
+	DECODER_CASE("endpoint", decode_endpoint, endpoint_expected,
+		7, LIBUSB_DT_ENDPOINT, 3, 4, 5, 6, 7),
+	DECODER_CASE("audio endpoint", decode_audio_endpoint, audio_endpoint_expected,
+		9, LIBUSB_DT_ENDPOINT, 3, 4, 5, 6, 7, 8, 9),
+	DECODER_CASE("SuperSpeed endpoint companion", decode_ss_endpoint_companion,
+		ss_endpoint_companion_expected,
+		6, LIBUSB_DT_SS_ENDPOINT_COMPANION, 3, 4, 5, 6),
+	DECODER_CASE("BOS", decode_bos, bos_expected,
+		5, LIBUSB_DT_BOS, 3, 4, 5),
+	DECODER_CASE("USB 2.0 extension", decode_usb_2_0_extension, usb_2_0_extension_expected,
+		7, LIBUSB_DT_DEVICE_CAPABILITY, LIBUSB_BT_USB_2_0_EXTENSION, 4, 5, 6, 7),
+	DECODER_CASE("SuperSpeed USB device capability", decode_ss_usb_device_capability,
+		ss_usb_device_capability_expected,
+		10, LIBUSB_DT_DEVICE_CAPABILITY, LIBUSB_BT_SS_USB_DEVICE_CAPABILITY,
+		4, 5, 6, 7, 8, 9, 10),
+	DECODER_CASE("container ID", decode_container_id, container_id_expected,
+		20, LIBUSB_DT_DEVICE_CAPABILITY, LIBUSB_BT_CONTAINER_ID, 4,
+		5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19, 20),
+	DECODER_CASE("platform", decode_platform, platform_expected,
+		20, LIBUSB_DT_DEVICE_CAPABILITY, LIBUSB_BT_PLATFORM_DESCRIPTOR, 4,
+		5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19, 20),
+	DECODER_CASE("interface association", decode_iad, iad_expected,
+		8, LIBUSB_DT_INTERFACE_ASSOCIATION, 3, 4, 5, 6, 7, 8),
+};
+
+/** Tests each fixed-layout decoder against the structure it should fill */
+static libusb_testlib_result test_decoders(void)
+{
+	libusb_testlib_result result = TEST_STATUS_SUCCESS;
+	size_t i;
+
+	for (i = 0; i < sizeof(decoder_cases) / sizeof(decoder_cases[0]); i++) {
+		const struct decoder_case *test = &decoder_cases[i];
+		uint8_t *buffer = malloc(test->data[0]);
+		void *out = calloc(1, test->size);
+
+		if (!buffer || !out) {
+			free(buffer);
+			free(out);
+			return TEST_STATUS_ERROR;
+		}
+
+		memcpy(buffer, test->data, test->data[0]);
+		test->decode(buffer, out);
+		if (memcmp(out, test->expected, test->size)) {
+			libusb_testlib_logf("%s: misdecoded", test->name);
+			result = TEST_STATUS_FAILURE;
+		}
+		free(out);
+		free(buffer);
+	}
+
+	return result;
+}
+
+static const libusb_testlib_test tests[] = {
+	{ "parse_configuration", &test_parse_configuration },
+	{ "parse_config_truncated", &test_parse_config_truncated },
+	{ "parse_bos", &test_parse_bos },
+	{ "decoders", &test_decoders },
+	LIBUSB_NULL_TEST
+};
+
+int main(int argc, char *argv[])
+{
+	return libusb_testlib_run_tests(argc, argv, tests);
+}
@@ -0,0 +1,2297 @@
+/*
+ * libusb stress tests for the loopback backend
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+ */
+
+/*
+ * These tests drive the asynchronous API from several threads against the
+ * device emulated by the loopback backend (./configure
+ * --enable-loopback-backend), so they are only built with that backend. The
+ * latency of the device is set for each test through LIBUSB_LOOPBACK_LATENCY,
+ * which the backend reads when the context is created.
+ */
+
+#include <config.h>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libusb.h"
+#include "libusb_testlib.h"
+
+#define LOOPBACK_VID		0x0525
+#define LOOPBACK_PID		0xa4a0
+#define BULK_IN			0x81
+#define BULK_LENGTH		512
+#define INTERRUPT_IN		0x83
+#define INTERRUPT_LENGTH	64
+
+/* vendor request making the loopback device disconnect from a handle */
+#define LOOPBACK_REQUEST_DISCONNECT	0x01
+/* vendor requests making the loopback device re-enumerate or unplugging it */
+#define LOOPBACK_REQUEST_REENUMERATE	0x02
+#define LOOPBACK_REQUEST_REMOVE		0x03
+
+/* longest time to wait for transfers to complete, in milliseconds */
+#define WAIT_TIMEOUT_MS		5000
+
+struct fixture {
+	libusb_context *ctx;
+	libusb_device_handle *handle;
+};
+
+struct counter {
+	atomic_int completed;
+	atomic_int failed;
+};
+
+static uint64_t now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+/* Create a context with the given device latency in microseconds and
+ * options, and open the loopback device */
+static libusb_testlib_result fixture_open_options(struct fixture *f,
+	const char *latency, const struct libusb_init_option *options,
+	int num_options)
+{
+	int r;
+
+	f->ctx = NULL;
+	f->handle = NULL;
+
+	if (latency)
+		setenv("LIBUSB_LOOPBACK_LATENCY", latency, 1);
+	else
+		unsetenv("LIBUSB_LOOPBACK_LATENCY");
+	r = libusb_init_context(&f->ctx, options, num_options);
+	unsetenv("LIBUSB_LOOPBACK_LATENCY");
+	if (r == LIBUSB_ERROR_NOT_SUPPORTED) {
+		libusb_testlib_logf("An option is not supported");
+		return TEST_STATUS_SKIP;
+	} else if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf("Failed to init libusb: %d", r);
+		return TEST_STATUS_FAILURE;
+	}
+
+	f->handle = libusb_open_device_with_vid_pid(f->ctx, LOOPBACK_VID, LOOPBACK_PID);
+	if (!f->handle) {
+		libusb_testlib_logf("Failed to open the loopback device");
+		libusb_exit(f->ctx);
+		return TEST_STATUS_FAILURE;
+	}
+
+	return TEST_STATUS_SUCCESS;
+}
+
+static libusb_testlib_result fixture_open(struct fixture *f, const char *latency)
+{
+	return fixture_open_options(f, latency, /*options=*/NULL, /*num_options=*/0);
+}
+
+static void fixture_close(struct fixture *f)
+{
+	if (f->handle)
+		libusb_close(f->handle);
+	libusb_exit(f->ctx);
+}
+
+static void LIBUSB_CALL count_cb(struct libusb_transfer *transfer)
+{
+	struct counter *counter = transfer->user_data;
+
+	if (transfer->status != LIBUSB_TRANSFER_COMPLETED ||
+	    transfer->actual_length != transfer->length)
+		atomic_fetch_add(&counter->failed, 1);
+	atomic_fetch_add(&counter->completed, 1);
+}
+
+static struct libusb_transfer *alloc_bulk(libusb_device_handle *handle,
+	libusb_transfer_cb_fn callback, void *user_data)
+{
+	struct libusb_transfer *transfer = libusb_alloc_transfer(0);
+	unsigned char *buffer = malloc(BULK_LENGTH);
+
+	if (!transfer || !buffer) {
+		libusb_free_transfer(transfer);
+		free(buffer);
+		return NULL;
+	}
+
+	libusb_fill_bulk_transfer(transfer, handle, BULK_IN, buffer, BULK_LENGTH,
+		callback, user_data, 0);
+	transfer->flags = LIBUSB_TRANSFER_FREE_BUFFER;
+	return transfer;
+}
+
+static void free_transfers(struct libusb_transfer **transfers, int count)
+{
+	for (int i = 0; i < count; i++)
+		libusb_free_transfer(transfers[i]);
+}
+
+/* Handle events until *count reaches target, returns 0 if it did before the
+ * timeout */
+static int wait_for_count(libusb_context *ctx, atomic_int *count, int target)
+{
+	uint64_t deadline = now_ms() + WAIT_TIMEOUT_MS;
+
+	while (atomic_load(count) < target) {
+		struct timeval tv = { 0, 10000 };
+
+		if (now_ms() >= deadline) {
+			libusb_testlib_logf("Timed out at %d of %d",
+				atomic_load(count), target);
+			return -1;
+		}
+		libusb_handle_events_timeout_completed(ctx, &tv, NULL);
+	}
+
+	return 0;
+}
+
+struct event_thread {
+	pthread_t thread;
+	libusb_context *ctx;
+	atomic_int stop;
+};
+
+static void *event_thread_main(void *arg)
+{
+	struct event_thread *et = arg;
+
+	while (!atomic_load(&et->stop))
+		libusb_handle_events_completed(et->ctx, NULL);
+
+	return NULL;
+}
+
+/* Start a thread handling the events of ctx, returns 0 on success */
+static int event_thread_start(struct event_thread *et, libusb_context *ctx)
+{
+	et->ctx = ctx;
+	atomic_init(&et->stop, 0);
+	if (pthread_create(&et->thread, NULL, event_thread_main, et)) {
+		libusb_testlib_logf("Failed to create the event thread");
+		return -1;
+	}
+
+	return 0;
+}
+
+static void event_thread_stop(struct event_thread *et)
+{
+	atomic_store(&et->stop, 1);
+	libusb_interrupt_event_handler(et->ctx);
+	pthread_join(et->thread, NULL);
+}
+
+/* Handle events for the given time, so that stray completions show up */
+static void handle_events_for(libusb_context *ctx, int ms)
+{
+	uint64_t deadline = now_ms() + (uint64_t)ms;
+
+	while (now_ms() < deadline) {
+		struct timeval tv = { 0, 10000 };
+
+		libusb_handle_events_timeout_completed(ctx, &tv, NULL);
+	}
+}
+
+/** Tests that libusb_submit_transfers() refuses invalid batches as a whole. */
+static libusb_testlib_result test_submit_transfers_invalid(void)
+{
+	libusb_testlib_result result = TEST_STATUS_FAILURE;
+	struct libusb_transfer *transfers[3] = { NULL };
+	struct libusb_transfer *batch[3];
+	struct libusb_transfer *other = NULL;
+	libusb_device_handle *other_handle = NULL;
+	struct counter counter = { 0 };
+	struct fixture f;
+	int r, error;
+
+	if (fixture_open(&f, NULL) != TEST_STATUS_SUCCESS)
+		return TEST_STATUS_FAILURE;
+
+	for (int i = 0; i < 3; i++) {
+		transfers[i] = alloc_bulk(f.handle, count_cb, &counter);
+		if (!transfers[i])
+			goto out;
+	}
+
+	r = libusb_open(libusb_get_device(f.handle), &other_handle);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf("Failed to open a second handle: %d", r);
+		goto out;
+	}
+	other = alloc_bulk(other_handle, count_cb, &counter);
+	if (!other)
+		goto out;
+
+	batch[0] = transfers[0];
+	batch[1] = transfers[1];
+	batch[2] = transfers[0];
+	r = libusb_submit_transfers(batch, 3, &error);
+	if (r != LIBUSB_ERROR_INVALID_PARAM || error != LIBUSB_ERROR_INVALID_PARAM) {
+		libusb_testlib_logf("Duplicate transfer: %d, error %d", r, error);
+		goto out;
+	}
+
+	batch[2] = other;
+	r = libusb_submit_transfers(batch, 3, &error);
+	if (r != LIBUSB_ERROR_INVALID_PARAM || error != LIBUSB_ERROR_INVALID_PARAM) {
+		libusb_testlib_logf("Two device handles: %d, error %d", r, error);
+		goto out;
+	}
+
+	handle_events_for(f.ctx, 50);
+	if (atomic_load(&counter.completed)) {
+		libusb_testlib_logf("%d transfers of a refused batch completed",
+			atomic_load(&counter.completed));
+		goto out;
+	}
+
+	/* none of the transfers must have been left in flight */
+	r = libusb_submit_transfers(transfers, 3, &error);
+	if (r != 3 || error != 0) {
+		libusb_testlib_logf("Valid batch: %d, error %d", r, error);
+		goto out;
+	}
+	if (wait_for_count(f.ctx, &counter.completed, 3))
+		goto out;
+
+	result = atomic_load(&counter.failed) ? TEST_STATUS_FAILURE : TEST_STATUS_SUCCESS;
+
+out:
+	free_transfers(transfers, 3);
+	libusb_free_transfer(other);
+	if (other_handle)
+		libusb_close(other_handle);
+	fixture_close(&f);
+	return result;
+}
+
+/* more than the transfers libusb_submit_transfers() locks at once */
+#define BUSY_TRANSFERS	100
+
+/* Submit count transfers in a batch, the one at index busy being in flight
+ * already, and check that the batch stops there. */
+static libusb_testlib_result submit_busy(int count, int busy)
+{
+	libusb_testlib_result result = TEST_STATUS_FAILURE;
+	struct libusb_transfer *transfers[BUSY_TRANSFERS] = { NULL };
+	struct counter counter = { 0 };
+	struct fixture f;
+	int r, error;
+
+	if (fixture_open(&f, "20000") != TEST_STATUS_SUCCESS)
+		return TEST_STATUS_FAILURE;
+
+	for (int i = 0; i < count; i++) {
+		transfers[i] = alloc_bulk(f.handle, count_cb, &counter);
+		if (!transfers[i])
+			goto out;
+	}
+
+	r = libusb_submit_transfer(transfers[busy]);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf("Failed to submit: %d", r);
+		goto out;
+	}
+
+	r = libusb_submit_transfers(transfers, count, &error);
+	if (r != busy || error != LIBUSB_ERROR_BUSY) {
+		libusb_testlib_logf("Batch of %d with transfer %d busy: %d, error %d",
+			count, busy, r, error);
+		goto out;
+	}
+
+	if (wait_for_count(f.ctx, &counter.completed, busy + 1))
+		goto out;
+	handle_events_for(f.ctx, 50);
+	if (atomic_load(&counter.completed) != busy + 1) {
+		libusb_testlib_logf("%d transfers completed instead of %d",
+			atomic_load(&counter.completed), busy + 1);
+		goto out;
+	}
+
+	/* the transfers after the busy one were not submitted */
+	r = libusb_submit_transfers(transfers + busy + 1, count - busy - 1, &error);
+	if (r != count - busy - 1) {
+		libusb_testlib_logf("Failed to submit the last transfers: %d, error %d",
+			r, error);
+		goto out;
+	}
+	if (wait_for_count(f.ctx, &counter.completed, count))
+		goto out;
+
+	result = atomic_load(&counter.failed) ? TEST_STATUS_FAILURE : TEST_STATUS_SUCCESS;
+
+out:
+	free_transfers(transfers, count);
+	fixture_close(&f);
+	return result;
+}
+
+/** Tests that a batch stops at a transfer which is still in flight, within
+ * the first group of transfers it locks together and past it. */
+static libusb_testlib_result test_submit_transfers_busy(void)
+{
+	libusb_testlib_result result = submit_busy(3, 1);
+
+	if (result == TEST_STATUS_SUCCESS)
+		result = submit_busy(BUSY_TRANSFERS, 70);
+	return result;
+}
+
+#define BATCH_THREADS	4
+#define BATCH_SIZE	16
+#define BATCH_ROUNDS	200
+
+struct batch_thread {
+	pthread_t thread;
+	libusb_context *ctx;
+	libusb_device *dev;
+	struct counter counter;
+	int failed;
+};
+
+static void *batch_thread_main(void *arg)
+{
+	struct batch_thread *bt = arg;
+	struct libusb_transfer *transfers[BATCH_SIZE] = { NULL };
+	libusb_device_handle *handle;
+	int r, error;
+
+	r = libusb_open(bt->dev, &handle);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf("Failed to open: %d", r);
+		bt->failed = 1;
+		return NULL;
+	}
+
+	for (int i = 0; i < BATCH_SIZE; i++) {
+		transfers[i] = alloc_bulk(handle, count_cb, &bt->counter);
+		if (!transfers[i]) {
+			bt->failed = 1;
+			goto out;
+		}
+	}
+
+	/* every thread handles events for all of them while it waits */
+	for (int round = 1; round <= BATCH_ROUNDS; round++) {
+		r = libusb_submit_transfers(transfers, BATCH_SIZE, &error);
+		if (r != BATCH_SIZE || error != 0) {
+			libusb_testlib_logf("Round %d: %d, error %d", round, r, error);
+			bt->failed = 1;
+			break;
+		}
+		if (wait_for_count(bt->ctx, &bt->counter.completed, round * BATCH_SIZE)) {
+			bt->failed = 1;
+			break;
+		}
+	}
+
+out:
+	free_transfers(transfers, BATCH_SIZE);
+	libusb_close(handle);
+	return NULL;
+}
+
+/** Tests batches submitted on one handle per thread. */
+static libusb_testlib_result test_submit_transfers_threads(void)
+{
+	struct batch_thread threads[BATCH_THREADS];
+	libusb_testlib_result result = TEST_STATUS_SUCCESS;
+	struct fixture f;
+
+	if (fixture_open(&f, NULL) != TEST_STATUS_SUCCESS)
+		return TEST_STATUS_FAILURE;
+
+	memset(threads, 0, sizeof(threads));
+	for (int i = 0; i < BATCH_THREADS; i++) {
+		threads[i].ctx = f.ctx;
+		threads[i].dev = libusb_get_device(f.handle);
+		if (pthread_create(&threads[i].thread, NULL, batch_thread_main, &threads[i])) {
+			libusb_testlib_logf("Failed to create thread %d", i);
+			while (i-- > 0)
+				pthread_join(threads[i].thread, NULL);
+			fixture_close(&f);
+			return TEST_STATUS_ERROR;
+		}
+	}
+
+	for (int i = 0; i < BATCH_THREADS; i++) {
+		pthread_join(threads[i].thread, NULL);
+		if (threads[i].failed || atomic_load(&threads[i].counter.failed))
+			result = TEST_STATUS_FAILURE;
+	}
+
+	fixture_close(&f);
+	return result;
+}
+
+#define QUEUE_THREADS		4
+#define QUEUE_TRANSFERS		8
+#define QUEUE_COMPLETIONS	2000
+
+struct queue_thread {
+	pthread_t thread;
+	libusb_context *ctx;
+	libusb_device_handle *handle;
+	libusb_completion_queue *queue;
+	int completed;
+	int resubmit_failed;
+	int wrong_thread;
+	int failed;
+};
+
+static void LIBUSB_CALL queue_cb(struct libusb_transfer *transfer)
+{
+	struct queue_thread *qt = transfer->user_data;
+
+	if (!pthread_equal(pthread_self(), qt->thread))
+		qt->wrong_thread++;
+	if (transfer->status != LIBUSB_TRANSFER_COMPLETED)
+		qt->failed = 1;
+	if (++qt->completed + QUEUE_TRANSFERS <= QUEUE_COMPLETIONS &&
+	    libusb_submit_transfer(transfer) != LIBUSB_SUCCESS)
+		qt->resubmit_failed++;
+}
+
+static void *queue_thread_main(void *arg)
+{
+	struct queue_thread *qt = arg;
+	struct libusb_transfer *transfers[QUEUE_TRANSFERS] = { NULL };
+	uint64_t deadline = now_ms() + WAIT_TIMEOUT_MS;
+	int r;
+
+	r = libusb_completion_queue_create(qt->ctx, &qt->queue);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf("Failed to create a completion queue: %d", r);
+		qt->failed = 1;
+		return NULL;
+	}
+
+	for (int i = 0; i < QUEUE_TRANSFERS; i++) {
+		transfers[i] = alloc_bulk(qt->handle, queue_cb, qt);
+		if (!transfers[i] ||
+		    libusb_transfer_set_completion_queue(transfers[i], qt->queue) ||
+		    libusb_submit_transfer(transfers[i])) {
+			qt->failed = 1;
+			while (i-- > 0)
+				libusb_cancel_transfer(transfers[i]);
+			break;
+		}
+	}
+
+	/* the callbacks are only run by this thread, which does not handle
+	 * events itself */
+	while (qt->completed < QUEUE_COMPLETIONS && !qt->failed) {
+		struct timeval tv = { 0, 100000 };
+
+		if (now_ms() >= deadline) {
+			libusb_testlib_logf("Timed out at %d of %d completions",
+				qt->completed, QUEUE_COMPLETIONS);
+			qt->failed = 1;
+			break;
+		}
+		r = libusb_completion_queue_dispatch(qt->queue, &tv);
+		if (r < 0) {
+			libusb_testlib_logf("Failed to dispatch: %d", r);
+			qt->failed = 1;
+		}
+	}
+
+	free_transfers(transfers, QUEUE_TRANSFERS);
+	libusb_completion_queue_destroy(qt->queue);
+	return NULL;
+}
+
+/** Tests that each thread gets the completions of its own queue, and only
+ * those. */
+static libusb_testlib_result test_completion_queue_threads(void)
+{
+	struct queue_thread threads[QUEUE_THREADS];
+	libusb_testlib_result result = TEST_STATUS_SUCCESS;
+	struct event_thread et;
+	struct fixture f;
+	int i;
+
+	if (fixture_open(&f, NULL) != TEST_STATUS_SUCCESS)
+		return TEST_STATUS_FAILURE;
+	if (event_thread_start(&et, f.ctx)) {
+		fixture_close(&f);
+		return TEST_STATUS_ERROR;
+	}
+
+	memset(threads, 0, sizeof(threads));
+	for (i = 0; i < QUEUE_THREADS; i++) {
+		threads[i].ctx = f.ctx;
+		threads[i].handle = f.handle;
+		if (pthread_create(&threads[i].thread, NULL, queue_thread_main, &threads[i])) {
+			libusb_testlib_logf("Failed to create thread %d", i);
+			result = TEST_STATUS_ERROR;
+			break;
+		}
+	}
+
+	while (i-- > 0) {
+		pthread_join(threads[i].thread, NULL);
+		if (threads[i].failed || threads[i].resubmit_failed ||
+		    threads[i].wrong_thread) {
+			libusb_testlib_logf("Thread %d: %d completions, %d failed resubmissions, %d on another thread",
+				i, threads[i].completed, threads[i].resubmit_failed,
+				threads[i].wrong_thread);
+			result = TEST_STATUS_FAILURE;
+		}
+	}
+
+	event_thread_stop(&et);
+	fixture_close(&f);
+	return result;
+}
+
+#define DISPATCH_THREADS	8
+#define DISPATCH_TIMEOUT_MS	100
+#define DISPATCH_SLACK_MS	90
+#define DISPATCH_COMPLETIONS	100
+
+struct dispatch_thread {
+	pthread_t thread;
+	libusb_completion_queue *queue;
+	atomic_int *stop;
+	uint64_t longest_ms;
+	int failed;
+};
+
+static void *dispatch_thread_main(void *arg)
+{
+	struct dispatch_thread *dt = arg;
+
+	while (!atomic_load(dt->stop)) {
+		struct timeval tv = { 0, DISPATCH_TIMEOUT_MS * 1000 };
+		uint64_t start = now_ms(), elapsed;
+
+		if (libusb_completion_queue_dispatch(dt->queue, &tv) < 0)
+			dt->failed = 1;
+		elapsed = now_ms() - start;
+		if (elapsed > dt->longest_ms)
+			dt->longest_ms = elapsed;
+	}
+
+	return NULL;
+}
+
+/** Tests that a dispatch losing every completion to another thread still
+ * returns once its timeout has passed. */
+static libusb_testlib_result test_completion_queue_timeout(void)
+{
+	struct dispatch_thread threads[DISPATCH_THREADS];
+	libusb_testlib_result result = TEST_STATUS_SUCCESS;
+	libusb_completion_queue *queue;
+	struct counter counter = { 0 };
+	struct event_thread et;
+	atomic_int stop;
+	struct fixture f;
+	int i, r;
+
+	if (fixture_open(&f, NULL) != TEST_STATUS_SUCCESS)
+		return TEST_STATUS_FAILURE;
+	r = libusb_completion_queue_create(f.ctx, &queue);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf("Failed to create a completion queue: %d", r);
+		fixture_close(&f);
+		return TEST_STATUS_FAILURE;
+	}
+	if (event_thread_start(&et, f.ctx)) {
+		libusb_completion_queue_destroy(queue);
+		fixture_close(&f);
+		return TEST_STATUS_ERROR;
+	}
+
+	atomic_init(&stop, 0);
+	memset(threads, 0, sizeof(threads));
+	for (i = 0; i < DISPATCH_THREADS; i++) {
+		threads[i].queue = queue;
+		threads[i].stop = &stop;
+		if (pthread_create(&threads[i].thread, NULL, dispatch_thread_main, &threads[i])) {
+			libusb_testlib_logf("Failed to create thread %d", i);
+			result = TEST_STATUS_ERROR;
+			break;
+		}
+	}
+
+	/* a completion every 10ms wakes up all of the threads, only one of
+	 * which gets it */
+	for (int n = 0; n < DISPATCH_COMPLETIONS && result == TEST_STATUS_SUCCESS; n++) {
+		struct libusb_transfer *transfer = alloc_bulk(f.handle, count_cb, &counter);
+		struct timespec delay = { 0, 10000000 };
+
+		if (!transfer) {
+			result = TEST_STATUS_ERROR;
+			break;
+		}
+		transfer->flags |= LIBUSB_TRANSFER_FREE_TRANSFER;
+		if (libusb_transfer_set_completion_queue(transfer, queue) ||
+		    libusb_submit_transfer(transfer)) {
+			libusb_free_transfer(transfer);
+			result = TEST_STATUS_FAILURE;
+			break;
+		}
+		nanosleep(&delay, NULL);
+	}
+
+	if (result == TEST_STATUS_SUCCESS) {
+		uint64_t deadline = now_ms() + WAIT_TIMEOUT_MS;
+
+		while (atomic_load(&counter.completed) < DISPATCH_COMPLETIONS &&
+		       now_ms() < deadline) {
+			struct timespec delay = { 0, 1000000 };
+
+			nanosleep(&delay, NULL);
+		}
+		if (atomic_load(&counter.completed) != DISPATCH_COMPLETIONS) {
+			libusb_testlib_logf("%d of %d completions dispatched",
+				atomic_load(&counter.completed), DISPATCH_COMPLETIONS);
+			result = TEST_STATUS_FAILURE;
+		}
+	}
+
+	atomic_store(&stop, 1);
+	while (i-- > 0) {
+		pthread_join(threads[i].thread, NULL);
+		if (threads[i].failed ||
+		    threads[i].longest_ms > DISPATCH_TIMEOUT_MS + DISPATCH_SLACK_MS) {
+			libusb_testlib_logf("Thread %d: longest dispatch %lums",
+				i, (unsigned long)threads[i].longest_ms);
+			result = TEST_STATUS_FAILURE;
+		}
+	}
+
+	event_thread_stop(&et);
+	libusb_completion_queue_destroy(queue);
+	fixture_close(&f);
+	return result;
+}
+
+#define EVENT_LOOPS		4
+#define EVENT_LOOP_ROUNDS	100
+#define EVENT_LOOP_TRANSFERS	8
+
+struct loop_thread {
+	pthread_t thread;
+	libusb_context *ctx;
+	int loop;
+	atomic_int *stop;
+	int iterations;
+	int failed;
+};
+
+static void *loop_thread_main(void *arg)
+{
+	struct loop_thread *lt = arg;
+
+	while (!atomic_load(lt->stop)) {
+		struct timeval tv = { 0, 1000 };
+		int r = libusb_handle_events_loop(lt->ctx, lt->loop, &tv);
+
+		if (r != LIBUSB_SUCCESS) {
+			libusb_testlib_logf("Loop %d failed: %d", lt->loop, r);
+			lt->failed = 1;
+			break;
+		}
+		lt->iterations++;
+	}
+
+	return NULL;
+}
+
+struct loop_counter {
+	struct counter counter;
+	libusb_context *ctx;
+	atomic_int not_busy;
+};
+
+static void LIBUSB_CALL loop_cb(struct libusb_transfer *transfer)
+{
+	struct loop_counter *lc = transfer->user_data;
+	struct timeval tv = { 0, 0 };
+
+	/* no loop can be run from a callback */
+	if (libusb_handle_events_loop(lc->ctx, 1, &tv) != LIBUSB_ERROR_BUSY)
+		atomic_fetch_add(&lc->not_busy, 1);
+	count_cb(transfer);
+}
+
+/** Tests the secondary event loops running while devices are opened and
+ * closed, and transfers completed, on the primary loop. */
+static libusb_testlib_result test_event_loops(void)
+{
+	struct libusb_init_option options[] = {
+		{ .option = LIBUSB_OPTION_EVENT_LOOPS, .value = { .ival = EVENT_LOOPS } },
+	};
+	struct loop_thread threads[EVENT_LOOPS - 1];
+	libusb_testlib_result result;
+	struct loop_counter lc;
+	struct timeval tv = { 0, 0 };
+	atomic_int stop;
+	struct fixture f;
+	int i, r;
+
+	result = fixture_open_options(&f, "1000", options, 1);
+	if (result != TEST_STATUS_SUCCESS)
+		return result;
+
+	r = libusb_handle_events_loop(f.ctx, EVENT_LOOPS, &tv);
+	if (r != LIBUSB_ERROR_INVALID_PARAM) {
+		libusb_testlib_logf("Loop %d: %d", EVENT_LOOPS, r);
+		fixture_close(&f);
+		return TEST_STATUS_FAILURE;
+	}
+
+	memset(&lc, 0, sizeof(lc));
+	lc.ctx = f.ctx;
+	atomic_init(&stop, 0);
+	memset(threads, 0, sizeof(threads));
+	for (i = 0; i < EVENT_LOOPS - 1; i++) {
+		threads[i].ctx = f.ctx;
+		threads[i].loop = i + 1;
+		threads[i].stop = &stop;
+		if (pthread_create(&threads[i].thread, NULL, loop_thread_main, &threads[i])) {
+			libusb_testlib_logf("Failed to create thread %d", i);
+			result = TEST_STATUS_ERROR;
+			break;
+		}
+	}
+
+	for (int round = 1; round <= EVENT_LOOP_ROUNDS && result == TEST_STATUS_SUCCESS; round++) {
+		struct libusb_transfer *transfers[EVENT_LOOP_TRANSFERS] = { NULL };
+		libusb_device_handle *handle;
+		int error;
+
+		r = libusb_open(libusb_get_device(f.handle), &handle);
+		if (r != LIBUSB_SUCCESS) {
+			libusb_testlib_logf("Failed to open: %d", r);
+			result = TEST_STATUS_FAILURE;
+			break;
+		}
+
+		for (int j = 0; j < EVENT_LOOP_TRANSFERS; j++) {
+			transfers[j] = alloc_bulk(handle, loop_cb, &lc);
+			if (!transfers[j])
+				result = TEST_STATUS_ERROR;
+		}
+		if (result == TEST_STATUS_SUCCESS) {
+			r = libusb_submit_transfers(transfers, EVENT_LOOP_TRANSFERS, &error);
+			if (r != EVENT_LOOP_TRANSFERS ||
+			    wait_for_count(f.ctx, &lc.counter.completed,
+					   round * EVENT_LOOP_TRANSFERS))
+				result = TEST_STATUS_FAILURE;
+		}
+
+		free_transfers(transfers, EVENT_LOOP_TRANSFERS);
+		libusb_close(handle);
+	}
+
+	atomic_store(&stop, 1);
+	while (i-- > 0) {
+		pthread_join(threads[i].thread, NULL);
+		if (threads[i].failed)
+			result = TEST_STATUS_FAILURE;
+	}
+
+	if (atomic_load(&lc.counter.failed) || atomic_load(&lc.not_busy)) {
+		libusb_testlib_logf("%d failed transfers, %d loops run from a callback",
+			atomic_load(&lc.counter.failed), atomic_load(&lc.not_busy));
+		result = TEST_STATUS_FAILURE;
+	}
+
+	fixture_close(&f);
+	return result;
+}
+
+#define RING_TRANSFERS		16
+#define RING_COMPLETIONS	2000
+
+struct ring_state {
+	libusb_transfer_ring *ring;
+	atomic_int completed;
+	atomic_int stopping;
+	int next;
+	int cancelled;
+	int largest_batch;
+	int out_of_order;
+	int bad_status;
+	atomic_int single_callbacks;
+};
+
+static void LIBUSB_CALL ring_single_cb(struct libusb_transfer *transfer)
+{
+	struct ring_state *rs = transfer->user_data;
+
+	atomic_fetch_add(&rs->single_callbacks, 1);
+}
+
+static void LIBUSB_CALL ring_batch_cb(libusb_transfer_ring *ring,
+	struct libusb_transfer **transfers, int num_transfers, void *user_data)
+{
+	struct ring_state *rs = user_data;
+
+	if (ring != rs->ring || num_transfers < 1 || num_transfers > RING_TRANSFERS) {
+		rs->bad_status++;
+		return;
+	}
+	if (num_transfers > rs->largest_batch)
+		rs->largest_batch = num_transfers;
+
+	for (int i = 0; i < num_transfers; i++) {
+		struct libusb_transfer *transfer = transfers[i];
+
+		if (transfer->status == LIBUSB_TRANSFER_CANCELLED) {
+			rs->cancelled++;
+			continue;
+		}
+		if (transfer->status != LIBUSB_TRANSFER_COMPLETED ||
+		    transfer->actual_length != transfer->length)
+			rs->bad_status++;
+
+		/* the ring is resubmitted in the order it completes, and the
+		 * loopback device completes an endpoint's transfers in order */
+		if (!atomic_load(&rs->stopping) &&
+		    transfer != libusb_transfer_ring_get_transfer(ring, rs->next))
+			rs->out_of_order++;
+		rs->next = (rs->next + 1) % RING_TRANSFERS;
+		atomic_fetch_add(&rs->completed, 1);
+	}
+}
+
+/** Tests that the batch callback of a ring gets the completions of the ring
+ * oldest first, while two threads handle events. */
+static libusb_testlib_result test_transfer_ring_batches(void)
+{
+	libusb_testlib_result result = TEST_STATUS_SUCCESS;
+	struct ring_state rs;
+	struct event_thread et;
+	struct fixture f;
+	int r;
+
+	if (fixture_open(&f, "2000") != TEST_STATUS_SUCCESS)
+		return TEST_STATUS_FAILURE;
+
+	memset(&rs, 0, sizeof(rs));
+	r = libusb_alloc_transfer_ring(f.handle, BULK_IN, LIBUSB_TRANSFER_TYPE_BULK,
+		RING_TRANSFERS, BULK_LENGTH, 0, ring_single_cb, &rs, &rs.ring);
+	if (r == LIBUSB_SUCCESS)
+		r = libusb_transfer_ring_set_batch_callback(rs.ring, ring_batch_cb);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf("Failed to set up the ring: %d", r);
+		libusb_free_transfer_ring(rs.ring);
+		fixture_close(&f);
+		return TEST_STATUS_FAILURE;
+	}
+
+	if (event_thread_start(&et, f.ctx)) {
+		libusb_free_transfer_ring(rs.ring);
+		fixture_close(&f);
+		return TEST_STATUS_ERROR;
+	}
+
+	r = libusb_start_transfer_ring(rs.ring);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf("Failed to start the ring: %d", r);
+		result = TEST_STATUS_FAILURE;
+	} else if (wait_for_count(f.ctx, &rs.completed, RING_COMPLETIONS)) {
+		result = TEST_STATUS_FAILURE;
+	}
+
+	atomic_store(&rs.stopping, 1);
+	libusb_free_transfer_ring(rs.ring);
+	event_thread_stop(&et);
+
+	libusb_testlib_logf("%d completions, %d cancelled, batches of up to %d",
+		atomic_load(&rs.completed), rs.cancelled, rs.largest_batch);
+	if (rs.out_of_order || rs.bad_status || atomic_load(&rs.single_callbacks)) {
+		libusb_testlib_logf("%d out of order, %d failed, %d per-transfer callbacks",
+			rs.out_of_order, rs.bad_status, atomic_load(&rs.single_callbacks));
+		result = TEST_STATUS_FAILURE;
+	}
+
+	fixture_close(&f);
+	return result;
+}
+
+#define SCHED_STREAMS		4
+#define SCHED_DEPTH		2
+#define SCHED_TRANSFERS		64
+#define SCHED_COMPLETIONS	4000
+
+struct sched_state {
+	libusb_stream_scheduler *sched;
+	atomic_int resubmit;
+	atomic_int done;
+	atomic_int completed;
+	atomic_int cancelled;
+	atomic_int submitted;
+	atomic_int too_deep;
+	atomic_int failed;
+};
+
+static void LIBUSB_CALL sched_cb(struct libusb_transfer *transfer)
+{
+	struct sched_state *ss = transfer->user_data;
+	uint32_t stream_id = libusb_transfer_get_stream_id(transfer);
+
+	if (transfer->status == LIBUSB_TRANSFER_CANCELLED) {
+		atomic_fetch_add(&ss->cancelled, 1);
+		atomic_fetch_add(&ss->done, 1);
+		return;
+	}
+	if (transfer->status != LIBUSB_TRANSFER_COMPLETED ||
+	    stream_id < 1 || stream_id > SCHED_STREAMS)
+		atomic_fetch_add(&ss->failed, 1);
+
+	for (uint32_t id = 1; id <= SCHED_STREAMS; id++) {
+		struct libusb_stream_stats stats;
+
+		if (libusb_stream_scheduler_get_stream_stats(ss->sched, id, &stats) ||
+		    stats.in_flight < 0 || stats.in_flight > SCHED_DEPTH)
+			atomic_fetch_add(&ss->too_deep, 1);
+	}
+
+	atomic_fetch_add(&ss->completed, 1);
+	atomic_fetch_add(&ss->done, 1);
+	if (atomic_load(&ss->resubmit) &&
+	    atomic_fetch_add(&ss->submitted, 1) < SCHED_COMPLETIONS &&
+	    libusb_stream_scheduler_submit(ss->sched, transfer))
+		atomic_fetch_add(&ss->failed, 1);
+}
+
+/* Submit all the transfers through the scheduler, returns 0 on success */
+static int sched_submit_all(struct sched_state *ss,
+	struct libusb_transfer **transfers)
+{
+	for (int i = 0; i < SCHED_TRANSFERS; i++) {
+		int r;
+
+		atomic_fetch_add(&ss->submitted, 1);
+		r = libusb_stream_scheduler_submit(ss->sched, transfers[i]);
+		if (r != LIBUSB_SUCCESS) {
+			libusb_testlib_logf("Failed to submit transfer %d: %d", i, r);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/** Tests that a stream scheduler keeps at most depth transfers in flight on
+ * each stream, uses all of them and cancels everything it holds. */
+static libusb_testlib_result test_stream_scheduler(void)
+{
+	libusb_testlib_result result = TEST_STATUS_FAILURE;
+	struct libusb_transfer *transfers[SCHED_TRANSFERS] = { NULL };
+	struct sched_state ss;
+	struct event_thread et;
+	uint64_t total = 0;
+	struct fixture f;
+	int r;
+
+	if (fixture_open(&f, "500") != TEST_STATUS_SUCCESS)
+		return TEST_STATUS_FAILURE;
+
+	memset(&ss, 0, sizeof(ss));
+	r = libusb_stream_scheduler_create(f.handle, SCHED_STREAMS, SCHED_DEPTH, &ss.sched);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf("Failed to create the scheduler: %d", r);
+		fixture_close(&f);
+		return TEST_STATUS_FAILURE;
+	}
+	for (int i = 0; i < SCHED_TRANSFERS; i++) {
+		transfers[i] = alloc_bulk(f.handle, sched_cb, &ss);
+		if (!transfers[i])
+			goto out_free;
+	}
+	if (event_thread_start(&et, f.ctx))
+		goto out_free;
+
+	/* most of the transfers start queued, and are resubmitted by their
+	 * callback until enough have completed */
+	atomic_store(&ss.resubmit, 1);
+	if (sched_submit_all(&ss, transfers) ||
+	    wait_for_count(f.ctx, &ss.done, SCHED_COMPLETIONS))
+		goto out;
+	atomic_store(&ss.resubmit, 0);
+
+	for (uint32_t id = 1; id <= SCHED_STREAMS; id++) {
+		struct libusb_stream_stats stats;
+
+		libusb_stream_scheduler_get_stream_stats(ss.sched, id, &stats);
+		if (stats.in_flight ||
+		    stats.transfers_completed < SCHED_COMPLETIONS / SCHED_STREAMS / 2) {
+			libusb_testlib_logf("Stream %u: %d in flight, %llu completed",
+				id, stats.in_flight,
+				(unsigned long long)stats.transfers_completed);
+			goto out;
+		}
+		total += stats.transfers_completed;
+	}
+	if (total != SCHED_COMPLETIONS) {
+		libusb_testlib_logf("%llu transfers counted by the streams",
+			(unsigned long long)total);
+		goto out;
+	}
+
+	/* the queued transfers are cancelled right away, the others when
+	 * events are handled */
+	if (sched_submit_all(&ss, transfers))
+		goto out;
+	libusb_stream_scheduler_cancel(ss.sched);
+	if (atomic_load(&ss.cancelled) < SCHED_TRANSFERS - SCHED_STREAMS * SCHED_DEPTH) {
+		libusb_testlib_logf("Only %d transfers cancelled", atomic_load(&ss.cancelled));
+		goto out;
+	}
+	if (wait_for_count(f.ctx, &ss.done, SCHED_COMPLETIONS + SCHED_TRANSFERS))
+		goto out;
+
+	if (atomic_load(&ss.failed) || atomic_load(&ss.too_deep)) {
+		libusb_testlib_logf("%d failed transfers, %d streams too deep",
+			atomic_load(&ss.failed), atomic_load(&ss.too_deep));
+		goto out;
+	}
+	result = TEST_STATUS_SUCCESS;
+
+out:
+	event_thread_stop(&et);
+out_free:
+	free_transfers(transfers, SCHED_TRANSFERS);
+	libusb_stream_scheduler_destroy(ss.sched);
+	fixture_close(&f);
+	return result;
+}
+
+#define RACE_THREADS		4
+#define RACE_TRANSFERS		16
+#define RACE_ROUNDS		2000
+
+struct race_slot {
+	struct race_thread *owner;
+	struct libusb_transfer *transfer;
+	atomic_int in_flight;
+};
+
+struct race_thread {
+	pthread_t thread;
+	libusb_context *ctx;
+	libusb_device_handle *handle;
+	struct race_slot slots[RACE_TRANSFERS];
+	atomic_int callbacks;
+	atomic_int twice;
+	atomic_int bad_status;
+	int submitted;
+	int cancelled;
+	int failed;
+};
+
+static void LIBUSB_CALL race_cb(struct libusb_transfer *transfer)
+{
+	struct race_slot *slot = transfer->user_data;
+	struct race_thread *rt = slot->owner;
+
+	if (transfer->status != LIBUSB_TRANSFER_COMPLETED &&
+	    transfer->status != LIBUSB_TRANSFER_CANCELLED)
+		atomic_fetch_add(&rt->bad_status, 1);
+	if (atomic_exchange(&slot->in_flight, 0) != 1)
+		atomic_fetch_add(&rt->twice, 1);
+	atomic_fetch_add(&rt->callbacks, 1);
+}
+
+static void *race_thread_main(void *arg)
+{
+	struct race_thread *rt = arg;
+	unsigned int seed = (unsigned int)(uintptr_t)rt;
+	int i, r;
+
+	for (i = 0; i < RACE_TRANSFERS; i++) {
+		rt->slots[i].owner = rt;
+		rt->slots[i].transfer = alloc_bulk(rt->handle, race_cb, &rt->slots[i]);
+		if (!rt->slots[i].transfer) {
+			rt->failed = 1;
+			goto out;
+		}
+	}
+
+	/* submit every idle transfer and cancel some of them at once, which
+	 * races with the loopback thread completing them */
+	for (int round = 0; round < RACE_ROUNDS && !rt->failed; round++) {
+		struct timeval tv = { 0, 100 };
+
+		for (i = 0; i < RACE_TRANSFERS; i++) {
+			struct race_slot *slot = &rt->slots[i];
+
+			if (atomic_load(&slot->in_flight))
+				continue;
+
+			atomic_store(&slot->in_flight, 1);
+			r = libusb_submit_transfer(slot->transfer);
+			if (r != LIBUSB_SUCCESS) {
+				libusb_testlib_logf("Failed to submit: %d", r);
+				atomic_store(&slot->in_flight, 0);
+				rt->failed = 1;
+				break;
+			}
+			rt->submitted++;
+
+			if (rand_r(&seed) % 2)
+				continue;
+			r = libusb_cancel_transfer(slot->transfer);
+			if (r == LIBUSB_SUCCESS)
+				rt->cancelled++;
+			else if (r != LIBUSB_ERROR_NOT_FOUND)
+				rt->failed = 1;
+
+			/* a transfer is only cancelled once */
+			r = libusb_cancel_transfer(slot->transfer);
+			if (r != LIBUSB_ERROR_NOT_FOUND)
+				rt->failed = 1;
+		}
+		libusb_handle_events_timeout_completed(rt->ctx, &tv, NULL);
+	}
+
+	if (wait_for_count(rt->ctx, &rt->callbacks, rt->submitted))
+		rt->failed = 1;
+
+out:
+	for (i = 0; i < RACE_TRANSFERS; i++)
+		libusb_free_transfer(rt->slots[i].transfer);
+	return NULL;
+}
+
+/** Tests that transfers being cancelled while they complete, from several
+ * threads, get exactly one callback each. */
+static libusb_testlib_result test_cancel_races(void)
+{
+	struct race_thread threads[RACE_THREADS];
+	libusb_testlib_result result = TEST_STATUS_SUCCESS;
+	struct event_thread et;
+	struct fixture f;
+	int i;
+
+	if (fixture_open(&f, "50") != TEST_STATUS_SUCCESS)
+		return TEST_STATUS_FAILURE;
+	if (event_thread_start(&et, f.ctx)) {
+		fixture_close(&f);
+		return TEST_STATUS_ERROR;
+	}
+
+	memset(threads, 0, sizeof(threads));
+	for (i = 0; i < RACE_THREADS; i++) {
+		threads[i].ctx = f.ctx;
+		threads[i].handle = f.handle;
+		if (pthread_create(&threads[i].thread, NULL, race_thread_main, &threads[i])) {
+			libusb_testlib_logf("Failed to create thread %d", i);
+			result = TEST_STATUS_ERROR;
+			break;
+		}
+	}
+
+	while (i-- > 0) {
+		struct race_thread *rt = &threads[i];
+
+		pthread_join(rt->thread, NULL);
+		libusb_testlib_logf("Thread %d: %d submitted, %d cancelled, %d callbacks",
+			i, rt->submitted, rt->cancelled, atomic_load(&rt->callbacks));
+		if (rt->failed || atomic_load(&rt->twice) || atomic_load(&rt->bad_status) ||
+		    atomic_load(&rt->callbacks) != rt->submitted) {
+			libusb_testlib_logf("Thread %d: %d callbacks twice, %d failed transfers",
+				i, atomic_load(&rt->twice), atomic_load(&rt->bad_status));
+			result = TEST_STATUS_FAILURE;
+		}
+	}
+
+	event_thread_stop(&et);
+	fixture_close(&f);
+	return result;
+}
+
+#define DISCONNECT_ROUNDS	5
+#define DISCONNECT_TRANSFERS	200
+#define DISCONNECT_OTHERS	10
+
+struct disconnect_state {
+	atomic_int no_device;
+	atomic_int cancelled;
+	atomic_int other_status;
+	atomic_int resubmitted;
+};
+
+static void LIBUSB_CALL disconnect_cb(struct libusb_transfer *transfer)
+{
+	struct disconnect_state *ds = transfer->user_data;
+
+	if (transfer->status == LIBUSB_TRANSFER_NO_DEVICE) {
+		/* the device is gone, so this must fail */
+		if (libusb_submit_transfer(transfer) != LIBUSB_ERROR_NO_DEVICE)
+			atomic_fetch_add(&ds->resubmitted, 1);
+		atomic_fetch_add(&ds->no_device, 1);
+	} else if (transfer->status == LIBUSB_TRANSFER_CANCELLED) {
+		atomic_fetch_add(&ds->cancelled, 1);
+	} else {
+		atomic_fetch_add(&ds->other_status, 1);
+	}
+}
+
+static int submit_all(struct libusb_transfer **transfers, int count)
+{
+	int r, error;
+
+	r = libusb_submit_transfers(transfers, count, &error);
+	if (r != count) {
+		libusb_testlib_logf("Submitted %d of %d transfers, error %d", r, count, error);
+		return -1;
+	}
+
+	return 0;
+}
+
+/** Tests that a disconnect completes all the transfers in flight on the
+ * handle, more than are collected in one pass, and none of the others. */
+static libusb_testlib_result test_disconnect(void)
+{
+	libusb_testlib_result result = TEST_STATUS_SUCCESS;
+	struct libusb_transfer *transfers[DISCONNECT_TRANSFERS] = { NULL };
+	struct libusb_transfer *others[DISCONNECT_OTHERS] = { NULL };
+	struct disconnect_state ds, other_ds;
+	struct event_thread et;
+	struct fixture f;
+	int i, r;
+
+	/* nothing completes by itself during the test */
+	if (fixture_open(&f, "10000000") != TEST_STATUS_SUCCESS)
+		return TEST_STATUS_FAILURE;
+	if (event_thread_start(&et, f.ctx)) {
+		fixture_close(&f);
+		return TEST_STATUS_ERROR;
+	}
+
+	memset(&other_ds, 0, sizeof(other_ds));
+	for (i = 0; i < DISCONNECT_OTHERS; i++) {
+		others[i] = alloc_bulk(f.handle, disconnect_cb, &other_ds);
+		if (!others[i])
+			result = TEST_STATUS_ERROR;
+	}
+	if (result != TEST_STATUS_SUCCESS || submit_all(others, DISCONNECT_OTHERS)) {
+		if (result == TEST_STATUS_SUCCESS)
+			result = TEST_STATUS_FAILURE;
+		goto out;
+	}
+
+	for (int round = 0; round < DISCONNECT_ROUNDS && result == TEST_STATUS_SUCCESS; round++) {
+		libusb_device_handle *handle;
+		struct libusb_transfer *transfer;
+
+		r = libusb_open(libusb_get_device(f.handle), &handle);
+		if (r != LIBUSB_SUCCESS) {
+			libusb_testlib_logf("Failed to open: %d", r);
+			result = TEST_STATUS_FAILURE;
+			break;
+		}
+
+		memset(&ds, 0, sizeof(ds));
+		for (i = 0; i < DISCONNECT_TRANSFERS; i++) {
+			transfers[i] = alloc_bulk(handle, disconnect_cb, &ds);
+			if (!transfers[i])
+				result = TEST_STATUS_ERROR;
+		}
+
+		if (result == TEST_STATUS_SUCCESS &&
+		    submit_all(transfers, DISCONNECT_TRANSFERS) == 0) {
+			r = libusb_control_transfer(handle,
+				LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE,
+				LOOPBACK_REQUEST_DISCONNECT, 0, 0, NULL, 0, 1000);
+			if (r != 0) {
+				libusb_testlib_logf("Failed to disconnect: %d", r);
+				result = TEST_STATUS_FAILURE;
+			} else if (wait_for_count(f.ctx, &ds.no_device, DISCONNECT_TRANSFERS)) {
+				result = TEST_STATUS_FAILURE;
+			}
+		} else if (result == TEST_STATUS_SUCCESS) {
+			result = TEST_STATUS_FAILURE;
+		}
+
+		/* the handle stays disconnected */
+		transfer = transfers[0];
+		if (result == TEST_STATUS_SUCCESS &&
+		    libusb_submit_transfer(transfer) != LIBUSB_ERROR_NO_DEVICE) {
+			libusb_testlib_logf("Submitted a transfer after the disconnect");
+			result = TEST_STATUS_FAILURE;
+		}
+		if (atomic_load(&ds.resubmitted) || atomic_load(&ds.cancelled) ||
+		    atomic_load(&ds.other_status)) {
+			libusb_testlib_logf("%d resubmitted, %d cancelled, %d with another status",
+				atomic_load(&ds.resubmitted), atomic_load(&ds.cancelled),
+				atomic_load(&ds.other_status));
+			result = TEST_STATUS_FAILURE;
+		}
+
+		free_transfers(transfers, DISCONNECT_TRANSFERS);
+		libusb_close(handle);
+	}
+
+	/* the transfers of the other handle were left alone */
+	if (atomic_load(&other_ds.no_device) || atomic_load(&other_ds.other_status)) {
+		libusb_testlib_logf("%d transfers of another handle completed",
+			atomic_load(&other_ds.no_device) + atomic_load(&other_ds.other_status));
+		result = TEST_STATUS_FAILURE;
+	}
+	for (i = 0; i < DISCONNECT_OTHERS; i++)
+		libusb_cancel_transfer(others[i]);
+	if (wait_for_count(f.ctx, &other_ds.cancelled, DISCONNECT_OTHERS))
+		result = TEST_STATUS_FAILURE;
+
+out:
+	event_thread_stop(&et);
+	free_transfers(others, DISCONNECT_OTHERS);
+	fixture_close(&f);
+	return result;
+}
+
+#define CAPTURE_THREADS		4
+#define CAPTURE_TRANSFERS	8
+#define CAPTURE_COMPLETIONS	3000
+#define CAPTURE_RECORDS		256
+#define CAPTURE_SNAPLEN		128
+#define CAPTURE_UNIT		64
+
+/* Each thread transfers CAPTURE_UNIT * n bytes, where n is its number from
+ * 1, and its buffers are filled with n. The loopback device leaves IN
+ * buffers untouched, so that is what the completion records hold. */
+struct capture_thread {
+	pthread_t thread;
+	libusb_context *ctx;
+	libusb_device_handle *handle;
+	int number;
+	atomic_int completed;
+	int submitted;
+	int failed;
+};
+
+static void LIBUSB_CALL capture_cb(struct libusb_transfer *transfer)
+{
+	struct capture_thread *ct = transfer->user_data;
+
+	if (transfer->status != LIBUSB_TRANSFER_COMPLETED)
+		ct->failed = 1;
+	if (ct->submitted < CAPTURE_COMPLETIONS) {
+		ct->submitted++;
+		if (libusb_submit_transfer(transfer))
+			ct->failed = 1;
+	}
+	atomic_fetch_add(&ct->completed, 1);
+}
+
+static void *capture_thread_main(void *arg)
+{
+	struct capture_thread *ct = arg;
+	struct libusb_transfer *transfers[CAPTURE_TRANSFERS] = { NULL };
+	int i, r;
+
+	for (i = 0; i < CAPTURE_TRANSFERS; i++) {
+		transfers[i] = alloc_bulk(ct->handle, capture_cb, ct);
+		if (!transfers[i]) {
+			ct->failed = 1;
+			goto out;
+		}
+		transfers[i]->length = CAPTURE_UNIT * ct->number;
+		memset(transfers[i]->buffer, ct->number, (size_t)transfers[i]->length);
+	}
+
+	ct->submitted = CAPTURE_TRANSFERS;
+	r = libusb_submit_transfers(transfers, CAPTURE_TRANSFERS, NULL);
+	if (r != CAPTURE_TRANSFERS) {
+		libusb_testlib_logf("Failed to submit: %d", r);
+		ct->failed = 1;
+	} else {
+		uint64_t deadline = now_ms() + WAIT_TIMEOUT_MS;
+
+		while (atomic_load(&ct->completed) < CAPTURE_COMPLETIONS && now_ms() < deadline) {
+			struct timespec delay = { 0, 1000000 };
+
+			nanosleep(&delay, NULL);
+		}
+		if (atomic_load(&ct->completed) < CAPTURE_COMPLETIONS)
+			ct->failed = 1;
+	}
+
+out:
+	free_transfers(transfers, CAPTURE_TRANSFERS);
+	return NULL;
+}
+
+struct capture_reader {
+	pthread_t thread;
+	const unsigned char *map;
+	size_t record_size;
+	atomic_int *stop;
+	int copied;
+	int torn;
+	int invalid;
+};
+
+/* Check a record copied out of the capture file, returns 0 if it is one
+ * that the capture threads can have made */
+static int capture_check(const struct libusb_capture_record *record,
+	uint64_t sequence, unsigned int slot)
+{
+	int n = record->length / CAPTURE_UNIT;
+	uint32_t expected;
+
+	if (record->sequence != sequence ||
+	    ((sequence - 1) & (CAPTURE_RECORDS - 1)) != slot ||
+	    record->endpoint != BULK_IN || record->type != LIBUSB_TRANSFER_TYPE_BULK ||
+	    n < 1 || n > CAPTURE_THREADS || record->length != n * CAPTURE_UNIT)
+		return -1;
+
+	if (record->event == LIBUSB_CAPTURE_SUBMIT)
+		return record->data_length ? -1 : 0;
+	if (record->event != LIBUSB_CAPTURE_COMPLETE ||
+	    record->status != LIBUSB_TRANSFER_COMPLETED)
+		return -1;
+
+	expected = (uint32_t)(record->length < CAPTURE_SNAPLEN ? record->length : CAPTURE_SNAPLEN);
+	if (record->data_length != expected)
+		return -1;
+	for (uint32_t i = 0; i < record->data_length; i++) {
+		if (record->data[i] != n)
+			return -1;
+	}
+
+	return 0;
+}
+
+/* Copy the slots of the capture file over and over like a reader in another
+ * process would, keeping a copy only if the sequence did not change */
+static void *capture_reader_main(void *arg)
+{
+	struct capture_reader *cr = arg;
+	struct libusb_capture_record *record = malloc(cr->record_size);
+
+	if (!record) {
+		cr->invalid++;
+		return NULL;
+	}
+
+	while (!atomic_load(cr->stop)) {
+		for (unsigned int slot = 0; slot < CAPTURE_RECORDS; slot++) {
+			const volatile uint64_t *sequence = (const volatile uint64_t *)(const void *)
+				(cr->map + slot * cr->record_size);
+			uint64_t before, after;
+
+			before = *sequence;
+			if (!before)
+				continue;
+			atomic_thread_fence(memory_order_acquire);
+			memcpy(record, cr->map + slot * cr->record_size, cr->record_size);
+			atomic_thread_fence(memory_order_acquire);
+			after = *sequence;
+			if (before != after) {
+				cr->torn++;
+				continue;
+			}
+
+			cr->copied++;
+			if (capture_check(record, before, slot))
+				cr->invalid++;
+		}
+	}
+
+	free(record);
+	return NULL;
+}
+
+/** Tests that the records of a capture file read while several threads
+ * transfer are consistent, and that the capture can be written out
+ * meanwhile. */
+static libusb_testlib_result test_capture(void)
+{
+	struct capture_thread threads[CAPTURE_THREADS];
+	libusb_testlib_result result = TEST_STATUS_SUCCESS;
+	struct capture_reader reader;
+	char path[64], pcap_path[64];
+	struct event_thread et;
+	struct fixture f;
+	struct stat st;
+	atomic_int stop;
+	void *map = MAP_FAILED;
+	size_t map_len;
+	int i, r, fd;
+
+	if (fixture_open(&f, NULL) != TEST_STATUS_SUCCESS)
+		return TEST_STATUS_FAILURE;
+
+	snprintf(path, sizeof(path), "/tmp/libusb-capture-%d", (int)getpid());
+	snprintf(pcap_path, sizeof(pcap_path), "/tmp/libusb-capture-%d.pcap", (int)getpid());
+	r = libusb_capture_start(f.ctx, path, CAPTURE_RECORDS, CAPTURE_SNAPLEN);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf("Failed to start the capture: %d", r);
+		fixture_close(&f);
+		return TEST_STATUS_FAILURE;
+	}
+
+	/* the header and the data rounded up to 8 bytes, which is what every
+	 * record_size in the file is */
+	memset(&reader, 0, sizeof(reader));
+	reader.record_size = (sizeof(struct libusb_capture_record) + CAPTURE_SNAPLEN + 7) & ~(size_t)7;
+	map_len = reader.record_size * CAPTURE_RECORDS;
+	fd = open(path, O_RDONLY);
+	if (fd >= 0) {
+		if (fstat(fd, &st) == 0 && (size_t)st.st_size == map_len)
+			map = mmap(NULL, map_len, PROT_READ, MAP_SHARED, fd, 0);
+		close(fd);
+	}
+	if (map == MAP_FAILED) {
+		libusb_testlib_logf("Failed to map the capture file");
+		result = TEST_STATUS_FAILURE;
+		goto out_capture;
+	}
+	reader.map = map;
+
+	atomic_init(&stop, 0);
+	reader.stop = &stop;
+	if (event_thread_start(&et, f.ctx)) {
+		result = TEST_STATUS_ERROR;
+		goto out_map;
+	}
+	if (pthread_create(&reader.thread, NULL, capture_reader_main, &reader)) {
+		result = TEST_STATUS_ERROR;
+		goto out_events;
+	}
+
+	memset(threads, 0, sizeof(threads));
+	for (i = 0; i < CAPTURE_THREADS; i++) {
+		threads[i].ctx = f.ctx;
+		threads[i].handle = f.handle;
+		threads[i].number = i + 1;
+		if (pthread_create(&threads[i].thread, NULL, capture_thread_main, &threads[i])) {
+			libusb_testlib_logf("Failed to create thread %d", i);
+			result = TEST_STATUS_ERROR;
+			break;
+		}
+	}
+
+	/* written out while records are being made */
+	for (int n = 0; n < 10; n++) {
+		r = libusb_capture_write_pcap(f.ctx, pcap_path);
+		if (r != LIBUSB_SUCCESS) {
+			libusb_testlib_logf("Failed to write the pcap file: %d", r);
+			result = TEST_STATUS_FAILURE;
+		}
+	}
+
+	while (i-- > 0) {
+		pthread_join(threads[i].thread, NULL);
+		if (threads[i].failed)
+			result = TEST_STATUS_FAILURE;
+	}
+
+	atomic_store(&stop, 1);
+	pthread_join(reader.thread, NULL);
+	libusb_testlib_logf("%d records copied, %d torn, %d invalid",
+		reader.copied, reader.torn, reader.invalid);
+	if (!reader.copied || reader.invalid)
+		result = TEST_STATUS_FAILURE;
+
+	/* the global header and at least one record */
+	if (stat(pcap_path, &st) || st.st_size <= 24) {
+		libusb_testlib_logf("The pcap file is missing or empty");
+		result = TEST_STATUS_FAILURE;
+	}
+
+out_events:
+	event_thread_stop(&et);
+out_map:
+	munmap(map, map_len);
+out_capture:
+	libusb_capture_stop(f.ctx);
+	unlink(path);
+	unlink(pcap_path);
+	fixture_close(&f);
+	return result;
+}
+
+#define PRIORITY_BULK		32
+#define PRIORITY_ROUNDS		200
+
+struct priority_state {
+	int order[PRIORITY_BULK + 1];
+	int count;
+};
+
+static void LIBUSB_CALL priority_order_cb(struct libusb_transfer *transfer)
+{
+	struct priority_state *ps = transfer->user_data;
+
+	if (ps->count <= PRIORITY_BULK)
+		ps->order[ps->count] = transfer->endpoint;
+	ps->count++;
+}
+
+/** Tests that a high priority completion is dispatched ahead of the bulk
+ * completions handled in the same iteration, even though it came last. */
+static libusb_testlib_result test_priority_order(void)
+{
+	libusb_testlib_result result = TEST_STATUS_SUCCESS;
+	struct libusb_transfer *transfers[PRIORITY_BULK + 1] = { NULL };
+	struct priority_state ps;
+	struct fixture f;
+	int i;
+
+	/* without latency, all the transfers have completed by the time
+	 * events are handled */
+	if (fixture_open(&f, NULL) != TEST_STATUS_SUCCESS)
+		return TEST_STATUS_FAILURE;
+
+	for (i = 0; i <= PRIORITY_BULK; i++) {
+		transfers[i] = alloc_bulk(f.handle, priority_order_cb, &ps);
+		if (!transfers[i]) {
+			result = TEST_STATUS_ERROR;
+			goto out;
+		}
+	}
+	libusb_fill_interrupt_transfer(transfers[PRIORITY_BULK], f.handle, INTERRUPT_IN,
+		transfers[PRIORITY_BULK]->buffer, INTERRUPT_LENGTH, priority_order_cb, &ps, 0);
+	transfers[PRIORITY_BULK]->flags |= LIBUSB_TRANSFER_HIGH_PRIORITY;
+
+	for (int round = 0; round < PRIORITY_ROUNDS && result == TEST_STATUS_SUCCESS; round++) {
+		memset(&ps, 0, sizeof(ps));
+		for (i = 0; i <= PRIORITY_BULK; i++) {
+			if (libusb_submit_transfer(transfers[i]) != LIBUSB_SUCCESS) {
+				result = TEST_STATUS_FAILURE;
+				break;
+			}
+		}
+
+		while (ps.count < i && result == TEST_STATUS_SUCCESS) {
+			if (libusb_handle_events(f.ctx) != LIBUSB_SUCCESS)
+				result = TEST_STATUS_FAILURE;
+		}
+
+		if (result == TEST_STATUS_SUCCESS && ps.order[0] != INTERRUPT_IN) {
+			for (i = 1; i <= PRIORITY_BULK && ps.order[i] != INTERRUPT_IN; i++)
+				;
+			libusb_testlib_logf("Round %d: the high priority transfer came back after %d others",
+				round, i);
+			result = TEST_STATUS_FAILURE;
+		}
+	}
+
+out:
+	free_transfers(transfers, PRIORITY_BULK + 1);
+	fixture_close(&f);
+	return result;
+}
+
+#define PRIORITY_REQUESTS	500
+
+struct priority_load {
+	atomic_int stop;
+	atomic_int bulk_completed;
+	atomic_int bulk_retired;
+	atomic_int failed;
+};
+
+static void LIBUSB_CALL priority_bulk_cb(struct libusb_transfer *transfer)
+{
+	struct priority_load *pl = transfer->user_data;
+
+	if (transfer->status != LIBUSB_TRANSFER_COMPLETED)
+		atomic_fetch_add(&pl->failed, 1);
+	atomic_fetch_add(&pl->bulk_completed, 1);
+	if (atomic_load(&pl->stop) || libusb_submit_transfer(transfer))
+		atomic_fetch_add(&pl->bulk_retired, 1);
+}
+
+/** Tests high priority transfers going back and forth from one thread while
+ * bulk transfers stream on, handled by two other threads. */
+static libusb_testlib_result test_priority_load(void)
+{
+	libusb_testlib_result result = TEST_STATUS_SUCCESS;
+	struct libusb_transfer *bulk[PRIORITY_BULK] = { NULL };
+	struct libusb_transfer *request;
+	struct priority_load pl;
+	struct counter counter = { 0 };
+	struct event_thread et;
+	struct fixture f;
+	int i, before;
+
+	if (fixture_open(&f, "100") != TEST_STATUS_SUCCESS)
+		return TEST_STATUS_FAILURE;
+
+	memset(&pl, 0, sizeof(pl));
+	request = alloc_bulk(f.handle, count_cb, &counter);
+	if (!request) {
+		fixture_close(&f);
+		return TEST_STATUS_ERROR;
+	}
+	libusb_fill_interrupt_transfer(request, f.handle, INTERRUPT_IN, request->buffer,
+		INTERRUPT_LENGTH, count_cb, &counter, 0);
+	request->flags |= LIBUSB_TRANSFER_HIGH_PRIORITY;
+
+	for (i = 0; i < PRIORITY_BULK; i++) {
+		bulk[i] = alloc_bulk(f.handle, priority_bulk_cb, &pl);
+		if (!bulk[i]) {
+			result = TEST_STATUS_ERROR;
+			goto out;
+		}
+	}
+	if (event_thread_start(&et, f.ctx)) {
+		result = TEST_STATUS_ERROR;
+		goto out;
+	}
+
+	if (submit_all(bulk, PRIORITY_BULK)) {
+		event_thread_stop(&et);
+		result = TEST_STATUS_FAILURE;
+		goto out;
+	}
+
+	/* one high priority request at a time, each resubmitted once the
+	 * previous one is back */
+	for (i = 1; i <= PRIORITY_REQUESTS && result == TEST_STATUS_SUCCESS; i++) {
+		if (libusb_submit_transfer(request) != LIBUSB_SUCCESS ||
+		    wait_for_count(f.ctx, &counter.completed, i))
+			result = TEST_STATUS_FAILURE;
+	}
+
+	/* the bulk callbacks are not held back once no high priority transfer
+	 * is in flight */
+	before = atomic_load(&pl.bulk_completed);
+	if (result == TEST_STATUS_SUCCESS &&
+	    wait_for_count(f.ctx, &pl.bulk_completed, before + PRIORITY_BULK))
+		result = TEST_STATUS_FAILURE;
+
+	atomic_store(&pl.stop, 1);
+	if (wait_for_count(f.ctx, &pl.bulk_retired, PRIORITY_BULK) ||
+	    atomic_load(&pl.failed) || atomic_load(&counter.failed))
+		result = TEST_STATUS_FAILURE;
+
+	event_thread_stop(&et);
+out:
+	free_transfers(bulk, PRIORITY_BULK);
+	libusb_free_transfer(request);
+	fixture_close(&f);
+	return result;
+}
+
+/* Tell whether config still reads as the configuration of the loopback
+ * device, walking it down to its endpoints. */
+static int config_is_loopback(const struct libusb_config_descriptor *config)
+{
+	const struct libusb_interface_descriptor *altsetting;
+	int i;
+
+	if (config->bNumInterfaces != 1 || config->interface[0].num_altsetting < 1)
+		return 0;
+
+	altsetting = &config->interface[0].altsetting[0];
+	for (i = 0; i < altsetting->bNumEndpoints; i++) {
+		if (altsetting->endpoint[i].bEndpointAddress == BULK_IN)
+			return altsetting->endpoint[i].wMaxPacketSize == BULK_LENGTH;
+	}
+
+	return 0;
+}
+
+/** Tests that the devices of two contexts, which have identical
+ * descriptors, share the configuration parsed for them, and that it lives
+ * exactly as long as its last user, even while the raw descriptor it was
+ * parsed from is still held by a device. The test marks the shared
+ * descriptor by writing to it, which applications must not do, to tell
+ * whether a later call returns the same object or parses a new one, since a
+ * new one may be allocated at the same address. */
+static libusb_testlib_result test_config_sharing(void)
+{
+	libusb_testlib_result result = TEST_STATUS_FAILURE;
+	struct libusb_config_descriptor *first, *second, *active, *held = NULL;
+	struct fixture f1, f2 = { NULL, NULL };
+	uint8_t value, mark;
+
+	if (fixture_open(&f1, NULL) != TEST_STATUS_SUCCESS)
+		return TEST_STATUS_FAILURE;
+	if (fixture_open(&f2, NULL) != TEST_STATUS_SUCCESS) {
+		fixture_close(&f1);
+		return TEST_STATUS_FAILURE;
+	}
+
+	if (libusb_get_config_descriptor(libusb_get_device(f1.handle), 0, &first)) {
+		libusb_testlib_logf("Failed to get the configuration descriptor");
+		goto out;
+	}
+	if (libusb_get_config_descriptor(libusb_get_device(f2.handle), 0, &second)) {
+		libusb_testlib_logf("Failed to get the configuration descriptor");
+		libusb_free_config_descriptor(first);
+		goto out;
+	}
+	if (libusb_get_active_config_descriptor(libusb_get_device(f1.handle), &active)) {
+		libusb_testlib_logf("Failed to get the active configuration descriptor");
+		libusb_free_config_descriptor(first);
+		libusb_free_config_descriptor(second);
+		goto out;
+	}
+
+	if (first != second || first != active || !config_is_loopback(first)) {
+		libusb_testlib_logf("Identical configurations are not shared");
+		libusb_free_config_descriptor(first);
+		libusb_free_config_descriptor(second);
+		libusb_free_config_descriptor(active);
+		goto out;
+	}
+
+	value = first->iConfiguration;
+	mark = (uint8_t)~value;
+	first->iConfiguration = mark;
+	libusb_free_config_descriptor(first);
+	libusb_free_config_descriptor(second);
+	libusb_free_config_descriptor(active);
+
+	/* the devices still cache the descriptor freed by all of its callers */
+	if (libusb_get_config_descriptor(libusb_get_device(f2.handle), 0, &held)) {
+		libusb_testlib_logf("Failed to get the configuration descriptor");
+		goto out;
+	}
+	if (held != first || held->iConfiguration != mark) {
+		libusb_testlib_logf("The cached configuration was released");
+		goto out;
+	}
+
+	/* held is the last user once both devices are gone */
+	fixture_close(&f2);
+	f2.ctx = NULL;
+	if (!config_is_loopback(held)) {
+		libusb_testlib_logf("The configuration did not survive its device");
+		goto out;
+	}
+	fixture_close(&f1);
+	f1.ctx = NULL;
+	if (!config_is_loopback(held) || held->iConfiguration != mark) {
+		libusb_testlib_logf("The configuration did not survive its devices");
+		goto out;
+	}
+	libusb_free_config_descriptor(held);
+	held = NULL;
+
+	/* it is gone with its last user, so it is parsed again */
+	if (fixture_open(&f1, NULL) != TEST_STATUS_SUCCESS) {
+		f1.ctx = NULL;
+		goto out;
+	}
+	if (fixture_open(&f2, NULL) != TEST_STATUS_SUCCESS) {
+		f2.ctx = NULL;
+		goto out;
+	}
+	if (libusb_get_config_descriptor(libusb_get_device(f2.handle), 0, &held)) {
+		libusb_testlib_logf("Failed to get the configuration descriptor");
+		goto out;
+	}
+	if (held->iConfiguration != value || !config_is_loopback(held)) {
+		libusb_testlib_logf("A released configuration was reused");
+		goto out;
+	}
+
+	/* the device of the first context keeps the raw descriptor, but not
+	 * the configuration parsed for the second one, which is gone with it */
+	held->iConfiguration = mark;
+	libusb_free_config_descriptor(held);
+	held = NULL;
+	fixture_close(&f2);
+	f2.ctx = NULL;
+	if (libusb_get_config_descriptor(libusb_get_device(f1.handle), 0, &held)) {
+		libusb_testlib_logf("Failed to get the configuration descriptor");
+		goto out;
+	}
+	if (held->iConfiguration != value || !config_is_loopback(held)) {
+		libusb_testlib_logf("A released configuration was reused");
+		goto out;
+	}
+
+	result = TEST_STATUS_SUCCESS;
+out:
+	libusb_free_config_descriptor(held);
+	if (f2.ctx)
+		fixture_close(&f2);
+	if (f1.ctx)
+		fixture_close(&f1);
+	return result;
+}
+
+/* Send one of the LOOPBACK_REQUEST_* vendor requests */
+static int vendor_request(libusb_device_handle *handle, uint8_t request)
+{
+	return libusb_control_transfer(handle,
+		LIBUSB_ENDPOINT_OUT | LIBUSB_REQUEST_TYPE_VENDOR | LIBUSB_RECIPIENT_DEVICE,
+		request, 0, 0, NULL, 0, 1000);
+}
+
+struct hotplug_counts {
+	atomic_int arrived;
+	atomic_int left;
+};
+
+struct hotplug_state {
+	libusb_hotplug_callback_handle doomed;
+	libusb_hotplug_callback_handle added;
+	libusb_hotplug_callback_handle enumerated;
+	int failed;
+
+	/* the calls of each callback */
+	struct hotplug_counts first;
+	atomic_int doomed_calls;
+	struct hotplug_counts added_calls;
+	atomic_int enumerated_calls;
+};
+
+static void hotplug_count(struct hotplug_counts *counts, libusb_hotplug_event event)
+{
+	if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED)
+		atomic_fetch_add(&counts->arrived, 1);
+	else
+		atomic_fetch_add(&counts->left, 1);
+}
+
+static int LIBUSB_CALL hotplug_count_cb(libusb_context *ctx, libusb_device *dev,
+	libusb_hotplug_event event, void *user_data)
+{
+	(void)ctx;
+	(void)dev;
+	hotplug_count(user_data, event);
+	return 0;
+}
+
+static int LIBUSB_CALL hotplug_doomed_cb(libusb_context *ctx, libusb_device *dev,
+	libusb_hotplug_event event, void *user_data)
+{
+	struct hotplug_state *hs = user_data;
+
+	(void)ctx;
+	(void)dev;
+	(void)event;
+	atomic_fetch_add(&hs->doomed_calls, 1);
+	return 0;
+}
+
+static int LIBUSB_CALL hotplug_enumerated_cb(libusb_context *ctx, libusb_device *dev,
+	libusb_hotplug_event event, void *user_data)
+{
+	struct hotplug_state *hs = user_data;
+
+	(void)ctx;
+	(void)dev;
+	(void)event;
+	atomic_fetch_add(&hs->enumerated_calls, 1);
+	return 0;
+}
+
+/* On departure, deregister the callback not called yet and register
+ * another. On arrival, register one which enumerates the devices. */
+static int LIBUSB_CALL hotplug_first_cb(libusb_context *ctx, libusb_device *dev,
+	libusb_hotplug_event event, void *user_data)
+{
+	struct hotplug_state *hs = user_data;
+	int r;
+
+	(void)dev;
+	hotplug_count(&hs->first, event);
+	if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT) {
+		libusb_hotplug_deregister_callback(ctx, hs->doomed);
+		r = libusb_hotplug_register_callback(ctx,
+			LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+			0, LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY,
+			LIBUSB_HOTPLUG_MATCH_ANY, hotplug_count_cb, &hs->added_calls,
+			&hs->added);
+	} else {
+		r = libusb_hotplug_register_callback(ctx,
+			LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED, LIBUSB_HOTPLUG_ENUMERATE,
+			LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY,
+			LIBUSB_HOTPLUG_MATCH_ANY, hotplug_enumerated_cb, hs,
+			&hs->enumerated);
+	}
+	if (r != LIBUSB_SUCCESS)
+		hs->failed = 1;
+
+	return 0;
+}
+
+/** Tests that the callbacks registered and deregistered by a hotplug
+ * callback take effect from the next event on: the device re-enumerates,
+ * and each callback is called exactly once for each event it was registered
+ * for when the event fired. The first callback matches the vendor ID and the
+ * others any device, so that the first is called before the others are.
+ * The callback registered with LIBUSB_HOTPLUG_ENUMERATE on arrival hears of
+ * the new device from the enumeration only. */
+static libusb_testlib_result test_hotplug_dispatch(void)
+{
+	libusb_testlib_result result = TEST_STATUS_FAILURE;
+	libusb_hotplug_callback_handle first;
+	struct hotplug_state hs;
+	struct fixture f;
+	int r;
+
+	if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG))
+		return TEST_STATUS_SKIP;
+	if (fixture_open(&f, NULL) != TEST_STATUS_SUCCESS)
+		return TEST_STATUS_FAILURE;
+
+	memset(&hs, 0, sizeof(hs));
+	r = libusb_hotplug_register_callback(f.ctx,
+		LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+		0, LOOPBACK_VID, LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY,
+		hotplug_first_cb, &hs, &first);
+	if (r == LIBUSB_SUCCESS)
+		r = libusb_hotplug_register_callback(f.ctx,
+			LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+			0, LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY,
+			LIBUSB_HOTPLUG_MATCH_ANY, hotplug_doomed_cb, &hs, &hs.doomed);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf("Failed to register a hotplug callback: %d", r);
+		goto out;
+	}
+
+	r = vendor_request(f.handle, LOOPBACK_REQUEST_REENUMERATE);
+	if (r != 0) {
+		libusb_testlib_logf("Failed to re-enumerate: %d", r);
+		goto out;
+	}
+	if (wait_for_count(f.ctx, &hs.first.arrived, 1))
+		goto out;
+	/* anything called twice would be by now */
+	handle_events_for(f.ctx, 100);
+
+	if (hs.failed) {
+		libusb_testlib_logf("Failed to register a hotplug callback");
+		goto out;
+	}
+	if (atomic_load(&hs.first.arrived) != 1 || atomic_load(&hs.first.left) != 1 ||
+	    atomic_load(&hs.doomed_calls) != 0 ||
+	    atomic_load(&hs.added_calls.arrived) != 1 || atomic_load(&hs.added_calls.left) != 0 ||
+	    atomic_load(&hs.enumerated_calls) != 1) {
+		libusb_testlib_logf("Calls: first %d/%d, deregistered %d, registered %d/%d, enumerating %d",
+			atomic_load(&hs.first.arrived), atomic_load(&hs.first.left),
+			atomic_load(&hs.doomed_calls),
+			atomic_load(&hs.added_calls.arrived), atomic_load(&hs.added_calls.left),
+			atomic_load(&hs.enumerated_calls));
+		goto out;
+	}
+
+	result = TEST_STATUS_SUCCESS;
+out:
+	fixture_close(&f);
+	return result;
+}
+
+/* Count the loopback devices listed by ctx, and return a reference to the
+ * last one in *dev, or NULL if there is none */
+static ssize_t list_loopback(libusb_context *ctx, libusb_device **dev)
+{
+	libusb_device **list;
+	ssize_t i, len, count = 0;
+
+	*dev = NULL;
+	len = libusb_get_device_list(ctx, &list);
+	if (len < 0)
+		return len;
+
+	for (i = 0; i < len; i++) {
+		struct libusb_device_descriptor desc;
+
+		if (libusb_get_device_descriptor(list[i], &desc) ||
+		    desc.idVendor != LOOPBACK_VID || desc.idProduct != LOOPBACK_PID)
+			continue;
+		if (*dev)
+			libusb_unref_device(*dev);
+		*dev = libusb_ref_device(list[i]);
+		count++;
+	}
+	libusb_free_device_list(list, 1);
+
+	return count;
+}
+
+struct session_state {
+	struct hotplug_counts counts;
+	libusb_device *arrived;
+	libusb_device *left;
+};
+
+static int LIBUSB_CALL session_cb(libusb_context *ctx, libusb_device *dev,
+	libusb_hotplug_event event, void *user_data)
+{
+	struct session_state *ss = user_data;
+
+	(void)ctx;
+	if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED)
+		ss->arrived = dev;
+	else
+		ss->left = dev;
+	hotplug_count(&ss->counts, event);
+	return 0;
+}
+
+/** Tests that the backend finds the device by its session ID once the
+ * device has re-enumerated, and no longer once it has been removed. The
+ * requests making the loopback device re-enumerate or leave look it up by
+ * its session ID, and stall if they do not find it. The test keeps
+ * handles open on every device, so that none of them is freed and another
+ * allocated at its address. */
+static libusb_testlib_result test_session_lookup(void)
+{
+	libusb_testlib_result result = TEST_STATUS_FAILURE;
+	libusb_device_handle *reenumerated = NULL, *removed = NULL, *stale = NULL;
+	libusb_device *dev = NULL, *old;
+	struct session_state ss;
+	struct fixture f;
+	ssize_t count;
+	int r;
+
+	if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG))
+		return TEST_STATUS_SKIP;
+	if (fixture_open(&f, NULL) != TEST_STATUS_SUCCESS)
+		return TEST_STATUS_FAILURE;
+
+	memset(&ss, 0, sizeof(ss));
+	r = libusb_hotplug_register_callback(f.ctx,
+		LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+		0, LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY,
+		LIBUSB_HOTPLUG_MATCH_ANY, session_cb, &ss, NULL);
+	if (r != LIBUSB_SUCCESS) {
+		libusb_testlib_logf("Failed to register a hotplug callback: %d", r);
+		goto out;
+	}
+
+	/* the device is replaced by a new one */
+	old = libusb_get_device(f.handle);
+	r = vendor_request(f.handle, LOOPBACK_REQUEST_REENUMERATE);
+	if (r != 0) {
+		libusb_testlib_logf("Failed to re-enumerate: %d", r);
+		goto out;
+	}
+	if (wait_for_count(f.ctx, &ss.counts.arrived, 1))
+		goto out;
+	count = list_loopback(f.ctx, &dev);
+	if (ss.left != old || ss.arrived == old || count != 1 || dev != ss.arrived) {
+		libusb_testlib_logf("The device was not replaced, %zd listed", count);
+		goto out;
+	}
+
+	/* the new device is found when it re-enumerates in turn */
+	r = libusb_open(dev, &reenumerated);
+	if (r == LIBUSB_SUCCESS)
+		r = vendor_request(reenumerated, LOOPBACK_REQUEST_REENUMERATE);
+	if (r != 0) {
+		libusb_testlib_logf("Failed to re-enumerate the new device: %d", r);
+		goto out;
+	}
+	if (wait_for_count(f.ctx, &ss.counts.arrived, 2))
+		goto out;
+	old = dev;
+	libusb_unref_device(dev);
+	count = list_loopback(f.ctx, &dev);
+	if (ss.left != old || count != 1 || dev != ss.arrived) {
+		libusb_testlib_logf("The new device was not replaced, %zd listed", count);
+		goto out;
+	}
+
+	/* once removed, the device is found neither by the context nor by the
+	 * requests sent on another of its handles */
+	r = libusb_open(dev, &removed);
+	if (r == LIBUSB_SUCCESS)
+		r = libusb_open(dev, &stale);
+	if (r == LIBUSB_SUCCESS)
+		r = vendor_request(removed, LOOPBACK_REQUEST_REMOVE);
+	if (r != 0) {
+		libusb_testlib_logf("Failed to remove the device: %d", r);
+		goto out;
+	}
+	if (wait_for_count(f.ctx, &ss.counts.left, 3))
+		goto out;
+	old = dev;
+	libusb_unref_device(dev);
+	count = list_loopback(f.ctx, &dev);
+	if (ss.left != old || count != 0) {
+		libusb_testlib_logf("The device was not removed, %zd listed", count);
+		goto out;
+	}
+	if (vendor_request(stale, LOOPBACK_REQUEST_REENUMERATE) != LIBUSB_ERROR_PIPE ||
+	    vendor_request(stale, LOOPBACK_REQUEST_REMOVE) != LIBUSB_ERROR_PIPE) {
+		libusb_testlib_logf("The removed device was found");
+		goto out;
+	}
+	handle_events_for(f.ctx, 100);
+	if (atomic_load(&ss.counts.arrived) != 2 || atomic_load(&ss.counts.left) != 3) {
+		libusb_testlib_logf("%d arrivals and %d departures",
+			atomic_load(&ss.counts.arrived), atomic_load(&ss.counts.left));
+		goto out;
+	}
+
+	result = TEST_STATUS_SUCCESS;
+out:
+	libusb_unref_device(dev);
+	if (stale)
+		libusb_close(stale);
+	if (removed)
+		libusb_close(removed);
+	if (reenumerated)
+		libusb_close(reenumerated);
+	fixture_close(&f);
+	return result;
+}
+
+/* Fill in the list of tests. */
+static const libusb_testlib_test tests[] = {
+	{ "submit_transfers_invalid", &test_submit_transfers_invalid },
+	{ "submit_transfers_busy", &test_submit_transfers_busy },
+	{ "submit_transfers_threads", &test_submit_transfers_threads },
+	{ "completion_queue_threads", &test_completion_queue_threads },
+	{ "completion_queue_timeout", &test_completion_queue_timeout },
+	{ "event_loops", &test_event_loops },
+	{ "transfer_ring_batches", &test_transfer_ring_batches },
+	{ "stream_scheduler", &test_stream_scheduler },
+	{ "cancel_races", &test_cancel_races },
+	{ "disconnect", &test_disconnect },
+	{ "capture", &test_capture },
+	{ "priority_order", &test_priority_order },
+	{ "priority_load", &test_priority_load },
+	{ "config_sharing", &test_config_sharing },
+	{ "hotplug_dispatch", &test_hotplug_dispatch },
+	{ "session_lookup", &test_session_lookup },
+	LIBUSB_NULL_TEST
+};
+
+int main(int argc, char *argv[])
+{
+	return libusb_testlib_run_tests(argc, argv, tests);
+}
@@ -23,6 +23,7 @@
 #include <unistd.h>
 #include <string.h>
 #include <errno.h>
+#include <malloc.h>
 #include <linux/ioctl.h>
 #include <linux/usbdevice_fs.h>
 
@@ -1117,6 +1118,161 @@ test_hotplug_add_remove(UMockdevTestbedFixture * fixture, UNUSED_DATA)
 #endif
 }
 
+/* Add count devices without usbfs emulation, enough for enumerating them.
+ * Each bus gets a root hub and up to 99 devices behind it. */
+static void
+test_fixture_add_devices(UMockdevTestbedFixture * fixture, int first, int count)
+{
+	for (int i = first; i < first + count; i++) {
+		int busnum = 1 + i / 100;
+		int devnum = 1 + i % 100;
+		g_autofree gchar *path = NULL;
+		g_autofree gchar *desc = NULL;
+
+		if (devnum == 1)
+			path = g_strdup_printf("/devices/usb%d", busnum);
+		else
+			path = g_strdup_printf("/devices/usb%d/%d-%d", busnum, busnum, devnum - 1);
+
+		desc = g_strdup_printf(
+			"P: %s\n"
+			"N: bus/usb/%03d/%03d\n"
+			"E: SUBSYSTEM=usb\n"
+			"E: DRIVER=usb\n"
+			"E: BUSNUM=%03d\n"
+			"E: DEVNUM=%03d\n"
+			"E: DEVNAME=/dev/bus/usb/%03d/%03d\n"
+			"E: DEVTYPE=usb_device\n"
+			"A: bConfigurationValue=1\\n\n"
+			"A: busnum=%d\\n\n"
+			"A: devnum=%d\\n\n"
+			"A: speed=480\\n\n"
+			"H: descriptors="
+			  "1201000200000040a904c03102000102"
+			  "030109022700010100c0010904000003"
+			  "06010100070581020002000705020200"
+			  "020007058303080009\n",
+			path, busnum, devnum, busnum, devnum, busnum, devnum,
+			busnum, devnum);
+
+		umockdev_testbed_add_from_string(fixture->testbed, desc, NULL);
+	}
+}
+
+static size_t
+heap_in_use(void)
+{
+#if defined(__GLIBC__)
+#if __GLIBC_PREREQ(2, 33)
+	return mallinfo2().uordblks;
+#endif
+#endif
+	return 0;
+}
+
+static void
+test_fixture_setup_perf(UMockdevTestbedFixture * fixture, UNUSED_DATA)
+{
+	test_fixture_setup_common(fixture);
+
+	/* Logging would dominate the measurements */
+	libusb_set_log_cb (NULL, log_handler_null, LIBUSB_LOG_CB_GLOBAL);
+}
+
+static void
+test_fixture_teardown_perf(UMockdevTestbedFixture * fixture, UNUSED_DATA)
+{
+	if (fixture->ctx) {
+		libusb_exit(fixture->ctx);
+		fixture->ctx = NULL;
+	}
+
+	test_fixture_teardown(fixture, NULL);
+}
+
+static void
+test_perf_enumerate(UMockdevTestbedFixture * fixture, gconstpointer data)
+{
+	int count = GPOINTER_TO_INT(data);
+	libusb_device **devs = NULL;
+	size_t heap_before, heap_after;
+	double elapsed;
+
+	test_fixture_add_devices(fixture, 0, count);
+
+	heap_before = heap_in_use();
+	g_test_timer_start();
+	g_assert_cmpint(libusb_init_context(&fixture->ctx, /*options=*/NULL, /*num_options=*/0), ==, 0);
+	elapsed = g_test_timer_elapsed();
+	g_test_minimized_result(elapsed, "libusb_init_context() with %d devices: %.3f ms",
+	                        count, elapsed * 1e3);
+
+	g_assert_cmpint(libusb_get_device_list(fixture->ctx, &devs), ==, count);
+	libusb_free_device_list(devs, TRUE);
+	heap_after = heap_in_use();
+	if (heap_before && heap_after > heap_before)
+		g_test_minimized_result((double)(heap_after - heap_before) / count,
+		                        "heap per device with %d devices: %zu bytes",
+		                        count, (heap_after - heap_before) / count);
+
+	g_test_timer_start();
+	for (int i = 0; i < 10; i++) {
+		g_assert_cmpint(libusb_get_device_list(fixture->ctx, &devs), ==, count);
+		libusb_free_device_list(devs, TRUE);
+	}
+	elapsed = g_test_timer_elapsed() / 10;
+	g_test_minimized_result(elapsed, "libusb_get_device_list() with %d devices: %.3f ms",
+	                        count, elapsed * 1e3);
+}
+
+static void
+test_perf_hotplug(UMockdevTestbedFixture * fixture, gconstpointer data)
+{
+#ifdef UMOCKDEV_HOTPLUG
+	int count = GPOINTER_TO_INT(data);
+	libusb_hotplug_callback_handle handle;
+	int event_count = 0;
+	double elapsed = 0;
+	int r;
+
+	test_fixture_add_devices(fixture, 0, count);
+	g_assert_cmpint(libusb_init_context(&fixture->ctx, /*options=*/NULL, /*num_options=*/0), ==, 0);
+
+	r = libusb_hotplug_register_callback(fixture->ctx,
+	                                     LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED,
+	                                     0,
+	                                     LIBUSB_HOTPLUG_MATCH_ANY,
+	                                     LIBUSB_HOTPLUG_MATCH_ANY,
+	                                     LIBUSB_HOTPLUG_MATCH_ANY,
+	                                     hotplug_count_arrival_cb,
+	                                     &event_count,
+	                                     &handle);
+	g_assert_cmpint(r, ==, 0);
+
+	/* Time from the uevent until the callback ran, for a few arrivals */
+	for (int i = 0; i < 10; i++) {
+		struct timeval tv = { 0, 100000 };
+
+		g_test_timer_start();
+		test_fixture_add_devices(fixture, count + i, 1);
+		while (event_count == i) {
+			libusb_handle_events_timeout(fixture->ctx, &tv);
+			g_assert_cmpfloat(g_test_timer_elapsed(), <, 10);
+		}
+		elapsed += g_test_timer_elapsed();
+	}
+	elapsed /= 10;
+	g_test_minimized_result(elapsed, "hotplug arrival with %d devices: %.3f ms",
+	                        count, elapsed * 1e3);
+
+	libusb_hotplug_deregister_callback(fixture->ctx, handle);
+#else
+	(void) fixture;
+	(void) data;
+	g_test_skip("UMockdev is too old to test hotplug");
+#endif
+}
+
 int
 main(int argc, char **argv)
 {
@@ -1171,5 +1327,24 @@ main(int argc, char **argv)
 	           test_hotplug_add_remove,
 	           test_fixture_teardown);
 
+	/* Scaling benchmarks, run with -m perf */
+	if (g_test_perf()) {
+		static const int counts[] = { 10, 100, 1000 };
+
+		for (size_t i = 0; i < G_N_ELEMENTS(counts); i++) {
+			g_autofree gchar *enumerate = g_strdup_printf("/libusb/perf/enumerate/%d", counts[i]);
+			g_autofree gchar *hotplug = g_strdup_printf("/libusb/perf/hotplug/%d", counts[i]);
+
+			g_test_add(enumerate, UMockdevTestbedFixture, GINT_TO_POINTER(counts[i]),
+			           test_fixture_setup_perf,
+			           test_perf_enumerate,
+			           test_fixture_teardown_perf);
+			g_test_add(hotplug, UMockdevTestbedFixture, GINT_TO_POINTER(counts[i]),
+			           test_fixture_setup_perf,
+			           test_perf_hotplug,
+			           test_fixture_teardown_perf);
+		}
+	}
+
 	return g_test_run();
 }